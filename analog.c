@@ -0,0 +1,137 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "analog: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/**
+ * @file
+ *
+ * Helpers for raw analog data.
+ */
+
+/**
+ * @defgroup grp_analog_raw Raw analog data
+ *
+ * Helpers for analog samples sent as the device's integer codes.
+ *
+ * Devices whose ADC delivers 8 or 16 bit codes can send them as
+ * SR_DF_ANALOG_RAW packets, along with each probe's scale and offset,
+ * instead of converting every sample to a float. An 8 bit scope then
+ * puts a quarter of the bytes on the datafeed bus.
+ *
+ * Consumers which want the values convert the codes with
+ * sr_analog_raw_to_float(). Unless the frontend declares that all of its
+ * datafeed callbacks handle SR_DF_ANALOG_RAW (see
+ * sr_session_analog_raw_set()), the session does that for them and
+ * delivers SR_DF_ANALOG packets only.
+ *
+ * @{
+ */
+
+/**
+ * Get the size of the codes in a raw analog packet.
+ *
+ * @param raw The packet's payload. Must not be NULL.
+ *
+ * @return The size of 'data' in bytes.
+ */
+SR_API uint64_t sr_analog_raw_size(const struct sr_datafeed_analog_raw *raw)
+{
+	if (raw->num_samples <= 0 || raw->num_probes <= 0)
+		return 0;
+
+	return (uint64_t)raw->num_samples * raw->num_probes * raw->sample_size;
+}
+
+/* Convert interleaved codes of the given type with their probe's scale. */
+#define CONVERT(type) do { \
+	const type *in = raw->data; \
+	for (i = 0; i < n; i++) \
+		for (p = 0; p < num_probes; p++) \
+			*out++ = *in++ * raw->scales[p].scale \
+				 + raw->scales[p].offset; \
+} while (0)
+
+/**
+ * Convert the codes of a raw analog packet to their values.
+ *
+ * Code c of probe p stands for the value c * scales[p].scale +
+ * scales[p].offset. The values are interleaved by probe, like the codes
+ * and like the data of an SR_DF_ANALOG packet.
+ *
+ * @param raw The packet's payload. Must not be NULL.
+ * @param out Buffer for num_samples * num_probes floats. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, such as
+ *         an unsupported sample_size.
+ */
+SR_API int sr_analog_raw_to_float(const struct sr_datafeed_analog_raw *raw,
+		float *out)
+{
+	int i, n, p, num_probes;
+
+	if (!raw || !out) {
+		sr_err("%s: raw and out may not be NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	n = raw->num_samples;
+	num_probes = raw->num_probes;
+	if (n <= 0 || num_probes <= 0)
+		return SR_OK;
+
+	if (!raw->scales || !raw->data) {
+		sr_err("%s: packet has no scales or data", __func__);
+		return SR_ERR_ARG;
+	}
+
+	switch (raw->sample_size) {
+	case 1:
+		if (raw->is_signed)
+			CONVERT(int8_t);
+		else
+			CONVERT(uint8_t);
+		break;
+	case 2:
+		if (raw->is_signed)
+			CONVERT(int16_t);
+		else
+			CONVERT(uint16_t);
+		break;
+	case 4:
+		if (raw->is_signed)
+			CONVERT(int32_t);
+		else
+			CONVERT(uint32_t);
+		break;
+	default:
+		sr_err("%s: unsupported sample size %d", __func__,
+		       raw->sample_size);
+		return SR_ERR_ARG;
+	}
+
+	return SR_OK;
+}
+
+/** @} */
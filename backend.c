@@ -114,6 +114,7 @@
  * @{
  */
 
+#ifndef SKIP_DRIVER_CHECKS
 /**
  * Sanity-check all libsigrok drivers.
  *
@@ -202,12 +203,17 @@ static int sanity_check_all_drivers(void)
 
 	return ret;
 }
+#endif
 
 /**
  * Initialize libsigrok.
  *
  * This function must be called before any other libsigrok function.
  *
+ * Drivers are not initialized here. Each one is initialized on its first
+ * scan, or explicitly by sr_driver_init(), so only drivers actually used
+ * cost anything.
+ *
  * @param ctx Pointer to a libsigrok context struct pointer. Must not be NULL.
  *            This will be a pointer to a newly allocated libsigrok context
  *            object upon success, and is undefined upon errors.
@@ -227,10 +233,12 @@ SR_API int sr_init(struct sr_context **ctx)
 		return SR_ERR;
 	}
 
+#ifndef SKIP_DRIVER_CHECKS
 	if (sanity_check_all_drivers() < 0) {
 		sr_err("Internal driver error(s), aborting.");
 		return ret;
 	}
+#endif
 
 	/* + 1 to handle when struct sr_context has no members. */
 	context = g_try_malloc0(sizeof(struct sr_context) + 1);
@@ -249,6 +257,9 @@ SR_API int sr_init(struct sr_context **ctx)
 	}
 #endif
 
+	/* Drivers are initialized with this context on first use. */
+	sr_hw_context_set(context);
+
 	*ctx = context;
 	context = NULL;
 	ret = SR_OK;
@@ -273,12 +284,16 @@ SR_API int sr_exit(struct sr_context *ctx)
 		return SR_ERR;
 	}
 
+	sr_hotplug_disable(ctx);
 	sr_hw_cleanup_all();
+	sr_hw_context_unset(ctx);
 
 #ifdef HAVE_LIBUSB_1_0
 	libusb_exit(ctx->libusb_ctx);
 #endif
 
+	sr_pool_flush();
+
 	g_free(ctx);
 
 	return SR_OK;
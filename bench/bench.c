@@ -0,0 +1,555 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of libsigrok's hot paths, run with 'make bench'.
+ *
+ * Every benchmark repeats its operation for at least the minimum time,
+ * then prints one tab separated line:
+ *
+ *   name  bytes  samples  seconds  MB/s  samples/s
+ *
+ * where MB are 10^6 bytes of input. Lines starting with '#' are comments.
+ * The benchmarks which need a device use the demo driver, and are
+ * skipped if it isn't built in.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include "libsigrok.h"
+
+/* Size of the sample buffers the microbenchmarks work on. */
+#define BENCH_BUFSIZE          (1024 * 1024)
+
+/* Samples per run of the pipelines through a session. */
+#define PIPELINE_SAMPLES       (64 * 1024 * 1024)
+
+/* Size of the packets the demo device sends. */
+#define PIPELINE_CHUNKSIZE     (64 * 1024)
+
+/* Number of timestamps in the generated VCD file. */
+#define VCD_TIMESTAMPS         (256 * 1024)
+
+struct bench_result {
+	uint64_t bytes;
+	uint64_t samples;
+	gint64 usecs;
+};
+
+static gint64 min_usecs = G_USEC_PER_SEC;
+static char **only;
+static struct sr_dev_inst *demo_sdi;
+static uint8_t *samples;
+
+/* State of the datafeed callbacks of the session benchmarks. */
+static uint64_t feed_bytes;
+static struct sr_output *feed_output;
+static struct sr_output_sink *feed_sink;
+
+static gboolean selected(const char *name)
+{
+	int i;
+
+	if (!only || !only[0])
+		return TRUE;
+
+	for (i = 0; only[i]; i++) {
+		if (strstr(name, only[i]))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void report(const char *name, const struct bench_result *r)
+{
+	double secs;
+
+	secs = (double)r->usecs / G_USEC_PER_SEC;
+	if (secs <= 0)
+		secs = 1e-9;
+
+	printf("%s\t%" PRIu64 "\t%" PRIu64 "\t%.6f\t%.2f\t%.0f\n", name,
+	       r->bytes, r->samples, secs, r->bytes / secs / 1e6,
+	       r->samples / secs);
+	fflush(stdout);
+}
+
+static void fill_samples(void)
+{
+	uint64_t x;
+	int i;
+
+	/* xorshift64, so every run works on the same data. */
+	x = UINT64_C(0x9e3779b97f4a7c15);
+	for (i = 0; i < BENCH_BUFSIZE; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		samples[i] = x;
+	}
+}
+
+static void bench_filter(const char *name, int in_unitsize,
+			 int out_unitsize, const int *probelist,
+			 gboolean alloc)
+{
+	struct bench_result r;
+	uint8_t *out;
+	uint64_t length_out;
+	gint64 start;
+
+	if (!selected(name))
+		return;
+
+	if (!(out = g_try_malloc(BENCH_BUFSIZE))) {
+		fprintf(stderr, "%s: out of memory\n", name);
+		return;
+	}
+
+	memset(&r, 0, sizeof(r));
+	start = g_get_monotonic_time();
+	do {
+		if (alloc) {
+			g_free(out);
+			out = NULL;
+			if (sr_filter_probes(in_unitsize, out_unitsize,
+					probelist, samples, BENCH_BUFSIZE,
+					&out, &length_out) != SR_OK)
+				break;
+		} else if (sr_filter_probes_buf(in_unitsize, out_unitsize,
+				probelist, samples, BENCH_BUFSIZE, out,
+				&length_out) != SR_OK) {
+			break;
+		}
+		r.bytes += BENCH_BUFSIZE;
+		r.samples += BENCH_BUFSIZE / in_unitsize;
+		r.usecs = g_get_monotonic_time() - start;
+	} while (r.usecs < min_usecs);
+	g_free(out);
+
+	report(name, &r);
+}
+
+static void bench_datastore(const char *name, uint64_t chunksize)
+{
+	static const int probelist[] = { 1, 2, 3, 4, 5, 6, 7, 8, 0 };
+	struct bench_result r;
+	struct sr_datastore *ds;
+	uint64_t i;
+	gint64 start;
+
+	if (!selected(name))
+		return;
+
+	memset(&r, 0, sizeof(r));
+	start = g_get_monotonic_time();
+	do {
+		/* A new datastore per megabyte keeps memory use flat. */
+		if (sr_datastore_new(1, &ds) != SR_OK)
+			break;
+		for (i = 0; i + chunksize <= BENCH_BUFSIZE; i += chunksize) {
+			if (sr_datastore_put(ds, samples + i, chunksize, 1,
+					     probelist) != SR_OK)
+				break;
+			r.bytes += chunksize;
+		}
+		sr_datastore_destroy(ds);
+		r.usecs = g_get_monotonic_time() - start;
+	} while (r.usecs < min_usecs);
+	r.samples = r.bytes;
+
+	report(name, &r);
+}
+
+static struct sr_output_format *output_format_get(const char *id)
+{
+	struct sr_output_format **formats;
+	int i;
+
+	formats = sr_output_list();
+	for (i = 0; formats[i]; i++) {
+		if (!strcmp(formats[i]->id, id))
+			return formats[i];
+	}
+
+	return NULL;
+}
+
+static int output_open(struct sr_output *o, const char *id)
+{
+	memset(o, 0, sizeof(*o));
+	if (!(o->format = output_format_get(id)))
+		return SR_ERR_ARG;
+	o->sdi = demo_sdi;
+	if (o->format->init && o->format->init(o) != SR_OK)
+		return SR_ERR;
+
+	return SR_OK;
+}
+
+static void output_close(struct sr_output *o)
+{
+	if (o->format->cleanup)
+		o->format->cleanup(o);
+}
+
+/* The data() callback of an output module, on the demo device's 8 probes. */
+static void bench_output(const char *id)
+{
+	struct bench_result r;
+	struct sr_output o;
+	struct sr_output_sink *sink;
+	char name[64];
+	gint64 start;
+
+	snprintf(name, sizeof(name), "output/%s", id);
+	if (!selected(name))
+		return;
+
+	if (output_open(&o, id) != SR_OK) {
+		printf("# %s: skipped, can't set up the output module\n", name);
+		return;
+	}
+	if (!(sink = sr_output_sink_buffer_new())) {
+		output_close(&o);
+		return;
+	}
+
+	memset(&r, 0, sizeof(r));
+	start = g_get_monotonic_time();
+	do {
+		/* Chunks the size of a typical datafeed packet. */
+		if (sr_output_data(&o, samples, PIPELINE_CHUNKSIZE,
+				   sink) != SR_OK)
+			break;
+		sr_output_sink_reset(sink);
+		r.bytes += PIPELINE_CHUNKSIZE;
+		r.samples += PIPELINE_CHUNKSIZE;
+		r.usecs = g_get_monotonic_time() - start;
+	} while (r.usecs < min_usecs);
+
+	sr_output_sink_destroy(sink);
+	output_close(&o);
+
+	report(name, &r);
+}
+
+static void count_logic(const struct sr_dev_inst *sdi,
+			struct sr_datafeed_packet *packet)
+{
+	const struct sr_datafeed_logic *logic;
+
+	(void)sdi;
+
+	if (packet->type != SR_DF_LOGIC)
+		return;
+	logic = packet->payload;
+	feed_bytes += logic->length;
+}
+
+static void feed_output_logic(const struct sr_dev_inst *sdi,
+			      struct sr_datafeed_packet *packet)
+{
+	const struct sr_datafeed_logic *logic;
+
+	(void)sdi;
+
+	if (packet->type != SR_DF_LOGIC)
+		return;
+	logic = packet->payload;
+	feed_bytes += logic->length;
+	sr_output_data(feed_output, logic->data, logic->length, feed_sink);
+	sr_output_sink_reset(feed_sink);
+}
+
+/* Generate a VCD file with 8 probes, some of which change every step. */
+static GString *vcd_generate(void)
+{
+	static const char ids[] = "!\"#$%&'(";
+	GString *vcd;
+	uint64_t t, x;
+	int i;
+
+	vcd = g_string_sized_new(VCD_TIMESTAMPS * 16);
+	g_string_append(vcd, "$timescale 1 us $end\n"
+			"$scope module bench $end\n");
+	for (i = 0; i < 8; i++)
+		g_string_append_printf(vcd, "$var wire 1 %c %d $end\n",
+				       ids[i], i);
+	g_string_append(vcd, "$upscope $end\n$enddefinitions $end\n");
+
+	x = UINT64_C(0x9e3779b97f4a7c15);
+	for (t = 0; t < VCD_TIMESTAMPS; t++) {
+		g_string_append_printf(vcd, "#%" PRIu64 "\n", t * 3);
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		for (i = 0; i < 8; i++) {
+			if (t == 0 || (x >> (i * 2) & 3) == 0)
+				g_string_append_printf(vcd, "%d%c\n",
+					(int)(x >> (i + 16) & 1), ids[i]);
+		}
+	}
+
+	return vcd;
+}
+
+/* The VCD input module's streaming parser, fed 64 KiB at a time. */
+static void bench_input_vcd(void)
+{
+	const char *name = "input/vcd";
+	struct sr_input_format **formats;
+	struct sr_input in;
+	struct bench_result r;
+	GString *vcd;
+	uint64_t i;
+	gint64 start;
+
+	if (!selected(name))
+		return;
+
+	memset(&in, 0, sizeof(in));
+	formats = sr_input_list();
+	for (i = 0; formats[i]; i++) {
+		if (!strcmp(formats[i]->id, "vcd"))
+			in.format = formats[i];
+	}
+	if (!in.format || !in.format->begin) {
+		printf("# %s: skipped, no streaming VCD input\n", name);
+		return;
+	}
+
+	vcd = vcd_generate();
+	memset(&r, 0, sizeof(r));
+	start = g_get_monotonic_time();
+	do {
+		sr_session_new();
+		sr_session_datafeed_callback_add(count_logic);
+		feed_bytes = 0;
+		if (in.format->init(&in) != SR_OK
+		    || sr_input_begin(&in) != SR_OK)
+			break;
+		for (i = 0; i < vcd->len; i += PIPELINE_CHUNKSIZE)
+			sr_input_receive(&in, vcd->str + i,
+					 MIN(vcd->len - i, PIPELINE_CHUNKSIZE));
+		sr_input_end(&in);
+		sr_session_destroy();
+		r.bytes += vcd->len;
+		r.samples += feed_bytes;
+		r.usecs = g_get_monotonic_time() - start;
+	} while (r.usecs < min_usecs);
+	g_string_free(vcd, TRUE);
+
+	report(name, &r);
+}
+
+/* Run the unthrottled demo device through a session, to the callbacks. */
+static int run_demo(int num_callbacks, sr_datafeed_callback_t cb)
+{
+	uint64_t tmp_u64;
+	int i;
+
+	if (sr_session_new() == NULL)
+		return SR_ERR;
+	if (sr_session_dev_add(demo_sdi) != SR_OK)
+		return SR_ERR;
+	for (i = 0; i < num_callbacks; i++)
+		sr_session_datafeed_callback_add(cb);
+
+	tmp_u64 = 0;
+	sr_dev_config_set(demo_sdi, SR_HWCAP_PLAYBACK_SPEED, &tmp_u64);
+	tmp_u64 = PIPELINE_CHUNKSIZE;
+	sr_dev_config_set(demo_sdi, SR_HWCAP_PLAYBACK_CHUNKSIZE, &tmp_u64);
+	tmp_u64 = PIPELINE_SAMPLES;
+	sr_dev_config_set(demo_sdi, SR_HWCAP_LIMIT_SAMPLES, &tmp_u64);
+
+	if (sr_session_start() != SR_OK) {
+		sr_session_destroy();
+		return SR_ERR;
+	}
+	sr_session_run();
+	sr_session_destroy();
+
+	return SR_OK;
+}
+
+/* sr_session_send() delivering every packet to several callbacks. */
+static void bench_fanout(int num_callbacks)
+{
+	struct bench_result r;
+	char name[64];
+	gint64 start;
+
+	snprintf(name, sizeof(name), "session/fanout-%d", num_callbacks);
+	if (!selected(name))
+		return;
+
+	memset(&r, 0, sizeof(r));
+	start = g_get_monotonic_time();
+	do {
+		feed_bytes = 0;
+		if (run_demo(num_callbacks, count_logic) != SR_OK)
+			break;
+		/* Count what the session delivered, not what it got. */
+		r.bytes += feed_bytes / num_callbacks;
+		r.samples += feed_bytes / num_callbacks;
+		r.usecs = g_get_monotonic_time() - start;
+	} while (r.usecs < min_usecs);
+
+	report(name, &r);
+}
+
+/* The demo device's samples, through a session, into an output module. */
+static void bench_pipeline(const char *id)
+{
+	struct bench_result r;
+	struct sr_output o;
+	char name[64];
+	gint64 start;
+
+	snprintf(name, sizeof(name), "pipeline/demo-%s", id);
+	if (!selected(name))
+		return;
+
+	if (output_open(&o, id) != SR_OK) {
+		printf("# %s: skipped, can't set up the output module\n", name);
+		return;
+	}
+	if (!(feed_sink = sr_output_sink_buffer_new())) {
+		output_close(&o);
+		return;
+	}
+	feed_output = &o;
+
+	memset(&r, 0, sizeof(r));
+	start = g_get_monotonic_time();
+	do {
+		feed_bytes = 0;
+		if (run_demo(1, feed_output_logic) != SR_OK)
+			break;
+		r.bytes += feed_bytes;
+		r.samples += feed_bytes;
+		r.usecs = g_get_monotonic_time() - start;
+	} while (r.usecs < min_usecs);
+
+	sr_output_sink_destroy(feed_sink);
+	feed_sink = NULL;
+	output_close(&o);
+
+	report(name, &r);
+}
+
+static struct sr_dev_inst *demo_open(struct sr_context *sr_ctx)
+{
+	struct sr_dev_driver **drivers;
+	GSList *devices;
+	struct sr_dev_inst *sdi;
+	int i;
+
+	drivers = sr_driver_list();
+	for (i = 0; drivers[i]; i++) {
+		if (strcmp(drivers[i]->name, "demo"))
+			continue;
+		if (sr_driver_init(sr_ctx, drivers[i]) != SR_OK)
+			return NULL;
+		if (!(devices = sr_driver_scan(drivers[i], NULL)))
+			return NULL;
+		sdi = devices->data;
+		g_slist_free(devices);
+		return sdi;
+	}
+
+	return NULL;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-t <ms>] [name...]\n"
+		"  -t <ms>  Minimum time per benchmark (default 1000)\n"
+		"  name     Only run benchmarks whose name contains it\n",
+		argv0);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *outputs[] = {
+		"vcd", "csv", "bits", "hex", "ascii", "gnuplot", "ols",
+		"binary", NULL,
+	};
+	static const int probes_8of16[] = {
+		0, 2, 4, 6, 8, 10, 12, 14, -1,
+	};
+	static const int probes_16of32[] = {
+		0, 1, 2, 3, 4, 5, 6, 7, 16, 17, 18, 19, 20, 21, 22, 23, -1,
+	};
+	struct sr_context *sr_ctx;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "t:h")) != -1) {
+		switch (opt) {
+		case 't':
+			min_usecs = strtoll(optarg, NULL, 10) * 1000;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	only = argv + optind;
+
+	sr_log_loglevel_set(SR_LOG_NONE);
+	if (sr_init(&sr_ctx) != SR_OK) {
+		fprintf(stderr, "libsigrok initialization failed\n");
+		return 1;
+	}
+
+	if (!(samples = g_try_malloc(BENCH_BUFSIZE))) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	fill_samples();
+
+	printf("# libsigrok %s\n", sr_lib_version_string_get());
+	printf("# benchmark\tbytes\tsamples\tseconds\tMB/s\tsamples/s\n");
+
+	bench_filter("filter/8of16", 2, 1, probes_8of16, TRUE);
+	bench_filter("filter/8of16-buf", 2, 1, probes_8of16, FALSE);
+	bench_filter("filter/16of32-buf", 4, 2, probes_16of32, FALSE);
+	bench_datastore("datastore/put-4k", 4096);
+	bench_datastore("datastore/put-64k", 64 * 1024);
+	bench_input_vcd();
+
+	if (!(demo_sdi = demo_open(sr_ctx))) {
+		printf("# demo driver not available, skipping the rest\n");
+	} else {
+		for (i = 0; outputs[i]; i++)
+			bench_output(outputs[i]);
+		bench_fanout(1);
+		bench_fanout(4);
+		bench_pipeline("vcd");
+		bench_pipeline("binary");
+	}
+
+	g_free(samples);
+	sr_exit(sr_ctx);
+
+	return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "buffer: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/**
+ * @file
+ *
+ * Reference-counted data buffers for datafeed packets.
+ */
+
+/**
+ * @defgroup grp_buffer Datafeed buffers
+ *
+ * Reference-counted data buffers for datafeed packets.
+ *
+ * A driver which sends an SR_DF_LOGIC or SR_DF_ANALOG packet normally owns
+ * the memory the payload's 'data' field points to, and may reuse it as soon
+ * as sr_session_send() returns. A consumer which wants to keep the data
+ * would have to copy it.
+ *
+ * Instead, a driver can put its samples into a struct sr_buffer and point
+ * the payload's 'buffer' field to it. Any consumer can then take its own
+ * reference with sr_buffer_acquire() and keep the data around (without
+ * copying it) until it calls sr_buffer_release(). The memory is freed, or
+ * handed back to its owner, once the last reference is dropped.
+ *
+ * @{
+ */
+
+/**
+ * Allocate a new buffer of the specified size.
+ *
+ * The buffer's data is allocated together with the buffer itself. The new
+ * buffer has a reference count of 1, owned by the caller.
+ *
+ * @param size The size of the data area in bytes.
+ *
+ * @return A pointer to the new buffer, or NULL upon errors.
+ */
+SR_API struct sr_buffer *sr_buffer_new(uint64_t size)
+{
+	struct sr_buffer *buf;
+
+	if (!(buf = g_try_malloc(sizeof(struct sr_buffer) + size))) {
+		sr_err("%s: buffer malloc failed", __func__);
+		return NULL;
+	}
+
+	buf->data = buf + 1;
+	buf->size = size;
+	buf->refcount = 1;
+	buf->free_cb = NULL;
+	buf->cb_data = NULL;
+
+	return buf;
+}
+
+/**
+ * Wrap existing memory in a new buffer.
+ *
+ * This allows a driver to hand out memory it allocated itself, e.g. a USB
+ * transfer buffer. Once the last reference is dropped, 'free_cb' is called
+ * and the memory belongs to the driver again (it can e.g. resubmit the
+ * transfer at that point).
+ *
+ * @param data Pointer to the memory to wrap. Must not be NULL.
+ * @param size The size of the memory area in bytes.
+ * @param free_cb Function to call when the last reference is dropped. Can
+ *                be NULL, in which case the memory is not touched.
+ * @param cb_data Data passed to 'free_cb'. Can be NULL.
+ *
+ * @return A pointer to the new buffer, or NULL upon errors.
+ */
+SR_API struct sr_buffer *sr_buffer_new_full(void *data, uint64_t size,
+		sr_buffer_free_callback_t free_cb, void *cb_data)
+{
+	struct sr_buffer *buf;
+
+	if (!data) {
+		sr_err("%s: data was NULL", __func__);
+		return NULL;
+	}
+
+	if (!(buf = g_try_malloc(sizeof(struct sr_buffer)))) {
+		sr_err("%s: buffer malloc failed", __func__);
+		return NULL;
+	}
+
+	buf->data = data;
+	buf->size = size;
+	buf->refcount = 1;
+	buf->free_cb = free_cb;
+	buf->cb_data = cb_data;
+
+	return buf;
+}
+
+/**
+ * Take a new reference to a buffer.
+ *
+ * This is safe to call from any thread.
+ *
+ * @param buf The buffer. Must not be NULL.
+ *
+ * @return The buffer, or NULL upon invalid arguments.
+ */
+SR_API struct sr_buffer *sr_buffer_acquire(struct sr_buffer *buf)
+{
+	if (!buf) {
+		sr_err("%s: buf was NULL", __func__);
+		return NULL;
+	}
+
+	g_atomic_int_inc(&buf->refcount);
+
+	return buf;
+}
+
+/**
+ * Drop a reference to a buffer.
+ *
+ * When the last reference is dropped, the buffer is freed. This is safe
+ * to call from any thread; the buffer's free callback (if any) runs on the
+ * thread which dropped the last reference.
+ *
+ * @param buf The buffer. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_buffer_release(struct sr_buffer *buf)
+{
+	if (!buf) {
+		sr_err("%s: buf was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!g_atomic_int_dec_and_test(&buf->refcount))
+		return SR_OK;
+
+	if (buf->free_cb)
+		buf->free_cb(buf->data, buf->cb_data);
+	g_free(buf);
+
+	return SR_OK;
+}
+
+/** @} */
@@ -20,18 +20,19 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "datastore: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 /**
  * @file
@@ -47,51 +48,1147 @@
  * @{
  */
 
-static gpointer new_chunk(struct sr_datastore **ds);
+/** @cond PRIVATE */
+/* Initial number of entries in a datastore's chunk array. */
+#define DATASTORE_CHUNKS_MIN 16
+
+/* Longest run of identical units a single RLE record can describe. */
+#define DATASTORE_RUN_MAX 0xffff
+
+/*
+ * Maximum number of transitions of one probe in one chunk for which the
+ * edge index keeps their offsets. Busier probes (clocks, mostly) are only
+ * counted, and scanned in the raw data when searched.
+ */
+#define DATASTORE_EDGES_MAX 4096
+
+/* Number of units sr_datastore_put_rle() expands at a time when packing. */
+#define DATASTORE_RLE_BLOCK 4096
+/** @endcond */
+
+static int new_chunk(struct sr_datastore *ds);
+
+/* Size of a chunk in bytes. */
+static uint64_t chunk_bytes(const struct sr_datastore *ds)
+{
+	if (ds->ds_unitbits)
+		return (uint64_t)DATASTORE_CHUNKSIZE * ds->ds_unitbits / 8;
+
+	return (uint64_t)DATASTORE_CHUNKSIZE * ds->ds_unitsize;
+}
+
+/*
+ * Run-length encode 'units' units from 'in' into 'out'. Each record is a
+ * 16-bit little-endian run length followed by one unit. Returns the size
+ * of the encoded data, or 0 if it doesn't fit into 'out_size' bytes.
+ */
+static uint64_t chunk_pack(const uint8_t *in, uint64_t units, int unitsize,
+			   uint8_t *out, uint64_t out_size)
+{
+	uint64_t i, o, run;
+
+	i = o = 0;
+	while (i < units) {
+		run = 1;
+		while (i + run < units && run < DATASTORE_RUN_MAX &&
+		       !memcmp(in + (i + run) * unitsize, in + i * unitsize,
+			       unitsize))
+			run++;
+
+		if (o + 2 + unitsize > out_size)
+			return 0;
+		out[o] = run & 0xff;
+		out[o + 1] = run >> 8;
+		memcpy(out + o + 2, in + i * unitsize, unitsize);
+		o += 2 + unitsize;
+		i += run;
+	}
+
+	return o;
+}
+
+/* Decode 'size' bytes of chunk_pack() output from 'in' into 'out'. */
+static void chunk_unpack(const uint8_t *in, uint64_t size, int unitsize,
+			 uint8_t *out)
+{
+	uint64_t i, run;
+
+	for (i = 0; i < size; i += 2 + unitsize) {
+		run = in[i] | (in[i + 1] << 8);
+		if (unitsize == 1) {
+			memset(out, in[i + 2], run);
+			out += run;
+			continue;
+		}
+		while (run--) {
+			memcpy(out, in + i + 2, unitsize);
+			out += unitsize;
+		}
+	}
+}
+
+/*
+ * Compress the (full) chunk 'i' of a datastore with compression enabled.
+ * If the chunk doesn't get any smaller, it is left as it is.
+ */
+static void chunk_seal(struct sr_datastore *ds, uint64_t i)
+{
+	uint8_t *packed, *shrunk;
+	uint64_t size;
+
+	if (!(packed = g_try_malloc(chunk_bytes(ds)))) {
+		sr_dbg("%s: not enough memory to compress chunk", __func__);
+		return;
+	}
+
+	/* Packed chunks are run-length encoded byte by byte. */
+	size = chunk_pack(ds->chunks[i], chunk_bytes(ds) / ds->ds_unitsize,
+			  ds->ds_unitsize, packed, chunk_bytes(ds) - 1);
+	if (size == 0) {
+		g_free(packed);
+		return;
+	}
+
+	/* Give the unused tail of the buffer back. */
+	if ((shrunk = g_try_realloc(packed, size)))
+		packed = shrunk;
+
+	sr_pool_free(ds->chunks[i], chunk_bytes(ds));
+	ds->chunks[i] = packed;
+	ds->packed_sizes[i] = size;
+}
+
+/*
+ * Append an entry to level 'level' of the summary pyramid. Whenever two
+ * entries of a level are complete, they are merged into an entry of the
+ * next level up.
+ */
+static int summary_append(struct sr_datastore *ds, int level,
+			  const uint8_t *entry)
+{
+	struct sr_datastore_level *l;
+	uint8_t *new_entries, *a, *b, *merged;
+	uint64_t entry_size, new_size, i;
+
+	if (level >= DATASTORE_SUMMARY_LEVELS)
+		return SR_OK;
+
+	l = &ds->levels[level];
+	entry_size = 3 * ds->ds_unitsize;
+	if (l->num_entries == l->size) {
+		new_size = l->size ? l->size * 2 : DATASTORE_CHUNKS_MIN;
+		new_entries = g_try_realloc(l->entries, entry_size * new_size);
+		if (!new_entries) {
+			sr_err("%s: summary level malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		l->entries = new_entries;
+		l->size = new_size;
+	}
+
+	memcpy(l->entries + l->num_entries * entry_size, entry, entry_size);
+	l->num_entries++;
+	ds->num_levels = MAX(ds->num_levels, level + 1);
+
+	if (l->num_entries % 2)
+		return SR_OK;
+
+	/* All three fields are ORs, and so is merging them. */
+	a = l->entries + (l->num_entries - 2) * entry_size;
+	b = a + entry_size;
+	merged = ds->summary_acc + 4 * ds->ds_unitsize;
+	for (i = 0; i < entry_size; i++)
+		merged[i] = a[i] | b[i];
+
+	return summary_append(ds, level + 1, merged);
+}
+
+/* Accumulate 'units' newly stored units into the summary pyramid. */
+static int summary_feed(struct sr_datastore *ds, const uint8_t *data,
+			uint64_t units)
+{
+	uint8_t *high, *low, *edge, *last;
+	uint64_t i;
+	int unitsize, b, ret;
+
+	unitsize = ds->ds_unitsize;
+	high = ds->summary_acc;
+	low = high + unitsize;
+	edge = low + unitsize;
+	last = edge + unitsize;
+
+	for (i = 0; i < units; i++, data += unitsize) {
+		for (b = 0; b < unitsize; b++) {
+			high[b] |= data[b];
+			low[b] |= ~data[b];
+			/* The very first unit has no predecessor. */
+			if (ds->num_units + i > 0)
+				edge[b] |= data[b] ^ last[b];
+			last[b] = data[b];
+		}
+
+		if (++ds->summary_fill < UINT64_C(1) << DATASTORE_SUMMARY_BASE)
+			continue;
+
+		if ((ret = summary_append(ds, 0, high)) != SR_OK)
+			return ret;
+		memset(high, 0, 3 * unitsize);
+		ds->summary_fill = 0;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * Return a pointer to the data of chunk 'i', as stored (i.e. still packed
+ * for packed datastores). For memory-mapped datastores this maps the chunk
+ * if needed, and for compressed chunks it decompresses the chunk into a
+ * scratch buffer. In both cases, the pointer to any other chunk than the
+ * last one is only valid until the next call.
+ */
+static uint8_t *chunk_stored(struct sr_datastore *ds, uint64_t i)
+{
+	if (!ds->filename) {
+		if (!ds->packed_sizes || !ds->packed_sizes[i])
+			return ds->chunks[i];
+
+		if (ds->unpacked && ds->unpacked_chunk == i)
+			return ds->unpacked;
+
+		if (!ds->unpacked &&
+		    !(ds->unpacked = g_try_malloc(chunk_bytes(ds)))) {
+			sr_err("%s: unpack buffer malloc failed", __func__);
+			return NULL;
+		}
+		chunk_unpack(ds->chunks[i], ds->packed_sizes[i],
+			     ds->ds_unitsize, ds->unpacked);
+		ds->unpacked_chunk = i;
+
+		return ds->unpacked;
+	}
+
+	if (i == ds->num_chunks - 1)
+		return ds->tail_map;
+
+#ifdef HAVE_SYS_MMAN_H
+	if (ds->read_map && ds->read_chunk == i)
+		return ds->read_map;
+
+	if (ds->read_map)
+		munmap(ds->read_map, chunk_bytes(ds));
+	ds->read_map = mmap(NULL, chunk_bytes(ds), PROT_READ, MAP_SHARED,
+			    ds->fd, i * chunk_bytes(ds));
+	if (ds->read_map == MAP_FAILED) {
+		sr_err("%s: failed to map chunk %" PRIu64 ": %s", __func__, i,
+		       g_strerror(errno));
+		ds->read_map = NULL;
+		return NULL;
+	}
+	ds->read_chunk = i;
+
+	return ds->read_map;
+#else
+	return NULL;
+#endif
+}
+
+/* Number of chunks holding at least one unit. */
+static uint64_t chunks_used(const struct sr_datastore *ds)
+{
+	return (ds->num_units + DATASTORE_CHUNKSIZE - 1) / DATASTORE_CHUNKSIZE;
+}
+
+/* Number of units stored in chunk 'c'. */
+static uint64_t chunk_units(const struct sr_datastore *ds, uint64_t c)
+{
+	if (c < ds->num_units / DATASTORE_CHUNKSIZE)
+		return DATASTORE_CHUNKSIZE;
+
+	return ds->num_units % DATASTORE_CHUNKSIZE;
+}
+
+/*
+ * Return a pointer to the data of chunk 'i', one unit after the other.
+ * Chunks of packed datastores are unpacked into a scratch buffer, so the
+ * pointer is only valid until the next call, as with chunk_stored().
+ */
+static uint8_t *chunk_get(struct sr_datastore *ds, uint64_t i)
+{
+	uint8_t *stored;
+	uint64_t units;
+
+	if (!ds->ds_unitbits)
+		return chunk_stored(ds, i);
+
+	/* The last chunk may have grown since it was unpacked. */
+	units = chunk_units(ds, i);
+	if (ds->expanded && ds->expanded_chunk == i &&
+	    ds->expanded_units == units)
+		return ds->expanded;
+
+	if (!ds->expanded &&
+	    !(ds->expanded = g_try_malloc(DATASTORE_CHUNKSIZE))) {
+		sr_err("%s: expand buffer malloc failed", __func__);
+		return NULL;
+	}
+	if (!(stored = chunk_stored(ds, i)))
+		return NULL;
+	sr_logic_unpack(stored, 0, units, ds->ds_unitbits, ds->expanded);
+	ds->expanded_chunk = i;
+	ds->expanded_units = units;
+
+	return ds->expanded;
+}
+
+/* Start the edge index record of chunk 'c'. */
+static int edges_chunk_new(struct sr_datastore *ds, uint64_t c)
+{
+	struct sr_datastore_edges *new_edges, *e;
+	uint64_t new_size;
+	int num_probes;
+
+	if (c == ds->edges_size) {
+		new_size = ds->edges_size ?
+			   ds->edges_size * 2 : DATASTORE_CHUNKS_MIN;
+		new_edges = g_try_realloc(ds->edges,
+				sizeof(struct sr_datastore_edges) * new_size);
+		if (!new_edges) {
+			sr_err("%s: edge index malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		ds->edges = new_edges;
+		ds->edges_size = new_size;
+	}
+
+	e = &ds->edges[c];
+	num_probes = ds->ds_unitsize * 8;
+	e->counts = g_try_malloc0(sizeof(uint32_t) * num_probes);
+	e->sizes = g_try_malloc0(sizeof(uint32_t) * num_probes);
+	e->offsets = g_try_malloc0(sizeof(uint32_t *) * num_probes);
+	e->prev = g_try_malloc(ds->ds_unitsize);
+	/* Count it first, so sr_datastore_destroy() frees it on errors. */
+	ds->num_edge_chunks = c + 1;
+	if (!e->counts || !e->sizes || !e->offsets || !e->prev) {
+		sr_err("%s: edge index malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	memcpy(e->prev, ds->edges_last, ds->ds_unitsize);
+
+	return SR_OK;
+}
+
+/* Record a transition of probe 'p' at offset 'o' of a chunk. */
+static int edges_add(struct sr_datastore_edges *e, int p, uint32_t o)
+{
+	uint32_t *new_offsets, new_size;
+
+	if (++e->counts[p] > DATASTORE_EDGES_MAX) {
+		/* Too busy, from now on this probe is only counted. */
+		g_free(e->offsets[p]);
+		e->offsets[p] = NULL;
+		return SR_OK;
+	}
+
+	if (e->counts[p] > e->sizes[p]) {
+		new_size = e->sizes[p] ? e->sizes[p] * 2 : DATASTORE_CHUNKS_MIN;
+		new_offsets = g_try_realloc(e->offsets[p],
+					    sizeof(uint32_t) * new_size);
+		if (!new_offsets) {
+			sr_err("%s: edge list malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		e->offsets[p] = new_offsets;
+		e->sizes[p] = new_size;
+	}
+	e->offsets[p][e->counts[p] - 1] = o;
+
+	return SR_OK;
+}
+
+/* Index the transitions in 'units' newly stored units. */
+static int edges_feed(struct sr_datastore *ds, const uint8_t *data,
+		      uint64_t units)
+{
+	struct sr_datastore_edges *e;
+	uint64_t i, n;
+	uint8_t diff;
+	int unitsize, b, bit, ret;
+
+	unitsize = ds->ds_unitsize;
+	for (i = 0; i < units; i++, data += unitsize) {
+		n = ds->num_units + i;
+		if (n % DATASTORE_CHUNKSIZE == 0) {
+			ret = edges_chunk_new(ds, n / DATASTORE_CHUNKSIZE);
+			if (ret != SR_OK)
+				return ret;
+		}
+		e = &ds->edges[n / DATASTORE_CHUNKSIZE];
+		if (n == 0)
+			/* The first unit has no predecessor, it's no edge. */
+			memcpy(e->prev, data, unitsize);
+
+		for (b = 0; b < unitsize && n > 0; b++) {
+			if (!(diff = data[b] ^ ds->edges_last[b]))
+				continue;
+			for (bit = 0; bit < 8; bit++) {
+				if (!(diff & (1 << bit)))
+					continue;
+				ret = edges_add(e, b * 8 + bit,
+						n % DATASTORE_CHUNKSIZE);
+				if (ret != SR_OK)
+					return ret;
+			}
+		}
+		memcpy(ds->edges_last, data, unitsize);
+	}
+
+	return SR_OK;
+}
+
+/* Whether probe 'p' changes at offset 'o' of chunk data 'data'. */
+static gboolean edge_at(const struct sr_datastore *ds,
+			const struct sr_datastore_edges *e,
+			const uint8_t *data, int p, uint64_t o)
+{
+	const uint8_t *unit, *prev;
+
+	unit = data + o * ds->ds_unitsize;
+	prev = o ? unit - ds->ds_unitsize : e->prev;
+
+	return ((unit[p / 8] ^ prev[p / 8]) >> (p % 8)) & 1;
+}
+
+/* Index of the first entry in sorted array 'a' of size 'n' that is >= o. */
+static uint64_t edges_lower_bound(const uint32_t *a, uint64_t n, uint64_t o)
+{
+	uint64_t lo, hi, mid;
+
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (a[mid] < o)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Find the first transition of probe 'p' at offset >= 'o' of chunk 'c'. */
+static gboolean chunk_edge_next(struct sr_datastore *ds, uint64_t c, int p,
+				uint64_t o, uint64_t *unit)
+{
+	struct sr_datastore_edges *e;
+	const uint8_t *data;
+	uint64_t idx, n;
+
+	e = &ds->edges[c];
+	if ((n = e->counts[p]) == 0)
+		return FALSE;
+
+	if (n <= DATASTORE_EDGES_MAX) {
+		idx = edges_lower_bound(e->offsets[p], n, o);
+		if (idx == n)
+			return FALSE;
+		*unit = c * DATASTORE_CHUNKSIZE + e->offsets[p][idx];
+		return TRUE;
+	}
+
+	if (!(data = chunk_get(ds, c)))
+		return FALSE;
+	for (; o < chunk_units(ds, c); o++) {
+		if (edge_at(ds, e, data, p, o)) {
+			*unit = c * DATASTORE_CHUNKSIZE + o;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* Find the last transition of probe 'p' at offset < 'o' of chunk 'c'. */
+static gboolean chunk_edge_prev(struct sr_datastore *ds, uint64_t c, int p,
+				uint64_t o, uint64_t *unit)
+{
+	struct sr_datastore_edges *e;
+	const uint8_t *data;
+	uint64_t idx, n;
+
+	e = &ds->edges[c];
+	if ((n = e->counts[p]) == 0)
+		return FALSE;
+
+	if (n <= DATASTORE_EDGES_MAX) {
+		idx = edges_lower_bound(e->offsets[p], n, o);
+		if (idx == 0)
+			return FALSE;
+		*unit = c * DATASTORE_CHUNKSIZE + e->offsets[p][idx - 1];
+		return TRUE;
+	}
+
+	if (!(data = chunk_get(ds, c)))
+		return FALSE;
+	for (o = MIN(o, chunk_units(ds, c)); o-- > 0; ) {
+		if (edge_at(ds, e, data, p, o)) {
+			*unit = c * DATASTORE_CHUNKSIZE + o;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* Count the transitions of probe 'p' at offsets [start, end) of chunk 'c'. */
+static uint64_t chunk_edge_count(struct sr_datastore *ds, uint64_t c, int p,
+				 uint64_t start, uint64_t end)
+{
+	struct sr_datastore_edges *e;
+	const uint8_t *data;
+	uint64_t n, o, count;
+
+	e = &ds->edges[c];
+	n = e->counts[p];
+	if (n == 0 || (start == 0 && end >= chunk_units(ds, c)))
+		return n;
+
+	if (n <= DATASTORE_EDGES_MAX)
+		return edges_lower_bound(e->offsets[p], n, end) -
+		       edges_lower_bound(e->offsets[p], n, start);
+
+	if (!(data = chunk_get(ds, c)))
+		return 0;
+	count = 0;
+	for (o = start; o < end; o++)
+		count += edge_at(ds, e, data, p, o);
+
+	return count;
+}
+
+/**
+ * Create a new datastore with the specified unit size.
+ *
+ * The unit size is fixed once the datastore is created, and cannot be
+ * changed later on, neither can data be added to the datastore with
+ * different unit sizes later.
+ *
+ * It is the caller's responsibility to free the allocated memory of the
+ * datastore via the sr_datastore_destroy() function, if no longer needed.
+ *
+ * @todo Unitsize should probably be unsigned int or uint32_t or similar.
+ * @todo This function should have a 'chunksize' parameter, and
+ *       struct sr_datastore a 'chunksize' field.
+ *
+ * @param unitsize The unit size (>= 1) to be used for this datastore.
+ * @param ds Pointer to a variable which will hold the newly created
+ *           datastore structure.
+ *           
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments. If something other than SR_OK
+ *         is returned, the value of 'ds' is undefined.
+ */
+SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds)
+{
+	if (!ds) {
+		sr_err("%s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (unitsize <= 0) {
+		sr_err("%s: unitsize was %d, but it must be >= 1",
+		       __func__, unitsize);
+		return SR_ERR_ARG;
+	}
+
+	if (!(*ds = g_try_malloc(sizeof(struct sr_datastore)))) {
+		sr_err("%s: ds malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	(*ds)->ds_unitsize = unitsize;
+	(*ds)->ds_unitbits = 0;
+	(*ds)->num_units = 0;
+	(*ds)->chunks = NULL;
+	(*ds)->num_chunks = 0;
+	(*ds)->chunks_size = 0;
+	(*ds)->last_fill = 0;
+	(*ds)->filename = NULL;
+	(*ds)->fd = -1;
+	(*ds)->tail_map = NULL;
+	(*ds)->read_map = NULL;
+	(*ds)->read_chunk = 0;
+	(*ds)->compress = FALSE;
+	(*ds)->packed_sizes = NULL;
+	(*ds)->unpacked = NULL;
+	(*ds)->unpacked_chunk = 0;
+	(*ds)->expanded = NULL;
+	(*ds)->expanded_chunk = 0;
+	(*ds)->expanded_units = 0;
+	(*ds)->summarize = FALSE;
+	(*ds)->levels = NULL;
+	(*ds)->num_levels = 0;
+	(*ds)->summary_acc = NULL;
+	(*ds)->summary_fill = 0;
+	(*ds)->index_edges = FALSE;
+	(*ds)->edges = NULL;
+	(*ds)->num_edge_chunks = 0;
+	(*ds)->edges_size = 0;
+	(*ds)->edges_last = NULL;
+	(*ds)->reserved = NULL;
+	(*ds)->reserved_chunks = 0;
+
+	return SR_OK;
+}
+
+/**
+ * Create a new memory-mapped datastore with the specified unit size.
+ *
+ * This works like sr_datastore_new(), but the data is stored in a
+ * temporary file instead of in memory. Only the chunk currently being
+ * filled, and one chunk being read, are mapped into memory at any time.
+ * Full chunks are left to the operating system to write back to disk,
+ * so the size of a capture is limited by disk space rather than RAM.
+ *
+ * The temporary file is created in the directory returned by
+ * g_get_tmp_dir(), and deleted again by sr_datastore_destroy().
+ *
+ * @param unitsize The unit size (>= 1) to be used for this datastore.
+ * @param ds Pointer to a variable which will hold the newly created
+ *           datastore structure.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         SR_ERR_ARG upon invalid arguments, or SR_ERR if the temporary
+ *         file can't be created (or memory-mapping isn't supported on
+ *         this platform). If something other than SR_OK is returned,
+ *         the value of 'ds' is undefined.
+ */
+SR_API int sr_datastore_new_mapped(int unitsize, struct sr_datastore **ds)
+{
+#ifdef HAVE_SYS_MMAN_H
+	GError *error;
+	int ret;
+
+	if ((ret = sr_datastore_new(unitsize, ds)) != SR_OK)
+		return ret;
+
+	error = NULL;
+	(*ds)->fd = g_file_open_tmp("sigrok-datastore-XXXXXX",
+				    &(*ds)->filename, &error);
+	if ((*ds)->fd < 0) {
+		sr_err("%s: failed to create temporary file: %s",
+		       __func__, error->message);
+		g_error_free(error);
+		g_free(*ds);
+		return SR_ERR;
+	}
+
+	return SR_OK;
+#else
+	(void)unitsize;
+	(void)ds;
+
+	sr_err("%s: memory-mapped datastores are not supported", __func__);
+
+	return SR_ERR;
+#endif
+}
+
+/**
+ * Enable or disable compression of the specified datastore's chunks.
+ *
+ * With compression enabled, each chunk is run-length encoded as soon as
+ * it is full, if that makes it any smaller. Idle probes in logic captures
+ * typically make this shrink chunks by orders of magnitude. Chunks are
+ * decompressed on demand when read through sr_datastore_get_range() or a
+ * datastore iterator; only the chunk being filled stays uncompressed.
+ *
+ * This must be called before any data is added to the datastore. It is
+ * not available for memory-mapped datastores.
+ *
+ * @param ds The datastore. Must not be NULL.
+ * @param enabled TRUE to compress chunks, FALSE to store them as is.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments (or if
+ *         the datastore already holds data, is memory-mapped or has
+ *         memory reserved).
+ */
+SR_API int sr_datastore_compression_set(struct sr_datastore *ds,
+		gboolean enabled)
+{
+	if (!ds) {
+		sr_err("%s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->num_chunks > 0) {
+		sr_err("%s: datastore already holds data", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->filename) {
+		sr_err("%s: memory-mapped datastores can't be compressed",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->reserved) {
+		sr_err("%s: datastores with reserved memory can't be "
+		       "compressed", __func__);
+		return SR_ERR_ARG;
+	}
+
+	ds->compress = enabled;
+
+	return SR_OK;
+}
+
+/**
+ * Pack the units of the specified datastore into fewer than 8 bits each.
+ *
+ * Captures of one, two or four probes need only one, two or four bits
+ * per sample, instead of the whole byte of the smallest unit size. With
+ * packing enabled, the datastore's chunks take up only that much memory
+ * (or disk space, for memory-mapped datastores), and sr_session_save()
+ * writes the packed chunks as they are.
+ *
+ * The API doesn't change otherwise: units are still added one byte each
+ * (with the probes in the low 'unitbits' bits, as sr_filter_probes()
+ * produces them), and they're unpacked back to one byte each when read
+ * through sr_datastore_get_range() or a datastore iterator. Packing can
+ * be combined with compression, memory-mapping, the summary pyramid and
+ * the edge index.
+ *
+ * This must be called before any data is added to the datastore.
+ *
+ * @param ds The datastore. Must not be NULL, and must have a unit size
+ *           of 1.
+ * @param unitbits The number of bits per unit (1, 2 or 4), or 0 to store
+ *                 units as they are.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments (or if
+ *         the datastore already holds data or has memory reserved).
+ */
+SR_API int sr_datastore_unitbits_set(struct sr_datastore *ds, int unitbits)
+{
+	if (!ds) {
+		sr_err("%s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->num_chunks > 0) {
+		sr_err("%s: datastore already holds data", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (unitbits != 0 && unitbits != 1 && unitbits != 2 && unitbits != 4) {
+		sr_err("%s: unitbits was %d, but it must be 0, 1, 2 or 4",
+		       __func__, unitbits);
+		return SR_ERR_ARG;
+	}
+
+	if (unitbits && ds->ds_unitsize != 1) {
+		sr_err("%s: only datastores with unitsize 1 can be packed",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	/* The reservation was sized for the old chunk size. */
+	if (ds->reserved) {
+		sr_err("%s: datastore already has memory reserved", __func__);
+		return SR_ERR_ARG;
+	}
+
+	ds->ds_unitbits = unitbits;
+
+	return SR_OK;
+}
+
+/**
+ * Enable or disable the summary pyramid of the specified datastore.
+ *
+ * With the summary enabled, sr_datastore_put() incrementally maintains
+ * per-probe "any high", "any low" and "has edge" bits for consecutive
+ * blocks of 2^k units, for every k from DATASTORE_SUMMARY_BASE upwards.
+ * A frontend can then draw any range of the capture at any zoom level by
+ * looking at a number of summary entries proportional to its width in
+ * pixels (see sr_datastore_summary_get()), instead of at every unit.
+ *
+ * The summary takes up about 6 / 2^DATASTORE_SUMMARY_BASE times the size
+ * of the (uncompressed) data. This must be called before any data is added
+ * to the datastore.
+ *
+ * @param ds The datastore. Must not be NULL.
+ * @param enabled TRUE to maintain a summary, FALSE otherwise.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments (or if the datastore already
+ *         holds data).
+ */
+SR_API int sr_datastore_summary_set(struct sr_datastore *ds, gboolean enabled)
+{
+	if (!ds) {
+		sr_err("%s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->num_chunks > 0) {
+		sr_err("%s: datastore already holds data", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (enabled == ds->summarize)
+		return SR_OK;
+
+	if (!enabled) {
+		g_free(ds->levels);
+		g_free(ds->summary_acc);
+		ds->levels = NULL;
+		ds->summary_acc = NULL;
+		ds->summarize = FALSE;
+		return SR_OK;
+	}
+
+	ds->levels = g_try_malloc0(sizeof(struct sr_datastore_level) *
+				   DATASTORE_SUMMARY_LEVELS);
+	/* Current entry, last unit, and scratch space for merging. */
+	ds->summary_acc = g_try_malloc0(7 * ds->ds_unitsize);
+	if (!ds->levels || !ds->summary_acc) {
+		sr_err("%s: summary malloc failed", __func__);
+		g_free(ds->levels);
+		g_free(ds->summary_acc);
+		ds->levels = NULL;
+		ds->summary_acc = NULL;
+		return SR_ERR_MALLOC;
+	}
+	ds->summarize = TRUE;
+
+	return SR_OK;
+}
+
+/**
+ * Query the summary pyramid of the specified datastore.
+ *
+ * This picks the coarsest level which still has at least one entry per
+ * pixel when the requested range is drawn 'width' pixels wide, and returns
+ * the entries of that level which cover the range. The first and last
+ * entry may extend beyond the range. Units at the end of the datastore
+ * which don't fill a whole entry yet are not covered.
+ *
+ * If the range is so short that there are fewer than
+ * 2^DATASTORE_SUMMARY_BASE units per pixel, level 0 is returned. Drawing
+ * from the raw data (see sr_datastore_get_range()) is cheap at that point.
+ *
+ * @param ds The datastore. Must not be NULL, and must have its summary
+ *           enabled via sr_datastore_summary_set().
+ * @param start_unit The index of the first unit of the range.
+ * @param count The number of units in the range.
+ * @param width The number of pixels the range is drawn in. Must be > 0.
+ * @param summary Pointer to a struct which will hold the result. Must not
+ *                be NULL. The entries are only valid until the next call
+ *                to sr_datastore_put() or sr_datastore_destroy().
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_datastore_summary_get(struct sr_datastore *ds,
+		uint64_t start_unit, uint64_t count, uint64_t width,
+		struct sr_datastore_summary *summary)
+{
+	struct sr_datastore_level *l;
+	uint64_t per_pixel, first, last;
+	int level, shift;
+
+	if (!ds || !summary) {
+		sr_err("%s: ds or summary was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!ds->summarize) {
+		sr_err("%s: summary is not enabled", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (width == 0) {
+		sr_err("%s: width was 0", __func__);
+		return SR_ERR_ARG;
+	}
+
+	/* Coarsest level with entries no larger than a pixel. */
+	per_pixel = count / width;
+	level = 0;
+	while (level + 1 < ds->num_levels &&
+	       UINT64_C(1) << (DATASTORE_SUMMARY_BASE + level + 1) <= per_pixel)
+		level++;
+
+	l = &ds->levels[level];
+	shift = DATASTORE_SUMMARY_BASE + level;
+	first = start_unit >> shift;
+	last = MIN((start_unit + count + (UINT64_C(1) << shift) - 1) >> shift,
+		   l->num_entries);
+
+	summary->units_per_entry = UINT64_C(1) << shift;
+	summary->first_unit = first << shift;
+	summary->num_entries = first < last ? last - first : 0;
+	summary->entries = summary->num_entries ?
+			   l->entries + first * 3 * ds->ds_unitsize : NULL;
+
+	return SR_OK;
+}
 
 /**
- * Create a new datastore with the specified unit size.
+ * Enable or disable the edge index of the specified datastore.
  *
- * The unit size is fixed once the datastore is created, and cannot be
- * changed later on, neither can data be added to the datastore with
- * different unit sizes later.
+ * With the index enabled, sr_datastore_put() records, per chunk and per
+ * probe, how often the probe changes state and (unless it changes more than
+ * DATASTORE_EDGES_MAX times in the chunk) at which units. This lets
+ * sr_datastore_edge_next(), sr_datastore_edge_prev() and
+ * sr_datastore_edge_count() skip over quiet stretches of a capture without
+ * looking at the samples.
  *
- * It is the caller's responsibility to free the allocated memory of the
- * datastore via the sr_datastore_destroy() function, if no longer needed.
+ * This must be called before any data is added to the datastore.
  *
- * @todo Unitsize should probably be unsigned int or uint32_t or similar.
- * @todo This function should have a 'chunksize' parameter, and
- *       struct sr_datastore a 'chunksize' field.
+ * @param ds The datastore. Must not be NULL.
+ * @param enabled TRUE to maintain an edge index, FALSE otherwise.
  *
- * @param unitsize The unit size (>= 1) to be used for this datastore.
- * @param ds Pointer to a variable which will hold the newly created
- *           datastore structure.
- *           
  * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
- *         or SR_ERR_ARG upon invalid arguments. If something other than SR_OK
- *         is returned, the value of 'ds' is undefined.
+ *         or SR_ERR_ARG upon invalid arguments (or if the datastore already
+ *         holds data).
  */
-SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds)
+SR_API int sr_datastore_edges_set(struct sr_datastore *ds, gboolean enabled)
 {
 	if (!ds) {
 		sr_err("%s: ds was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
-	if (unitsize <= 0) {
-		sr_err("%s: unitsize was %d, but it must be >= 1",
-		       __func__, unitsize);
+	if (ds->num_chunks > 0) {
+		sr_err("%s: datastore already holds data", __func__);
 		return SR_ERR_ARG;
 	}
 
-	if (!(*ds = g_try_malloc(sizeof(struct sr_datastore)))) {
-		sr_err("%s: ds malloc failed", __func__);
+	if (enabled && !ds->edges_last &&
+	    !(ds->edges_last = g_try_malloc0(ds->ds_unitsize))) {
+		sr_err("%s: edges_last malloc failed", __func__);
 		return SR_ERR_MALLOC;
 	}
+	ds->index_edges = enabled;
 
-	(*ds)->ds_unitsize = unitsize;
-	(*ds)->num_units = 0;
-	(*ds)->chunklist = NULL;
+	return SR_OK;
+}
+
+/**
+ * Reserve memory for a capture of known size in the specified datastore.
+ *
+ * If the number of units a capture will produce is known up front (e.g.
+ * from SR_HWCAP_LIMIT_SAMPLES), this allocates the chunks to hold them
+ * as a single block, and the chunk array to match, before the capture
+ * starts. All pages of the block are faulted in right away, so the first
+ * milliseconds of a high-rate capture don't stall on page faults. The
+ * block is backed by huge pages if the buffer pool's are enabled (see
+ * sr_pool_hugepages_set()).
+ *
+ * Units beyond the reservation are stored in chunks allocated as usual.
+ *
+ * This must be called before any data is added to the datastore, and
+ * after sr_datastore_unitbits_set(). It is not available for compressed
+ * or memory-mapped datastores, and can only be called once.
+ *
+ * @param ds The datastore. Must not be NULL.
+ * @param num_units The number of units to reserve memory for. Must be > 0.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments (or if the datastore already
+ *         holds data or can't have memory reserved).
+ */
+SR_API int sr_datastore_reserve(struct sr_datastore *ds, uint64_t num_units)
+{
+	void **new_chunks;
+	uint64_t n;
+
+	if (!ds) {
+		sr_err("%s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (num_units == 0) {
+		sr_err("%s: num_units was 0", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->num_chunks > 0 || ds->reserved) {
+		sr_err("%s: datastore already holds data or reserved memory",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->compress || ds->filename) {
+		sr_err("%s: compressed and memory-mapped datastores can't "
+		       "have memory reserved", __func__);
+		return SR_ERR_ARG;
+	}
+
+	n = (num_units + DATASTORE_CHUNKSIZE - 1) / DATASTORE_CHUNKSIZE;
+	if (n > ds->chunks_size) {
+		if (!(new_chunks = g_try_realloc(ds->chunks,
+						 sizeof(void *) * n))) {
+			sr_err("%s: chunk array malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		ds->chunks = new_chunks;
+		ds->chunks_size = n;
+	}
+
+	if (!(ds->reserved = sr_pool_reserve(n * chunk_bytes(ds)))) {
+		sr_err("%s: reserved memory malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	ds->reserved_chunks = n;
+
+	sr_dbg("%s: reserved %" PRIu64 " chunks for %" PRIu64 " units",
+	       __func__, n, num_units);
+
+	return SR_OK;
+}
+
+/* Check the arguments common to all edge index queries. */
+static int edges_check(const struct sr_datastore *ds, int probe,
+		       const char *func)
+{
+	if (!ds) {
+		sr_err("%s: ds was NULL", func);
+		return SR_ERR_ARG;
+	}
+
+	if (!ds->index_edges) {
+		sr_err("%s: edge index is not enabled", func);
+		return SR_ERR_ARG;
+	}
+
+	if (probe < 0 || probe >= (ds->ds_unitbits ? ds->ds_unitbits :
+				   ds->ds_unitsize * 8)) {
+		sr_err("%s: invalid probe %d", func, probe);
+		return SR_ERR_ARG;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Find the next transition of a probe in the specified datastore.
+ *
+ * A unit is a transition of a probe if the probe's state in it differs
+ * from its state in the unit before.
+ *
+ * @param ds The datastore. Must not be NULL, and must have its edge index
+ *           enabled via sr_datastore_edges_set().
+ * @param probe The index of the probe, i.e. its bit number in a unit.
+ * @param from The index of the unit to search from (exclusive).
+ * @param unit Pointer to a variable which will hold the index of the
+ *             first transition after 'from'. Must not be NULL.
+ *
+ * @return TRUE if a transition was found, FALSE otherwise (or upon errors).
+ */
+SR_API gboolean sr_datastore_edge_next(struct sr_datastore *ds, int probe,
+		uint64_t from, uint64_t *unit)
+{
+	uint64_t c, o;
+
+	if (edges_check(ds, probe, __func__) != SR_OK || !unit)
+		return FALSE;
+
+	if (from >= ds->num_units)
+		return FALSE;
+
+	c = (from + 1) / DATASTORE_CHUNKSIZE;
+	o = (from + 1) % DATASTORE_CHUNKSIZE;
+	for (; c < chunks_used(ds); c++, o = 0) {
+		if (chunk_edge_next(ds, c, probe, o, unit))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Find the previous transition of a probe in the specified datastore.
+ *
+ * @param ds The datastore. Must not be NULL, and must have its edge index
+ *           enabled via sr_datastore_edges_set().
+ * @param probe The index of the probe, i.e. its bit number in a unit.
+ * @param from The index of the unit to search from (exclusive).
+ * @param unit Pointer to a variable which will hold the index of the
+ *             last transition before 'from'. Must not be NULL.
+ *
+ * @return TRUE if a transition was found, FALSE otherwise (or upon errors).
+ */
+SR_API gboolean sr_datastore_edge_prev(struct sr_datastore *ds, int probe,
+		uint64_t from, uint64_t *unit)
+{
+	uint64_t c, o;
+
+	if (edges_check(ds, probe, __func__) != SR_OK || !unit)
+		return FALSE;
+
+	from = MIN(from, ds->num_units);
+	c = from / DATASTORE_CHUNKSIZE;
+	o = from % DATASTORE_CHUNKSIZE;
+	while (TRUE) {
+		if (c < chunks_used(ds) && o > 0 &&
+		    chunk_edge_prev(ds, c, probe, o, unit))
+			return TRUE;
+		if (c == 0)
+			return FALSE;
+		c--;
+		o = DATASTORE_CHUNKSIZE;
+	}
+}
+
+/**
+ * Count the transitions of a probe in a range of the specified datastore.
+ *
+ * @param ds The datastore. Must not be NULL, and must have its edge index
+ *           enabled via sr_datastore_edges_set().
+ * @param probe The index of the probe, i.e. its bit number in a unit.
+ * @param start_unit The index of the first unit of the range.
+ * @param count The number of units in the range. The range must lie
+ *              within the units stored in the datastore.
+ * @param num Pointer to a variable which will hold the number of
+ *            transitions in the range. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_datastore_edge_count(struct sr_datastore *ds, int probe,
+		uint64_t start_unit, uint64_t count, uint64_t *num)
+{
+	uint64_t c, start, end, total;
+	int ret;
+
+	if ((ret = edges_check(ds, probe, __func__)) != SR_OK)
+		return ret;
+
+	if (!num) {
+		sr_err("%s: num was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (start_unit > ds->num_units || count > ds->num_units - start_unit) {
+		sr_err("%s: range %" PRIu64 "+%" PRIu64 " exceeds the %" PRIu64
+		       " stored units", __func__, start_unit, count,
+		       ds->num_units);
+		return SR_ERR_ARG;
+	}
+
+	total = 0;
+	end = start_unit + count;
+	for (c = start_unit / DATASTORE_CHUNKSIZE;
+	     c * DATASTORE_CHUNKSIZE < end; c++) {
+		start = c == start_unit / DATASTORE_CHUNKSIZE ?
+			start_unit % DATASTORE_CHUNKSIZE : 0;
+		total += chunk_edge_count(ds, c, probe, start,
+				MIN(end - c * DATASTORE_CHUNKSIZE,
+				    (uint64_t)DATASTORE_CHUNKSIZE));
+	}
+	*num = total;
 
 	return SR_OK;
 }
@@ -99,8 +1196,8 @@ SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds)
 /**
  * Destroy the specified datastore and free the memory used by it.
  *
- * This will free the memory used by the data in the datastore's 'chunklist',
- * by the chunklist data structure itself, and by the datastore struct.
+ * This will free the memory used by the datastore's chunks, by the chunk
+ * array itself, and by the datastore struct.
  *
  * @param ds The datastore to destroy.
  *
@@ -108,22 +1205,108 @@ SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds)
  */
 SR_API int sr_datastore_destroy(struct sr_datastore *ds)
 {
-	GSList *chunk;
+	uint64_t i;
+	int p;
 
 	if (!ds) {
 		sr_err("%s: ds was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
-	for (chunk = ds->chunklist; chunk; chunk = chunk->next)
-		g_free(chunk->data);
-	g_slist_free(ds->chunklist);
+	for (i = 0; i < ds->num_chunks && ds->chunks; i++) {
+		if (i < ds->reserved_chunks)
+			continue;
+		if (ds->packed_sizes && ds->packed_sizes[i])
+			g_free(ds->chunks[i]);
+		else
+			sr_pool_free(ds->chunks[i], chunk_bytes(ds));
+	}
+	sr_pool_release(ds->reserved, ds->reserved_chunks * chunk_bytes(ds));
+	g_free(ds->chunks);
+	g_free(ds->packed_sizes);
+	g_free(ds->unpacked);
+	g_free(ds->expanded);
+	for (i = 0; i < DATASTORE_SUMMARY_LEVELS && ds->levels; i++)
+		g_free(ds->levels[i].entries);
+	g_free(ds->levels);
+	g_free(ds->summary_acc);
+	for (i = 0; i < ds->num_edge_chunks; i++) {
+		for (p = 0; p < ds->ds_unitsize * 8 && ds->edges[i].offsets;
+		     p++)
+			g_free(ds->edges[i].offsets[p]);
+		g_free(ds->edges[i].counts);
+		g_free(ds->edges[i].sizes);
+		g_free(ds->edges[i].offsets);
+		g_free(ds->edges[i].prev);
+	}
+	g_free(ds->edges);
+	g_free(ds->edges_last);
+
+#ifdef HAVE_SYS_MMAN_H
+	if (ds->filename) {
+		if (ds->tail_map)
+			munmap(ds->tail_map, chunk_bytes(ds));
+		if (ds->read_map)
+			munmap(ds->read_map, chunk_bytes(ds));
+		close(ds->fd);
+		g_unlink(ds->filename);
+		g_free(ds->filename);
+	}
+#endif
+
 	g_free(ds);
 	ds = NULL;
 
 	return SR_OK;
 }
 
+/*
+ * Append 'units' units to the datastore's chunks, and feed them to the
+ * summary and the edge index.
+ */
+static int tail_append(struct sr_datastore *ds, const uint8_t *data,
+		       uint64_t units)
+{
+	uint64_t stored, n;
+	uint8_t *chunk;
+	int ret;
+
+	for (stored = 0; stored < units; stored += n) {
+		/* No more free space left, allocate a new chunk. */
+		if (ds->num_chunks == 0 ||
+		    ds->last_fill == DATASTORE_CHUNKSIZE) {
+			if ((ret = new_chunk(ds)) != SR_OK) {
+				sr_err("%s: couldn't allocate new chunk",
+				       __func__);
+				return ret;
+			}
+		}
+
+		/* Append to the tail chunk, as much as fits. */
+		if (!(chunk = chunk_stored(ds, ds->num_chunks - 1)))
+			return SR_ERR;
+		n = MIN(units - stored, DATASTORE_CHUNKSIZE - ds->last_fill);
+		if (ds->ds_unitbits)
+			sr_logic_pack(data + stored, n, ds->ds_unitbits, chunk,
+				      ds->last_fill);
+		else
+			memcpy(chunk + ds->last_fill * ds->ds_unitsize,
+			       data + stored * ds->ds_unitsize,
+			       n * ds->ds_unitsize);
+		ds->last_fill += n;
+	}
+
+	if (ds->summarize && (ret = summary_feed(ds, data, units)) != SR_OK)
+		return ret;
+
+	if (ds->index_edges && (ret = edges_feed(ds, data, units)) != SR_OK)
+		return ret;
+
+	ds->num_units += units;
+
+	return SR_OK;
+}
+
 /**
  * Append some data to the specified datastore.
  *
@@ -140,7 +1323,8 @@ SR_API int sr_datastore_destroy(struct sr_datastore *ds)
  *           Must not be NULL.
  * @param data Pointer to the memory buffer containing the data to add.
  *             Must not be NULL.
- * @param length Length of the data to add (in number of bytes).
+ * @param length Length of the data to add (in number of bytes). Units of
+ *               packed datastores are added one byte each.
  * @param in_unitsize The unit size (>= 1) of the input data.
  * @param probelist Pointer to a list of integers (probe numbers). The probe
  *                  numbers in this list are 1-based, i.e. the first probe
@@ -151,11 +1335,9 @@ SR_API int sr_datastore_destroy(struct sr_datastore *ds)
  *         is returned, the value/state of 'ds' is undefined.
  */
 SR_API int sr_datastore_put(struct sr_datastore *ds, void *data,
-		unsigned int length, int in_unitsize, const int *probelist)
+		uint64_t length, int in_unitsize, const int *probelist)
 {
-	unsigned int stored;
-	int capacity, size, num_chunks, chunk_bytes_free, chunk_offset;
-	gpointer chunk;
+	int ret;
 
 	if (!ds) {
 		sr_err("%s: ds was NULL", __func__);
@@ -184,85 +1366,365 @@ SR_API int sr_datastore_put(struct sr_datastore *ds, void *data,
 		return SR_ERR_ARG;
 	}
 
-	/* Get the last chunk in the list, or create a new one if needed. */
-	if (ds->chunklist == NULL) {
-		if (!(chunk = new_chunk(&ds))) {
-			sr_err("%s: couldn't allocate new chunk", __func__);
-			return SR_ERR_MALLOC;
-		}
-	} else {
-		chunk = g_slist_last(ds->chunklist)->data;
+	SR_TRACE2(datastore_put_entry, ds, length);
+	ret = tail_append(ds, data, length / ds->ds_unitsize);
+	SR_TRACE1(datastore_put_return, ret);
+
+	return ret;
+}
+
+/**
+ * Append run-length encoded logic data to a datastore.
+ *
+ * The runs are expanded straight into the datastore's chunks, without
+ * going through a buffer of plain samples first.
+ *
+ * @param ds The datastore. Must not be NULL.
+ * @param rle The payload of an SR_DF_LOGIC_RLE packet, with the same
+ *            unitsize as the datastore. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments. If something other than SR_OK
+ *         is returned, the value/state of 'ds' is undefined.
+ */
+SR_API int sr_datastore_put_rle(struct sr_datastore *ds,
+		const struct sr_datafeed_logic_rle *rle)
+{
+	uint8_t block[DATASTORE_RLE_BLOCK];
+	uint64_t run, offset, length, units;
+	uint8_t *chunk;
+	int ret;
+
+	if (!ds || !rle) {
+		sr_err("%s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->ds_unitsize == 0 || rle->unitsize != ds->ds_unitsize) {
+		sr_err("%s: unitsize %d doesn't match the datastore's (%d)",
+		       __func__, rle->unitsize, ds->ds_unitsize);
+		return SR_ERR_ARG;
 	}
 
-	/* Get/calculate number of chunks, free space, etc. */
-	num_chunks = g_slist_length(ds->chunklist);
-	capacity = (num_chunks * DATASTORE_CHUNKSIZE);
-	chunk_bytes_free = capacity - (ds->ds_unitsize * ds->num_units);
-	chunk_offset = capacity - (DATASTORE_CHUNKSIZE * (num_chunks - 1))
-		       - chunk_bytes_free;
+	run = offset = 0;
+	while (ds->ds_unitbits && run < rle->num_runs) {
+		/* Expand a block at a time, and pack that. */
+		if ((ret = sr_logic_rle_expand(rle, &run, &offset, block,
+				sizeof(block), &length)) != SR_OK)
+			return ret;
+		if (length == 0)
+			break;
+		if ((ret = tail_append(ds, block, length)) != SR_OK)
+			return ret;
+	}
 
-	stored = 0;
-	while (stored < length) {
-		/* No more free space left, allocate a new chunk. */
-		if (chunk_bytes_free == 0) {
-			if (!(chunk = new_chunk(&ds))) {
+	while (run < rle->num_runs) {
+		if (ds->num_chunks == 0 ||
+		    ds->last_fill == DATASTORE_CHUNKSIZE) {
+			if ((ret = new_chunk(ds)) != SR_OK) {
 				sr_err("%s: couldn't allocate new chunk",
 				       __func__);
-				return SR_ERR_MALLOC;
+				return ret;
 			}
-			chunk_bytes_free = DATASTORE_CHUNKSIZE;
-			chunk_offset = 0;
 		}
 
-		if (length - stored > (unsigned int)chunk_bytes_free)
-			size = chunk_bytes_free;
-		else
-			/* Last part, won't fill up this chunk. */
-			size = length - stored;
+		/* Expand into the tail chunk, as much as fits. */
+		if (!(chunk = chunk_stored(ds, ds->num_chunks - 1)))
+			return SR_ERR;
+		chunk += ds->last_fill * ds->ds_unitsize;
+		if ((ret = sr_logic_rle_expand(rle, &run, &offset, chunk,
+				(DATASTORE_CHUNKSIZE - ds->last_fill) *
+				ds->ds_unitsize, &length)) != SR_OK)
+			return ret;
+		if (length == 0)
+			break;
+
+		units = length / ds->ds_unitsize;
+		ds->last_fill += units;
+		if (ds->summarize
+		    && (ret = summary_feed(ds, chunk, units)) != SR_OK)
+			return ret;
+		if (ds->index_edges
+		    && (ret = edges_feed(ds, chunk, units)) != SR_OK)
+			return ret;
+		ds->num_units += units;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Start iterating over a range of units in the specified datastore.
+ *
+ * The range is handed out by sr_datastore_iter_next() as a sequence of
+ * contiguous spans, one per chunk touched, without copying any data.
+ *
+ * @param ds The datastore to read from. Must not be NULL.
+ * @param iter Pointer to the iterator to initialize. Must not be NULL.
+ * @param start_unit The index of the first unit to read.
+ * @param count The number of units to read. The range must lie within
+ *              the units stored in the datastore.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_datastore_iter_init(struct sr_datastore *ds,
+		struct sr_datastore_iter *iter, uint64_t start_unit,
+		uint64_t count)
+{
+	if (!ds) {
+		sr_err("%s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!iter) {
+		sr_err("%s: iter was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (start_unit > ds->num_units || count > ds->num_units - start_unit) {
+		sr_err("%s: range %" PRIu64 "+%" PRIu64 " exceeds the %" PRIu64
+		       " stored units", __func__, start_unit, count,
+		       ds->num_units);
+		return SR_ERR_ARG;
+	}
+
+	iter->ds = ds;
+	iter->unit = start_unit;
+	iter->end = start_unit + count;
+
+	return SR_OK;
+}
 
-		memcpy(chunk + chunk_offset, data + stored, size);
-		chunk_bytes_free -= size;
-		stored += size;
+/**
+ * Get the next span of data from a datastore iterator.
+ *
+ * Each span is contiguous in memory and covers the rest of the range, or
+ * the rest of the current chunk, whichever is shorter. The data must not
+ * be modified. For memory-mapped, compressed or packed datastores it is
+ * only valid until the next call on the datastore. Units of packed
+ * datastores are handed out unpacked, one byte each.
+ *
+ * @param iter The iterator, initialized by sr_datastore_iter_init().
+ *             Must not be NULL.
+ * @param data Pointer to a variable which will point to the span's data.
+ *             Must not be NULL.
+ * @param length Pointer to a variable which will hold the span's length
+ *               (in number of bytes). Must not be NULL.
+ *
+ * @return TRUE if a span was returned, FALSE at the end of the range (or
+ *         upon errors).
+ */
+SR_API gboolean sr_datastore_iter_next(struct sr_datastore_iter *iter,
+		const void **data, uint64_t *length)
+{
+	uint64_t chunk, offset, units;
+	uint8_t *p;
+
+	if (!iter || !data || !length) {
+		sr_err("%s: invalid arguments", __func__);
+		return FALSE;
+	}
+
+	if (iter->unit >= iter->end)
+		return FALSE;
+
+	/* Every chunk holds the same number of units. */
+	chunk = iter->unit / DATASTORE_CHUNKSIZE;
+	offset = iter->unit % DATASTORE_CHUNKSIZE;
+	units = MIN(iter->end - iter->unit, DATASTORE_CHUNKSIZE - offset);
+
+	if (!(p = chunk_get(iter->ds, chunk))) {
+		iter->unit = iter->end;
+		return FALSE;
+	}
+
+	*data = p + offset * iter->ds->ds_unitsize;
+	*length = units * iter->ds->ds_unitsize;
+	iter->unit += units;
+
+	return TRUE;
+}
+
+/**
+ * Copy a range of units out of the specified datastore.
+ *
+ * @param ds The datastore to read from. Must not be NULL.
+ * @param start_unit The index of the first unit to read.
+ * @param count The number of units to read. The range must lie within
+ *              the units stored in the datastore.
+ * @param buf The buffer to copy the units to. Must not be NULL, and must
+ *            be at least count * ds_unitsize bytes in size.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if a chunk of a memory-mapped datastore can't be mapped.
+ */
+SR_API int sr_datastore_get_range(struct sr_datastore *ds,
+		uint64_t start_unit, uint64_t count, void *buf)
+{
+	struct sr_datastore_iter iter;
+	const void *data;
+	uint64_t length, copied;
+	int ret;
+
+	if (!buf) {
+		sr_err("%s: buf was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	ret = sr_datastore_iter_init(ds, &iter, start_unit, count);
+	if (ret != SR_OK)
+		return ret;
+
+	copied = 0;
+	while (sr_datastore_iter_next(&iter, &data, &length)) {
+		memcpy((uint8_t *)buf + copied, data, length);
+		copied += length;
+	}
+
+	if (copied != count * ds->ds_unitsize)
+		return SR_ERR;
+
+	return SR_OK;
+}
+
+/**
+ * Get the data of a datastore chunk, as stored.
+ *
+ * Unlike the data returned by datastore iterators, the units of packed
+ * datastores are still packed (see sr_datastore_unitbits_set()). For
+ * memory-mapped or compressed datastores the data is only valid until
+ * the next call on the datastore.
+ *
+ * @param ds The datastore. Must not be NULL.
+ * @param chunk The index of the chunk. Must be less than num_chunks.
+ *
+ * @return The chunk's data, or NULL upon errors.
+ *
+ * @private
+ */
+SR_PRIV const uint8_t *sr_datastore_chunk_data(struct sr_datastore *ds,
+		uint64_t chunk)
+{
+	if (!ds || chunk >= ds->num_chunks) {
+		sr_err("%s: invalid arguments", __func__);
+		return NULL;
+	}
+
+	return chunk_stored(ds, chunk);
+}
+
+#ifdef HAVE_SYS_MMAN_H
+/*
+ * Grow the datastore's file by one chunk and map the new chunk. The old
+ * tail chunk is full by now, so it's unmapped and only lives on in the
+ * file (and whatever of it the OS keeps cached).
+ */
+static int new_chunk_mapped(struct sr_datastore *ds)
+{
+	uint64_t offset;
+	void *map;
+
+	offset = ds->num_chunks * chunk_bytes(ds);
+	if (ftruncate(ds->fd, offset + chunk_bytes(ds)) < 0) {
+		sr_err("%s: failed to grow datastore file: %s", __func__,
+		       g_strerror(errno));
+		return SR_ERR;
+	}
+
+	map = mmap(NULL, chunk_bytes(ds), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   ds->fd, offset);
+	if (map == MAP_FAILED) {
+		sr_err("%s: failed to map new chunk: %s", __func__,
+		       g_strerror(errno));
+		return SR_ERR;
 	}
 
-	ds->num_units += stored / ds->ds_unitsize;
+	if (ds->tail_map)
+		munmap(ds->tail_map, chunk_bytes(ds));
+	ds->tail_map = map;
+	ds->num_chunks++;
+	ds->last_fill = 0;
 
 	return SR_OK;
 }
+#endif
 
 /**
- * Allocate a new memory chunk, append it to the datastore's chunklist.
+ * Allocate a new memory chunk, append it to the datastore's chunk array.
  *
- * The newly allocated chunk is added to the datastore's chunklist by this
- * function, and the return value additionally points to the new chunk.
+ * The chunk array grows geometrically, so appending a chunk takes
+ * amortized constant time. The new chunk becomes the datastore's tail
+ * chunk, with nothing stored in it yet.
  *
- * The allocated memory is guaranteed to be cleared.
+ * The chunk is carved from the datastore's reserved memory while that
+ * lasts (see sr_datastore_reserve()), and taken from the buffer pool
+ * (see sr_pool_alloc()) after that. Its contents are undefined; only the
+ * first 'last_fill' units are ever read.
  *
  * @todo This function should use the datastore's 'chunksize' field instead
  *       of hardcoding DATASTORE_CHUNKSIZE.
- * @todo Return int, so we can return SR_OK / SR_ERR_ARG / SR_ERR_MALLOC?
  *
- * @param ds Pointer to a variable which holds the datastore structure.
- *           Must not be NULL. The contents of 'ds' are modified in-place.
+ * @param ds The datastore. Must not be NULL.
  *
- * @return Pointer to the newly allocated chunk, or NULL upon failure.
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         SR_ERR if a memory-mapped datastore's file can't be grown.
  */
-static gpointer new_chunk(struct sr_datastore **ds)
+static int new_chunk(struct sr_datastore *ds)
 {
+	void **new_chunks;
+	uint64_t *new_sizes, new_size;
 	gpointer chunk;
 
 	/* Note: Caller checked that ds != NULL. */
 
-	chunk = g_try_malloc0(DATASTORE_CHUNKSIZE * (*ds)->ds_unitsize);
+#ifdef HAVE_SYS_MMAN_H
+	if (ds->filename)
+		return new_chunk_mapped(ds);
+#endif
+
+	if (ds->num_chunks == ds->chunks_size) {
+		new_size = ds->chunks_size ?
+			   ds->chunks_size * 2 : DATASTORE_CHUNKS_MIN;
+		new_chunks = g_try_realloc(ds->chunks,
+					   sizeof(void *) * new_size);
+		if (!new_chunks) {
+			sr_err("%s: chunk array malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		ds->chunks = new_chunks;
+		if (ds->compress) {
+			new_sizes = g_try_realloc(ds->packed_sizes,
+						  sizeof(uint64_t) * new_size);
+			if (!new_sizes) {
+				sr_err("%s: chunk size array malloc failed",
+				       __func__);
+				return SR_ERR_MALLOC;
+			}
+			ds->packed_sizes = new_sizes;
+		}
+		ds->chunks_size = new_size;
+	}
+
+	/* The current tail chunk is full, compress it. */
+	if (ds->compress && ds->num_chunks > 0)
+		chunk_seal(ds, ds->num_chunks - 1);
+
+	if (ds->num_chunks < ds->reserved_chunks)
+		chunk = ds->reserved + ds->num_chunks * chunk_bytes(ds);
+	else
+		chunk = sr_pool_alloc(chunk_bytes(ds));
 	if (!chunk) {
 		sr_err("%s: chunk malloc failed (ds_unitsize was %u)",
-		       __func__, (*ds)->ds_unitsize);
-		return NULL; /* TODO: SR_ERR_MALLOC later? */
+		       __func__, ds->ds_unitsize);
+		return SR_ERR_MALLOC;
 	}
 
-	(*ds)->chunklist = g_slist_append((*ds)->chunklist, chunk);
+	if (ds->compress)
+		ds->packed_sizes[ds->num_chunks] = 0;
+	ds->chunks[ds->num_chunks++] = chunk;
+	ds->last_fill = 0;
 
-	return chunk; /* TODO: SR_OK later? */
+	return SR_OK;
 }
 
 /** @} */
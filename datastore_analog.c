@@ -0,0 +1,893 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "datastore: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/**
+ * @file
+ *
+ * Storing analog samples, one column per probe.
+ */
+
+/**
+ * @addtogroup grp_datastore
+ *
+ * An analog datastore keeps the samples of SR_DF_ANALOG and
+ * SR_DF_ANALOG_RAW packets in a column per probe, so one probe's samples
+ * can be read or drawn without touching the others. Samples are stored
+ * either as floats, or as 16-bit codes with a scale and offset per probe
+ * (half the size, and lossless for 8 and 16 bit ADCs whose codes arrive
+ * as SR_DF_ANALOG_RAW). The frames a scope marks with SR_DF_FRAME_BEGIN
+ * and SR_DF_FRAME_END are recorded along with the samples.
+ *
+ * @{
+ */
+
+/** @cond PRIVATE */
+/* Initial number of entries in the chunk and frame arrays. */
+#define ANALOG_CHUNKS_MIN 16
+/** @endcond */
+
+/* Column of probe 'p' in chunk 'c'. */
+static void *column(const struct sr_analog_datastore *ads, uint64_t c, int p)
+{
+	return ads->chunks[c * ads->num_probes + p];
+}
+
+/* Value of sample 'i' of a column of probe 'p'. */
+static float column_value(const struct sr_analog_datastore *ads,
+			  const void *col, int p, uint64_t i)
+{
+	if (ads->format == SR_ANALOG_FLOAT)
+		return ((const float *)col)[i];
+
+	return ((const int16_t *)col)[i] * ads->scales[p].scale
+	       + ads->scales[p].offset;
+}
+
+/* The code of probe 'p' closest to 'value', clamped to the int16 range. */
+static int16_t quantize(const struct sr_analog_datastore *ads, int p,
+			float value)
+{
+	float code;
+
+	code = (value - ads->scales[p].offset) / ads->scales[p].scale;
+	if (!(code > INT16_MIN))
+		return INT16_MIN;
+	if (code >= INT16_MAX)
+		return INT16_MAX;
+
+	return code < 0 ? (int16_t)(code - 0.5f) : (int16_t)(code + 0.5f);
+}
+
+/*
+ * Append an entry (minimum and maximum) to level 'level' of probe 'p''s
+ * summary pyramid, merging every two entries into one of the next level.
+ */
+static int summary_append(struct sr_analog_datastore *ads, int p, int level,
+			  const float *entry)
+{
+	struct sr_datastore_level *l;
+	uint8_t *new_entries;
+	float *a, *merged;
+	uint64_t new_size;
+
+	if (level >= DATASTORE_SUMMARY_LEVELS)
+		return SR_OK;
+
+	l = &ads->levels[p * DATASTORE_SUMMARY_LEVELS + level];
+	if (l->num_entries == l->size) {
+		new_size = l->size ? l->size * 2 : ANALOG_CHUNKS_MIN;
+		new_entries = g_try_realloc(l->entries,
+					    2 * sizeof(float) * new_size);
+		if (!new_entries) {
+			sr_err("%s: summary level malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		l->entries = new_entries;
+		l->size = new_size;
+	}
+
+	a = (float *)l->entries + 2 * l->num_entries;
+	a[0] = entry[0];
+	a[1] = entry[1];
+	l->num_entries++;
+	ads->num_levels = MAX(ads->num_levels, level + 1);
+
+	if (l->num_entries % 2)
+		return SR_OK;
+
+	a -= 2;
+	merged = ads->summary_acc + 2 * ads->num_probes;
+	merged[0] = MIN(a[0], a[2]);
+	merged[1] = MAX(a[1], a[3]);
+
+	return summary_append(ads, p, level + 1, merged);
+}
+
+/* Accumulate 'n' newly stored samples, from sample 'first' on. */
+static int summary_feed(struct sr_analog_datastore *ads, uint64_t first,
+			uint64_t n)
+{
+	const void *col;
+	float *acc, v;
+	uint64_t i, c, o;
+	int p, ret;
+
+	acc = ads->summary_acc;
+	for (i = first; i < first + n; i++) {
+		c = i / DATASTORE_CHUNKSIZE;
+		o = i % DATASTORE_CHUNKSIZE;
+		for (p = 0; p < ads->num_probes; p++) {
+			col = column(ads, c, p);
+			v = column_value(ads, col, p, o);
+			acc[2 * p] = MIN(acc[2 * p], v);
+			acc[2 * p + 1] = MAX(acc[2 * p + 1], v);
+		}
+
+		if (++ads->summary_fill < UINT64_C(1) << DATASTORE_SUMMARY_BASE)
+			continue;
+
+		for (p = 0; p < ads->num_probes; p++) {
+			ret = summary_append(ads, p, 0, acc + 2 * p);
+			if (ret != SR_OK)
+				return ret;
+			acc[2 * p] = FLT_MAX;
+			acc[2 * p + 1] = -FLT_MAX;
+		}
+		ads->summary_fill = 0;
+	}
+
+	return SR_OK;
+}
+
+/* Allocate the columns of a new tail chunk. */
+static int new_chunk(struct sr_analog_datastore *ads)
+{
+	void **new_chunks;
+	uint64_t new_size;
+	int p;
+
+	if (ads->num_chunks == ads->chunks_size) {
+		new_size = ads->chunks_size ?
+			   ads->chunks_size * 2 : ANALOG_CHUNKS_MIN;
+		new_chunks = g_try_realloc(ads->chunks, sizeof(void *) *
+					   new_size * ads->num_probes);
+		if (!new_chunks) {
+			sr_err("%s: chunk array malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		ads->chunks = new_chunks;
+		ads->chunks_size = new_size;
+	}
+
+	for (p = 0; p < ads->num_probes; p++) {
+		ads->chunks[ads->num_chunks * ads->num_probes + p] =
+			sr_pool_alloc((uint64_t)DATASTORE_CHUNKSIZE *
+				      ads->sample_size);
+		if (!ads->chunks[ads->num_chunks * ads->num_probes + p]) {
+			sr_err("%s: chunk malloc failed", __func__);
+			while (p--)
+				sr_pool_free(column(ads, ads->num_chunks, p),
+					     (uint64_t)DATASTORE_CHUNKSIZE *
+					     ads->sample_size);
+			return SR_ERR_MALLOC;
+		}
+	}
+	ads->num_chunks++;
+
+	return SR_OK;
+}
+
+/* Bookkeeping once 'n' more samples have been written to the columns. */
+static int samples_added(struct sr_analog_datastore *ads, uint64_t n)
+{
+	int ret;
+
+	if (ads->summarize &&
+	    (ret = summary_feed(ads, ads->num_samples, n)) != SR_OK)
+		return ret;
+
+	ads->num_samples += n;
+	if (ads->in_frame)
+		ads->frames[ads->num_frames - 1].num_samples =
+			ads->num_samples -
+			ads->frames[ads->num_frames - 1].first_sample;
+
+	return SR_OK;
+}
+
+/* Copy the codes of probe 'p' of a raw packet into an int16 column. */
+#define COPY_CODES(type) do { \
+	const type *in = (const type *)raw->data + done * num_probes + p; \
+	for (i = 0; i < k; i++) \
+		icol[i] = in[i * num_probes]; \
+} while (0)
+
+/*
+ * Append 'n' samples. The values are in 'values', interleaved by probe. If
+ * 'raw' is not NULL, its codes are stored instead of quantizing the values.
+ */
+static int append(struct sr_analog_datastore *ads, const float *values,
+		  const struct sr_datafeed_analog_raw *raw, uint64_t n)
+{
+	const float *in;
+	uint64_t i, k, o, done;
+	void *col;
+	float *fcol;
+	int16_t *icol;
+	int p, num_probes, ret;
+
+	num_probes = ads->num_probes;
+	for (done = 0; done < n; done += k) {
+		if (ads->num_samples == ads->num_chunks * DATASTORE_CHUNKSIZE
+		    && (ret = new_chunk(ads)) != SR_OK)
+			return ret;
+
+		o = ads->num_samples % DATASTORE_CHUNKSIZE;
+		k = MIN(n - done, DATASTORE_CHUNKSIZE - o);
+		for (p = 0; p < num_probes; p++) {
+			col = column(ads, ads->num_chunks - 1, p);
+			fcol = (float *)col + o;
+			icol = (int16_t *)col + o;
+			in = values ? values + done * num_probes + p : NULL;
+			if (ads->format == SR_ANALOG_FLOAT) {
+				for (i = 0; i < k; i++)
+					fcol[i] = in[i * num_probes];
+			} else if (raw && raw->sample_size == 2) {
+				COPY_CODES(int16_t);
+			} else if (raw && raw->is_signed) {
+				COPY_CODES(int8_t);
+			} else if (raw) {
+				COPY_CODES(uint8_t);
+			} else {
+				for (i = 0; i < k; i++)
+					icol[i] = quantize(ads, p,
+							   in[i * num_probes]);
+			}
+		}
+
+		if ((ret = samples_added(ads, k)) != SR_OK)
+			return ret;
+	}
+
+	return SR_OK;
+}
+
+/* Make sure the conversion buffer holds at least 'n' floats. */
+static float *convert_get(struct sr_analog_datastore *ads, uint64_t n)
+{
+	float *new_convert;
+
+	if (ads->convert_size >= n)
+		return ads->convert;
+
+	if (!(new_convert = g_try_realloc(ads->convert, n * sizeof(float)))) {
+		sr_err("%s: conversion buffer malloc failed", __func__);
+		return NULL;
+	}
+	ads->convert = new_convert;
+	ads->convert_size = n;
+
+	return new_convert;
+}
+
+/* Record the measured quantity of the first packet, and check the rest. */
+static void mq_check(struct sr_analog_datastore *ads, int mq, int unit,
+		     uint64_t mqflags)
+{
+	if (!ads->have_mq) {
+		ads->mq = mq;
+		ads->unit = unit;
+		ads->mqflags = mqflags;
+		ads->have_mq = TRUE;
+	} else if (mq != ads->mq || unit != ads->unit) {
+		sr_dbg("Samples of another MQ or unit are stored as the "
+		       "first ones.");
+	}
+}
+
+static int put_analog(struct sr_analog_datastore *ads,
+		      const struct sr_datafeed_analog *analog)
+{
+	if (analog->num_samples <= 0)
+		return SR_OK;
+
+	if (ads->format == SR_ANALOG_INT16 && !ads->scales) {
+		sr_err("%s: int16 datastore needs scales for SR_DF_ANALOG",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	mq_check(ads, analog->mq, analog->unit, analog->mqflags);
+
+	return append(ads, analog->data, NULL, analog->num_samples);
+}
+
+static int put_analog_raw(struct sr_analog_datastore *ads,
+			  const struct sr_datafeed_analog_raw *raw)
+{
+	uint64_t n;
+	float *values;
+	gboolean direct;
+	int p, ret;
+
+	if (raw->num_samples <= 0)
+		return SR_OK;
+
+	if (raw->num_probes != ads->num_probes) {
+		sr_err("%s: packet has %d probes, datastore has %d", __func__,
+		       raw->num_probes, ads->num_probes);
+		return SR_ERR_ARG;
+	}
+
+	/* Codes which fit an int16 are kept, if the scales match. */
+	if (ads->format == SR_ANALOG_INT16 && !ads->scales &&
+	    (ret = sr_analog_datastore_scales_set(ads, raw->scales)) != SR_OK)
+		return ret;
+	direct = ads->format == SR_ANALOG_INT16 &&
+		 (raw->sample_size == 1 ||
+		  (raw->sample_size == 2 && raw->is_signed));
+	for (p = 0; direct && p < ads->num_probes; p++)
+		direct = raw->scales[p].scale == ads->scales[p].scale &&
+			 raw->scales[p].offset == ads->scales[p].offset;
+
+	mq_check(ads, raw->mq, raw->unit, raw->mqflags);
+
+	if (direct)
+		return append(ads, NULL, raw, raw->num_samples);
+
+	n = (uint64_t)raw->num_samples * raw->num_probes;
+	if (!(values = convert_get(ads, n)))
+		return SR_ERR_MALLOC;
+	if ((ret = sr_analog_raw_to_float(raw, values)) != SR_OK)
+		return ret;
+
+	return append(ads, values, NULL, raw->num_samples);
+}
+
+static int frame_begin(struct sr_analog_datastore *ads)
+{
+	struct sr_analog_frame *new_frames;
+	uint64_t new_size;
+
+	if (ads->num_frames == ads->frames_size) {
+		new_size = ads->frames_size ?
+			   ads->frames_size * 2 : ANALOG_CHUNKS_MIN;
+		new_frames = g_try_realloc(ads->frames,
+				sizeof(struct sr_analog_frame) * new_size);
+		if (!new_frames) {
+			sr_err("%s: frame array malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		ads->frames = new_frames;
+		ads->frames_size = new_size;
+	}
+
+	ads->frames[ads->num_frames].first_sample = ads->num_samples;
+	ads->frames[ads->num_frames].num_samples = 0;
+	ads->num_frames++;
+	ads->in_frame = TRUE;
+
+	return SR_OK;
+}
+
+/**
+ * Create a new analog datastore.
+ *
+ * @param num_probes The number of probes (>= 1), as in the
+ *                   SR_DF_META_ANALOG packet of the acquisition.
+ * @param format The format the samples are stored in: SR_ANALOG_FLOAT, or
+ *               SR_ANALOG_INT16 for 16-bit codes. An SR_ANALOG_INT16
+ *               datastore takes its scales from the first SR_DF_ANALOG_RAW
+ *               packet, unless they're set with
+ *               sr_analog_datastore_scales_set() beforehand.
+ * @param ads Pointer to a variable which will hold the newly created
+ *            datastore structure.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments. If something other than SR_OK
+ *         is returned, the value of 'ads' is undefined.
+ */
+SR_API int sr_analog_datastore_new(int num_probes, int format,
+		struct sr_analog_datastore **ads)
+{
+	if (!ads) {
+		sr_err("%s: ads was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (num_probes <= 0) {
+		sr_err("%s: num_probes was %d, but it must be >= 1",
+		       __func__, num_probes);
+		return SR_ERR_ARG;
+	}
+
+	if (format != SR_ANALOG_FLOAT && format != SR_ANALOG_INT16) {
+		sr_err("%s: invalid format %d", __func__, format);
+		return SR_ERR_ARG;
+	}
+
+	if (!(*ads = g_try_malloc0(sizeof(struct sr_analog_datastore)))) {
+		sr_err("%s: ads malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	(*ads)->num_probes = num_probes;
+	(*ads)->format = format;
+	(*ads)->sample_size = format == SR_ANALOG_FLOAT ?
+			      sizeof(float) : sizeof(int16_t);
+
+	return SR_OK;
+}
+
+/**
+ * Set the scale and offset of each probe's codes.
+ *
+ * This is only meaningful for SR_ANALOG_INT16 datastores, and must be
+ * called before any samples are added. Values outside the range the codes
+ * can represent are clamped.
+ *
+ * @param ads The datastore. Must not be NULL.
+ * @param scales One scale per probe. Must not be NULL. The scales are copied.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments (or if the datastore already
+ *         holds samples).
+ */
+SR_API int sr_analog_datastore_scales_set(struct sr_analog_datastore *ads,
+		const struct sr_analog_scale *scales)
+{
+	struct sr_analog_scale *new_scales;
+	int p;
+
+	if (!ads || !scales) {
+		sr_err("%s: ads and scales may not be NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ads->num_samples > 0) {
+		sr_err("%s: datastore already holds samples", __func__);
+		return SR_ERR_ARG;
+	}
+
+	for (p = 0; p < ads->num_probes; p++) {
+		if (scales[p].scale == 0) {
+			sr_err("%s: scale of probe %d was 0", __func__, p);
+			return SR_ERR_ARG;
+		}
+	}
+
+	new_scales = g_try_malloc(sizeof(struct sr_analog_scale) *
+				  ads->num_probes);
+	if (!new_scales) {
+		sr_err("%s: scales malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	memcpy(new_scales, scales,
+	       sizeof(struct sr_analog_scale) * ads->num_probes);
+	g_free(ads->scales);
+	ads->scales = new_scales;
+
+	return SR_OK;
+}
+
+/**
+ * Enable or disable the summary pyramid of the specified analog datastore.
+ *
+ * This works like sr_datastore_summary_set(), with each entry holding the
+ * minimum and maximum of the samples of one probe it covers. This must be
+ * called before any samples are added.
+ *
+ * @param ads The datastore. Must not be NULL.
+ * @param enabled TRUE to maintain a summary, FALSE otherwise.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments (or if the datastore already
+ *         holds samples).
+ */
+SR_API int sr_analog_datastore_summary_set(struct sr_analog_datastore *ads,
+		gboolean enabled)
+{
+	int p;
+
+	if (!ads) {
+		sr_err("%s: ads was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ads->num_samples > 0) {
+		sr_err("%s: datastore already holds samples", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (enabled == ads->summarize)
+		return SR_OK;
+
+	if (!enabled) {
+		g_free(ads->levels);
+		g_free(ads->summary_acc);
+		ads->levels = NULL;
+		ads->summary_acc = NULL;
+		ads->summarize = FALSE;
+		return SR_OK;
+	}
+
+	ads->levels = g_try_malloc0(sizeof(struct sr_datastore_level) *
+				    DATASTORE_SUMMARY_LEVELS * ads->num_probes);
+	/* Current entry of each probe, and scratch space for merging. */
+	ads->summary_acc = g_try_malloc(sizeof(float) *
+					2 * (ads->num_probes + 1));
+	if (!ads->levels || !ads->summary_acc) {
+		sr_err("%s: summary malloc failed", __func__);
+		g_free(ads->levels);
+		g_free(ads->summary_acc);
+		ads->levels = NULL;
+		ads->summary_acc = NULL;
+		return SR_ERR_MALLOC;
+	}
+	for (p = 0; p < ads->num_probes; p++) {
+		ads->summary_acc[2 * p] = FLT_MAX;
+		ads->summary_acc[2 * p + 1] = -FLT_MAX;
+	}
+	ads->summary_fill = 0;
+	ads->summarize = TRUE;
+
+	return SR_OK;
+}
+
+/**
+ * Destroy the specified analog datastore, and free all of its memory.
+ *
+ * @param ads The datastore to destroy. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_analog_datastore_destroy(struct sr_analog_datastore *ads)
+{
+	uint64_t i;
+
+	if (!ads) {
+		sr_err("%s: ads was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	for (i = 0; i < ads->num_chunks * ads->num_probes; i++)
+		sr_pool_free(ads->chunks[i],
+			     (uint64_t)DATASTORE_CHUNKSIZE * ads->sample_size);
+	g_free(ads->chunks);
+	g_free(ads->scales);
+	g_free(ads->frames);
+	for (i = 0; ads->levels &&
+	     i < (uint64_t)DATASTORE_SUMMARY_LEVELS * ads->num_probes; i++)
+		g_free(ads->levels[i].entries);
+	g_free(ads->levels);
+	g_free(ads->summary_acc);
+	g_free(ads->convert);
+	g_free(ads);
+
+	return SR_OK;
+}
+
+/**
+ * Add a datafeed packet to the specified analog datastore.
+ *
+ * The samples of SR_DF_ANALOG and SR_DF_ANALOG_RAW packets are appended,
+ * and SR_DF_FRAME_BEGIN and SR_DF_FRAME_END delimit a frame. A frame
+ * begun while another one is still open ends that one. Other packets are
+ * ignored, so this can be called for every packet of an acquisition.
+ *
+ * The measured quantity, unit and flags of the first packet with samples
+ * are kept for the whole datastore.
+ *
+ * @param ads The datastore. Must not be NULL.
+ * @param packet The packet. Must not be NULL. SR_DF_ANALOG_RAW packets must
+ *               have as many probes as the datastore; SR_DF_ANALOG packets
+ *               are assumed to.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments. If something other than SR_OK
+ *         is returned, the state of 'ads' is undefined.
+ */
+SR_API int sr_analog_datastore_put(struct sr_analog_datastore *ads,
+		const struct sr_datafeed_packet *packet)
+{
+	if (!ads || !packet) {
+		sr_err("%s: ads and packet may not be NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	switch (packet->type) {
+	case SR_DF_ANALOG:
+		return put_analog(ads, packet->payload);
+	case SR_DF_ANALOG_RAW:
+		return put_analog_raw(ads, packet->payload);
+	case SR_DF_FRAME_BEGIN:
+		return frame_begin(ads);
+	case SR_DF_FRAME_END:
+		ads->in_frame = FALSE;
+		return SR_OK;
+	default:
+		return SR_OK;
+	}
+}
+
+/**
+ * Copy a range of one probe's samples out of the specified analog
+ * datastore, as floats.
+ *
+ * @param ads The datastore to read from. Must not be NULL.
+ * @param probe The index of the probe, starting at 0.
+ * @param start_sample The index of the first sample to read.
+ * @param count The number of samples to read. The range must lie within
+ *              the samples stored in the datastore.
+ * @param buf The buffer to copy the samples to. Must not be NULL, and must
+ *            hold at least 'count' floats.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_analog_datastore_get_range(struct sr_analog_datastore *ads,
+		int probe, uint64_t start_sample, uint64_t count, float *buf)
+{
+	const void *col;
+	uint64_t i, j, c, o, n;
+
+	if (!ads || !buf) {
+		sr_err("%s: ads and buf may not be NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (probe < 0 || probe >= ads->num_probes) {
+		sr_err("%s: invalid probe %d", __func__, probe);
+		return SR_ERR_ARG;
+	}
+
+	if (start_sample > ads->num_samples ||
+	    count > ads->num_samples - start_sample) {
+		sr_err("%s: range outside of the datastore", __func__);
+		return SR_ERR_ARG;
+	}
+
+	for (i = start_sample; i < start_sample + count; i += n) {
+		c = i / DATASTORE_CHUNKSIZE;
+		o = i % DATASTORE_CHUNKSIZE;
+		n = MIN(start_sample + count - i, DATASTORE_CHUNKSIZE - o);
+		col = column(ads, c, probe);
+		if (ads->format == SR_ANALOG_FLOAT) {
+			memcpy(buf, (const float *)col + o, n * sizeof(float));
+			buf += n;
+			continue;
+		}
+		for (j = 0; j < n; j++)
+			*buf++ = column_value(ads, col, probe, o + j);
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Query the summary pyramid of one probe of the specified analog datastore.
+ *
+ * This works like sr_datastore_summary_get(): it picks the coarsest level
+ * with at least one entry per pixel, and returns the entries covering the
+ * range.
+ *
+ * @param ads The datastore. Must not be NULL, and must have its summary
+ *            enabled via sr_analog_datastore_summary_set().
+ * @param probe The index of the probe, starting at 0.
+ * @param start_sample The index of the first sample of the range.
+ * @param count The number of samples in the range.
+ * @param width The number of pixels the range is drawn in. Must be > 0.
+ * @param summary Pointer to a struct which will hold the result. Must not
+ *                be NULL. The entries are only valid until the next call
+ *                to sr_analog_datastore_put() or
+ *                sr_analog_datastore_destroy().
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_analog_datastore_summary_get(struct sr_analog_datastore *ads,
+		int probe, uint64_t start_sample, uint64_t count,
+		uint64_t width, struct sr_analog_datastore_summary *summary)
+{
+	struct sr_datastore_level *l;
+	uint64_t per_pixel, first, last;
+	int level, shift;
+
+	if (!ads || !summary) {
+		sr_err("%s: ads or summary was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!ads->summarize) {
+		sr_err("%s: summary is not enabled", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (probe < 0 || probe >= ads->num_probes) {
+		sr_err("%s: invalid probe %d", __func__, probe);
+		return SR_ERR_ARG;
+	}
+
+	if (width == 0) {
+		sr_err("%s: width was 0", __func__);
+		return SR_ERR_ARG;
+	}
+
+	per_pixel = count / width;
+	level = 0;
+	while (level + 1 < ads->num_levels &&
+	       UINT64_C(1) << (DATASTORE_SUMMARY_BASE + level + 1) <= per_pixel)
+		level++;
+
+	l = &ads->levels[probe * DATASTORE_SUMMARY_LEVELS + level];
+	shift = DATASTORE_SUMMARY_BASE + level;
+	first = start_sample >> shift;
+	last = MIN((start_sample + count + (UINT64_C(1) << shift) - 1) >> shift,
+		   l->num_entries);
+
+	summary->samples_per_entry = UINT64_C(1) << shift;
+	summary->first_sample = first << shift;
+	summary->num_entries = first < last ? last - first : 0;
+	summary->entries = summary->num_entries ?
+			   (const float *)l->entries + 2 * first : NULL;
+
+	return SR_OK;
+}
+
+/**
+ * Get the number of samples in a chunk of an analog datastore.
+ *
+ * @param ads The datastore. Must not be NULL.
+ * @param chunk The index of the chunk. Must be less than num_chunks.
+ *
+ * @return The number of samples.
+ *
+ * @private
+ */
+SR_PRIV uint64_t sr_analog_datastore_chunk_samples(
+		const struct sr_analog_datastore *ads, uint64_t chunk)
+{
+	return MIN(ads->num_samples - chunk * DATASTORE_CHUNKSIZE,
+		   (uint64_t)DATASTORE_CHUNKSIZE);
+}
+
+/**
+ * Write the samples of a chunk of an analog datastore, as stored in
+ * session files: the columns of all probes back to back, little endian.
+ *
+ * @param ads The datastore. Must not be NULL.
+ * @param chunk The index of the chunk. Must be less than num_chunks.
+ * @param out The buffer to write to. Must hold num_probes * sample_size
+ *            times the number of samples in the chunk (see
+ *            sr_analog_datastore_chunk_samples()) bytes.
+ *
+ * @private
+ */
+SR_PRIV void sr_analog_datastore_chunk_write(
+		const struct sr_analog_datastore *ads, uint64_t chunk,
+		uint8_t *out)
+{
+	const int16_t *icol;
+	const float *fcol;
+	uint64_t i, n;
+	uint32_t bits;
+	int p;
+
+	n = sr_analog_datastore_chunk_samples(ads, chunk);
+	for (p = 0; p < ads->num_probes; p++) {
+		fcol = column(ads, chunk, p);
+		icol = column(ads, chunk, p);
+		for (i = 0; i < n; i++, out += ads->sample_size) {
+			if (ads->format == SR_ANALOG_FLOAT) {
+				memcpy(&bits, &fcol[i], sizeof(bits));
+				WL32(out, bits);
+			} else {
+				WL16(out, (uint16_t)icol[i]);
+			}
+		}
+	}
+}
+
+/**
+ * Append a chunk of samples as written by sr_analog_datastore_chunk_write().
+ *
+ * The datastore's samples must end at a chunk boundary, i.e. all chunks
+ * but the last one added this way must be full.
+ *
+ * @param ads The datastore. Must not be NULL.
+ * @param in The columns of the chunk.
+ * @param num_samples The number of samples in the chunk, at most
+ *                    DATASTORE_CHUNKSIZE.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments.
+ *
+ * @private
+ */
+SR_PRIV int sr_analog_datastore_chunk_read(struct sr_analog_datastore *ads,
+		const uint8_t *in, uint64_t num_samples)
+{
+	int16_t *icol;
+	float *fcol;
+	uint64_t i;
+	uint32_t bits;
+	int p, ret;
+
+	if (num_samples == 0)
+		return SR_OK;
+
+	if (ads->num_samples % DATASTORE_CHUNKSIZE ||
+	    num_samples > DATASTORE_CHUNKSIZE ||
+	    (ads->format == SR_ANALOG_INT16 && !ads->scales)) {
+		sr_err("%s: invalid chunk", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if ((ret = new_chunk(ads)) != SR_OK)
+		return ret;
+
+	for (p = 0; p < ads->num_probes; p++) {
+		fcol = column(ads, ads->num_chunks - 1, p);
+		icol = column(ads, ads->num_chunks - 1, p);
+		for (i = 0; i < num_samples; i++, in += ads->sample_size) {
+			if (ads->format == SR_ANALOG_FLOAT) {
+				bits = RL32(in);
+				memcpy(&fcol[i], &bits, sizeof(bits));
+			} else {
+				icol[i] = (int16_t)RL16(in);
+			}
+		}
+	}
+
+	return samples_added(ads, num_samples);
+}
+
+/**
+ * Add a frame to an analog datastore.
+ *
+ * @param ads The datastore. Must not be NULL.
+ * @param first_sample The index of the frame's first sample.
+ * @param num_samples The number of samples in the frame.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors.
+ *
+ * @private
+ */
+SR_PRIV int sr_analog_datastore_frame_add(struct sr_analog_datastore *ads,
+		uint64_t first_sample, uint64_t num_samples)
+{
+	int ret;
+
+	if ((ret = frame_begin(ads)) != SR_OK)
+		return ret;
+	ads->frames[ads->num_frames - 1].first_sample = first_sample;
+	ads->frames[ads->num_frames - 1].num_samples = num_samples;
+	ads->in_frame = FALSE;
+
+	return SR_OK;
+}
+
+/** @} */
@@ -0,0 +1,340 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "decimate: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/**
+ * @file
+ *
+ * Decimation of logic samples.
+ */
+
+/**
+ * @defgroup grp_decimate Decimation
+ *
+ * Decimation of logic samples.
+ *
+ * A decimator turns every 'factor' consecutive samples (a window) into
+ * one, dividing the samplerate by 'factor'. Windows may span several
+ * buffers; a window which isn't complete yet is kept in the decimator.
+ *
+ * SR_DECIMATE_SAMPLE keeps the first sample of each window, and drops
+ * everything which happened in between. SR_DECIMATE_OR and
+ * SR_DECIMATE_AND keep glitches of one polarity: a probe which was high
+ * (or low) for any sample of the window is high (or low) in the output.
+ * SR_DECIMATE_TRANSITION keeps the last sample of the window, except
+ * that a probe which changed in the window, but ended up at its previous
+ * output level again, is toggled; every window with a transition thus
+ * shows one in the output.
+ *
+ * With unit sizes of 1, 2, 4 and 8 bytes, windows are combined eight
+ * bytes at a time.
+ *
+ * The session can decimate all logic packets before they reach the
+ * datafeed callbacks, see sr_session_decimate_set().
+ *
+ * @{
+ */
+
+/* Sample 'i' of a buffer, with probe n in bit n. */
+static inline uint64_t sample_get(const uint8_t *buf, uint16_t unitsize,
+				  uint64_t i)
+{
+	const uint8_t *p;
+	uint64_t sample;
+	int b;
+
+	p = buf + i * unitsize;
+	if (unitsize == 1)
+		return p[0];
+
+	sample = 0;
+	for (b = 0; b < unitsize; b++)
+		sample |= (uint64_t)p[b] << (8 * b);
+
+	return sample;
+}
+
+static void sample_put(uint8_t *p, uint16_t unitsize, uint64_t sample)
+{
+	int b;
+
+	for (b = 0; b < unitsize; b++)
+		p[b] = sample >> (8 * b);
+}
+
+static inline uint64_t rotl(uint64_t x, unsigned int n)
+{
+	return (x << n) | (x >> (64 - n));
+}
+
+/* The value a window's combination starts out with. */
+static uint64_t acc_init(int mode)
+{
+	return mode == SR_DECIMATE_AND ? UINT64_MAX : 0;
+}
+
+/*
+ * Combine 'num_samples' samples into 'acc'. SR_DECIMATE_TRANSITION
+ * collects the probes which differ from the last output sample.
+ */
+static uint64_t window_scan(const struct sr_decimator *d, const uint8_t *p,
+			    uint64_t num_samples, uint64_t acc)
+{
+	const uint16_t u = d->unitsize;
+	uint8_t pattern[8];
+	uint64_t i, n, w, wacc, prev;
+	unsigned int sh;
+
+	i = 0;
+	prev = d->prev;
+	if (8 % u == 0 && num_samples * u >= 16) {
+		/* Eight bytes at a time, then fold the lanes together. */
+		for (i = 0; i < 8; i += u)
+			sample_put(pattern + i, u, prev);
+		memcpy(&prev, pattern, 8);
+		n = num_samples * u / 8;
+		wacc = acc_init(d->mode);
+		for (i = 0; i < n; i++) {
+			memcpy(&w, p + i * 8, 8);
+			if (d->mode == SR_DECIMATE_OR)
+				wacc |= w;
+			else if (d->mode == SR_DECIMATE_AND)
+				wacc &= w;
+			else
+				wacc |= w ^ prev;
+		}
+		for (sh = 32; sh >= 8U * u; sh /= 2) {
+			if (d->mode == SR_DECIMATE_AND)
+				wacc &= rotl(wacc, sh);
+			else
+				wacc |= rotl(wacc, sh);
+		}
+		/* All lanes hold the same value now. */
+		memcpy(pattern, &wacc, 8);
+		w = sample_get(pattern, u, 0);
+		if (d->mode == SR_DECIMATE_AND)
+			acc &= w;
+		else
+			acc |= w;
+		i = n * 8 / u;
+		prev = d->prev;
+	}
+
+	for (; i < num_samples; i++) {
+		w = sample_get(p, u, i);
+		if (d->mode == SR_DECIMATE_OR)
+			acc |= w;
+		else if (d->mode == SR_DECIMATE_AND)
+			acc &= w;
+		else
+			acc |= w ^ prev;
+	}
+
+	return acc;
+}
+
+/* The output sample of a complete window. */
+static uint64_t window_result(struct sr_decimator *d)
+{
+	uint64_t mask, out;
+
+	mask = d->unitsize >= 8 ? UINT64_MAX
+		: (UINT64_C(1) << (8 * d->unitsize)) - 1;
+
+	switch (d->mode) {
+	case SR_DECIMATE_SAMPLE:
+		out = d->first;
+		break;
+	case SR_DECIMATE_TRANSITION:
+		/* Toggle the probes which changed, but came back. */
+		out = d->last ^ (d->acc & ~(d->last ^ d->prev));
+		break;
+	default:
+		out = d->acc;
+		break;
+	}
+	out &= mask;
+	d->prev = out;
+	d->have_prev = TRUE;
+
+	return out;
+}
+
+/**
+ * Create a decimator.
+ *
+ * @param factor The number of samples to turn into one. Must be at
+ *               least 1.
+ * @param mode How to turn them into one (SR_DECIMATE_*).
+ * @param decimator Where to store the new decimator. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors.
+ */
+SR_API int sr_decimator_new(uint64_t factor, int mode,
+		struct sr_decimator **decimator)
+{
+	struct sr_decimator *d;
+
+	if (!decimator || factor == 0) {
+		sr_err("%s: decimator may not be NULL, factor not 0",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (mode != SR_DECIMATE_SAMPLE && mode != SR_DECIMATE_OR
+	    && mode != SR_DECIMATE_AND && mode != SR_DECIMATE_TRANSITION) {
+		sr_err("%s: invalid mode %d", __func__, mode);
+		return SR_ERR_ARG;
+	}
+
+	if (!(d = g_try_malloc0(sizeof(struct sr_decimator)))) {
+		sr_err("%s: decimator malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	d->factor = factor;
+	d->mode = mode;
+	d->acc = acc_init(mode);
+	*decimator = d;
+
+	return SR_OK;
+}
+
+/**
+ * Destroy a decimator.
+ *
+ * @param decimator The decimator. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_decimator_destroy(struct sr_decimator *decimator)
+{
+	if (!decimator)
+		return SR_ERR_ARG;
+
+	g_free(decimator);
+
+	return SR_OK;
+}
+
+/**
+ * Reset a decimator for a new acquisition.
+ *
+ * The window it had started on is dropped.
+ *
+ * @param decimator The decimator. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_decimator_reset(struct sr_decimator *decimator)
+{
+	if (!decimator)
+		return SR_ERR_ARG;
+
+	decimator->unitsize = 0;
+	decimator->fill = 0;
+	decimator->acc = acc_init(decimator->mode);
+	decimator->have_prev = FALSE;
+	decimator->samples_out = 0;
+
+	return SR_OK;
+}
+
+/**
+ * Decimate logic samples.
+ *
+ * For every window completed by the samples in 'data', one sample is
+ * written to 'out'. If the unit size differs from that of the last
+ * call, the decimator is reset first.
+ *
+ * @param decimator The decimator. Must not be NULL.
+ * @param data The samples. Must not be NULL.
+ * @param length The length of 'data', in bytes.
+ * @param unitsize The size of a sample, in bytes (1 to 8).
+ * @param out Where to write the decimated samples, with the same unit
+ *            size. Must have room for length / unitsize / factor + 1
+ *            samples. Must not be NULL.
+ * @param length_out Where to store the number of bytes written to 'out'.
+ *                   Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_decimate_logic(struct sr_decimator *decimator,
+		const uint8_t *data, uint64_t length, uint16_t unitsize,
+		uint8_t *out, uint64_t *length_out)
+{
+	struct sr_decimator *d;
+	uint64_t i, n, o, take;
+
+	if (!decimator || !data || !out || !length_out) {
+		sr_err("%s: arguments may not be NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (unitsize == 0 || unitsize > 8) {
+		sr_err("%s: invalid unit size %d", __func__, unitsize);
+		return SR_ERR_ARG;
+	}
+
+	d = decimator;
+	if (d->unitsize != unitsize) {
+		sr_decimator_reset(d);
+		d->unitsize = unitsize;
+	}
+
+	n = length / unitsize;
+	i = o = 0;
+	while (i < n) {
+		if (d->fill == 0) {
+			d->first = sample_get(data, unitsize, i);
+			if (!d->have_prev) {
+				d->prev = d->first;
+				d->have_prev = TRUE;
+			}
+		}
+
+		take = MIN(d->factor - d->fill, n - i);
+		if (d->mode != SR_DECIMATE_SAMPLE)
+			d->acc = window_scan(d, data + i * unitsize, take,
+					     d->acc);
+		d->fill += take;
+		i += take;
+		d->last = sample_get(data, unitsize, i - 1);
+		if (d->fill < d->factor)
+			break;
+
+		sample_put(out + o * unitsize, unitsize, window_result(d));
+		o++;
+		d->fill = 0;
+		d->acc = acc_init(d->mode);
+	}
+	d->samples_out += o;
+	*length_out = o * unitsize;
+
+	return SR_OK;
+}
+
+/** @} */
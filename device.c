@@ -18,6 +18,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <glib.h>
 #include "config.h" /* Needed for HAVE_LIBUSB_1_0 and others. */
 #include "libsigrok.h"
@@ -26,11 +27,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "device: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 /**
  * @file
@@ -343,6 +339,101 @@ SR_API int sr_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 	return ret;
 }
 
+/** @private */
+SR_PRIV void sr_dev_stats_start(struct sr_dev_stats *stats)
+{
+	memset(stats, 0, sizeof(struct sr_dev_stats));
+	stats->start_time = stats->window_start = g_get_monotonic_time();
+}
+
+/**
+ * Account for a transfer which completed with data.
+ *
+ * This is cheap enough to be called for every transfer.
+ *
+ * @param stats The device's counters.
+ * @param bytes The number of bytes the transfer brought.
+ * @param samples The number of samples in those bytes.
+ * @param latency How long (in us) the data waited to be handled, or 0 if
+ *                the driver can't tell.
+ *
+ * @private
+ */
+SR_PRIV void sr_dev_stats_data(struct sr_dev_stats *stats, uint64_t bytes,
+		uint64_t samples, uint64_t latency)
+{
+	const int64_t now = g_get_monotonic_time();
+	int64_t elapsed;
+
+	stats->last_time = now;
+	stats->bytes += bytes;
+	stats->samples += samples;
+	stats->transfers_completed++;
+	stats->latency_last = latency;
+	stats->latency_total += latency;
+	if (latency > stats->latency_max)
+		stats->latency_max = latency;
+
+	stats->window_bytes += bytes;
+	stats->window_samples += samples;
+	elapsed = now - stats->window_start;
+	if (elapsed >= G_USEC_PER_SEC) {
+		stats->bytes_per_sec = (double)stats->window_bytes *
+				       G_USEC_PER_SEC / elapsed;
+		stats->samples_per_sec = (double)stats->window_samples *
+					 G_USEC_PER_SEC / elapsed;
+		stats->window_start = now;
+		stats->window_bytes = stats->window_samples = 0;
+	}
+}
+
+/**
+ * Get the health and throughput counters of a device.
+ *
+ * They cover the device's current acquisition, or the last one if none
+ * is running, and can be polled at any time: a drop in the rates, or a
+ * rise in the failed transfers, latency or buffer occupancy, shows a
+ * link going bad before the acquisition starts losing data.
+ *
+ * @param sdi The device. Must not be NULL.
+ * @param stats Pointer to a struct which will be filled in. Must not be
+ *              NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or if
+ *         the device's driver doesn't keep the counters.
+ */
+SR_API int sr_dev_stats_get(const struct sr_dev_inst *sdi,
+		struct sr_dev_stats *stats)
+{
+	const struct sr_dev_stats *cur;
+	const void *data;
+	int64_t elapsed;
+
+	if (!sdi || !sdi->driver || !stats) {
+		sr_err("%s: sdi, its driver and stats may not be NULL",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (sr_info_get(sdi->driver, SR_DI_DEV_STATS, &data, sdi) != SR_OK)
+		return SR_ERR_ARG;
+	cur = data;
+	*stats = *cur;
+
+	/* Without data coming in, the window never rolls over. */
+	elapsed = g_get_monotonic_time() - stats->window_start;
+	if (stats->start_time && elapsed >= G_USEC_PER_SEC) {
+		stats->bytes_per_sec = (double)stats->window_bytes *
+				       G_USEC_PER_SEC / elapsed;
+		stats->samples_per_sec = (double)stats->window_samples *
+					 G_USEC_PER_SEC / elapsed;
+	}
+	stats->latency_avg = stats->transfers_completed ?
+		stats->latency_total / stats->transfers_completed : 0;
+
+	return SR_OK;
+}
+
 SR_API GSList *sr_dev_inst_list(const struct sr_dev_driver *driver)
 {
 
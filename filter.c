@@ -20,17 +20,15 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "filter: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 /**
  * @file
@@ -46,6 +44,194 @@
  * @{
  */
 
+/** @cond PRIVATE */
+/*
+ * Minimum number of samples for which building per-byte lookup tables
+ * pays off, compared to testing each probe's bit in each sample.
+ */
+#define FILTER_TABLE_MIN_SAMPLES 256
+
+/* Number of samples sr_filter_probes_packed() filters at a time. */
+#define FILTER_PACK_BLOCK 4096
+/** @endcond */
+
+/* Read / write a unit of 'unitsize' bytes (1-8), least significant first. */
+static inline uint64_t unit_get(const uint8_t *p, int unitsize)
+{
+	uint64_t v;
+	int b;
+
+	v = 0;
+	for (b = unitsize - 1; b >= 0; b--)
+		v = (v << 8) | p[b];
+
+	return v;
+}
+
+static inline void unit_put(uint8_t *p, int unitsize, uint64_t v)
+{
+	int b;
+
+	for (b = 0; b < unitsize; b++, v >>= 8)
+		p[b] = v & 0xff;
+}
+
+/* Bit-by-bit filter, for short input and as the generic fallback. */
+static void filter_bits(int in_unitsize, int out_unitsize,
+			const int *probelist, const uint8_t *data_in,
+			uint64_t num_samples, uint8_t *data_out)
+{
+	uint64_t n, sample_in, sample_out;
+	int i;
+
+	for (n = 0; n < num_samples; n++) {
+		sample_in = unit_get(data_in + n * in_unitsize, in_unitsize);
+		sample_out = 0;
+		for (i = 0; probelist[i] != -1; i++)
+			sample_out |= ((sample_in >> probelist[i]) & 1) << i;
+		unit_put(data_out + n * out_unitsize, out_unitsize, sample_out);
+	}
+}
+
+/*
+ * Table-driven filter: for every input byte position, a table maps each of
+ * the 256 possible byte values to the output bits it contributes. A sample
+ * then costs one lookup and OR per input byte, regardless of the number of
+ * probes or their order.
+ */
+static int filter_table(int in_unitsize, int out_unitsize,
+			const int *probelist, const uint8_t *data_in,
+			uint64_t num_samples, uint8_t *data_out)
+{
+	uint64_t (*table)[256], n, sample_out;
+	const uint8_t *in;
+	int b, v, i;
+
+	if (!(table = g_try_malloc0(sizeof(*table) * in_unitsize))) {
+		sr_err("%s: table malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	/* Single bits first, every other value is an OR of those. */
+	for (i = 0; probelist[i] != -1; i++)
+		table[probelist[i] / 8][1 << (probelist[i] % 8)] |=
+			UINT64_C(1) << i;
+	for (b = 0; b < in_unitsize; b++)
+		for (v = 1; v < 256; v++)
+			table[b][v] = table[b][v & (v - 1)] |
+				      table[b][v & -v];
+
+	for (n = 0; n < num_samples; n++) {
+		in = data_in + n * in_unitsize;
+		sample_out = 0;
+		for (b = 0; b < in_unitsize; b++)
+			sample_out |= table[b][in[b]];
+		unit_put(data_out + n * out_unitsize, out_unitsize, sample_out);
+	}
+
+	g_free(table);
+
+	return SR_OK;
+}
+
+/*
+ * If the probes in 'probelist' are in ascending order, the output is the
+ * input with the unused bits squeezed out, i.e. a parallel bit extract of
+ * 'mask'. Returns FALSE otherwise.
+ */
+static gboolean probes_ascending(const int *probelist, uint64_t *mask)
+{
+	int i;
+
+	*mask = 0;
+	for (i = 0; probelist[i] != -1; i++) {
+		if (i > 0 && probelist[i] <= probelist[i - 1])
+			return FALSE;
+		*mask |= UINT64_C(1) << probelist[i];
+	}
+
+	return TRUE;
+}
+
+/* Check the arguments common to both filter functions. */
+static int filter_check(int in_unitsize, int out_unitsize,
+			const int *probelist, const uint8_t *data_in,
+			uint64_t *length_out, const char *func)
+{
+	int num_enabled_probes, i;
+
+	if (!probelist) {
+		sr_err("%s: probelist was NULL", func);
+		return SR_ERR_ARG;
+	}
+
+	if (!data_in) {
+		sr_err("%s: data_in was NULL", func);
+		return SR_ERR_ARG;
+	}
+
+	if (!length_out) {
+		sr_err("%s: length_out was NULL", func);
+		return SR_ERR_ARG;
+	}
+
+	if (in_unitsize < 1 || in_unitsize > 8 ||
+	    out_unitsize < 1 || out_unitsize > 8) {
+		sr_err("%s: unit sizes %d/%d out of range (1-8)", func,
+		       in_unitsize, out_unitsize);
+		return SR_ERR_ARG;
+	}
+
+	num_enabled_probes = 0;
+	for (i = 0; probelist[i] != -1; i++) {
+		if (probelist[i] < 0 || probelist[i] >= in_unitsize * 8) {
+			sr_err("%s: probe %d out of range for unit size %d",
+			       func, probelist[i], in_unitsize);
+			return SR_ERR_ARG;
+		}
+		num_enabled_probes++;
+	}
+
+	/* Are there more probes than the target unit size supports? */
+	if (num_enabled_probes > out_unitsize * 8) {
+		sr_err("%s: too many probes (%d) for the target unit "
+		       "size (%d)", func, num_enabled_probes, out_unitsize);
+		return SR_ERR_ARG;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Check whether filtering samples would leave them unchanged.
+ *
+ * This is the case if the probe list contains every probe of the input,
+ * in order, and the unit size stays the same. Callers can then use the
+ * input data as is, without calling sr_filter_probes() at all.
+ *
+ * @param in_unitsize The unit size of the input.
+ * @param out_unitsize The unit size the output shall have.
+ * @param probelist Pointer to a list of probe numbers, terminated with -1.
+ *                  Must not be NULL.
+ *
+ * @return TRUE if filtering is a no-op, FALSE otherwise.
+ */
+SR_API gboolean sr_filter_probes_identity(int in_unitsize, int out_unitsize,
+					  const int *probelist)
+{
+	int i;
+
+	if (!probelist || in_unitsize != out_unitsize)
+		return FALSE;
+
+	for (i = 0; probelist[i] != -1; i++) {
+		if (probelist[i] != i)
+			return FALSE;
+	}
+
+	return i == in_unitsize * 8;
+}
+
 /**
  * Remove unused probes from samples.
  *
@@ -74,18 +260,20 @@
  * actually allocated for the input data (data_in), as this function does
  * not check that.
  *
- * @param in_unitsize The unit size (>= 1) of the input (data_in).
- * @param out_unitsize The unit size (>= 1) the output shall have (data_out).
+ * @param in_unitsize The unit size (1-8) of the input (data_in).
+ * @param out_unitsize The unit size (1-8) the output shall have (data_out).
  *                     The requested unit size must be big enough to hold as
  *                     much data as is specified by the number of enabled
  *                     probes in 'probelist'.
  * @param probelist Pointer to a list of probe numbers, numbered starting
- *                  from 0. The list is terminated with -1.
+ *                  from 0. The list is terminated with -1. All numbers must
+ *                  be less than in_unitsize * 8.
  * @param data_in Pointer to the input data buffer. Must not be NULL.
  * @param length_in The input data length (>= 1), in number of bytes.
  * @param data_out Variable which will point to the newly allocated buffer
  *                 of output data. The caller is responsible for g_free()'ing
  *                 the buffer when it's no longer needed. Must not be NULL.
+ *                 To avoid the allocation, see sr_filter_probes_buf().
  * @param length_out Pointer to the variable which will contain the output
  *                   data length (in number of bytes) when the function
  *                   returns SR_OK. Must not be NULL.
@@ -100,68 +288,325 @@ SR_API int sr_filter_probes(int in_unitsize, int out_unitsize,
 			    uint64_t length_in, uint8_t **data_out,
 			    uint64_t *length_out)
 {
-	unsigned int in_offset, out_offset;
-	int num_enabled_probes, out_bit, i;
-	uint64_t sample_in, sample_out;
+	uint64_t size;
+	int ret;
 
-	if (!probelist) {
-		sr_err("%s: probelist was NULL", __func__);
+	if (!data_out) {
+		sr_err("%s: data_out was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
-	if (!data_in) {
-		sr_err("%s: data_in was NULL", __func__);
-		return SR_ERR_ARG;
+	if ((ret = filter_check(in_unitsize, out_unitsize, probelist,
+				data_in, length_out, __func__)) != SR_OK)
+		return ret;
+
+	size = (length_in / in_unitsize) * out_unitsize;
+	if (!(*data_out = g_try_malloc(MAX(size, 1)))) {
+		sr_err("%s: data_out malloc failed", __func__);
+		return SR_ERR_MALLOC;
 	}
 
+	ret = sr_filter_probes_buf(in_unitsize, out_unitsize, probelist,
+				   data_in, length_in, *data_out, length_out);
+	if (ret != SR_OK)
+		g_free(*data_out);
+
+	return ret;
+}
+
+/**
+ * Remove unused probes from samples, into a caller-provided buffer.
+ *
+ * This works like sr_filter_probes(), but writes the output into
+ * 'data_out' instead of a newly allocated buffer.
+ *
+ * The output may be written over the input (data_out == data_in), as long
+ * as out_unitsize <= in_unitsize; otherwise the two buffers must not
+ * overlap. If filtering leaves the samples unchanged (see
+ * sr_filter_probes_identity()) and data_out == data_in, nothing is copied.
+ *
+ * @param in_unitsize The unit size (1-8) of the input (data_in).
+ * @param out_unitsize The unit size (1-8) the output shall have (data_out).
+ * @param probelist Pointer to a list of probe numbers, numbered starting
+ *                  from 0. The list is terminated with -1. All numbers must
+ *                  be less than in_unitsize * 8.
+ * @param data_in Pointer to the input data buffer. Must not be NULL.
+ * @param length_in The input data length (>= 1), in number of bytes.
+ * @param data_out Pointer to the output data buffer. Must not be NULL, and
+ *                 must be at least (length_in / in_unitsize) * out_unitsize
+ *                 bytes in size.
+ * @param length_out Pointer to the variable which will contain the output
+ *                   data length (in number of bytes) when the function
+ *                   returns SR_OK. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments.
+ *         If something other than SR_OK is returned, the contents of
+ *         data_out and the value of length_out are undefined.
+ */
+SR_API int sr_filter_probes_buf(int in_unitsize, int out_unitsize,
+				const int *probelist, const uint8_t *data_in,
+				uint64_t length_in, uint8_t *data_out,
+				uint64_t *length_out)
+{
+	int shift, ret;
+	uint64_t num_samples, n, mask, sample_in;
+	uint8_t *out;
+
 	if (!data_out) {
 		sr_err("%s: data_out was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
-	if (!length_out) {
-		sr_err("%s: length_out was NULL", __func__);
+	if ((ret = filter_check(in_unitsize, out_unitsize, probelist,
+				data_in, length_out, __func__)) != SR_OK)
+		return ret;
+
+	if (data_out == data_in && out_unitsize > in_unitsize) {
+		sr_err("%s: can't filter in place to a larger unit size",
+		       __func__);
 		return SR_ERR_ARG;
 	}
 
-	num_enabled_probes = 0;
-	for (i = 0; probelist[i] != -1; i++)
-		num_enabled_probes++;
+	num_samples = length_in / in_unitsize;
+	*length_out = num_samples * out_unitsize;
 
-	/* Are there more probes than the target unit size supports? */
-	if (num_enabled_probes > out_unitsize * 8) {
-		sr_err("%s: too many probes (%d) for the target unit "
-		       "size (%d)", __func__, num_enabled_probes, out_unitsize);
-		return SR_ERR_ARG;
+	if (sr_filter_probes_identity(in_unitsize, out_unitsize, probelist)) {
+		/* All probes are used in order -- nothing to compress. */
+		if (data_out != data_in)
+			memcpy(data_out, data_in, *length_out);
+		return SR_OK;
 	}
 
-	if (!(*data_out = g_try_malloc(length_in))) {
-		sr_err("%s: data_out malloc failed", __func__);
-		return SR_ERR_MALLOC;
+	/* If we reached this point, not all probes are used, so "compress". */
+	out = data_out;
+	if (probes_ascending(probelist, &mask) && mask) {
+		shift = __builtin_ctzll(mask);
+		if (!((mask >> shift) & ((mask >> shift) + 1))) {
+			/* One contiguous run of probes: shift and mask. */
+			for (n = 0; n < num_samples; n++) {
+				sample_in = unit_get(data_in + n * in_unitsize,
+						     in_unitsize);
+				unit_put(out + n * out_unitsize, out_unitsize,
+					 (sample_in & mask) >> shift);
+			}
+			return SR_OK;
+		}
+#ifdef __BMI2__
+		/* Arbitrary ascending probes: one parallel bit extract. */
+		for (n = 0; n < num_samples; n++) {
+			sample_in = unit_get(data_in + n * in_unitsize,
+					     in_unitsize);
+			unit_put(out + n * out_unitsize, out_unitsize,
+				 _pext_u64(sample_in, mask));
+		}
+		return SR_OK;
+#endif
 	}
 
-	if (num_enabled_probes == in_unitsize * 8) {
-		/* All probes are used -- no need to compress anything. */
-		memcpy(*data_out, data_in, length_in);
-		*length_out = length_in;
+	if (num_samples < FILTER_TABLE_MIN_SAMPLES) {
+		filter_bits(in_unitsize, out_unitsize, probelist, data_in,
+			    num_samples, out);
 		return SR_OK;
 	}
 
-	/* If we reached this point, not all probes are used, so "compress". */
-	in_offset = out_offset = 0;
-	while (in_offset <= length_in - in_unitsize) {
-		memcpy(&sample_in, data_in + in_offset, in_unitsize);
-		sample_out = out_bit = 0;
-		for (i = 0; probelist[i] != -1; i++) {
-			if (sample_in & (1 << (probelist[i])))
-				sample_out |= (1 << out_bit);
-			out_bit++;
-		}
-		memcpy((*data_out) + out_offset, &sample_out, out_unitsize);
-		in_offset += in_unitsize;
-		out_offset += out_unitsize;
+	return filter_table(in_unitsize, out_unitsize, probelist, data_in,
+			    num_samples, out);
+}
+
+/* Check the arguments of the bit packing functions. */
+static int pack_check(const uint8_t *in, uint8_t *out, int unitbits,
+		      const char *func)
+{
+	if (!in || !out) {
+		sr_err("%s: in or out was NULL", func);
+		return SR_ERR_ARG;
+	}
+
+	if (unitbits != 1 && unitbits != 2 && unitbits != 4) {
+		sr_err("%s: unitbits was %d, but it must be 1, 2 or 4", func,
+		       unitbits);
+		return SR_ERR_ARG;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * Store sample 'n' of a packed buffer. The first sample of a byte clears
+ * the rest of it, so no stale bits are left at the end of the data.
+ */
+static inline void packed_put(uint8_t *out, int unitbits, uint64_t n,
+			      uint8_t v)
+{
+	uint64_t per_byte, mask;
+	int shift;
+
+	per_byte = 8 / unitbits;
+	mask = (1 << unitbits) - 1;
+	shift = (n % per_byte) * unitbits;
+	if (shift == 0)
+		out[n / per_byte] = v & mask;
+	else
+		out[n / per_byte] = (out[n / per_byte] & ~(mask << shift)) |
+				    ((v & mask) << shift);
+}
+
+/**
+ * Pack one-byte logic samples into 'unitbits' bits each.
+ *
+ * Captures of up to four probes take up a half, a quarter or an eighth of
+ * the space of one byte per sample this way. Sample n of a packed buffer
+ * is stored in bits (n * unitbits) % 8 and up of byte n * unitbits / 8,
+ * i.e. the first sample of each byte is in its least significant bits.
+ *
+ * @param in The samples, one byte each, with the probes in the low
+ *           'unitbits' bits. The other bits are ignored. Must not be NULL.
+ * @param num_samples The number of samples in 'in'.
+ * @param unitbits The number of bits per packed sample (1, 2 or 4).
+ * @param out The packed buffer. Must not be NULL. The samples are stored
+ *            from sample 'offset' on; the samples before it are kept.
+ * @param offset The index of the sample of 'out' to store the first
+ *               sample at.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_logic_pack(const uint8_t *in, uint64_t num_samples,
+			 int unitbits, uint8_t *out, uint64_t offset)
+{
+	uint64_t i, per_byte;
+	uint8_t *p, mask, v;
+	int k, ret;
+
+	if ((ret = pack_check(in, out, unitbits, __func__)) != SR_OK)
+		return ret;
+
+	per_byte = 8 / unitbits;
+	mask = (1 << unitbits) - 1;
+
+	/* Up to the next whole byte, then a byte at a time. */
+	for (i = 0; i < num_samples && (offset + i) % per_byte; i++)
+		packed_put(out, unitbits, offset + i, in[i]);
+	p = out + (offset + i) / per_byte;
+	for (; i + per_byte <= num_samples; i += per_byte) {
+		v = 0;
+		for (k = 0; k < (int)per_byte; k++)
+			v |= (in[i + k] & mask) << (k * unitbits);
+		*p++ = v;
+	}
+	for (; i < num_samples; i++)
+		packed_put(out, unitbits, offset + i, in[i]);
+
+	return SR_OK;
+}
+
+/**
+ * Unpack logic samples packed by sr_logic_pack() into one byte each.
+ *
+ * @param in The packed buffer. Must not be NULL.
+ * @param offset The index of the first sample of 'in' to unpack.
+ * @param num_samples The number of samples to unpack.
+ * @param unitbits The number of bits per packed sample (1, 2 or 4).
+ * @param out The buffer for the unpacked samples, num_samples bytes in
+ *            size. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_logic_unpack(const uint8_t *in, uint64_t offset,
+			   uint64_t num_samples, int unitbits, uint8_t *out)
+{
+	uint64_t i, n, per_byte;
+	const uint8_t *p;
+	uint8_t mask, v;
+	int k, ret;
+
+	if ((ret = pack_check(in, out, unitbits, __func__)) != SR_OK)
+		return ret;
+
+	per_byte = 8 / unitbits;
+	mask = (1 << unitbits) - 1;
+
+	i = 0;
+	for (; i < num_samples && (offset + i) % per_byte; i++) {
+		n = offset + i;
+		out[i] = (in[n / per_byte] >> ((n % per_byte) * unitbits))
+			 & mask;
+	}
+	p = in + (offset + i) / per_byte;
+	for (; i + per_byte <= num_samples; i += per_byte) {
+		v = *p++;
+		for (k = 0; k < (int)per_byte; k++)
+			out[i + k] = (v >> (k * unitbits)) & mask;
+	}
+	for (k = 0; i < num_samples; i++, k++)
+		out[i] = (*p >> (k * unitbits)) & mask;
+
+	return SR_OK;
+}
+
+/**
+ * Remove unused probes from samples, and pack them into 'out_unitbits'
+ * bits each.
+ *
+ * This works like sr_filter_probes_buf() with an output unit size of
+ * one byte, followed by sr_logic_pack(), for captures of up to four
+ * probes.
+ *
+ * @param in_unitsize The unit size (1-8) of the input (data_in).
+ * @param out_unitbits The number of bits (1, 2 or 4) per output sample.
+ *                     Must be at least the number of probes in
+ *                     'probelist'.
+ * @param probelist Pointer to a list of probe numbers, numbered starting
+ *                  from 0. The list is terminated with -1. All numbers must
+ *                  be less than in_unitsize * 8.
+ * @param data_in Pointer to the input data buffer. Must not be NULL.
+ * @param length_in The input data length (>= 1), in number of bytes.
+ * @param data_out Pointer to the output data buffer. Must not be NULL, must
+ *                 not overlap the input, and must be at least
+ *                 (length_in / in_unitsize * out_unitbits + 7) / 8 bytes
+ *                 in size.
+ * @param length_out Pointer to the variable which will contain the output
+ *                   data length (in number of bytes) when the function
+ *                   returns SR_OK. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_filter_probes_packed(int in_unitsize, int out_unitbits,
+				   const int *probelist, const uint8_t *data_in,
+				   uint64_t length_in, uint8_t *data_out,
+				   uint64_t *length_out)
+{
+	uint8_t block[FILTER_PACK_BLOCK];
+	uint64_t num_samples, n, count, length;
+	int i, ret;
+
+	if ((ret = filter_check(in_unitsize, 1, probelist, data_in,
+				length_out, __func__)) != SR_OK)
+		return ret;
+
+	if ((ret = pack_check(data_in, data_out, out_unitbits,
+			      __func__)) != SR_OK)
+		return ret;
+
+	for (i = 0; probelist[i] != -1; i++)
+		;
+	if (i > out_unitbits) {
+		sr_err("%s: too many probes (%d) for %d bits per sample",
+		       __func__, i, out_unitbits);
+		return SR_ERR_ARG;
+	}
+
+	num_samples = length_in / in_unitsize;
+	for (n = 0; n < num_samples; n += count) {
+		count = MIN(num_samples - n, FILTER_PACK_BLOCK);
+		if ((ret = sr_filter_probes_buf(in_unitsize, 1, probelist,
+				data_in + n * in_unitsize, count * in_unitsize,
+				block, &length)) != SR_OK)
+			return ret;
+		sr_logic_pack(block, count, out_unitbits, data_out, n);
 	}
-	*length_out = out_offset;
+	*length_out = (num_samples * out_unitbits + 7) / 8;
 
 	return SR_OK;
 }
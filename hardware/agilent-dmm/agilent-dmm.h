@@ -24,13 +24,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "agilent-dmm: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
-
-#define AGDMM_BUFSIZE  256
 
 /* Supported models */
 enum {
@@ -63,8 +56,10 @@ struct dev_context {
 	/* Runtime. */
 	uint64_t num_samples;
 	int64_t jobqueue[8];
-	unsigned char buf[AGDMM_BUFSIZE];
-	int buflen;
+	/* When the next job is due (ms, monotonic time). */
+	int64_t next_job;
+	/* The profile's recv_regex patterns, compiled in dev_open(). */
+	GRegex *recv_regex[8];
 	int cur_mq;
 	int cur_unit;
 	int cur_mqflags;
@@ -84,6 +79,8 @@ struct agdmm_recv {
 	int (*recv) (const struct sr_dev_inst *sdi, GMatchInfo *match);
 };
 
+SR_PRIV int agdmm_regex_compile(struct dev_context *devc);
+SR_PRIV void agdmm_regex_free(struct dev_context *devc);
 SR_PRIV int agdmm_receive_data(int fd, int revents, void *cb_data);
 
 #endif /* LIBSIGROK_AGILENT_DMM_H */
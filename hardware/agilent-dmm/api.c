@@ -219,9 +219,14 @@ static int hw_dev_open(struct sr_dev_inst *sdi)
 		return SR_ERR_BUG;
 	}
 
-	if (serial_open(devc->serial, SERIAL_RDWR | SERIAL_NONBLOCK) != SR_OK)
+	if (agdmm_regex_compile(devc) != SR_OK)
 		return SR_ERR;
 
+	if (serial_open(devc->serial, SERIAL_RDWR | SERIAL_NONBLOCK) != SR_OK) {
+		agdmm_regex_free(devc);
+		return SR_ERR;
+	}
+
 	sdi->status = SR_ST_ACTIVE;
 
 	return SR_OK;
@@ -240,6 +245,7 @@ static int hw_dev_close(struct sr_dev_inst *sdi)
 		serial_close(devc->serial);
 		sdi->status = SR_ST_INACTIVE;
 	}
+	agdmm_regex_free(devc);
 
 	return SR_OK;
 }
@@ -332,6 +338,7 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	sr_dbg("Starting acquisition.");
 
 	devc->cb_data = cb_data;
+	devc->next_job = 0;
 
 	/* Send header packet to the session bus. */
 	sr_dbg("Sending SR_DF_HEADER.");
@@ -348,8 +355,12 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	meta.num_probes = 1;
 	sr_session_send(devc->cb_data, &packet);
 
-	/* Poll every 100ms, or whenever some data comes in. */
-	sr_source_add(devc->serial->fd, G_IO_IN, 100, agdmm_receive_data, (void *)sdi);
+	/*
+	 * Wake up whenever some data comes in; dispatch() sets the timeout
+	 * to when the next job is due.
+	 */
+	sr_source_add(devc->serial->fd, G_IO_IN, 100, agdmm_receive_data,
+		      (void *)sdi);
 
 	return SR_OK;
 }
@@ -26,71 +26,130 @@
 #include <errno.h>
 #include <math.h>
 
+/*
+ * Run the jobs which are due, and have the serial port's source wake
+ * us up again when the next one is.
+ */
 static void dispatch(const struct sr_dev_inst *sdi)
 {
 	struct dev_context *devc;
 	const struct agdmm_job *jobs;
-	int64_t now;
+	int64_t now, due;
 	int i;
 
 	devc = sdi->priv;
-	jobs = devc->profile->jobs;
 	now = g_get_monotonic_time() / 1000;
+	if (now < devc->next_job)
+		return;
+
+	jobs = devc->profile->jobs;
+	devc->next_job = INT64_MAX;
 	for (i = 0; (&jobs[i])->interval; i++) {
 		if (now - devc->jobqueue[i] > (&jobs[i])->interval) {
 			sr_spew("Running job %d.", i);
 			(&jobs[i])->send(sdi);
 			devc->jobqueue[i] = now;
 		}
+		due = devc->jobqueue[i] + (&jobs[i])->interval + 1;
+		devc->next_job = MIN(devc->next_job, due);
 	}
+
+	sr_session_source_timeout_set(devc->serial->fd,
+				      devc->next_job - now);
 }
 
-static void receive_line(const struct sr_dev_inst *sdi)
+/**
+ * Compile the device profile's response patterns.
+ *
+ * Done once per dev_open(), rather than for every line received.
+ *
+ * @param devc The device context. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR if a pattern doesn't compile.
+ */
+SR_PRIV int agdmm_regex_compile(struct dev_context *devc)
+{
+	const struct agdmm_recv *recvs;
+	GError *error;
+	unsigned int i;
+
+	recvs = devc->profile->recvs;
+	for (i = 0; (&recvs[i])->recv_regex; i++) {
+		if (i == G_N_ELEMENTS(devc->recv_regex)) {
+			sr_err("Too many response patterns.");
+			agdmm_regex_free(devc);
+			return SR_ERR_BUG;
+		}
+		error = NULL;
+		devc->recv_regex[i] = g_regex_new((&recvs[i])->recv_regex,
+				G_REGEX_OPTIMIZE, 0, &error);
+		if (!devc->recv_regex[i]) {
+			sr_err("Invalid pattern '%s': %s.",
+			       (&recvs[i])->recv_regex, error->message);
+			g_error_free(error);
+			agdmm_regex_free(devc);
+			return SR_ERR;
+		}
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Free the patterns compiled by agdmm_regex_compile().
+ *
+ * @param devc The device context. Must not be NULL.
+ */
+SR_PRIV void agdmm_regex_free(struct dev_context *devc)
+{
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(devc->recv_regex); i++) {
+		if (devc->recv_regex[i])
+			g_regex_unref(devc->recv_regex[i]);
+		devc->recv_regex[i] = NULL;
+	}
+}
+
+static void receive_line(const struct sr_dev_inst *sdi, char *line, int len)
 {
 	struct dev_context *devc;
 	const struct agdmm_recv *recvs, *recv;
-	GRegex *reg;
 	GMatchInfo *match;
 	int i;
 
 	devc = sdi->priv;
 
 	/* Strip CRLF */
-	while (devc->buflen) {
-		if (*(devc->buf + devc->buflen - 1) == '\r'
-				|| *(devc->buf + devc->buflen - 1) == '\n')
-			*(devc->buf + --devc->buflen) = '\0';
+	while (len) {
+		if (line[len - 1] == '\r' || line[len - 1] == '\n')
+			line[--len] = '\0';
 		else
 			break;
 	}
-	sr_spew("Received '%s'.", devc->buf);
+	sr_spew("Received '%s'.", line);
 
 	recv = NULL;
 	recvs = devc->profile->recvs;
 	for (i = 0; (&recvs[i])->recv_regex; i++) {
-		reg = g_regex_new((&recvs[i])->recv_regex, 0, 0, NULL);
-		if (g_regex_match(reg, (char *)devc->buf, 0, &match)) {
+		if (g_regex_match(devc->recv_regex[i], line, 0, &match)) {
 			recv = &recvs[i];
 			break;
 		}
 		g_match_info_unref(match);
-		g_regex_unref(reg);
 	}
 	if (recv) {
 		recv->recv(sdi, match);
 		g_match_info_unref(match);
-		g_regex_unref(reg);
 	} else
-		sr_dbg("Unknown line '%s'.", devc->buf);
-
-	/* Done with this. */
-	devc->buflen = 0;
+		sr_dbg("Unknown line '%s'.", line);
 }
 
 SR_PRIV int agdmm_receive_data(int fd, int revents, void *cb_data)
 {
 	struct sr_dev_inst *sdi;
 	struct dev_context *devc;
+	char *line;
 	int len;
 
 	(void)fd;
@@ -103,18 +162,9 @@ SR_PRIV int agdmm_receive_data(int fd, int revents, void *cb_data)
 
 	if (revents == G_IO_IN) {
 		/* Serial data arrived. */
-		while(AGDMM_BUFSIZE - devc->buflen - 1 > 0) {
-			len = serial_read(devc->serial, devc->buf + devc->buflen, 1);
-			if (len < 1)
-				break;
-			devc->buflen += len;
-			*(devc->buf + devc->buflen) = '\0';
-			if (*(devc->buf + devc->buflen - 1) == '\n') {
-				/* End of line */
-				receive_line(sdi);
-				break;
-			}
-		}
+		serial_fill(devc->serial);
+		while ((line = serial_get_line(devc->serial, '\n', &len)))
+			receive_line(sdi, line, len);
 	}
 
 	dispatch(sdi);
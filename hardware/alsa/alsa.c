@@ -18,11 +18,10 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
-/* Note: This driver doesn't compile, analog support in sigrok is WIP. */
-
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/time.h>
 #include <alsa/asoundlib.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
@@ -30,31 +29,25 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "alsa: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 #define NUM_PROBES 2
 #define SAMPLE_WIDTH 16
 #define AUDIO_DEV "plughw:0,0"
 
-struct sr_analog_probe {
-	uint8_t att;
-	uint8_t res;    /* Needs to be a power of 2, FIXME */
-	uint16_t val;   /* Max hardware ADC width is 16bits */
-};
+/* Interval (in ms) at which the session checks for samples without poll. */
+#define POLL_INTERVAL 10
 
-struct sr_analog_sample {
-	uint8_t num_probes; /* Max hardware probes is 256 */
-	struct sr_analog_probe probes[];
+static const int hwopts[] = {
+	SR_HWOPT_CONN,
+	0,
 };
 
 static const int hwcaps[] = {
+	SR_HWCAP_OSCILLOSCOPE,
 	SR_HWCAP_SAMPLERATE,
 	SR_HWCAP_LIMIT_SAMPLES,
 	SR_HWCAP_CONTINUOUS,
+	0,
 };
 
 /* TODO: Which probe names/numbers to use? */
@@ -64,297 +57,465 @@ static const char *probe_names[NUM_PROBES + 1] = {
 	NULL,
 };
 
-static GSList *dev_insts = NULL;
+static const uint64_t supported_samplerates[] = {
+	SR_HZ(8000),
+	SR_HZ(11025),
+	SR_HZ(16000),
+	SR_HZ(22050),
+	SR_HZ(32000),
+	SR_HZ(44100),
+	SR_HZ(48000),
+	SR_HZ(88200),
+	SR_HZ(96000),
+	SR_HZ(176400),
+	SR_HZ(192000),
+	0,
+};
+
+static const struct sr_samplerates samplerates = {
+	0,
+	0,
+	0,
+	supported_samplerates,
+};
+
+SR_PRIV struct sr_dev_driver alsa_driver_info;
+static struct sr_dev_driver *adi = &alsa_driver_info;
 
 /* Private, per-device-instance driver context. */
-struct context {
-	uint64_t cur_rate;
+struct dev_context {
+	char *pcm_name;
+	uint64_t cur_samplerate;
 	uint64_t limit_samples;
+	uint64_t num_samples;
 	snd_pcm_t *capture_handle;
 	snd_pcm_hw_params_t *hw_params;
+	int pollfd;
 	void *session_dev_id;
 };
 
-static int hw_init(struct sr_context *sr_ctx)
+static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi, void *cb_data);
+
+static int clear_instances(void)
 {
+	GSList *l;
 	struct sr_dev_inst *sdi;
-	struct context *ctx;
+	struct drv_context *drvc;
+	struct dev_context *devc;
+
+	if (!(drvc = adi->priv))
+		return SR_OK;
 
-	if (!(ctx = g_try_malloc0(sizeof(struct context)))) {
-		sr_err("%s: ctx malloc failed", __func__);
+	for (l = drvc->instances; l; l = l->next) {
+		if (!(sdi = l->data))
+			continue;
+		if ((devc = sdi->priv)) {
+			if (devc->hw_params)
+				snd_pcm_hw_params_free(devc->hw_params);
+			if (devc->capture_handle)
+				snd_pcm_close(devc->capture_handle);
+			g_free(devc->pcm_name);
+		}
+		sr_dev_inst_free(sdi);
+	}
+	g_slist_free(drvc->instances);
+	drvc->instances = NULL;
+
+	return SR_OK;
+}
+
+static int hw_init(struct sr_context *sr_ctx)
+{
+	struct drv_context *drvc;
+
+	if (!(drvc = g_try_malloc0(sizeof(struct drv_context)))) {
+		sr_err("Driver context malloc failed.");
 		return SR_ERR_MALLOC;
 	}
+	drvc->sr_ctx = sr_ctx;
+	adi->priv = drvc;
 
-	if (!(sdi = sr_dev_inst_new(0, SR_ST_ACTIVE, "alsa", NULL, NULL))) {
-		sr_err("%s: sdi was NULL", __func__);
-		goto free_ctx;
+	return SR_OK;
+}
+
+static GSList *hw_scan(GSList *options)
+{
+	struct sr_hwopt *opt;
+	struct sr_dev_inst *sdi;
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	struct sr_probe *probe;
+	GSList *l, *devices;
+	const char *conn;
+	int i;
+
+	drvc = adi->priv;
+	devices = NULL;
+
+	/* An ALSA PCM name, e.g. "hw:1,0". */
+	conn = AUDIO_DEV;
+	for (l = options; l; l = l->next) {
+		opt = l->data;
+		if (opt->hwopt == SR_HWOPT_CONN)
+			conn = opt->value;
+	}
+
+	if (!(devc = g_try_malloc0(sizeof(struct dev_context)))) {
+		sr_err("Device context malloc failed.");
+		return NULL;
+	}
+	devc->pcm_name = g_strdup(conn);
+	devc->cur_samplerate = SR_HZ(44100);
+	devc->pollfd = -1;
+
+	if (!(sdi = sr_dev_inst_new(0, SR_ST_INACTIVE, "ALSA", conn, NULL))) {
+		sr_err("%s: sr_dev_inst_new failed", __func__);
+		g_free(devc->pcm_name);
+		g_free(devc);
+		return NULL;
+	}
+	sdi->driver = adi;
+	sdi->priv = devc;
+
+	for (i = 0; probe_names[i]; i++) {
+		if (!(probe = sr_probe_new(i, SR_PROBE_ANALOG, TRUE,
+				probe_names[i])))
+			return NULL;
+		sdi->probes = g_slist_append(sdi->probes, probe);
 	}
 
-	sdi->priv = ctx;
+	drvc->instances = g_slist_append(drvc->instances, sdi);
+	devices = g_slist_append(devices, sdi);
 
-	dev_insts = g_slist_append(dev_insts, sdi);
+	return devices;
+}
 
-	return 1;
+static GSList *hw_dev_list(void)
+{
+	struct drv_context *drvc;
+
+	drvc = adi->priv;
 
-free_ctx:
-	g_free(ctx);
-	return 0;
+	return drvc->instances;
 }
 
-static int hw_dev_open(int dev_index)
+static int hw_dev_open(struct sr_dev_inst *sdi)
 {
-	struct sr_dev_inst *sdi;
-	struct context *ctx;
+	struct dev_context *devc;
 	int ret;
 
-	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
-		return SR_ERR;
-	ctx = sdi->priv;
+	devc = sdi->priv;
 
-	ret = snd_pcm_open(&ctx->capture_handle, AUDIO_DEV,
-			   SND_PCM_STREAM_CAPTURE, 0);
+	/* Non-blocking, the session drives the reads. */
+	ret = snd_pcm_open(&devc->capture_handle, devc->pcm_name,
+			   SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK);
 	if (ret < 0) {
-		sr_err("Can't open audio device %s (%s).", AUDIO_DEV,
+		sr_err("Can't open audio device %s (%s).", devc->pcm_name,
 		       snd_strerror(ret));
+		devc->capture_handle = NULL;
 		return SR_ERR;
 	}
 
-	ret = snd_pcm_hw_params_malloc(&ctx->hw_params);
+	ret = snd_pcm_hw_params_malloc(&devc->hw_params);
 	if (ret < 0) {
 		sr_err("Can't allocate hardware parameter structure (%s).",
 		       snd_strerror(ret));
+		devc->hw_params = NULL;
+		snd_pcm_close(devc->capture_handle);
+		devc->capture_handle = NULL;
 		return SR_ERR_MALLOC;
 	}
 
-	ret = snd_pcm_hw_params_any(ctx->capture_handle, ctx->hw_params);
+	ret = snd_pcm_hw_params_any(devc->capture_handle, devc->hw_params);
 	if (ret < 0) {
 		sr_err("Can't initialize hardware parameter structure (%s)",
 		       snd_strerror(ret));
+		snd_pcm_hw_params_free(devc->hw_params);
+		devc->hw_params = NULL;
+		snd_pcm_close(devc->capture_handle);
+		devc->capture_handle = NULL;
 		return SR_ERR;
 	}
 
+	sdi->status = SR_ST_ACTIVE;
+
 	return SR_OK;
 }
 
-static int hw_dev_close(int dev_index)
+static int hw_dev_close(struct sr_dev_inst *sdi)
 {
-	struct sr_dev_inst *sdi;
-	struct context *ctx;
+	struct dev_context *devc;
 
-	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index))) {
-		sr_err("%s: sdi was NULL", __func__);
-		return SR_ERR_BUG;
-	}
-
-	if (!(ctx = sdi->priv)) {
+	if (!(devc = sdi->priv)) {
 		sr_err("%s: sdi->priv was NULL", __func__);
 		return SR_ERR_BUG;
 	}
 
 	// TODO: Return values of snd_*?
-	if (ctx->hw_params)
-		snd_pcm_hw_params_free(ctx->hw_params);
-	if (ctx->capture_handle)
-		snd_pcm_close(ctx->capture_handle);
+	if (devc->hw_params)
+		snd_pcm_hw_params_free(devc->hw_params);
+	devc->hw_params = NULL;
+	if (devc->capture_handle)
+		snd_pcm_close(devc->capture_handle);
+	devc->capture_handle = NULL;
+
+	sdi->status = SR_ST_INACTIVE;
 
 	return SR_OK;
 }
 
 static int hw_cleanup(void)
 {
-	struct sr_dev_inst *sdi;
-
-	if (!(sdi = sr_dev_inst_get(dev_insts, 0))) {
-		sr_err("%s: sdi was NULL", __func__);
-		return SR_ERR_BUG;
-	}
-
-	sr_dev_inst_free(sdi);
+	clear_instances();
 
 	return SR_OK;
 }
 
-static const void *hw_dev_info_get(int dev_index, int dev_info_id)
+static int hw_info_get(int info_id, const void **data,
+		       const struct sr_dev_inst *sdi)
 {
-	struct sr_dev_inst *sdi;
-	struct context *ctx;
-	void *info = NULL;
+	struct dev_context *devc;
 
-	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
-		return NULL;
-	ctx = sdi->priv;
-
-	switch (dev_info_id) {
-	case SR_DI_INST:
-		info = sdi;
+	switch (info_id) {
+	case SR_DI_HWOPTS:
+		*data = hwopts;
+		break;
+	case SR_DI_HWCAPS:
+		*data = hwcaps;
 		break;
 	case SR_DI_NUM_PROBES:
-		info = GINT_TO_POINTER(NUM_PROBES);
+		*data = GINT_TO_POINTER(NUM_PROBES);
 		break;
 	case SR_DI_PROBE_NAMES:
-		info = probe_names;
+		*data = probe_names;
+		break;
+	case SR_DI_SAMPLERATES:
+		*data = &samplerates;
 		break;
 	case SR_DI_CUR_SAMPLERATE:
-		info = &ctx->cur_rate;
+		if (!sdi)
+			return SR_ERR;
+		devc = sdi->priv;
+		*data = &devc->cur_samplerate;
 		break;
-	// case SR_DI_PROBE_TYPE:
-	// 	info = GINT_TO_POINTER(SR_PROBE_TYPE_ANALOG);
-	// 	break;
+	default:
+		return SR_ERR_ARG;
 	}
 
-	return info;
-}
-
-static int hw_dev_status_get(int dev_index)
-{
-	(void)dev_index;
-
-	return SR_ST_ACTIVE;
-}
-
-static const int *hw_hwcap_get_all(void)
-{
-	return hwcaps;
+	return SR_OK;
 }
 
-static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
+static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
+			     const void *value)
 {
-	struct sr_dev_inst *sdi;
-	struct context *ctx;
+	struct dev_context *devc;
 
-	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
-		return SR_ERR;
-	ctx = sdi->priv;
+	devc = sdi->priv;
 
 	switch (hwcap) {
-	case SR_HWCAP_PROBECONFIG:
-		return SR_OK;
 	case SR_HWCAP_SAMPLERATE:
-		ctx->cur_rate = *(const uint64_t *)value;
+		devc->cur_samplerate = *(const uint64_t *)value;
 		return SR_OK;
 	case SR_HWCAP_LIMIT_SAMPLES:
-		ctx->limit_samples = *(const uint64_t *)value;
+		devc->limit_samples = *(const uint64_t *)value;
 		return SR_OK;
 	default:
 		return SR_ERR;
 	}
 }
 
+/* Get the PCM going again after an overrun, telling the frontend. */
+static int recover_overrun(struct dev_context *devc)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_overrun overrun;
+	int ret;
+
+	sr_warn("Overrun after %" PRIu64 " samples.", devc->num_samples);
+	packet.type = SR_DF_OVERRUN;
+	packet.payload = &overrun;
+	overrun.offset = devc->num_samples;
+	overrun.num_samples = 0;
+	sr_session_send(devc->session_dev_id, &packet);
+
+	if ((ret = snd_pcm_prepare(devc->capture_handle)) < 0
+	    || (ret = snd_pcm_start(devc->capture_handle)) < 0) {
+		sr_err("Can't restart capture (%s).", snd_strerror(ret));
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * Send the frames that are ready straight out of the PCM's mmap'd ring
+ * buffer, as SR_DF_ANALOG_RAW packets of native int16 frames.
+ */
 static int receive_data(int fd, int revents, void *cb_data)
 {
-	struct sr_dev_inst *sdi = cb_data;
-	struct context *ctx = sdi->priv;
+	struct sr_dev_inst *sdi;
+	struct dev_context *devc;
 	struct sr_datafeed_packet packet;
-	struct sr_analog_sample *sample;
-	unsigned int sample_size = sizeof(struct sr_analog_sample) +
-		(NUM_PROBES * sizeof(struct sr_analog_probe));
-	char *outb;
-	char inb[4096];
-	int i, x, count;
-
-	fd = fd;
-	revents = revents;
-
-	do {
-		memset(inb, 0, sizeof(inb));
-		count = snd_pcm_readi(ctx->capture_handle, inb,
-			MIN(4096 / 4, ctx->limit_samples));
-		if (count < 1) {
-			sr_err("Failed to read samples");
-			return FALSE;
-		}
+	struct sr_datafeed_analog_raw raw;
+	struct sr_analog_scale scales[NUM_PROBES];
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t avail, committed;
+	int i, ret;
+
+	(void)fd;
+	(void)revents;
+
+	sdi = cb_data;
+	devc = sdi->priv;
+
+	/* Full scale is 1, the session converts for consumers. */
+	for (i = 0; i < NUM_PROBES; i++) {
+		scales[i].scale = 1.0 / 32768;
+		scales[i].offset = 0;
+	}
 
-		if (!(outb = g_try_malloc(sample_size * count))) {
-			sr_err("%s: outb malloc failed", __func__);
-			return FALSE;
+	packet.type = SR_DF_ANALOG_RAW;
+	packet.payload = &raw;
+	raw.num_probes = NUM_PROBES;
+	/* ALSA doesn't say what voltage full scale is, so it's a ratio. */
+	raw.mq = SR_MQ_GAIN;
+	raw.unit = SR_UNIT_UNITLESS;
+	raw.mqflags = 0;
+	raw.sample_size = SAMPLE_WIDTH / 8;
+	raw.is_signed = TRUE;
+	raw.scales = scales;
+	raw.buffer = NULL;
+
+	while (!devc->limit_samples || devc->num_samples < devc->limit_samples) {
+		if ((avail = snd_pcm_avail_update(devc->capture_handle)) < 0) {
+			if (avail == -EPIPE
+			    && recover_overrun(devc) == SR_OK)
+				continue;
+			sr_err("Failed to read samples (%s).",
+			       snd_strerror(avail));
+			hw_dev_acquisition_stop(sdi, devc->session_dev_id);
+			return TRUE;
 		}
-
-		for (i = 0; i < count; i++) {
-			sample = (struct sr_analog_sample *)
-						(outb + (i * sample_size));
-			sample->num_probes = NUM_PROBES;
-
-			for (x = 0; x < NUM_PROBES; x++) {
-				sample->probes[x].val =
-					*(uint16_t *)(inb + (i * 4) + (x * 2));
-				sample->probes[x].val &= ((1 << 16) - 1);
-				sample->probes[x].res = 16;
-			}
+		if (avail == 0)
+			break;
+
+		frames = avail;
+		if (devc->limit_samples)
+			frames = MIN(frames, devc->limit_samples
+				     - devc->num_samples);
+		ret = snd_pcm_mmap_begin(devc->capture_handle, &areas,
+					 &offset, &frames);
+		if (ret < 0) {
+			sr_err("Failed to map samples (%s).", snd_strerror(ret));
+			hw_dev_acquisition_stop(sdi, devc->session_dev_id);
+			return TRUE;
 		}
 
-		packet.type = SR_DF_ANALOG;
-		packet.length = count * sample_size;
-		packet.unitsize = sample_size;
-		packet.payload = outb;
-		sr_session_send(sdi, &packet);
-		g_free(outb);
-		ctx->limit_samples -= count;
-
-	} while (ctx->limit_samples > 0);
+		/* Interleaved frames: all channels start at the first area. */
+		raw.num_samples = frames;
+		raw.data = (uint8_t *)areas[0].addr + areas[0].first / 8
+			   + offset * areas[0].step / 8;
+		sr_session_send(devc->session_dev_id, &packet);
+		devc->num_samples += frames;
+
+		committed = snd_pcm_mmap_commit(devc->capture_handle, offset,
+						frames);
+		if (committed < 0 || (snd_pcm_uframes_t)committed != frames) {
+			if (committed == -EPIPE
+			    && recover_overrun(devc) == SR_OK)
+				continue;
+			sr_err("Failed to release samples (%s).",
+			       snd_strerror(committed));
+			hw_dev_acquisition_stop(sdi, devc->session_dev_id);
+			return TRUE;
+		}
+	}
 
-	packet.type = SR_DF_END;
-	sr_session_send(sdi, &packet);
+	if (devc->limit_samples && devc->num_samples >= devc->limit_samples)
+		hw_dev_acquisition_stop(sdi, devc->session_dev_id);
 
 	return TRUE;
 }
 
-static int hw_dev_acquisition_start(int dev_index, void *cb_data)
+static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
+				    void *cb_data)
 {
-	struct sr_dev_inst *sdi;
-	struct context *ctx;
+	struct dev_context *devc;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_header header;
+	struct sr_datafeed_meta_analog meta;
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
 	struct pollfd *ufds;
+	unsigned int rate;
 	int count;
 	int ret;
 
-	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
-		return SR_ERR;
-	ctx = sdi->priv;
+	devc = sdi->priv;
 
-	ret = snd_pcm_hw_params_set_access(ctx->capture_handle,
-			ctx->hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+	/* mmap'd access, so samples go out without being copied. */
+	ret = snd_pcm_hw_params_set_access(devc->capture_handle,
+			devc->hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED);
 	if (ret < 0) {
 		sr_err("Can't set access type (%s).", snd_strerror(ret));
 		return SR_ERR;
 	}
 
 	/* FIXME: Hardcoded for 16bits */
-	ret = snd_pcm_hw_params_set_format(ctx->capture_handle,
-			ctx->hw_params, SND_PCM_FORMAT_S16_LE);
+	ret = snd_pcm_hw_params_set_format(devc->capture_handle,
+			devc->hw_params, SND_PCM_FORMAT_S16);
 	if (ret < 0) {
 		sr_err("Can't set sample format (%s).", snd_strerror(ret));
 		return SR_ERR;
 	}
 
-	ret = snd_pcm_hw_params_set_rate_near(ctx->capture_handle,
-			ctx->hw_params, (unsigned int *)&ctx->cur_rate, 0);
+	rate = devc->cur_samplerate;
+	ret = snd_pcm_hw_params_set_rate_near(devc->capture_handle,
+			devc->hw_params, &rate, 0);
 	if (ret < 0) {
 		sr_err("Can't set sample rate (%s).", snd_strerror(ret));
 		return SR_ERR;
 	}
+	if (rate != devc->cur_samplerate)
+		sr_info("Using samplerate %u instead of %" PRIu64 ".", rate,
+			devc->cur_samplerate);
+	devc->cur_samplerate = rate;
 
-	ret = snd_pcm_hw_params_set_channels(ctx->capture_handle,
-			ctx->hw_params, NUM_PROBES);
+	ret = snd_pcm_hw_params_set_channels(devc->capture_handle,
+			devc->hw_params, NUM_PROBES);
 	if (ret < 0) {
 		sr_err("Can't set channel count (%s).", snd_strerror(ret));
 		return SR_ERR;
 	}
 
-	ret = snd_pcm_hw_params(ctx->capture_handle, ctx->hw_params);
+	ret = snd_pcm_hw_params(devc->capture_handle, devc->hw_params);
 	if (ret < 0) {
 		sr_err("Can't set parameters (%s).", snd_strerror(ret));
 		return SR_ERR;
 	}
 
-	ret = snd_pcm_prepare(ctx->capture_handle);
+	ret = snd_pcm_prepare(devc->capture_handle);
 	if (ret < 0) {
 		sr_err("Can't prepare audio interface for use (%s).",
 		       snd_strerror(ret));
 		return SR_ERR;
 	}
 
-	count = snd_pcm_poll_descriptors_count(ctx->capture_handle);
+	/* receive_data() sends frames as they are in the ring buffer. */
+	frames = 1;
+	if (snd_pcm_mmap_begin(devc->capture_handle, &areas, &offset,
+			       &frames) < 0) {
+		sr_err("Can't map the ring buffer.");
+		return SR_ERR;
+	}
+	snd_pcm_mmap_commit(devc->capture_handle, offset, 0);
+	if (areas[0].step != NUM_PROBES * SAMPLE_WIDTH) {
+		sr_err("Unsupported ring buffer layout.");
+		return SR_ERR;
+	}
+
+	count = snd_pcm_poll_descriptors_count(devc->capture_handle);
 	if (count < 1) {
 		sr_err("Unable to obtain poll descriptors count.");
 		return SR_ERR;
@@ -365,7 +526,7 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 		return SR_ERR_MALLOC;
 	}
 
-	ret = snd_pcm_poll_descriptors(ctx->capture_handle, ufds, count);
+	ret = snd_pcm_poll_descriptors(devc->capture_handle, ufds, count);
 	if (ret < 0) {
 		sr_err("Unable to obtain poll descriptors (%s)",
 		       snd_strerror(ret));
@@ -373,29 +534,51 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 		return SR_ERR;
 	}
 
-	ctx->session_dev_id = cb_data;
-	sr_source_add(ufds[0].fd, ufds[0].events, 10, receive_data, sdi);
+	ret = snd_pcm_start(devc->capture_handle);
+	if (ret < 0) {
+		sr_err("Can't start capture (%s).", snd_strerror(ret));
+		g_free(ufds);
+		return SR_ERR;
+	}
+
+	devc->session_dev_id = cb_data;
+	devc->num_samples = 0;
+	devc->pollfd = ufds[0].fd;
+	sr_source_add(ufds[0].fd, ufds[0].events, POLL_INTERVAL,
+		      receive_data, (void *)sdi);
+	g_free(ufds);
 
+	/* Send header packet to the session bus. */
 	packet.type = SR_DF_HEADER;
-	packet.length = sizeof(struct sr_datafeed_header);
-	packet.payload = (unsigned char *)&header;
+	packet.payload = &header;
 	header.feed_version = 1;
 	gettimeofday(&header.starttime, NULL);
-	header.samplerate = ctx->cur_rate;
-	header.num_analog_probes = NUM_PROBES;
-	header.num_logic_probes = 0;
-	header.protocol_id = SR_PROTO_RAW;
 	sr_session_send(cb_data, &packet);
-	g_free(ufds);
+
+	/* Send metadata about the SR_DF_ANALOG_RAW packets to come. */
+	packet.type = SR_DF_META_ANALOG;
+	packet.payload = &meta;
+	meta.num_probes = NUM_PROBES;
+	sr_session_send(cb_data, &packet);
 
 	return SR_OK;
 }
 
-/* TODO: This stops acquisition on ALL devices, ignoring dev_index. */
-static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
+static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi, void *cb_data)
 {
-	(void)dev_index;
-	(void)cb_data;
+	struct dev_context *devc;
+	struct sr_datafeed_packet packet;
+
+	devc = sdi->priv;
+	if (devc->pollfd == -1)
+		return SR_OK;
+
+	sr_source_remove(devc->pollfd);
+	devc->pollfd = -1;
+	snd_pcm_drop(devc->capture_handle);
+
+	packet.type = SR_DF_END;
+	sr_session_send(cb_data, &packet);
 
 	return SR_OK;
 }
@@ -406,12 +589,14 @@ SR_PRIV struct sr_dev_driver alsa_driver_info = {
 	.api_version = 1,
 	.init = hw_init,
 	.cleanup = hw_cleanup,
+	.scan = hw_scan,
+	.dev_list = hw_dev_list,
+	.dev_clear = clear_instances,
 	.dev_open = hw_dev_open,
 	.dev_close = hw_dev_close,
-	.dev_info_get = hw_dev_info_get,
-	.dev_status_get = hw_dev_status_get,
-	.hwcap_get_all = hw_hwcap_get_all,
+	.info_get = hw_info_get,
 	.dev_config_set = hw_dev_config_set,
 	.dev_acquisition_start = hw_dev_acquisition_start,
 	.dev_acquisition_stop = hw_dev_acquisition_stop,
+	.priv = NULL,
 };
@@ -94,6 +94,7 @@ static const int hwcaps[] = {
 	SR_HWCAP_LOGIC_ANALYZER,
 	SR_HWCAP_SAMPLERATE,
 	SR_HWCAP_CAPTURE_RATIO,
+	SR_HWCAP_LIVE_DOWNLOAD,
 
 	SR_HWCAP_LIMIT_MSEC,
 	0,
@@ -264,6 +265,106 @@ static int sigma_read_dram(uint16_t startchunk, size_t numchunks,
 	return sigma_read(data, numchunks * CHUNK_SIZE, devc);
 }
 
+/*
+ * DRAM reader thread: reads batches of chunks while the session thread
+ * decodes the previous ones, so the download doesn't wait for decoding
+ * and vice versa. libftdi only has an async API since 1.0, so this uses
+ * a thread instead.
+ */
+static gpointer reader_run(gpointer data)
+{
+	struct dev_context *devc = data;
+	struct dram_batch *b;
+	int start, n;
+
+	g_mutex_lock(&devc->reader_mutex);
+	while (!devc->reader_stop) {
+		b = &devc->batches[devc->batch_fill];
+		if (b->filled || devc->chunks_read >= devc->chunks_readable) {
+			g_cond_wait(&devc->reader_cond, &devc->reader_mutex);
+			continue;
+		}
+		start = devc->chunks_read;
+		n = MIN(CHUNKS_PER_READ, devc->chunks_readable - start);
+		g_mutex_unlock(&devc->reader_mutex);
+
+		g_mutex_lock(&devc->ftdi_mutex);
+		sigma_read_dram(start, n, b->data, devc);
+		g_mutex_unlock(&devc->ftdi_mutex);
+
+		g_mutex_lock(&devc->reader_mutex);
+		b->startchunk = start;
+		b->numchunks = n;
+		b->filled = TRUE;
+		devc->chunks_read += n;
+		devc->batch_fill = (devc->batch_fill + 1) % NUM_DRAM_BATCHES;
+	}
+	g_mutex_unlock(&devc->reader_mutex);
+
+	return NULL;
+}
+
+static int reader_start(struct dev_context *devc)
+{
+	GError *error = NULL;
+	int i;
+
+	devc->reader_stop = FALSE;
+	devc->chunks_readable = 0;
+	devc->chunks_read = 0;
+	devc->batch_fill = 0;
+	devc->batch_decode = 0;
+	for (i = 0; i < NUM_DRAM_BATCHES; i++)
+		devc->batches[i].filled = FALSE;
+
+	g_mutex_init(&devc->ftdi_mutex);
+	g_mutex_init(&devc->reader_mutex);
+	g_cond_init(&devc->reader_cond);
+
+	devc->reader = g_thread_try_new("asix-sigma-dram", reader_run, devc,
+					&error);
+	if (!devc->reader) {
+		sr_err("Failed to create DRAM reader thread: %s.",
+		       error->message);
+		g_error_free(error);
+		g_cond_clear(&devc->reader_cond);
+		g_mutex_clear(&devc->reader_mutex);
+		g_mutex_clear(&devc->ftdi_mutex);
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+static void reader_stop(struct dev_context *devc)
+{
+	if (!devc->reader)
+		return;
+
+	g_mutex_lock(&devc->reader_mutex);
+	devc->reader_stop = TRUE;
+	g_cond_signal(&devc->reader_cond);
+	g_mutex_unlock(&devc->reader_mutex);
+
+	g_thread_join(devc->reader);
+	devc->reader = NULL;
+
+	g_cond_clear(&devc->reader_cond);
+	g_mutex_clear(&devc->reader_mutex);
+	g_mutex_clear(&devc->ftdi_mutex);
+}
+
+/* Let the reader read up to (not including) chunk 'numchunks'. */
+static void reader_extend(struct dev_context *devc, int numchunks)
+{
+	g_mutex_lock(&devc->reader_mutex);
+	if (numchunks > devc->chunks_readable) {
+		devc->chunks_readable = numchunks;
+		g_cond_signal(&devc->reader_cond);
+	}
+	g_mutex_unlock(&devc->reader_mutex);
+}
+
 /* Upload trigger look-up tables to Sigma. */
 static int sigma_write_trigger_lut(struct triggerlut *lut, struct dev_context *devc)
 {
@@ -327,52 +428,22 @@ static int sigma_write_trigger_lut(struct triggerlut *lut, struct dev_context *d
 static int bin2bitbang(const char *filename,
 		       unsigned char **buf, size_t *buf_size)
 {
-	FILE *f;
-	unsigned long file_size;
-	unsigned long offset = 0;
+	GError *error;
+	gchar *firmware;
+	gsize fwsize, i;
 	unsigned char *p;
-	uint8_t *firmware;
-	unsigned long fwsize = 0;
-	const int buffer_size = 65536;
-	size_t i;
-	int c, bit, v;
+	int bit, v;
+	uint8_t c;
 	uint32_t imm = 0x3f6df2ab;
 
-	f = g_fopen(filename, "rb");
-	if (!f) {
-		sr_err("g_fopen(\"%s\", \"rb\")", filename);
+	error = NULL;
+	if (!g_file_get_contents(filename, &firmware, &fwsize, &error)) {
+		sr_err("Error reading firmware %s: %s", filename,
+		       error->message);
+		g_error_free(error);
 		return SR_ERR;
 	}
 
-	if (-1 == fseek(f, 0, SEEK_END)) {
-		sr_err("fseek on %s failed", filename);
-		fclose(f);
-		return SR_ERR;
-	}
-
-	file_size = ftell(f);
-
-	fseek(f, 0, SEEK_SET);
-
-	if (!(firmware = g_try_malloc(buffer_size))) {
-		sr_err("%s: firmware malloc failed", __func__);
-		fclose(f);
-		return SR_ERR_MALLOC;
-	}
-
-	while ((c = getc(f)) != EOF) {
-		imm = (imm + 0xa853753) % 177 + (imm * 0x8034052);
-		firmware[fwsize++] = c ^ imm;
-	}
-	fclose(f);
-
-	if(fwsize != file_size) {
-	    sr_err("%s: Error reading firmware", filename);
-	    fclose(f);
-	    g_free(firmware);
-	    return SR_ERR;
-	}
-
 	*buf_size = fwsize * 2 * 8;
 
 	*buf = p = (unsigned char *)g_try_malloc(*buf_size);
@@ -383,30 +454,68 @@ static int bin2bitbang(const char *filename,
 	}
 
 	for (i = 0; i < fwsize; ++i) {
+		imm = (imm + 0xa853753) % 177 + (imm * 0x8034052);
+		c = firmware[i] ^ imm;
 		for (bit = 7; bit >= 0; --bit) {
-			v = firmware[i] & 1 << bit ? 0x40 : 0x00;
-			p[offset++] = v | 0x01;
-			p[offset++] = v;
+			v = c & 1 << bit ? 0x40 : 0x00;
+			*p++ = v | 0x01;
+			*p++ = v;
 		}
 	}
 
 	g_free(firmware);
 
-	if (offset != *buf_size) {
-		g_free(*buf);
-		sr_err("Error reading firmware %s "
-		       "offset=%ld, file_size=%ld, buf_size=%zd.",
-		       filename, offset, file_size, *buf_size);
+	return SR_OK;
+}
+
+/*
+ * Bitbang streams of the firmware files, generated on first use and kept
+ * until the driver is cleaned up, so that changing the samplerate, which
+ * reloads the FPGA, doesn't convert the file again.
+ */
+static struct {
+	unsigned char *buf;
+	size_t size;
+} firmware_cache[G_N_ELEMENTS(firmware_files)];
 
-		return SR_ERR;
+static int get_firmware(int firmware_idx, const unsigned char **buf,
+			size_t *buf_size)
+{
+	char firmware_path[128];
+	int ret;
+
+	if (!firmware_cache[firmware_idx].buf) {
+		snprintf(firmware_path, sizeof(firmware_path), "%s/%s",
+			 FIRMWARE_DIR, firmware_files[firmware_idx]);
+		if ((ret = bin2bitbang(firmware_path,
+				&firmware_cache[firmware_idx].buf,
+				&firmware_cache[firmware_idx].size)) != SR_OK) {
+			sr_err("An error occured while reading the firmware: "
+			       "%s", firmware_path);
+			return ret;
+		}
 	}
 
+	*buf = firmware_cache[firmware_idx].buf;
+	*buf_size = firmware_cache[firmware_idx].size;
+
 	return SR_OK;
 }
 
+static void clear_firmware_cache(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(firmware_cache); i++) {
+		g_free(firmware_cache[i].buf);
+		firmware_cache[i].buf = NULL;
+	}
+}
+
 static int clear_instances(void)
 {
 	GSList *l;
+	int i;
 	struct sr_dev_inst *sdi;
 	struct drv_context *drvc;
 	struct dev_context *devc;
@@ -422,7 +531,11 @@ static int clear_instances(void)
 		}
 		if (sdi->priv) {
 			devc = sdi->priv;
+			reader_stop(devc);
 			ftdi_free(&devc->ftdic);
+			for (i = 0; i < NUM_DRAM_BATCHES; i++)
+				g_free(devc->batches[i].data);
+			g_free(devc->samples);
 		}
 		sr_dev_inst_free(sdi);
 	}
@@ -501,6 +614,12 @@ static GSList *hw_scan(GSList *options)
 	devc->samples_per_event = 0;
 	devc->capture_ratio = 50;
 	devc->use_triggers = 0;
+	for (i = 0; i < NUM_DRAM_BATCHES; i++)
+		devc->batches[i].data = NULL;
+	devc->samples = NULL;
+	devc->num_samples = 0;
+	devc->live_download = FALSE;
+	devc->reader = NULL;
 
 	/* Register SIGMA device. */
 	if (!(sdi = sr_dev_inst_new(0, SR_ST_INITIALIZING, USB_VENDOR_NAME,
@@ -544,11 +663,10 @@ static GSList *hw_dev_list(void)
 static int upload_firmware(int firmware_idx, struct dev_context *devc)
 {
 	int ret;
-	unsigned char *buf;
+	const unsigned char *buf;
 	unsigned char pins;
 	size_t buf_size;
 	unsigned char result[32];
-	char firmware_path[128];
 
 	/* Make sure it's an ASIX SIGMA. */
 	if ((ret = ftdi_usb_open_desc(&devc->ftdic,
@@ -590,20 +708,12 @@ static int upload_firmware(int firmware_idx, struct dev_context *devc)
 	}
 
 	/* Prepare firmware. */
-	snprintf(firmware_path, sizeof(firmware_path), "%s/%s", FIRMWARE_DIR,
-		 firmware_files[firmware_idx]);
-
-	if ((ret = bin2bitbang(firmware_path, &buf, &buf_size)) != SR_OK) {
-		sr_err("An error occured while reading the firmware: %s",
-		       firmware_path);
+	if ((ret = get_firmware(firmware_idx, &buf, &buf_size)) != SR_OK)
 		return ret;
-	}
 
 	/* Upload firmare. */
 	sr_info("Uploading firmware file '%s'.", firmware_files[firmware_idx]);
-	sigma_write(buf, buf_size, devc);
-
-	g_free(buf);
+	sigma_write((void *)buf, buf_size, devc);
 
 	if ((ret = ftdi_set_bitmode(&devc->ftdic, 0x00, BITMODE_RESET)) < 0) {
 		sr_err("ftdi_set_bitmode failed: %s",
@@ -701,74 +811,74 @@ static int set_samplerate(const struct sr_dev_inst *sdi, uint64_t samplerate)
 static int configure_probes(const struct sr_dev_inst *sdi)
 {
 	struct dev_context *devc = sdi->priv;
-	const struct sr_probe *probe;
-	const GSList *l;
-	int trigger_set = 0;
-	int probebit;
+	struct sr_trigger *trigger;
+	uint64_t levels, edges, rising, falling;
+	int ret;
 
 	memset(&devc->trigger, 0, sizeof(struct sigma_trigger));
 
-	for (l = sdi->probes; l; l = l->next) {
-		probe = (struct sr_probe *)l->data;
-		probebit = 1 << (probe->index);
-
-		if (!probe->enabled || !probe->trigger)
-			continue;
+	if (sr_trigger_new(sdi, 0, &trigger) != SR_OK)
+		return SR_ERR;
 
-		if (devc->cur_samplerate >= SR_MHZ(100)) {
-			/* Fast trigger support. */
-			if (trigger_set) {
-				sr_err("Only a single pin trigger in 100 and "
-				       "200MHz mode is supported.");
-				return SR_ERR;
-			}
-			if (probe->trigger[0] == 'f')
-				devc->trigger.fallingmask |= probebit;
-			else if (probe->trigger[0] == 'r')
-				devc->trigger.risingmask |= probebit;
-			else {
-				sr_err("Only rising/falling trigger in 100 "
-				       "and 200MHz mode is supported.");
-				return SR_ERR;
-			}
+	/* The hardware has a single trigger stage. */
+	ret = SR_ERR;
+	if (trigger->num_stages > 1) {
+		sr_err("Only single stage triggers are supported.");
+		goto out;
+	}
+	if (trigger->num_stages == 0) {
+		ret = SR_OK;
+		goto out;
+	}
 
-			++trigger_set;
-		} else {
-			/* Simple trigger support (event). */
-			if (probe->trigger[0] == '1') {
-				devc->trigger.simplevalue |= probebit;
-				devc->trigger.simplemask |= probebit;
-			}
-			else if (probe->trigger[0] == '0') {
-				devc->trigger.simplevalue &= ~probebit;
-				devc->trigger.simplemask |= probebit;
-			}
-			else if (probe->trigger[0] == 'f') {
-				devc->trigger.fallingmask |= probebit;
-				++trigger_set;
-			}
-			else if (probe->trigger[0] == 'r') {
-				devc->trigger.risingmask |= probebit;
-				++trigger_set;
-			}
+	levels = trigger->mask[0] & ~trigger->edge[0];
+	edges = trigger->edge[0];
+	rising = edges & trigger->mask[0] & trigger->value[0];
+	falling = edges & trigger->mask[0] & ~trigger->value[0];
+	if (edges & ~trigger->mask[0]) {
+		sr_err("Change triggers are not supported.");
+		goto out;
+	}
 
-			/*
-			 * Actually, Sigma supports 2 rising/falling triggers,
-			 * but they are ORed and the current trigger syntax
-			 * does not permit ORed triggers.
-			 */
-			if (trigger_set > 1) {
-				sr_err("Only 1 rising/falling trigger "
-				       "is supported.");
-				return SR_ERR;
-			}
+	if (devc->cur_samplerate >= SR_MHZ(100)) {
+		/* Fast trigger support. */
+		if (levels) {
+			sr_err("Only rising/falling trigger in 100 "
+			       "and 200MHz mode is supported.");
+			goto out;
 		}
+		if (edges & (edges - 1)) {
+			sr_err("Only a single pin trigger in 100 and "
+			       "200MHz mode is supported.");
+			goto out;
+		}
+	} else {
+		/* Simple trigger support (event). */
+		devc->trigger.simplevalue = trigger->value[0] & levels;
+		devc->trigger.simplemask = levels;
 
-		if (trigger_set)
-			devc->use_triggers = 1;
+		/*
+		 * Actually, Sigma supports 2 rising/falling triggers,
+		 * but they are ORed and the current trigger syntax
+		 * does not permit ORed triggers.
+		 */
+		if (edges & (edges - 1)) {
+			sr_err("Only 1 rising/falling trigger "
+			       "is supported.");
+			goto out;
+		}
 	}
+	devc->trigger.risingmask = rising;
+	devc->trigger.fallingmask = falling;
 
-	return SR_OK;
+	if (edges)
+		devc->use_triggers = 1;
+	ret = SR_OK;
+
+out:
+	sr_trigger_destroy(trigger);
+
+	return ret;
 }
 
 static int hw_dev_close(struct sr_dev_inst *sdi)
@@ -780,6 +890,8 @@ static int hw_dev_close(struct sr_dev_inst *sdi)
 		return SR_ERR_BUG;
 	}
 
+	reader_stop(devc);
+
 	/* TODO */
 	if (sdi->status == SR_ST_ACTIVE)
 		ftdi_usb_close(&devc->ftdic);
@@ -795,6 +907,7 @@ static int hw_cleanup(void)
 		return SR_OK;
 
 	clear_instances();
+	clear_firmware_cache();
 
 	return SR_OK;
 }
@@ -856,6 +969,10 @@ static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 			ret = SR_ERR;
 		else
 			ret = SR_OK;
+	} else if (hwcap == SR_HWCAP_LIVE_DOWNLOAD) {
+		/* Takes effect when the next acquisition starts. */
+		devc->live_download = GPOINTER_TO_INT(value);
+		ret = SR_OK;
 	} else {
 		ret = SR_ERR;
 	}
@@ -864,12 +981,12 @@ static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 }
 
 /* Software trigger to determine exact trigger position. */
-static int get_trigger_offset(uint16_t *samples, uint16_t last_sample,
+static int get_trigger_offset(uint16_t *samples, int n, uint16_t last_sample,
 			      struct sigma_trigger *t)
 {
 	int i;
 
-	for (i = 0; i < 8; ++i) {
+	for (i = 0; i < MIN(n, 8); ++i) {
 		if (i > 0)
 			last_sample = samples[i-1];
 
@@ -887,11 +1004,75 @@ static int get_trigger_offset(uint16_t *samples, uint16_t last_sample,
 		    (samples[i] & t->fallingmask) != 0)
 			continue;
 
-		break;
+		return i;
 	}
 
 	/* If we did not match, return original trigger pos. */
-	return i & 0x7;
+	return 0;
+}
+
+/*
+ * An event holds 'samples_per_event' samples of each probe, with sample
+ * 'k' of probe 'l' in bit (l * samples_per_event + k). Tabulate, for each
+ * 'k' and each value of an event byte, sample 'k' of the probes whose bits
+ * are in that byte, so an event decodes with two lookups per sample.
+ */
+static void decode_lut_init(struct dev_context *devc)
+{
+	int k, b, l, spe;
+
+	spe = devc->samples_per_event;
+	for (k = 0; k < spe; ++k) {
+		for (b = 0; b < 256; ++b) {
+			devc->event_lut[k][b] = 0;
+			for (l = 0; l < 8 / spe; ++l)
+				devc->event_lut[k][b] |=
+					(!!(b & (1 << (l * spe + k)))) << l;
+		}
+	}
+}
+
+/* Send the decoded samples to sigrok. */
+static void samples_flush(struct dev_context *devc)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+
+	if (devc->num_samples == 0)
+		return;
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.length = devc->num_samples * sizeof(uint16_t);
+	logic.unitsize = 2;
+	logic.data = devc->samples;
+	logic.buffer = NULL;
+	sr_session_send(devc->session_dev_id, &packet);
+
+	devc->num_samples = 0;
+}
+
+/* Make room for 'n' (at most SAMPLE_BUF_SIZE) more samples. */
+static uint16_t *samples_reserve(struct dev_context *devc, size_t n)
+{
+	if (devc->num_samples + n > SAMPLE_BUF_SIZE)
+		samples_flush(devc);
+
+	return devc->samples + devc->num_samples;
+}
+
+/* Fill 'n' samples with 'value', copying ever larger blocks. */
+static void samples_fill(uint16_t *samples, uint16_t value, size_t n)
+{
+	size_t done;
+
+	if (n == 0)
+		return;
+
+	samples[0] = value;
+	for (done = 1; done < n; done *= 2)
+		memcpy(samples + done, samples,
+		       MIN(done, n - done) * sizeof(uint16_t));
 }
 
 /*
@@ -902,6 +1083,10 @@ static int get_trigger_offset(uint16_t *samples, uint16_t last_sample,
  * For 100 MHz, events contain 2 samples for each channel, spread 10 ns apart.
  * For 50 MHz and below, events contain one sample for each channel,
  * spread 20 ns apart.
+ *
+ * The samples are collected in devc->samples, which is only sent to sigrok
+ * when it's full, at the trigger point, and by receive_data() once it has
+ * decoded all chunks it read.
  */
 static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 			   uint16_t *lastsample, int triggerpos,
@@ -909,15 +1094,13 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 {
 	struct sr_dev_inst *sdi = cb_data;
 	struct dev_context *devc = sdi->priv;
-	uint16_t tsdiff, ts;
-	uint16_t samples[65536 * devc->samples_per_event];
 	struct sr_datafeed_packet packet;
-	struct sr_datafeed_logic logic;
-	int i, j, k, l, numpad, tosend;
-	size_t n = 0, sent = 0;
+	uint16_t tsdiff, ts;
+	int i, j, k, numpad, shift, tosend;
+	size_t n;
 	int clustersize = EVENTS_PER_CLUSTER * devc->samples_per_event;
-	uint16_t *event;
-	uint16_t cur_sample;
+	uint16_t *event, *samples, *p;
+	uint8_t lo, hi;
 	int triggerts = -1;
 
 	/* Check if trigger is in this chunk. */
@@ -932,8 +1115,10 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 		triggerts = triggerpos / 7;
 	}
 
+	shift = 8 / devc->samples_per_event;
+
 	/* For each ts. */
-	for (i = 0; i < 64; ++i) {
+	for (i = 0; i < CLUSTERS_PER_CHUNK; ++i) {
 		ts = *(uint16_t *) &buf[i * 16];
 		tsdiff = ts - *lastts;
 		*lastts = ts;
@@ -944,50 +1129,28 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 
 		/* Pad last sample up to current point. */
 		numpad = tsdiff * devc->samples_per_event - clustersize;
-		if (numpad > 0) {
-			for (j = 0; j < numpad; ++j)
-				samples[j] = *lastsample;
-
-			n = numpad;
-		}
-
-		/* Send samples between previous and this timestamp to sigrok. */
-		sent = 0;
-		while (sent < n) {
-			tosend = MIN(2048, n - sent);
-
-			packet.type = SR_DF_LOGIC;
-			packet.payload = &logic;
-			logic.length = tosend * sizeof(uint16_t);
-			logic.unitsize = 2;
-			logic.data = samples + sent;
-			sr_session_send(devc->session_dev_id, &packet);
-
-			sent += tosend;
+		while (numpad > 0) {
+			n = MIN(numpad, SAMPLE_BUF_SIZE);
+			samples_fill(samples_reserve(devc, n), *lastsample, n);
+			devc->num_samples += n;
+			numpad -= n;
 		}
-		n = 0;
 
 		event = (uint16_t *) &buf[i * 16 + 2];
-		cur_sample = 0;
+		samples = p = samples_reserve(devc, clustersize);
 
 		/* For each event in cluster. */
-		for (j = 0; j < 7; ++j) {
+		for (j = 0; j < EVENTS_PER_CLUSTER; ++j) {
+			lo = event[j] & 0xff;
+			hi = event[j] >> 8;
 
 			/* For each sample in event. */
-			for (k = 0; k < devc->samples_per_event; ++k) {
-				cur_sample = 0;
-
-				/* For each probe. */
-				for (l = 0; l < devc->num_probes; ++l)
-					cur_sample |= (!!(event[j] & (1 << (l *
-					   devc->samples_per_event + k)))) << l;
-
-				samples[n++] = cur_sample;
-			}
+			for (k = 0; k < devc->samples_per_event; ++k)
+				*p++ = devc->event_lut[k][lo] |
+				       devc->event_lut[k][hi] << shift;
 		}
 
 		/* Send data up to trigger point (if triggered). */
-		sent = 0;
 		if (i == triggerts) {
 			/*
 			 * Trigger is not always accurate to sample because of
@@ -995,43 +1158,101 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 			 * the actual event. We therefore look at the next
 			 * samples to pinpoint the exact position of the trigger.
 			 */
-			tosend = get_trigger_offset(samples, *lastsample,
+			tosend = get_trigger_offset(samples, clustersize,
+						    *lastsample,
 						    &devc->trigger);
-
-			if (tosend > 0) {
-				packet.type = SR_DF_LOGIC;
-				packet.payload = &logic;
-				logic.length = tosend * sizeof(uint16_t);
-				logic.unitsize = 2;
-				logic.data = samples;
-				sr_session_send(devc->session_dev_id, &packet);
-
-				sent += tosend;
-			}
+			devc->num_samples += tosend;
+			samples_flush(devc);
 
 			/* Only send trigger if explicitly enabled. */
 			if (devc->use_triggers) {
 				packet.type = SR_DF_TRIGGER;
+				packet.payload = NULL;
 				sr_session_send(devc->session_dev_id, &packet);
 			}
+
+			/* Move the rest of the cluster to the front. */
+			memmove(devc->samples, samples + tosend,
+				(clustersize - tosend) * sizeof(uint16_t));
+			devc->num_samples = clustersize - tosend;
+		} else {
+			devc->num_samples += clustersize;
 		}
 
-		/* Send rest of the chunk to sigrok. */
-		tosend = n - sent;
+		*lastsample = p[-1];
+	}
 
-		if (tosend > 0) {
-			packet.type = SR_DF_LOGIC;
-			packet.payload = &logic;
-			logic.length = tosend * sizeof(uint16_t);
-			logic.unitsize = 2;
-			logic.data = samples + sent;
-			sr_session_send(devc->session_dev_id, &packet);
+	return SR_OK;
+}
+
+/*
+ * Decode the batches of chunks the reader has read so far. 'numchunks' is
+ * the number of chunks in the capture, or 0 while it's still running.
+ */
+static void download_decode(struct sr_dev_inst *sdi, int numchunks)
+{
+	struct dev_context *devc = sdi->priv;
+	struct dram_batch *b;
+	gboolean filled;
+	uint8_t *buf;
+	int i;
+
+	for (;;) {
+		g_mutex_lock(&devc->reader_mutex);
+		b = &devc->batches[devc->batch_decode];
+		filled = b->filled;
+		g_mutex_unlock(&devc->reader_mutex);
+		if (!filled)
+			break;
+
+		if (numchunks)
+			sr_info("Downloading sample data: %.0f %%.",
+				100.0 * devc->state.chunks_downloaded /
+				numchunks);
+
+		/* Find first ts. */
+		buf = b->data;
+		if (b->startchunk == 0) {
+			devc->state.lastts = *(uint16_t *) buf - 1;
+			devc->state.lastsample = 0;
+		}
+
+		/* Decode chunks and send them to sigrok. */
+		for (i = 0; i < b->numchunks; ++i) {
+			int limit_chunk = 0;
+
+			/* The last chunk may potentially be only in part. */
+			if (devc->state.chunks_downloaded == numchunks - 1) {
+				/* Find the last valid timestamp */
+				limit_chunk = devc->state.stoppos % 512 + devc->state.lastts;
+			}
+
+			if (devc->state.chunks_downloaded ==
+			    devc->state.triggerchunk)
+				decode_chunk_ts(buf + (i * CHUNK_SIZE),
+						&devc->state.lastts,
+						&devc->state.lastsample,
+						devc->state.triggerpos & 0x1ff,
+						limit_chunk, sdi);
+			else
+				decode_chunk_ts(buf + (i * CHUNK_SIZE),
+						&devc->state.lastts,
+						&devc->state.lastsample,
+						-1, limit_chunk, sdi);
+
+			++devc->state.chunks_downloaded;
 		}
 
-		*lastsample = samples[n - 1];
+		/* Hand the batch back to the reader. */
+		g_mutex_lock(&devc->reader_mutex);
+		b->filled = FALSE;
+		devc->batch_decode = (devc->batch_decode + 1) %
+				     NUM_DRAM_BATCHES;
+		g_cond_signal(&devc->reader_cond);
+		g_mutex_unlock(&devc->reader_mutex);
 	}
 
-	return SR_OK;
+	samples_flush(devc);
 }
 
 static int receive_data(int fd, int revents, void *cb_data)
@@ -1039,86 +1260,60 @@ static int receive_data(int fd, int revents, void *cb_data)
 	struct sr_dev_inst *sdi = cb_data;
 	struct dev_context *devc = sdi->priv;
 	struct sr_datafeed_packet packet;
-	const int chunks_per_read = 32;
-	unsigned char buf[chunks_per_read * CHUNK_SIZE];
-	int bufsz, numchunks, i, newchunks;
+	int numchunks;
 	uint64_t running_msec;
 	struct timeval tv;
 
 	(void)fd;
 	(void)revents;
 
-	/* Get the current position. */
-	sigma_read_pos(&devc->state.stoppos, &devc->state.triggerpos, devc);
-
-	numchunks = (devc->state.stoppos + 511) / 512;
-
 	if (devc->state.state == SIGMA_IDLE)
 		return TRUE;
 
 	if (devc->state.state == SIGMA_CAPTURE) {
+		/* Get the current position. */
+		if (devc->reader)
+			g_mutex_lock(&devc->ftdi_mutex);
+		sigma_read_pos(&devc->state.stoppos, &devc->state.triggerpos,
+			       devc);
+		if (devc->reader)
+			g_mutex_unlock(&devc->ftdi_mutex);
+
+		numchunks = (devc->state.stoppos + 511) / 512;
+
 		/* Check if the timer has expired, or memory is full. */
 		gettimeofday(&tv, 0);
 		running_msec = (tv.tv_sec - devc->start_tv.tv_sec) * 1000 +
 			(tv.tv_usec - devc->start_tv.tv_usec) / 1000;
 
-		if (running_msec < devc->limit_msec && numchunks < 32767)
-			return TRUE; /* While capturing... */
-		else
+		if (running_msec < devc->limit_msec && numchunks < 32767) {
+			/* While capturing, download the chunks written. */
+			if (devc->reader) {
+				reader_extend(devc, devc->state.stoppos / 512);
+				download_decode(sdi, 0);
+			}
+			return TRUE;
+		} else {
 			hw_dev_acquisition_stop(sdi, sdi);
+		}
 
 	} else if (devc->state.state == SIGMA_DOWNLOAD) {
+		numchunks = (devc->state.stoppos + 511) / 512;
+
 		if (devc->state.chunks_downloaded >= numchunks) {
+			reader_stop(devc);
+
 			/* End of samples. */
 			packet.type = SR_DF_END;
 			sr_session_send(devc->session_dev_id, &packet);
 
 			devc->state.state = SIGMA_IDLE;
+			sr_source_remove(0);
 
 			return TRUE;
 		}
 
-		newchunks = MIN(chunks_per_read,
-				numchunks - devc->state.chunks_downloaded);
-
-		sr_info("Downloading sample data: %.0f %%.",
-			100.0 * devc->state.chunks_downloaded / numchunks);
-
-		bufsz = sigma_read_dram(devc->state.chunks_downloaded,
-					newchunks, buf, devc);
-		/* TODO: Check bufsz. For now, just avoid compiler warnings. */
-		(void)bufsz;
-
-		/* Find first ts. */
-		if (devc->state.chunks_downloaded == 0) {
-			devc->state.lastts = *(uint16_t *) buf - 1;
-			devc->state.lastsample = 0;
-		}
-
-		/* Decode chunks and send them to sigrok. */
-		for (i = 0; i < newchunks; ++i) {
-			int limit_chunk = 0;
-
-			/* The last chunk may potentially be only in part. */
-			if (devc->state.chunks_downloaded == numchunks - 1) {
-				/* Find the last valid timestamp */
-				limit_chunk = devc->state.stoppos % 512 + devc->state.lastts;
-			}
-
-			if (devc->state.chunks_downloaded + i == devc->state.triggerchunk)
-				decode_chunk_ts(buf + (i * CHUNK_SIZE),
-						&devc->state.lastts,
-						&devc->state.lastsample,
-						devc->state.triggerpos & 0x1ff,
-						limit_chunk, sdi);
-			else
-				decode_chunk_ts(buf + (i * CHUNK_SIZE),
-						&devc->state.lastts,
-						&devc->state.lastsample,
-						-1, limit_chunk, sdi);
-
-			++devc->state.chunks_downloaded;
-		}
+		download_decode(sdi, numchunks);
 	}
 
 	return TRUE;
@@ -1289,7 +1484,7 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	struct sr_datafeed_header *header;
 	struct sr_datafeed_meta_logic meta;
 	struct clockselect_50 clockselect;
-	int frac, triggerpin, ret;
+	int frac, triggerpin, ret, i;
 	uint8_t triggerselect;
 	struct triggerinout triggerinout_conf;
 	struct triggerlut lut;
@@ -1307,6 +1502,35 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 			return ret;
 	}
 
+	for (i = 0; i < NUM_DRAM_BATCHES; i++) {
+		if (!devc->batches[i].data && !(devc->batches[i].data =
+		    g_try_malloc(CHUNKS_PER_READ * CHUNK_SIZE))) {
+			sr_err("%s: DRAM buffer malloc failed.", __func__);
+			return SR_ERR_MALLOC;
+		}
+	}
+
+	if (!devc->samples && !(devc->samples =
+	    g_try_malloc(SAMPLE_BUF_SIZE * sizeof(uint16_t)))) {
+		sr_err("%s: sample buffer malloc failed.", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	devc->num_samples = 0;
+	decode_lut_init(devc);
+	devc->state.chunks_downloaded = 0;
+
+	/*
+	 * Downloading while capturing relies on the samples being written
+	 * from the start of DRAM on, which doesn't hold with triggers.
+	 */
+	if (devc->live_download && devc->use_triggers) {
+		sr_info("Can't download during capture with triggers set.");
+	} else if (devc->live_download) {
+		if ((ret = reader_start(devc)) != SR_OK)
+			return ret;
+	}
+
 	/* Enter trigger programming mode. */
 	sigma_set_register(WRITE_TRIGGER_SELECT1, 0x20, devc);
 
@@ -1420,16 +1644,25 @@ static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi, void *cb_data)
 {
 	struct dev_context *devc;
 	uint8_t modestatus;
+	int ret;
 
 	(void)cb_data;
 
-	sr_source_remove(0);
-
 	if (!(devc = sdi->priv)) {
 		sr_err("%s: sdi->priv was NULL", __func__);
 		return SR_ERR_BUG;
 	}
 
+	/*
+	 * The capture source stays in place until the download is done,
+	 * see receive_data().
+	 */
+	if (devc->state.state != SIGMA_CAPTURE)
+		return SR_OK;
+
+	if (devc->reader)
+		g_mutex_lock(&devc->ftdi_mutex);
+
 	/* Stop acquisition. */
 	sigma_set_register(WRITE_MODE, 0x11, devc);
 
@@ -1446,9 +1679,13 @@ static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi, void *cb_data)
 	else
 		devc->state.triggerchunk = -1;
 
-	devc->state.chunks_downloaded = 0;
+	if (devc->reader)
+		g_mutex_unlock(&devc->ftdi_mutex);
+	else if ((ret = reader_start(devc)) != SR_OK)
+		return ret;
 
 	devc->state.state = SIGMA_DOWNLOAD;
+	reader_extend(devc, (devc->state.stoppos + 511) / 512);
 
 	return SR_OK;
 }
@@ -25,11 +25,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "asix-sigma: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 enum sigma_write_register {
 	WRITE_CLOCK_SELECT	= 0,
@@ -82,6 +77,23 @@ enum sigma_read_register {
 #define EVENTS_PER_CLUSTER	7
 
 #define CHUNK_SIZE		1024
+#define CLUSTERS_PER_CHUNK	64
+
+/*
+ * DRAM chunks downloaded (and decoded) at a time. sigma_read_dram() needs
+ * three command bytes per chunk, in a buffer of 4096 bytes.
+ */
+#define CHUNKS_PER_READ		256
+
+/*
+ * Size (in samples) of the decoder's output buffer: enough for a batch
+ * of chunks without padding, at four samples per event.
+ */
+#define SAMPLE_BUF_SIZE		(CHUNKS_PER_READ * CLUSTERS_PER_CHUNK * \
+				 EVENTS_PER_CLUSTER * 4)
+
+/* Batches of chunks the DRAM reader thread can be ahead of the decoder. */
+#define NUM_DRAM_BATCHES	2
 
 struct clockselect_50 {
 	uint8_t async;
@@ -166,6 +178,14 @@ enum triggerfunc {
 	FUNC_NXOR,
 };
 
+/* Chunks read from DRAM by the reader thread, see reader_run(). */
+struct dram_batch {
+	uint8_t *data;
+	int startchunk;
+	int numchunks;
+	gboolean filled;
+};
+
 struct sigma_state {
 	enum {
 		SIGMA_UNINITIALIZED = 0,
@@ -197,6 +217,29 @@ struct dev_context {
 	int use_triggers;
 	struct sigma_state state;
 	void *session_dev_id;
+
+	/* Download buffers, allocated on the first acquisition. */
+	struct dram_batch batches[NUM_DRAM_BATCHES];
+	uint16_t *samples;
+	size_t num_samples;
+	/* Sample 'k' of an event byte's probes, see decode_lut_init(). */
+	uint8_t event_lut[4][256];
+
+	/*
+	 * DRAM reader thread. While it runs, all I/O on 'ftdic' happens
+	 * with 'ftdi_mutex' held; the rest is protected by 'reader_mutex'.
+	 */
+	gboolean live_download;
+	GThread *reader;
+	GMutex ftdi_mutex;
+	GMutex reader_mutex;
+	GCond reader_cond;
+	gboolean reader_stop;
+	/* The reader may read chunks up to (not including) this one. */
+	int chunks_readable;
+	int chunks_read;
+	int batch_fill;
+	int batch_decode;
 };
 
 #endif
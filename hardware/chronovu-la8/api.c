@@ -110,14 +110,16 @@ static GSList *hw_scan(GSList *options)
 	devc->limit_msec = 0;
 	devc->limit_samples = 0;
 	devc->session_dev_id = NULL;
-	memset(devc->mangled_buf, 0, BS);
+	memset(devc->mangled_buf, 0, sizeof(devc->mangled_buf));
 	devc->final_buf = NULL;
+	devc->trigger = NULL;
 	devc->trigger_pattern = 0x00; /* Value irrelevant, see trigger_mask. */
 	devc->trigger_mask = 0x00; /* All probes are "don't care". */
 	devc->trigger_timeout = 10; /* Default to 10s trigger timeout. */
 	devc->trigger_found = 0;
 	devc->done = 0;
 	devc->block_counter = 0;
+	devc->reader = NULL;
 	devc->divcount = 0; /* 10ns sample period == 100MHz samplerate */
 	devc->usb_pid = 0;
 
@@ -274,6 +276,11 @@ static int hw_dev_close(struct sr_dev_inst *sdi)
 	sr_dbg("Freeing sample buffer.");
 	g_free(devc->final_buf);
 
+	if (devc->trigger) {
+		sr_trigger_destroy(devc->trigger);
+		devc->trigger = NULL;
+	}
+
 	return SR_OK;
 }
 
@@ -378,7 +385,7 @@ static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 
 static int receive_data(int fd, int revents, void *cb_data)
 {
-	int i, ret;
+	int ret;
 	struct sr_dev_inst *sdi;
 	struct dev_context *devc;
 
@@ -400,24 +407,18 @@ static int receive_data(int fd, int revents, void *cb_data)
 		return FALSE;
 	}
 
-	/* Get one block of data. */
-	if ((ret = la8_read_block(devc)) < 0) {
-		sr_err("%s: la8_read_block error: %d.", __func__, ret);
+	/* Demangle and send what the reader thread got so far. */
+	if ((ret = la8_receive_blocks(devc)) < 0) {
+		sr_err("%s: la8_receive_blocks error: %d.", __func__, ret);
 		hw_dev_acquisition_stop(sdi, sdi);
 		return FALSE;
 	}
 
 	/* We need to get exactly NUM_BLOCKS blocks (i.e. 8MB) of data. */
-	if (devc->block_counter != (NUM_BLOCKS - 1)) {
-		devc->block_counter++;
+	if (devc->block_counter != NUM_BLOCKS)
 		return TRUE;
-	}
-
-	sr_dbg("Sampling finished, sending data to session bus now.");
 
-	/* All data was received and demangled, send it to the session bus. */
-	for (i = 0; i < NUM_BLOCKS; i++)
-		send_block_to_session_bus(devc, i);
+	sr_dbg("Sampling finished, all data was sent to the session bus.");
 
 	hw_dev_acquisition_stop(sdi, sdi);
 
@@ -496,11 +497,14 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	/* Time when we should be done (for detecting trigger timeouts). */
 	devc->done = (devc->divcount + 1) * 0.08388608 + time(NULL)
 			+ devc->trigger_timeout;
-	devc->block_counter = 0;
 	devc->trigger_found = 0;
 
-	/* Hook up a dummy handler to receive data from the LA8. */
-	sr_source_add(-1, G_IO_IN, 0, receive_data, (void *)sdi);
+	/* Read the samples on a thread, so the session keeps running. */
+	if (la8_reader_start(devc) != SR_OK)
+		return SR_ERR;
+
+	/* Hook up a dummy handler to pick up the blocks it has read. */
+	sr_source_add(-1, G_IO_IN, POLL_INTERVAL, receive_data, (void *)sdi);
 
 	return SR_OK;
 }
@@ -509,10 +513,9 @@ static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi, void *cb_data)
 {
 	struct sr_datafeed_packet packet;
 
-	(void)sdi;
-
 	sr_dbg("Stopping acquisition.");
 	sr_source_remove(-1);
+	la8_reader_stop(sdi->priv);
 
 	/* Send end packet to the session bus. */
 	sr_dbg("Sending SR_DF_END.");
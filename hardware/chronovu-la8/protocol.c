@@ -18,6 +18,7 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#include <string.h>
 #include <ftdi.h>
 #include <glib.h>
 #include "libsigrok.h"
@@ -320,55 +321,30 @@ SR_PRIV int la8_reset(struct dev_context *devc)
 SR_PRIV int configure_probes(const struct sr_dev_inst *sdi)
 {
 	struct dev_context *devc;
-	const struct sr_probe *probe;
-	const GSList *l;
-	uint8_t probe_bit;
-	char *tc;
+	struct sr_trigger *trigger;
 
 	devc = sdi->priv;
 	devc->trigger_pattern = 0;
 	devc->trigger_mask = 0; /* Default to "don't care" for all probes. */
 
-	for (l = sdi->probes; l; l = l->next) {
-		probe = (struct sr_probe *)l->data;
-
-		if (!probe) {
-			sr_err("%s: probe was NULL.", __func__);
-			return SR_ERR;
-		}
-
-		/* Skip disabled probes. */
-		if (!probe->enabled)
-			continue;
-
-		/* Skip (enabled) probes with no configured trigger. */
-		if (!probe->trigger)
-			continue;
-
-		/* Note: Must only be run if probe->trigger != NULL. */
-		if (probe->index < 0 || probe->index > 7) {
-			sr_err("%s: Invalid probe index %d, must be "
-			       "between 0 and 7.", __func__, probe->index);
-			return SR_ERR;
-		}
-
-		probe_bit = (1 << (probe->index));
-
-		/* Configure the probe's trigger mask and trigger pattern. */
-		for (tc = probe->trigger; tc && *tc; tc++) {
-			devc->trigger_mask |= probe_bit;
-
-			/* Sanity check, LA8 only supports low/high trigger. */
-			if (*tc != '0' && *tc != '1') {
-				sr_err("%s: Invalid trigger '%c', only "
-				       "'0'/'1' supported.", __func__, *tc);
-				return SR_ERR;
-			}
+	if (devc->trigger) {
+		sr_trigger_destroy(devc->trigger);
+		devc->trigger = NULL;
+	}
+	if (sr_trigger_new(sdi, 0, &trigger) != SR_OK)
+		return SR_ERR;
 
-			if (*tc == '1')
-				devc->trigger_pattern |= probe_bit;
-		}
+	/* The LA8 has a single stage of low/high triggers on 8 probes. */
+	if (trigger->num_stages > 1 || trigger->edge[0]
+	    || trigger->mask[0] > 0xff) {
+		sr_err("%s: Only one stage of '0'/'1' triggers on probes "
+		       "0 to 7 is supported.", __func__);
+		sr_trigger_destroy(trigger);
+		return SR_ERR;
 	}
+	devc->trigger = trigger;
+	devc->trigger_mask = trigger->mask[0];
+	devc->trigger_pattern = trigger->value[0];
 
 	sr_dbg("Trigger mask = 0x%x, trigger pattern = 0x%x.",
 	       devc->trigger_mask, devc->trigger_pattern);
@@ -400,51 +376,193 @@ SR_PRIV int set_samplerate(const struct sr_dev_inst *sdi, uint64_t samplerate)
 	return SR_OK;
 }
 
+/* Read blocks from the LA8 into mangled_buf[], ahead of the demangling. */
+static gpointer reader_run(gpointer data)
+{
+	struct dev_context *devc = data;
+	uint8_t *buf;
+	int block, bytes_read;
+	time_t now;
+
+	g_mutex_lock(&devc->reader_mutex);
+	while (!g_atomic_int_get(&devc->reader_stop)
+	       && devc->blocks_read < NUM_BLOCKS) {
+		block = devc->blocks_read;
+		if (block - devc->block_counter >= NUM_READ_BUFS) {
+			/* Wait for a buffer to be demangled. */
+			g_cond_wait(&devc->reader_cond, &devc->reader_mutex);
+			continue;
+		}
+		g_mutex_unlock(&devc->reader_mutex);
+
+		sr_spew("Reading block %d.", block);
+		buf = devc->mangled_buf[block % NUM_READ_BUFS];
+		bytes_read = la8_read(devc, buf, BS);
+
+		/*
+		 * If first block read got 0 bytes, retry until success or
+		 * timeout.
+		 */
+		if ((bytes_read == 0) && (block == 0)) {
+			do {
+				sr_spew("Reading block 0 (again).");
+				bytes_read = la8_read(devc, buf, BS);
+				/* TODO: How to handle read errors here? */
+				now = time(NULL);
+			} while ((devc->done > now) && (bytes_read == 0)
+				 && !g_atomic_int_get(&devc->reader_stop));
+		}
+
+		g_mutex_lock(&devc->reader_mutex);
+		if (bytes_read != BS) {
+			devc->read_failed = TRUE;
+			devc->read_result = bytes_read;
+			break;
+		}
+		devc->blocks_read++;
+	}
+	g_mutex_unlock(&devc->reader_mutex);
+
+	return NULL;
+}
+
 /**
- * Get a block of data from the LA8.
+ * Start the thread reading the samples from the LA8.
+ *
+ * Reading all of the LA8's 8MB takes a while, so it's done by a thread
+ * of its own. la8_receive_blocks() picks up what it has read so far.
  *
  * @param devc The struct containing private per-device-instance data. Must not
  *            be NULL. devc->ftdic must not be NULL either.
- * @return SR_OK upon success, or SR_ERR upon errors.
+ * @return SR_OK upon success, SR_ERR upon failure.
  */
-SR_PRIV int la8_read_block(struct dev_context *devc)
+SR_PRIV int la8_reader_start(struct dev_context *devc)
 {
-	int i, byte_offset, m, mi, p, index, bytes_read;
-	time_t now;
+	GError *error = NULL;
+
+	devc->reader_stop = 0;
+	devc->block_counter = 0;
+	devc->blocks_read = 0;
+	devc->read_failed = FALSE;
+	devc->read_result = 0;
+
+	g_mutex_init(&devc->reader_mutex);
+	g_cond_init(&devc->reader_cond);
+
+	devc->reader = g_thread_try_new("chronovu-la8-read", reader_run, devc,
+					&error);
+	if (!devc->reader) {
+		sr_err("Failed to create reader thread: %s.", error->message);
+		g_error_free(error);
+		g_cond_clear(&devc->reader_cond);
+		g_mutex_clear(&devc->reader_mutex);
+		return SR_ERR;
+	}
 
-	/* Note: Caller checked that devc and devc->ftdic != NULL. */
+	return SR_OK;
+}
 
-	sr_spew("Reading block %d.", devc->block_counter);
+/**
+ * Stop the reader thread, and wait for it to finish its current read.
+ *
+ * @param devc The struct containing private per-device-instance data. Must not
+ *            be NULL.
+ */
+SR_PRIV void la8_reader_stop(struct dev_context *devc)
+{
+	if (!devc->reader)
+		return;
 
-	bytes_read = la8_read(devc, devc->mangled_buf, BS);
+	g_mutex_lock(&devc->reader_mutex);
+	g_atomic_int_set(&devc->reader_stop, 1);
+	g_cond_signal(&devc->reader_cond);
+	g_mutex_unlock(&devc->reader_mutex);
+
+	g_thread_join(devc->reader);
+	devc->reader = NULL;
+
+	g_cond_clear(&devc->reader_cond);
+	g_mutex_clear(&devc->reader_mutex);
+}
 
-	/* If first block read got 0 bytes, retry until success or timeout. */
-	if ((bytes_read == 0) && (devc->block_counter == 0)) {
-		do {
-			sr_spew("Reading block 0 (again).");
-			bytes_read = la8_read(devc, devc->mangled_buf, BS);
-			/* TODO: How to handle read errors here? */
-			now = time(NULL);
-		} while ((devc->done > now) && (bytes_read == 0));
+/*
+ * De-mangle a block into final_buf. Byte pair j of a block lands at
+ * sample pair (offset in its section / 2 + j) * NUM_SECTIONS + section,
+ * with the two bytes of a pair swapped unless divcount is 0.
+ */
+static void demangle_block(struct dev_context *devc, const uint8_t *in,
+			   int block)
+{
+	uint8_t *out;
+	int byte_offset, m, j;
+
+	byte_offset = block * BS;
+	m = byte_offset / SECTION_SIZE;
+	out = devc->final_buf + m * 2
+		+ ((byte_offset - m * SECTION_SIZE) / 2) * NUM_SECTIONS * 2;
+
+	if (devc->divcount == 0) {
+		for (j = 0; j < BS / 2; j++) {
+			memcpy(out, in, 2);
+			out += NUM_SECTIONS * 2;
+			in += 2;
+		}
+	} else {
+		for (j = 0; j < BS / 2; j++) {
+			out[0] = in[1];
+			out[1] = in[0];
+			out += NUM_SECTIONS * 2;
+			in += 2;
+		}
 	}
+}
 
-	/* Check if block read was successful or a timeout occured. */
-	if (bytes_read != BS) {
-		sr_err("Trigger timed out. Bytes read: %d.", bytes_read);
-		(void) la8_reset(devc); /* Ignore errors. */
-		return SR_ERR;
+/**
+ * Demangle the blocks read so far, and send out the samples completed.
+ *
+ * The samples in final_buf are only complete once the last section has
+ * been read up to them. From there on, each block of that section
+ * completes another NUM_SECTIONS blocks of samples.
+ *
+ * @param devc The struct containing private per-device-instance data. Must not
+ *            be NULL. devc->ftdic must not be NULL either.
+ * @return SR_OK upon success (all samples were sent once block_counter
+ *         reaches NUM_BLOCKS), or SR_ERR upon read errors or timeouts.
+ */
+SR_PRIV int la8_receive_blocks(struct dev_context *devc)
+{
+	int block, blocks_read, first, i;
+	gboolean read_failed;
+
+	g_mutex_lock(&devc->reader_mutex);
+	blocks_read = devc->blocks_read;
+	read_failed = devc->read_failed;
+	g_mutex_unlock(&devc->reader_mutex);
+
+	while ((block = devc->block_counter) < blocks_read) {
+		sr_spew("Demangling block %d.", block);
+		demangle_block(devc, devc->mangled_buf[block % NUM_READ_BUFS],
+			       block);
+
+		/* Hand the buffer back to the reader thread. */
+		g_mutex_lock(&devc->reader_mutex);
+		devc->block_counter++;
+		g_cond_signal(&devc->reader_cond);
+		g_mutex_unlock(&devc->reader_mutex);
+
+		first = block - (NUM_BLOCKS - BLOCKS_PER_SECTION);
+		if (first < 0)
+			continue;
+		for (i = 0; i < NUM_SECTIONS; i++)
+			send_block_to_session_bus(devc,
+						  first * NUM_SECTIONS + i);
 	}
 
-	/* De-mangle the data. */
-	sr_spew("Demangling block %d.", devc->block_counter);
-	byte_offset = devc->block_counter * BS;
-	m = byte_offset / (1024 * 1024);
-	mi = m * (1024 * 1024);
-	for (i = 0; i < BS; i++) {
-		p = i & (1 << 0);
-		index = m * 2 + (((byte_offset + i) - mi) / 2) * 16;
-		index += (devc->divcount == 0) ? p : (1 - p);
-		devc->final_buf[index] = devc->mangled_buf[i];
+	if (read_failed) {
+		sr_err("Trigger timed out. Bytes read: %d.", devc->read_result);
+		la8_reader_stop(devc);
+		(void) la8_reset(devc); /* Ignore errors. */
+		return SR_ERR;
 	}
 
 	return SR_OK;
@@ -452,36 +570,26 @@ SR_PRIV int la8_read_block(struct dev_context *devc)
 
 SR_PRIV void send_block_to_session_bus(struct dev_context *devc, int block)
 {
-	int i;
-	uint8_t sample, expected_sample;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_logic logic;
 	int trigger_point; /* Relative trigger point (in this block). */
+	uint64_t start;
 
 	/* Note: No sanity checks on devc/block, caller is responsible. */
 
-	/* Check if we can find the trigger condition in this block. */
+	/*
+	 * Check if we can find the trigger condition in this block. Don't
+	 * if the trigger was found previously, or if triggers are "don't
+	 * care", i.e. if no trigger conditions were specified by the user.
+	 * In that case we don't want to send an SR_DF_TRIGGER packet at all.
+	 */
 	trigger_point = -1;
-	expected_sample = devc->trigger_pattern & devc->trigger_mask;
-	for (i = 0; i < BS; i++) {
-		/* Don't continue if the trigger was found previously. */
-		if (devc->trigger_found)
-			break;
-
-		/*
-		 * Also, don't continue if triggers are "don't care", i.e. if
-		 * no trigger conditions were specified by the user. In that
-		 * case we don't want to send an SR_DF_TRIGGER packet at all.
-		 */
-		if (devc->trigger_mask == 0x00)
-			break;
-
-		sample = *(devc->final_buf + (block * BS) + i);
-
-		if ((sample & devc->trigger_mask) == expected_sample) {
-			trigger_point = i;
+	if (!devc->trigger_found && devc->trigger_mask != 0x00) {
+		start = devc->trigger->samplecount;
+		if (sr_trigger_find(devc->trigger, devc->final_buf +
+				    (block * BS), BS, 1, NULL)) {
+			trigger_point = devc->trigger->trigger_pos - start;
 			devc->trigger_found = 1;
-			break;
 		}
 	}
 
@@ -495,6 +603,7 @@ SR_PRIV void send_block_to_session_bus(struct dev_context *devc, int block)
 		logic.length = BS;
 		logic.unitsize = 1;
 		logic.data = devc->final_buf + (block * BS);
+		logic.buffer = NULL;
 		sr_session_send(devc->session_dev_id, &packet);
 		return;
 	}
@@ -518,6 +627,7 @@ SR_PRIV void send_block_to_session_bus(struct dev_context *devc, int block)
 		logic.length = trigger_point;
 		logic.unitsize = 1;
 		logic.data = devc->final_buf + (block * BS);
+		logic.buffer = NULL;
 		sr_session_send(devc->session_dev_id, &packet);
 	}
 
@@ -528,17 +638,18 @@ SR_PRIV void send_block_to_session_bus(struct dev_context *devc, int block)
 	packet.payload = NULL;
 	sr_session_send(devc->session_dev_id, &packet);
 
-	/* If at least one sample is located after the trigger... */
-	if (trigger_point < (BS - 1)) {
-		/* Send post-trigger SR_DF_LOGIC packet to the session bus. */
-		sr_spew("Sending post-trigger SR_DF_LOGIC packet, "
-			"start = %d, length = %d.",
-			(block * BS) + trigger_point, BS - trigger_point);
-		packet.type = SR_DF_LOGIC;
-		packet.payload = &logic;
-		logic.length = BS - trigger_point;
-		logic.unitsize = 1;
-		logic.data = devc->final_buf + (block * BS) + trigger_point;
-		sr_session_send(devc->session_dev_id, &packet);
-	}
+	/*
+	 * Send the trigger sample and the ones after it as the post-trigger
+	 * SR_DF_LOGIC packet.
+	 */
+	sr_spew("Sending post-trigger SR_DF_LOGIC packet, "
+		"start = %d, length = %d.",
+		(block * BS) + trigger_point, BS - trigger_point);
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.length = BS - trigger_point;
+	logic.unitsize = 1;
+	logic.data = devc->final_buf + (block * BS) + trigger_point;
+	logic.buffer = NULL;
+	sr_session_send(devc->session_dev_id, &packet);
 }
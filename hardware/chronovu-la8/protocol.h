@@ -30,11 +30,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "la8: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 #define USB_VENDOR_ID			0x0403
 #define USB_DESCRIPTION			"ChronoVu LA8"
@@ -50,6 +45,20 @@
 #define BS				4096 /* Block size */
 #define NUM_BLOCKS			2048 /* Number of blocks */
 
+/*
+ * The SDRAM is read out in sections of 1MB, each of which holds every
+ * eighth pair of samples.
+ */
+#define SECTION_SIZE			(1024 * 1024)
+#define NUM_SECTIONS			(SDRAM_SIZE / SECTION_SIZE)
+#define BLOCKS_PER_SECTION		(SECTION_SIZE / BS)
+
+/* Number of blocks the reader thread may read ahead. */
+#define NUM_READ_BUFS			32
+
+/* Interval (in ms) at which the session picks up the blocks read. */
+#define POLL_INTERVAL			10
+
 /* Private, per-device-instance driver context. */
 struct dev_context {
 	/** FTDI device context (used by libftdi). */
@@ -68,10 +77,11 @@ struct dev_context {
 	void *session_dev_id;
 
 	/**
-	 * A buffer containing some (mangled) samples from the device.
+	 * Blocks of (mangled) samples from the device, read ahead by the
+	 * reader thread. Block n is in mangled_buf[n % NUM_READ_BUFS].
 	 * Format: Pretty mangled-up (due to hardware reasons), see code.
 	 */
-	uint8_t mangled_buf[BS];
+	uint8_t mangled_buf[NUM_READ_BUFS][BS];
 
 	/**
 	 * An 8MB buffer where we'll store the de-mangled samples.
@@ -92,6 +102,9 @@ struct dev_context {
 	 */
 	uint8_t trigger_mask;
 
+	/** The probe triggers, compiled when the acquisition starts. */
+	struct sr_trigger *trigger;
+
 	/** Time (in seconds) before the trigger times out. */
 	uint64_t trigger_timeout;
 
@@ -101,9 +114,22 @@ struct dev_context {
 	/** TODO */
 	time_t done;
 
-	/** Counter/index for the data block to be read. */
+	/** Counter/index for the data block to be demangled. */
 	int block_counter;
 
+	/** Thread reading blocks from the device, see la8_reader_start(). */
+	GThread *reader;
+	/** Protects the reader fields below, and block_counter. */
+	GMutex reader_mutex;
+	/** Signalled when a block was demangled, or the reader should stop. */
+	GCond reader_cond;
+	volatile gint reader_stop;
+	/** Number of blocks the reader thread read so far. */
+	int blocks_read;
+	/** Whether the reader thread gave up, and what the last read got. */
+	gboolean read_failed;
+	int read_result;
+
 	/** The divcount value (determines the sample period) for the LA8. */
 	uint8_t divcount;
 
@@ -126,7 +152,9 @@ SR_PRIV int la8_close_usb_reset_sequencer(struct dev_context *devc);
 SR_PRIV int la8_reset(struct dev_context *devc);
 SR_PRIV int configure_probes(const struct sr_dev_inst *sdi);
 SR_PRIV int set_samplerate(const struct sr_dev_inst *sdi, uint64_t samplerate);
-SR_PRIV int la8_read_block(struct dev_context *devc);
+SR_PRIV int la8_reader_start(struct dev_context *devc);
+SR_PRIV void la8_reader_stop(struct dev_context *devc);
+SR_PRIV int la8_receive_blocks(struct dev_context *devc);
 SR_PRIV void send_block_to_session_bus(struct dev_context *devc, int block);
 
 #endif
@@ -0,0 +1,175 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Batch helpers for the DMM protocol parsers.
+ *
+ * Replaying a recorded DMM log means framing and decoding millions of
+ * packets. Instead of going through a driver's per-packet path, the log
+ * is handed to sr_dmm_find_packets(), which locates the valid packets
+ * of one chipset, and sr_dmm_parse_packets(), which decodes all of them
+ * into plain arrays of values, quantities, units and flags.
+ *
+ * Both work on any chipset described by a struct sr_dmm_chip.
+ */
+
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "dmm: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/* Room for whichever info struct a chipset's parser fills in. */
+union dmm_info {
+	struct fs9721_info fs9721;
+	struct metex14_info metex14;
+};
+
+static int parse_fs9922(const uint8_t *buf, float *floatval,
+			struct sr_datafeed_analog *analog, void *info)
+{
+	(void)info;
+
+	return sr_dmm_parse_fs9922(buf, floatval, analog);
+}
+
+SR_PRIV const struct sr_dmm_chip sr_dmm_chip_fs9721 = {
+	"fs9721", FS9721_PACKET_SIZE, sr_fs9721_is_packet_start,
+	sr_fs9721_packet_valid, sr_fs9721_parse,
+};
+
+SR_PRIV const struct sr_dmm_chip sr_dmm_chip_fs9922 = {
+	"fs9922", FS9922_PACKET_SIZE, sr_fs9922_is_packet_start,
+	sr_fs9922_packet_valid, parse_fs9922,
+};
+
+SR_PRIV const struct sr_dmm_chip sr_dmm_chip_metex14 = {
+	"metex14", METEX14_PACKET_SIZE, NULL,
+	sr_metex14_packet_valid, sr_metex14_parse,
+};
+
+SR_PRIV const struct sr_dmm_chip sr_dmm_chip_rs9lcd = {
+	"rs9lcd", RS9LCD_PACKET_SIZE, NULL,
+	sr_rs9lcd_packet_valid, sr_rs9lcd_parse,
+};
+
+/**
+ * Find the valid packets of a DMM chipset in a byte stream.
+ *
+ * Bytes which don't start a valid packet are skipped one at a time, so
+ * the stream resynchronizes by itself after garbage. A valid packet is
+ * skipped as a whole.
+ *
+ * @param chip The chipset. Must not be NULL.
+ * @param buf The byte stream. Must not be NULL.
+ * @param len The number of bytes in 'buf'.
+ * @param offsets Where to store the offsets of the packets found in 'buf'.
+ *                Must not be NULL.
+ * @param max_packets The number of offsets 'offsets' has room for.
+ * @param used Where to store the number of bytes of 'buf' handled; the
+ *             ones after that may still start a packet and should be
+ *             passed in again with more data. May be NULL.
+ *
+ * @return The number of packets found.
+ */
+SR_PRIV size_t sr_dmm_find_packets(const struct sr_dmm_chip *chip,
+		const uint8_t *buf, size_t len, size_t *offsets,
+		size_t max_packets, size_t *used)
+{
+	size_t i, n;
+
+	i = n = 0;
+	while (n < max_packets && len - i >= chip->packet_size) {
+		if ((!chip->is_packet_start || chip->is_packet_start(buf[i]))
+				&& chip->packet_valid(buf + i)) {
+			offsets[n++] = i;
+			i += chip->packet_size;
+		} else {
+			i++;
+		}
+	}
+
+	if (used)
+		*used = i;
+
+	return n;
+}
+
+/**
+ * Decode DMM packets into arrays of values.
+ *
+ * Entry i of each array is set from packet i. Packets which don't decode
+ * to a measurement get a NAN value and a quantity of -1.
+ *
+ * @param chip The chipset. Must not be NULL.
+ * @param buf The buffer containing the packets. Must not be NULL.
+ * @param offsets The offsets of the packets in 'buf', as returned by
+ *                sr_dmm_find_packets(). If NULL, the packets follow
+ *                each other in 'buf'.
+ * @param num_packets The number of packets.
+ * @param values Where to store the values. Must not be NULL.
+ * @param mqs Where to store the measured quantities (SR_MQ_*). May be NULL.
+ * @param units Where to store the units (SR_UNIT_*). May be NULL.
+ * @param mqflags Where to store the flags (SR_MQFLAG_*). May be NULL.
+ *
+ * @return The number of packets which decoded to a measurement.
+ */
+SR_PRIV size_t sr_dmm_parse_packets(const struct sr_dmm_chip *chip,
+		const uint8_t *buf, const size_t *offsets, size_t num_packets,
+		float *values, int *mqs, int *units, uint64_t *mqflags)
+{
+	struct sr_datafeed_analog analog;
+	union dmm_info info;
+	const uint8_t *packet;
+	size_t i, n;
+
+	n = 0;
+	for (i = 0; i < num_packets; i++) {
+		packet = buf + (offsets ? offsets[i] : i * chip->packet_size);
+
+		memset(&analog, 0, sizeof(struct sr_datafeed_analog));
+		memset(&info, 0, sizeof(union dmm_info));
+		analog.mq = -1;
+		analog.data = &values[i];
+		if (chip->packet_parse(packet, &values[i], &analog,
+				       &info) != SR_OK)
+			analog.mq = -1;
+
+		if (analog.mq == -1) {
+			values[i] = NAN;
+			analog.unit = 0;
+			analog.mqflags = 0;
+		} else {
+			n++;
+		}
+		if (mqs)
+			mqs[i] = analog.mq;
+		if (units)
+			units[i] = analog.unit;
+		if (mqflags)
+			mqflags[i] = analog.mqflags;
+	}
+
+	sr_spew("%s: decoded %zu of %zu packets.", chip->name, n,
+		num_packets);
+
+	return n;
+}
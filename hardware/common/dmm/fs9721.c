@@ -41,39 +41,24 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "fs9721: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
+
+/*
+ * Digit + 1 for each 7-segment code (bit 7 cleared), so that the codes
+ * which aren't digits map to 0.
+ */
+static const uint8_t digit_table[128] = {
+	[0x7d] = 1, [0x05] = 2, [0x5b] = 3, [0x1f] = 4, [0x27] = 5,
+	[0x3e] = 6, [0x7e] = 7, [0x15] = 8, [0x7f] = 9, [0x3f] = 10,
+};
 
 static int parse_digit(uint8_t b)
 {
-	switch (b) {
-	case 0x7d:
-		return 0;
-	case 0x05:
-		return 1;
-	case 0x5b:
-		return 2;
-	case 0x1f:
-		return 3;
-	case 0x27:
-		return 4;
-	case 0x3e:
-		return 5;
-	case 0x7e:
-		return 6;
-	case 0x15:
-		return 7;
-	case 0x7f:
-		return 8;
-	case 0x3f:
-		return 9;
-	default:
+	if (!digit_table[b & 0x7f]) {
 		sr_err("Invalid digit byte: 0x%02x.", b);
 		return -1;
 	}
+
+	return digit_table[b & 0x7f] - 1;
 }
 
 static gboolean sync_nibbles_valid(const uint8_t *buf)
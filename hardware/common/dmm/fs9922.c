@@ -32,11 +32,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "fs9922: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 /**
  * Parse the numerical value from a protocol packet.
@@ -299,6 +294,22 @@ static int parse_flags(const uint8_t *buf, float *floatval,
 	return SR_OK;
 }
 
+SR_PRIV gboolean sr_fs9922_is_packet_start(uint8_t b)
+{
+	return (b == '+' || b == '-');
+}
+
+SR_PRIV gboolean sr_fs9922_packet_valid(const uint8_t *buf)
+{
+	/* Sign, separator, decimal point and line end are fixed. */
+	if (!sr_fs9922_is_packet_start(buf[0]) || buf[5] != ' ')
+		return FALSE;
+	if (buf[6] != '0' && buf[6] != '1' && buf[6] != '2' && buf[6] != '4')
+		return FALSE;
+
+	return (buf[12] == '\r' && buf[13] == '\n');
+}
+
 /**
  * Parse a Fortune Semiconductor FS9922-DMM3/4 protocol packet.
  *
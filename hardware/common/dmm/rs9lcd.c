@@ -38,11 +38,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "rs9lcd: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 /* Byte 1 of the packet, and the modes it represents */
 #define IND1_HZ		0x80
@@ -227,42 +222,32 @@ SR_PRIV gboolean sr_rs9lcd_packet_valid(const uint8_t *buf)
 	return TRUE;
 }
 
+/*
+ * Digit + 1 for each LCD value (decimal point taken out), so that the
+ * values which aren't digits map to 0. A blank digit reads as 0.
+ */
+static const uint8_t digit_table[256] = {
+	[0x00] = 1,
+	[LCD_0] = 1, [LCD_1] = 2, [LCD_2] = 3, [LCD_3] = 4, [LCD_4] = 5,
+	[LCD_5] = 6, [LCD_6] = 7, [LCD_7] = 8, [LCD_8] = 9, [LCD_9] = 10,
+};
+
 static uint8_t decode_digit(uint8_t raw_digit)
 {
-	/* Take out the decimal point, so we can use a simple switch(). */
+	/* Take out the decimal point. */
 	raw_digit &= ~DP_MASK;
 
-	switch (raw_digit) {
-	case 0x00:
-	case LCD_0:
-		return 0;
-	case LCD_1:
-		return 1;
-	case LCD_2:
-		return 2;
-	case LCD_3:
-		return 3;
-	case LCD_4:
-		return 4;
-	case LCD_5:
-		return 5;
-	case LCD_6:
-		return 6;
-	case LCD_7:
-		return 7;
-	case LCD_8:
-		return 8;
-	case LCD_9:
-		return 9;
-	default:
+	if (!digit_table[raw_digit]) {
 		sr_err("Invalid digit byte: 0x%02x.", raw_digit);
 		return 0xff;
 	}
+
+	return digit_table[raw_digit] - 1;
 }
 
 static double lcd_to_double(const struct rs9lcd_packet *rs_packet, int type)
 {
-	double rawval, multiplier = 1;
+	double rawval = 0, multiplier = 1;
 	uint8_t digit, raw_digit;
 	gboolean dp_reached = FALSE;
 	int i, end;
@@ -369,7 +354,7 @@ SR_PRIV int sr_rs9lcd_parse(const uint8_t *buf, float *floatval,
 	case MODE_CONT:
 		analog->mq = SR_MQ_CONTINUITY;
 		analog->unit = SR_UNIT_BOOLEAN;
-		*analog->data = is_shortcirc(rs_packet);
+		rawval = is_shortcirc(rs_packet);
 		break;
 	case MODE_DIODE:
 		analog->mq = SR_MQ_VOLTAGE;
@@ -394,7 +379,7 @@ SR_PRIV int sr_rs9lcd_parse(const uint8_t *buf, float *floatval,
 		} else {
 			/* We have either HI or LOW. */
 			analog->unit = SR_UNIT_BOOLEAN;
-			*analog->data = is_logic_high(rs_packet);
+			rawval = is_logic_high(rs_packet);
 		}
 		break;
 	case MODE_HFE:
@@ -412,10 +397,11 @@ SR_PRIV int sr_rs9lcd_parse(const uint8_t *buf, float *floatval,
 	case MODE_AMP_WIDTH:
 		analog->mq = SR_MQ_PULSE_WIDTH;
 		analog->unit = SR_UNIT_SECOND;
+		break;
 	case MODE_TEMP:
 		analog->mq = SR_MQ_TEMPERATURE;
 		/* We need to reparse. */
-		*analog->data = lcd_to_double(rs_packet, READ_TEMP);
+		rawval = lcd_to_double(rs_packet, READ_TEMP);
 		analog->unit = is_celsius(rs_packet) ?
 				SR_UNIT_CELSIUS : SR_UNIT_FAHRENHEIT;
 		break;
@@ -33,11 +33,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "ezusb: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 SR_PRIV int ezusb_reset(struct libusb_device_handle *hdl, int set_clear)
 {
@@ -56,29 +51,139 @@ SR_PRIV int ezusb_reset(struct libusb_device_handle *hdl, int set_clear)
 	return ret;
 }
 
+/*
+ * Firmware images are kept in memory once read, so that uploading to
+ * several devices, or again on the next scan, doesn't read the file each
+ * time. An image is read again when the file changes.
+ */
+struct fw_image {
+	char *filename;
+	gint64 mtime;
+	gint64 size;
+	unsigned char *data;
+	gsize len;
+	int refcount;
+};
+
+static GMutex fw_mutex;
+static GSList *fw_images;
+
+/* Call with fw_mutex held. */
+static void fw_image_unref_locked(struct fw_image *img)
+{
+	if (--img->refcount > 0)
+		return;
+
+	g_free(img->filename);
+	g_free(img->data);
+	g_free(img);
+}
+
+static void fw_image_unref(struct fw_image *img)
+{
+	g_mutex_lock(&fw_mutex);
+	fw_image_unref_locked(img);
+	g_mutex_unlock(&fw_mutex);
+}
+
+static struct fw_image *fw_image_get(const char *filename)
+{
+	struct fw_image *img, *old;
+	GStatBuf st;
+	GError *error;
+	GSList *l;
+	gchar *data;
+	gsize len;
+
+	if (g_stat(filename, &st) < 0) {
+		sr_err("Unable to open firmware file %s for reading: %s",
+		       filename, strerror(errno));
+		return NULL;
+	}
+
+	g_mutex_lock(&fw_mutex);
+
+	old = NULL;
+	for (l = fw_images; l; l = l->next) {
+		old = l->data;
+		if (!strcmp(old->filename, filename))
+			break;
+	}
+	if (l && old->mtime == st.st_mtime && old->size == st.st_size) {
+		old->refcount++;
+		g_mutex_unlock(&fw_mutex);
+		return old;
+	}
+
+	error = NULL;
+	if (!g_file_get_contents(filename, &data, &len, &error)) {
+		sr_err("Unable to read firmware file %s: %s", filename,
+		       error->message);
+		g_error_free(error);
+		g_mutex_unlock(&fw_mutex);
+		return NULL;
+	}
+
+	if (!(img = g_try_malloc0(sizeof(struct fw_image)))) {
+		sr_err("Firmware image malloc failed.");
+		g_free(data);
+		g_mutex_unlock(&fw_mutex);
+		return NULL;
+	}
+	img->filename = g_strdup(filename);
+	img->mtime = st.st_mtime;
+	img->size = st.st_size;
+	img->data = (unsigned char *)data;
+	img->len = len;
+	/* One for the cache, one for the caller. */
+	img->refcount = 2;
+
+	if (l) {
+		fw_images = g_slist_delete_link(fw_images, l);
+		fw_image_unref_locked(old);
+	}
+	fw_images = g_slist_prepend(fw_images, img);
+
+	g_mutex_unlock(&fw_mutex);
+
+	return img;
+}
+
+/**
+ * Drop the firmware images kept in memory.
+ *
+ * Drivers uploading firmware call this from their cleanup callback.
+ */
+SR_PRIV void ezusb_firmware_cache_clear(void)
+{
+	GSList *l;
+
+	g_mutex_lock(&fw_mutex);
+	for (l = fw_images; l; l = l->next)
+		fw_image_unref_locked(l->data);
+	g_slist_free(fw_images);
+	fw_images = NULL;
+	g_mutex_unlock(&fw_mutex);
+}
+
 SR_PRIV int ezusb_install_firmware(libusb_device_handle *hdl,
 				   const char *filename)
 {
-	FILE *fw;
+	struct fw_image *img;
 	int offset, chunksize, ret, result;
-	unsigned char buf[4096];
 
 	sr_info("Uploading firmware at %s", filename);
-	if ((fw = g_fopen(filename, "rb")) == NULL) {
-		sr_err("Unable to open firmware file %s for reading: %s",
-		       filename, strerror(errno));
+	if (!(img = fw_image_get(filename)))
 		return SR_ERR;
-	}
 
 	result = SR_OK;
 	offset = 0;
-	while (1) {
-		chunksize = fread(buf, 1, 4096, fw);
-		if (chunksize == 0)
-			break;
+	while (offset < (int)img->len) {
+		chunksize = MIN(4096, (int)img->len - offset);
 		ret = libusb_control_transfer(hdl, LIBUSB_REQUEST_TYPE_VENDOR |
 					      LIBUSB_ENDPOINT_OUT, 0xa0, offset,
-					      0x0000, buf, chunksize, 100);
+					      0x0000, img->data + offset,
+					      chunksize, 100);
 		if (ret < 0) {
 			sr_err("Unable to send firmware to device: %s.",
 					libusb_error_name(ret));
@@ -88,7 +193,7 @@ SR_PRIV int ezusb_install_firmware(libusb_device_handle *hdl,
 		sr_info("Uploaded %d bytes", chunksize);
 		offset += chunksize;
 	}
-	fclose(fw);
+	fw_image_unref(img);
 	sr_info("Firmware upload done");
 
 	return result;
@@ -28,6 +28,7 @@
 #include <windows.h>
 #else
 #include <glob.h>
+#include <poll.h>
 #include <termios.h>
 #include <sys/ioctl.h>
 #endif
@@ -40,11 +41,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "serial: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 // FIXME: Must be moved, or rather passed as function argument.
 #ifdef _WIN32
@@ -77,6 +73,8 @@ SR_PRIV int serial_open(struct sr_serial_dev_inst *serial, int flags)
 
 	sr_spew("Opening serial port '%s' (flags %d).", serial->port, flags);
 
+	serial->rbuf_start = serial->rbuf_len = 0;
+
 #ifdef _WIN32
 	/* Map 'flags' to the OS-specific settings. */
 	desired_access |= GENERIC_READ;
@@ -155,6 +153,7 @@ SR_PRIV int serial_close(struct sr_serial_dev_inst *serial)
 #endif
 
 	serial->fd = -1;
+	serial->rbuf_start = serial->rbuf_len = 0;
 
 	return ret;
 }
@@ -183,6 +182,7 @@ SR_PRIV int serial_flush(struct sr_serial_dev_inst *serial)
 
 	sr_spew("Flushing serial port %s (fd %d).", serial->port, serial->fd);
 	ret = SR_OK;
+	serial->rbuf_start = serial->rbuf_len = 0;
 
 #ifdef _WIN32
 	/* Returns non-zero upon success, 0 upon failure. */
@@ -244,37 +244,52 @@ SR_PRIV int serial_write(struct sr_serial_dev_inst *serial,
 	return ret;
 }
 
-/**
- * Read a number of bytes from the specified serial port.
- *
- * @param serial Previously initialized serial port structure.
- * @param buf Buffer where to store the bytes that are read.
- * @param count The number of bytes to read.
- *
- * @return The number of bytes read, or -1 upon failure.
- */
-SR_PRIV int serial_read(struct sr_serial_dev_inst *serial, void *buf,
+/* Drop 'count' bytes from the front of the port's read-ahead buffer. */
+static void rbuf_consume(struct sr_serial_dev_inst *serial, size_t count)
+{
+	serial->rbuf_start += count;
+	serial->rbuf_len -= count;
+	if (serial->rbuf_len == 0)
+		serial->rbuf_start = 0;
+}
+
+/* Take up to 'count' bytes out of the port's read-ahead buffer. */
+static size_t rbuf_take(struct sr_serial_dev_inst *serial, void *buf,
 		size_t count)
 {
-	ssize_t ret;
+	count = MIN(count, serial->rbuf_len);
+	memcpy(buf, serial->rbuf + serial->rbuf_start, count);
+	rbuf_consume(serial, count);
 
-	if (!serial) {
-		sr_dbg("Invalid serial port.");
-		return -1;
-	}
+	return count;
+}
 
-	if (serial->fd == -1) {
-		sr_dbg("Cannot use unopened serial port %s (fd %d).",
-				serial->port, serial->fd);
-		return -1;
-	}
+/* Push bytes read too early back in front of the read-ahead buffer. */
+static void rbuf_put(struct sr_serial_dev_inst *serial, const void *buf,
+		size_t count)
+{
+	count = MIN(count, SERIAL_RBUF_SIZE - 1 - serial->rbuf_len);
+	memmove(serial->rbuf + count, serial->rbuf + serial->rbuf_start,
+		serial->rbuf_len);
+	memcpy(serial->rbuf, buf, count);
+	serial->rbuf_start = 0;
+	serial->rbuf_len += count;
+}
+
+/* Read from the port itself, bypassing the read-ahead buffer. */
+static int read_port(struct sr_serial_dev_inst *serial, void *buf,
+		size_t count)
+{
+	ssize_t ret;
 
 #ifdef _WIN32
 	DWORD tmp = 0;
 
 	/* FIXME */
 	/* Returns non-zero upon success, 0 upon failure. */
-	return ReadFile(hdl, buf, count, &tmp, NULL);
+	if (!ReadFile(hdl, buf, count, &tmp, NULL))
+		return -1;
+	ret = tmp;
 #else
 	/* Returns the number of bytes read, or -1 upon failure. */
 	ret = read(serial->fd, buf, count);
@@ -291,6 +306,38 @@ SR_PRIV int serial_read(struct sr_serial_dev_inst *serial, void *buf,
 	return ret;
 }
 
+/**
+ * Read a number of bytes from the specified serial port.
+ *
+ * Bytes which are waiting in the port's read-ahead buffer (see
+ * serial_fill()) are returned first, without touching the port.
+ *
+ * @param serial Previously initialized serial port structure.
+ * @param buf Buffer where to store the bytes that are read.
+ * @param count The number of bytes to read.
+ *
+ * @return The number of bytes read, or -1 upon failure.
+ */
+SR_PRIV int serial_read(struct sr_serial_dev_inst *serial, void *buf,
+		size_t count)
+{
+	if (!serial) {
+		sr_dbg("Invalid serial port.");
+		return -1;
+	}
+
+	if (serial->fd == -1) {
+		sr_dbg("Cannot use unopened serial port %s (fd %d).",
+				serial->port, serial->fd);
+		return -1;
+	}
+
+	if (serial->rbuf_len > 0)
+		return rbuf_take(serial, buf, count);
+
+	return read_port(serial, buf, count);
+}
+
 /**
  * Set serial parameters for the specified serial port.
  *
@@ -378,6 +425,16 @@ SR_PRIV int serial_set_params(struct sr_serial_dev_inst *serial, int baudrate,
 	case 256000:
 		dcb.BaudRate = CBR_256000; /* Not available on Unix? */
 		break;
+	/* Higher rates are passed as they are, if the driver takes them. */
+	case 230400:
+	case 460800:
+	case 921600:
+	case 1000000:
+	case 1500000:
+	case 2000000:
+	case 3000000:
+		dcb.BaudRate = baudrate;
+		break;
 	default:
 		sr_err("Unsupported baudrate: %d.", baudrate);
 		return SR_ERR;
@@ -511,6 +568,36 @@ SR_PRIV int serial_set_params(struct sr_serial_dev_inst *serial, int baudrate,
 	case 460800:
 		baud = B460800;
 		break;
+#endif
+#ifdef B500000
+	case 500000:
+		baud = B500000;
+		break;
+#endif
+#ifdef B921600
+	case 921600:
+		baud = B921600;
+		break;
+#endif
+#ifdef B1000000
+	case 1000000:
+		baud = B1000000;
+		break;
+#endif
+#ifdef B1500000
+	case 1500000:
+		baud = B1500000;
+		break;
+#endif
+#ifdef B2000000
+	case 2000000:
+		baud = B2000000;
+		break;
+#endif
+#ifdef B3000000
+	case 3000000:
+		baud = B3000000;
+		break;
 #endif
 	default:
 		sr_err("Unsupported baudrate: %d.", baudrate);
@@ -728,6 +815,55 @@ SR_PRIV int serial_set_paramstr(struct sr_serial_dev_inst *serial,
 	}
 }
 
+/*
+ * Wait until the port has bytes to read, for at most 'timeout_ms'.
+ *
+ * Returns 1 if bytes may be read, 0 on timeout and -1 upon failure.
+ */
+static int serial_wait_readable(struct sr_serial_dev_inst *serial,
+		gint64 timeout_ms)
+{
+	if (serial->rbuf_len > 0)
+		return 1;
+
+#ifdef _WIN32
+	/* No poll() on a HANDLE: try reading again after a short nap. */
+	g_usleep(MIN(timeout_ms, 2) * 1000);
+
+	return 1;
+#else
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = serial->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (timeout_ms > G_MAXINT)
+		timeout_ms = G_MAXINT;
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
+		sr_err("Error polling serial port %s: %s.", serial->port,
+		       strerror(errno));
+		return -1;
+	}
+
+	return ret > 0;
+#endif
+}
+
+/* Milliseconds left until 'deadline' (in monotonic time), rounded up. */
+static gint64 time_left_ms(gint64 deadline)
+{
+	gint64 left;
+
+	left = deadline - g_get_monotonic_time();
+
+	return left > 0 ? (left + 999) / 1000 : 0;
+}
+
 /**
  * Read a line from the specified serial port.
  *
@@ -736,17 +872,25 @@ SR_PRIV int serial_set_paramstr(struct sr_serial_dev_inst *serial,
  * @param buflen Size of the buffer.
  * @param timeout_ms How long to wait for a line to come in.
  *
- * Reading stops when CR of LR is found, which is stripped from the buffer.
+ * Reading stops when CR or LF is found, which is stripped from the buffer.
+ * A CR directly followed by LF counts as a single line end.
+ *
+ * The port is polled rather than read byte by byte: whatever it has is
+ * read into its read-ahead buffer in one go (see serial_fill()), and
+ * bytes beyond the end of the line stay there for the next read.
  *
  * @return SR_OK on success, SR_ERR on failure.
  */
 SR_PRIV int serial_readline(struct sr_serial_dev_inst *serial, char **buf,
 		int *buflen, gint64 timeout_ms)
 {
-	gint64 start;
-	int maxlen, len;
+	gint64 deadline, left;
+	size_t i;
+	int maxlen, ret;
+	gboolean eol;
+	uint8_t c, *p;
 
-	if (!serial || serial->fd == -1) {
+	if (!serial) {
 		sr_dbg("Invalid serial port.");
 		return SR_ERR;
 	}
@@ -754,34 +898,44 @@ SR_PRIV int serial_readline(struct sr_serial_dev_inst *serial, char **buf,
 	if (serial->fd == -1) {
 		sr_dbg("Cannot use unopened serial port %s (fd %d).",
 				serial->port, serial->fd);
-		return -1;
+		return SR_ERR;
 	}
 
-	timeout_ms *= 1000;
-	start = g_get_monotonic_time();
+	deadline = g_get_monotonic_time() + timeout_ms * 1000;
 
 	maxlen = *buflen;
-	*buflen = len = 0;
-	while(1) {
-		len = maxlen - *buflen - 1;
-		if (len < 1)
-			break;
-		len = serial_read(serial, *buf + *buflen, 1);
-		if (len > 0) {
-			*buflen += len;
-			*(*buf + *buflen) = '\0';
-			if (*buflen > 0 && (*(*buf + *buflen - 1) == '\r'
-					|| *(*buf + *buflen - 1) == '\n')) {
-				/* Strip CR/LF and terminate. */
-				*(*buf + --*buflen) = '\0';
+	*buflen = 0;
+	eol = FALSE;
+	while (1) {
+		/* Move what has been read so far over to the line. */
+		p = serial->rbuf + serial->rbuf_start;
+		for (i = 0; i < serial->rbuf_len && *buflen < maxlen - 1; i++) {
+			c = p[i];
+			if (c == '\r' || c == '\n') {
+				eol = TRUE;
+				i++;
+				if (c == '\r' && i < serial->rbuf_len
+						&& p[i] == '\n')
+					i++;
 				break;
 			}
+			(*buf)[(*buflen)++] = c;
 		}
-		if (g_get_monotonic_time() - start > timeout_ms)
+		rbuf_consume(serial, i);
+
+		if (eol || *buflen >= maxlen - 1)
+			break;
+
+		if ((left = time_left_ms(deadline)) == 0)
 			/* Timeout */
 			break;
-		g_usleep(2000);
+		if ((ret = serial_wait_readable(serial, left)) < 0)
+			break;
+		if (ret > 0)
+			serial_fill(serial);
 	}
+	if (maxlen > 0)
+		(*buf)[*buflen] = '\0';
 	if (*buflen)
 		sr_dbg("Received %d: '%s'.", *buflen, *buf);
 
@@ -798,9 +952,12 @@ SR_PRIV int serial_readline(struct sr_serial_dev_inst *serial, char **buf,
  * @param is_valid Callback that assesses whether the packet is valid or not.
  * @param timeout_ms The timeout after which, if no packet is detected, to
  *                   abort scanning.
- * @param baudrate The baudrate of the serial port. This parameter is not
- *                 critical, but it helps fine tune the serial port polling
- *                 delay.
+ * @param baudrate The baudrate of the serial port. Only used for logging;
+ *                 the port is polled for data instead of being read at
+ *                 the expected byte rate.
+ *
+ * On success, 'buflen' is set to the end of the valid packet. Bytes read
+ * beyond it are put into the port's read-ahead buffer.
  *
  * @return SR_OK if a valid packet is found within the given timeout,
  *         SR_ERR upon failure.
@@ -810,9 +967,10 @@ SR_PRIV int serial_stream_detect(struct sr_serial_dev_inst *serial,
 				 size_t packet_size, packet_valid_t is_valid,
 				 uint64_t timeout_ms, int baudrate)
 {
-	uint64_t start, time, byte_delay_us;
+	gint64 start, deadline, left;
+	uint64_t time;
 	size_t ibuf, i, maxlen;
-	int len;
+	int len, ret;
 
 	maxlen = *buflen;
 
@@ -824,44 +982,44 @@ SR_PRIV int serial_stream_detect(struct sr_serial_dev_inst *serial,
 		return SR_ERR;
 	}
 
-	/* Assume 8n1 transmission. That is 10 bits for every byte. */
-	byte_delay_us = 10 * (1000000 / baudrate);
 	start = g_get_monotonic_time();
+	deadline = start + timeout_ms * 1000;
 
-	i = ibuf = len = 0;
+	i = ibuf = 0;
 	while (ibuf < maxlen) {
-		len = serial_read(serial, &buf[ibuf], 1);
-		if (len > 0) {
-			ibuf += len;
-		} else if (len == 0) {
-			sr_spew("Error: Only read 0 bytes.");
-		} else {
-			/* Error reading byte, but continuing anyway. */
-		}
-
-		time = g_get_monotonic_time() - start;
-		time /= 1000;
-
-		if ((ibuf - i) >= packet_size) {
-			/* We have at least a packet's worth of data. */
+		/* Check every packet-sized window that's complete. */
+		while ((ibuf - i) >= packet_size) {
+			time = (g_get_monotonic_time() - start) / 1000;
 			if (is_valid(&buf[i])) {
 				sr_spew("Found valid %d-byte packet after "
-					"%" PRIu64 "ms.", (ibuf - i), time);
-				*buflen = ibuf;
+					"%" PRIu64 "ms.", packet_size, time);
+				/* Keep what follows it for serial_read(). */
+				rbuf_put(serial, &buf[i + packet_size],
+					 ibuf - i - packet_size);
+				*buflen = i + packet_size;
 				return SR_OK;
-			} else {
-				sr_spew("Got %d bytes, but not a valid "
-					"packet.", (ibuf - i));
 			}
 			/* Not a valid packet. Continue searching. */
 			i++;
 		}
-		if (time >= timeout_ms) {
+
+		if ((left = time_left_ms(deadline)) == 0) {
 			/* Timeout */
-			sr_dbg("Detection timed out after %dms.", time);
+			sr_dbg("Detection timed out after %" PRIu64 "ms.",
+			       timeout_ms);
 			break;
 		}
-		g_usleep(byte_delay_us);
+		if ((ret = serial_wait_readable(serial, left)) < 0)
+			break;
+		if (ret == 0)
+			continue;
+
+		/* Read all the port has, as far as it fits. */
+		len = serial_read(serial, &buf[ibuf], maxlen - ibuf);
+		if (len > 0)
+			ibuf += len;
+		else if (len == 0)
+			sr_spew("Error: Only read 0 bytes.");
 	}
 
 	*buflen = ibuf;
@@ -870,3 +1028,131 @@ SR_PRIV int serial_stream_detect(struct sr_serial_dev_inst *serial,
 
 	return SR_ERR;
 }
+
+/**
+ * Read all the bytes the specified serial port has into its read-ahead
+ * buffer.
+ *
+ * Drivers call this once when the port becomes readable, then take what
+ * arrived out of the buffer with serial_get_packet() or serial_get_line().
+ * That's a single read() per wakeup, however many bytes the port has,
+ * and packets are parsed where they were read to.
+ *
+ * Use this on ports opened with SERIAL_NONBLOCK, or when poll() said the
+ * port is readable.
+ *
+ * @param serial Previously initialized serial port structure.
+ *
+ * @return The number of bytes read (0 if the port has none or the buffer
+ *         is full), or -1 upon failure.
+ */
+SR_PRIV int serial_fill(struct sr_serial_dev_inst *serial)
+{
+	size_t space;
+	int len;
+
+	if (!serial || serial->fd == -1) {
+		sr_dbg("Invalid serial port.");
+		return -1;
+	}
+
+	/*
+	 * Consumed bytes are only moved out of the way once the data has
+	 * crept halfway up the buffer, not after every packet.
+	 */
+	if (serial->rbuf_start > 0 && serial->rbuf_start + serial->rbuf_len
+			>= SERIAL_RBUF_SIZE / 2) {
+		memmove(serial->rbuf, serial->rbuf + serial->rbuf_start,
+			serial->rbuf_len);
+		serial->rbuf_start = 0;
+	}
+
+	/* Leave room for serial_get_line() to terminate a line. */
+	space = SERIAL_RBUF_SIZE - 1 - serial->rbuf_start - serial->rbuf_len;
+	if (space == 0)
+		return 0;
+
+	len = read_port(serial, serial->rbuf + serial->rbuf_start
+			+ serial->rbuf_len, space);
+	if (len < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	serial->rbuf_len += len;
+
+	return len;
+}
+
+/**
+ * Take the next valid fixed-size packet out of the port's read-ahead
+ * buffer.
+ *
+ * Bytes in front of the first window that 'is_valid' accepts are
+ * dropped, so the stream resynchronizes by itself after garbage.
+ *
+ * @param serial Previously initialized serial port structure.
+ * @param packet_size Size, in bytes, of a valid packet. At most
+ *                    SERIAL_RBUF_SIZE - 1.
+ * @param is_valid Callback that assesses whether the packet is valid or not.
+ *
+ * @return The packet, inside the read-ahead buffer, or NULL if no
+ *         complete valid packet has arrived yet. It stays valid until the
+ *         next call on this port.
+ */
+SR_PRIV const uint8_t *serial_get_packet(struct sr_serial_dev_inst *serial,
+		size_t packet_size, packet_valid_t is_valid)
+{
+	const uint8_t *packet;
+
+	while (serial->rbuf_len >= packet_size) {
+		packet = serial->rbuf + serial->rbuf_start;
+		if (is_valid(packet)) {
+			rbuf_consume(serial, packet_size);
+			return packet;
+		}
+		rbuf_consume(serial, 1);
+	}
+
+	return NULL;
+}
+
+/**
+ * Take the next line out of the port's read-ahead buffer.
+ *
+ * The delimiter is replaced by a NUL, so the line can be used as a string.
+ * If half the buffer fills up without a delimiter, that is returned as a
+ * line, so that an overlong line can't stall the port.
+ *
+ * @param serial Previously initialized serial port structure.
+ * @param delim The character which ends a line.
+ * @param len Where to store the length of the line, without the
+ *            delimiter. May be NULL.
+ *
+ * @return The line, inside the read-ahead buffer, or NULL if no complete
+ *         line has arrived yet. It stays valid until the next call on
+ *         this port.
+ */
+SR_PRIV char *serial_get_line(struct sr_serial_dev_inst *serial, char delim,
+		int *len)
+{
+	char *line, *end;
+	size_t n;
+
+	if (serial->rbuf_len == 0)
+		return NULL;
+
+	line = (char *)serial->rbuf + serial->rbuf_start;
+	if ((end = memchr(line, delim, serial->rbuf_len))) {
+		n = end - line;
+		rbuf_consume(serial, n + 1);
+	} else if (serial->rbuf_len >= SERIAL_RBUF_SIZE / 2) {
+		sr_dbg("Line too long, passing it on in pieces.");
+		n = serial->rbuf_len;
+		rbuf_consume(serial, n);
+	} else {
+		return NULL;
+	}
+	line[n] = '\0';
+	if (len)
+		*len = n;
+
+	return line;
+}
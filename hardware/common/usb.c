@@ -32,11 +32,223 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "usb: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
+
+/* libusb_dev_mem_alloc() appeared in libusb 1.0.21. */
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define HAVE_LIBUSB_DEV_MEM 1
+#endif
+
+#ifdef HAVE_LIBUSB_DEV_MEM
+/*
+ * The buffers handed out by libusb_dev_mem_alloc(), mapped to the device
+ * handle they belong to. Drivers move transfer buffers around, so a
+ * buffer has to be recognized as one of these when it's freed.
+ */
+static struct {
+	GMutex mutex;
+	GHashTable *bufs;
+} dev_mem;
+#endif
+
+/*
+ * A snapshot of the USB device list, shared by the scan jobs of one
+ * sr_scan_all() call, so the bus is enumerated and each device
+ * descriptor is read once rather than once per driver.
+ */
+struct sr_usb_snapshot {
+	GMutex mutex;
+	libusb_context *usb_ctx;
+	/* NULL once the snapshot is dropped. */
+	libusb_device **devlist;
+	ssize_t num_devs;
+	struct libusb_device_descriptor *descs;
+	int *desc_rets;
+};
+
+/* The snapshot the calling thread answers from, if any. */
+static GPrivate thread_snapshot = G_PRIVATE_INIT(NULL);
+
+/**
+ * Take a snapshot of the USB devices on the system.
+ *
+ * Only threads which select it with sr_usb_snapshot_use() answer from
+ * it, until it is dropped.
+ *
+ * @param usb_ctx libusb context to enumerate with.
+ *
+ * @return The snapshot, or NULL upon errors.
+ */
+SR_PRIV struct sr_usb_snapshot *sr_usb_snapshot_new(libusb_context *usb_ctx)
+{
+	struct sr_usb_snapshot *snap;
+	ssize_t i, cnt;
+
+	if (!(snap = g_try_malloc0(sizeof(struct sr_usb_snapshot)))) {
+		sr_err("Snapshot malloc failed.");
+		return NULL;
+	}
+
+	if ((cnt = libusb_get_device_list(usb_ctx, &snap->devlist)) < 0) {
+		sr_err("Failed to retrieve device list: %s.",
+		       libusb_error_name(cnt));
+		g_free(snap);
+		return NULL;
+	}
+
+	snap->descs = g_try_malloc(MAX(cnt, 1) * sizeof(*snap->descs));
+	snap->desc_rets = g_try_malloc(MAX(cnt, 1) * sizeof(int));
+	if (!snap->descs || !snap->desc_rets) {
+		sr_err("Snapshot malloc failed.");
+		g_free(snap->descs);
+		g_free(snap->desc_rets);
+		libusb_free_device_list(snap->devlist, 1);
+		g_free(snap);
+		return NULL;
+	}
+
+	for (i = 0; i < cnt; i++)
+		snap->desc_rets[i] = libusb_get_device_descriptor(
+				snap->devlist[i], &snap->descs[i]);
+
+	g_mutex_init(&snap->mutex);
+	snap->usb_ctx = usb_ctx;
+	snap->num_devs = cnt;
+	sr_dbg("Took a snapshot of %zd USB device(s).", cnt);
+
+	return snap;
+}
+
+/**
+ * Drop the device list of a snapshot.
+ *
+ * Threads still using it answer from the bus from then on; the snapshot
+ * itself stays valid until sr_usb_snapshot_free().
+ */
+SR_PRIV void sr_usb_snapshot_drop(struct sr_usb_snapshot *snap)
+{
+	g_mutex_lock(&snap->mutex);
+
+	if (snap->devlist) {
+		libusb_free_device_list(snap->devlist, 1);
+		g_free(snap->descs);
+		g_free(snap->desc_rets);
+		snap->devlist = NULL;
+		snap->descs = NULL;
+		snap->desc_rets = NULL;
+		snap->num_devs = 0;
+	}
+
+	g_mutex_unlock(&snap->mutex);
+}
+
+/**
+ * Free a snapshot taken with sr_usb_snapshot_new().
+ *
+ * No thread may be using it anymore.
+ */
+SR_PRIV void sr_usb_snapshot_free(struct sr_usb_snapshot *snap)
+{
+	sr_usb_snapshot_drop(snap);
+	g_mutex_clear(&snap->mutex);
+	g_free(snap);
+}
+
+/**
+ * Select the snapshot the calling thread answers from.
+ *
+ * While one is selected, sr_usb_get_device_list() and
+ * sr_usb_get_device_descriptor() answer from it in this thread.
+ *
+ * @param snap The snapshot, or NULL to answer from the bus again.
+ */
+SR_PRIV void sr_usb_snapshot_use(struct sr_usb_snapshot *snap)
+{
+	g_private_set(&thread_snapshot, snap);
+}
+
+/**
+ * Get the list of USB devices on the system.
+ *
+ * Same as libusb_get_device_list(), but answers from the calling
+ * thread's snapshot if it has one for 'usb_ctx'. Either way the list is
+ * freed with libusb_free_device_list(list, 1).
+ *
+ * @param usb_ctx libusb context to enumerate with.
+ * @param list Where to store the NULL-terminated device list.
+ *
+ * @return The number of devices in the list, or a LIBUSB_ERROR code.
+ */
+SR_PRIV ssize_t sr_usb_get_device_list(libusb_context *usb_ctx,
+		libusb_device ***list)
+{
+	struct sr_usb_snapshot *snap;
+	libusb_device **devlist;
+	ssize_t i, cnt;
+
+	if (!(snap = g_private_get(&thread_snapshot))
+	    || snap->usb_ctx != usb_ctx)
+		return libusb_get_device_list(usb_ctx, list);
+
+	g_mutex_lock(&snap->mutex);
+
+	if (!snap->devlist) {
+		g_mutex_unlock(&snap->mutex);
+		return libusb_get_device_list(usb_ctx, list);
+	}
+
+	/* libusb_free_device_list() frees the array with free(). */
+	cnt = snap->num_devs;
+	if (!(devlist = malloc((cnt + 1) * sizeof(libusb_device *)))) {
+		g_mutex_unlock(&snap->mutex);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	for (i = 0; i < cnt; i++)
+		devlist[i] = libusb_ref_device(snap->devlist[i]);
+	devlist[cnt] = NULL;
+
+	g_mutex_unlock(&snap->mutex);
+
+	*list = devlist;
+
+	return cnt;
+}
+
+/**
+ * Get the device descriptor of a USB device.
+ *
+ * Same as libusb_get_device_descriptor(), but answers from the calling
+ * thread's snapshot if the device is in it.
+ *
+ * @param dev The device.
+ * @param des Where to store the descriptor.
+ *
+ * @return 0 upon success, or a LIBUSB_ERROR code.
+ */
+SR_PRIV int sr_usb_get_device_descriptor(libusb_device *dev,
+		struct libusb_device_descriptor *des)
+{
+	struct sr_usb_snapshot *snap;
+	ssize_t i;
+	int ret;
+
+	if (!(snap = g_private_get(&thread_snapshot)))
+		return libusb_get_device_descriptor(dev, des);
+
+	g_mutex_lock(&snap->mutex);
+
+	for (i = 0; i < snap->num_devs; i++) {
+		if (snap->devlist[i] != dev)
+			continue;
+		if ((ret = snap->desc_rets[i]) == 0)
+			*des = snap->descs[i];
+		g_mutex_unlock(&snap->mutex);
+		return ret;
+	}
+
+	g_mutex_unlock(&snap->mutex);
+
+	return libusb_get_device_descriptor(dev, des);
+}
 
 /**
  * Find USB devices according to a connection string.
@@ -120,9 +332,9 @@ SR_PRIV GSList *sr_usb_find(libusb_context *usb_ctx, const char *conn)
 
 	/* Looks like a valid USB device specification, but is it connected? */
 	devices = NULL;
-	libusb_get_device_list(usb_ctx, &devlist);
+	sr_usb_get_device_list(usb_ctx, &devlist);
 	for (i = 0; devlist[i]; i++) {
-		if ((ret = libusb_get_device_descriptor(devlist[i], &des))) {
+		if ((ret = sr_usb_get_device_descriptor(devlist[i], &des))) {
 			sr_err("Failed to get device descriptor: %s.",
 			       libusb_error_name(ret));
 			continue;
@@ -158,7 +370,7 @@ SR_PRIV int sr_usb_open(libusb_context *usb_ctx, struct sr_usb_dev_inst *usb)
 
 	sr_dbg("Trying to open USB device.");
 
-	if ((cnt = libusb_get_device_list(usb_ctx, &devlist)) < 0) {
+	if ((cnt = sr_usb_get_device_list(usb_ctx, &devlist)) < 0) {
 		sr_err("Failed to retrieve device list: %s.",
 		       libusb_error_name(cnt));
 		return SR_ERR;
@@ -166,7 +378,7 @@ SR_PRIV int sr_usb_open(libusb_context *usb_ctx, struct sr_usb_dev_inst *usb)
 
 	ret = SR_ERR;
 	for (i = 0; i < cnt; i++) {
-		if ((r = libusb_get_device_descriptor(devlist[i], &des)) < 0) {
+		if ((r = sr_usb_get_device_descriptor(devlist[i], &des)) < 0) {
 			sr_err("Failed to get device descriptor: %s.",
 			       libusb_error_name(r));
 			continue;
@@ -197,3 +409,73 @@ SR_PRIV int sr_usb_open(libusb_context *usb_ctx, struct sr_usb_dev_inst *usb)
 
 	return ret;
 }
+
+/**
+ * Allocate a buffer for bulk transfers of a device.
+ *
+ * Where libusb and the kernel support it, the buffer is mapped from
+ * usbfs, so that transfers go straight to and from it rather than being
+ * copied by the kernel. Otherwise, e.g. once the kernel's usbfs memory
+ * limit is reached, it comes from the buffer pool (see sr_pool_alloc()).
+ *
+ * The buffer must be freed with sr_usb_buf_free(), before the device is
+ * closed.
+ *
+ * @param usb The device, which must be open.
+ * @param size The size of the buffer, in bytes.
+ *
+ * @return The buffer, or NULL upon memory allocation errors.
+ */
+SR_PRIV uint8_t *sr_usb_buf_alloc(struct sr_usb_dev_inst *usb, size_t size)
+{
+#ifdef HAVE_LIBUSB_DEV_MEM
+	uint8_t *buf;
+
+	if (usb->devhdl && (buf = libusb_dev_mem_alloc(usb->devhdl, size))) {
+		g_mutex_lock(&dev_mem.mutex);
+		if (!dev_mem.bufs)
+			dev_mem.bufs = g_hash_table_new(NULL, NULL);
+		g_hash_table_insert(dev_mem.bufs, buf, usb->devhdl);
+		g_mutex_unlock(&dev_mem.mutex);
+		return buf;
+	}
+#else
+	(void)usb;
+#endif
+
+	return sr_pool_alloc(size);
+}
+
+/**
+ * Free a buffer of sr_usb_buf_alloc(), or of sr_pool_alloc().
+ *
+ * @param buf The buffer. May be NULL.
+ * @param size The size it was allocated with.
+ */
+SR_PRIV void sr_usb_buf_free(uint8_t *buf, size_t size)
+{
+#ifdef HAVE_LIBUSB_DEV_MEM
+	libusb_device_handle *hdl;
+
+	if (!buf)
+		return;
+
+	hdl = NULL;
+	g_mutex_lock(&dev_mem.mutex);
+	if (dev_mem.bufs && (hdl = g_hash_table_lookup(dev_mem.bufs, buf))) {
+		g_hash_table_remove(dev_mem.bufs, buf);
+		if (g_hash_table_size(dev_mem.bufs) == 0) {
+			g_hash_table_destroy(dev_mem.bufs);
+			dev_mem.bufs = NULL;
+		}
+	}
+	g_mutex_unlock(&dev_mem.mutex);
+
+	if (hdl) {
+		libusb_dev_mem_free(hdl, buf, size);
+		return;
+	}
+#endif
+
+	sr_pool_free(buf, size);
+}
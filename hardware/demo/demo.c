@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <math.h>
 #ifdef _WIN32
 #include <io.h>
 #include <fcntl.h>
@@ -34,21 +35,32 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "demo: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
-/* TODO: Number of probes should be configurable. */
-#define NUM_PROBES             8
+/* Number of probes a new demo device has, and the most it can have. */
+#define DEFAULT_NUM_PROBES     8
+#define MAX_NUM_PROBES         64
+#define MAX_NUM_ANALOG_PROBES  8
 
 #define DEMONAME               "Demo device"
 
-/* The size of chunks to send through the session bus. */
-/* TODO: Should be configurable. */
+/* The default size (in bytes) of chunks to send through the session bus. */
 #define BUFSIZE                4096
 
+/*
+ * How many bytes an unthrottled device sends per call of receive_data(),
+ * so that other sources still get their turn.
+ */
+#define UNTHROTTLED_BURST      (4 * 1024 * 1024)
+
+/* Number of samples after which the fixed patterns repeat. */
+#define PATTERN_PERIOD         64
+
+/* Number of samples after which the analog patterns repeat. */
+#define ANALOG_PERIOD          1000
+
+/* Peak value (in volts) of the analog patterns. */
+#define ANALOG_AMPLITUDE       1.0
+
 /* Supported patterns which we can generate */
 enum {
 	/**
@@ -73,24 +85,79 @@ enum {
 	PATTERN_ALL_HIGH,
 };
 
+/* Supported patterns of the analog probes */
+enum {
+	/** One period of a sine wave every ANALOG_PERIOD samples. */
+	ANALOG_PATTERN_SINE,
+
+	/** A square wave with a 50% duty cycle. */
+	ANALOG_PATTERN_SQUARE,
+
+	/** (Pseudo-)random values, repeating every ANALOG_PERIOD samples. */
+	ANALOG_PATTERN_NOISE,
+
+	/** A sawtooth, rising from -ANALOG_AMPLITUDE to ANALOG_AMPLITUDE. */
+	ANALOG_PATTERN_RAMP,
+};
+
 /* Private, per-device-instance driver context. */
 struct dev_context {
 	int pipe_fds[2];
 	GIOChannel *channels[2];
 	uint8_t sample_generator;
+	uint8_t analog_generator;
+	uint64_t cur_samplerate;
+	uint64_t limit_samples;
+	uint64_t limit_msec;
+	uint64_t limit_frames;
+	int num_probes;
+	int num_analog_probes;
+	int unitsize;
+	/* Size of the packets to send, in bytes. */
+	uint64_t chunksize;
+	/* Speed as a multiple of the samplerate, 0 for unthrottled. */
+	uint64_t speed;
+	/* Number of samples per frame, 0 for no frames. */
+	uint64_t framesize;
+	/* Number of samples after which to stop, 0 to run continuously. */
+	uint64_t limit;
 	uint64_t samples_counter;
+	/* State of the xorshift PRNG behind PATTERN_RANDOM, never 0. */
+	uint64_t rng_state;
+	/* PATTERN_PERIOD samples of a fixed pattern. */
+	uint8_t *period;
+	struct sr_buffer *buf;
+	/*
+	 * The enabled analog probes' interleaved values: a whole period,
+	 * followed by as many samples from its start as a chunk has, so
+	 * that any chunk can be sent straight out of it.
+	 */
+	struct sr_buffer *analog_buf;
+	int num_enabled_analog;
+	uint64_t chunk_samples;
+	gboolean running;
 	void *session_dev_id;
 	int64_t starttime;
 };
 
 static const int hwcaps[] = {
 	SR_HWCAP_LOGIC_ANALYZER,
+	SR_HWCAP_OSCILLOSCOPE,
 	SR_HWCAP_DEMO_DEV,
 	SR_HWCAP_SAMPLERATE,
 	SR_HWCAP_PATTERN_MODE,
+	SR_HWCAP_NUM_ANALOG_PROBES,
+	SR_HWCAP_ANALOG_PATTERN_MODE,
+	SR_HWCAP_BUFFERSIZE,
+	SR_HWCAP_CAPTURE_UNITSIZE,
+	SR_HWCAP_CAPTURE_NUM_PROBES,
+	SR_HWCAP_PLAYBACK_SPEED,
+	SR_HWCAP_PLAYBACK_CHUNKSIZE,
 	SR_HWCAP_LIMIT_SAMPLES,
 	SR_HWCAP_LIMIT_MSEC,
+	SR_HWCAP_LIMIT_FRAMES,
 	SR_HWCAP_CONTINUOUS,
+	0,
 };
 
 static const struct sr_samplerates samplerates = {
@@ -109,16 +176,29 @@ static const char *pattern_strings[] = {
 	NULL,
 };
 
-/* We name the probes 0-7 on our demo driver. */
-static const char *probe_names[NUM_PROBES + 1] = {
-	"0",
-	"1",
-	"2",
-	"3",
-	"4",
-	"5",
-	"6",
-	"7",
+static const char *analog_pattern_strings[] = {
+	"sine",
+	"square",
+	"noise",
+	"ramp",
+	NULL,
+};
+
+/* We name the probes 0-63 on our demo driver. */
+static const char *probe_names[MAX_NUM_PROBES + 1] = {
+	"0", "1", "2", "3", "4", "5", "6", "7",
+	"8", "9", "10", "11", "12", "13", "14", "15",
+	"16", "17", "18", "19", "20", "21", "22", "23",
+	"24", "25", "26", "27", "28", "29", "30", "31",
+	"32", "33", "34", "35", "36", "37", "38", "39",
+	"40", "41", "42", "43", "44", "45", "46", "47",
+	"48", "49", "50", "51", "52", "53", "54", "55",
+	"56", "57", "58", "59", "60", "61", "62", "63",
+	NULL,
+};
+
+static const char *analog_probe_names[MAX_NUM_ANALOG_PROBES + 1] = {
+	"A0", "A1", "A2", "A3", "A4", "A5", "A6", "A7",
 	NULL,
 };
 
@@ -133,22 +213,77 @@ static uint8_t pattern_sigrok[] = {
 	0xbe, 0xbe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 };
 
-/* Private, per-device-instance driver context. */
-/* TODO: struct context as with the other drivers. */
-
-/* List of struct sr_dev_inst, maintained by dev_open()/dev_close(). */
 SR_PRIV struct sr_dev_driver demo_driver_info;
 static struct sr_dev_driver *ddi = &demo_driver_info;
-static uint64_t cur_samplerate = SR_KHZ(200);
-static uint64_t limit_samples = 0;
-static uint64_t limit_msec = 0;
-static int default_pattern = PATTERN_SIGROK;
 
 static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi, void *cb_data);
 
+static void free_probes(struct sr_dev_inst *sdi)
+{
+	struct sr_probe *probe;
+	GSList *l;
+
+	for (l = sdi->probes; l; l = l->next) {
+		probe = l->data;
+		g_free(probe->name);
+		g_free(probe->trigger);
+		g_free(probe);
+	}
+	g_slist_free(sdi->probes);
+	sdi->probes = NULL;
+}
+
+/* The analog probes are numbered after the logic probes. */
+static int create_probes(struct sr_dev_inst *sdi, int num_probes,
+			 int num_analog_probes)
+{
+	struct sr_probe *probe;
+	int i;
+
+	free_probes(sdi);
+	for (i = 0; i < num_probes; i++) {
+		if (!(probe = sr_probe_new(i, SR_PROBE_LOGIC, TRUE,
+				probe_names[i])))
+			return SR_ERR_MALLOC;
+		sdi->probes = g_slist_append(sdi->probes, probe);
+	}
+	for (i = 0; i < num_analog_probes; i++) {
+		if (!(probe = sr_probe_new(num_probes + i, SR_PROBE_ANALOG,
+				TRUE, analog_probe_names[i])))
+			return SR_ERR_MALLOC;
+		sdi->probes = g_slist_append(sdi->probes, probe);
+	}
+
+	return SR_OK;
+}
+
 static int clear_instances(void)
 {
-	/* Nothing needed so far. */
+	GSList *l;
+	struct sr_dev_inst *sdi;
+	struct drv_context *drvc;
+	struct dev_context *devc;
+
+	if (!(drvc = ddi->priv))
+		return SR_OK;
+
+	for (l = drvc->instances; l; l = l->next) {
+		sdi = l->data;
+		if ((devc = sdi->priv)) {
+			if (devc->running)
+				hw_dev_acquisition_stop(sdi,
+						devc->session_dev_id);
+			if (devc->buf)
+				sr_buffer_release(devc->buf);
+			if (devc->analog_buf)
+				sr_buffer_release(devc->analog_buf);
+			g_free(devc->period);
+		}
+		free_probes(sdi);
+		sr_dev_inst_free(sdi);
+	}
+	g_slist_free(drvc->instances);
+	drvc->instances = NULL;
 
 	return SR_OK;
 }
@@ -167,31 +302,44 @@ static int hw_init(struct sr_context *sr_ctx)
 	return SR_OK;
 }
 
+/* Every scan adds a demo device, so that several can run at once. */
 static GSList *hw_scan(GSList *options)
 {
 	struct sr_dev_inst *sdi;
-	struct sr_probe *probe;
 	struct drv_context *drvc;
+	struct dev_context *devc;
 	GSList *devices;
-	int i;
 
 	(void)options;
 
 	drvc = ddi->priv;
 	devices = NULL;
 
-	sdi = sr_dev_inst_new(0, SR_ST_ACTIVE, DEMONAME, NULL, NULL);
+	if (!(devc = g_try_malloc0(sizeof(struct dev_context)))) {
+		sr_err("%s: devc malloc failed", __func__);
+		return NULL;
+	}
+	devc->sample_generator = PATTERN_SIGROK;
+	devc->cur_samplerate = SR_KHZ(200);
+	devc->num_probes = DEFAULT_NUM_PROBES;
+	devc->unitsize = 1;
+	devc->chunksize = BUFSIZE;
+	devc->speed = 1;
+
+	sdi = sr_dev_inst_new(g_slist_length(drvc->instances), SR_ST_ACTIVE,
+			      DEMONAME, NULL, NULL);
 	if (!sdi) {
 		sr_err("%s: sr_dev_inst_new failed", __func__);
-		return 0;
+		g_free(devc);
+		return NULL;
 	}
 	sdi->driver = ddi;
+	sdi->priv = devc;
 
-	for (i = 0; probe_names[i]; i++) {
-		if (!(probe = sr_probe_new(i, SR_PROBE_LOGIC, TRUE,
-				probe_names[i])))
-			return NULL;
-		sdi->probes = g_slist_append(sdi->probes, probe);
+	if (create_probes(sdi, devc->num_probes, 0) != SR_OK) {
+		free_probes(sdi);
+		sr_dev_inst_free(sdi);
+		return NULL;
 	}
 
 	devices = g_slist_append(devices, sdi);
@@ -229,21 +377,25 @@ static int hw_dev_close(struct sr_dev_inst *sdi)
 
 static int hw_cleanup(void)
 {
-	/* Nothing needed so far. */
-	return SR_OK;
+	return clear_instances();
 }
 
 static int hw_info_get(int info_id, const void **data,
        const struct sr_dev_inst *sdi)
 {
-	(void)sdi;
+	struct dev_context *devc;
 
 	switch (info_id) {
 	case SR_DI_HWCAPS:
 		*data = hwcaps;
 		break;
 	case SR_DI_NUM_PROBES:
-		*data = GINT_TO_POINTER(NUM_PROBES);
+		if (sdi) {
+			devc = sdi->priv;
+			*data = GINT_TO_POINTER(devc->num_probes);
+		} else {
+			*data = GINT_TO_POINTER(DEFAULT_NUM_PROBES);
+		}
 		break;
 	case SR_DI_PROBE_NAMES:
 		*data = probe_names;
@@ -252,11 +404,17 @@ static int hw_info_get(int info_id, const void **data,
 		*data = &samplerates;
 		break;
 	case SR_DI_CUR_SAMPLERATE:
-		*data = &cur_samplerate;
+		if (!sdi)
+			return SR_ERR;
+		devc = sdi->priv;
+		*data = &devc->cur_samplerate;
 		break;
 	case SR_DI_PATTERNS:
 		*data = &pattern_strings;
 		break;
+	case SR_DI_ANALOG_PATTERNS:
+		*data = &analog_pattern_strings;
+		break;
 	default:
 		return SR_ERR_ARG;
 	}
@@ -264,48 +422,138 @@ static int hw_info_get(int info_id, const void **data,
 	return SR_OK;
 }
 
+/* The smallest unitsize which holds the given number of probes. */
+static int probes_to_unitsize(int num_probes)
+{
+	return (num_probes + 7) / 8;
+}
+
 static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 		const void *value)
 {
-	int ret;
+	struct dev_context *devc;
+	uint64_t tmp_u64;
+	int i, ret;
 	const char *stropt;
 
-	(void)sdi;
+	devc = sdi->priv;
+
+	if (devc->running) {
+		sr_err("%s: can't configure while acquiring", __func__);
+		return SR_ERR;
+	}
 
 	if (hwcap == SR_HWCAP_SAMPLERATE) {
-		cur_samplerate = *(const uint64_t *)value;
+		devc->cur_samplerate = *(const uint64_t *)value;
 		sr_dbg("%s: setting samplerate to %" PRIu64, __func__,
-		       cur_samplerate);
+		       devc->cur_samplerate);
 		ret = SR_OK;
 	} else if (hwcap == SR_HWCAP_LIMIT_SAMPLES) {
-		limit_msec = 0;
-		limit_samples = *(const uint64_t *)value;
+		devc->limit_msec = 0;
+		devc->limit_samples = *(const uint64_t *)value;
 		sr_dbg("%s: setting limit_samples to %" PRIu64, __func__,
-		       limit_samples);
+		       devc->limit_samples);
 		ret = SR_OK;
 	} else if (hwcap == SR_HWCAP_LIMIT_MSEC) {
-		limit_msec = *(const uint64_t *)value;
-		limit_samples = 0;
+		devc->limit_msec = *(const uint64_t *)value;
+		devc->limit_samples = 0;
 		sr_dbg("%s: setting limit_msec to %" PRIu64, __func__,
-		       limit_msec);
+		       devc->limit_msec);
 		ret = SR_OK;
 	} else if (hwcap == SR_HWCAP_PATTERN_MODE) {
 		stropt = value;
 		ret = SR_OK;
 		if (!strcmp(stropt, "sigrok")) {
-			default_pattern = PATTERN_SIGROK;
+			devc->sample_generator = PATTERN_SIGROK;
 		} else if (!strcmp(stropt, "random")) {
-			default_pattern = PATTERN_RANDOM;
+			devc->sample_generator = PATTERN_RANDOM;
 		} else if (!strcmp(stropt, "incremental")) {
-			default_pattern = PATTERN_INC;
+			devc->sample_generator = PATTERN_INC;
 		} else if (!strcmp(stropt, "all-low")) {
-			default_pattern = PATTERN_ALL_LOW;
+			devc->sample_generator = PATTERN_ALL_LOW;
 		} else if (!strcmp(stropt, "all-high")) {
-			default_pattern = PATTERN_ALL_HIGH;
+			devc->sample_generator = PATTERN_ALL_HIGH;
 		} else {
 			ret = SR_ERR;
 		}
-		sr_dbg("%s: setting pattern to %d", __func__, default_pattern);
+		sr_dbg("%s: setting pattern to %d", __func__,
+		       devc->sample_generator);
+	} else if (hwcap == SR_HWCAP_ANALOG_PATTERN_MODE) {
+		stropt = value;
+		ret = SR_ERR;
+		for (i = 0; analog_pattern_strings[i]; i++) {
+			if (!strcmp(stropt, analog_pattern_strings[i])) {
+				devc->analog_generator = i;
+				ret = SR_OK;
+			}
+		}
+		sr_dbg("%s: setting analog pattern to %d", __func__,
+		       devc->analog_generator);
+	} else if (hwcap == SR_HWCAP_CAPTURE_NUM_PROBES) {
+		/* Without logic probes, only analog packets are sent. */
+		tmp_u64 = *(const uint64_t *)value;
+		if (tmp_u64 > MAX_NUM_PROBES) {
+			sr_err("%s: can't have %" PRIu64 " probes", __func__,
+			       tmp_u64);
+			return SR_ERR_ARG;
+		}
+		if ((ret = create_probes((struct sr_dev_inst *)sdi, tmp_u64,
+					 devc->num_analog_probes)) != SR_OK)
+			return ret;
+		devc->num_probes = tmp_u64;
+		/* Widen the samples if they can't hold all probes. */
+		devc->unitsize = MAX(devc->unitsize,
+				     probes_to_unitsize(devc->num_probes));
+		sr_dbg("%s: setting number of probes to %d", __func__,
+		       devc->num_probes);
+	} else if (hwcap == SR_HWCAP_NUM_ANALOG_PROBES) {
+		tmp_u64 = *(const uint64_t *)value;
+		if (tmp_u64 > MAX_NUM_ANALOG_PROBES) {
+			sr_err("%s: can't have %" PRIu64 " analog probes",
+			       __func__, tmp_u64);
+			return SR_ERR_ARG;
+		}
+		if ((ret = create_probes((struct sr_dev_inst *)sdi,
+					 devc->num_probes, tmp_u64)) != SR_OK)
+			return ret;
+		devc->num_analog_probes = tmp_u64;
+		sr_dbg("%s: setting number of analog probes to %d", __func__,
+		       devc->num_analog_probes);
+	} else if (hwcap == SR_HWCAP_BUFFERSIZE) {
+		devc->framesize = *(const uint64_t *)value;
+		sr_dbg("%s: setting frame size to %" PRIu64, __func__,
+		       devc->framesize);
+		ret = SR_OK;
+	} else if (hwcap == SR_HWCAP_LIMIT_FRAMES) {
+		devc->limit_frames = *(const uint64_t *)value;
+		sr_dbg("%s: setting limit_frames to %" PRIu64, __func__,
+		       devc->limit_frames);
+		ret = SR_OK;
+	} else if (hwcap == SR_HWCAP_CAPTURE_UNITSIZE) {
+		tmp_u64 = *(const uint64_t *)value;
+		if (tmp_u64 > MAX_NUM_PROBES / 8 ||
+		    tmp_u64 < (uint64_t)probes_to_unitsize(devc->num_probes)) {
+			sr_err("%s: unitsize %" PRIu64 " doesn't fit %d probes",
+			       __func__, tmp_u64, devc->num_probes);
+			return SR_ERR_ARG;
+		}
+		devc->unitsize = tmp_u64;
+		sr_dbg("%s: setting unitsize to %d", __func__, devc->unitsize);
+		ret = SR_OK;
+	} else if (hwcap == SR_HWCAP_PLAYBACK_SPEED) {
+		devc->speed = *(const uint64_t *)value;
+		sr_dbg("%s: setting speed to %" PRIu64 "x", __func__,
+		       devc->speed);
+		ret = SR_OK;
+	} else if (hwcap == SR_HWCAP_PLAYBACK_CHUNKSIZE) {
+		if (*(const uint64_t *)value == 0) {
+			sr_err("%s: chunk size can't be 0", __func__);
+			return SR_ERR_ARG;
+		}
+		devc->chunksize = *(const uint64_t *)value;
+		sr_dbg("%s: setting chunk size to %" PRIu64, __func__,
+		       devc->chunksize);
+		ret = SR_OK;
 	} else {
 		ret = SR_ERR;
 	}
@@ -313,36 +561,118 @@ static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 	return ret;
 }
 
-static void samples_generator(uint8_t *buf, uint64_t size,
-			      struct dev_context *devc)
+/* Clear the bits of probes the device doesn't have. */
+static void mask_samples(uint8_t *buf, uint64_t num_samples,
+			 const struct dev_context *devc)
 {
-	static uint64_t p = 0;
 	uint64_t i;
+	int used, b;
+	uint8_t mask;
+
+	used = devc->num_probes / 8;
+	mask = (1 << (devc->num_probes % 8)) - 1;
+	if (used == devc->unitsize)
+		return;
+
+	for (i = 0; i < num_samples; i++, buf += devc->unitsize) {
+		buf[used] &= mask;
+		for (b = used + 1; b < devc->unitsize; b++)
+			buf[b] = 0;
+	}
+}
+
+/* Set up the repeating part of the fixed patterns. */
+static int period_init(struct dev_context *devc)
+{
+	int i, b;
+
+	g_free(devc->period);
+	if (!(devc->period = g_try_malloc(PATTERN_PERIOD * devc->unitsize))) {
+		sr_err("%s: period malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	for (i = 0; i < PATTERN_PERIOD; i++) {
+		for (b = 0; b < devc->unitsize; b++) {
+			switch (devc->sample_generator) {
+			case PATTERN_SIGROK:
+				/* Every group of 8 probes spells "sigrok". */
+				devc->period[i * devc->unitsize + b] =
+					~(pattern_sigrok[i] >> 1);
+				break;
+			case PATTERN_ALL_HIGH:
+				devc->period[i * devc->unitsize + b] = 0xff;
+				break;
+			default:
+				devc->period[i * devc->unitsize + b] = 0x00;
+				break;
+			}
+		}
+	}
+	mask_samples(devc->period, PATTERN_PERIOD, devc);
 
-	/* TODO: Needed? */
-	memset(buf, 0, size);
+	return SR_OK;
+}
+
+/* xorshift64*: cheap, and random enough for test data. */
+static inline uint64_t rng_next(struct dev_context *devc)
+{
+	uint64_t x;
+
+	x = devc->rng_state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	devc->rng_state = x;
+
+	return x * UINT64_C(2685821657736338717);
+}
+
+/* Generate the next 'num_samples' samples, a whole word at a time. */
+static void samples_generator(uint8_t *buf, uint64_t num_samples,
+			      struct dev_context *devc)
+{
+	uint64_t i, v, size, pos, n;
+	int b;
+
+	size = num_samples * devc->unitsize;
 
 	switch (devc->sample_generator) {
 	case PATTERN_SIGROK: /* sigrok pattern */
-		for (i = 0; i < size; i++) {
-			*(buf + i) = ~(pattern_sigrok[p] >> 1);
-			if (++p == 64)
-				p = 0;
+	case PATTERN_ALL_LOW: /* All probes are low */
+	case PATTERN_ALL_HIGH: /* All probes are high */
+		/* Copy the period, starting where the last chunk stopped. */
+		pos = (devc->samples_counter % PATTERN_PERIOD)
+		      * devc->unitsize;
+		for (i = 0; i < size; i += n) {
+			n = MIN(size - i, PATTERN_PERIOD * devc->unitsize - pos);
+			memcpy(buf + i, devc->period + pos, n);
+			pos = 0;
 		}
 		break;
 	case PATTERN_RANDOM: /* Random */
-		for (i = 0; i < size; i++)
-			*(buf + i) = (uint8_t)(rand() & 0xff);
+		for (i = 0; i + sizeof(v) <= size; i += sizeof(v)) {
+			v = rng_next(devc);
+			memcpy(buf + i, &v, sizeof(v));
+		}
+		if (i < size) {
+			v = rng_next(devc);
+			memcpy(buf + i, &v, size - i);
+		}
+		mask_samples(buf, num_samples, devc);
 		break;
 	case PATTERN_INC: /* Simple increment */
-		for (i = 0; i < size; i++)
-			*(buf + i) = i;
-		break;
-	case PATTERN_ALL_LOW: /* All probes are low */
-		memset(buf, 0x00, size);
-		break;
-	case PATTERN_ALL_HIGH: /* All probes are high */
-		memset(buf, 0xff, size);
+		v = devc->samples_counter;
+		if (devc->unitsize == 1) {
+			for (i = 0; i < size; i++)
+				buf[i] = v++;
+		} else {
+			for (i = 0; i < size; v++) {
+				for (b = 0; b < devc->unitsize; b++)
+					buf[i++] = v >> (b * 8);
+			}
+		}
+		mask_samples(buf, num_samples, devc);
 		break;
 	default:
 		sr_err("Unknown pattern: %d.", devc->sample_generator);
@@ -350,51 +680,204 @@ static void samples_generator(uint8_t *buf, uint64_t size,
 	}
 }
 
-/* Callback handling data */
-static int receive_data(int fd, int revents, void *cb_data)
+/* Generate a chunk of samples and send it through the session bus. */
+static int send_chunk(struct dev_context *devc, uint64_t num_samples)
 {
-	struct dev_context *devc = cb_data;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_logic logic;
-	uint8_t buf[BUFSIZE];
-	static uint64_t samples_to_send, expected_samplenum, sending_now;
-	int64_t time, elapsed;
+	uint64_t size;
+
+	size = num_samples * devc->unitsize;
+
+	/* Reuse the last buffer, unless it's too small or still held. */
+	if (devc->buf && (devc->buf->size < size ||
+		g_atomic_int_get(&devc->buf->refcount) > 1)) {
+		sr_buffer_release(devc->buf);
+		devc->buf = NULL;
+	}
+	if (!devc->buf && !(devc->buf = sr_buffer_new(size))) {
+		sr_err("%s: buffer malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	samples_generator(devc->buf->data, num_samples, devc);
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.length = size;
+	logic.unitsize = devc->unitsize;
+	logic.data = devc->buf->data;
+	logic.buffer = devc->buf;
+	sr_session_send(devc->session_dev_id, &packet);
+
+	return SR_OK;
+}
+
+/* Value of an analog pattern, 'k' samples into its period. */
+static float analog_value(int pattern, uint64_t k)
+{
+	uint64_t x;
+
+	switch (pattern) {
+	case ANALOG_PATTERN_SINE:
+		return ANALOG_AMPLITUDE * sin(2 * G_PI * k / ANALOG_PERIOD);
+	case ANALOG_PATTERN_SQUARE:
+		return k < ANALOG_PERIOD / 2 ? ANALOG_AMPLITUDE
+					     : -ANALOG_AMPLITUDE;
+	case ANALOG_PATTERN_NOISE:
+		/* Hash k, so that the noise is the same on every run. */
+		x = (k + 1) * UINT64_C(0x9e3779b97f4a7c15);
+		x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+		x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+		x ^= x >> 31;
+		/* The top 53 bits, scaled to [-1, 1). */
+		return ANALOG_AMPLITUDE * ((x >> 11) * 0x1p-52 - 1);
+	case ANALOG_PATTERN_RAMP:
+		return ANALOG_AMPLITUDE * (2.0 * k / ANALOG_PERIOD - 1);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Precompute the values of the enabled analog probes, so that sending
+ * them costs nothing. Each probe is shifted by a part of the period.
+ */
+static int analog_init(const struct sr_dev_inst *sdi,
+		       struct dev_context *devc)
+{
+	const struct sr_probe *probe;
+	const GSList *l;
+	float *values;
+	uint64_t i, num_samples;
+	int j, n;
+
+	if (devc->analog_buf) {
+		sr_buffer_release(devc->analog_buf);
+		devc->analog_buf = NULL;
+	}
+
+	n = 0;
+	for (l = sdi->probes; l; l = l->next) {
+		probe = l->data;
+		if (probe->type == SR_PROBE_ANALOG && probe->enabled)
+			n++;
+	}
+	devc->num_enabled_analog = n;
+	if (n == 0)
+		return SR_OK;
+
+	num_samples = ANALOG_PERIOD + devc->chunk_samples;
+	devc->analog_buf = sr_buffer_new(num_samples * n * sizeof(float));
+	if (!devc->analog_buf) {
+		sr_err("%s: analog buffer malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	values = devc->analog_buf->data;
+
+	for (i = 0; i < ANALOG_PERIOD; i++) {
+		for (j = 0; j < n; j++)
+			values[i * n + j] = analog_value(devc->analog_generator,
+				(i + j * ANALOG_PERIOD / n) % ANALOG_PERIOD);
+	}
+	for (i = ANALOG_PERIOD; i < num_samples; i++)
+		memcpy(values + i * n, values + (i % ANALOG_PERIOD) * n,
+		       n * sizeof(float));
+
+	return SR_OK;
+}
+
+/* Send the next chunk of analog samples straight out of the table. */
+static void send_analog_chunk(struct dev_context *devc, uint64_t num_samples)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_analog analog;
+	float *values;
+
+	values = devc->analog_buf->data;
+
+	packet.type = SR_DF_ANALOG;
+	packet.payload = &analog;
+	analog.num_samples = num_samples;
+	analog.mq = SR_MQ_VOLTAGE;
+	analog.unit = SR_UNIT_VOLT;
+	analog.mqflags = 0;
+	analog.data = values + (devc->samples_counter % ANALOG_PERIOD)
+		      * devc->num_enabled_analog;
+	analog.buffer = devc->analog_buf;
+	sr_session_send(devc->session_dev_id, &packet);
+}
+
+static void send_frame_marker(struct dev_context *devc, int type)
+{
+	struct sr_datafeed_packet packet;
+
+	packet.type = type;
+	packet.payload = NULL;
+	sr_session_send(devc->session_dev_id, &packet);
+}
+
+/* Callback handling data */
+static int receive_data(int fd, int revents, void *cb_data)
+{
+	struct sr_dev_inst *sdi = cb_data;
+	struct dev_context *devc = sdi->priv;
+	uint64_t samples_to_send, expected_samplenum, sending_now;
+	uint64_t frame_pos, rate;
+	int64_t elapsed;
 
 	(void)fd;
 	(void)revents;
 
-	/* How many "virtual" samples should we have collected by now? */
-	time = g_get_monotonic_time();
-	elapsed = time - devc->starttime;
-	expected_samplenum = elapsed * cur_samplerate / 1000000;
-	/* Of those, how many do we still have to send? */
-	samples_to_send = expected_samplenum - devc->samples_counter;
+	if (devc->speed) {
+		/* How many "virtual" samples should we have collected by now? */
+		elapsed = g_get_monotonic_time() - devc->starttime;
+		rate = devc->cur_samplerate * devc->speed;
+		expected_samplenum = (elapsed / G_USEC_PER_SEC) * rate
+			+ (elapsed % G_USEC_PER_SEC) * rate / G_USEC_PER_SEC;
+		/* Of those, how many do we still have to send? */
+		samples_to_send = 0;
+		if (expected_samplenum > devc->samples_counter)
+			samples_to_send = expected_samplenum
+					  - devc->samples_counter;
+	} else {
+		/* Unthrottled: as much as the consumers take, a burst a call. */
+		samples_to_send = MAX(UNTHROTTLED_BURST / devc->unitsize, 1);
+	}
 
-	if (limit_samples) {
+	if (devc->limit) {
 		samples_to_send = MIN(samples_to_send,
-				 limit_samples - devc->samples_counter);
+				 devc->limit - devc->samples_counter);
 	}
 
 	while (samples_to_send > 0) {
-		sending_now = MIN(samples_to_send, sizeof(buf));
-		samples_to_send -= sending_now;
-		samples_generator(buf, sending_now, devc);
-
-		packet.type = SR_DF_LOGIC;
-		packet.payload = &logic;
-		logic.length = sending_now;
-		logic.unitsize = 1;
-		logic.data = buf;
-		sr_session_send(devc->session_dev_id, &packet);
+		sending_now = MIN(samples_to_send, devc->chunk_samples);
+		if (devc->framesize) {
+			/* Chunks don't straddle frames. */
+			frame_pos = devc->samples_counter % devc->framesize;
+			sending_now = MIN(sending_now,
+					  devc->framesize - frame_pos);
+			if (frame_pos == 0)
+				send_frame_marker(devc, SR_DF_FRAME_BEGIN);
+		}
+		if (devc->num_probes && send_chunk(devc, sending_now) != SR_OK) {
+			hw_dev_acquisition_stop(sdi, devc->session_dev_id);
+			return TRUE;
+		}
+		if (devc->analog_buf)
+			send_analog_chunk(devc, sending_now);
 		devc->samples_counter += sending_now;
+		samples_to_send -= sending_now;
+		if (devc->framesize
+		    && devc->samples_counter % devc->framesize == 0)
+			send_frame_marker(devc, SR_DF_FRAME_END);
 	}
 
-
-	if (devc->samples_counter >= limit_samples) {
+	if (devc->limit && devc->samples_counter >= devc->limit) {
 		sr_spew("We sent a total of %" PRIu64 " samples.",
 			devc->samples_counter);
 		/* Make sure we don't receive more packets. */
-		hw_dev_acquisition_stop(NULL, cb_data);
+		hw_dev_acquisition_stop(sdi, devc->session_dev_id);
 		return TRUE;
 	}
 
@@ -407,21 +890,36 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	struct sr_datafeed_packet *packet;
 	struct sr_datafeed_header *header;
 	struct sr_datafeed_meta_logic meta;
+	struct sr_datafeed_meta_analog meta_analog;
 	struct dev_context *devc;
-
-	(void)sdi;
+	int ret;
 
 	sr_dbg("Starting acquisition.");
 
-	/* TODO: 'devc' is never g_free()'d? */
-	if (!(devc = g_try_malloc(sizeof(struct dev_context)))) {
-		sr_err("%s: devc malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
-
-	devc->sample_generator = default_pattern;
+	devc = sdi->priv;
 	devc->session_dev_id = cb_data;
 	devc->samples_counter = 0;
+	devc->rng_state = UINT64_C(0x9e3779b97f4a7c15) + sdi->index;
+
+	/* A time limit is a number of samples at the configured rate. */
+	devc->limit = devc->limit_samples;
+	if (devc->limit_msec)
+		devc->limit = devc->limit_msec * devc->cur_samplerate / 1000;
+	if (devc->framesize && devc->limit_frames) {
+		if (!devc->limit || devc->limit >
+				devc->limit_frames * devc->framesize)
+			devc->limit = devc->limit_frames * devc->framesize;
+	}
+
+	devc->chunk_samples = MAX(devc->chunksize / devc->unitsize, 1);
+	if ((ret = period_init(devc)) != SR_OK)
+		return ret;
+	if ((ret = analog_init(sdi, devc)) != SR_OK)
+		return ret;
+	if (!devc->num_probes && !devc->num_enabled_analog) {
+		sr_err("%s: no probes to generate samples for", __func__);
+		return SR_ERR;
+	}
 
 	/*
 	 * Setting two channels connected by a pipe is a remnant from when the
@@ -449,8 +947,18 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	g_io_channel_set_buffered(devc->channels[0], FALSE);
 	g_io_channel_set_buffered(devc->channels[1], FALSE);
 
+	/*
+	 * Unthrottled, the pipe is left readable so that receive_data() is
+	 * called on every iteration of the session loop.
+	 */
+	if (!devc->speed && write(devc->pipe_fds[1], "", 1) != 1) {
+		sr_err("%s: write() to pipe failed", __func__);
+		return SR_ERR;
+	}
+
 	sr_session_source_add_channel(devc->channels[0], G_IO_IN | G_IO_ERR,
-		    40, receive_data, devc);
+		    40, receive_data, (void *)sdi);
+	devc->running = TRUE;
 
 	if (!(packet = g_try_malloc(sizeof(struct sr_datafeed_packet)))) {
 		sr_err("%s: packet malloc failed", __func__);
@@ -469,11 +977,21 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	sr_session_send(devc->session_dev_id, packet);
 
 	/* Send metadata about the SR_DF_LOGIC packets to come. */
-	packet->type = SR_DF_META_LOGIC;
-	packet->payload = &meta;
-	meta.samplerate = cur_samplerate;
-	meta.num_probes = NUM_PROBES;
-	sr_session_send(devc->session_dev_id, packet);
+	if (devc->num_probes) {
+		packet->type = SR_DF_META_LOGIC;
+		packet->payload = &meta;
+		meta.samplerate = devc->cur_samplerate;
+		meta.num_probes = devc->num_probes;
+		sr_session_send(devc->session_dev_id, packet);
+	}
+
+	/* Send metadata about the SR_DF_ANALOG packets to come. */
+	if (devc->num_enabled_analog) {
+		packet->type = SR_DF_META_ANALOG;
+		packet->payload = &meta_analog;
+		meta_analog.num_probes = devc->num_enabled_analog;
+		sr_session_send(devc->session_dev_id, packet);
+	}
 
 	/* We use this timestamp to decide how many more samples to send. */
 	devc->starttime = g_get_monotonic_time();
@@ -489,18 +1007,26 @@ static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi, void *cb_data)
 	struct dev_context *devc;
 	struct sr_datafeed_packet packet;
 
-	(void)sdi;
-
-	devc = cb_data;
+	devc = sdi->priv;
+	if (!devc->running)
+		return SR_OK;
+	devc->running = FALSE;
 
 	sr_dbg("Stopping aquisition.");
 
 	sr_session_source_remove_channel(devc->channels[0]);
 	g_io_channel_shutdown(devc->channels[0], FALSE, NULL);
+	g_io_channel_shutdown(devc->channels[1], FALSE, NULL);
+	g_io_channel_unref(devc->channels[0]);
+	g_io_channel_unref(devc->channels[1]);
+
+	/* Close a frame which was cut short. */
+	if (devc->framesize && devc->samples_counter % devc->framesize)
+		send_frame_marker(devc, SR_DF_FRAME_END);
 
 	/* Send last packet. */
 	packet.type = SR_DF_END;
-	sr_session_send(devc->session_dev_id, &packet);
+	sr_session_send(cb_data, &packet);
 
 	return SR_OK;
 }
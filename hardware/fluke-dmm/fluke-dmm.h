@@ -24,13 +24,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "fluke-dmm: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
-
-#define FLUKEDMM_BUFSIZE  256
 
 /* Supported models */
 enum {
@@ -58,8 +51,6 @@ struct dev_context {
 
 	/* Runtime. */
 	uint64_t num_samples;
-	char buf[FLUKEDMM_BUFSIZE];
-	int buflen;
 	int64_t cmd_sent_at;
 	int expect_response;
 };
@@ -261,7 +261,7 @@ static struct sr_datafeed_analog *handle_qm_v2(const struct sr_dev_inst *sdi,
 	return analog;
 }
 
-static void handle_line(const struct sr_dev_inst *sdi)
+static void handle_line(const struct sr_dev_inst *sdi, char *line, int len)
 {
 	struct dev_context *devc;
 	struct sr_datafeed_packet packet;
@@ -269,20 +269,19 @@ static void handle_line(const struct sr_dev_inst *sdi)
 	char **tokens;
 
 	devc = sdi->priv;
-	sr_spew("Received line '%s' (%d).", devc->buf, devc->buflen);
+	sr_spew("Received line '%s' (%d).", line, len);
 
-	if (devc->buflen == 1) {
-		if (devc->buf[0] != '0') {
+	if (len == 1) {
+		if (line[0] != '0') {
 			/* Not just a CMD_ACK from the query command. */
-			sr_dbg("Got CMD_ACK '%c'.", devc->buf[0]);
+			sr_dbg("Got CMD_ACK '%c'.", line[0]);
 			devc->expect_response = FALSE;
 		}
-		devc->buflen = 0;
 		return;
 	}
 
 	analog = NULL;
-	tokens = g_strsplit(devc->buf, ",", 0);
+	tokens = g_strsplit(line, ",", 0);
 	if (tokens[0] && tokens[1]) {
 		if (devc->profile->model == FLUKE_187) {
 			devc->expect_response = FALSE;
@@ -293,7 +292,6 @@ static void handle_line(const struct sr_dev_inst *sdi)
 		}
 	}
 	g_strfreev(tokens);
-	devc->buflen = 0;
 
 	if (analog) {
 		/* Got a measurement. */
@@ -311,6 +309,7 @@ SR_PRIV int fluke_receive_data(int fd, int revents, void *cb_data)
 {
 	struct sr_dev_inst *sdi;
 	struct dev_context *devc;
+	char *line;
 	int len;
 	int64_t now, elapsed;
 
@@ -324,18 +323,9 @@ SR_PRIV int fluke_receive_data(int fd, int revents, void *cb_data)
 
 	if (revents == G_IO_IN) {
 		/* Serial data arrived. */
-		while(FLUKEDMM_BUFSIZE - devc->buflen - 1 > 0) {
-			len = serial_read(devc->serial, devc->buf + devc->buflen, 1);
-			if (len < 1)
-				break;
-			devc->buflen++;
-			*(devc->buf + devc->buflen) = '\0';
-			if (*(devc->buf + devc->buflen - 1) == '\r') {
-				*(devc->buf + --devc->buflen) = '\0';
-				handle_line(sdi);
-				break;
-			}
-		}
+		serial_fill(devc->serial);
+		while ((line = serial_get_line(devc->serial, '\r', &len)))
+			handle_line(sdi, line, len);
 	}
 
 	if (devc->num_samples >= devc->limit_samples) {
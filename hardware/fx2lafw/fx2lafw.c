@@ -22,6 +22,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 #include <libusb.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
@@ -87,7 +93,11 @@ static const int hwcaps[] = {
 
 	/* These are really implemented in the driver, not the hardware. */
 	SR_HWCAP_LIMIT_SAMPLES,
+	SR_HWCAP_CAPTURE_RATIO,
 	SR_HWCAP_CONTINUOUS,
+#ifndef _WIN32
+	SR_HWCAP_USB_EVENT_THREAD,
+#endif
 	0,
 };
 
@@ -145,6 +155,57 @@ static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 		const void *value);
 static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi, void *cb_data);
 
+/*
+ * Devices found running fx2lafw, so that later scans don't have to open
+ * them again to tell. A device gets a new address whenever it is plugged
+ * in or renumerates, but the OS may hand out the address of one that is
+ * gone again, so entries also keep the device descriptor to check.
+ */
+struct fw_device {
+	uint8_t bus;
+	uint8_t address;
+	struct libusb_device_descriptor des;
+};
+
+static GSList *fw_devices;
+
+static GSList *fw_device_find(uint8_t bus, uint8_t address)
+{
+	struct fw_device *fwd;
+	GSList *l;
+
+	for (l = fw_devices; l; l = l->next) {
+		fwd = l->data;
+		if (fwd->bus == bus && fwd->address == address)
+			return l;
+	}
+
+	return NULL;
+}
+
+static void fw_device_forget(uint8_t bus, uint8_t address)
+{
+	GSList *l;
+
+	if (!(l = fw_device_find(bus, address)))
+		return;
+	g_free(l->data);
+	fw_devices = g_slist_delete_link(fw_devices, l);
+}
+
+static void fw_device_remember(uint8_t bus, uint8_t address,
+		const struct libusb_device_descriptor *des)
+{
+	struct fw_device *fwd;
+
+	if (!(fwd = g_try_malloc(sizeof(struct fw_device))))
+		return;
+	fwd->bus = bus;
+	fwd->address = address;
+	fwd->des = *des;
+	fw_devices = g_slist_prepend(fw_devices, fwd);
+}
+
 /**
  * Check the USB configuration to determine if this is an fx2lafw device.
  *
@@ -157,12 +218,29 @@ static gboolean check_conf_profile(libusb_device *dev)
 	struct libusb_device_handle *hdl;
 	gboolean ret;
 	unsigned char strdesc[64];
+	uint8_t bus, address;
+	GSList *l;
+
+	if (sr_usb_get_device_descriptor(dev, &des) != 0)
+		return FALSE;
+
+	bus = libusb_get_bus_number(dev);
+	address = libusb_get_device_address(dev);
+	if ((l = fw_device_find(bus, address))) {
+		if (!memcmp(&((struct fw_device *)l->data)->des, &des,
+			    sizeof(des)))
+			return TRUE;
+		/* Another device got the address of one that's gone. */
+		fw_device_forget(bus, address);
+	}
 
 	hdl = NULL;
 	ret = FALSE;
 	while (!ret) {
 		/* Assume the FW has not been loaded, unless proven wrong. */
-		if (libusb_get_device_descriptor(dev, &des) != 0)
+
+		/* fx2lafw has both strings, no need to open devices without. */
+		if (!des.iManufacturer || !des.iProduct)
 			break;
 
 		if (libusb_open(dev, &hdl) != 0)
@@ -182,6 +260,7 @@ static gboolean check_conf_profile(libusb_device *dev)
 
 		/* If we made it here, it must be an fx2lafw. */
 		ret = TRUE;
+		fw_device_remember(bus, address, &des);
 	}
 	if (hdl)
 		libusb_close(hdl);
@@ -206,7 +285,7 @@ static int fx2lafw_dev_open(struct sr_dev_inst *sdi)
 		return SR_ERR;
 
 	skip = 0;
-	const int device_count = libusb_get_device_list(
+	const int device_count = sr_usb_get_device_list(
 		drvc->sr_ctx->libusb_ctx, &devlist);
 	if (device_count < 0) {
 		sr_err("fx2lafw: Failed to retrieve device list (%d)",
@@ -215,7 +294,7 @@ static int fx2lafw_dev_open(struct sr_dev_inst *sdi)
 	}
 
 	for (i = 0; i < device_count; i++) {
-		if ((ret = libusb_get_device_descriptor(devlist[i], &des))) {
+		if ((ret = sr_usb_get_device_descriptor(devlist[i], &des))) {
 			sr_err("fx2lafw: Failed to get device descriptor: %s.",
 			       libusb_error_name(ret));
 			continue;
@@ -301,40 +380,23 @@ static int configure_probes(const struct sr_dev_inst *sdi)
 	struct dev_context *devc;
 	struct sr_probe *probe;
 	GSList *l;
-	int probe_bit, stage, i;
-	char *tc;
 
 	devc = sdi->priv;
-	for (i = 0; i < NUM_TRIGGER_STAGES; i++) {
-		devc->trigger_mask[i] = 0;
-		devc->trigger_value[i] = 0;
-	}
-
-	stage = -1;
 	for (l = sdi->probes; l; l = l->next) {
 		probe = (struct sr_probe *)l->data;
-		if (probe->enabled == FALSE)
-			continue;
-
-		if (probe->index > 7)
+		if (probe->enabled && probe->index > 7)
 			devc->sample_wide = TRUE;
+	}
 
-		probe_bit = 1 << (probe->index);
-		if (!(probe->trigger))
-			continue;
-
-		stage = 0;
-		for (tc = probe->trigger; *tc; tc++) {
-			devc->trigger_mask[stage] |= probe_bit;
-			if (*tc == '1')
-				devc->trigger_value[stage] |= probe_bit;
-			stage++;
-			if (stage > NUM_TRIGGER_STAGES)
-				return SR_ERR;
-		}
+	/* The pre-trigger window is kept here, see pretrigger_alloc(). */
+	if (devc->trigger) {
+		sr_trigger_destroy(devc->trigger);
+		devc->trigger = NULL;
 	}
+	if (sr_trigger_new(sdi, 0, &devc->trigger) != SR_OK)
+		return SR_ERR;
 
-	if (stage == -1)
+	if (devc->trigger->num_stages == 0)
 		/*
 		 * We didn't configure any triggers, make sure acquisition
 		 * doesn't wait for any.
@@ -356,6 +418,8 @@ static struct dev_context *fx2lafw_dev_new(void)
 	}
 
 	devc->trigger_stage = TRIGGER_FIRED;
+	devc->transfer_ms = DEFAULT_TRANSFER_MS;
+	devc->wakeup_fds[0] = devc->wakeup_fds[1] = -1;
 
 	return devc;
 }
@@ -387,6 +451,8 @@ static int clear_instances(void)
 		}
 		hw_dev_close(sdi);
 		sr_usb_dev_inst_free(devc->usb);
+		if (devc->trigger)
+			sr_trigger_destroy(devc->trigger);
 		sdi = l->data;
 		sr_dev_inst_free(sdi);
 	}
@@ -417,6 +483,77 @@ static int hw_init(struct sr_context *sr_ctx)
 	return SR_OK;
 }
 
+static const struct fx2lafw_profile *find_profile(uint16_t vid, uint16_t pid)
+{
+	int i;
+
+	for (i = 0; supported_fx2[i].vid; i++) {
+		if (vid == supported_fx2[i].vid && pid == supported_fx2[i].pid)
+			return &supported_fx2[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Add an instance for a device, uploading the firmware to it if need be.
+ * Until it has renumerated after that, the address is unknown (0xff).
+ */
+static struct sr_dev_inst *dev_inst_add(libusb_device *dev,
+		const struct fx2lafw_profile *prof)
+{
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	struct sr_dev_inst *sdi;
+	struct sr_probe *probe;
+	int devcnt, num_logic_probes, j;
+
+	drvc = fdi->priv;
+
+	devcnt = g_slist_length(drvc->instances);
+	sdi = sr_dev_inst_new(devcnt, SR_ST_INITIALIZING,
+		prof->vendor, prof->model, prof->model_version);
+	if (!sdi)
+		return NULL;
+	sdi->driver = fdi;
+
+	/* Fill in probelist according to this device's profile. */
+	num_logic_probes = prof->dev_caps & DEV_CAPS_16BIT ? 16 : 8;
+	for (j = 0; j < num_logic_probes; j++) {
+		if (!(probe = sr_probe_new(j, SR_PROBE_LOGIC, TRUE,
+				probe_names[j])))
+			return NULL;
+		sdi->probes = g_slist_append(sdi->probes, probe);
+	}
+
+	devc = fx2lafw_dev_new();
+	devc->profile = prof;
+	sdi->priv = devc;
+	drvc->instances = g_slist_append(drvc->instances, sdi);
+
+	if (check_conf_profile(dev)) {
+		/* Already has the firmware, so fix the new address. */
+		sr_dbg("fx2lafw: Found an fx2lafw device.");
+		sdi->status = SR_ST_INACTIVE;
+		devc->usb = sr_usb_dev_inst_new
+		    (libusb_get_bus_number(dev),
+		     libusb_get_device_address(dev), NULL);
+	} else {
+		devc->fw_old_address = libusb_get_device_address(dev);
+		if (ezusb_upload_firmware(dev, USB_CONFIGURATION,
+			prof->firmware) == SR_OK)
+			/* Remember when the firmware on this device was updated */
+			devc->fw_updated = g_get_monotonic_time();
+		else
+			sr_err("fx2lafw: Firmware upload failed for "
+			       "device %d.", devcnt);
+		devc->usb = sr_usb_dev_inst_new
+			(libusb_get_bus_number(dev), 0xff, NULL);
+	}
+
+	return sdi;
+}
+
 static GSList *hw_scan(GSList *options)
 {
 	GSList *devices;
@@ -424,10 +561,8 @@ static GSList *hw_scan(GSList *options)
 	struct sr_dev_inst *sdi;
 	const struct fx2lafw_profile *prof;
 	struct drv_context *drvc;
-	struct dev_context *devc;
-	struct sr_probe *probe;
 	libusb_device **devlist;
-	int devcnt, num_logic_probes, ret, i, j;
+	int ret, i;
 
 	(void)options;
 
@@ -438,74 +573,143 @@ static GSList *hw_scan(GSList *options)
 
 	/* Find all fx2lafw compatible devices and upload firmware to them. */
 	devices = NULL;
-	libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
+	sr_usb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
 	for (i = 0; devlist[i]; i++) {
 
-		if ((ret = libusb_get_device_descriptor(
+		if ((ret = sr_usb_get_device_descriptor(
 		     devlist[i], &des)) != 0) {
 			sr_warn("fx2lafw: Failed to get device descriptor: %s.",
 				libusb_error_name(ret));
 			continue;
 		}
 
-		prof = NULL;
-		for (j = 0; supported_fx2[j].vid; j++) {
-			if (des.idVendor == supported_fx2[j].vid &&
-				des.idProduct == supported_fx2[j].pid) {
-				prof = &supported_fx2[j];
-			}
-		}
-
 		/* Skip if the device was not found */
-		if (!prof)
+		if (!(prof = find_profile(des.idVendor, des.idProduct)))
 			continue;
 
-		devcnt = g_slist_length(drvc->instances);
-		sdi = sr_dev_inst_new(devcnt, SR_ST_INITIALIZING,
-			prof->vendor, prof->model, prof->model_version);
-		if (!sdi)
+		if (!(sdi = dev_inst_add(devlist[i], prof)))
 			return NULL;
-		sdi->driver = fdi;
-
-		/* Fill in probelist according to this device's profile. */
-		num_logic_probes = prof->dev_caps & DEV_CAPS_16BIT ? 16 : 8;
-		for (j = 0; j < num_logic_probes; j++) {
-			if (!(probe = sr_probe_new(j, SR_PROBE_LOGIC, TRUE,
-					probe_names[j])))
-				return NULL;
-			sdi->probes = g_slist_append(sdi->probes, probe);
-		}
-
-		devc = fx2lafw_dev_new();
-		devc->profile = prof;
-		sdi->priv = devc;
-		drvc->instances = g_slist_append(drvc->instances, sdi);
 		devices = g_slist_append(devices, sdi);
-
-		if (check_conf_profile(devlist[i])) {
-			/* Already has the firmware, so fix the new address. */
-			sr_dbg("fx2lafw: Found an fx2lafw device.");
-			sdi->status = SR_ST_INACTIVE;
-			devc->usb = sr_usb_dev_inst_new
-			    (libusb_get_bus_number(devlist[i]),
-			     libusb_get_device_address(devlist[i]), NULL);
-		} else {
-			if (ezusb_upload_firmware(devlist[i], USB_CONFIGURATION,
-				prof->firmware) == SR_OK)
-				/* Remember when the firmware on this device was updated */
-				devc->fw_updated = g_get_monotonic_time();
-			else
-				sr_err("fx2lafw: Firmware upload failed for "
-				       "device %d.", devcnt);
-			devc->usb = sr_usb_dev_inst_new
-				(libusb_get_bus_number(devlist[i]), 0xff, NULL);
-		}
 	}
 	libusb_free_device_list(devlist, 1);
 
 	return devices;
 }
 
+/* The device list entry of the instance at bus.address, if any. */
+static GSList *find_instance(uint8_t bus, uint8_t address)
+{
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	struct sr_dev_inst *sdi;
+	GSList *l;
+
+	drvc = fdi->priv;
+	for (l = drvc->instances; l; l = l->next) {
+		sdi = l->data;
+		devc = sdi->priv;
+		if (devc->usb->bus == bus && devc->usb->address == address)
+			return l;
+	}
+
+	return NULL;
+}
+
+/* An instance still waiting for its device to renumerate, if any. */
+static struct sr_dev_inst *find_renumerating(
+		const struct fx2lafw_profile *prof, uint8_t bus)
+{
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	struct sr_dev_inst *sdi;
+	GSList *l;
+
+	drvc = fdi->priv;
+	for (l = drvc->instances; l; l = l->next) {
+		sdi = l->data;
+		devc = sdi->priv;
+		if (devc->profile == prof && devc->fw_updated > 0
+				&& devc->usb->bus == bus
+				&& devc->usb->address == 0xff)
+			return sdi;
+	}
+
+	return NULL;
+}
+
+static void hw_usb_arrived(uint16_t vid, uint16_t pid, uint8_t bus,
+		uint8_t address)
+{
+	const struct fx2lafw_profile *prof;
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	struct sr_dev_inst *sdi;
+	libusb_device **devlist, *dev;
+	int i;
+
+	if (!(prof = find_profile(vid, pid)))
+		return;
+
+	/* A scan may have found it already. */
+	if (find_instance(bus, address))
+		return;
+
+	drvc = fdi->priv;
+	if (sr_usb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist) < 0)
+		return;
+	dev = NULL;
+	for (i = 0; devlist[i] && !dev; i++) {
+		if (libusb_get_bus_number(devlist[i]) != bus)
+			continue;
+		if (libusb_get_device_address(devlist[i]) == address)
+			dev = devlist[i];
+	}
+
+	if (!dev) {
+		sr_dbg("fx2lafw: Device %d.%d left already.", bus, address);
+	} else if ((sdi = find_renumerating(prof, bus))
+			&& check_conf_profile(dev)) {
+		/* Our firmware came up: the instance now has an address. */
+		sr_dbg("fx2lafw: Device renumerated to %d.%d.", bus, address);
+		devc = sdi->priv;
+		devc->usb->address = address;
+		sdi->status = SR_ST_INACTIVE;
+	} else if ((sdi = dev_inst_add(dev, prof))) {
+		sr_hotplug_post(drvc->sr_ctx, SR_HOTPLUG_ARRIVED, sdi);
+	}
+
+	libusb_free_device_list(devlist, 1);
+}
+
+static void hw_usb_left(uint8_t bus, uint8_t address)
+{
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	struct sr_dev_inst *sdi;
+	GSList *l;
+
+	fw_device_forget(bus, address);
+
+	if (!(l = find_instance(bus, address)))
+		return;
+
+	drvc = fdi->priv;
+	sdi = l->data;
+	devc = sdi->priv;
+	sr_hotplug_post(drvc->sr_ctx, SR_HOTPLUG_LEFT, sdi);
+
+	if (sdi->status == SR_ST_ACTIVE || sdi->status == SR_ST_STOPPING) {
+		/* Its transfers still point to it; the next scan frees it. */
+		sr_dbg("fx2lafw: Unplugged device is still in use.");
+		return;
+	}
+
+	drvc->instances = g_slist_delete_link(drvc->instances, l);
+	hw_dev_close(sdi);
+	sr_usb_dev_inst_free(devc->usb);
+	sr_dev_inst_free(sdi);
+}
+
 static GSList *hw_dev_list(void)
 {
 	struct drv_context *drvc;
@@ -515,43 +719,139 @@ static GSList *hw_dev_list(void)
 	return drvc->instances;
 }
 
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+struct renum_wait {
+	struct sr_dev_inst *sdi;
+	int done;
+};
+
+static int renum_arrived(libusb_context *usb_ctx, libusb_device *dev,
+		libusb_hotplug_event event, void *user_data)
+{
+	struct renum_wait *wait;
+	struct dev_context *devc;
+	uint8_t bus, address;
+
+	(void)usb_ctx;
+	(void)event;
+
+	wait = user_data;
+	if (wait->done)
+		return 0;
+	devc = wait->sdi->priv;
+	bus = libusb_get_bus_number(dev);
+	address = libusb_get_device_address(dev);
+
+	/* Skip the device as it was before the upload, and other boards. */
+	if (bus != devc->usb->bus || address == devc->fw_old_address
+			|| find_instance(bus, address))
+		return 0;
+
+	sr_dbg("fx2lafw: Device renumerated to %d.%d.", bus, address);
+	devc->usb->address = address;
+	wait->sdi->status = SR_ST_INACTIVE;
+	wait->done = 1;
+
+	/*
+	 * libusb ignores the return value while enumerating present devices,
+	 * so wait_renumeration() always deregisters the callback itself.
+	 */
+	return 0;
+}
+
+/*
+ * Wait for the device to come back with the new firmware, as reported
+ * by libusb. Returns FALSE if libusb can't report it.
+ */
+static gboolean wait_renumeration(struct sr_dev_inst *sdi)
+{
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	struct renum_wait wait;
+	libusb_hotplug_callback_handle handle;
+	struct timeval tv;
+	int64_t deadline, now;
+
+	drvc = fdi->priv;
+	devc = sdi->priv;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return FALSE;
+
+	wait.sdi = sdi;
+	wait.done = 0;
+	/* It may be back already, so have libusb report present ones. */
+	if (libusb_hotplug_register_callback(drvc->sr_ctx->libusb_ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+			LIBUSB_HOTPLUG_ENUMERATE, devc->profile->vid,
+			devc->profile->pid, LIBUSB_HOTPLUG_MATCH_ANY,
+			renum_arrived, &wait, &handle) != LIBUSB_SUCCESS)
+		return FALSE;
+
+	deadline = devc->fw_updated + MAX_RENUM_DELAY_MS * 1000;
+	while (!wait.done && (now = g_get_monotonic_time()) < deadline) {
+		tv.tv_sec = 0;
+		tv.tv_usec = MIN(deadline - now, 100 * 1000);
+		libusb_handle_events_timeout_completed(
+				drvc->sr_ctx->libusb_ctx, &tv, &wait.done);
+	}
+
+	/* 'wait' goes away with this stack frame, the callback must too. */
+	libusb_hotplug_deregister_callback(drvc->sr_ctx->libusb_ctx, handle);
+
+	return TRUE;
+}
+#else
+static gboolean wait_renumeration(struct sr_dev_inst *sdi)
+{
+	(void)sdi;
+
+	return FALSE;
+}
+#endif
+
 static int hw_dev_open(struct sr_dev_inst *sdi)
 {
 	struct dev_context *devc;
 	int ret;
-	int64_t timediff_us, timediff_ms;
+	int64_t timediff_ms;
 
 	devc = sdi->priv;
 
 	/*
-	 * If the firmware was recently uploaded, wait up to MAX_RENUM_DELAY_MS
-	 * milliseconds for the FX2 to renumerate.
+	 * If the firmware was uploaded and the device hasn't been seen
+	 * since, wait up to MAX_RENUM_DELAY_MS milliseconds for the FX2 to
+	 * renumerate.
 	 */
 	ret = SR_ERR;
-	if (devc->fw_updated > 0) {
+	if (devc->fw_updated > 0 && devc->usb->address == 0xff) {
 		sr_info("fx2lafw: Waiting for device to reset.");
-		/* takes at least 300ms for the FX2 to be gone from the USB bus */
-		g_usleep(300 * 1000);
-		timediff_ms = 0;
-		while (timediff_ms < MAX_RENUM_DELAY_MS) {
+		timediff_ms = (g_get_monotonic_time() - devc->fw_updated) / 1000;
+		if (!wait_renumeration(sdi) && timediff_ms < MIN_RENUM_DELAY_MS)
+			g_usleep((MIN_RENUM_DELAY_MS - timediff_ms) * 1000);
+		/* Opening may fail until permissions are set up. */
+		while (1) {
 			if ((ret = fx2lafw_dev_open(sdi)) == SR_OK)
 				break;
-			g_usleep(100 * 1000);
-
-			timediff_us = g_get_monotonic_time() - devc->fw_updated;
-			timediff_ms = timediff_us / 1000;
+			timediff_ms = (g_get_monotonic_time()
+				       - devc->fw_updated) / 1000;
+			if (timediff_ms >= MAX_RENUM_DELAY_MS)
+				break;
 			sr_spew("fx2lafw: waited %" PRIi64 " ms", timediff_ms);
+			g_usleep(100 * 1000);
 		}
+		if (ret == SR_OK)
+			sr_info("fx2lafw: Device came back after %" PRIi64
+				" ms.", (g_get_monotonic_time()
+					 - devc->fw_updated) / 1000);
 	} else {
 		ret = fx2lafw_dev_open(sdi);
 	}
 
 	if (ret != SR_OK) {
 		sr_err("fx2lafw: Unable to open device.");
+		fw_device_forget(devc->usb->bus, devc->usb->address);
 		return SR_ERR;
-	} else {
-		sr_info("fx2lafw: Device came back after %d ms.",
-			timediff_ms);
 	}
 
 	devc = sdi->priv;
@@ -614,6 +914,9 @@ static int hw_cleanup(void)
 		return SR_OK;
 
 	ret = clear_instances();
+	ezusb_firmware_cache_clear();
+	g_slist_free_full(fw_devices, g_free);
+	fw_devices = NULL;
 
 	g_free(drvc);
 	fdi->priv = NULL;
@@ -655,6 +958,20 @@ static int hw_info_get(int info_id, const void **data,
 		} else
 			return SR_ERR;
 		break;
+	case SR_DI_TRANSFER_STATS:
+		if (sdi) {
+			devc = sdi->priv;
+			*data = &devc->stats;
+		} else
+			return SR_ERR;
+		break;
+	case SR_DI_DEV_STATS:
+		if (sdi) {
+			devc = sdi->priv;
+			*data = &devc->dev_stats;
+		} else
+			return SR_ERR;
+		break;
 	default:
 		return SR_ERR_ARG;
 	}
@@ -676,6 +993,25 @@ static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 	} else if (hwcap == SR_HWCAP_LIMIT_SAMPLES) {
 		devc->limit_samples = *(const uint64_t *)value;
 		ret = SR_OK;
+	} else if (hwcap == SR_HWCAP_CAPTURE_RATIO) {
+		if (*(const uint64_t *)value > 100) {
+			sr_err("fx2lafw: Invalid capture ratio %" PRIu64 "%%.",
+			       *(const uint64_t *)value);
+			return SR_ERR_ARG;
+		}
+		devc->capture_ratio = *(const uint64_t *)value;
+		ret = SR_OK;
+	} else if (hwcap == SR_HWCAP_USB_EVENT_THREAD) {
+#ifdef _WIN32
+		/* No pipe() to wake up the session with. */
+		sr_err("fx2lafw: The USB event thread isn't available on "
+		       "Windows.");
+		ret = SR_ERR_ARG;
+#else
+		/* Takes effect when the next acquisition starts. */
+		devc->event_thread = GPOINTER_TO_INT(value);
+		ret = SR_OK;
+#endif
 	} else {
 		ret = SR_ERR;
 	}
@@ -702,12 +1038,198 @@ static void abort_acquisition(struct dev_context *devc)
 {
 	int i;
 
+	/* Keep the event thread from resubmitting behind our back. */
+	if (devc->filled)
+		g_mutex_lock(&devc->thread_mutex);
+
 	devc->num_samples = -1;
 
 	for (i = devc->num_transfers - 1; i >= 0; i--) {
 		if (devc->transfers[i])
 			libusb_cancel_transfer(devc->transfers[i]);
 	}
+
+	if (devc->filled)
+		g_mutex_unlock(&devc->thread_mutex);
+}
+
+static void pretrigger_free(struct dev_context *devc)
+{
+	unsigned int i;
+
+	/* Slots may hold buffers swapped in from transfers by now. */
+	for (i = 0; i < devc->pretrigger_size; i++)
+		sr_usb_buf_free(devc->pretrigger[i].buf,
+				devc->pretrigger_buf_size);
+	g_free(devc->pretrigger);
+	devc->pretrigger = NULL;
+	devc->pretrigger_size = 0;
+}
+
+/*
+ * Set up the pre-trigger ring for the acquisition about to start. It holds
+ * capture_ratio percent of limit_samples, rounded up to whole transfer
+ * buffers, plus one spare since transfers may come back short.
+ */
+static int pretrigger_alloc(struct dev_context *devc, size_t size)
+{
+	const int sample_width = devc->sample_wide ? 2 : 1;
+	unsigned int i, n;
+
+	devc->pretrigger_head = 0;
+	devc->pretrigger_count = 0;
+	devc->pretrigger_samples =
+		devc->limit_samples * devc->capture_ratio / 100;
+
+	if (devc->trigger_stage == TRIGGER_FIRED ||
+	    devc->pretrigger_samples == 0)
+		return SR_OK;
+
+	n = (devc->pretrigger_samples * sample_width + size - 1) / size + 1;
+	devc->pretrigger = g_try_malloc0(sizeof(*devc->pretrigger) * n);
+	if (!devc->pretrigger) {
+		sr_err("fx2lafw: %s: pre-trigger ring malloc failed.",
+		       __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	devc->pretrigger_buf_size = size;
+	for (i = 0; i < n; i++) {
+		if (!(devc->pretrigger[i].buf = sr_pool_alloc(size))) {
+			sr_err("fx2lafw: %s: pre-trigger buffer malloc "
+			       "failed.", __func__);
+			devc->pretrigger_size = i;
+			pretrigger_free(devc);
+			return SR_ERR_MALLOC;
+		}
+	}
+	devc->pretrigger_size = n;
+
+	sr_dbg("fx2lafw: Keeping %" PRIu64 " pre-trigger samples in %u "
+	       "buffers.", devc->pretrigger_samples, n);
+
+	return SR_OK;
+}
+
+/*
+ * Keep the data of a pre-trigger buffer by swapping it with the oldest one
+ * in the ring. The caller then reuses (e.g. resubmits) that one instead.
+ */
+static void pretrigger_store(struct dev_context *devc, uint8_t **buf,
+		int num_samples)
+{
+	struct pretrigger_buf *slot;
+	uint8_t *old;
+
+	slot = &devc->pretrigger[devc->pretrigger_head];
+	old = slot->buf;
+	slot->buf = *buf;
+	slot->num_samples = num_samples;
+	*buf = old;
+
+	devc->pretrigger_head = (devc->pretrigger_head + 1) %
+		devc->pretrigger_size;
+	if (devc->pretrigger_count < devc->pretrigger_size)
+		devc->pretrigger_count++;
+}
+
+static void pretrigger_send_range(struct dev_context *devc,
+		const uint8_t *buf, uint64_t pos, uint64_t len,
+		uint64_t start, uint64_t end)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	const int sample_width = devc->sample_wide ? 2 : 1;
+	uint64_t from, to;
+
+	from = MAX(pos, start);
+	to = MIN(pos + len, end);
+	if (from >= to)
+		return;
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.length = (to - from) * sample_width;
+	logic.unitsize = sample_width;
+	logic.data = (uint8_t *)buf + (from - pos) * sample_width;
+	logic.buffer = NULL;
+	sr_session_send(devc->session_dev_id, &packet);
+}
+
+/*
+ * Send the pre-trigger window: the ring followed by the first trigger_offset
+ * samples of the current buffer, minus the trailing samples which matched
+ * the trigger stages (those go out after SR_DF_TRIGGER), capped at
+ * pretrigger_samples. Returns the number of samples sent.
+ */
+static uint64_t pretrigger_send(struct dev_context *devc,
+		const uint8_t *cur_buf, int trigger_offset)
+{
+	const struct pretrigger_buf *slot;
+	uint64_t total, start, end, pos;
+	unsigned int i, first;
+
+	if (!devc->pretrigger)
+		return 0;
+
+	first = (devc->pretrigger_head + devc->pretrigger_size -
+		 devc->pretrigger_count) % devc->pretrigger_size;
+
+	total = trigger_offset;
+	for (i = 0; i < devc->pretrigger_count; i++)
+		total += devc->pretrigger[(first + i) %
+			devc->pretrigger_size].num_samples;
+
+	end = total > (uint64_t)devc->trigger->num_stages ?
+		total - devc->trigger->num_stages : 0;
+	start = end > devc->pretrigger_samples ?
+		end - devc->pretrigger_samples : 0;
+
+	pos = 0;
+	for (i = 0; i < devc->pretrigger_count; i++) {
+		slot = &devc->pretrigger[(first + i) % devc->pretrigger_size];
+		pretrigger_send_range(devc, slot->buf, pos,
+				      slot->num_samples, start, end);
+		pos += slot->num_samples;
+	}
+	pretrigger_send_range(devc, cur_buf, pos, trigger_offset, start, end);
+
+	return end - start;
+}
+
+static void receive_transfer(struct libusb_transfer *transfer);
+
+/* Stop the USB event thread, and free what it used. */
+static void event_thread_stop(struct dev_context *devc)
+{
+	unsigned int i;
+
+	if (devc->thread) {
+		g_atomic_int_set(&devc->thread_stop, 1);
+		g_thread_join(devc->thread);
+		devc->thread = NULL;
+	}
+
+	if (devc->wakeup_fds[0] >= 0) {
+		sr_source_remove(devc->wakeup_fds[0]);
+		close(devc->wakeup_fds[0]);
+		close(devc->wakeup_fds[1]);
+		devc->wakeup_fds[0] = devc->wakeup_fds[1] = -1;
+	}
+
+	for (i = 0; i < devc->num_bufs; i++)
+		if (devc->bufs[i].buf)
+			sr_usb_buf_free(devc->bufs[i].buf,
+					devc->transfer_size);
+	g_free(devc->bufs);
+	devc->bufs = NULL;
+	devc->num_bufs = 0;
+
+	g_async_queue_unref(devc->filled);
+	g_async_queue_unref(devc->handoff);
+	g_async_queue_unref(devc->spares);
+	devc->filled = devc->handoff = devc->spares = NULL;
+	g_mutex_clear(&devc->thread_mutex);
 }
 
 static void finish_acquisition(struct dev_context *devc)
@@ -721,15 +1243,36 @@ static void finish_acquisition(struct dev_context *devc)
 	packet.type = SR_DF_END;
 	sr_session_send(devc->session_dev_id, &packet);
 
-	/* Remove fds from polling */
-	const struct libusb_pollfd **const lupfd =
-		libusb_get_pollfds(drvc->sr_ctx->libusb_ctx);
-	for (i = 0; lupfd[i]; i++)
-		sr_source_remove(lupfd[i]->fd);
-	free(lupfd); /* NOT g_free()! */
+	if (devc->filled) {
+		event_thread_stop(devc);
+	} else {
+		/* Remove fds from polling */
+		const struct libusb_pollfd **const lupfd =
+			libusb_get_pollfds(drvc->sr_ctx->libusb_ctx);
+		for (i = 0; lupfd[i]; i++)
+			sr_source_remove(lupfd[i]->fd);
+		free(lupfd); /* NOT g_free()! */
+	}
 
 	devc->num_transfers = 0;
 	g_free(devc->transfers);
+	devc->transfers = NULL;
+
+	pretrigger_free(devc);
+	if (devc->trigger) {
+		sr_trigger_destroy(devc->trigger);
+		devc->trigger = NULL;
+	}
+
+	/*
+	 * If the queue had to grow to keep up, the host is better served
+	 * with fewer, larger transfers.
+	 */
+	if (devc->transfers_grew && devc->transfer_ms < MAX_TRANSFER_MS) {
+		devc->transfer_ms *= 2;
+		sr_dbg("fx2lafw: Using %u ms transfers from now on.",
+		       devc->transfer_ms);
+	}
 }
 
 static void free_transfer(struct libusb_transfer *transfer)
@@ -737,7 +1280,7 @@ static void free_transfer(struct libusb_transfer *transfer)
 	struct dev_context *devc = transfer->user_data;
 	unsigned int i;
 
-	g_free(transfer->buffer);
+	sr_usb_buf_free(transfer->buffer, transfer->length);
 	transfer->buffer = NULL;
 	libusb_free_transfer(transfer);
 
@@ -749,6 +1292,7 @@ static void free_transfer(struct libusb_transfer *transfer)
 	}
 
 	devc->submitted_transfers--;
+	devc->stats.transfers = devc->submitted_transfers;
 	if (devc->submitted_transfers == 0)
 		finish_acquisition(devc);
 
@@ -756,10 +1300,13 @@ static void free_transfer(struct libusb_transfer *transfer)
 
 static void resubmit_transfer(struct libusb_transfer *transfer)
 {
+	struct dev_context *devc = transfer->user_data;
 	int ret = libusb_submit_transfer(transfer);
 
-	if (LIBUSB_SUCCESS == ret)
+	if (LIBUSB_SUCCESS == ret) {
+		devc->dev_stats.transfers_resubmitted++;
 		return;
+	}
 
 	free_transfer(transfer);
 	/* TODO: Stop session? */
@@ -767,13 +1314,207 @@ static void resubmit_transfer(struct libusb_transfer *transfer)
 	sr_err("fx2lafw: %s: %s", __func__, libusb_error_name(ret));
 }
 
-static void receive_transfer(struct libusb_transfer *transfer)
+/* Return an entry to the spares, or the handoff entries. */
+static void spare_put(struct dev_context *devc, struct usb_buf *b)
+{
+	b->transfer = NULL;
+	g_async_queue_push(b->buf ? devc->spares : devc->handoff, b);
+}
+
+static int spare_add(struct dev_context *devc)
+{
+	struct usb_buf *b;
+
+	if (devc->num_bufs >= MAX_NUM_TRANSFERS + MAX_SPARE_BUFFERS)
+		return SR_ERR;
+
+	b = &devc->bufs[devc->num_bufs];
+	if (!(b->buf = sr_usb_buf_alloc(devc->usb, devc->transfer_size))) {
+		sr_err("fx2lafw: %s: buf malloc failed.", __func__);
+		return SR_ERR_MALLOC;
+	}
+	devc->num_bufs++;
+	devc->stats.spare_buffers++;
+	devc->dev_stats.buffer_size += devc->transfer_size;
+	spare_put(devc, b);
+
+	return SR_OK;
+}
+
+static int transfer_add(struct dev_context *devc)
+{
+	struct libusb_transfer *transfer;
+	unsigned char *buf;
+	int ret;
+
+	if (devc->num_transfers >= MAX_NUM_TRANSFERS)
+		return SR_ERR;
+
+	if (!(buf = sr_usb_buf_alloc(devc->usb, devc->transfer_size))) {
+		sr_err("fx2lafw: %s: buf malloc failed.", __func__);
+		return SR_ERR_MALLOC;
+	}
+	if (!(transfer = libusb_alloc_transfer(0))) {
+		sr_err("fx2lafw: %s: transfer malloc failed.", __func__);
+		sr_usb_buf_free(buf, devc->transfer_size);
+		return SR_ERR_MALLOC;
+	}
+	libusb_fill_bulk_transfer(transfer, devc->usb->devhdl,
+			2 | LIBUSB_ENDPOINT_IN, buf, devc->transfer_size,
+			receive_transfer, devc, devc->transfer_timeout);
+	if ((ret = libusb_submit_transfer(transfer)) != 0) {
+		sr_err("fx2lafw: %s: libusb_submit_transfer: %s.",
+		       __func__, libusb_error_name(ret));
+		libusb_free_transfer(transfer);
+		sr_usb_buf_free(buf, devc->transfer_size);
+		return SR_ERR;
+	}
+	devc->transfers[devc->num_transfers++] = transfer;
+	devc->submitted_transfers++;
+	devc->stats.transfers = devc->submitted_transfers;
+	/* With the event thread, the data waits in the spares instead. */
+	if (!devc->filled)
+		devc->dev_stats.buffer_size += devc->transfer_size;
+
+	return SR_OK;
+}
+
+/*
+ * Account for completed data which waited since 'since' (in us) to be
+ * handled, and grow the transfer queue until it covers twice the longest
+ * such wait. Without the event thread, the wait is the time since the
+ * previous completion was handled.
+ */
+static void account_data(struct dev_context *devc, int64_t since,
+		int length)
+{
+	const int64_t now = g_get_monotonic_time();
+	const uint64_t transfer_us = devc->transfer_ms * 1000;
+	const int sample_width = devc->sample_wide ? 2 : 1;
+	uint64_t latency, reserve, used;
+
+	if (!devc->filled) {
+		since = devc->last_completion;
+		devc->last_completion = now;
+	}
+	latency = since ? now - since : 0;
+
+	devc->stats.completed++;
+	devc->stats.bytes += length;
+	if (latency > devc->stats.latency_max)
+		devc->stats.latency_max = latency;
+
+	sr_dev_stats_data(&devc->dev_stats, length, length / sample_width,
+			  latency);
+	/* This buffer, and whatever the event thread queued behind it. */
+	used = length;
+	if (devc->filled)
+		used += (uint64_t)MAX(g_async_queue_length(devc->filled), 0)
+			* devc->transfer_size;
+	devc->dev_stats.buffer_used = used;
+	if (used > devc->dev_stats.buffer_max)
+		devc->dev_stats.buffer_max = used;
+
+	/*
+	 * With the event thread, transfers are resubmitted at once and the
+	 * spare buffers are what the data waits in; otherwise it waits in
+	 * the transfers themselves.
+	 */
+	for (;;) {
+		reserve = devc->filled ? devc->stats.spare_buffers :
+			(uint64_t)devc->submitted_transfers;
+		if (reserve * transfer_us >= 2 * latency)
+			break;
+		if ((devc->filled ? spare_add(devc) : transfer_add(devc))
+		    != SR_OK)
+			break;
+		devc->transfers_grew = TRUE;
+	}
+}
+
+/*
+ * Run the trigger over a buffer of sample data and send what's due. The
+ * buffer may be swapped for another one (of the same size) to keep it for
+ * the pre-trigger window.
+ *
+ * Returns TRUE once limit_samples has been reached.
+ */
+static gboolean process_data(struct dev_context *devc, uint8_t **buf,
+		int length)
 {
-	gboolean packet_has_error = FALSE;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_logic logic;
+	uint8_t *const cur_buf = *buf;
+	const int sample_width = devc->sample_wide ? 2 : 1;
+	const int cur_sample_count = length / sample_width;
+	uint64_t used;
+	int trigger_offset;
+
+	trigger_offset = 0;
+	if (devc->trigger_stage >= 0 && sr_trigger_find(devc->trigger,
+			cur_buf, length, sample_width, &used)) {
+		/* Match on all trigger stages, we're done. */
+		const int n = devc->trigger->num_stages;
+
+		trigger_offset = used;
+
+		/*
+		 * Send the pre-trigger window, then tell the frontend we
+		 * hit the trigger here.
+		 */
+		devc->num_samples += pretrigger_send(devc, cur_buf,
+				trigger_offset);
+
+		packet.type = SR_DF_TRIGGER;
+		packet.payload = NULL;
+		sr_session_send(devc->session_dev_id, &packet);
+
+		/*
+		 * Send the samples that triggered it, since we're skipping
+		 * past them.
+		 */
+		packet.type = SR_DF_LOGIC;
+		packet.payload = &logic;
+		logic.unitsize = sample_width;
+		logic.length = n * logic.unitsize;
+		logic.data = devc->trigger->match;
+		logic.buffer = NULL;
+		sr_session_send(devc->session_dev_id, &packet);
+		devc->num_samples += n;
+
+		devc->trigger_stage = TRIGGER_FIRED;
+	}
+
+	if (devc->trigger_stage == TRIGGER_FIRED) {
+		/* Send the incoming data to the session bus. */
+		const int trigger_offset_bytes = trigger_offset * sample_width;
+		packet.type = SR_DF_LOGIC;
+		packet.payload = &logic;
+		logic.length = length - trigger_offset_bytes;
+		logic.unitsize = sample_width;
+		logic.data = cur_buf + trigger_offset_bytes;
+		logic.buffer = NULL;
+		sr_session_send(devc->session_dev_id, &packet);
+
+		devc->num_samples += cur_sample_count - trigger_offset;
+		if (devc->limit_samples &&
+			(unsigned int)devc->num_samples > devc->limit_samples)
+			return TRUE;
+	} else if (devc->pretrigger) {
+		/* Keep this buffer around for the pre-trigger window. */
+		pretrigger_store(devc, buf, cur_sample_count);
+	}
+
+	return FALSE;
+}
+
+/* Handle the completion of a transfer, in the session's context. */
+static void handle_transfer(struct libusb_transfer *transfer)
+{
+	gboolean packet_has_error = FALSE;
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_overrun overrun;
 	struct dev_context *devc = transfer->user_data;
-	int trigger_offset, i;
 
 	/*
 	 * If acquisition has already ended, just free any queued up
@@ -787,10 +1528,7 @@ static void receive_transfer(struct libusb_transfer *transfer)
 	sr_info("fx2lafw: receive_transfer(): status %d received %d bytes.",
 		transfer->status, transfer->actual_length);
 
-	/* Save incoming transfer before reusing the transfer struct. */
-	uint8_t *const cur_buf = transfer->buffer;
 	const int sample_width = devc->sample_wide ? 2 : 1;
-	const int cur_sample_count = transfer->actual_length / sample_width;
 
 	switch (transfer->status) {
 	case LIBUSB_TRANSFER_NO_DEVICE:
@@ -805,7 +1543,21 @@ static void receive_transfer(struct libusb_transfer *transfer)
 		break;
 	}
 
+	if (packet_has_error && devc->trigger_stage == TRIGGER_FIRED) {
+		/*
+		 * The data of this transfer is lost. Tell the frontend, so
+		 * that the capture isn't mistaken for a gapless one.
+		 */
+		packet.type = SR_DF_OVERRUN;
+		packet.payload = &overrun;
+		overrun.offset = devc->num_samples;
+		overrun.num_samples = transfer->length / sample_width;
+		sr_session_send(devc->session_dev_id, &packet);
+	}
+
 	if (transfer->actual_length == 0 || packet_has_error) {
+		devc->stats.failed++;
+		devc->dev_stats.transfers_failed++;
 		devc->empty_transfer_count++;
 		if (devc->empty_transfer_count > MAX_EMPTY_TRANSFERS) {
 			/*
@@ -822,103 +1574,208 @@ static void receive_transfer(struct libusb_transfer *transfer)
 		devc->empty_transfer_count = 0;
 	}
 
-	trigger_offset = 0;
-	if (devc->trigger_stage >= 0) {
-		for (i = 0; i < cur_sample_count; i++) {
-
-			const uint16_t cur_sample = devc->sample_wide ?
-				*((const uint16_t*)cur_buf + i) :
-				*((const uint8_t*)cur_buf + i);
-
-			if ((cur_sample & devc->trigger_mask[devc->trigger_stage]) ==
-				devc->trigger_value[devc->trigger_stage]) {
-				/* Match on this trigger stage. */
-				devc->trigger_buffer[devc->trigger_stage] = cur_sample;
-				devc->trigger_stage++;
-
-				if (devc->trigger_stage == NUM_TRIGGER_STAGES ||
-					devc->trigger_mask[devc->trigger_stage] == 0) {
-					/* Match on all trigger stages, we're done. */
-					trigger_offset = i + 1;
-
-					/*
-					 * TODO: Send pre-trigger buffer to session bus.
-					 * Tell the frontend we hit the trigger here.
-					 */
-					packet.type = SR_DF_TRIGGER;
-					packet.payload = NULL;
-					sr_session_send(devc->session_dev_id, &packet);
-
-					/*
-					 * Send the samples that triggered it, since we're
-					 * skipping past them.
-					 */
-					packet.type = SR_DF_LOGIC;
-					packet.payload = &logic;
-					logic.unitsize = sizeof(*devc->trigger_buffer);
-					logic.length = devc->trigger_stage * logic.unitsize;
-					logic.data = devc->trigger_buffer;
-					sr_session_send(devc->session_dev_id, &packet);
-
-					devc->trigger_stage = TRIGGER_FIRED;
-					break;
-				}
-			} else if (devc->trigger_stage > 0) {
-				/*
-				 * We had a match before, but not in the next sample. However, we may
-				 * have a match on this stage in the next bit -- trigger on 0001 will
-				 * fail on seeing 00001, so we need to go back to stage 0 -- but at
-				 * the next sample from the one that matched originally, which the
-				 * counter increment at the end of the loop takes care of.
-				 */
-				i -= devc->trigger_stage;
-				if (i < -1)
-					i = -1; /* Oops, went back past this buffer. */
-				/* Reset trigger stage. */
-				devc->trigger_stage = 0;
-			}
+	account_data(devc, 0, transfer->actual_length);
+
+	if (process_data(devc, &transfer->buffer, transfer->actual_length)) {
+		abort_acquisition(devc);
+		free_transfer(transfer);
+		return;
+	}
+
+	resubmit_transfer(transfer);
+}
+
+/*
+ * Hand a completed transfer over to the session, on the event thread. If
+ * it brought data, it's resubmitted at once with a spare buffer and just
+ * the data is queued. Anything else is left to handle_transfer().
+ */
+static void queue_transfer(struct libusb_transfer *transfer)
+{
+	struct dev_context *devc = transfer->user_data;
+	struct usb_buf *b;
+	uint8_t *buf;
+	int length;
+
+	b = NULL;
+	length = transfer->actual_length;
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED && length > 0
+	    && (b = g_async_queue_try_pop(devc->spares))) {
+		g_mutex_lock(&devc->thread_mutex);
+		buf = transfer->buffer;
+		transfer->buffer = b->buf;
+		if (devc->num_samples != -1
+		    && libusb_submit_transfer(transfer) == LIBUSB_SUCCESS) {
+			b->buf = buf;
+			b->length = length;
+		} else {
+			transfer->buffer = buf;
+			g_async_queue_push(devc->spares, b);
+			b = NULL;
 		}
+		g_mutex_unlock(&devc->thread_mutex);
 	}
 
-	if (devc->trigger_stage == TRIGGER_FIRED) {
-		/* Send the incoming transfer to the session bus. */
-		const int trigger_offset_bytes = trigger_offset * sample_width;
-		packet.type = SR_DF_LOGIC;
-		packet.payload = &logic;
-		logic.length = transfer->actual_length - trigger_offset_bytes;
-		logic.unitsize = sample_width;
-		logic.data = cur_buf + trigger_offset_bytes;
-		sr_session_send(devc->session_dev_id, &packet);
+	if (!b) {
+		/* There is a handoff entry for every transfer. */
+		b = g_async_queue_pop(devc->handoff);
+		b->transfer = transfer;
+	}
+	b->time = g_get_monotonic_time();
+	g_async_queue_push(devc->filled, b);
 
-		devc->num_samples += cur_sample_count;
-		if (devc->limit_samples &&
-			(unsigned int)devc->num_samples > devc->limit_samples) {
-			abort_acquisition(devc);
-			free_transfer(transfer);
-			return;
+	/* A full pipe is fine, the session has yet to read it anyway. */
+	if (write(devc->wakeup_fds[1], "", 1) < 0 && errno != EAGAIN)
+		sr_warn("fx2lafw: %s: %s", __func__, g_strerror(errno));
+}
+
+static void receive_transfer(struct libusb_transfer *transfer)
+{
+	struct dev_context *devc = transfer->user_data;
+
+	SR_TRACE2(fx2lafw_transfer, transfer->status, transfer->actual_length);
+
+	if (devc->filled)
+		queue_transfer(transfer);
+	else
+		handle_transfer(transfer);
+}
+
+/* Handle what the event thread queued up, in the session's context. */
+static int receive_queue(int fd, int revents, void *cb_data)
+{
+	struct dev_context *devc = cb_data;
+	struct libusb_transfer *transfer;
+	struct usb_buf *b;
+	char dummy[64];
+
+	(void)revents;
+
+	while (read(fd, dummy, sizeof(dummy)) > 0)
+		;
+
+	/* The acquisition may finish (and the queue go away) in here. */
+	while (devc->filled && (b = g_async_queue_try_pop(devc->filled))) {
+		if ((transfer = b->transfer)) {
+			spare_put(devc, b);
+			handle_transfer(transfer);
+			continue;
 		}
-	} else {
-		/*
-		 * TODO: Buffer pre-trigger data in capture
-		 * ratio-sized buffer.
-		 */
+		if (devc->num_samples != -1) {
+			/* The event thread resubmitted its transfer. */
+			devc->dev_stats.transfers_resubmitted++;
+			account_data(devc, b->time, b->length);
+			if (process_data(devc, &b->buf, b->length))
+				abort_acquisition(devc);
+		}
+		spare_put(devc, b);
 	}
 
-	resubmit_transfer(transfer);
+	return TRUE;
+}
+
+static gpointer event_thread_run(gpointer data)
+{
+	struct dev_context *devc = data;
+	struct drv_context *drvc = fdi->priv;
+#ifndef _WIN32
+	struct sched_param param;
+#endif
+	struct timeval tv;
+
+#ifndef _WIN32
+	/* Needs privileges, which we may well not have. */
+	param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+		sr_dbg("fx2lafw: USB event thread runs at normal priority.");
+#endif
+
+	while (!g_atomic_int_get(&devc->thread_stop)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = EVENT_THREAD_TIMEOUT_MS * 1000;
+		libusb_handle_events_timeout(drvc->sr_ctx->libusb_ctx, &tv);
+	}
+
+	return NULL;
 }
 
-static unsigned int to_bytes_per_ms(unsigned int samplerate)
+static int event_thread_start(struct dev_context *devc,
+		unsigned int num_spares)
 {
-	return samplerate / 1000;
+	GError *error;
+	unsigned int i;
+	int ret;
+
+	devc->bufs = g_try_malloc0(sizeof(*devc->bufs) *
+				   (MAX_NUM_TRANSFERS + MAX_SPARE_BUFFERS));
+	if (!devc->bufs) {
+		sr_err("fx2lafw: %s: bufs malloc failed.", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	g_mutex_init(&devc->thread_mutex);
+	devc->spares = g_async_queue_new();
+	devc->handoff = g_async_queue_new();
+	devc->filled = g_async_queue_new();
+
+	/* Entries without a buffer, for handing over transfers. */
+	for (devc->num_bufs = 0; devc->num_bufs < MAX_NUM_TRANSFERS;
+	     devc->num_bufs++)
+		spare_put(devc, &devc->bufs[devc->num_bufs]);
+	for (i = 0; i < num_spares; i++) {
+		if ((ret = spare_add(devc)) != SR_OK) {
+			event_thread_stop(devc);
+			return ret;
+		}
+	}
+
+#ifdef _WIN32
+	/* Can't be enabled, see hw_dev_config_set(). */
+	event_thread_stop(devc);
+	return SR_ERR_BUG;
+#else
+	if (pipe(devc->wakeup_fds) < 0) {
+		sr_err("fx2lafw: %s: pipe: %s", __func__, g_strerror(errno));
+		devc->wakeup_fds[0] = devc->wakeup_fds[1] = -1;
+		event_thread_stop(devc);
+		return SR_ERR;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(devc->wakeup_fds[i], F_SETFL, O_NONBLOCK);
+		fcntl(devc->wakeup_fds[i], F_SETFD, FD_CLOEXEC);
+	}
+#endif
+
+	sr_source_add(devc->wakeup_fds[0], G_IO_IN, devc->transfer_timeout,
+		      receive_queue, devc);
+
+	error = NULL;
+	g_atomic_int_set(&devc->thread_stop, 0);
+	devc->thread = g_thread_try_new("fx2lafw-usb", event_thread_run,
+					devc, &error);
+	if (!devc->thread) {
+		sr_err("fx2lafw: %s: failed to create USB event thread: %s",
+		       __func__, error->message);
+		g_error_free(error);
+		event_thread_stop(devc);
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+static unsigned int to_bytes_per_ms(struct dev_context *devc)
+{
+	return devc->cur_samplerate / 1000 * (devc->sample_wide ? 2 : 1);
 }
 
 static size_t get_buffer_size(struct dev_context *devc)
 {
 	size_t s;
 
-	/* The buffer should be large enough to hold 10ms of data and a multiple
-	 * of 512. */
-	s = 10 * to_bytes_per_ms(devc->cur_samplerate);
+	/* The buffer should be large enough to hold transfer_ms of data and
+	 * a multiple of 512. */
+	s = devc->transfer_ms * to_bytes_per_ms(devc);
 	return (s + 511) & ~511;
 }
 
@@ -927,7 +1784,7 @@ static unsigned int get_number_of_transfers(struct dev_context *devc)
 	unsigned int n;
 
 	/* Total buffer size should be able to hold about 500ms of data */
-	n = 500 * to_bytes_per_ms(devc->cur_samplerate) / get_buffer_size(devc);
+	n = TOTAL_TRANSFER_MS * to_bytes_per_ms(devc) / get_buffer_size(devc);
 
 	if (n > NUM_SIMUL_TRANSFERS)
 		return NUM_SIMUL_TRANSFERS;
@@ -940,12 +1797,17 @@ static unsigned int get_timeout(struct dev_context *devc)
 	size_t total_size;
 	unsigned int timeout;
 
-	total_size = get_buffer_size(devc) * get_number_of_transfers(devc);
-	timeout = total_size / to_bytes_per_ms(devc->cur_samplerate);
+	/* Allow for the queue growing to its maximum. */
+	total_size = get_buffer_size(devc) * MAX_NUM_TRANSFERS;
+	timeout = total_size / to_bytes_per_ms(devc);
 	return timeout + timeout / 4; /* Leave a headroom of 25% percent */
 }
 
-static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
+/*
+ * Set up everything for an acquisition, up to the point where the device
+ * only needs to be told to start sampling.
+ */
+static int hw_dev_acquisition_arm(const struct sr_dev_inst *sdi,
 		void *cb_data)
 {
 	struct sr_datafeed_packet packet;
@@ -953,11 +1815,9 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	struct sr_datafeed_meta_logic meta;
 	struct dev_context *devc;
 	struct drv_context *drvc = fdi->priv;
-	struct libusb_transfer *transfer;
 	const struct libusb_pollfd **lupfd;
 	unsigned int i;
 	int ret;
-	unsigned char *buf;
 
 	devc = sdi->priv;
 	if (devc->submitted_transfers != 0)
@@ -971,45 +1831,52 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	devc->session_dev_id = cb_data;
 	devc->num_samples = 0;
 	devc->empty_transfer_count = 0;
-
-	const unsigned int timeout = get_timeout(devc);
+	devc->transfers_grew = FALSE;
+	devc->last_completion = 0;
+	memset(&devc->stats, 0, sizeof(devc->stats));
+	sr_dev_stats_start(&devc->dev_stats);
+
+	devc->transfer_size = get_buffer_size(devc);
+	devc->transfer_timeout = get_timeout(devc);
+	devc->stats.transfer_size = devc->transfer_size;
 	const unsigned int num_transfers = get_number_of_transfers(devc);
-	const size_t size = get_buffer_size(devc);
 
-	devc->transfers = g_try_malloc0(sizeof(*devc->transfers) * num_transfers);
+	if ((ret = pretrigger_alloc(devc, devc->transfer_size)) != SR_OK)
+		return ret;
+
+	devc->transfers = g_try_malloc0(sizeof(*devc->transfers) *
+					MAX_NUM_TRANSFERS);
 	if (!devc->transfers) {
 		sr_err("fx2lafw: USB transfers malloc failed.");
+		pretrigger_free(devc);
 		return SR_ERR_MALLOC;
 	}
+	devc->num_transfers = 0;
 
-	devc->num_transfers = num_transfers;
+	/* Double buffering: one spare buffer for each transfer. */
+	if (devc->event_thread
+	    && (ret = event_thread_start(devc, num_transfers)) != SR_OK) {
+		g_free(devc->transfers);
+		devc->transfers = NULL;
+		pretrigger_free(devc);
+		return ret;
+	}
 
 	for (i = 0; i < num_transfers; i++) {
-		if (!(buf = g_try_malloc(size))) {
-			sr_err("fx2lafw: %s: buf malloc failed.", __func__);
-			return SR_ERR_MALLOC;
-		}
-		transfer = libusb_alloc_transfer(0);
-		libusb_fill_bulk_transfer(transfer, devc->usb->devhdl,
-				2 | LIBUSB_ENDPOINT_IN, buf, size,
-				receive_transfer, devc, timeout);
-		if ((ret = libusb_submit_transfer(transfer)) != 0) {
-			sr_err("fx2lafw: %s: libusb_submit_transfer: %s.",
-			       __func__, libusb_error_name(ret));
-			libusb_free_transfer(transfer);
-			g_free(buf);
+		if ((ret = transfer_add(devc)) != SR_OK) {
 			abort_acquisition(devc);
-			return SR_ERR;
+			return ret;
 		}
-		devc->transfers[i] = transfer;
-		devc->submitted_transfers++;
 	}
 
-	lupfd = libusb_get_pollfds(drvc->sr_ctx->libusb_ctx);
-	for (i = 0; lupfd[i]; i++)
-		sr_source_add(lupfd[i]->fd, lupfd[i]->events,
-			      timeout, receive_data, NULL);
-	free(lupfd); /* NOT g_free()! */
+	if (!devc->filled) {
+		lupfd = libusb_get_pollfds(drvc->sr_ctx->libusb_ctx);
+		for (i = 0; lupfd[i]; i++)
+			sr_source_add(lupfd[i]->fd, lupfd[i]->events,
+				      devc->transfer_timeout, receive_data,
+				      NULL);
+		free(lupfd); /* NOT g_free()! */
+	}
 
 	packet.type = SR_DF_HEADER;
 	packet.payload = &header;
@@ -1024,6 +1891,16 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	meta.num_probes = devc->sample_wide ? 16 : 8;
 	sr_session_send(cb_data, &packet);
 
+	return SR_OK;
+}
+
+/* Let an armed device start sampling. */
+static int hw_dev_acquisition_release(const struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc;
+	int ret;
+
+	devc = sdi->priv;
 	if ((ret = command_start_acquisition (devc->usb->devhdl,
 		devc->cur_samplerate, devc->sample_wide)) != SR_OK) {
 		abort_acquisition(devc);
@@ -1033,6 +1910,17 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	return SR_OK;
 }
 
+static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
+		void *cb_data)
+{
+	int ret;
+
+	if ((ret = hw_dev_acquisition_arm(sdi, cb_data)) != SR_OK)
+		return ret;
+
+	return hw_dev_acquisition_release(sdi);
+}
+
 /* TODO: This stops acquisition on ALL devices, ignoring dev_index. */
 static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi, void *cb_data)
 {
@@ -1058,5 +1946,9 @@ SR_PRIV struct sr_dev_driver fx2lafw_driver_info = {
 	.dev_config_set = hw_dev_config_set,
 	.dev_acquisition_start = hw_dev_acquisition_start,
 	.dev_acquisition_stop = hw_dev_acquisition_stop,
+	.dev_acquisition_arm = hw_dev_acquisition_arm,
+	.dev_acquisition_release = hw_dev_acquisition_release,
+	.usb_arrived = hw_usb_arrived,
+	.usb_left = hw_usb_left,
 	.priv = NULL,
 };
@@ -19,19 +19,36 @@
  */
 
 #include <glib.h>
+#include "libsigrok.h"
 
 #ifndef LIBSIGROK_HARDWARE_FX2LAFW_FX2LAFW_H
 #define LIBSIGROK_HARDWARE_FX2LAFW_FX2LAFW_H
 
 #define USB_INTERFACE		0
 #define USB_CONFIGURATION	1
-#define NUM_TRIGGER_STAGES	4
-#define TRIGGER_TYPES		"01"
+#define TRIGGER_TYPES		"01rfc"
 
 #define MAX_RENUM_DELAY_MS	3000
+/* How long the FX2 takes at least to leave the bus after an upload. */
+#define MIN_RENUM_DELAY_MS	300
 #define NUM_SIMUL_TRANSFERS	32
 #define MAX_EMPTY_TRANSFERS	(NUM_SIMUL_TRANSFERS * 2)
 
+/*
+ * Transfer geometry: each transfer holds transfer_ms of data (doubled for
+ * the next acquisition whenever the queue had to grow), and the queue
+ * starts out holding about TOTAL_TRANSFER_MS, capped at NUM_SIMUL_TRANSFERS.
+ * It then grows, up to the MAX_* limits, until it covers twice the longest
+ * time completed data had to wait.
+ */
+#define DEFAULT_TRANSFER_MS	10
+#define MAX_TRANSFER_MS		40
+#define TOTAL_TRANSFER_MS	500
+#define MAX_NUM_TRANSFERS	(NUM_SIMUL_TRANSFERS * 4)
+#define MAX_SPARE_BUFFERS	256
+/* How long the USB event thread waits for events at a time. */
+#define EVENT_THREAD_TIMEOUT_MS	100
+
 #define FX2LAFW_REQUIRED_VERSION_MAJOR	1
 
 #define MAX_8BIT_SAMPLE_RATE	SR_MHZ(24)
@@ -60,6 +77,31 @@ struct fx2lafw_profile {
 	uint32_t dev_caps;
 };
 
+/*
+ * One slot of the pre-trigger ring. Until the trigger fires, each completed
+ * transfer swaps its buffer with the oldest slot and is resubmitted with
+ * that, so the most recent data is kept without copying it.
+ */
+struct pretrigger_buf {
+	uint8_t *buf;
+	int num_samples;
+};
+
+/*
+ * A buffer of sample data handed from the USB event thread to the session,
+ * or a transfer whose completion the session has to handle itself (if
+ * 'transfer' is set). Spare buffers are swapped into completed transfers
+ * so that those can be resubmitted at once; handoff entries carry no
+ * buffer, only transfers.
+ */
+struct usb_buf {
+	struct libusb_transfer *transfer;
+	uint8_t *buf;
+	int length;
+	/* Monotonic time (in us) at which the transfer completed. */
+	int64_t time;
+};
+
 struct dev_context {
 	const struct fx2lafw_profile *profile;
 
@@ -70,17 +112,27 @@ struct dev_context {
 	 * until a proper delay after the last device was upgraded.
 	 */
 	int64_t fw_updated;
+	/* Address the device had before the upload, while it renumerates. */
+	uint8_t fw_old_address;
 
 	/* Device/capture settings */
 	uint64_t cur_samplerate;
 	uint64_t limit_samples;
+	uint64_t capture_ratio;
 
 	gboolean sample_wide;
 
-	uint16_t trigger_mask[NUM_TRIGGER_STAGES];
-	uint16_t trigger_value[NUM_TRIGGER_STAGES];
+	/* The probe triggers, compiled when the acquisition starts. */
+	struct sr_trigger *trigger;
 	int trigger_stage;
-	uint16_t trigger_buffer[NUM_TRIGGER_STAGES];
+
+	/* Pre-trigger ring, allocated only when a capture ratio is set. */
+	struct pretrigger_buf *pretrigger;
+	unsigned int pretrigger_size;
+	unsigned int pretrigger_head;
+	unsigned int pretrigger_count;
+	uint64_t pretrigger_samples;
+	size_t pretrigger_buf_size;
 
 	int num_samples;
 	int submitted_transfers;
@@ -92,6 +144,29 @@ struct dev_context {
 
 	unsigned int num_transfers;
 	struct libusb_transfer **transfers;
+
+	/* Transfer geometry and statistics, see the *_TRANSFER_MS defines. */
+	unsigned int transfer_ms;
+	size_t transfer_size;
+	unsigned int transfer_timeout;
+	gboolean transfers_grew;
+	int64_t last_completion;
+	struct sr_transfer_stats stats;
+	struct sr_dev_stats dev_stats;
+
+	/* USB event thread, if enabled with SR_HWCAP_USB_EVENT_THREAD. */
+	gboolean event_thread;
+	GThread *thread;
+	volatile gint thread_stop;
+	/* Held while resubmitting from the thread, and while aborting. */
+	GMutex thread_mutex;
+	/* The thread writes a byte here when 'filled' becomes non-empty. */
+	int wakeup_fds[2];
+	GAsyncQueue *filled;
+	GAsyncQueue *spares;
+	GAsyncQueue *handoff;
+	struct usb_buf *bufs;
+	unsigned int num_bufs;
 };
 
 #endif
@@ -49,6 +49,7 @@ static const int hwcaps[] = {
 	SR_HWCAP_FILTER,
 	SR_HWCAP_VDIV,
 	SR_HWCAP_COUPLING,
+	SR_HWCAP_ROLL_MODE,
 	0,
 };
 
@@ -243,6 +244,10 @@ static int clear_instances(void)
 		dso_close(sdi);
 		sr_usb_dev_inst_free(devc->usb);
 		g_free(devc->triggersource);
+		g_free(devc->framebuf);
+		dso_free_transfers(devc);
+		if (devc->chunk_buf)
+			sr_buffer_release(devc->chunk_buf);
 
 		sr_dev_inst_free(sdi);
 	}
@@ -289,9 +294,9 @@ static GSList *hw_scan(GSList *options)
 	clear_instances();
 
 	/* Find all Hantek DSO devices and upload firmware to all of them. */
-	libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
+	sr_usb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
 	for (i = 0; devlist[i]; i++) {
-		if ((ret = libusb_get_device_descriptor(devlist[i], &des))) {
+		if ((ret = sr_usb_get_device_descriptor(devlist[i], &des))) {
 			sr_err("Failed to get device descriptor: %s.",
 			       libusb_error_name(ret));
 			continue;
@@ -414,6 +419,7 @@ static int hw_cleanup(void)
 		return SR_OK;
 
 	clear_instances();
+	ezusb_firmware_cache_clear();
 
 	return SR_OK;
 }
@@ -421,10 +427,9 @@ static int hw_cleanup(void)
 static int hw_info_get(int info_id, const void **data,
 		       const struct sr_dev_inst *sdi)
 {
+	struct dev_context *devc;
 	uint64_t tmp;
 
-	(void)sdi;
-
 	switch (info_id) {
 	case SR_DI_HWCAPS:
 		*data = hwcaps;
@@ -453,6 +458,12 @@ static int hw_info_get(int info_id, const void **data,
 	case SR_DI_COUPLING:
 		*data = coupling;
 		break;
+	case SR_DI_DEV_STATS:
+		if (!sdi)
+			return SR_ERR;
+		devc = sdi->priv;
+		*data = &devc->stats;
+		break;
 	/* TODO remove this */
 	case SR_DI_CUR_SAMPLERATE:
 		*data = &tmp;
@@ -576,6 +587,9 @@ static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 		if (coupling[i] == 0)
 			ret = SR_ERR_ARG;
 		break;
+	case SR_HWCAP_ROLL_MODE:
+		devc->roll_mode = GPOINTER_TO_INT(value);
+		break;
 	default:
 		ret = SR_ERR_ARG;
 		break;
@@ -584,52 +598,88 @@ static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 	return ret;
 }
 
+/*
+ * Voltage values are encoded as a value 0-255 (0-512 on the DSO-5200*),
+ * where the value is a point in the range represented by the vdiv setting.
+ * There are 8 vertical divs, so e.g. 500mV/div represents 4V peak-to-peak
+ * where 0 = -2V and 255 = +2V.
+ */
+static void vdiv_to_scale(int vdiv, struct sr_analog_scale *scale)
+{
+	float range;
+
+	range = ((float)vdivs[vdiv].p / vdivs[vdiv].q) * 8;
+	scale->scale = range / 255;
+	/* Value is centered around 0V. */
+	scale->offset = -range / 2;
+}
+
 static void send_chunk(struct dev_context *devc, unsigned char *buf,
 		int num_samples)
 {
 	struct sr_datafeed_packet packet;
-	struct sr_datafeed_analog analog;
-	float ch1, ch2, range;
-	int num_probes, data_offset, i;
+	struct sr_datafeed_analog_raw raw;
+	struct sr_analog_scale scales[2];
+	uint8_t *out;
+	uint64_t size;
+	int num_probes, i;
 
 	num_probes = (devc->ch1_enabled && devc->ch2_enabled) ? 2 : 1;
-	packet.type = SR_DF_ANALOG;
-	packet.payload = &analog;
+	size = num_samples * num_probes;
+
+	/* Reuse the last buffer, unless it's too small or still held. */
+	if (devc->chunk_buf && (devc->chunk_buf->size < size ||
+		g_atomic_int_get(&devc->chunk_buf->refcount) > 1)) {
+		sr_buffer_release(devc->chunk_buf);
+		devc->chunk_buf = NULL;
+	}
+	if (!devc->chunk_buf && !(devc->chunk_buf = sr_buffer_new(size))) {
+		sr_err("Sample buffer malloc failed.");
+		return;
+	}
+
+	/* The scales are in the order of the probes in the data. */
+	if (devc->ch1_enabled) {
+		vdiv_to_scale(devc->voltage_ch1, &scales[0]);
+		vdiv_to_scale(devc->voltage_ch2, &scales[1]);
+	} else {
+		vdiv_to_scale(devc->voltage_ch2, &scales[0]);
+	}
+
+	packet.type = SR_DF_ANALOG_RAW;
+	packet.payload = &raw;
 	/* TODO: support for 5xxx series 9-bit samples */
-	analog.num_samples = num_samples;
-	analog.mq = SR_MQ_VOLTAGE;
-	analog.unit = SR_UNIT_VOLT;
-	/* TODO: Check malloc return value. */
-	analog.data = g_try_malloc(analog.num_samples * sizeof(float) * num_probes);
-	data_offset = 0;
-	for (i = 0; i < analog.num_samples; i++) {
-		/*
-		 * The device always sends data for both channels. If a channel
-		 * is disabled, it contains a copy of the enabled channel's
-		 * data. However, we only send the requested channels to
-		 * the bus.
-		 *
-		 * Voltage values are encoded as a value 0-255 (0-512 on the
-		 * DSO-5200*), where the value is a point in the range
-		 * represented by the vdiv setting. There are 8 vertical divs,
-		 * so e.g. 500mV/div represents 4V peak-to-peak where 0 = -2V
-		 * and 255 = +2V.
-		 */
-		/* TODO: Support for DSO-5xxx series 9-bit samples. */
-		if (devc->ch1_enabled) {
-			range = ((float)vdivs[devc->voltage_ch1].p / vdivs[devc->voltage_ch1].q) * 8;
-			ch1 = range / 255 * *(buf + i * 2 + 1);
-			/* Value is centered around 0V. */
-			ch1 -= range / 2;
-			analog.data[data_offset++] = ch1;
-		}
-		if (devc->ch2_enabled) {
-			range = ((float)vdivs[devc->voltage_ch2].p / vdivs[devc->voltage_ch2].q) * 8;
-			ch2 = range / 255 * *(buf + i * 2);
-			ch2 -= range / 2;
-			analog.data[data_offset++] = ch2;
+	raw.num_samples = num_samples;
+	raw.num_probes = num_probes;
+	raw.mq = SR_MQ_VOLTAGE;
+	raw.unit = SR_UNIT_VOLT;
+	raw.mqflags = 0;
+	raw.sample_size = 1;
+	raw.is_signed = FALSE;
+	raw.scales = scales;
+	raw.data = devc->chunk_buf->data;
+	raw.buffer = devc->chunk_buf;
+
+	/*
+	 * The device always sends data for both channels. If a channel
+	 * is disabled, it contains a copy of the enabled channel's
+	 * data. However, we only send the requested channels to
+	 * the bus.
+	 */
+	out = raw.data;
+	if (devc->ch1_enabled && devc->ch2_enabled) {
+		for (i = 0; i < num_samples; i++) {
+			*out++ = buf[i * 2 + 1];
+			*out++ = buf[i * 2];
 		}
+	} else if (devc->ch1_enabled) {
+		for (i = 0; i < num_samples; i++)
+			*out++ = buf[i * 2 + 1];
+	} else {
+		for (i = 0; i < num_samples; i++)
+			*out++ = buf[i * 2];
 	}
+
 	sr_session_send(devc->cb_data, &packet);
 }
 
@@ -641,19 +691,34 @@ static void send_chunk(struct dev_context *devc, unsigned char *buf,
  */
 static void receive_transfer(struct libusb_transfer *transfer)
 {
-	struct sr_datafeed_packet packet;
 	struct dev_context *devc;
 	int num_samples, pre;
 
 	devc = transfer->user_data;
+	devc->submitted_transfers--;
+	SR_TRACE2(hantek_dso_transfer, transfer->status,
+		  transfer->actual_length);
 	sr_dbg("receive_transfer(): status %d received %d bytes.",
 	       transfer->status, transfer->actual_length);
 
-	if (transfer->actual_length == 0)
-		/* Nothing to send to the bus. */
+	/* Leftovers of a cancelled or failed readout. */
+	if (devc->dev_state != FETCH_DATA)
 		return;
 
 	num_samples = transfer->actual_length / 2;
+	/*
+	 * Each transfer counts as either failed or completed. The samples
+	 * of a failed one which still brought some are used all the same.
+	 */
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED || num_samples == 0)
+		devc->stats.transfers_failed++;
+	else
+		/* The data waited for at most as long as handle_event() did. */
+		sr_dev_stats_data(&devc->stats, transfer->actual_length,
+				  num_samples, devc->poll_wait);
+	if (num_samples == 0)
+		/* Nothing to send to the bus. */
+		goto done;
 
 	sr_dbg("Got %d-%d/%d samples in frame.", devc->samp_received + 1,
 	       devc->samp_received + num_samples, devc->framesize);
@@ -702,30 +767,219 @@ static void receive_transfer(struct libusb_transfer *transfer)
 	}
 
 	devc->samp_received += num_samples;
+	devc->stats.buffer_used = devc->samp_buffered * 2;
+	if (devc->stats.buffer_used > devc->stats.buffer_max)
+		devc->stats.buffer_max = devc->stats.buffer_used;
 
-	/* Everything in this transfer was either copied to the buffer or
-	 * sent to the session bus. */
-	g_free(transfer->buffer);
-	libusb_free_transfer(transfer);
+done:
+	/*
+	 * Everything in this transfer was either copied to the buffer or
+	 * sent to the session bus; it's free for the next frame now. Once
+	 * all of them are back, handle_event() finishes the frame.
+	 */
+	if (devc->submitted_transfers > 0)
+		return;
 
-	if (devc->samp_received >= devc->framesize) {
-		/* That was the last chunk in this frame. Send the buffered
-		 * pre-trigger samples out now, in one big chunk. */
-		sr_dbg("End of frame, sending %d pre-trigger buffered samples.",
-		       devc->samp_buffered);
-		send_chunk(devc, devc->framebuf, devc->samp_buffered);
+	if (devc->samp_received < devc->framesize)
+		sr_warn("Incomplete frame, got %d/%d samples.",
+			devc->samp_received, devc->framesize);
+	devc->dev_state = FRAME_DONE;
+}
 
-		/* Mark the end of this frame. */
-		packet.type = SR_DF_FRAME_END;
-		sr_session_send(devc->cb_data, &packet);
+/* Make room for 'size' bytes of samples in the frame buffer. */
+static int framebuf_reserve(struct dev_context *devc, unsigned int size)
+{
+	if (devc->framebuf_size >= size)
+		return SR_OK;
 
-		if (devc->limit_frames && ++devc->num_frames == devc->limit_frames) {
-			/* Terminate session */
-			devc->dev_state = STOPPING;
-		} else {
-			devc->dev_state = NEW_CAPTURE;
-		}
+	g_free(devc->framebuf);
+	devc->framebuf_size = size;
+	if (!(devc->framebuf = g_try_malloc(devc->framebuf_size))) {
+		sr_err("Frame buffer malloc failed.");
+		devc->framebuf_size = 0;
+		return SR_ERR_MALLOC;
+	}
+	devc->stats.buffer_size = devc->framebuf_size;
+
+	return SR_OK;
+}
+
+/*
+ * Roll mode counterpart of receive_transfer(): the readout of the whole
+ * ring buffer is collected in the frame buffer, and handle_event() sends
+ * the new part of it once all transfers are back.
+ */
+static void receive_roll_transfer(struct libusb_transfer *transfer)
+{
+	struct dev_context *devc;
+	unsigned int num_samples;
+
+	devc = transfer->user_data;
+	devc->submitted_transfers--;
+	SR_TRACE2(hantek_dso_transfer, transfer->status,
+		  transfer->actual_length);
+
+	/* Leftovers of a cancelled or failed readout. */
+	if (devc->dev_state != ROLL_FETCH)
+		return;
+
+	num_samples = transfer->actual_length / 2;
+	/* Failed or completed, like in receive_transfer(). */
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED || num_samples == 0)
+		devc->stats.transfers_failed++;
+	num_samples = MIN(num_samples, devc->framesize - devc->samp_received);
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED && num_samples > 0)
+		sr_dev_stats_data(&devc->stats, transfer->actual_length,
+				  num_samples, devc->poll_wait);
+	if (num_samples > 0) {
+		memcpy(devc->framebuf + devc->samp_received * 2,
+		       transfer->buffer, num_samples * 2);
+		devc->samp_received += num_samples;
 	}
+
+	if (devc->submitted_transfers == 0)
+		devc->dev_state = ROLL_DONE;
+}
+
+/* Roll mode: start reading out the ring buffer, if anything new is in it. */
+static void roll_poll(struct dev_context *devc, int64_t now)
+{
+	uint32_t pos;
+	uint8_t capturestate;
+	double rate;
+
+	if (now - devc->roll_last < ROLL_INTERVAL ||
+	    devc->submitted_transfers > 0)
+		return;
+
+	if (dso_get_capturestate(devc, &capturestate, &pos) != SR_OK)
+		return;
+	sr_dbg("Capturestate %d, write position 0x%.6x.", capturestate, pos);
+	pos %= devc->framesize;
+	/* If the trigger stopped the capture, it's restarted after this. */
+	devc->roll_restart = capturestate == CAPTURE_READY_8BIT;
+
+	if (!devc->roll_started) {
+		/* Only what's written from now on is sent. */
+		devc->roll_started = TRUE;
+		devc->roll_pos = pos;
+		devc->roll_start = devc->roll_last = now;
+		return;
+	}
+	if (pos == devc->roll_pos)
+		return;
+
+	/* The ring buffer may have wrapped more than once since. */
+	if (devc->roll_samples > 0 && now > devc->roll_start) {
+		rate = (double)devc->roll_samples / (now - devc->roll_start);
+		if (rate * (now - devc->roll_last) >= devc->framesize)
+			sr_warn("Roll mode fell behind, samples were lost.");
+	}
+	devc->roll_last = now;
+
+	if (framebuf_reserve(devc, devc->framesize * 2) != SR_OK)
+		return;
+	devc->roll_next = pos;
+	devc->samp_received = 0;
+	if (dso_get_channeldata(devc, receive_roll_transfer) != SR_OK)
+		return;
+	devc->dev_state = ROLL_FETCH;
+}
+
+/* Roll mode: send the samples written since the last readout, in order. */
+static void finish_roll(struct dev_context *devc)
+{
+	unsigned int pos, next;
+
+	devc->dev_state = ROLL_CAPTURE;
+	if (devc->samp_received < devc->framesize) {
+		/* The next readout covers these samples as well. */
+		sr_warn("Incomplete readout, got %d/%d samples.",
+			devc->samp_received, devc->framesize);
+		return;
+	}
+
+	pos = devc->roll_pos;
+	next = devc->roll_next;
+	if (next < pos) {
+		/* The ring buffer wrapped around in between. */
+		send_chunk(devc, devc->framebuf + pos * 2,
+			   devc->framesize - pos);
+		devc->roll_samples += devc->framesize - pos;
+		pos = 0;
+	}
+	if (next > pos) {
+		send_chunk(devc, devc->framebuf + pos * 2, next - pos);
+		devc->roll_samples += next - pos;
+	}
+	devc->roll_pos = next;
+
+	if (devc->roll_restart && dso_capture_start(devc) == SR_OK) {
+		sr_dbg("Capture stopped, restarted it.");
+		devc->roll_started = FALSE;
+	}
+}
+
+/* Start the next capture, with the trigger armed. */
+static int arm_capture(struct dev_context *devc)
+{
+	if (dso_capture_start(devc) != SR_OK)
+		return SR_ERR;
+	if (dso_enable_trigger(devc) != SR_OK)
+		return SR_ERR;
+//	if (dso_force_trigger(devc) != SR_OK)
+//		return SR_ERR;
+	sr_dbg("Successfully requested next chunk.");
+
+	return SR_OK;
+}
+
+/* Log the frame rate achieved over roughly the last second. */
+static void report_frame_rate(struct dev_context *devc)
+{
+	int64_t now;
+
+	now = g_get_monotonic_time();
+	if (now - devc->rate_start < G_USEC_PER_SEC)
+		return;
+
+	sr_info("%.1f frames/s.", (double)(devc->num_frames -
+		devc->rate_frames) * G_USEC_PER_SEC / (now - devc->rate_start));
+	devc->rate_start = now;
+	devc->rate_frames = devc->num_frames;
+}
+
+/*
+ * All transfers of a frame are back. Arm the next capture first, so the
+ * scope fills its buffer while this frame's remainder goes out on the
+ * session bus.
+ */
+static void finish_frame(struct dev_context *devc)
+{
+	struct sr_datafeed_packet packet;
+	gboolean last;
+
+	last = devc->limit_frames && devc->num_frames + 1 >= devc->limit_frames;
+	if (last)
+		/* Terminate session */
+		devc->dev_state = STOPPING;
+	else if (arm_capture(devc) == SR_OK)
+		devc->dev_state = CAPTURE;
+	else
+		devc->dev_state = NEW_CAPTURE;
+
+	/* Send the buffered pre-trigger samples out now, in one big chunk. */
+	sr_dbg("End of frame, sending %d pre-trigger buffered samples.",
+	       devc->samp_buffered);
+	if (devc->samp_buffered > 0)
+		send_chunk(devc, devc->framebuf, devc->samp_buffered);
+
+	/* Mark the end of this frame. */
+	packet.type = SR_DF_FRAME_END;
+	sr_session_send(devc->cb_data, &packet);
+
+	devc->num_frames++;
+	report_frame_rate(devc);
 }
 
 static int handle_event(int fd, int revents, void *cb_data)
@@ -736,6 +990,7 @@ static int handle_event(int fd, int revents, void *cb_data)
 	struct dev_context *devc;
 	struct drv_context *drvc = hdi->priv;
 	const struct libusb_pollfd **lupfd;
+	int64_t elapsed, now;
 	int num_probes, i;
 	uint32_t trigger_offset;
 	uint8_t capturestate;
@@ -745,17 +1000,36 @@ static int handle_event(int fd, int revents, void *cb_data)
 
 	sdi = cb_data;
 	devc = sdi->priv;
+
+	now = g_get_monotonic_time();
+	devc->poll_wait = devc->last_poll ? now - devc->last_poll : 0;
+	devc->last_poll = now;
+
+	/* Always handle pending libusb events. */
+	tv.tv_sec = tv.tv_usec = 0;
+	libusb_handle_events_timeout(drvc->sr_ctx->libusb_ctx, &tv);
+
 	if (devc->dev_state == STOPPING) {
 		/* We've been told to wind up the acquisition. */
+		if (devc->submitted_transfers > 0) {
+			/* Have the readout's transfers come back first. */
+			for (i = 0; i < devc->num_transfers; i++)
+				libusb_cancel_transfer(devc->transfers[i]);
+			return TRUE;
+		}
+
 		sr_dbg("Stopping acquisition.");
-		/*
-		 * TODO: Doesn't really cancel pending transfers so they might
-		 * come in after SR_DF_END is sent.
-		 */
 		lupfd = libusb_get_pollfds(drvc->sr_ctx->libusb_ctx);
 		for (i = 0; lupfd[i]; i++)
 			sr_source_remove(lupfd[i]->fd);
 		free(lupfd);
+		dso_free_transfers(devc);
+
+		elapsed = g_get_monotonic_time() - devc->acq_start;
+		if (devc->num_frames > 0 && elapsed > 0)
+			sr_info("Got %" PRIu64 " frames, %.1f frames/s.",
+				devc->num_frames, (double)devc->num_frames *
+				G_USEC_PER_SEC / elapsed);
 
 		packet.type = SR_DF_END;
 		sr_session_send(sdi, &packet);
@@ -765,20 +1039,22 @@ static int handle_event(int fd, int revents, void *cb_data)
 		return TRUE;
 	}
 
-	/* Always handle pending libusb events. */
-	tv.tv_sec = tv.tv_usec = 0;
-	libusb_handle_events_timeout(drvc->sr_ctx->libusb_ctx, &tv);
+	if (devc->dev_state == FRAME_DONE) {
+		finish_frame(devc);
+		return TRUE;
+	}
+
+	if (devc->dev_state == ROLL_DONE)
+		finish_roll(devc);
+	if (devc->dev_state == ROLL_CAPTURE) {
+		roll_poll(devc, now);
+		return TRUE;
+	}
 
 	/* TODO: ugh */
 	if (devc->dev_state == NEW_CAPTURE) {
-		if (dso_capture_start(devc) != SR_OK)
-			return TRUE;
-		if (dso_enable_trigger(devc) != SR_OK)
-			return TRUE;
-//		if (dso_force_trigger(devc) != SR_OK)
-//			return TRUE;
-		sr_dbg("Successfully requested next chunk.");
-		devc->dev_state = CAPTURE;
+		if (arm_capture(devc) == SR_OK)
+			devc->dev_state = CAPTURE;
 		return TRUE;
 	}
 	if (devc->dev_state != CAPTURE)
@@ -793,25 +1069,24 @@ static int handle_event(int fd, int revents, void *cb_data)
 	case CAPTURE_EMPTY:
 		if (++devc->capture_empty_count >= MAX_CAPTURE_EMPTY) {
 			devc->capture_empty_count = 0;
-			if (dso_capture_start(devc) != SR_OK)
-				break;
-			if (dso_enable_trigger(devc) != SR_OK)
-				break;
-//			if (dso_force_trigger(devc) != SR_OK)
-//				break;
-			sr_dbg("Successfully requested next chunk.");
+			arm_capture(devc);
 		}
 		break;
 	case CAPTURE_FILLING:
 		/* No data yet. */
 		break;
 	case CAPTURE_READY_8BIT:
+		/* A failed readout's transfers may still be on their way. */
+		if (devc->submitted_transfers > 0)
+			break;
+
 		/* Remember where in the captured frame the trigger is. */
 		devc->trigger_offset = trigger_offset;
 
 		num_probes = (devc->ch1_enabled && devc->ch2_enabled) ? 2 : 1;
-		/* TODO: Check malloc return value. */
-		devc->framebuf = g_try_malloc(devc->framesize * num_probes * 2);
+		if (framebuf_reserve(devc, devc->framesize * num_probes * 2)
+		    != SR_OK)
+			break;
 		devc->samp_buffered = devc->samp_received = 0;
 
 		/* Tell the scope to send us the first frame. */
@@ -865,13 +1140,34 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 		return SR_ERR;
 	}
 
+	if (devc->roll_mode && devc->timebase < ROLL_MIN_TIMEBASE) {
+		sr_err("Roll mode needs a timebase of at least %" PRIu64
+		       "/%" PRIu64 " s.", timebases[ROLL_MIN_TIMEBASE].p,
+		       timebases[ROLL_MIN_TIMEBASE].q);
+		return SR_ERR_ARG;
+	}
+
 	if (dso_init(devc) != SR_OK)
 		return SR_ERR;
 
 	if (dso_capture_start(devc) != SR_OK)
 		return SR_ERR;
 
-	devc->dev_state = CAPTURE;
+	devc->num_frames = 0;
+	devc->submitted_transfers = 0;
+	devc->acq_start = devc->rate_start = g_get_monotonic_time();
+	devc->rate_frames = 0;
+	devc->last_poll = 0;
+	sr_dev_stats_start(&devc->stats);
+	devc->stats.buffer_size = devc->framebuf_size;
+	/*
+	 * In roll mode the capture is never armed again, so the scope
+	 * keeps writing its ring buffer, which is read out as it fills.
+	 */
+	devc->roll_started = FALSE;
+	devc->roll_samples = 0;
+	devc->roll_last = 0;
+	devc->dev_state = devc->roll_mode ? ROLL_CAPTURE : CAPTURE;
 	lupfd = libusb_get_pollfds(drvc->sr_ctx->libusb_ctx);
 	for (i = 0; lupfd[i]; i++)
 		sr_source_add(lupfd[i]->fd, lupfd[i]->events, TICK,
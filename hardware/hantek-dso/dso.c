@@ -69,7 +69,7 @@ SR_PRIV int dso_getmps(libusb_device *dev)
 	const struct libusb_interface_descriptor *intf_dsc;
 	int mps;
 
-	if (libusb_get_device_descriptor(dev, &des) != 0)
+	if (sr_usb_get_device_descriptor(dev, &des) != 0)
 		return 0;
 
 	if (des.bNumConfigurations != 1)
@@ -117,9 +117,9 @@ SR_PRIV int dso_open(struct sr_dev_inst *sdi)
 		return SR_ERR;
 
 	skip = 0;
-	libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
+	sr_usb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
 	for (i = 0; devlist[i]; i++) {
-		if ((err = libusb_get_device_descriptor(devlist[i], &des))) {
+		if ((err = sr_usb_get_device_descriptor(devlist[i], &des))) {
 			sr_err("Failed to get device descriptor: %s.",
 			       libusb_error_name(err));
 			continue;
@@ -189,6 +189,8 @@ SR_PRIV void dso_close(struct sr_dev_inst *sdi)
 
 	sr_info("Closing device %d on %d.%d interface %d.", sdi->index,
 		devc->usb->bus, devc->usb->address, USB_INTERFACE);
+	/* Their buffer belongs to the device handle. */
+	dso_free_transfers(devc);
 	libusb_release_interface(devc->usb->devhdl, USB_INTERFACE);
 	libusb_close(devc->usb->devhdl);
 	devc->usb->devhdl = NULL;
@@ -707,12 +709,71 @@ SR_PRIV int dso_capture_start(struct dev_context *devc)
 	return SR_OK;
 }
 
-SR_PRIV int dso_get_channeldata(struct dev_context *devc, libusb_transfer_cb_fn cb)
+SR_PRIV void dso_free_transfers(struct dev_context *devc)
+{
+	int i;
+
+	for (i = 0; i < devc->num_transfers; i++)
+		libusb_free_transfer(devc->transfers[i]);
+	sr_usb_buf_free(devc->transfer_buf, devc->transfer_buf_size);
+	devc->transfer_buf = NULL;
+	g_free(devc->transfers);
+	devc->transfers = NULL;
+	devc->num_transfers = 0;
+}
+
+/*
+ * Set up the transfers a frame is read with, once per acquisition. They
+ * share one buffer, which is mapped from usbfs if possible.
+ */
+static int alloc_transfers(struct dev_context *devc, libusb_transfer_cb_fn cb)
 {
 	struct libusb_transfer *transfer;
-	int num_transfers, ret, i;
+	int num_transfers;
+
+	/* TODO: DSO-2xxx only. */
+	num_transfers = devc->framesize *
+			sizeof(unsigned short) / devc->epin_maxpacketsize;
+	if (!(devc->transfers = g_try_malloc0(num_transfers *
+			sizeof(struct libusb_transfer *)))) {
+		sr_err("Failed to malloc transfer list.");
+		return SR_ERR_MALLOC;
+	}
+
+	devc->transfer_buf_size = num_transfers * devc->epin_maxpacketsize;
+	if (!(devc->transfer_buf = sr_usb_buf_alloc(devc->usb,
+			devc->transfer_buf_size))) {
+		sr_err("Failed to malloc USB endpoint buffer.");
+		dso_free_transfers(devc);
+		return SR_ERR_MALLOC;
+	}
+
+	while (devc->num_transfers < num_transfers) {
+		if (!(transfer = libusb_alloc_transfer(0))) {
+			sr_err("Failed to allocate transfer.");
+			dso_free_transfers(devc);
+			return SR_ERR_MALLOC;
+		}
+		libusb_fill_bulk_transfer(transfer, devc->usb->devhdl,
+				DSO_EP_IN | LIBUSB_ENDPOINT_IN,
+				devc->transfer_buf + devc->num_transfers *
+				devc->epin_maxpacketsize,
+				devc->epin_maxpacketsize, cb, devc, 40);
+		devc->transfers[devc->num_transfers++] = transfer;
+	}
+
+	return SR_OK;
+}
+
+SR_PRIV int dso_get_channeldata(struct dev_context *devc, libusb_transfer_cb_fn cb)
+{
+	int ret, i;
 	uint8_t cmdstring[2];
-	unsigned char *buf;
+	gboolean reused;
+
+	reused = devc->transfers != NULL;
+	if (!reused && (ret = alloc_transfers(devc, cb)) != SR_OK)
+		return ret;
 
 	sr_dbg("Sending CMD_GET_CHANNELDATA.");
 
@@ -725,27 +786,21 @@ SR_PRIV int dso_get_channeldata(struct dev_context *devc, libusb_transfer_cb_fn
 		return SR_ERR;
 	}
 
-	/* TODO: DSO-2xxx only. */
-	num_transfers = devc->framesize *
-			sizeof(unsigned short) / devc->epin_maxpacketsize;
-	sr_dbg("Queueing up %d transfers.", num_transfers);
-	for (i = 0; i < num_transfers; i++) {
-		if (!(buf = g_try_malloc(devc->epin_maxpacketsize))) {
-			sr_err("Failed to malloc USB endpoint buffer.");
-			return SR_ERR_MALLOC;
-		}
-		transfer = libusb_alloc_transfer(0);
-		libusb_fill_bulk_transfer(transfer, devc->usb->devhdl,
-				DSO_EP_IN | LIBUSB_ENDPOINT_IN, buf,
-				devc->epin_maxpacketsize, cb, devc, 40);
-		if ((ret = libusb_submit_transfer(transfer)) != 0) {
+	sr_dbg("Queueing up %d transfers.", devc->num_transfers);
+	for (i = 0; i < devc->num_transfers; i++) {
+		/* Frames and roll mode readouts come back to different cbs. */
+		devc->transfers[i]->callback = cb;
+		if ((ret = libusb_submit_transfer(devc->transfers[i])) != 0) {
 			sr_err("Failed to submit transfer: %s.",
 			       libusb_error_name(ret));
-			/* TODO: Free them all. */
-			libusb_free_transfer(transfer);
-			g_free(buf);
+			/* The ones already queued come back cancelled. */
+			while (i--)
+				libusb_cancel_transfer(devc->transfers[i]);
 			return SR_ERR;
 		}
+		devc->submitted_transfers++;
+		if (reused)
+			devc->stats.transfers_resubmitted++;
 	}
 
 	return SR_OK;
@@ -33,6 +33,11 @@
 
 #define MAX_CAPTURE_EMPTY		3
 
+/* Roll mode needs a timebase at least this slow. */
+#define ROLL_MIN_TIMEBASE		TIME_10ms
+/* Roll mode fetches the new samples at most this often (in us). */
+#define ROLL_INTERVAL			50000
+
 #define DEFAULT_VOLTAGE			VDIV_500MV
 #define DEFAULT_FRAMESIZE		FRAMESIZE_SMALL
 #define DEFAULT_TIMEBASE		TIME_100us
@@ -144,6 +149,13 @@ enum states {
 	CAPTURE,
 	FETCH_DATA,
 	STOPPING,
+	FRAME_DONE,
+	/* Roll mode: waiting to fetch the next samples. */
+	ROLL_CAPTURE,
+	/* Roll mode: reading out the device's ring buffer. */
+	ROLL_FETCH,
+	/* Roll mode: the readout is complete. */
+	ROLL_DONE,
 };
 
 struct dso_profile {
@@ -201,6 +213,41 @@ struct dev_context {
 	unsigned int samp_buffered;
 	unsigned int trigger_offset;
 	unsigned char *framebuf;
+	unsigned int framebuf_size;
+	/* Output of send_chunk(), reused once nobody holds it. */
+	struct sr_buffer *chunk_buf;
+	/* The transfers a frame is read with, reused for every frame. */
+	struct libusb_transfer **transfers;
+	int num_transfers;
+	uint8_t *transfer_buf;
+	size_t transfer_buf_size;
+	int submitted_transfers;
+	/* Health and throughput counters, see sr_dev_stats_get(). */
+	struct sr_dev_stats stats;
+	/* Since when handle_event() last ran, and for how long before. */
+	int64_t last_poll;
+	uint64_t poll_wait;
+
+	/* Frame rate reporting. */
+	int64_t acq_start;
+	int64_t rate_start;
+	uint64_t rate_frames;
+
+	/*
+	 * Roll mode: the capture runs on, and each readout of the ring
+	 * buffer sends what was written between 'roll_pos' and 'roll_next',
+	 * the write positions at the last and the current readout.
+	 */
+	gboolean roll_mode;
+	gboolean roll_started;
+	gboolean roll_restart;
+	unsigned int roll_pos;
+	unsigned int roll_next;
+	/* Samples sent so far, and since when. */
+	uint64_t roll_samples;
+	int64_t roll_start;
+	/* When the last readout was started. */
+	int64_t roll_last;
 };
 
 SR_PRIV int dso_open(struct sr_dev_inst *sdi);
@@ -211,6 +258,7 @@ SR_PRIV int dso_init(struct dev_context *devc);
 SR_PRIV int dso_get_capturestate(struct dev_context *devc,
 		uint8_t *capturestate, uint32_t *trigger_offset);
 SR_PRIV int dso_capture_start(struct dev_context *devc);
+SR_PRIV void dso_free_transfers(struct dev_context *devc);
 SR_PRIV int dso_get_channeldata(struct dev_context *devc,
 		libusb_transfer_cb_fn cb);
 
@@ -17,13 +17,15 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
+#include <inttypes.h>
+#include <sys/time.h>
 #include <glib.h>
 #include <libusb.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 #include "protocol.h"
 
-SR_PRIV struct sr_dev_inst *lascar_scan(int bus, int address);
 SR_PRIV struct sr_dev_driver lascar_el_usb_driver_info;
 static struct sr_dev_driver *di = &lascar_el_usb_driver_info;
 static int hw_dev_close(struct sr_dev_inst *sdi);
@@ -133,12 +135,8 @@ static GSList *hw_scan(GSList *options)
 				g_free(usb);
 				continue;
 			}
-			if (!(devc = g_try_malloc0(sizeof(struct dev_context)))) {
-				sr_err("Device context malloc failed.");
-				return NULL;
-			}
+			devc = sdi->priv;
 			devc->usb = usb;
-			sdi->priv = devc;
 			if (!(probe = sr_probe_new(0, SR_PROBE_ANALOG, TRUE, "P1")))
 				return NULL;
 			sdi->probes = g_slist_append(sdi->probes, probe);
@@ -163,23 +161,58 @@ static GSList *hw_dev_list(void)
 
 static int hw_dev_open(struct sr_dev_inst *sdi)
 {
-	/* TODO */
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	int ret;
+
+	if (!(drvc = di->priv)) {
+		sr_err("Driver was not initialized.");
+		return SR_ERR;
+	}
+
+	devc = sdi->priv;
+	if (sr_usb_open(drvc->sr_ctx->libusb_ctx, devc->usb) != SR_OK)
+		return SR_ERR;
+
+	if ((ret = libusb_claim_interface(devc->usb->devhdl,
+			LASCAR_INTERFACE))) {
+		sr_err("Failed to claim interface: %s.", libusb_error_name(ret));
+		libusb_close(devc->usb->devhdl);
+		devc->usb->devhdl = NULL;
+		return SR_ERR;
+	}
+	sdi->status = SR_ST_ACTIVE;
 
 	return SR_OK;
 }
 
 static int hw_dev_close(struct sr_dev_inst *sdi)
 {
-	/* TODO */
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+	if (!devc->usb || !devc->usb->devhdl)
+		/* Nothing to do. */
+		return SR_OK;
+
+	libusb_release_interface(devc->usb->devhdl, LASCAR_INTERFACE);
+	libusb_close(devc->usb->devhdl);
+	devc->usb->devhdl = NULL;
+	sdi->status = SR_ST_INACTIVE;
 
 	return SR_OK;
 }
 
 static int hw_cleanup(void)
 {
-	clear_instances();
+	struct drv_context *drvc;
 
-	/* TODO */
+	if (!(drvc = di->priv))
+		return SR_OK;
+
+	clear_instances();
+	g_free(drvc);
+	di->priv = NULL;
 
 	return SR_OK;
 }
@@ -187,8 +220,21 @@ static int hw_cleanup(void)
 static int hw_info_get(int info_id, const void **data,
 		const struct sr_dev_inst *sdi)
 {
+	(void)sdi;
+
 	switch (info_id) {
-	/* TODO */
+	case SR_DI_HWOPTS:
+		*data = hwopts;
+		break;
+	case SR_DI_HWCAPS:
+		*data = hwcaps;
+		break;
+	case SR_DI_NUM_PROBES:
+		*data = GINT_TO_POINTER(1);
+		break;
+	case SR_DI_PROBE_NAMES:
+		*data = probe_names;
+		break;
 	default:
 		sr_err("Unknown info_id: %d.", info_id);
 		return SR_ERR_ARG;
@@ -200,6 +246,7 @@ static int hw_info_get(int info_id, const void **data,
 static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 		const void *value)
 {
+	struct dev_context *devc;
 	int ret;
 
 	if (sdi->status != SR_ST_ACTIVE) {
@@ -207,9 +254,14 @@ static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 		return SR_ERR;
 	}
 
+	devc = sdi->priv;
 	ret = SR_OK;
 	switch (hwcap) {
-	/* TODO */
+	case SR_HWCAP_LIMIT_SAMPLES:
+		devc->limit_samples = *(const uint64_t *)value;
+		sr_dbg("Setting sample limit to %" PRIu64 ".",
+		       devc->limit_samples);
+		break;
 	default:
 		sr_err("Unknown hardware capability: %d.", hwcap);
 		ret = SR_ERR_ARG;
@@ -221,21 +273,77 @@ static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 		void *cb_data)
 {
-	/* TODO */
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_header header;
+	struct sr_datafeed_meta_analog meta;
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	const struct libusb_pollfd **lupfd;
+	int ret, i;
+
+	if (!(drvc = di->priv)) {
+		sr_err("Driver was not initialized.");
+		return SR_ERR;
+	}
+
+	if (sdi->status != SR_ST_ACTIVE) {
+		sr_err("Device inactive, can't start acquisition.");
+		return SR_ERR;
+	}
+
+	devc = sdi->priv;
+	devc->cb_data = cb_data;
+	devc->num_samples = 0;
+
+	/* The download is driven from the libusb events alone. */
+	if ((ret = lascar_start_download((struct sr_dev_inst *)sdi)) != SR_OK)
+		return ret;
+
+	/* Send header packet to the session bus. */
+	packet.type = SR_DF_HEADER;
+	packet.payload = (uint8_t *)&header;
+	header.feed_version = 1;
+	gettimeofday(&header.starttime, NULL);
+	sr_session_send(devc->cb_data, &packet);
+
+	/* Send metadata about the SR_DF_ANALOG packets to come. */
+	packet.type = SR_DF_META_ANALOG;
+	packet.payload = &meta;
+	meta.num_probes = 1;
+	sr_session_send(devc->cb_data, &packet);
+
+	lupfd = libusb_get_pollfds(drvc->sr_ctx->libusb_ctx);
+	for (i = 0; lupfd[i] && i < 9; i++) {
+		sr_source_add(lupfd[i]->fd, lupfd[i]->events, 100,
+			      lascar_el_usb_receive_data, (void *)sdi);
+		devc->usbfd[i] = lupfd[i]->fd;
+	}
+	devc->usbfd[i] = -1;
+	free(lupfd);
+	devc->running = TRUE;
 
 	return SR_OK;
 }
 
 static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi, void *cb_data)
 {
+	struct dev_context *devc;
+
 	(void)cb_data;
 
+	devc = sdi->priv;
+
+	/* The download may have finished, and the acquisition with it. */
+	if (devc && !devc->running)
+		return SR_OK;
+
 	if (sdi->status != SR_ST_ACTIVE) {
 		sr_err("Device inactive, can't stop acquisition.");
 		return SR_ERR;
 	}
 
-	/* TODO */
+	/* lascar_el_usb_receive_data() cancels the download. */
+	sdi->status = SR_ST_STOPPING;
 
 	return SR_OK;
 }
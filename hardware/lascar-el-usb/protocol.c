@@ -26,9 +26,6 @@
 #include "protocol.h"
 
 #define LASCAR_VENDOR "Lascar"
-#define LASCAR_INTERFACE 0
-#define LASCAR_EP_IN 0x82
-#define LASCAR_EP_OUT 2
 /* Max 100ms for a device to positively identify. */
 #define SCAN_TIMEOUT 100000
 
@@ -61,23 +58,292 @@ static const struct elusb_profile profiles[] = {
 };
 
 
-static void scan_xfer(struct libusb_transfer *xfer)
+/* Timeout of a read while flushing the device's queue (in ms). */
+#define FLUSH_TIMEOUT 5
+/* Timeout of the transfers of an exchange (in ms). */
+#define XFER_TIMEOUT 1000
+/* The longest configuration structure a device may send. */
+#define CONFIG_MAX_SIZE 256
+/* The longest log memory a device may send. */
+#define LOG_MAX_SIZE 65535
+
+static void exchange_finish(struct lascar_exchange *ex, int state)
 {
+	if (ex->state == LASCAR_DONE || ex->state == LASCAR_FAILED)
+		return;
+
+	ex->state = state;
+	if (state == LASCAR_FAILED)
+		lascar_exchange_cancel(ex);
+	ex->completed = 1;
+	if (ex->cb)
+		ex->cb(ex);
+}
 
-	xfer->user_data = GINT_TO_POINTER(1);
+static int exchange_submit(struct lascar_exchange *ex,
+		struct libusb_transfer *xfer)
+{
+	int ret;
+
+	if ((ret = libusb_submit_transfer(xfer)) != 0) {
+		sr_dbg("Failed to submit transfer: %s.",
+		       libusb_error_name(ret));
+		exchange_finish(ex, LASCAR_FAILED);
+		return SR_ERR;
+	}
+	ex->pending++;
 
+	return SR_OK;
+}
+
+static void exchange_in_cb(struct libusb_transfer *xfer);
+
+/* Read the rest of the block in one transfer, as large as it is. */
+static void exchange_read_body(struct lascar_exchange *ex)
+{
+	libusb_fill_bulk_transfer(ex->xfer_in, ex->hdl, LASCAR_EP_IN,
+			ex->buf + ex->received, ex->size - ex->received,
+			exchange_in_cb, ex, XFER_TIMEOUT);
+	exchange_submit(ex, ex->xfer_in);
+}
+
+/* The reply's header arrived: 'type', then the length of the block. */
+static void exchange_header(struct lascar_exchange *ex, int length)
+{
+	if (length != 3) {
+		sr_dbg("Expected 3-byte header, got %d bytes.", length);
+		exchange_finish(ex, LASCAR_FAILED);
+		return;
+	}
+
+	sr_spew("Reply header: 0x%.2x 0x%.2x 0x%.2x.", ex->header[0],
+		ex->header[1], ex->header[2]);
+	ex->size = ex->header[1] | (ex->header[2] << 8);
+	if (ex->header[0] != ex->type || ex->size > ex->max_size) {
+		sr_dbg("Invalid reply header: 0x%.2x 0x%.2x 0x%.2x.",
+		       ex->header[0], ex->header[1], ex->header[2]);
+		exchange_finish(ex, LASCAR_FAILED);
+		return;
+	}
+
+	if (ex->size == 0) {
+		exchange_finish(ex, LASCAR_DONE);
+		return;
+	}
+
+	if (!(ex->buf = g_try_malloc(ex->size))) {
+		sr_err("Block malloc failed.");
+		exchange_finish(ex, LASCAR_FAILED);
+		return;
+	}
+	ex->state = LASCAR_BODY;
+	exchange_read_body(ex);
+}
+
+static void exchange_in_cb(struct libusb_transfer *xfer)
+{
+	struct lascar_exchange *ex;
+
+	ex = xfer->user_data;
+	ex->pending--;
+	if (ex->state == LASCAR_FAILED || ex->state == LASCAR_DONE)
+		return;
+
+	switch (ex->state) {
+	case LASCAR_FLUSH:
+		if (xfer->status == LIBUSB_TRANSFER_COMPLETED &&
+		    xfer->actual_length > 0) {
+			/* Stale data, there may be more of it. */
+			exchange_submit(ex, xfer);
+			break;
+		}
+		/*
+		 * Nothing left: send the command, with a read request
+		 * waiting in the wings, ready to pounce the moment the
+		 * device replies.
+		 */
+		ex->state = LASCAR_HEADER;
+		libusb_fill_bulk_transfer(xfer, ex->hdl, LASCAR_EP_IN,
+				ex->header, sizeof(ex->header), exchange_in_cb,
+				ex, XFER_TIMEOUT);
+		if (exchange_submit(ex, xfer) == SR_OK)
+			exchange_submit(ex, ex->xfer_out);
+		break;
+	case LASCAR_HEADER:
+		if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+			sr_dbg("No reply to command 0x%.2x.", ex->cmd[0]);
+			exchange_finish(ex, LASCAR_FAILED);
+			break;
+		}
+		exchange_header(ex, xfer->actual_length);
+		break;
+	case LASCAR_BODY:
+		ex->received += xfer->actual_length;
+		if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+			sr_dbg("Block read failed after %d of %d bytes.",
+			       ex->received, ex->size);
+			exchange_finish(ex, LASCAR_FAILED);
+		} else if (ex->received >= ex->size) {
+			exchange_finish(ex, LASCAR_DONE);
+		} else {
+			exchange_read_body(ex);
+		}
+		break;
+	}
+}
+
+static void exchange_out_cb(struct libusb_transfer *xfer)
+{
+	struct lascar_exchange *ex;
+
+	ex = xfer->user_data;
+	ex->pending--;
+	if (xfer->status != LIBUSB_TRANSFER_COMPLETED &&
+	    ex->state != LASCAR_FAILED && ex->state != LASCAR_DONE) {
+		sr_dbg("Failed to send command 0x%.2x.", ex->cmd[0]);
+		exchange_finish(ex, LASCAR_FAILED);
+	}
+}
+
+/**
+ * Prepare an exchange with the device.
+ *
+ * @param hdl The device's handle, with its interface claimed.
+ * @param cmd The command byte.
+ * @param type The header type the reply must have.
+ * @param max_size The longest block accepted.
+ * @param cb Called once the exchange is done, or failed. May be NULL.
+ * @param cb_data Opaque pointer kept in the exchange.
+ *
+ * @return The new exchange, or NULL upon memory allocation errors.
+ */
+SR_PRIV struct lascar_exchange *lascar_exchange_new(
+		libusb_device_handle *hdl, unsigned char cmd,
+		unsigned char type, int max_size, lascar_exchange_cb cb,
+		void *cb_data)
+{
+	struct lascar_exchange *ex;
+
+	if (!(ex = g_try_malloc0(sizeof(struct lascar_exchange)))) {
+		sr_err("Exchange malloc failed.");
+		return NULL;
+	}
+
+	if (!(ex->xfer_in = libusb_alloc_transfer(0)) ||
+	    !(ex->xfer_out = libusb_alloc_transfer(0))) {
+		sr_err("Transfer malloc failed.");
+		lascar_exchange_free(ex);
+		return NULL;
+	}
+
+	ex->hdl = hdl;
+	ex->cmd[0] = cmd;
+	ex->cmd[1] = 0xff;
+	ex->cmd[2] = 0xff;
+	ex->type = type;
+	ex->max_size = max_size;
+	ex->cb = cb;
+	ex->cb_data = cb_data;
+	libusb_fill_bulk_transfer(ex->xfer_out, hdl, LASCAR_EP_OUT, ex->cmd,
+			sizeof(ex->cmd), exchange_out_cb, ex, XFER_TIMEOUT);
+
+	return ex;
+}
+
+/**
+ * Start an exchange. First, anything the device (an SiLabs F321) still
+ * has queued is read and discarded; then the command is sent, and the
+ * reply read. Everything happens in the transfers' callbacks, so this
+ * returns right away.
+ *
+ * @param ex The exchange.
+ *
+ * @return SR_OK upon success, SR_ERR if the first transfer couldn't be
+ *         submitted (the callback isn't called then).
+ */
+SR_PRIV int lascar_exchange_start(struct lascar_exchange *ex)
+{
+	int ret;
+
+	ex->state = LASCAR_FLUSH;
+	libusb_fill_bulk_transfer(ex->xfer_in, ex->hdl, LASCAR_EP_IN,
+			ex->header, sizeof(ex->header), exchange_in_cb, ex,
+			FLUSH_TIMEOUT);
+	if ((ret = libusb_submit_transfer(ex->xfer_in)) != 0) {
+		sr_err("Failed to submit transfer: %s.",
+		       libusb_error_name(ret));
+		return SR_ERR;
+	}
+	ex->pending++;
+
+	return SR_OK;
+}
+
+/**
+ * Cancel an exchange's transfers. It must not be freed before its
+ * 'pending' count drops to 0, once the libusb events for the cancelled
+ * transfers have been handled.
+ *
+ * @param ex The exchange.
+ */
+SR_PRIV void lascar_exchange_cancel(struct lascar_exchange *ex)
+{
+	if (ex->state != LASCAR_DONE)
+		ex->state = LASCAR_FAILED;
+	ex->completed = 1;
+	if (!ex->pending)
+		return;
+
+	libusb_cancel_transfer(ex->xfer_in);
+	libusb_cancel_transfer(ex->xfer_out);
+}
+
+/**
+ * Free an exchange, which has no transfers pending.
+ *
+ * @param ex The exchange. May be NULL.
+ */
+SR_PRIV void lascar_exchange_free(struct lascar_exchange *ex)
+{
+	if (!ex)
+		return;
+
+	libusb_free_transfer(ex->xfer_in);
+	libusb_free_transfer(ex->xfer_out);
+	g_free(ex->buf);
+	g_free(ex);
+}
+
+/*
+ * Handle the libusb events until the exchange finished, or the deadline
+ * passed. Nothing sleeps: libusb waits for the transfers themselves.
+ */
+static void exchange_wait(libusb_context *ctx, struct lascar_exchange *ex,
+		int64_t deadline)
+{
+	struct timeval tv;
+	int64_t left;
+
+	while (!ex->completed) {
+		if ((left = deadline - g_get_monotonic_time()) <= 0)
+			break;
+		tv.tv_sec = left / 1000000;
+		tv.tv_usec = left % 1000000;
+		libusb_handle_events_timeout_completed(ctx, &tv,
+				&ex->completed);
+	}
 }
 
 static struct sr_dev_inst *lascar_identify(libusb_device_handle *dev_hdl)
 {
 	struct drv_context *drvc;
+	struct dev_context *devc;
 	const struct elusb_profile *profile;
 	struct sr_dev_inst *sdi;
-	struct libusb_transfer *xfer_in, *xfer_out;
+	struct lascar_exchange *ex;
 	struct timeval tv;
-	int64_t start;
-	int modelid, buflen, i;
-	unsigned char cmd[3], buf[256];
+	int modelid, serial, i;
+	unsigned char buf[CONFIG_MAX_SIZE];
 	char firmware[5];
 
 	drvc = di->priv;
@@ -92,102 +358,31 @@ static struct sr_dev_inst *lascar_identify(libusb_device_handle *dev_hdl)
 	libusb_control_transfer(dev_hdl, LIBUSB_REQUEST_TYPE_VENDOR,
 			0x02, 0x0001, 0x00, buf, 0, 50);
 
-	if (!(xfer_in = libusb_alloc_transfer(0)) ||
-			!(xfer_out = libusb_alloc_transfer(0)))
-		return 0;
-
-	/* Flush anything the F321 still has queued. */
-	while (libusb_bulk_transfer(dev_hdl, LASCAR_EP_IN, buf, 256, &buflen,
-			5) == 0 && buflen > 0)
-		;
-
-	/* Keep a read request waiting in the wings, ready to pounce
-	 * the moment the device sends something. */
-	libusb_fill_bulk_transfer(xfer_in, dev_hdl, LASCAR_EP_IN,
-			buf, 256, scan_xfer, 0, 10000);
-	if (libusb_submit_transfer(xfer_in) != 0)
-		goto cleanup;
-
 	/* Request device configuration structure. */
-	cmd[0] = 0x00;
-	cmd[1] = 0xff;
-	cmd[2] = 0xff;
-	libusb_fill_bulk_transfer(xfer_out, dev_hdl, LASCAR_EP_OUT,
-			cmd, 3, scan_xfer, 0, 100);
-	if (libusb_submit_transfer(xfer_out) != 0)
-		goto cleanup;
-
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
-	start = g_get_monotonic_time();
-	while (!xfer_in->user_data || !xfer_out->user_data) {
-		if (g_get_monotonic_time() - start > SCAN_TIMEOUT) {
-			start = 0;
-			break;
-		}
-		g_usleep(5000);
-		libusb_handle_events_timeout(drvc->sr_ctx->libusb_ctx, &tv);
-	}
-	if (!start) {
-		sr_dbg("no response");
-		goto cleanup;
-	}
-	if (xfer_in->actual_length != 3) {
-		sr_dbg("expected 3-byte header, got %d bytes", xfer_in->actual_length);
-		goto cleanup;
+	if (!(ex = lascar_exchange_new(dev_hdl, 0x00, 0x02, CONFIG_MAX_SIZE,
+			NULL, NULL)))
+		return NULL;
+	if (lascar_exchange_start(ex) == SR_OK)
+		exchange_wait(drvc->sr_ctx->libusb_ctx, ex,
+			      g_get_monotonic_time() + SCAN_TIMEOUT);
+
+	if (ex->state == LASCAR_DONE && ex->size > 53) {
+		memcpy(buf, ex->buf, ex->size);
+		modelid = buf[0];
+	} else if (ex->state == LASCAR_DONE) {
+		sr_dbg("Configuration structure too short (%d bytes).",
+		       ex->size);
+	} else {
+		sr_dbg("No configuration structure.");
 	}
 
-	/* Got configuration structure header. */
-	sr_spew("response to config request: 0x%.2x 0x%.2x 0x%.2x ",
-			buf[0], buf[1], buf[2]);
-	buflen = buf[1] | (buf[2] << 8);
-	if (buf[0] != 0x02 || buflen > 256) {
-		sr_dbg("Invalid response to config request: "
-				"0x%.2x 0x%.2x 0x%.2x ", buf[0], buf[1], buf[2]);
-		libusb_close(dev_hdl);
-		goto cleanup;
-	}
-
-	/* Get configuration structure. */
-	xfer_in->length = buflen;
-	xfer_in->user_data = 0;
-	if (libusb_submit_transfer(xfer_in) != 0)
-		goto cleanup;
-	while (!xfer_in->user_data) {
-		if (g_get_monotonic_time() - start > SCAN_TIMEOUT) {
-			start = 0;
-			break;
-		}
-		g_usleep(5000);
+	/* The cancelled transfers complete right away. */
+	lascar_exchange_cancel(ex);
+	tv.tv_sec = 0;
+	tv.tv_usec = 10000;
+	while (ex->pending)
 		libusb_handle_events_timeout(drvc->sr_ctx->libusb_ctx, &tv);
-	}
-	if (!start) {
-		sr_dbg("Timeout waiting for configuration structure.");
-		goto cleanup;
-	}
-	if (xfer_in->actual_length != buflen) {
-		sr_dbg("expected %d-byte structure, got %d bytes", buflen,
-				xfer_in->actual_length);
-		goto cleanup;
-	}
-	modelid = buf[0];
-
-cleanup:
-	if (!xfer_in->user_data || !xfer_in->user_data) {
-		if (!xfer_in->user_data)
-			libusb_cancel_transfer(xfer_in);
-		if (!xfer_out->user_data)
-			libusb_cancel_transfer(xfer_out);
-		start = g_get_monotonic_time();
-		while (!xfer_in->user_data || !xfer_out->user_data) {
-			if (g_get_monotonic_time() - start > 10000)
-				break;
-			g_usleep(1000);
-			libusb_handle_events_timeout(drvc->sr_ctx->libusb_ctx, &tv);
-		}
-	}
-	libusb_free_transfer(xfer_in);
-	libusb_free_transfer(xfer_out);
+	lascar_exchange_free(ex);
 
 	sdi = NULL;
 	if (modelid) {
@@ -203,21 +398,30 @@ cleanup:
 			return NULL;
 		}
 
-		i = buf[52] | (buf[53] << 8);
+		serial = buf[52] | (buf[53] << 8);
 		memcpy(firmware, buf + 0x30, 4);
 		firmware[4] = '\0';
 		sr_dbg("found %s with firmware version %s serial %d",
-				profile->modelname, firmware, i);
+				profile->modelname, firmware, serial);
 
 		if (profile->logformat == LOG_UNSUPPORTED) {
 			sr_dbg("unsupported EL-USB logformat for %s", profile->modelname);
 			return NULL;
 		}
 
+		if (!(devc = g_try_malloc0(sizeof(struct dev_context)))) {
+			sr_err("Device context malloc failed.");
+			return NULL;
+		}
+		devc->profile = profile;
+
 		if (!(sdi = sr_dev_inst_new(0, SR_ST_INACTIVE, LASCAR_VENDOR,
-				profile->modelname, firmware)))
+				profile->modelname, firmware))) {
+			g_free(devc);
 			return NULL;
+		}
 		sdi->driver = di;
+		sdi->priv = devc;
 	}
 
 	return sdi;
@@ -235,9 +439,9 @@ SR_PRIV struct sr_dev_inst *lascar_scan(int bus, int address)
 	drvc = di->priv;
 	sdi = NULL;
 
-	libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
+	sr_usb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
 	for (i = 0; devlist[i]; i++) {
-		if ((ret = libusb_get_device_descriptor(devlist[i], &des))) {
+		if ((ret = sr_usb_get_device_descriptor(devlist[i], &des))) {
 			sr_err("Failed to get device descriptor: %d.", ret);
 			continue;
 		}
@@ -260,10 +464,118 @@ SR_PRIV struct sr_dev_inst *lascar_scan(int bus, int address)
 }
 
 
+/* Send the samples of an EL-USB-2 log: a temperature and RH byte each. */
+static void send_temp_rh(const struct sr_dev_inst *sdi, const uint8_t *buf,
+		int num_samples)
+{
+	struct dev_context *devc;
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_analog analog;
+	float *temp, *rh;
+	int i;
+
+	devc = sdi->priv;
+	if (!(temp = g_try_malloc(sizeof(float) * num_samples * 2))) {
+		sr_err("Sample buffer malloc failed.");
+		return;
+	}
+	rh = temp + num_samples;
+
+	for (i = 0; i < num_samples; i++) {
+		/* Both are stored in half-unit increments, -40 based. */
+		temp[i] = buf[i * 2] / 2.0 - 40;
+		rh[i] = buf[i * 2 + 1] / 2.0;
+	}
+
+	packet.type = SR_DF_ANALOG;
+	packet.payload = &analog;
+	memset(&analog, 0, sizeof(struct sr_datafeed_analog));
+	analog.num_samples = num_samples;
+	analog.mq = SR_MQ_TEMPERATURE;
+	analog.unit = SR_UNIT_CELSIUS;
+	analog.data = temp;
+	sr_session_send(devc->cb_data, &packet);
+
+	analog.mq = SR_MQ_RELATIVE_HUMIDITY;
+	analog.unit = SR_UNIT_PERCENTAGE;
+	analog.data = rh;
+	sr_session_send(devc->cb_data, &packet);
+
+	g_free(temp);
+}
+
+static void download_done(struct lascar_exchange *ex)
+{
+	struct sr_dev_inst *sdi;
+	struct dev_context *devc;
+	uint64_t num_samples;
+
+	sdi = ex->cb_data;
+	devc = sdi->priv;
+
+	if (ex->state == LASCAR_DONE) {
+		sr_dbg("Downloaded %d bytes of log memory.", ex->size);
+		num_samples = ex->size / 2;
+		if (devc->limit_samples)
+			num_samples = MIN(num_samples, devc->limit_samples);
+		if (num_samples)
+			send_temp_rh(sdi, ex->buf, num_samples);
+		devc->num_samples = num_samples;
+	} else if (sdi->status == SR_ST_ACTIVE) {
+		sr_err("Failed to download the log memory.");
+	}
+
+	/* Nothing more to come; lascar_el_usb_receive_data() wraps up. */
+	sdi->status = SR_ST_STOPPING;
+}
+
+/**
+ * Start downloading the device's log memory, as part of the acquisition.
+ * The download runs in the session's libusb event handling (see
+ * lascar_el_usb_receive_data()), which sends the samples and ends the
+ * acquisition once it is done.
+ *
+ * @param sdi The device instance, opened.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation
+ *         errors, SR_ERR upon other errors.
+ */
+SR_PRIV int lascar_start_download(struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+
+	if (devc->profile->logformat != LOG_TEMP_RH) {
+		sr_err("Downloading %s logs is not supported yet.",
+		       devc->profile->modelname);
+		return SR_ERR;
+	}
+
+	if (!(devc->download = lascar_exchange_new(devc->usb->devhdl, 0x03,
+			0x00, LOG_MAX_SIZE, download_done, sdi)))
+		return SR_ERR_MALLOC;
+
+	if (lascar_exchange_start(devc->download) != SR_OK) {
+		lascar_exchange_free(devc->download);
+		devc->download = NULL;
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
 SR_PRIV int lascar_el_usb_receive_data(int fd, int revents, void *cb_data)
 {
-	const struct sr_dev_inst *sdi;
+	struct drv_context *drvc;
+	struct sr_dev_inst *sdi;
 	struct dev_context *devc;
+	struct sr_datafeed_packet packet;
+	struct timeval tv;
+	int i;
+
+	(void)fd;
+	(void)revents;
 
 	if (!(sdi = cb_data))
 		return TRUE;
@@ -271,9 +583,31 @@ SR_PRIV int lascar_el_usb_receive_data(int fd, int revents, void *cb_data)
 	if (!(devc = sdi->priv))
 		return TRUE;
 
-	if (revents == G_IO_IN) {
-		/* TODO */
+	drvc = di->priv;
+	tv.tv_sec = tv.tv_usec = 0;
+	libusb_handle_events_timeout_completed(drvc->sr_ctx->libusb_ctx, &tv,
+			NULL);
+
+	if (sdi->status != SR_ST_STOPPING)
+		return TRUE;
+
+	/* Stopped, or done: wait for the cancelled transfers to finish. */
+	if (devc->download) {
+		lascar_exchange_cancel(devc->download);
+		if (devc->download->pending)
+			return TRUE;
+		lascar_exchange_free(devc->download);
+		devc->download = NULL;
 	}
 
+	for (i = 0; devc->usbfd[i] != -1; i++)
+		sr_source_remove(devc->usbfd[i]);
+
+	packet.type = SR_DF_END;
+	packet.payload = NULL;
+	sr_session_send(devc->cb_data, &packet);
+	sdi->status = SR_ST_ACTIVE;
+	devc->running = FALSE;
+
 	return TRUE;
 }
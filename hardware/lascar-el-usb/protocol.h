@@ -27,11 +27,10 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "lascar-el-usb: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
+
+#define LASCAR_INTERFACE 0
+#define LASCAR_EP_IN 0x82
+#define LASCAR_EP_OUT 2
 
 /** Private, per-device-instance driver context. */
 struct dev_context {
@@ -51,6 +50,61 @@ struct dev_context {
 	const struct elusb_profile *profile;
 	/* Only requires 3 really. */
 	int usbfd[10];
+
+	/** The log memory download, while the acquisition runs. */
+	struct lascar_exchange *download;
+
+	/** Whether an acquisition runs, i.e. SR_DF_END is yet to be sent. */
+	gboolean running;
+};
+
+/** States of a lascar_exchange. */
+enum {
+	/** Reading whatever the device still has queued, and discarding it. */
+	LASCAR_FLUSH,
+	/** The command was sent, waiting for the reply's header. */
+	LASCAR_HEADER,
+	/** Reading the block announced by the header. */
+	LASCAR_BODY,
+	/** The whole block was received. */
+	LASCAR_DONE,
+	/** An error occurred, or the exchange was cancelled. */
+	LASCAR_FAILED,
+};
+
+struct lascar_exchange;
+
+/** Called once an exchange reaches LASCAR_DONE or LASCAR_FAILED. */
+typedef void (*lascar_exchange_cb)(struct lascar_exchange *ex);
+
+/**
+ * One command sent to the device, and the block it replies with: a
+ * 3-byte header (type, little endian length), then the block itself.
+ *
+ * The exchange is a state machine driven entirely by the completion of
+ * its asynchronous transfers, i.e. by whoever handles the libusb events.
+ */
+struct lascar_exchange {
+	int state;
+	libusb_device_handle *hdl;
+	struct libusb_transfer *xfer_in;
+	struct libusb_transfer *xfer_out;
+	unsigned char cmd[3];
+	/** The header type the reply must have. */
+	unsigned char type;
+	/** The longest block accepted. */
+	int max_size;
+	unsigned char header[256];
+	/** The block, 'size' bytes of which have been announced. */
+	unsigned char *buf;
+	int size;
+	int received;
+	/** Transfers submitted and not completed yet. */
+	int pending;
+	/** Set once the exchange is finished (for libusb_handle_events). */
+	int completed;
+	lascar_exchange_cb cb;
+	void *cb_data;
 };
 
 enum {
@@ -59,12 +113,22 @@ enum {
 	LOG_CO,
 };
 
+
 struct elusb_profile {
 	int modelid;
 	char *modelname;
 	int logformat;
 };
 
+SR_PRIV struct sr_dev_inst *lascar_scan(int bus, int address);
+SR_PRIV struct lascar_exchange *lascar_exchange_new(
+		libusb_device_handle *hdl, unsigned char cmd,
+		unsigned char type, int max_size, lascar_exchange_cb cb,
+		void *cb_data);
+SR_PRIV int lascar_exchange_start(struct lascar_exchange *ex);
+SR_PRIV void lascar_exchange_cancel(struct lascar_exchange *ex);
+SR_PRIV void lascar_exchange_free(struct lascar_exchange *ex);
+SR_PRIV int lascar_start_download(struct sr_dev_inst *sdi);
 SR_PRIV int lascar_el_usb_receive_data(int fd, int revents, void *cb_data);
 
 #endif
@@ -96,18 +96,21 @@ static const struct sr_samplerates samplerates = {
 	supported_samplerates,
 };
 
-static GSList *dev_insts = NULL;
+SR_PRIV struct sr_dev_driver link_mso19_driver_info;
+static struct sr_dev_driver *di = &link_mso19_driver_info;
+
+static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi, void *cb_data);
 
 static int mso_send_control_message(struct sr_dev_inst *sdi,
 				    uint16_t payload[], int n)
 {
-	int fd = sdi->serial->fd;
+	struct dev_context *devc = sdi->priv;
 	int i, w, ret, s = n * 2 + sizeof(mso_head) + sizeof(mso_foot);
 	char *p, *buf;
 
 	ret = SR_ERR;
 
-	if (fd < 0)
+	if (devc->serial->fd < 0)
 		goto ret;
 
 	if (!(buf = g_try_malloc(s))) {
@@ -128,7 +131,7 @@ static int mso_send_control_message(struct sr_dev_inst *sdi,
 
 	w = 0;
 	while (w < s) {
-		ret = serial_write(fd, buf + w, s - w);
+		ret = serial_write(devc->serial, buf + w, s - w);
 		if (ret < 0) {
 			ret = SR_ERR;
 			goto free;
@@ -144,12 +147,12 @@ ret:
 
 static int mso_reset_adc(struct sr_dev_inst *sdi)
 {
-	struct context *ctx = sdi->priv;
+	struct dev_context *devc = sdi->priv;
 	uint16_t ops[2];
 
-	ops[0] = mso_trans(REG_CTL1, (ctx->ctlbase1 | BIT_CTL1_RESETADC));
-	ops[1] = mso_trans(REG_CTL1, ctx->ctlbase1);
-	ctx->ctlbase1 |= BIT_CTL1_ADC_UNKNOWN4;
+	ops[0] = mso_trans(REG_CTL1, (devc->ctlbase1 | BIT_CTL1_RESETADC));
+	ops[1] = mso_trans(REG_CTL1, devc->ctlbase1);
+	devc->ctlbase1 |= BIT_CTL1_ADC_UNKNOWN4;
 
 	sr_dbg("Requesting ADC reset.");
 	return mso_send_control_message(sdi, ARRAY_AND_SIZE(ops));
@@ -157,11 +160,11 @@ static int mso_reset_adc(struct sr_dev_inst *sdi)
 
 static int mso_reset_fsm(struct sr_dev_inst *sdi)
 {
-	struct context *ctx = sdi->priv;
+	struct dev_context *devc = sdi->priv;
 	uint16_t ops[1];
 
-	ctx->ctlbase1 |= BIT_CTL1_RESETFSM;
-	ops[0] = mso_trans(REG_CTL1, ctx->ctlbase1);
+	devc->ctlbase1 |= BIT_CTL1_RESETFSM;
+	ops[0] = mso_trans(REG_CTL1, devc->ctlbase1);
 
 	sr_dbg("Requesting ADC reset.");
 	return mso_send_control_message(sdi, ARRAY_AND_SIZE(ops));
@@ -169,13 +172,13 @@ static int mso_reset_fsm(struct sr_dev_inst *sdi)
 
 static int mso_toggle_led(struct sr_dev_inst *sdi, int state)
 {
-	struct context *ctx = sdi->priv;
+	struct dev_context *devc = sdi->priv;
 	uint16_t ops[1];
 
-	ctx->ctlbase1 &= ~BIT_CTL1_LED;
+	devc->ctlbase1 &= ~BIT_CTL1_LED;
 	if (state)
-		ctx->ctlbase1 |= BIT_CTL1_LED;
-	ops[0] = mso_trans(REG_CTL1, ctx->ctlbase1);
+		devc->ctlbase1 |= BIT_CTL1_LED;
+	ops[0] = mso_trans(REG_CTL1, devc->ctlbase1);
 
 	sr_dbg("Requesting LED toggle.");
 	return mso_send_control_message(sdi, ARRAY_AND_SIZE(ops));
@@ -183,6 +186,7 @@ static int mso_toggle_led(struct sr_dev_inst *sdi, int state)
 
 static int mso_check_trigger(struct sr_dev_inst *sdi, uint8_t *info)
 {
+	struct dev_context *devc = sdi->priv;
 	uint16_t ops[] = { mso_trans(REG_TRIGGER, 0) };
 	char buf[1];
 	int ret;
@@ -193,7 +197,7 @@ static int mso_check_trigger(struct sr_dev_inst *sdi, uint8_t *info)
 		return ret;
 
 	buf[0] = 0;
-	if (serial_read(sdi->serial->fd, buf, 1) != 1) /* FIXME: Need timeout */
+	if (serial_read(devc->serial, buf, 1) != 1) /* FIXME: Need timeout */
 		ret = SR_ERR;
 	*info = buf[0];
 
@@ -211,11 +215,11 @@ static int mso_read_buffer(struct sr_dev_inst *sdi)
 
 static int mso_arm(struct sr_dev_inst *sdi)
 {
-	struct context *ctx = sdi->priv;
+	struct dev_context *devc = sdi->priv;
 	uint16_t ops[] = {
-		mso_trans(REG_CTL1, ctx->ctlbase1 | BIT_CTL1_RESETFSM),
-		mso_trans(REG_CTL1, ctx->ctlbase1 | BIT_CTL1_ARM),
-		mso_trans(REG_CTL1, ctx->ctlbase1),
+		mso_trans(REG_CTL1, devc->ctlbase1 | BIT_CTL1_RESETFSM),
+		mso_trans(REG_CTL1, devc->ctlbase1 | BIT_CTL1_ARM),
+		mso_trans(REG_CTL1, devc->ctlbase1),
 	};
 
 	sr_dbg("Requesting trigger arm.");
@@ -224,10 +228,10 @@ static int mso_arm(struct sr_dev_inst *sdi)
 
 static int mso_force_capture(struct sr_dev_inst *sdi)
 {
-	struct context *ctx = sdi->priv;
+	struct dev_context *devc = sdi->priv;
 	uint16_t ops[] = {
-		mso_trans(REG_CTL1, ctx->ctlbase1 | 8),
-		mso_trans(REG_CTL1, ctx->ctlbase1),
+		mso_trans(REG_CTL1, devc->ctlbase1 | 8),
+		mso_trans(REG_CTL1, devc->ctlbase1),
 	};
 
 	sr_dbg("Requesting forced capture.");
@@ -236,11 +240,11 @@ static int mso_force_capture(struct sr_dev_inst *sdi)
 
 static int mso_dac_out(struct sr_dev_inst *sdi, uint16_t val)
 {
-	struct context *ctx = sdi->priv;
+	struct dev_context *devc = sdi->priv;
 	uint16_t ops[] = {
 		mso_trans(REG_DAC1, (val >> 8) & 0xff),
 		mso_trans(REG_DAC2, val & 0xff),
-		mso_trans(REG_CTL1, ctx->ctlbase1 | BIT_CTL1_RESETADC),
+		mso_trans(REG_CTL1, devc->ctlbase1 | BIT_CTL1_RESETADC),
 	};
 
 	sr_dbg("Setting dac word to 0x%x.", val);
@@ -260,44 +264,44 @@ static int mso_clkrate_out(struct sr_dev_inst *sdi, uint16_t val)
 
 static int mso_configure_rate(struct sr_dev_inst *sdi, uint32_t rate)
 {
-	struct context *ctx = sdi->priv;
+	struct dev_context *devc = sdi->priv;
 	unsigned int i;
 	int ret = SR_ERR;
 
 	for (i = 0; i < ARRAY_SIZE(rate_map); i++) {
 		if (rate_map[i].rate == rate) {
-			ctx->ctlbase2 = rate_map[i].slowmode;
+			devc->ctlbase2 = rate_map[i].slowmode;
 			ret = mso_clkrate_out(sdi, rate_map[i].val);
 			if (ret == SR_OK)
-				ctx->cur_rate = rate;
+				devc->cur_rate = rate;
 			return ret;
 		}
 	}
 	return ret;
 }
 
-static inline uint16_t mso_calc_raw_from_mv(struct context *ctx)
+static inline uint16_t mso_calc_raw_from_mv(struct dev_context *devc)
 {
 	return (uint16_t) (0x200 -
-			((ctx->dso_trigger_voltage / ctx->dso_probe_attn) /
-			 ctx->vbit));
+			((devc->dso_trigger_voltage / devc->dso_probe_attn) /
+			 devc->vbit));
 }
 
 static int mso_configure_trigger(struct sr_dev_inst *sdi)
 {
-	struct context *ctx = sdi->priv;
+	struct dev_context *devc = sdi->priv;
 	uint16_t ops[16];
-	uint16_t dso_trigger = mso_calc_raw_from_mv(ctx);
+	uint16_t dso_trigger = mso_calc_raw_from_mv(devc);
 
 	dso_trigger &= 0x3ff;
-	if ((!ctx->trigger_slope && ctx->trigger_chan == 1) ||
-			(ctx->trigger_slope &&
-			 (ctx->trigger_chan == 0 ||
-			  ctx->trigger_chan == 2 ||
-			  ctx->trigger_chan == 3)))
+	if ((!devc->trigger_slope && devc->trigger_chan == 1) ||
+			(devc->trigger_slope &&
+			 (devc->trigger_chan == 0 ||
+			  devc->trigger_chan == 2 ||
+			  devc->trigger_chan == 3)))
 		dso_trigger |= 0x400;
 
-	switch (ctx->trigger_chan) {
+	switch (devc->trigger_chan) {
 	case 1:
 		dso_trigger |= 0xe000;
 	case 2:
@@ -317,7 +321,7 @@ static int mso_configure_trigger(struct sr_dev_inst *sdi)
 		break;
 	}
 
-	switch (ctx->trigger_outsrc) {
+	switch (devc->trigger_outsrc) {
 	case 1:
 		dso_trigger |= 0x800;
 		break;
@@ -330,40 +334,40 @@ static int mso_configure_trigger(struct sr_dev_inst *sdi)
 
 	}
 
-	ops[0] = mso_trans(5, ctx->la_trigger);
-	ops[1] = mso_trans(6, ctx->la_trigger_mask);
+	ops[0] = mso_trans(5, devc->la_trigger);
+	ops[1] = mso_trans(6, devc->la_trigger_mask);
 	ops[2] = mso_trans(3, dso_trigger & 0xff);
 	ops[3] = mso_trans(4, (dso_trigger >> 8) & 0xff);
 	ops[4] = mso_trans(11,
-			ctx->dso_trigger_width / SR_HZ_TO_NS(ctx->cur_rate));
+			devc->dso_trigger_width / SR_HZ_TO_NS(devc->cur_rate));
 
 	/* Select the SPI/I2C trigger config bank */
-	ops[5] = mso_trans(REG_CTL2, (ctx->ctlbase2 | BITS_CTL2_BANK(2)));
+	ops[5] = mso_trans(REG_CTL2, (devc->ctlbase2 | BITS_CTL2_BANK(2)));
 	/* Configure the SPI/I2C protocol trigger */
-	ops[6] = mso_trans(REG_PT_WORD(0), ctx->protocol_trigger.word[0]);
-	ops[7] = mso_trans(REG_PT_WORD(1), ctx->protocol_trigger.word[1]);
-	ops[8] = mso_trans(REG_PT_WORD(2), ctx->protocol_trigger.word[2]);
-	ops[9] = mso_trans(REG_PT_WORD(3), ctx->protocol_trigger.word[3]);
-	ops[10] = mso_trans(REG_PT_MASK(0), ctx->protocol_trigger.mask[0]);
-	ops[11] = mso_trans(REG_PT_MASK(1), ctx->protocol_trigger.mask[1]);
-	ops[12] = mso_trans(REG_PT_MASK(2), ctx->protocol_trigger.mask[2]);
-	ops[13] = mso_trans(REG_PT_MASK(3), ctx->protocol_trigger.mask[3]);
-	ops[14] = mso_trans(REG_PT_SPIMODE, ctx->protocol_trigger.spimode);
+	ops[6] = mso_trans(REG_PT_WORD(0), devc->protocol_trigger.word[0]);
+	ops[7] = mso_trans(REG_PT_WORD(1), devc->protocol_trigger.word[1]);
+	ops[8] = mso_trans(REG_PT_WORD(2), devc->protocol_trigger.word[2]);
+	ops[9] = mso_trans(REG_PT_WORD(3), devc->protocol_trigger.word[3]);
+	ops[10] = mso_trans(REG_PT_MASK(0), devc->protocol_trigger.mask[0]);
+	ops[11] = mso_trans(REG_PT_MASK(1), devc->protocol_trigger.mask[1]);
+	ops[12] = mso_trans(REG_PT_MASK(2), devc->protocol_trigger.mask[2]);
+	ops[13] = mso_trans(REG_PT_MASK(3), devc->protocol_trigger.mask[3]);
+	ops[14] = mso_trans(REG_PT_SPIMODE, devc->protocol_trigger.spimode);
 	/* Select the default config bank */
-	ops[15] = mso_trans(REG_CTL2, ctx->ctlbase2);
+	ops[15] = mso_trans(REG_CTL2, devc->ctlbase2);
 
 	return mso_send_control_message(sdi, ARRAY_AND_SIZE(ops));
 }
 
 static int mso_configure_threshold_level(struct sr_dev_inst *sdi)
 {
-	struct context *ctx = sdi->priv;
+	struct dev_context *devc = sdi->priv;
 
-	return mso_dac_out(sdi, la_threshold_map[ctx->la_threshold]);
+	return mso_dac_out(sdi, la_threshold_map[devc->la_threshold]);
 }
 
 static int mso_parse_serial(const char *iSerial, const char *iProduct,
-			    struct context *ctx)
+			    struct dev_context *devc)
 {
 	unsigned int u1, u2, u3, u4, u5, u6;
 
@@ -371,26 +375,26 @@ static int mso_parse_serial(const char *iSerial, const char *iProduct,
 	/* FIXME: This code is in the original app, but I think its
 	 * used only for the GUI */
 /*	if (strstr(iProduct, "REV_02") || strstr(iProduct, "REV_03"))
-		ctx->num_sample_rates = 0x16;
+		devc->num_sample_rates = 0x16;
 	else
-		ctx->num_sample_rates = 0x10; */
+		devc->num_sample_rates = 0x10; */
 
 	/* parse iSerial */
 	if (iSerial[0] != '4' || sscanf(iSerial, "%5u%3u%3u%1u%1u%6u",
 				&u1, &u2, &u3, &u4, &u5, &u6) != 6)
 		return SR_ERR;
-	ctx->hwmodel = u4;
-	ctx->hwrev = u5;
-	ctx->serial = u6;
-	ctx->vbit = u1 / 10000;
-	if (ctx->vbit == 0)
-		ctx->vbit = 4.19195;
-	ctx->dac_offset = u2;
-	if (ctx->dac_offset == 0)
-		ctx->dac_offset = 0x1ff;
-	ctx->offset_range = u3;
-	if (ctx->offset_range == 0)
-		ctx->offset_range = 0x17d;
+	devc->hwmodel = u4;
+	devc->hwrev = u5;
+	devc->serial_num = u6;
+	devc->vbit = u1 / 10000.0;
+	if (devc->vbit == 0)
+		devc->vbit = 4.19195;
+	devc->dac_offset = u2;
+	if (devc->dac_offset == 0)
+		devc->dac_offset = 0x1ff;
+	devc->offset_range = u3;
+	if (devc->offset_range == 0)
+		devc->offset_range = 0x17d;
 
 	/*
 	 * FIXME: There is more code on the original software to handle
@@ -401,21 +405,69 @@ static int mso_parse_serial(const char *iSerial, const char *iProduct,
 	return SR_OK;
 }
 
+static int clear_instances(void)
+{
+	GSList *l;
+	struct sr_dev_inst *sdi;
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	int ret;
+
+	if (!(drvc = di->priv))
+		return SR_OK;
+
+	ret = SR_OK;
+	/* Properly close all devices. */
+	for (l = drvc->instances; l; l = l->next) {
+		if (!(sdi = l->data)) {
+			/* Log error, but continue cleaning up the rest. */
+			sr_err("%s: sdi was NULL, continuing", __func__);
+			ret = SR_ERR_BUG;
+			continue;
+		}
+		if ((devc = sdi->priv) && devc->serial) {
+			if (devc->serial->fd != -1)
+				serial_close(devc->serial);
+			sr_serial_dev_inst_free(devc->serial);
+		}
+		sr_dev_inst_free(sdi);
+	}
+	g_slist_free(drvc->instances);
+	drvc->instances = NULL;
+
+	return ret;
+}
+
 static int hw_init(struct sr_context *sr_ctx)
 {
-	/* Nothing to do. */
+	struct drv_context *drvc;
+
+	if (!(drvc = g_try_malloc0(sizeof(struct drv_context)))) {
+		sr_err("Driver context malloc failed.");
+		return SR_ERR_MALLOC;
+	}
+	drvc->sr_ctx = sr_ctx;
+	di->priv = drvc;
 
 	return SR_OK;
 }
 
-static int hw_scan(void)
+static GSList *hw_scan(GSList *options)
 {
 	struct sr_dev_inst *sdi;
+	struct drv_context *drvc;
+	struct sr_probe *probe;
+	GSList *devices;
 	int devcnt = 0;
 	struct udev *udev;
 	struct udev_enumerate *enumerate;
 	struct udev_list_entry *devs, *dev_list_entry;
-	struct context *ctx;
+	struct dev_context *devc;
+
+	(void)options;
+
+	drvc = di->priv;
+	devices = NULL;
 
 	/* It's easier to map usb<->serial using udev */
 	/*
@@ -437,6 +489,7 @@ static int hw_scan(void)
 		char path[32], manufacturer[32], product[32], hwrev[32];
 		struct udev_device *dev, *parent;
 		size_t s;
+		int i;
 
 		syspath = udev_list_entry_get_name(dev_list_entry);
 		dev = udev_device_new_from_syspath(udev, syspath);
@@ -470,117 +523,108 @@ static int hw_scan(void)
 		product[s] = 0;
 		strcpy(manufacturer, iProduct + s);
 
-		if (!(ctx = g_try_malloc0(sizeof(struct context)))) {
-			sr_err("Context malloc failed.");
+		if (!(devc = g_try_malloc0(sizeof(struct dev_context)))) {
+			sr_err("Device context malloc failed.");
 			continue; /* TODO: Errors handled correctly? */
 		}
 
-		if (mso_parse_serial(iSerial, iProduct, ctx) != SR_OK) {
+		if (mso_parse_serial(iSerial, iProduct, devc) != SR_OK) {
 			sr_err("Invalid iSerial: %s.", iSerial);
-			goto err_free_ctx;
+			goto err_free_devc;
 		}
-		sprintf(hwrev, "r%d", ctx->hwrev);
+		sprintf(hwrev, "r%d", devc->hwrev);
 
 		/* hardware initial state */
-		ctx->ctlbase1 = 0;
-		{
-			/* Initialize the protocol trigger configuration */
-			int i;
-			for (i = 0; i < 4; i++) {
-				ctx->protocol_trigger.word[i] = 0;
-				ctx->protocol_trigger.mask[i] = 0xff;
-			}
-			ctx->protocol_trigger.spimode = 0;
+		devc->ctlbase1 = 0;
+		devc->dso_probe_attn = 1;
+		/* Initialize the protocol trigger configuration */
+		for (i = 0; i < 4; i++) {
+			devc->protocol_trigger.word[i] = 0;
+			devc->protocol_trigger.mask[i] = 0xff;
 		}
+		devc->protocol_trigger.spimode = 0;
+
+		devc->serial = sr_serial_dev_inst_new(path, NULL);
+		if (!devc->serial)
+			goto err_free_devc;
 
-		sdi = sr_dev_inst_new(devcnt, SR_ST_INITIALIZING,
+		sdi = sr_dev_inst_new(devcnt, SR_ST_INACTIVE,
 				      manufacturer, product, hwrev);
 		if (!sdi) {
 			sr_err("Unable to create device instance for %s",
 			       sysname);
-			goto err_free_ctx;
+			goto err_serial_free;
 		}
+		sdi->driver = di;
 
 		/* save a pointer to our private instance data */
-		sdi->priv = ctx;
+		sdi->priv = devc;
 
-		sdi->serial = sr_serial_dev_inst_new(path, -1);
-		if (!sdi->serial)
-			goto err_dev_inst_free;
+		for (i = 0; probe_names[i]; i++) {
+			if (!(probe = sr_probe_new(i, SR_PROBE_LOGIC, TRUE,
+					probe_names[i])))
+				continue;
+			sdi->probes = g_slist_append(sdi->probes, probe);
+		}
 
-		dev_insts = g_slist_append(dev_insts, sdi);
+		drvc->instances = g_slist_append(drvc->instances, sdi);
+		devices = g_slist_append(devices, sdi);
 		devcnt++;
 		continue;
 
-err_dev_inst_free:
-		sr_dev_inst_free(sdi);
-err_free_ctx:
-		g_free(ctx);
+err_serial_free:
+		sr_serial_dev_inst_free(devc->serial);
+err_free_devc:
+		g_free(devc);
 	}
 
 	udev_enumerate_unref(enumerate);
 	udev_unref(udev);
 
 ret:
-	return devcnt;
+	return devices;
 }
 
-static int hw_cleanup(void)
+static GSList *hw_dev_list(void)
 {
-	GSList *l;
-	struct sr_dev_inst *sdi;
-	int ret;
+	struct drv_context *drvc;
 
-	ret = SR_OK;
-	/* Properly close all devices. */
-	for (l = dev_insts; l; l = l->next) {
-		if (!(sdi = l->data)) {
-			/* Log error, but continue cleaning up the rest. */
-			sr_err("%s: sdi was NULL, continuing", __func__);
-			ret = SR_ERR_BUG;
-			continue;
-		}
-		if (sdi->serial->fd != -1)
-			serial_close(sdi->serial->fd);
-		sr_dev_inst_free(sdi);
-	}
-	g_slist_free(dev_insts);
-	dev_insts = NULL;
+	drvc = di->priv;
 
-	return ret;
+	return drvc->instances;
 }
 
-static int hw_dev_open(int dev_index)
+static int hw_cleanup(void)
 {
-	struct sr_dev_inst *sdi;
-	struct context *ctx;
-	int ret = SR_ERR;
+	return clear_instances();
+}
 
-	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
-		return ret;
+static int hw_dev_open(struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc;
+	int ret = SR_ERR;
 
-	ctx = sdi->priv;
-	sdi->serial->fd = serial_open(sdi->serial->port, SERIAL_RDWR);
-	if (sdi->serial->fd == -1)
+	devc = sdi->priv;
+	if (serial_open(devc->serial, SERIAL_RDWR) != SR_OK)
 		return ret;
 
-	ret = serial_set_params(sdi->serial->fd, 460800, 8, 0, 1, 2);
+	ret = serial_set_params(devc->serial, 460800, 8, 0, 1, 2, -1, -1);
 	if (ret != SR_OK)
 		return ret;
 
 	sdi->status = SR_ST_ACTIVE;
 
-	/* FIXME: discard serial buffer */
+	serial_flush(devc->serial);
 
-	mso_check_trigger(sdi, &ctx->trigger_state);
-	sr_dbg("Trigger state: 0x%x.", ctx->trigger_state);
+	mso_check_trigger(sdi, &devc->trigger_state);
+	sr_dbg("Trigger state: 0x%x.", devc->trigger_state);
 
 	ret = mso_reset_adc(sdi);
 	if (ret != SR_OK)
 		return ret;
 
-	mso_check_trigger(sdi, &ctx->trigger_state);
-	sr_dbg("Trigger state: 0x%x.", ctx->trigger_state);
+	mso_check_trigger(sdi, &devc->trigger_state);
+	sr_dbg("Trigger state: 0x%x.", devc->trigger_state);
 
 //	ret = mso_reset_fsm(sdi);
 //	if (ret != SR_OK)
@@ -590,85 +634,69 @@ static int hw_dev_open(int dev_index)
 	return SR_OK;
 }
 
-static int hw_dev_close(int dev_index)
+static int hw_dev_close(struct sr_dev_inst *sdi)
 {
-	struct sr_dev_inst *sdi;
+	struct dev_context *devc;
 
-	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index))) {
-		sr_err("%s: sdi was NULL", __func__);
-		return SR_ERR_BUG;
-	}
+	devc = sdi->priv;
 
 	/* TODO */
-	if (sdi->serial->fd != -1) {
-		serial_close(sdi->serial->fd);
-		sdi->serial->fd = -1;
+	if (devc->serial->fd != -1) {
+		serial_close(devc->serial);
 		sdi->status = SR_ST_INACTIVE;
 	}
 
 	return SR_OK;
 }
 
-static const void *hw_dev_info_get(int dev_index, int dev_info_id)
+static int hw_info_get(int info_id, const void **data,
+		       const struct sr_dev_inst *sdi)
 {
-	struct sr_dev_inst *sdi;
-	struct context *ctx;
-	const void *info = NULL;
+	struct dev_context *devc;
 
-	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
-		return NULL;
-	ctx = sdi->priv;
-
-	switch (dev_info_id) {
-	case SR_DI_INST:
-		info = sdi;
+	switch (info_id) {
+	case SR_DI_HWCAPS:
+		*data = hwcaps;
 		break;
 	case SR_DI_NUM_PROBES: /* FIXME: How to report analog probe? */
-		info = GINT_TO_POINTER(NUM_PROBES);
+		*data = GINT_TO_POINTER(NUM_PROBES);
 		break;
-	case SR_DI_PROBE_NAMES: 
-		info = probe_names;
+	case SR_DI_PROBE_NAMES:
+		*data = probe_names;
 		break;
 	case SR_DI_SAMPLERATES:
-		info = &samplerates;
+		*data = &samplerates;
 		break;
 	case SR_DI_TRIGGER_TYPES:
-		info = "01"; /* FIXME */
+		*data = "01"; /* FIXME */
 		break;
 	case SR_DI_CUR_SAMPLERATE:
-		info = &ctx->cur_rate;
+		if (!sdi)
+			return SR_ERR;
+		devc = sdi->priv;
+		*data = &devc->cur_rate;
 		break;
+	default:
+		return SR_ERR_ARG;
 	}
-	return info;
-}
-
-static int hw_dev_status_get(int dev_index)
-{
-	struct sr_dev_inst *sdi;
-
-	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
-		return SR_ST_NOT_FOUND;
-
-	return sdi->status;
-}
 
-static const int *hw_hwcap_get_all(void)
-{
-	return hwcaps;
+	return SR_OK;
 }
 
-static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
+static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
+			     const void *value)
 {
-	struct sr_dev_inst *sdi;
+	struct dev_context *devc;
 
-	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
-		return SR_ERR;
+	devc = sdi->priv;
 
 	switch (hwcap) {
 	case SR_HWCAP_SAMPLERATE:
-		return mso_configure_rate(sdi, *(const uint64_t *) value);
-	case SR_HWCAP_PROBECONFIG:
+		return mso_configure_rate((struct sr_dev_inst *)sdi,
+					  *(const uint64_t *)value);
 	case SR_HWCAP_LIMIT_SAMPLES:
+		devc->limit_samples = *(const uint64_t *)value;
+		return SR_OK;
 	default:
 		return SR_OK; /* FIXME */
 	}
@@ -686,105 +714,126 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 static int receive_data(int fd, int revents, void *cb_data)
 {
 	struct sr_dev_inst *sdi = cb_data;
-	struct context *ctx = sdi->priv;
+	struct dev_context *devc = sdi->priv;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_logic logic;
+	struct sr_datafeed_analog_raw raw;
+	struct sr_analog_scale scale;
 	uint8_t in[1024], logic_out[1024];
-	double analog_out[1024];
-	size_t i, s;
+	uint16_t analog_out[1024];
+	double mv_per_bit;
+	int i, s, num_samples;
 
+	(void)fd;
 	(void)revents;
 
-	s = serial_read(fd, in, sizeof(in));
+	s = serial_read(devc->serial, in, sizeof(in));
 	if (s <= 0)
-		return FALSE;
+		return TRUE;
 
 	/* No samples */
-	if (ctx->trigger_state != MSO_TRIGGER_DATAREADY) {
-		ctx->trigger_state = in[0];
-		if (ctx->trigger_state == MSO_TRIGGER_DATAREADY) {
+	if (devc->trigger_state != MSO_TRIGGER_DATAREADY) {
+		devc->trigger_state = in[0];
+		if (devc->trigger_state == MSO_TRIGGER_DATAREADY) {
 			mso_read_buffer(sdi);
-			ctx->buffer_n = 0;
+			devc->buffer_n = 0;
 		} else {
 			mso_check_trigger(sdi, NULL);
 		}
-		return FALSE;
+		return TRUE;
 	}
 
 	/* the hardware always dumps 1024 samples, 24bits each */
-	if (ctx->buffer_n < 3072) {
-		memcpy(ctx->buffer + ctx->buffer_n, in, s);
-		ctx->buffer_n += s;
+	if (devc->buffer_n < 3072) {
+		s = MIN(s, 3072 - devc->buffer_n);
+		memcpy(devc->buffer + devc->buffer_n, in, s);
+		devc->buffer_n += s;
 	}
-	if (ctx->buffer_n < 3072)
-		return FALSE;
+	if (devc->buffer_n < 3072)
+		return TRUE;
 
-	/* do the conversion */
+	/* Split the samples into 10 bit ADC codes and logic bytes. */
 	for (i = 0; i < 1024; i++) {
-		/* FIXME: Need to do conversion to mV */
-		analog_out[i] = (ctx->buffer[i * 3] & 0x3f) |
-			((ctx->buffer[i * 3 + 1] & 0xf) << 6);
-		logic_out[i] = ((ctx->buffer[i * 3 + 1] & 0x30) >> 4) |
-			((ctx->buffer[i * 3 + 2] & 0x3f) << 2);
+		analog_out[i] = (devc->buffer[i * 3] & 0x3f) |
+			((devc->buffer[i * 3 + 1] & 0xf) << 6);
+		logic_out[i] = ((devc->buffer[i * 3 + 1] & 0x30) >> 4) |
+			((devc->buffer[i * 3 + 2] & 0x3f) << 2);
 	}
 
+	num_samples = 1024;
+	if (devc->limit_samples && devc->limit_samples < 1024)
+		num_samples = devc->limit_samples;
+
 	packet.type = SR_DF_LOGIC;
 	packet.payload = &logic;
-	logic.length = 1024;
+	logic.length = num_samples;
 	logic.unitsize = 1;
 	logic.data = logic_out;
-	sr_session_send(ctx->session_dev_id, &packet);
-
-	// Dont bother fixing this yet, keep it "old style"
-	/*
-	packet.type = SR_DF_ANALOG;
-	packet.length = 1024;
-	packet.unitsize = sizeof(double);
-	packet.payload = analog_out;
-	sr_session_send(ctx->session_dev_id, &packet);
-	*/
-
-	packet.type = SR_DF_END;
-	sr_session_send(ctx->session_dev_id, &packet);
+	logic.buffer = NULL;
+	sr_session_send(devc->session_dev_id, &packet);
+
+	/* The inverse of mso_calc_raw_from_mv(), in volts. */
+	mv_per_bit = devc->vbit * devc->dso_probe_attn;
+	scale.scale = -mv_per_bit / 1000;
+	scale.offset = 0x200 * mv_per_bit / 1000;
+
+	packet.type = SR_DF_ANALOG_RAW;
+	packet.payload = &raw;
+	raw.num_samples = num_samples;
+	raw.num_probes = 1;
+	raw.mq = SR_MQ_VOLTAGE;
+	raw.unit = SR_UNIT_VOLT;
+	raw.mqflags = 0;
+	raw.sample_size = sizeof(uint16_t);
+	raw.is_signed = FALSE;
+	raw.scales = &scale;
+	raw.data = analog_out;
+	raw.buffer = NULL;
+	sr_session_send(devc->session_dev_id, &packet);
+
+	hw_dev_acquisition_stop(sdi, devc->session_dev_id);
 
 	return TRUE;
 }
 
-static int hw_dev_acquisition_start(int dev_index, void *cb_data)
+static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
+				    void *cb_data)
 {
-	struct sr_dev_inst *sdi;
-	struct context *ctx;
+	struct sr_dev_inst *mso_sdi;
+	struct dev_context *devc;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_header header;
+	struct sr_datafeed_meta_logic meta;
+	struct sr_datafeed_meta_analog meta_analog;
 	int ret = SR_ERR;
 
-	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
-		return ret;
-	ctx = sdi->priv;
+	/* The register helpers update the cached control bits. */
+	mso_sdi = (struct sr_dev_inst *)sdi;
+	devc = sdi->priv;
 
 	/* FIXME: No need to do full reconfigure every time */
-//	ret = mso_reset_fsm(sdi);
+//	ret = mso_reset_fsm(mso_sdi);
 //	if (ret != SR_OK)
 //		return ret;
 
 	/* FIXME: ACDC Mode */
-	ctx->ctlbase1 &= 0x7f;
-//	ctx->ctlbase1 |= ctx->acdcmode;
+	devc->ctlbase1 &= 0x7f;
+//	devc->ctlbase1 |= devc->acdcmode;
 
-	ret = mso_configure_rate(sdi, ctx->cur_rate);
+	ret = mso_configure_rate(mso_sdi, devc->cur_rate);
 	if (ret != SR_OK)
 		return ret;
 
 	/* set dac offset */
-	ret = mso_dac_out(sdi, ctx->dac_offset);
+	ret = mso_dac_out(mso_sdi, devc->dac_offset);
 	if (ret != SR_OK)
 		return ret;
 
-	ret = mso_configure_threshold_level(sdi);
+	ret = mso_configure_threshold_level(mso_sdi);
 	if (ret != SR_OK)
 		return ret;
 
-	ret = mso_configure_trigger(sdi);
+	ret = mso_configure_trigger(mso_sdi);
 	if (ret != SR_OK)
 		return ret;
 
@@ -794,41 +843,51 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	/* END of config hardware part */
 
 	/* with trigger */
-	ret = mso_arm(sdi);
+	ret = mso_arm(mso_sdi);
 	if (ret != SR_OK)
 		return ret;
 
 	/* without trigger */
-//	ret = mso_force_capture(sdi);
+//	ret = mso_force_capture(mso_sdi);
 //	if (ret != SR_OK)
 //		return ret;
 
-	mso_check_trigger(sdi, &ctx->trigger_state);
-	ret = mso_check_trigger(sdi, NULL);
+	mso_check_trigger(mso_sdi, &devc->trigger_state);
+	ret = mso_check_trigger(mso_sdi, NULL);
 	if (ret != SR_OK)
 		return ret;
 
-	ctx->session_dev_id = cb_data;
-	sr_source_add(sdi->serial->fd, G_IO_IN, -1, receive_data, sdi);
+	devc->session_dev_id = cb_data;
+	sr_source_add(devc->serial->fd, G_IO_IN, -1, receive_data, mso_sdi);
 
 	packet.type = SR_DF_HEADER;
 	packet.payload = (unsigned char *) &header;
 	header.feed_version = 1;
 	gettimeofday(&header.starttime, NULL);
-	header.samplerate = ctx->cur_rate;
-	// header.num_analog_probes = 1;
-	header.num_logic_probes = 8;
-	sr_session_send(ctx->session_dev_id, &packet);
+	sr_session_send(devc->session_dev_id, &packet);
+
+	packet.type = SR_DF_META_LOGIC;
+	packet.payload = &meta;
+	meta.samplerate = devc->cur_rate;
+	meta.num_probes = NUM_PROBES;
+	sr_session_send(devc->session_dev_id, &packet);
+
+	/* The DSO probe's codes follow as SR_DF_ANALOG_RAW. */
+	packet.type = SR_DF_META_ANALOG;
+	packet.payload = &meta_analog;
+	meta_analog.num_probes = 1;
+	sr_session_send(devc->session_dev_id, &packet);
 
 	return ret;
 }
 
-/* TODO: This stops acquisition on ALL devices, ignoring dev_index. */
-static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
+static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi, void *cb_data)
 {
+	struct dev_context *devc;
 	struct sr_datafeed_packet packet;
 
-	(void)dev_index;
+	devc = sdi->priv;
+	sr_source_remove(devc->serial->fd);
 
 	packet.type = SR_DF_END;
 	sr_session_send(cb_data, &packet);
@@ -843,12 +902,13 @@ SR_PRIV struct sr_dev_driver link_mso19_driver_info = {
 	.init = hw_init,
 	.cleanup = hw_cleanup,
 	.scan = hw_scan,
+	.dev_list = hw_dev_list,
+	.dev_clear = clear_instances,
 	.dev_open = hw_dev_open,
 	.dev_close = hw_dev_close,
-	.dev_info_get = hw_dev_info_get,
-	.dev_status_get = hw_dev_status_get,
-	.hwcap_get_all = hw_hwcap_get_all,
+	.info_get = hw_info_get,
 	.dev_config_set = hw_dev_config_set,
 	.dev_acquisition_start = hw_dev_acquisition_start,
 	.dev_acquisition_stop = hw_dev_acquisition_stop,
+	.priv = NULL,
 };
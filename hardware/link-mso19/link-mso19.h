@@ -24,11 +24,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "mso-19: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 /* Structure for the pattern generator state */
 struct mso_patgen {
@@ -61,11 +56,11 @@ struct mso_prototrig {
 };
 
 /* Private, per-device-instance driver context. */
-struct mso {
+struct dev_context {
 	/* info */
 	uint8_t hwmodel;
 	uint8_t hwrev;
-	uint32_t serial;
+	uint32_t serial_num;
 //	uint8_t num_sample_rates;
 	/* calibration */
 	double vbit;
@@ -87,7 +82,9 @@ struct mso {
 	double dso_trigger_voltage;
 	uint16_t dso_trigger_width;
 	struct mso_prototrig protocol_trigger;
+	uint64_t limit_samples;
 	void *session_dev_id;
+	struct sr_serial_dev_inst *serial;
 	uint16_t buffer_n;
 	char buffer[4096];
 };
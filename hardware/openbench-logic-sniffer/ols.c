@@ -44,12 +44,22 @@
 
 #define SERIALCOMM "115200/8n1"
 
+/*
+ * Baudrates tried after the device answered at SERIALCOMM, fastest first.
+ * Those behind USB-CDC take any of them, those on a real UART only the
+ * one they are set up for.
+ */
+static const int fast_baudrates[] = {
+	3000000, 2000000, 1000000, 921600, 500000, 460800, 230400, 0,
+};
+
 static const int hwcaps[] = {
 	SR_HWCAP_LOGIC_ANALYZER,
 	SR_HWCAP_SAMPLERATE,
 	SR_HWCAP_CAPTURE_RATIO,
 	SR_HWCAP_LIMIT_SAMPLES,
 	SR_HWCAP_RLE,
+	SR_HWCAP_SERIALCOMM,
 	0,
 };
 
@@ -225,6 +235,73 @@ static struct dev_context *ols_dev_new(void)
 	return devc;
 }
 
+/*
+ * Send the Reset command (0x00) 5 times, since the device could be
+ * anywhere in a 5-byte command, then the ID command (0x02). If the device
+ * responds with 4 bytes ("OLS1" or "SLA1"), we have a match.
+ */
+static gboolean identify(struct sr_serial_dev_inst *serial)
+{
+	GPollFD probefd;
+	char buf[8];
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		if (send_shortcommand(serial, CMD_RESET) != SR_OK) {
+			sr_err("ols: port %s is not writable.", serial->port);
+			return FALSE;
+		}
+	}
+	send_shortcommand(serial, CMD_ID);
+
+	/* Wait 10ms for a response. */
+	usleep(10000);
+
+	probefd.fd = serial->fd;
+	probefd.events = G_IO_IN;
+	g_poll(&probefd, 1, 1);
+
+	if (probefd.revents != G_IO_IN)
+		return FALSE;
+	if (serial_read(serial, buf, 4) != 4)
+		return FALSE;
+
+	return !strncmp(buf, "1SLO", 4) || !strncmp(buf, "1ALS", 4);
+}
+
+/*
+ * Switch the port to the fastest baudrate which the device still answers
+ * at, keeping the original one if there is none. The serialcomm in
+ * 'serial' is the one in use afterwards.
+ */
+static void negotiate_baudrate(struct sr_serial_dev_inst *serial)
+{
+	char *serialcomm;
+	int cur, i;
+
+	cur = strtoul(serial->serialcomm, NULL, 10);
+	for (i = 0; fast_baudrates[i] > cur; i++) {
+		serialcomm = g_strdup_printf("%d/8n1", fast_baudrates[i]);
+		/* Don't take garbage from the last attempt for an answer. */
+		if (serial_set_paramstr(serial, serialcomm) == SR_OK
+		    && serial_flush(serial) == SR_OK && identify(serial)) {
+			sr_info("ols: %s answers at %s.", serial->port,
+				serialcomm);
+			g_free(serial->serialcomm);
+			serial->serialcomm = serialcomm;
+			return;
+		}
+		g_free(serialcomm);
+	}
+
+	/* Back to the original rate, and get the device in sync again. */
+	if (i > 0) {
+		serial_set_paramstr(serial, serial->serialcomm);
+		serial_flush(serial);
+		identify(serial);
+	}
+}
+
 static struct sr_dev_inst *get_metadata(struct sr_serial_dev_inst *serial)
 {
 	struct sr_dev_inst *sdi;
@@ -386,9 +463,9 @@ static GSList *hw_scan(GSList *options)
 	struct sr_serial_dev_inst *serial;
 	GPollFD probefd;
 	GSList *l, *devices;
-	int ret, i;
+	int i;
 	const char *conn, *serialcomm;
-	char buf[8];
+	gboolean negotiate;
 
 	(void)options;
 	drvc = odi->priv;
@@ -409,54 +486,37 @@ static GSList *hw_scan(GSList *options)
 	if (!conn)
 		return NULL;
 
+	/* A serialcomm given by the user is taken as it is. */
+	negotiate = serialcomm == NULL;
 	if (serialcomm == NULL)
 		serialcomm = SERIALCOMM;
 
 	if (!(serial = sr_serial_dev_inst_new(conn, serialcomm)))
 		return NULL;
 
-	/* The discovery procedure is like this: first send the Reset
-	 * command (0x00) 5 times, since the device could be anywhere
-	 * in a 5-byte command. Then send the ID command (0x02).
-	 * If the device responds with 4 bytes ("OLS1" or "SLA1"), we
-	 * have a match.
-	 */
 	sr_info("ols: probing %s .", conn);
-	if (serial_open(serial, SERIAL_RDWR | SERIAL_NONBLOCK) != SR_OK)
+	if (serial_open(serial, SERIAL_RDWR | SERIAL_NONBLOCK) != SR_OK) {
+		sr_serial_dev_inst_free(serial);
 		return NULL;
-
-	ret = SR_OK;
-	for (i = 0; i < 5; i++) {
-		if ((ret = send_shortcommand(serial, CMD_RESET)) != SR_OK) {
-			sr_err("ols: port %s is not writable.", conn);
-			break;
-		}
 	}
-	if (ret != SR_OK) {
+
+	if (!identify(serial)) {
 		serial_close(serial);
-		sr_err("ols: Could not use port %s. Quitting.", conn);
+		sr_serial_dev_inst_free(serial);
 		return NULL;
 	}
-	send_shortcommand(serial, CMD_ID);
 
-	/* Wait 10ms for a response. */
-	usleep(10000);
+	/*
+	 * Definitely using the OLS protocol. Find the fastest link it
+	 * takes before the metadata (and much later, the samples) come in.
+	 */
+	if (negotiate)
+		negotiate_baudrate(serial);
 
+	/* Check if it supports the metadata command. */
+	send_shortcommand(serial, CMD_METADATA);
 	probefd.fd = serial->fd;
 	probefd.events = G_IO_IN;
-	g_poll(&probefd, 1, 1);
-
-	if (probefd.revents != G_IO_IN)
-		return NULL;
-	if (serial_read(serial, buf, 4) != 4)
-		return NULL;
-	if (strncmp(buf, "1SLO", 4) && strncmp(buf, "1ALS", 4))
-		return NULL;
-
-	/* Definitely using the OLS protocol, check if it supports
-	 * the metadata command.
-	 */
-	send_shortcommand(serial, CMD_METADATA);
 	if (g_poll(&probefd, 1, 10) > 0) {
 		/* Got metadata. */
 		sdi = get_metadata(serial);
@@ -666,6 +726,19 @@ static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 		}
 		ret = SR_OK;
 		break;
+	case SR_HWCAP_SERIALCOMM:
+		/* The device has to be set up for it already. */
+		if ((ret = serial_set_paramstr(devc->serial, value)) != SR_OK) {
+			sr_err("ols: invalid serialcomm '%s'",
+			       (const char *)value);
+			serial_set_paramstr(devc->serial,
+					    devc->serial->serialcomm);
+			break;
+		}
+		g_free(devc->serial->serialcomm);
+		devc->serial->serialcomm = g_strdup(value);
+		sr_info("ols: using %s", devc->serial->serialcomm);
+		break;
 	default:
 		ret = SR_ERR;
 	}
@@ -680,6 +753,10 @@ static void abort_acquisition(const struct sr_dev_inst *sdi)
 
 	devc = sdi->priv;
 	sr_source_remove(devc->serial->fd);
+	g_free(devc->read_buf);
+	devc->read_buf = NULL;
+	sr_pool_release(devc->raw_sample_buf, devc->raw_sample_size);
+	devc->raw_sample_buf = NULL;
 
 	/* Terminate session */
 	packet.type = SR_DF_END;
@@ -689,16 +766,243 @@ static void abort_acquisition(const struct sr_dev_inst *sdi)
 
 
 
-static int receive_data(int fd, int revents, void *cb_data)
+/*
+ * Fill 'count' samples of 'unitsize' bytes at 'dest' with 'sample',
+ * copying ever larger blocks.
+ */
+static void fill_samples(unsigned char *dest, const unsigned char *sample,
+			 int unitsize, unsigned int count)
+{
+	unsigned int done;
+
+	if (count == 0)
+		return;
+
+	memcpy(dest, sample, unitsize);
+	for (done = 1; done < count; done *= 2)
+		memcpy(dest + done * unitsize, dest,
+		       MIN(done, count - done) * unitsize);
+}
+
+/* Append devc->sample, held for rle_count + 1 samples, to the runs. */
+static int add_run(struct dev_context *devc)
+{
+	struct sr_logic_run *runs;
+	uint64_t value;
+	unsigned int size;
+	int i;
+
+	for (value = 0, i = 0; i < devc->unitsize; i++)
+		value |= (uint64_t)devc->sample[i] << (8 * i);
+
+	if (devc->num_runs > 0
+	    && devc->runs[devc->num_runs - 1].value == value) {
+		devc->runs[devc->num_runs - 1].length += devc->rle_count + 1;
+		return SR_OK;
+	}
+
+	if (devc->num_runs == devc->max_runs) {
+		size = devc->max_runs ? devc->max_runs * 2 : 1024;
+		if (!(runs = g_try_realloc(devc->runs,
+				size * sizeof(struct sr_logic_run)))) {
+			sr_err("ols: %s: runs malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		devc->runs = runs;
+		devc->max_runs = size;
+	}
+	devc->runs[devc->num_runs].value = value;
+	devc->runs[devc->num_runs].length = devc->rle_count + 1;
+	devc->num_runs++;
+
+	return SR_OK;
+}
+
+/* Handle the complete sample in devc->sample. */
+static int process_sample(struct dev_context *devc, int num_channels)
+{
+	int offset, i, j, ret;
+
+	if (sr_log_loglevel_get() >= SR_LOG_DBG)
+		sr_dbg("ols: received sample 0x%.2x%.2x%.2x%.2x",
+		       devc->sample[3], devc->sample[2], devc->sample[1],
+		       devc->sample[0]);
+
+	if (devc->flag_reg & FLAG_RLE) {
+		/*
+		 * In RLE mode -1 should never come in as a
+		 * sample, because bit 31 is the "count" flag.
+		 */
+		if (devc->sample[devc->num_bytes - 1] & 0x80) {
+			devc->sample[devc->num_bytes - 1] &= 0x7f;
+			devc->rle_count = devc->sample[0] |
+					  devc->sample[1] << 8 |
+					  devc->sample[2] << 16 |
+					  devc->sample[3] << 24;
+			if (sr_log_loglevel_get() >= SR_LOG_DBG)
+				sr_dbg("ols: RLE count = %d", devc->rle_count);
+			memset(devc->sample, 0, 4);
+			devc->num_bytes = 0;
+			return SR_OK;
+		}
+	}
+	devc->num_samples += devc->rle_count + 1;
+	if (devc->num_samples > devc->limit_samples) {
+		/* Save us from overrunning the buffer. */
+		devc->rle_count -= devc->num_samples - devc->limit_samples;
+		devc->num_samples = devc->limit_samples;
+	}
+
+	if (num_channels < devc->unitsize) {
+		/*
+		 * Some channel groups may have been turned
+		 * off, to speed up transfer between the
+		 * hardware and the PC. Samples go out on the
+		 * session bus with probe n in bit n, so put
+		 * back the groups below the highest enabled
+		 * one. Those above it are left out.
+		 */
+		j = 0;
+		memset(devc->tmp_sample, 0, 4);
+		for (i = 0; i < devc->unitsize; i++) {
+			if (((devc->flag_reg >> 2) & (1 << i)) == 0) {
+				/*
+				 * This channel group was
+				 * enabled, copy from received
+				 * sample.
+				 */
+				devc->tmp_sample[i] = devc->sample[j++];
+			}
+		}
+		memcpy(devc->sample, devc->tmp_sample, 4);
+	}
+
+	ret = SR_OK;
+	if (devc->flag_reg & FLAG_RLE) {
+		/* Keep the runs as they are, they go out as runs. */
+		ret = add_run(devc);
+	} else {
+		/* the OLS sends its sample buffer backwards.
+		 * store it in reverse order here, so we can dump
+		 * this on the session bus later.
+		 */
+		offset = (devc->limit_samples - devc->num_samples)
+			 * devc->unitsize;
+		fill_samples(devc->raw_sample_buf + offset, devc->sample,
+			     devc->unitsize, devc->rle_count + 1);
+	}
+	memset(devc->sample, 0, 4);
+	devc->num_bytes = 0;
+	devc->rle_count = 0;
+
+	return ret;
+}
+
+static void send_samples(const struct dev_context *devc, void *cb_data,
+			 unsigned char *data, unsigned int num_samples)
 {
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_logic logic;
+
+	if (num_samples == 0)
+		return;
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.length = num_samples * devc->unitsize;
+	logic.unitsize = devc->unitsize;
+	logic.data = data;
+	logic.buffer = NULL;
+	sr_session_send(cb_data, &packet);
+}
+
+static void send_runs(const struct dev_context *devc, void *cb_data,
+		      struct sr_logic_run *runs, unsigned int num_runs)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic_rle rle;
+
+	if (num_runs == 0)
+		return;
+
+	packet.type = SR_DF_LOGIC_RLE;
+	packet.payload = &rle;
+	rle.num_runs = num_runs;
+	rle.unitsize = devc->unitsize;
+	rle.runs = runs;
+	rle.buffer = NULL;
+	sr_session_send(cb_data, &packet);
+}
+
+/* Send the runs, with a trigger before sample 'trigger_at' if triggered. */
+static void send_all_runs(struct dev_context *devc, void *cb_data,
+			  gboolean triggered, uint64_t trigger_at)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_logic_run tmp;
+	uint64_t n, length;
+	unsigned int i, k;
+
+	/* The runs came in backwards, like the samples. */
+	for (i = 0; i < devc->num_runs / 2; i++) {
+		tmp = devc->runs[i];
+		devc->runs[i] = devc->runs[devc->num_runs - 1 - i];
+		devc->runs[devc->num_runs - 1 - i] = tmp;
+	}
+
+	if (!triggered) {
+		send_runs(devc, cb_data, devc->runs, devc->num_runs);
+		return;
+	}
+
+	/* Find the run holding the trigger sample. */
+	for (k = 0, n = 0; k < devc->num_runs; n += devc->runs[k++].length) {
+		if (n + devc->runs[k].length > trigger_at)
+			break;
+	}
+
+	if (k < devc->num_runs && n < trigger_at) {
+		/* The trigger is within that run, split it. */
+		length = devc->runs[k].length;
+		devc->runs[k].length = trigger_at - n;
+		send_runs(devc, cb_data, devc->runs, k + 1);
+		devc->runs[k].length = length - (trigger_at - n);
+	} else {
+		send_runs(devc, cb_data, devc->runs, k);
+	}
+
+	packet.type = SR_DF_TRIGGER;
+	packet.payload = NULL;
+	sr_session_send(cb_data, &packet);
+
+	send_runs(devc, cb_data, devc->runs + k, devc->num_runs - k);
+}
+
+/* Done with the data, or with trying to receive it. */
+static void acquisition_finish(const struct sr_dev_inst *sdi)
+{
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+	g_free(devc->runs);
+	devc->runs = NULL;
+	devc->num_runs = devc->max_runs = 0;
+
+	serial_flush(devc->serial);
+	abort_acquisition(sdi);
+	serial_close(devc->serial);
+}
+
+static int receive_data(int fd, int revents, void *cb_data)
+{
+	struct sr_datafeed_packet packet;
 	struct sr_dev_inst *sdi;
 	struct drv_context *drvc;
 	struct dev_context *devc;
 	GSList *l;
-	int num_channels, offset, i, j;
-	unsigned char byte;
+	int num_channels, i, len, n;
+	unsigned int offset, trigger_at;
+	unsigned char *buf, *p, *data;
 
 	drvc = odi->priv;
 
@@ -722,17 +1026,8 @@ static int receive_data(int fd, int revents, void *cb_data)
 		 * longer than it takes to send a byte, that means it's
 		 * finished. We'll double that to 30ms to be sure...
 		 */
-		sr_source_remove(fd);
-		sr_source_add(fd, G_IO_IN, 30, receive_data, cb_data);
-		/* TODO: Check malloc return code. */
-		devc->raw_sample_buf = g_try_malloc(devc->limit_samples * 4);
-		if (!devc->raw_sample_buf) {
-			sr_err("ols: %s: devc->raw_sample_buf malloc failed",
-			       __func__);
-			return FALSE;
-		}
-		/* fill with 1010... for debugging */
-		memset(devc->raw_sample_buf, 0x82, devc->limit_samples * 4);
+		sr_session_source_timeout_set(fd, 30);
+		devc->num_runs = 0;
 	}
 
 	num_channels = 0;
@@ -742,81 +1037,26 @@ static int receive_data(int fd, int revents, void *cb_data)
 	}
 
 	if (revents == G_IO_IN) {
-		if (serial_read(devc->serial, &byte, 1) != 1)
+		/* Take everything there is, and decode all complete samples. */
+		buf = devc->read_buf;
+		len = serial_read(devc->serial, buf, devc->read_buf_size);
+		if (len <= 0)
 			return FALSE;
 
-		/* Ignore it if we've read enough. */
-		if (devc->num_samples >= devc->limit_samples)
-			return TRUE;
-
-		devc->sample[devc->num_bytes++] = byte;
-		sr_dbg("ols: received byte 0x%.2x", byte);
-		if (devc->num_bytes == num_channels) {
-			/* Got a full sample. */
-			sr_dbg("ols: received sample 0x%.*x",
-			       devc->num_bytes * 2, *(int *)devc->sample);
-			if (devc->flag_reg & FLAG_RLE) {
-				/*
-				 * In RLE mode -1 should never come in as a
-				 * sample, because bit 31 is the "count" flag.
-				 */
-				if (devc->sample[devc->num_bytes - 1] & 0x80) {
-					devc->sample[devc->num_bytes - 1] &= 0x7f;
-					/*
-					 * FIXME: This will only work on
-					 * little-endian systems.
-					 */
-					devc->rle_count = *(int *)(devc->sample);
-					sr_dbg("ols: RLE count = %d", devc->rle_count);
-					devc->num_bytes = 0;
-					return TRUE;
-				}
-			}
-			devc->num_samples += devc->rle_count + 1;
-			if (devc->num_samples > devc->limit_samples) {
-				/* Save us from overrunning the buffer. */
-				devc->rle_count -= devc->num_samples - devc->limit_samples;
-				devc->num_samples = devc->limit_samples;
-			}
-
-			if (num_channels < 4) {
-				/*
-				 * Some channel groups may have been turned
-				 * off, to speed up transfer between the
-				 * hardware and the PC. Expand that here before
-				 * submitting it over the session bus --
-				 * whatever is listening on the bus will be
-				 * expecting a full 32-bit sample, based on
-				 * the number of probes.
-				 */
-				j = 0;
-				memset(devc->tmp_sample, 0, 4);
-				for (i = 0; i < 4; i++) {
-					if (((devc->flag_reg >> 2) & (1 << i)) == 0) {
-						/*
-						 * This channel group was
-						 * enabled, copy from received
-						 * sample.
-						 */
-						devc->tmp_sample[i] = devc->sample[j++];
-					}
-				}
-				memcpy(devc->sample, devc->tmp_sample, 4);
-				sr_dbg("ols: full sample 0x%.8x", *(int *)devc->sample);
-			}
+		for (p = buf; p < buf + len; p += n) {
+			/* Ignore it if we've read enough. */
+			if (devc->num_samples >= devc->limit_samples)
+				break;
 
-			/* the OLS sends its sample buffer backwards.
-			 * store it in reverse order here, so we can dump
-			 * this on the session bus later.
-			 */
-			offset = (devc->limit_samples - devc->num_samples) * 4;
-			for (i = 0; i <= devc->rle_count; i++) {
-				memcpy(devc->raw_sample_buf + offset + (i * 4),
-				       devc->sample, 4);
+			n = MIN(num_channels - devc->num_bytes, buf + len - p);
+			memcpy(devc->sample + devc->num_bytes, p, n);
+			devc->num_bytes += n;
+			if (devc->num_bytes == num_channels &&
+			    process_sample(devc, num_channels) != SR_OK) {
+				/* Without memory for the runs, give up. */
+				acquisition_finish(sdi);
+				break;
 			}
-			memset(devc->sample, 0, 4);
-			devc->num_bytes = 0;
-			devc->rle_count = 0;
 		}
 	} else {
 		/*
@@ -824,48 +1064,38 @@ static int receive_data(int fd, int revents, void *cb_data)
 		 * we've acquired all the samples we asked for -- we're done.
 		 * Send the (properly-ordered) buffer to the frontend.
 		 */
-		if (devc->trigger_at != -1) {
+		trigger_at = MIN((unsigned int)MAX(devc->trigger_at, 0),
+				 devc->num_samples);
+		offset = devc->limit_samples - devc->num_samples;
+		if (devc->flag_reg & FLAG_RLE) {
+			/* The runs go out as they are, nothing is expanded. */
+			send_all_runs(devc, cb_data, devc->trigger_at != -1,
+				      trigger_at);
+		} else if (devc->trigger_at != -1) {
+			data = devc->raw_sample_buf + offset * devc->unitsize;
+
 			/* a trigger was set up, so we need to tell the frontend
 			 * about it.
 			 */
-			if (devc->trigger_at > 0) {
-				/* there are pre-trigger samples, send those first */
-				packet.type = SR_DF_LOGIC;
-				packet.payload = &logic;
-				logic.length = devc->trigger_at * 4;
-				logic.unitsize = 4;
-				logic.data = devc->raw_sample_buf +
-					(devc->limit_samples - devc->num_samples) * 4;
-				sr_session_send(cb_data, &packet);
-			}
+
+			/* there are pre-trigger samples, send those first */
+			send_samples(devc, cb_data, data, trigger_at);
 
 			/* send the trigger */
 			packet.type = SR_DF_TRIGGER;
+			packet.payload = NULL;
 			sr_session_send(cb_data, &packet);
 
 			/* send post-trigger samples */
-			packet.type = SR_DF_LOGIC;
-			packet.payload = &logic;
-			logic.length = (devc->num_samples * 4) - (devc->trigger_at * 4);
-			logic.unitsize = 4;
-			logic.data = devc->raw_sample_buf + devc->trigger_at * 4 +
-				(devc->limit_samples - devc->num_samples) * 4;
-			sr_session_send(cb_data, &packet);
+			send_samples(devc, cb_data,
+				     data + trigger_at * devc->unitsize,
+				     devc->num_samples - trigger_at);
 		} else {
 			/* no trigger was used */
-			packet.type = SR_DF_LOGIC;
-			packet.payload = &logic;
-			logic.length = devc->num_samples * 4;
-			logic.unitsize = 4;
-			logic.data = devc->raw_sample_buf +
-				(devc->limit_samples - devc->num_samples) * 4;
-			sr_session_send(cb_data, &packet);
+			data = devc->raw_sample_buf + offset * devc->unitsize;
+			send_samples(devc, cb_data, data, devc->num_samples);
 		}
-		g_free(devc->raw_sample_buf);
-
-		serial_flush(devc->serial);
-		abort_acquisition(sdi);
-		serial_close(devc->serial);
+		acquisition_finish(sdi);
 	}
 
 	return TRUE;
@@ -902,10 +1132,12 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	 */
 	changrp_mask = 0;
 	num_channels = 0;
+	devc->unitsize = 0;
 	for (i = 0; i < 4; i++) {
 		if (devc->probe_mask & (0xff << (i * 8))) {
 			changrp_mask |= (1 << i);
 			num_channels++;
+			devc->unitsize = i + 1;
 		}
 	}
 
@@ -994,6 +1226,35 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	if (send_longcommand(devc->serial, CMD_SET_FLAGS, data) != SR_OK)
 		return SR_ERR;
 
+	/*
+	 * Read about 10ms worth of the link at a time (a byte takes ten
+	 * bit times), so that a fast link doesn't take a wakeup per few
+	 * kilobytes.
+	 */
+	devc->read_buf_size = strtoul(devc->serial->serialcomm, NULL, 10)
+			      / 10 / 100;
+	devc->read_buf_size = MIN(MAX(devc->read_buf_size, READ_BUF_SIZE),
+				  MAX_READ_BUF_SIZE);
+	g_free(devc->read_buf);
+	if (!(devc->read_buf = g_try_malloc(devc->read_buf_size))) {
+		sr_err("ols: %s: read buffer malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	/*
+	 * The whole capture is buffered before it's sent, in the right
+	 * order. Fault the buffer in now, not while the samples pour in.
+	 */
+	sr_pool_release(devc->raw_sample_buf, devc->raw_sample_size);
+	devc->raw_sample_buf = NULL;
+	devc->raw_sample_size = devc->limit_samples * devc->unitsize;
+	if (!(devc->flag_reg & FLAG_RLE) &&
+	    !(devc->raw_sample_buf = sr_pool_reserve(devc->raw_sample_size))) {
+		sr_err("ols: %s: devc->raw_sample_buf malloc failed",
+		       __func__);
+		return SR_ERR_MALLOC;
+	}
+
 	/* Start acquisition on the device. */
 	if (send_shortcommand(devc->serial, CMD_RUN) != SR_OK)
 		return SR_ERR;
@@ -1023,7 +1284,7 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	packet->type = SR_DF_META_LOGIC;
 	packet->payload = &meta;
 	meta.samplerate = devc->cur_samplerate;
-	meta.num_probes = NUM_PROBES;
+	meta.num_probes = devc->unitsize * 8;
 	sr_session_send(cb_data, packet);
 
 	g_free(header);
@@ -26,6 +26,9 @@
 #define SERIAL_SPEED           B115200
 #define CLOCK_RATE             SR_MHZ(100)
 #define MIN_NUM_SAMPLES        4
+/* Bytes read from the serial port at a time, at least and at most. */
+#define READ_BUF_SIZE          4096
+#define MAX_READ_BUF_SIZE      (64 * 1024)
 
 /* Command opcodes */
 #define CMD_RESET                  0x00
@@ -86,7 +89,18 @@ struct dev_context {
 	int num_bytes;
 	unsigned char sample[4];
 	unsigned char tmp_sample[4];
+	/* Bytes per sample sent: up to the highest enabled channel group. */
+	int unitsize;
+	/* Reserved when the acquisition starts, see sr_pool_reserve(). */
 	unsigned char *raw_sample_buf;
+	uint64_t raw_sample_size;
+	/* With FLAG_RLE: the runs received, the latest samples first. */
+	struct sr_logic_run *runs;
+	unsigned int num_runs;
+	unsigned int max_runs;
+	/* Sized to the link's speed when the acquisition starts. */
+	unsigned char *read_buf;
+	int read_buf_size;
 
 	struct sr_serial_dev_inst *serial;
 };
@@ -90,62 +90,44 @@ static void handle_packet(const uint8_t *buf, struct dev_context *devc,
 {
 	float floatval;
 	struct sr_datafeed_packet packet;
-	struct sr_datafeed_analog *analog;
+	struct sr_datafeed_analog analog;
 
 	log_dmm_packet(buf);
 
-	if (!(analog = g_try_malloc0(sizeof(struct sr_datafeed_analog)))) {
-		sr_err("Analog packet malloc failed.");
-		return;
-	}
+	memset(&analog, 0, sizeof(struct sr_datafeed_analog));
+	analog.num_samples = 1;
+	analog.mq = -1;
 
-	analog->num_samples = 1;
-	analog->mq = -1;
-
-	dmms[dmm].packet_parse(buf, &floatval, analog, info);
-	analog->data = &floatval;
+	dmms[dmm].packet_parse(buf, &floatval, &analog, info);
+	analog.data = &floatval;
 
 	if (dmms[dmm].dmm_details)
-		dmms[dmm].dmm_details(analog, info);
+		dmms[dmm].dmm_details(&analog, info);
 
-	if (analog->mq != -1) {
+	if (analog.mq != -1) {
 		/* Got a measurement. */
 		packet.type = SR_DF_ANALOG;
-		packet.payload = analog;
+		packet.payload = &analog;
 		sr_session_send(devc->cb_data, &packet);
 		devc->num_samples++;
 	}
-
-	g_free(analog);
 }
 
 static void handle_new_data(struct dev_context *devc, int dmm, void *info)
 {
-	int len, i, offset = 0;
+	const uint8_t *buf;
+	int len;
 
-	/* Try to get as much data as the buffer can hold. */
-	len = DMM_BUFSIZE - devc->buflen;
-	len = serial_read(devc->serial, devc->buf + devc->buflen, len);
-	if (len < 1) {
+	/* Get all the data the port has. */
+	if ((len = serial_fill(devc->serial)) < 0) {
 		sr_err("Serial port read error: %d.", len);
 		return;
 	}
-	devc->buflen += len;
 
 	/* Now look for packets in that data. */
-	while ((devc->buflen - offset) >= dmms[dmm].packet_size) {
-		if (dmms[dmm].packet_valid(devc->buf + offset)) {
-			handle_packet(devc->buf + offset, devc, dmm, info);
-			offset += dmms[dmm].packet_size;
-		} else {
-			offset++;
-		}
-	}
-
-	/* If we have any data left, move it to the beginning of our buffer. */
-	for (i = 0; i < devc->buflen - offset; i++)
-		devc->buf[i] = devc->buf[offset + i];
-	devc->buflen -= offset;
+	while ((buf = serial_get_packet(devc->serial, dmms[dmm].packet_size,
+					dmms[dmm].packet_valid)))
+		handle_packet(buf, devc, dmm, info);
 }
 
 static int receive_data(int fd, int revents, int dmm, void *info, void *cb_data)
@@ -23,11 +23,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "serial-dmm: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 /* Note: When adding entries here, don't forget to update DMM_COUNT. */
 enum {
@@ -61,8 +56,6 @@ struct dmm_info {
 
 SR_PRIV struct dmm_info dmms[DMM_COUNT];
 
-#define DMM_BUFSIZE 256
-
 /** Private, per-device-instance driver context. */
 struct dev_context {
 	/** The current sampling limit (in number of samples). */
@@ -75,10 +68,6 @@ struct dev_context {
 	uint64_t num_samples;
 
 	struct sr_serial_dev_inst *serial;
-
-	uint8_t buf[DMM_BUFSIZE];
-	int bufoffset;
-	int buflen;
 };
 
 SR_PRIV int digitek_dt4000zc_receive_data(int fd, int revents, void *cb_data);
@@ -119,6 +119,7 @@ static GSList *hw_scan(GSList *options)
 		}
 		sdi->priv = devc;
 		sdi->driver = di;
+		devc->dmm = (di == di_ut61d) ? UNI_T_UT61D : VOLTCRAFT_VC820;
 		if (!(probe = sr_probe_new(0, SR_PROBE_ANALOG, TRUE, "P1")))
 			return NULL;
 		sdi->probes = g_slist_append(sdi->probes, probe);
@@ -146,6 +147,7 @@ static int hw_dev_open(struct sr_dev_inst *sdi)
 	struct dev_context *devc;
 
 	devc = sdi->priv;
+	devc->hid_chip_ready = FALSE;
 
 	return sr_usb_open(NULL, devc->usb);
 }
@@ -250,6 +252,7 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	struct sr_datafeed_header header;
 	struct sr_datafeed_meta_analog meta;
 	struct dev_context *devc;
+	int ret;
 
 	devc = sdi->priv;
 
@@ -257,6 +260,10 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 
 	devc->cb_data = cb_data;
 
+	/* Nothing arrives before the session polls the USB event sources. */
+	if ((ret = uni_t_dmm_acquisition_start(sdi)) != SR_OK)
+		return ret;
+
 	/* Send header packet to the session bus. */
 	sr_dbg("Sending SR_DF_HEADER.");
 	packet.type = SR_DF_HEADER;
@@ -272,32 +279,17 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	meta.num_probes = 1;
 	sr_session_send(devc->cb_data, &packet);
 
-	if (!strcmp(di->name, "uni-t-ut61d")) {
-		sr_source_add(0, 0, 10 /* poll_timeout */,
-			      uni_t_ut61d_receive_data, (void *)sdi);
-	} else if (!strcmp(di->name, "voltcraft-vc820")) {
-		sr_source_add(0, 0, 10 /* poll_timeout */,
-			      voltcraft_vc820_receive_data, (void *)sdi);
-	}
-
 	return SR_OK;
 }
 
 static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi, void *cb_data)
 {
-	struct sr_datafeed_packet packet;
-
-	(void)sdi;
+	(void)cb_data;
 
 	sr_dbg("Stopping acquisition.");
 
-	/* Send end packet to the session bus. */
-	sr_dbg("Sending SR_DF_END.");
-	packet.type = SR_DF_END;
-	sr_session_send(cb_data, &packet);
-
-	/* TODO? */
-	sr_source_remove(0);
+	/* SR_DF_END follows once the USB transfer in flight is back. */
+	uni_t_dmm_acquisition_stop(sdi);
 
 	return SR_OK;
 }
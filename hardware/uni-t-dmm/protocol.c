@@ -18,6 +18,7 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <glib.h>
 #include "libsigrok.h"
@@ -177,107 +178,244 @@ static void log_dmm_packet(const uint8_t *buf)
 	       buf[7], buf[8], buf[9], buf[10], buf[11], buf[12], buf[13]);
 }
 
-static int uni_t_dmm_receive_data(int fd, int revents, int dmm, void *cb_data)
+static void handle_chunk(const struct sr_dev_inst *sdi, const uint8_t *buf)
 {
-	struct sr_dev_inst *sdi;
 	struct dev_context *devc;
-	int i, ret, len, num_databytes_in_chunk;
-	uint8_t buf[CHUNK_SIZE];
+	int i, num_databytes_in_chunk;
 	uint8_t *pbuf;
-	static gboolean first_run = TRUE, synced_on_first_packet = FALSE;
-	static uint64_t data_byte_counter = 0;
+	gboolean valid;
 
-	(void)fd;
-	(void)revents;
-
-	sdi = cb_data;
 	devc = sdi->priv;
-
 	pbuf = devc->protocol_buf;
 
-	/* On the first run, we need to init the HID chip. */
-	if (first_run) {
-		/* TODO: The baudrate is DMM-specific (UT61D: 19230). */
-		if ((ret = hid_chip_init(devc, 19230)) != SR_OK) {
-			sr_err("HID chip init failed: %d.", ret);
-			return FALSE;
+	log_8byte_chunk(buf);
+
+	if (buf[0] == 0xf0)
+		return;
+
+	/* First time: Synchronize to the start of a packet. */
+	if (!devc->synced_on_first_packet) {
+		if (devc->dmm == UNI_T_UT61D) {
+			/* Valid packets start with '+' or '-'. */
+			if ((buf[1] != '+') && buf[1] != '-')
+				return;
+		} else if (devc->dmm == VOLTCRAFT_VC820) {
+			/* Valid packets have 0x1 as high nibble. */
+			if (!sr_fs9721_is_packet_start(buf[1]))
+				return;
+		}
+		devc->synced_on_first_packet = TRUE;
+		sr_spew("Successfully synchronized on first packet.");
+	}
+
+	num_databytes_in_chunk = buf[0] & 0x0f;
+	for (i = 0; i < num_databytes_in_chunk; i++) {
+		/* A chunk may not overrun the packet; resync if it does. */
+		if (devc->data_byte_counter == NUM_DATA_BYTES) {
+			sr_err("Packet overrun, resynchronizing.");
+			devc->data_byte_counter = 0;
+			devc->synced_on_first_packet = FALSE;
+			return;
+		}
+		pbuf[devc->data_byte_counter++] = buf[1 + i];
+	}
+
+	if (devc->data_byte_counter == NUM_DATA_BYTES) {
+		log_dmm_packet(pbuf);
+		devc->data_byte_counter = 0;
+		if (devc->dmm == UNI_T_UT61D)
+			valid = sr_fs9922_packet_valid(pbuf);
+		else
+			valid = sr_fs9721_packet_valid(pbuf);
+		if (!valid) {
+			sr_err("Invalid packet.");
+			return;
 		}
+		decode_packet(devc, devc->dmm, pbuf);
 		memset(pbuf, 0x00, NUM_DATA_BYTES);
-		first_run = FALSE;
 	}
+}
 
-	memset(&buf, 0x00, CHUNK_SIZE);
+/*
+ * All devices handled by this driver share the libusb context's fds as
+ * event sources. They're added when the first device starts acquiring,
+ * and removed when the last one is done.
+ */
+static int num_acquiring = 0;
 
-	/* Get data from EP2 using an interrupt transfer. */
-	ret = libusb_interrupt_transfer(
-		devc->usb->devhdl, /* libusb device handle */
-		LIBUSB_ENDPOINT_IN | 2, /* EP2, IN */
-		(unsigned char *)&buf, /* receive buffer */
-		CHUNK_SIZE, /* wLength */
-		&len, /* actually received byte count */
-		1000 /* timeout (ms) */);
+static int handle_events(int fd, int revents, void *cb_data)
+{
+	struct timeval tv;
 
-	if (ret < 0) {
-		sr_err("USB receive error: %s.", libusb_error_name(ret));
-		return FALSE;
-	}
+	(void)fd;
+	(void)revents;
 
-	if (len != CHUNK_SIZE) {
-		sr_err("Short packet: received %d/%d bytes.", len, CHUNK_SIZE);
-		/* TODO: Print the bytes? */
-		return FALSE;
-	}
+	memset(&tv, 0, sizeof(struct timeval));
+	libusb_handle_events_timeout_completed(cb_data, &tv, NULL);
 
-	log_8byte_chunk((const uint8_t *)&buf);
-
-	if (buf[0] != 0xf0) {
-		/* First time: Synchronize to the start of a packet. */
-		if (!synced_on_first_packet) {
-			if (dmm == UNI_T_UT61D) {
-				/* Valid packets start with '+' or '-'. */
-				if ((buf[1] != '+') && buf[1] != '-')
-					return TRUE;
-			} else if (dmm == VOLTCRAFT_VC820) {
-				/* Valid packets have 0x1 as high nibble. */
-				if (!sr_fs9721_is_packet_start(buf[1]))
-					return TRUE;
-			}
-			synced_on_first_packet = TRUE;
-			sr_spew("Successfully synchronized on first packet.");
-		}
+	return TRUE;
+}
+
+static void events_add(libusb_context *ctx)
+{
+	const struct libusb_pollfd **lupfd;
+	int i;
+
+	if (num_acquiring++ > 0)
+		return;
+
+	lupfd = libusb_get_pollfds(ctx);
+	/* Handle USB events every 100ms, for decent latency. */
+	for (i = 0; lupfd[i]; i++)
+		sr_source_add(lupfd[i]->fd, lupfd[i]->events, 100,
+			      handle_events, ctx);
+	free(lupfd); /* NOT g_free()! */
+}
+
+static void events_remove(libusb_context *ctx)
+{
+	const struct libusb_pollfd **lupfd;
+	int i;
+
+	if (--num_acquiring > 0)
+		return;
+
+	lupfd = libusb_get_pollfds(ctx);
+	for (i = 0; lupfd[i]; i++)
+		sr_source_remove(lupfd[i]->fd);
+	free(lupfd); /* NOT g_free()! */
+}
+
+/* The transfer is back for good: end this device's acquisition. */
+static void acquisition_finish(const struct sr_dev_inst *sdi)
+{
+	struct sr_datafeed_packet packet;
+	struct drv_context *drvc;
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+	drvc = sdi->driver->priv;
 
-		num_databytes_in_chunk = buf[0] & 0x0f;
-		for (i = 0; i < num_databytes_in_chunk; i++)
-			pbuf[data_byte_counter++] = buf[1 + i];
-
-		/* TODO: Handle > 14 bytes in pbuf? Can this happen? */
-		if (data_byte_counter == NUM_DATA_BYTES) {
-			log_dmm_packet(pbuf);
-			data_byte_counter = 0;
-			if (!sr_fs9721_packet_valid(pbuf)) {
-				sr_err("Invalid packet.");
-				return TRUE;
-			}
-			decode_packet(devc, dmm, pbuf);
-			memset(pbuf, 0x00, NUM_DATA_BYTES);
+	libusb_free_transfer(devc->transfer);
+	devc->transfer = NULL;
+
+	/* Send end packet to the session bus. */
+	sr_dbg("Sending SR_DF_END.");
+	packet.type = SR_DF_END;
+	sr_session_send(devc->cb_data, &packet);
+
+	events_remove(drvc->sr_ctx->libusb_ctx);
+}
+
+static void receive_transfer(struct libusb_transfer *transfer)
+{
+	const struct sr_dev_inst *sdi;
+	struct dev_context *devc;
+	int ret;
+
+	sdi = transfer->user_data;
+	devc = sdi->priv;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		if (transfer->actual_length != CHUNK_SIZE) {
+			sr_err("Short packet: received %d/%d bytes.",
+			       transfer->actual_length, CHUNK_SIZE);
+			break;
 		}
+		if (!devc->stopping)
+			handle_chunk(sdi, transfer->buffer);
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_CANCELLED:
+		break;
+	default:
+		sr_err("USB receive error: %d.", transfer->status);
+		devc->stopping = TRUE;
+		break;
 	}
 
 	/* Abort acquisition if we acquired enough samples. */
-	if (devc->num_samples >= devc->limit_samples && devc->limit_samples > 0) {
+	if (devc->num_samples >= devc->limit_samples && devc->limit_samples > 0
+			&& !devc->stopping) {
 		sr_info("Requested number of samples reached.");
-		sdi->driver->dev_acquisition_stop(sdi, cb_data);
+		devc->stopping = TRUE;
 	}
 
-	return TRUE;
+	if (devc->stopping) {
+		acquisition_finish(sdi);
+		return;
+	}
+
+	/* Get the next chunk from EP2. */
+	if ((ret = libusb_submit_transfer(transfer)) != 0) {
+		sr_err("Unable to resubmit transfer: %s.",
+		       libusb_error_name(ret));
+		acquisition_finish(sdi);
+	}
 }
 
-SR_PRIV int uni_t_ut61d_receive_data(int fd, int revents, void *cb_data)
+SR_PRIV int uni_t_dmm_acquisition_start(const struct sr_dev_inst *sdi)
 {
-	return uni_t_dmm_receive_data(fd, revents, UNI_T_UT61D, cb_data);
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	int ret;
+
+	devc = sdi->priv;
+	drvc = sdi->driver->priv;
+
+	if (devc->transfer) {
+		sr_err("Acquisition still running.");
+		return SR_ERR;
+	}
+
+	/* Once per open, we need to init the HID chip. */
+	if (!devc->hid_chip_ready) {
+		/* TODO: The baudrate is DMM-specific (UT61D: 19230). */
+		if ((ret = hid_chip_init(devc, 19230)) != SR_OK) {
+			sr_err("HID chip init failed: %d.", ret);
+			return SR_ERR;
+		}
+		devc->hid_chip_ready = TRUE;
+	}
+
+	devc->stopping = FALSE;
+	devc->synced_on_first_packet = FALSE;
+	devc->data_byte_counter = 0;
+	memset(devc->protocol_buf, 0x00, NUM_DATA_BYTES);
+
+	if (!(devc->transfer = libusb_alloc_transfer(0))) {
+		sr_err("USB transfer malloc failed.");
+		return SR_ERR_MALLOC;
+	}
+
+	/* Get data from EP2 using interrupt transfers. */
+	libusb_fill_interrupt_transfer(devc->transfer, devc->usb->devhdl,
+			LIBUSB_ENDPOINT_IN | 2, devc->chunk, CHUNK_SIZE,
+			receive_transfer, (void *)sdi, CHUNK_TIMEOUT);
+	if ((ret = libusb_submit_transfer(devc->transfer)) != 0) {
+		sr_err("Unable to submit transfer: %s.",
+		       libusb_error_name(ret));
+		libusb_free_transfer(devc->transfer);
+		devc->transfer = NULL;
+		return SR_ERR;
+	}
+
+	events_add(drvc->sr_ctx->libusb_ctx);
+
+	return SR_OK;
 }
 
-SR_PRIV int voltcraft_vc820_receive_data(int fd, int revents, void *cb_data)
+SR_PRIV void uni_t_dmm_acquisition_stop(const struct sr_dev_inst *sdi)
 {
-	return uni_t_dmm_receive_data(fd, revents, VOLTCRAFT_VC820, cb_data);
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+
+	if (!devc->transfer || devc->stopping)
+		return;
+
+	/* SR_DF_END is sent when the cancelled transfer comes back. */
+	devc->stopping = TRUE;
+	libusb_cancel_transfer(devc->transfer);
 }
@@ -30,11 +30,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "uni-t-dmm: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 enum {
 	UNI_T_UT61D,
@@ -47,6 +42,9 @@ enum {
 #define CHUNK_SIZE		8
 #define NUM_DATA_BYTES		14
 
+/* Timeout of each interrupt transfer (ms); it's resubmitted on timeout. */
+#define CHUNK_TIMEOUT		1000
+
 /** Private, per-device-instance driver context. */
 struct dev_context {
 	/** The current sampling limit (in number of samples). */
@@ -63,10 +61,27 @@ struct dev_context {
 
 	struct sr_usb_dev_inst *usb;
 
-	uint8_t protocol_buf[14];
+	/** Which DMM this is (UNI_T_UT61D, VOLTCRAFT_VC820, ...). */
+	int dmm;
+
+	/** The HID chip in the cable has been set up since dev_open(). */
+	gboolean hid_chip_ready;
+
+	/** The interrupt transfer in flight, NULL if none. */
+	struct libusb_transfer *transfer;
+	uint8_t chunk[CHUNK_SIZE];
+
+	/** Acquisition is to stop once the transfer in flight is back. */
+	gboolean stopping;
+
+	/** The first packet's start was found in the data stream. */
+	gboolean synced_on_first_packet;
+
+	uint8_t protocol_buf[NUM_DATA_BYTES];
+	int data_byte_counter;
 };
 
-SR_PRIV int uni_t_ut61d_receive_data(int fd, int revents, void *cb_data);
-SR_PRIV int voltcraft_vc820_receive_data(int fd, int revents, void *cb_data);
+SR_PRIV int uni_t_dmm_acquisition_start(const struct sr_dev_inst *sdi);
+SR_PRIV void uni_t_dmm_acquisition_stop(const struct sr_dev_inst *sdi);
 
 #endif
@@ -90,16 +90,47 @@ static int hw_init(struct sr_context *sr_ctx)
 	return SR_OK;
 }
 
-static GSList *hw_scan(GSList *options)
+/* Add an instance for the device at bus.address. */
+static struct sr_dev_inst *dev_inst_new(uint8_t bus, uint8_t address)
 {
 	struct drv_context *drvc;
 	struct dev_context *devc;
 	struct sr_dev_inst *sdi;
 	struct sr_probe *probe;
+	int devcnt;
+
+	drvc = di->priv;
+
+	devcnt = g_slist_length(drvc->instances);
+	if (!(sdi = sr_dev_inst_new(devcnt, SR_ST_INACTIVE,
+			VICTOR_VENDOR, NULL, NULL)))
+		return NULL;
+	sdi->driver = di;
+
+	if (!(devc = g_try_malloc0(sizeof(struct dev_context))))
+		return NULL;
+	sdi->priv = devc;
+
+	if (!(probe = sr_probe_new(0, SR_PROBE_ANALOG, TRUE, "P1")))
+		return NULL;
+	sdi->probes = g_slist_append(NULL, probe);
+
+	if (!(devc->usb = sr_usb_dev_inst_new(bus, address, NULL)))
+		return NULL;
+
+	drvc->instances = g_slist_append(drvc->instances, sdi);
+
+	return sdi;
+}
+
+static GSList *hw_scan(GSList *options)
+{
+	struct drv_context *drvc;
+	struct sr_dev_inst *sdi;
 	struct libusb_device_descriptor des;
 	libusb_device **devlist;
 	GSList *devices;
-	int ret, devcnt, i;
+	int ret, i;
 
 	(void)options;
 
@@ -112,9 +143,10 @@ static GSList *hw_scan(GSList *options)
 	clear_instances();
 
 	devices = NULL;
-	libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
+	sr_usb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
 	for (i = 0; devlist[i]; i++) {
-		if ((ret = libusb_get_device_descriptor(devlist[i], &des)) != 0) {
+		if ((ret = sr_usb_get_device_descriptor(devlist[i],
+				&des)) != 0) {
 			sr_warn("Failed to get device descriptor: %s",
 					libusb_error_name(ret));
 			continue;
@@ -123,30 +155,79 @@ static GSList *hw_scan(GSList *options)
 		if (des.idVendor != VICTOR_VID || des.idProduct != VICTOR_PID)
 			continue;
 
-		devcnt = g_slist_length(drvc->instances);
-		if (!(sdi = sr_dev_inst_new(devcnt, SR_ST_INACTIVE,
-				VICTOR_VENDOR, NULL, NULL)))
+		if (!(sdi = dev_inst_new(libusb_get_bus_number(devlist[i]),
+				libusb_get_device_address(devlist[i]))))
 			return NULL;
-		sdi->driver = di;
+		devices = g_slist_append(devices, sdi);
+	}
+	libusb_free_device_list(devlist, 1);
 
-		if (!(devc = g_try_malloc0(sizeof(struct dev_context))))
-			return NULL;
-		sdi->priv = devc;
+	return devices;
+}
 
-		if (!(probe = sr_probe_new(0, SR_PROBE_ANALOG, TRUE, "P1")))
-			return NULL;
-		sdi->probes = g_slist_append(NULL, probe);
+/* The device list entry of the instance at bus.address, if any. */
+static GSList *find_instance(uint8_t bus, uint8_t address)
+{
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	struct sr_dev_inst *sdi;
+	GSList *l;
 
-		if (!(devc->usb = sr_usb_dev_inst_new(libusb_get_bus_number(devlist[i]),
-				libusb_get_device_address(devlist[i]), NULL)))
-			return NULL;
+	drvc = di->priv;
+	for (l = drvc->instances; l; l = l->next) {
+		sdi = l->data;
+		devc = sdi->priv;
+		if (devc->usb->bus == bus && devc->usb->address == address)
+			return l;
+	}
 
-		drvc->instances = g_slist_append(drvc->instances, sdi);
-		devices = g_slist_append(devices, sdi);
+	return NULL;
+}
+
+static void hw_usb_arrived(uint16_t vid, uint16_t pid, uint8_t bus,
+		uint8_t address)
+{
+	struct drv_context *drvc;
+	struct sr_dev_inst *sdi;
+
+	if (vid != VICTOR_VID || pid != VICTOR_PID)
+		return;
+
+	/* A scan may have found it already. */
+	if (find_instance(bus, address))
+		return;
+
+	drvc = di->priv;
+	if (!(sdi = dev_inst_new(bus, address)))
+		return;
+	sr_hotplug_post(drvc->sr_ctx, SR_HOTPLUG_ARRIVED, sdi);
+}
+
+static void hw_usb_left(uint8_t bus, uint8_t address)
+{
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	struct sr_dev_inst *sdi;
+	GSList *l;
+
+	if (!(l = find_instance(bus, address)))
+		return;
+
+	drvc = di->priv;
+	sdi = l->data;
+	devc = sdi->priv;
+	sr_hotplug_post(drvc->sr_ctx, SR_HOTPLUG_LEFT, sdi);
+
+	if (sdi->status == SR_ST_ACTIVE || sdi->status == SR_ST_STOPPING) {
+		/* Its transfer still points to it; the next scan frees it. */
+		sr_dbg("Unplugged device is still in use.");
+		return;
 	}
-	libusb_free_device_list(devlist, 1);
 
-	return devices;
+	drvc->instances = g_slist_delete_link(drvc->instances, l);
+	hw_dev_close(sdi);
+	sr_usb_dev_inst_free(devc->usb);
+	sr_dev_inst_free(sdi);
 }
 
 static GSList *hw_dev_list(void)
@@ -174,7 +255,7 @@ static int hw_dev_open(struct sr_dev_inst *sdi)
 	}
 
 	devc = sdi->priv;
-	libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
+	sr_usb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
 	for (i = 0; devlist[i]; i++) {
 		if (libusb_get_bus_number(devlist[i]) != devc->usb->bus
 				|| libusb_get_device_address(devlist[i]) != devc->usb->address)
@@ -490,5 +571,7 @@ SR_PRIV struct sr_dev_driver victor_dmm_driver_info = {
 	.dev_config_set = hw_dev_config_set,
 	.dev_acquisition_start = hw_dev_acquisition_start,
 	.dev_acquisition_stop = hw_dev_acquisition_stop,
+	.usb_arrived = hw_usb_arrived,
+	.usb_left = hw_usb_left,
 	.priv = NULL,
 };
@@ -30,6 +30,7 @@
  */
 
 #include <assert.h>
+#include <string.h>
 #include "analyzer.h"
 #include "gl_usb.h"
 #include "libsigrok-internal.h"
@@ -105,17 +106,17 @@ enum {
 	READ_RAM_STATUS			= 0xa0,
 };
 
-static int g_trigger_status[9] = { 0 };
-static int g_trigger_count = 1;
-static int g_filter_status[8] = { 0 };
-static int g_filter_enable = 0;
-
-static int g_freq_value = 1;
-static int g_freq_scale = FREQ_SCALE_MHZ;
-static int g_memory_size = MEMORY_SIZE_8K;
-static int g_ramsize_triggerbar_addr = 2 * 1024;
-static int g_triggerbar_addr = 0;
-static int g_compression = COMPRESSION_NONE;
+SR_PRIV void analyzer_config_init(struct analyzer_config *cfg)
+{
+	memset(cfg, 0, sizeof(struct analyzer_config));
+	cfg->trigger_count = 1;
+	cfg->freq_value = 1;
+	cfg->freq_scale = FREQ_SCALE_MHZ;
+	cfg->memory_size = MEMORY_SIZE_8K;
+	cfg->ramsize_triggerbar_addr = 2 * 1024;
+	cfg->triggerbar_addr = 0;
+	cfg->compression = COMPRESSION_NONE;
+}
 
 /* Maybe unk specifies an "endpoint" or "register" of sorts. */
 static int analyzer_write_status(libusb_device_handle *devh, unsigned char unk,
@@ -375,12 +376,13 @@ static void analyzer_write_enable_insert_data(libusb_device_handle *devh)
 	gl_reg_write(devh, ENABLE_INSERT_DATA3, 0x78);
 }
 
-static void analyzer_set_filter(libusb_device_handle *devh)
+static void analyzer_set_filter(libusb_device_handle *devh,
+			       const struct analyzer_config *cfg)
 {
 	int i;
-	gl_reg_write(devh, FILTER_ENABLE, g_filter_enable);
+	gl_reg_write(devh, FILTER_ENABLE, cfg->filter_enable);
 	for (i = 0; i < 8; i++)
-		gl_reg_write(devh, FILTER_STATUS + i, g_filter_status[i]);
+		gl_reg_write(devh, FILTER_STATUS + i, cfg->filter_status[i]);
 }
 
 SR_PRIV void analyzer_reset(libusb_device_handle *devh)
@@ -422,6 +424,22 @@ SR_PRIV int analyzer_read_data(libusb_device_handle *devh, void *buffer,
 	return gl_read_bulk(devh, buffer, size);
 }
 
+SR_PRIV int analyzer_read_request(libusb_device_handle *devh,
+				  unsigned int size)
+{
+	return gl_read_bulk_request(devh, size);
+}
+
+SR_PRIV void analyzer_fill_read_transfer(struct libusb_transfer *transfer,
+					 libusb_device_handle *devh,
+					 void *buffer, unsigned int size,
+					 libusb_transfer_cb_fn callback,
+					 void *user_data)
+{
+	gl_fill_bulk_transfer(transfer, devh, buffer, size, callback,
+			      user_data);
+}
+
 SR_PRIV void analyzer_read_stop(libusb_device_handle *devh)
 {
 	analyzer_write_status(devh, 3, STATUS_FLAG_20);
@@ -436,7 +454,8 @@ SR_PRIV void analyzer_start(libusb_device_handle *devh)
 	analyzer_write_status(devh, 1, STATUS_FLAG_GO);
 }
 
-SR_PRIV void analyzer_configure(libusb_device_handle *devh)
+SR_PRIV void analyzer_configure(libusb_device_handle *devh,
+				const struct analyzer_config *cfg)
 {
 	int i;
 
@@ -449,19 +468,19 @@ SR_PRIV void analyzer_configure(libusb_device_handle *devh)
 	analyzer_write_status(devh, 1, STATUS_FLAG_NONE);
 
 	/* SetData_To_Frequence_Reg */
-	__analyzer_set_freq(devh, g_freq_value, g_freq_scale);
+	__analyzer_set_freq(devh, cfg->freq_value, cfg->freq_scale);
 
 	/* SetMemory_Length */
-	gl_reg_write(devh, MEMORY_LENGTH, g_memory_size);
+	gl_reg_write(devh, MEMORY_LENGTH, cfg->memory_size);
 
 	/* Sele_Inside_Outside_Clock */
 	gl_reg_write(devh, CLOCK_SOURCE, 0x03);
 
 	/* Set_Trigger_Status */
 	for (i = 0; i < 9; i++)
-		gl_reg_write(devh, TRIGGER_STATUS0 + i, g_trigger_status[i]);
+		gl_reg_write(devh, TRIGGER_STATUS0 + i, cfg->trigger_status[i]);
 
-	__analyzer_set_trigger_count(devh, g_trigger_count);
+	__analyzer_set_trigger_count(devh, cfg->trigger_count);
 
 	/* Set_Trigger_Level */
 	gl_reg_write(devh, TRIGGER_LEVEL0, 0x31);
@@ -470,43 +489,45 @@ SR_PRIV void analyzer_configure(libusb_device_handle *devh)
 	gl_reg_write(devh, TRIGGER_LEVEL3, 0x31);
 
 	/* Size of actual memory >> 2 */
-	__analyzer_set_ramsize_trigger_address(devh, g_ramsize_triggerbar_addr);
-	__analyzer_set_triggerbar_address(devh, g_triggerbar_addr);
+	__analyzer_set_ramsize_trigger_address(devh,
+					       cfg->ramsize_triggerbar_addr);
+	__analyzer_set_triggerbar_address(devh, cfg->triggerbar_addr);
 
 	/* Set_Dont_Care_TriggerBar */
-	if (g_triggerbar_addr)
+	if (cfg->triggerbar_addr)
 		gl_reg_write(devh, DONT_CARE_TRIGGERBAR, 0x00);
 	else
 		gl_reg_write(devh, DONT_CARE_TRIGGERBAR, 0x01);
 
 	/* Enable_Status */
-	analyzer_set_filter(devh);
+	analyzer_set_filter(devh, cfg);
 
 	/* Set_Enable_Delay_Time */
 	gl_reg_write(devh, 0x7a, 0x00);
 	gl_reg_write(devh, 0x7b, 0x00);
 	analyzer_write_enable_insert_data(devh);
-	__analyzer_set_compression(devh, g_compression);
+	__analyzer_set_compression(devh, cfg->compression);
 }
 
-SR_PRIV void analyzer_add_trigger(int channel, int type)
+SR_PRIV void analyzer_add_trigger(struct analyzer_config *cfg, int channel,
+				  int type)
 {
 	switch (type) {
 	case TRIGGER_HIGH:
-		g_trigger_status[channel / 4] |= 1 << (channel % 4 * 2);
+		cfg->trigger_status[channel / 4] |= 1 << (channel % 4 * 2);
 		break;
 	case TRIGGER_LOW:
-		g_trigger_status[channel / 4] |= 2 << (channel % 4 * 2);
+		cfg->trigger_status[channel / 4] |= 2 << (channel % 4 * 2);
 		break;
 #if 0
 	case TRIGGER_POSEDGE:
-		g_trigger_status[8] = 0x40 | channel;
+		cfg->trigger_status[8] = 0x40 | channel;
 		break;
 	case TRIGGER_NEGEDGE:
-		g_trigger_status[8] = 0x80 | channel;
+		cfg->trigger_status[8] = 0x80 | channel;
 		break;
 	case TRIGGER_ANYEDGE:
-		g_trigger_status[8] = 0xc0 | channel;
+		cfg->trigger_status[8] = 0xc0 | channel;
 		break;
 #endif
 	default:
@@ -514,7 +535,8 @@ SR_PRIV void analyzer_add_trigger(int channel, int type)
 	}
 }
 
-SR_PRIV void analyzer_add_filter(int channel, int type)
+SR_PRIV void analyzer_add_filter(struct analyzer_config *cfg, int channel,
+				 int type)
 {
 	int i;
 
@@ -539,36 +561,41 @@ SR_PRIV void analyzer_add_filter(int channel, int type)
 		channel -= 4;
 	}
 
-	g_filter_status[i] |=
+	cfg->filter_status[i] |=
 	    1 << ((2 * channel) + (type == FILTER_LOW ? 1 : 0));
 
-	g_filter_enable = 1;
+	cfg->filter_enable = 1;
 }
 
-SR_PRIV void analyzer_set_trigger_count(int count)
+SR_PRIV void analyzer_set_trigger_count(struct analyzer_config *cfg,
+					int count)
 {
-	g_trigger_count = count;
+	cfg->trigger_count = count;
 }
 
-SR_PRIV void analyzer_set_freq(int freq, int scale)
+SR_PRIV void analyzer_set_freq(struct analyzer_config *cfg, int freq,
+			       int scale)
 {
-	g_freq_value = freq;
-	g_freq_scale = scale;
+	cfg->freq_value = freq;
+	cfg->freq_scale = scale;
 }
 
-SR_PRIV void analyzer_set_memory_size(unsigned int size)
+SR_PRIV void analyzer_set_memory_size(struct analyzer_config *cfg,
+				      unsigned int size)
 {
-	g_memory_size = size;
+	cfg->memory_size = size;
 }
 
-SR_PRIV void analyzer_set_ramsize_trigger_address(unsigned int address)
+SR_PRIV void analyzer_set_ramsize_trigger_address(struct analyzer_config *cfg,
+						  unsigned int address)
 {
-	g_ramsize_triggerbar_addr = address;
+	cfg->ramsize_triggerbar_addr = address;
 }
 
-SR_PRIV void analyzer_set_triggerbar_address(unsigned int address)
+SR_PRIV void analyzer_set_triggerbar_address(struct analyzer_config *cfg,
+					     unsigned int address)
 {
-	g_triggerbar_addr = address;
+	cfg->triggerbar_addr = address;
 }
 
 SR_PRIV unsigned int analyzer_read_status(libusb_device_handle *devh)
@@ -599,9 +626,10 @@ SR_PRIV unsigned int analyzer_get_trigger_address(libusb_device_handle *devh)
 		TRIGGER_ADDRESS1) << 8 | gl_reg_read(devh, TRIGGER_ADDRESS0);
 }
 
-SR_PRIV void analyzer_set_compression(unsigned int type)
+SR_PRIV void analyzer_set_compression(struct analyzer_config *cfg,
+				      unsigned int type)
 {
-	g_compression = type;
+	cfg->compression = type;
 }
 
 SR_PRIV void analyzer_wait_button(libusb_device_handle *devh)
@@ -614,36 +642,92 @@ SR_PRIV void analyzer_wait_data(libusb_device_handle *devh)
 	analyzer_wait(devh, STATUS_READY | 8, STATUS_BUSY);
 }
 
+/* Non-blocking version of analyzer_wait_data(). */
+SR_PRIV int analyzer_has_data(libusb_device_handle *devh)
+{
+	int status;
+
+	status = gl_reg_read(devh, DEV_STATUS);
+	return status >= 0 && (status & (STATUS_READY | 8)) &&
+	       (status & STATUS_BUSY) == 0;
+}
+
+/*
+ * With compression enabled, the sample memory holds 32-bit little-endian
+ * words, of which the lower three bytes are the value of channels A-C, and
+ * the top byte is the number of samples with that value, minus one.
+ */
+#define COMPRESSED_VALUE(w)	((w) & 0x00ffffff)
+#define COMPRESSED_COUNT(w)	(((w) >> 24) + 1)
+
+static uint32_t compressed_word(const unsigned char *in)
+{
+	return in[0] | in[1] << 8 | in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
 SR_PRIV int analyzer_decompress(void *input, unsigned int input_len,
 				void *output, unsigned int output_len)
 {
-	unsigned char *in = input;
+	const unsigned char *in = input;
 	unsigned char *out = output;
-	unsigned int A, B, C, count;
+	unsigned char sample[4];
+	uint32_t word, value;
+	unsigned int count, i;
 	unsigned int written = 0;
 
-	while (input_len > 0) {
-		A = *in++;
-		B = *in++;
-		C = *in++;
-		count = (*in++) + 1;
-
-		if (count > output_len)
-			count = output_len;
+	for (; input_len >= 4 && output_len > 0; input_len -= 4, in += 4) {
+		word = compressed_word(in);
+		count = MIN(COMPRESSED_COUNT(word), output_len);
 		output_len -= count;
 		written += count;
 
-		while (count--) {
-			*out++ = A;
-			*out++ = B;
-			*out++ = C;
-			*out++ = 0; /* Channel D */
-		}
-
-		input_len -= 4;
-		if (output_len == 0)
-			break;
+		/* Channel D is always 0. */
+		value = COMPRESSED_VALUE(word);
+		sample[0] = value & 0xff;
+		sample[1] = (value >> 8) & 0xff;
+		sample[2] = value >> 16;
+		sample[3] = 0;
+		for (i = 0; i < count; i++, out += 4)
+			memcpy(out, sample, 4);
 	}
 
 	return written;
 }
+
+/*
+ * Decode compressed sample memory into runs, joining consecutive words
+ * with the same value. At most 'max_samples' samples are decoded; the
+ * number decoded is stored in 'num_samples'. 'runs' must have room for
+ * input_len / 4 runs. Returns the number of runs.
+ */
+SR_PRIV unsigned int analyzer_decompress_runs(const void *input,
+					      unsigned int input_len,
+					      struct sr_logic_run *runs,
+					      uint64_t max_samples,
+					      uint64_t *num_samples)
+{
+	const unsigned char *in = input;
+	uint64_t samples = 0, count;
+	uint32_t word, value;
+	unsigned int n = 0;
+
+	for (; input_len >= 4 && samples < max_samples;
+	     input_len -= 4, in += 4) {
+		word = compressed_word(in);
+		value = COMPRESSED_VALUE(word);
+		count = MIN(COMPRESSED_COUNT(word), max_samples - samples);
+		samples += count;
+
+		if (n > 0 && runs[n - 1].value == value) {
+			runs[n - 1].length += count;
+		} else {
+			runs[n].value = value;
+			runs[n].length = count;
+			n++;
+		}
+	}
+
+	*num_samples = samples;
+
+	return n;
+}
@@ -76,14 +76,40 @@ enum {
 	TRIGGER_ANYEDGE,
 };
 
-SR_PRIV void analyzer_set_freq(int freq, int scale);
-SR_PRIV void analyzer_set_ramsize_trigger_address(unsigned int address);
-SR_PRIV void analyzer_set_triggerbar_address(unsigned int address);
-SR_PRIV void analyzer_set_compression(unsigned int type);
-SR_PRIV void analyzer_set_memory_size(unsigned int size);
-SR_PRIV void analyzer_add_trigger(int channel, int type);
-SR_PRIV void analyzer_set_trigger_count(int count);
-SR_PRIV void analyzer_add_filter(int channel, int type);
+/*
+ * The settings analyzer_configure() writes to the device. Each device
+ * has its own, so several devices can be used at the same time.
+ */
+struct analyzer_config {
+	int trigger_status[9];
+	int trigger_count;
+	int filter_status[8];
+	int filter_enable;
+	int freq_value;
+	int freq_scale;
+	int memory_size;
+	int ramsize_triggerbar_addr;
+	int triggerbar_addr;
+	int compression;
+};
+
+SR_PRIV void analyzer_config_init(struct analyzer_config *cfg);
+SR_PRIV void analyzer_set_freq(struct analyzer_config *cfg, int freq,
+			       int scale);
+SR_PRIV void analyzer_set_ramsize_trigger_address(struct analyzer_config *cfg,
+						  unsigned int address);
+SR_PRIV void analyzer_set_triggerbar_address(struct analyzer_config *cfg,
+					     unsigned int address);
+SR_PRIV void analyzer_set_compression(struct analyzer_config *cfg,
+				      unsigned int type);
+SR_PRIV void analyzer_set_memory_size(struct analyzer_config *cfg,
+				      unsigned int size);
+SR_PRIV void analyzer_add_trigger(struct analyzer_config *cfg, int channel,
+				  int type);
+SR_PRIV void analyzer_set_trigger_count(struct analyzer_config *cfg,
+					int count);
+SR_PRIV void analyzer_add_filter(struct analyzer_config *cfg, int channel,
+				 int type);
 
 SR_PRIV unsigned int analyzer_read_status(libusb_device_handle *devh);
 SR_PRIV unsigned int analyzer_read_id(libusb_device_handle *devh);
@@ -92,6 +118,11 @@ SR_PRIV unsigned int analyzer_get_now_address(libusb_device_handle *devh);
 SR_PRIV unsigned int analyzer_get_trigger_address(libusb_device_handle *devh);
 SR_PRIV int analyzer_decompress(void *input, unsigned int input_len,
 				void *output, unsigned int output_len);
+SR_PRIV unsigned int analyzer_decompress_runs(const void *input,
+					      unsigned int input_len,
+					      struct sr_logic_run *runs,
+					      uint64_t max_samples,
+					      uint64_t *num_samples);
 
 SR_PRIV void analyzer_reset(libusb_device_handle *devh);
 SR_PRIV void analyzer_initialize(libusb_device_handle *devh);
@@ -99,11 +130,20 @@ SR_PRIV void analyzer_wait(libusb_device_handle *devh, int set, int unset);
 SR_PRIV void analyzer_read_start(libusb_device_handle *devh);
 SR_PRIV int analyzer_read_data(libusb_device_handle *devh, void *buffer,
 			       unsigned int size);
+SR_PRIV int analyzer_read_request(libusb_device_handle *devh,
+				  unsigned int size);
+SR_PRIV void analyzer_fill_read_transfer(struct libusb_transfer *transfer,
+					 libusb_device_handle *devh,
+					 void *buffer, unsigned int size,
+					 libusb_transfer_cb_fn callback,
+					 void *user_data);
 SR_PRIV void analyzer_read_stop(libusb_device_handle *devh);
 SR_PRIV void analyzer_start(libusb_device_handle *devh);
-SR_PRIV void analyzer_configure(libusb_device_handle *devh);
+SR_PRIV void analyzer_configure(libusb_device_handle *devh,
+				const struct analyzer_config *cfg);
 
 SR_PRIV void analyzer_wait_button(libusb_device_handle *devh);
 SR_PRIV void analyzer_wait_data(libusb_device_handle *devh);
+SR_PRIV int analyzer_has_data(libusb_device_handle *devh);
 
 #endif
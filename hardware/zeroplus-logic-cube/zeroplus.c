@@ -40,7 +40,12 @@
 #define NUM_TRIGGER_STAGES		4
 #define TRIGGER_TYPES			"01"
 
-#define PACKET_SIZE			2048	/* ?? */
+/* Sample memory is read in transfers of this size, a few at a time. */
+#define TRANSFER_SIZE			(256 * 1024)
+#define NUM_TRANSFERS			4
+
+/* How often (in ms) to check whether a capture is done. */
+#define POLL_INTERVAL			100
 
 //#define ZP_EXPERIMENTAL
 
@@ -74,6 +79,7 @@ static const int hwcaps[] = {
 	SR_HWCAP_LOGIC_ANALYZER,
 	SR_HWCAP_SAMPLERATE,
 	SR_HWCAP_CAPTURE_RATIO,
+	SR_HWCAP_RLE,
 
 	/* These are really implemented in the driver, not the hardware. */
 	SR_HWCAP_LIMIT_SAMPLES,
@@ -160,9 +166,28 @@ struct dev_context {
 	// uint8_t trigger_buffer[NUM_TRIGGER_STAGES];
 	int trigger;
 	unsigned int capture_ratio;
+	/* Use the hardware's compression, see receive_transfer(). */
+	gboolean rle;
 
 	/* TODO: this belongs in the device instance */
 	struct sr_usb_dev_inst *usb;
+	/* Settings to write to the device, see analyzer_configure(). */
+	struct analyzer_config analyzer;
+
+	/* Acquisition state, see receive_data(). */
+	void *session_dev_id;
+	gboolean running;
+	gboolean reading;
+	gboolean aborted;
+	/* Bytes of sample memory to read, submitted and received so far. */
+	unsigned int read_size;
+	unsigned int read_submitted;
+	unsigned int read_received;
+	/* With compression: samples still wanted, and the decoded runs. */
+	uint64_t samples_left;
+	struct sr_logic_run *runs;
+	struct libusb_transfer *transfers[NUM_TRANSFERS];
+	int submitted_transfers;
 };
 
 static int hw_dev_close(struct sr_dev_inst *sdi);
@@ -262,7 +287,8 @@ static int configure_probes(const struct sr_dev_inst *sdi)
 			default:
 				return SR_ERR;
 			}
-			analyzer_add_trigger(probe->index, type);
+			analyzer_add_trigger(&devc->analyzer, probe->index,
+					     type);
 			devc->trigger = 1;
 		}
 	}
@@ -286,6 +312,7 @@ static int clear_instances(void)
 			continue;
 		}
 		sr_usb_dev_inst_free(devc->usb);
+		g_free(devc->runs);
 		/* Properly close all devices... */
 		hw_dev_close(sdi);
 		/* ...and free all their memory. */
@@ -336,10 +363,11 @@ static GSList *hw_scan(GSList *options)
 
 	/* Find all ZEROPLUS analyzers and add them to device list. */
 	devcnt = 0;
-	libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist); /* TODO: Errors. */
+	/* TODO: Errors. */
+	sr_usb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
 
 	for (i = 0; devlist[i]; i++) {
-		ret = libusb_get_device_descriptor(devlist[i], &des);
+		ret = sr_usb_get_device_descriptor(devlist[i], &des);
 		if (ret != 0) {
 			sr_err("zp: failed to get device descriptor: %s",
 			       libusb_error_name(ret));
@@ -382,6 +410,7 @@ static GSList *hw_scan(GSList *options)
 #endif
 		devc->max_samplerate *= SR_MHZ(1);
 		devc->memory_size = MEMORY_SIZE_8K;
+		analyzer_config_init(&devc->analyzer);
 		// memset(devc->trigger_buffer, 0, NUM_TRIGGER_STAGES);
 
 		/* Fill in probelist according to this device's profile. */
@@ -427,7 +456,7 @@ static int hw_dev_open(struct sr_dev_inst *sdi)
 		return SR_ERR_ARG;
 	}
 
-	device_count = libusb_get_device_list(drvc->sr_ctx->libusb_ctx,
+	device_count = sr_usb_get_device_list(drvc->sr_ctx->libusb_ctx,
 					      &devlist);
 	if (device_count < 0) {
 		sr_err("zp: Failed to retrieve device list");
@@ -436,7 +465,7 @@ static int hw_dev_open(struct sr_dev_inst *sdi)
 
 	dev = NULL;
 	for (i = 0; i < device_count; i++) {
-		if ((ret = libusb_get_device_descriptor(devlist[i], &des))) {
+		if ((ret = sr_usb_get_device_descriptor(devlist[i], &des))) {
 			sr_err("zp: Failed to get device descriptor: %s.",
 			       libusb_error_name(ret));
 			continue;
@@ -479,14 +508,14 @@ static int hw_dev_open(struct sr_dev_inst *sdi)
 
 	/* Set default configuration after power on */
 	if (analyzer_read_status(devc->usb->devhdl) == 0)
-		analyzer_configure(devc->usb->devhdl);
+		analyzer_configure(devc->usb->devhdl, &devc->analyzer);
 
 	analyzer_reset(devc->usb->devhdl);
 	analyzer_initialize(devc->usb->devhdl);
 
 	//analyzer_set_memory_size(MEMORY_SIZE_512K);
 	// analyzer_set_freq(g_freq, g_freq_scale);
-	analyzer_set_trigger_count(1);
+	analyzer_set_trigger_count(&devc->analyzer, 1);
 	// analyzer_set_ramsize_trigger_address((((100 - g_pre_trigger)
 	// * get_memory_size(g_memory_size)) / 100) >> 2);
 
@@ -497,11 +526,11 @@ static int hw_dev_open(struct sr_dev_inst *sdi)
 		analyzer_set_compression(COMPRESSION_ENABLE);
 	else
 #endif
-	analyzer_set_compression(COMPRESSION_NONE);
+	analyzer_set_compression(&devc->analyzer, COMPRESSION_NONE);
 
 	if (devc->cur_samplerate == 0) {
 		/* Samplerate hasn't been set. Default to 1MHz. */
-		analyzer_set_freq(1, FREQ_SCALE_MHZ);
+		analyzer_set_freq(&devc->analyzer, 1, FREQ_SCALE_MHZ);
 		devc->cur_samplerate = SR_MHZ(1);
 	}
 
@@ -604,11 +633,14 @@ static int set_samplerate(struct dev_context *devc, uint64_t samplerate)
 	sr_info("zp: Setting samplerate to %" PRIu64 "Hz.", samplerate);
 
 	if (samplerate >= SR_MHZ(1))
-		analyzer_set_freq(samplerate / SR_MHZ(1), FREQ_SCALE_MHZ);
+		analyzer_set_freq(&devc->analyzer, samplerate / SR_MHZ(1),
+				  FREQ_SCALE_MHZ);
 	else if (samplerate >= SR_KHZ(1))
-		analyzer_set_freq(samplerate / SR_KHZ(1), FREQ_SCALE_KHZ);
+		analyzer_set_freq(&devc->analyzer, samplerate / SR_KHZ(1),
+				  FREQ_SCALE_KHZ);
 	else
-		analyzer_set_freq(samplerate, FREQ_SCALE_HZ);
+		analyzer_set_freq(&devc->analyzer, samplerate,
+				  FREQ_SCALE_HZ);
 
 	devc->cur_samplerate = samplerate;
 
@@ -632,7 +664,7 @@ static int set_limit_samples(struct dev_context *devc, uint64_t samples)
 	sr_info("zp: Setting memory size to %dK.",
 		get_memory_size(devc->memory_size) / 1024);
 
-	analyzer_set_memory_size(devc->memory_size);
+	analyzer_set_memory_size(&devc->analyzer, devc->memory_size);
 
 	return SR_OK;
 }
@@ -673,6 +705,9 @@ static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 		return set_limit_samples(devc, *(const uint64_t *)value);
 	case SR_HWCAP_CAPTURE_RATIO:
 		return set_capture_ratio(devc, *(const uint64_t *)value);
+	case SR_HWCAP_RLE:
+		devc->rle = GPOINTER_TO_INT(value);
+		return SR_OK;
 	default:
 		return SR_ERR;
 	}
@@ -699,53 +734,289 @@ static void set_triggerbar(struct dev_context *devc)
 	} else {
 		triggerbar = 0;
 	}
-	analyzer_set_triggerbar_address(triggerbar);
-	analyzer_set_ramsize_trigger_address(ramsize - triggerbar);
+	analyzer_set_triggerbar_address(&devc->analyzer, triggerbar);
+	analyzer_set_ramsize_trigger_address(&devc->analyzer,
+					     ramsize - triggerbar);
 
 	sr_dbg("zp: triggerbar_address = %d(0x%x)", triggerbar, triggerbar);
 	sr_dbg("zp: ramsize_triggerbar_address = %d(0x%x)",
 	       ramsize - triggerbar, ramsize - triggerbar);
 }
 
+static void finish_acquisition(struct dev_context *devc)
+{
+	struct sr_datafeed_packet packet;
+	struct drv_context *drvc = zdi->priv;
+	const struct libusb_pollfd **lupfd;
+	int i;
+
+	if (devc->aborted)
+		analyzer_reset(devc->usb->devhdl);
+	else
+		analyzer_read_stop(devc->usb->devhdl);
+
+	packet.type = SR_DF_END;
+	sr_session_send(devc->session_dev_id, &packet);
+
+	lupfd = libusb_get_pollfds(drvc->sr_ctx->libusb_ctx);
+	for (i = 0; lupfd[i]; i++)
+		sr_source_remove(lupfd[i]->fd);
+	free(lupfd); /* NOT g_free()! */
+
+	devc->running = FALSE;
+}
+
+static void free_transfer(struct libusb_transfer *transfer)
+{
+	struct dev_context *devc = transfer->user_data;
+	int i;
+
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		if (devc->transfers[i] == transfer)
+			devc->transfers[i] = NULL;
+	}
+	g_free(transfer->buffer);
+	libusb_free_transfer(transfer);
+	devc->submitted_transfers--;
+}
+
+/* Submit 'transfer' for the next part of the sample memory, if any. */
+static int submit_transfer(struct dev_context *devc,
+			   struct libusb_transfer *transfer)
+{
+	unsigned int size;
+	int ret;
+
+	if (devc->aborted || devc->read_submitted >= devc->read_size)
+		return SR_ERR;
+
+	size = MIN(TRANSFER_SIZE, devc->read_size - devc->read_submitted);
+	analyzer_fill_read_transfer(transfer, devc->usb->devhdl,
+				    transfer->buffer, size,
+				    transfer->callback, devc);
+	if ((ret = libusb_submit_transfer(transfer)) != 0) {
+		sr_err("zp: %s: libusb_submit_transfer: %s", __func__,
+		       libusb_error_name(ret));
+		return SR_ERR;
+	}
+	devc->read_submitted += size;
+
+	return SR_OK;
+}
+
+/*
+ * Send compressed sample memory on as runs, without expanding it. Once
+ * the samples wanted are in, there's no need to read any further.
+ */
+static void send_runs(struct dev_context *devc, const unsigned char *buf,
+		      int length)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic_rle rle;
+	uint64_t samples;
+
+	rle.num_runs = analyzer_decompress_runs(buf, length, devc->runs,
+						devc->samples_left, &samples);
+	if (rle.num_runs > 0) {
+		packet.type = SR_DF_LOGIC_RLE;
+		packet.payload = &rle;
+		rle.unitsize = 4;
+		rle.runs = devc->runs;
+		rle.buffer = NULL;
+		sr_session_send(devc->session_dev_id, &packet);
+	}
+
+	devc->samples_left -= samples;
+	if (devc->samples_left == 0)
+		devc->read_size = devc->read_submitted;
+}
+
+static void receive_transfer(struct libusb_transfer *transfer)
+{
+	struct dev_context *devc = transfer->user_data;
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	int length;
+
+	sr_spew("zp: receive_transfer(): status %d received %d bytes",
+		transfer->status, transfer->actual_length);
+
+	/* Whole samples only; a short read ends the download. */
+	length = transfer->actual_length - transfer->actual_length % 4;
+	if (length > 0 && !devc->aborted && devc->rle) {
+		send_runs(devc, transfer->buffer, length);
+		devc->read_received += length;
+	} else if (length > 0 && !devc->aborted) {
+		packet.type = SR_DF_LOGIC;
+		packet.payload = &logic;
+		logic.length = length;
+		logic.unitsize = 4;
+		logic.data = transfer->buffer;
+		logic.buffer = NULL;
+		sr_session_send(devc->session_dev_id, &packet);
+		devc->read_received += length;
+	}
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED
+	    || transfer->actual_length < transfer->length) {
+		if (transfer->status != LIBUSB_TRANSFER_CANCELLED &&
+		    transfer->status != LIBUSB_TRANSFER_COMPLETED)
+			sr_err("zp: sample memory transfer failed (%d)",
+			       transfer->status);
+		/* Don't wait for any parts which are still to come. */
+		devc->read_size = devc->read_submitted;
+		free_transfer(transfer);
+		return;
+	}
+
+	if (submit_transfer(devc, transfer) != SR_OK)
+		free_transfer(transfer);
+}
+
+/* Request the sample memory, and queue the transfers reading it. */
+static int start_reading(struct dev_context *devc)
+{
+	struct libusb_transfer *transfer;
+	unsigned char *buf;
+	int i;
+
+	sr_info("zp: Stop address    = 0x%x",
+		analyzer_get_stop_address(devc->usb->devhdl));
+	sr_info("zp: Now address     = 0x%x",
+		analyzer_get_now_address(devc->usb->devhdl));
+	sr_info("zp: Trigger address = 0x%x",
+		analyzer_get_trigger_address(devc->usb->devhdl));
+
+	devc->read_size = get_memory_size(devc->memory_size);
+	if (devc->max_memory_size * 4 < devc->read_size)
+		devc->read_size = devc->max_memory_size * 4;
+	devc->read_submitted = 0;
+	devc->read_received = 0;
+	devc->samples_left = devc->limit_samples ? devc->limit_samples
+						 : UINT64_MAX;
+
+	if (devc->rle && !devc->runs && !(devc->runs =
+	    g_try_malloc(TRANSFER_SIZE / 4 * sizeof(struct sr_logic_run)))) {
+		sr_err("zp: %s: runs malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	analyzer_read_start(devc->usb->devhdl);
+	if (analyzer_read_request(devc->usb->devhdl, devc->read_size) < 0)
+		return SR_ERR;
+
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		if (devc->read_submitted >= devc->read_size)
+			break;
+		if (!(buf = g_try_malloc(TRANSFER_SIZE))) {
+			sr_err("zp: %s: buf malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		if (!(transfer = libusb_alloc_transfer(0))) {
+			sr_err("zp: %s: transfer malloc failed", __func__);
+			g_free(buf);
+			return SR_ERR_MALLOC;
+		}
+		analyzer_fill_read_transfer(transfer, devc->usb->devhdl, buf,
+					    TRANSFER_SIZE, receive_transfer,
+					    devc);
+		devc->transfers[i] = transfer;
+		devc->submitted_transfers++;
+		if (submit_transfer(devc, transfer) != SR_OK) {
+			free_transfer(transfer);
+			return SR_ERR;
+		}
+	}
+
+	return SR_OK;
+}
+
+/*
+ * Runs from the session loop: polls the device until the capture is done,
+ * then services the transfers reading the sample memory.
+ */
+static int receive_data(int fd, int revents, void *cb_data)
+{
+	struct sr_dev_inst *sdi = cb_data;
+	struct dev_context *devc = sdi->priv;
+	struct drv_context *drvc = zdi->priv;
+	struct timeval tv;
+	int i;
+
+	(void)fd;
+	(void)revents;
+
+	if (!devc->running)
+		return TRUE;
+
+	if (!devc->reading && !devc->aborted) {
+		if (!analyzer_has_data(devc->usb->devhdl))
+			return TRUE;
+		devc->reading = TRUE;
+		if (start_reading(devc) != SR_OK) {
+			/* Read what was submitted, if anything. */
+			devc->aborted = TRUE;
+			for (i = 0; i < NUM_TRANSFERS; i++) {
+				if (devc->transfers[i])
+					libusb_cancel_transfer(
+						devc->transfers[i]);
+			}
+		}
+	}
+
+	tv.tv_sec = tv.tv_usec = 0;
+	libusb_handle_events_timeout(drvc->sr_ctx->libusb_ctx, &tv);
+
+	if (devc->submitted_transfers == 0) {
+		sr_dbg("zp: read %u of %u bytes of sample memory",
+		       devc->read_received, devc->read_size);
+		finish_acquisition(devc);
+	}
+
+	return TRUE;
+}
+
 static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 		void *cb_data)
 {
 	struct sr_datafeed_packet packet;
-	struct sr_datafeed_logic logic;
 	struct sr_datafeed_header header;
 	struct sr_datafeed_meta_logic meta;
-	//uint64_t samples_read;
-	int res;
-	unsigned int packet_num;
-	unsigned int n;
-	unsigned char *buf;
 	struct dev_context *devc;
+	struct drv_context *drvc = zdi->priv;
+	const struct libusb_pollfd **lupfd;
+	int i;
 
 	if (!(devc = sdi->priv)) {
 		sr_err("zp: %s: sdi->priv was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
+	if (devc->running)
+		return SR_ERR;
+
 	if (configure_probes(sdi) != SR_OK) {
 		sr_err("zp: failed to configured probes");
 		return SR_ERR;
 	}
 
 	set_triggerbar(devc);
+	analyzer_set_compression(&devc->analyzer, devc->rle ?
+				 COMPRESSION_ENABLE : COMPRESSION_NONE);
 
 	/* push configured settings to device */
-	analyzer_configure(devc->usb->devhdl);
+	analyzer_configure(devc->usb->devhdl, &devc->analyzer);
 
 	analyzer_start(devc->usb->devhdl);
 	sr_info("zp: Waiting for data");
-	analyzer_wait_data(devc->usb->devhdl);
 
-	sr_info("zp: Stop address    = 0x%x",
-		analyzer_get_stop_address(devc->usb->devhdl));
-	sr_info("zp: Now address     = 0x%x",
-		analyzer_get_now_address(devc->usb->devhdl));
-	sr_info("zp: Trigger address = 0x%x",
-		analyzer_get_trigger_address(devc->usb->devhdl));
+	devc->session_dev_id = cb_data;
+	devc->running = TRUE;
+	devc->reading = FALSE;
+	devc->aborted = FALSE;
+	devc->submitted_transfers = 0;
+	for (i = 0; i < NUM_TRANSFERS; i++)
+		devc->transfers[i] = NULL;
 
 	packet.type = SR_DF_HEADER;
 	packet.payload = &header;
@@ -760,35 +1031,12 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	meta.num_probes = devc->num_channels;
 	sr_session_send(cb_data, &packet);
 
-	if (!(buf = g_try_malloc(PACKET_SIZE))) {
-		sr_err("zp: %s: buf malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
-
-	//samples_read = 0;
-	analyzer_read_start(devc->usb->devhdl);
-	/* Send the incoming transfer to the session bus. */
-	n = get_memory_size(devc->memory_size);
-	if (devc->max_memory_size * 4 < n)
-		n = devc->max_memory_size * 4;
-	for (packet_num = 0; packet_num < n / PACKET_SIZE; packet_num++) {
-		res = analyzer_read_data(devc->usb->devhdl, buf, PACKET_SIZE);
-		sr_info("zp: Tried to read %d bytes, actually read %d bytes",
-			PACKET_SIZE, res);
-
-		packet.type = SR_DF_LOGIC;
-		packet.payload = &logic;
-		logic.length = PACKET_SIZE;
-		logic.unitsize = 4;
-		logic.data = buf;
-		sr_session_send(cb_data, &packet);
-		//samples_read += res / 4;
-	}
-	analyzer_read_stop(devc->usb->devhdl);
-	g_free(buf);
-
-	packet.type = SR_DF_END;
-	sr_session_send(cb_data, &packet);
+	/* The capture is read out from the session loop. */
+	lupfd = libusb_get_pollfds(drvc->sr_ctx->libusb_ctx);
+	for (i = 0; lupfd[i]; i++)
+		sr_source_add(lupfd[i]->fd, lupfd[i]->events, POLL_INTERVAL,
+			      receive_data, (void *)sdi);
+	free(lupfd); /* NOT g_free()! */
 
 	return SR_OK;
 }
@@ -796,19 +1044,25 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 /* TODO: This stops acquisition on ALL devices, ignoring dev_index. */
 static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi, void *cb_data)
 {
-	struct sr_datafeed_packet packet;
 	struct dev_context *devc;
+	int i;
 
-	packet.type = SR_DF_END;
-	sr_session_send(cb_data, &packet);
+	(void)cb_data;
 
 	if (!(devc = sdi->priv)) {
 		sr_err("zp: %s: sdi->priv was NULL", __func__);
 		return SR_ERR_BUG;
 	}
 
-	analyzer_reset(devc->usb->devhdl);
-	/* TODO: Need to cancel and free any queued up transfers. */
+	if (!devc->running || devc->aborted)
+		return SR_OK;
+
+	/* Transfers come back cancelled, then receive_data() finishes. */
+	devc->aborted = TRUE;
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		if (devc->transfers[i])
+			libusb_cancel_transfer(devc->transfers[i]);
+	}
 
 	return SR_OK;
 }
@@ -0,0 +1,334 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/time.h>
+#include <glib.h>
+#include "config.h" /* Needed for HAVE_LIBUSB_1_0 and others. */
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "hotplug: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/* libusb has hotplug support since 1.0.16. */
+#if defined(HAVE_LIBUSB_1_0) && defined(LIBUSB_HOTPLUG_MATCH_ANY)
+#define HAVE_USB_HOTPLUG 1
+#endif
+
+/**
+ * @file
+ *
+ * Tracking devices as they are plugged in and out.
+ */
+
+/**
+ * @defgroup grp_hotplug Hotplug
+ *
+ * Tracking devices as they are plugged in and out.
+ *
+ * Once a frontend has scanned for devices, it can have libsigrok keep the
+ * drivers' device lists current instead of scanning again. Drivers which
+ * support it add an instance when one of their devices is plugged in,
+ * and remove it when it is unplugged; the frontend is told about both.
+ *
+ * Only USB devices are tracked, and only by drivers which implement the
+ * usb_arrived and usb_left callbacks.
+ *
+ * @{
+ */
+
+#ifdef HAVE_USB_HOTPLUG
+/* A device event, queued until sr_hotplug_handle_events(). */
+struct hotplug_event {
+	libusb_hotplug_event event;
+	uint16_t vid;
+	uint16_t pid;
+	uint8_t bus;
+	uint8_t address;
+};
+#endif
+
+struct sr_hotplug {
+	sr_hotplug_callback_t cb;
+	void *cb_data;
+#ifdef HAVE_USB_HOTPLUG
+	libusb_hotplug_callback_handle handle;
+	/*
+	 * libusb reports events from whichever thread handles its events,
+	 * which may be a driver's USB event thread.
+	 */
+	GMutex mutex;
+	GSList *events;
+#endif
+};
+
+#ifdef HAVE_USB_HOTPLUG
+static int usb_event(libusb_context *usb_ctx, libusb_device *dev,
+		libusb_hotplug_event event, void *user_data)
+{
+	struct sr_hotplug *hotplug;
+	struct hotplug_event *ev;
+	struct libusb_device_descriptor des;
+
+	(void)usb_ctx;
+
+	hotplug = user_data;
+
+	if (!(ev = g_try_malloc0(sizeof(struct hotplug_event)))) {
+		sr_err("Event malloc failed, event lost.");
+		return 0;
+	}
+	ev->event = event;
+	ev->bus = libusb_get_bus_number(dev);
+	ev->address = libusb_get_device_address(dev);
+	if (libusb_get_device_descriptor(dev, &des) == 0) {
+		ev->vid = des.idVendor;
+		ev->pid = des.idProduct;
+	}
+
+	g_mutex_lock(&hotplug->mutex);
+	hotplug->events = g_slist_append(hotplug->events, ev);
+	g_mutex_unlock(&hotplug->mutex);
+
+	/* Stay registered. */
+	return 0;
+}
+
+static void dispatch(const struct hotplug_event *ev)
+{
+	struct sr_dev_driver **drivers;
+	int i;
+
+	if (ev->event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		sr_dbg("USB device %04x:%04x arrived on %d.%d.", ev->vid,
+		       ev->pid, ev->bus, ev->address);
+	else
+		sr_dbg("USB device %04x:%04x left %d.%d.", ev->vid,
+		       ev->pid, ev->bus, ev->address);
+
+	/* Only drivers which were initialized track devices. */
+	drivers = sr_driver_list();
+	for (i = 0; drivers[i]; i++) {
+		if (!drivers[i]->priv)
+			continue;
+		if (ev->event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+			if (drivers[i]->usb_arrived)
+				drivers[i]->usb_arrived(ev->vid, ev->pid,
+						ev->bus, ev->address);
+		} else {
+			if (drivers[i]->usb_left)
+				drivers[i]->usb_left(ev->bus, ev->address);
+		}
+	}
+}
+#endif
+
+/**
+ * Start tracking devices as they are plugged in and out.
+ *
+ * Devices which are already connected are not reported; scan for those
+ * first. Events are handled by sr_hotplug_handle_events(), which the
+ * frontend calls from its main loop, or from a timeout source (see
+ * sr_session_source_add()) while a session runs.
+ *
+ * 'cb' is called with SR_HOTPLUG_ARRIVED after a driver added a device
+ * instance to its list, and with SR_HOTPLUG_LEFT before one is removed
+ * and freed. Upon the latter, the frontend must stop any acquisition on
+ * the device and forget about it.
+ *
+ * @param ctx The libsigrok context. Must not be NULL.
+ * @param cb The callback. Must not be NULL.
+ * @param cb_data Opaque pointer passed to the callback.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, SR_ERR
+ *         if hotplug events are not supported on this system.
+ */
+SR_API int sr_hotplug_enable(struct sr_context *ctx, sr_hotplug_callback_t cb,
+		void *cb_data)
+{
+#ifdef HAVE_USB_HOTPLUG
+	struct sr_hotplug *hotplug;
+	int ret;
+
+	if (!ctx || !cb) {
+		sr_err("%s: ctx and cb may not be NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ctx->hotplug) {
+		ctx->hotplug->cb = cb;
+		ctx->hotplug->cb_data = cb_data;
+		return SR_OK;
+	}
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		sr_err("libusb has no hotplug support on this system.");
+		return SR_ERR;
+	}
+
+	if (!(hotplug = g_try_malloc0(sizeof(struct sr_hotplug)))) {
+		sr_err("%s: hotplug malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	hotplug->cb = cb;
+	hotplug->cb_data = cb_data;
+	g_mutex_init(&hotplug->mutex);
+
+	ret = libusb_hotplug_register_callback(ctx->libusb_ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+			LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			LIBUSB_HOTPLUG_NO_FLAGS, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			usb_event, hotplug, &hotplug->handle);
+	if (ret != LIBUSB_SUCCESS) {
+		sr_err("Failed to register hotplug callback: %s.",
+		       libusb_error_name(ret));
+		g_mutex_clear(&hotplug->mutex);
+		g_free(hotplug);
+		return SR_ERR;
+	}
+
+	ctx->hotplug = hotplug;
+
+	return SR_OK;
+#else
+	(void)cb;
+	(void)cb_data;
+
+	if (!ctx)
+		return SR_ERR_ARG;
+
+	sr_err("Hotplug events are not supported in this build.");
+
+	return SR_ERR;
+#endif
+}
+
+/**
+ * Stop tracking devices as they are plugged in and out.
+ *
+ * Events which were not handled yet are dropped.
+ *
+ * @param ctx The libsigrok context. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_hotplug_disable(struct sr_context *ctx)
+{
+	if (!ctx)
+		return SR_ERR_ARG;
+
+	if (!ctx->hotplug)
+		return SR_OK;
+
+#ifdef HAVE_USB_HOTPLUG
+	libusb_hotplug_deregister_callback(ctx->libusb_ctx,
+					   ctx->hotplug->handle);
+	g_slist_free_full(ctx->hotplug->events, g_free);
+	g_mutex_clear(&ctx->hotplug->mutex);
+#endif
+	g_free(ctx->hotplug);
+	ctx->hotplug = NULL;
+
+	return SR_OK;
+}
+
+/**
+ * Handle pending hotplug events.
+ *
+ * Drivers add and remove device instances, and the frontend's callback
+ * is called, from within this function.
+ *
+ * @param ctx The libsigrok context. Must not be NULL.
+ * @param timeout Time (in ms) to wait for USB events, 0 to only handle
+ *                those already pending.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, SR_ERR
+ *         if hotplug events are not enabled.
+ */
+SR_API int sr_hotplug_handle_events(struct sr_context *ctx, int timeout)
+{
+#ifdef HAVE_USB_HOTPLUG
+	struct hotplug_event *ev;
+	struct timeval tv;
+	GSList *events, *l;
+	int ret;
+
+	if (!ctx)
+		return SR_ERR_ARG;
+
+	if (!ctx->hotplug) {
+		sr_err("Hotplug events are not enabled.");
+		return SR_ERR;
+	}
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	ret = libusb_handle_events_timeout_completed(ctx->libusb_ctx, &tv,
+						     NULL);
+	if (ret != LIBUSB_SUCCESS && ret != LIBUSB_ERROR_INTERRUPTED)
+		sr_warn("Failed to handle USB events: %s.",
+			libusb_error_name(ret));
+
+	g_mutex_lock(&ctx->hotplug->mutex);
+	events = ctx->hotplug->events;
+	ctx->hotplug->events = NULL;
+	g_mutex_unlock(&ctx->hotplug->mutex);
+
+	for (l = events; l; l = l->next) {
+		ev = l->data;
+		dispatch(ev);
+	}
+	g_slist_free_full(events, g_free);
+
+	return SR_OK;
+#else
+	(void)timeout;
+
+	if (!ctx)
+		return SR_ERR_ARG;
+
+	return SR_ERR;
+#endif
+}
+
+/**
+ * Tell the frontend that a device instance arrived or is about to leave.
+ *
+ * Called by drivers from their usb_arrived and usb_left callbacks.
+ *
+ * @param ctx The libsigrok context.
+ * @param event SR_HOTPLUG_ARRIVED or SR_HOTPLUG_LEFT.
+ * @param sdi The device instance.
+ *
+ * @private
+ */
+SR_PRIV void sr_hotplug_post(struct sr_context *ctx, int event,
+		struct sr_dev_inst *sdi)
+{
+	if (!ctx || !ctx->hotplug || !ctx->hotplug->cb)
+		return;
+
+	sr_dbg("Device %s %s %s.", sdi->vendor ? sdi->vendor : "",
+	       sdi->model ? sdi->model : "",
+	       event == SR_HOTPLUG_ARRIVED ? "arrived" : "left");
+
+	ctx->hotplug->cb(event, sdi, ctx->hotplug->cb_data);
+}
+
+/** @} */
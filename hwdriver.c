@@ -64,6 +64,26 @@ static struct sr_hwcap_option sr_devopts[] = {
 	{SR_HWCAP_FILTER, SR_T_CHAR, "Filter targets", "filter"},
 	{SR_HWCAP_VDIV, SR_T_RATIONAL_VOLT, "Volts/div", "vdiv"},
 	{SR_HWCAP_COUPLING, SR_T_CHAR, "Coupling", "coupling"},
+	{SR_HWCAP_USB_EVENT_THREAD, SR_T_BOOL, "USB event thread",
+			"usbthread"},
+	{SR_HWCAP_LIVE_DOWNLOAD, SR_T_BOOL, "Download during capture",
+			"livedownload"},
+	{SR_HWCAP_NUM_ANALOG_PROBES, SR_T_UINT64, "Number of analog probes",
+			"numanalogprobes"},
+	{SR_HWCAP_ANALOG_PATTERN_MODE, SR_T_CHAR, "Analog pattern mode",
+			"analogpattern"},
+	{SR_HWCAP_SERIALCOMM, SR_T_CHAR, "Serial communication",
+			"serialcomm"},
+	{SR_HWCAP_ROLL_MODE, SR_T_BOOL, "Roll mode", "rollmode"},
+	{SR_HWCAP_CAPTURE_UNITSIZE, SR_T_UINT64, "Unit size", "unitsize"},
+	{SR_HWCAP_CAPTURE_NUM_PROBES, SR_T_UINT64, "Number of probes",
+			"numprobes"},
+	{SR_HWCAP_PLAYBACK_SPEED, SR_T_UINT64, "Playback speed",
+			"playbackspeed"},
+	{SR_HWCAP_PLAYBACK_CHUNKSIZE, SR_T_UINT64, "Playback chunk size",
+			"playbackchunksize"},
+	{SR_HWCAP_CAPTURE_UNITBITS, SR_T_UINT64, "Unit size in bits",
+			"unitbits"},
 	{0, 0, NULL, NULL},
 };
 
@@ -198,6 +218,16 @@ static struct sr_dev_driver *drivers_list[] = {
 	NULL,
 };
 
+/* The context drivers are initialized with on first use. */
+static struct sr_context *driver_ctx = NULL;
+
+/*
+ * The drivers which are initialized, each with the context it was
+ * initialized with. Kept here rather than inferred from driver->priv,
+ * which not every driver's cleanup resets.
+ */
+static GHashTable *driver_inits = NULL;
+
 /**
  * Return the list of supported hardware drivers.
  *
@@ -209,9 +239,38 @@ SR_API struct sr_dev_driver **sr_driver_list(void)
 	return drivers_list;
 }
 
+/**
+ * Find a hardware driver by name.
+ *
+ * The driver is not initialized; that happens on its first scan.
+ *
+ * @param name The driver's name, e.g. "fx2lafw". Must not be NULL.
+ *
+ * @return The driver, or NULL if no driver has that name.
+ */
+SR_API struct sr_dev_driver *sr_driver_find(const char *name)
+{
+	int i;
+
+	if (!name)
+		return NULL;
+
+	for (i = 0; drivers_list[i]; i++) {
+		if (!strcmp(drivers_list[i]->name, name))
+			return drivers_list[i];
+	}
+
+	return NULL;
+}
+
 /**
  * Initialize a hardware driver.
  *
+ * Calling this is optional, drivers are initialized on their first scan.
+ * Drivers which are initialized with 'ctx' already are left alone; one
+ * which is initialized with another context is refused until sr_exit()
+ * cleans it up.
+ *
  * @param ctx A libsigrok context object allocated by a previous call to
  * 		sr_init().
  * @param driver The driver to initialize.
@@ -220,13 +279,49 @@ SR_API struct sr_dev_driver **sr_driver_list(void)
  */
 SR_API int sr_driver_init(struct sr_context *ctx, struct sr_dev_driver *driver)
 {
+	struct sr_context *inited;
+	int ret;
+
+	if (driver_inits && (inited = g_hash_table_lookup(driver_inits,
+							 driver))) {
+		if (inited == ctx)
+			return SR_OK;
+		sr_err("hwdriver: %s: driver '%s' is initialized with "
+		       "another context already", __func__, driver->name);
+		return SR_ERR_ARG;
+	}
+
+	if (driver->init) {
+		sr_dbg("hwdriver: Initializing driver '%s'.", driver->name);
+		if ((ret = driver->init(ctx)) != SR_OK) {
+			sr_err("hwdriver: Failed to initialize driver '%s'.",
+			       driver->name);
+			return ret;
+		}
+	}
 
-	if (driver->init)
-		return driver->init(ctx);
+	if (!driver_inits)
+		driver_inits = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_hash_table_insert(driver_inits, driver, ctx);
 
 	return SR_OK;
 }
 
+/* Initialize a driver upon its first use. */
+static int driver_init_lazy(struct sr_dev_driver *driver)
+{
+	if (driver_inits && g_hash_table_lookup(driver_inits, driver))
+		return SR_OK;
+
+	if (!driver_ctx) {
+		sr_err("hwdriver: %s: driver '%s' used before sr_init()",
+		       __func__, driver->name);
+		return SR_ERR_BUG;
+	}
+
+	return sr_driver_init(driver_ctx, driver);
+}
+
 /**
  * Tell a hardware driver to scan for devices.
  *
@@ -248,23 +343,371 @@ SR_API int sr_driver_init(struct sr_context *ctx, struct sr_dev_driver *driver)
 SR_API GSList *sr_driver_scan(struct sr_dev_driver *driver, GSList *options)
 {
 
+	if (driver_init_lazy(driver) != SR_OK)
+		return NULL;
+
 	if (driver->scan)
 		return driver->scan(options);
 
 	return NULL;
 }
 
+/*
+ * sr_scan_all() runs its scans in jobs, one thread each. Scans of the
+ * same driver or on the same port go into the same job, so no driver
+ * scans twice at once and no port is probed by two drivers at once.
+ */
+struct scan_item {
+	struct sr_dev_driver *driver;
+	/*
+	 * Copy of the caller's options, which may be gone by the time a
+	 * scan still running at the deadline gets to it. Only the string
+	 * values are copied; others must outlive the scan.
+	 */
+	GSList *options;
+	const char *conn;
+};
+
+struct scan_state;
+
+struct scan_job {
+	struct scan_state *state;
+	GSList *items;
+	GSList *devices;
+	gboolean done;
+};
+
+struct scan_state {
+	GMutex mutex;
+	GCond cond;
+	volatile gint refcount;
+	int pending;
+	GSList *jobs;
+	/* Used by the scan jobs only; dropped when sr_scan_all() returns. */
+	struct sr_usb_snapshot *usb_snapshot;
+};
+
+/* Options whose values are strings, and thus copied along. */
+static gboolean scan_option_is_string(int hwopt)
+{
+	return hwopt == SR_HWOPT_CONN || hwopt == SR_HWOPT_SERIALCOMM;
+}
+
+static void scan_item_free(struct scan_item *item)
+{
+	GSList *l;
+	struct sr_hwopt *opt;
+
+	for (l = item->options; l; l = l->next) {
+		opt = l->data;
+		if (scan_option_is_string(opt->hwopt))
+			g_free((void *)opt->value);
+		g_free(opt);
+	}
+	g_slist_free(item->options);
+	g_free(item);
+}
+
+static struct scan_item *scan_item_new(const struct sr_scan *scan)
+{
+	struct scan_item *item;
+	struct sr_hwopt *opt, *src;
+	GSList *l;
+
+	if (!(item = g_try_malloc0(sizeof(struct scan_item))))
+		return NULL;
+	item->driver = scan->driver;
+
+	for (l = scan->options; l; l = l->next) {
+		src = l->data;
+		if (!(opt = g_try_malloc(sizeof(struct sr_hwopt)))) {
+			scan_item_free(item);
+			return NULL;
+		}
+		opt->hwopt = src->hwopt;
+		if (scan_option_is_string(opt->hwopt))
+			opt->value = g_strdup(src->value);
+		else
+			opt->value = src->value;
+		item->options = g_slist_append(item->options, opt);
+		if (opt->hwopt == SR_HWOPT_CONN)
+			item->conn = opt->value;
+	}
+
+	return item;
+}
+
+/* Whether a scan conflicts with one already in the job. */
+static gboolean scan_job_conflicts(const struct scan_job *job,
+		const struct scan_item *item)
+{
+	const struct scan_item *other;
+	GSList *l;
+
+	for (l = job->items; l; l = l->next) {
+		other = l->data;
+		if (other->driver == item->driver)
+			return TRUE;
+		if (other->conn && item->conn
+				&& !strcmp(other->conn, item->conn))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Add a scan to the job it conflicts with, merging jobs if need be. */
+static int scan_state_add(struct scan_state *state, struct scan_item *item)
+{
+	struct scan_job *job, *other;
+	GSList *l, *next;
+
+	job = NULL;
+	for (l = state->jobs; l; l = next) {
+		next = l->next;
+		other = l->data;
+		if (!scan_job_conflicts(other, item))
+			continue;
+		if (!job) {
+			job = other;
+			continue;
+		}
+		job->items = g_slist_concat(job->items, other->items);
+		state->jobs = g_slist_delete_link(state->jobs, l);
+		g_free(other);
+	}
+
+	if (!job) {
+		if (!(job = g_try_malloc0(sizeof(struct scan_job))))
+			return SR_ERR_MALLOC;
+		job->state = state;
+		state->jobs = g_slist_append(state->jobs, job);
+	}
+	job->items = g_slist_append(job->items, item);
+
+	return SR_OK;
+}
+
+static void scan_state_unref(struct scan_state *state)
+{
+	struct scan_job *job;
+	GSList *l;
+
+	if (!g_atomic_int_dec_and_test(&state->refcount))
+		return;
+
+#ifdef HAVE_LIBUSB_1_0
+	if (state->usb_snapshot)
+		sr_usb_snapshot_free(state->usb_snapshot);
+#endif
+
+	for (l = state->jobs; l; l = l->next) {
+		job = l->data;
+		g_slist_free_full(job->items, (GDestroyNotify)scan_item_free);
+		/* Devices found too late; their drivers still list them. */
+		g_slist_free(job->devices);
+		g_free(job);
+	}
+	g_slist_free(state->jobs);
+	g_mutex_clear(&state->mutex);
+	g_cond_clear(&state->cond);
+	g_free(state);
+}
+
+static gpointer scan_thread(gpointer data)
+{
+	struct scan_job *job;
+	struct scan_state *state;
+	struct scan_item *item;
+	GSList *l, *devices;
+
+	job = data;
+	state = job->state;
+
+#ifdef HAVE_LIBUSB_1_0
+	sr_usb_snapshot_use(state->usb_snapshot);
+#endif
+	devices = NULL;
+	for (l = job->items; l; l = l->next) {
+		item = l->data;
+		devices = g_slist_concat(devices,
+				sr_driver_scan(item->driver, item->options));
+	}
+#ifdef HAVE_LIBUSB_1_0
+	sr_usb_snapshot_use(NULL);
+#endif
+
+	g_mutex_lock(&state->mutex);
+	job->devices = devices;
+	job->done = TRUE;
+	state->pending--;
+	g_cond_signal(&state->cond);
+	g_mutex_unlock(&state->mutex);
+
+	scan_state_unref(state);
+
+	return NULL;
+}
+
+/**
+ * Scan for devices with several drivers at once.
+ *
+ * All USB drivers work from one snapshot of the USB devices, taken when
+ * the scan starts, instead of enumerating the bus each. Nothing outside
+ * the scans sees the snapshot, and it is dropped when this returns. The
+ * scans run concurrently, except that scans of the same driver, or with
+ * the same SR_HWOPT_CONN, run one after the other. Serial drivers
+ * probing different ports thus probe them in parallel.
+ *
+ * Scans still running at the deadline carry on in the background. The
+ * devices they find are not returned, but show up in their driver's
+ * device list; don't use such a driver until it is done.
+ *
+ * @param ctx The libsigrok context the drivers were initialized with.
+ * @param scans The drivers to scan, and their options. Must not be NULL.
+ * @param num_scans The number of entries in 'scans'.
+ * @param timeout Time (in ms) to wait for the scans, or 0 to wait for
+ *                all of them.
+ *
+ * @return A GSList * of struct sr_dev_inst, or NULL if no devices were found.
+ * This list must be freed by the caller, but without freeing the data
+ * pointed to in the list.
+ */
+SR_API GSList *sr_scan_all(struct sr_context *ctx, const struct sr_scan *scans,
+		int num_scans, int timeout)
+{
+	struct scan_state *state;
+	struct scan_item *item;
+	struct scan_job *job;
+	GThread *thread;
+	GError *error;
+	GSList *l, *devices;
+	gint64 end_time;
+	int i;
+
+	if (!scans || num_scans <= 0)
+		return NULL;
+
+	if (!(state = g_try_malloc0(sizeof(struct scan_state)))) {
+		sr_err("hwdriver: %s: state malloc failed", __func__);
+		return NULL;
+	}
+	g_mutex_init(&state->mutex);
+	g_cond_init(&state->cond);
+	state->refcount = 1;
+
+	for (i = 0; i < num_scans; i++) {
+		if (!scans[i].driver)
+			continue;
+		/* Drivers aren't made for being initialized concurrently. */
+		if (driver_init_lazy(scans[i].driver) != SR_OK)
+			continue;
+		if (!(item = scan_item_new(&scans[i]))
+				|| scan_state_add(state, item) != SR_OK) {
+			sr_err("hwdriver: %s: job malloc failed", __func__);
+			if (item)
+				scan_item_free(item);
+			scan_state_unref(state);
+			return NULL;
+		}
+	}
+
+#ifdef HAVE_LIBUSB_1_0
+	if (ctx)
+		state->usb_snapshot = sr_usb_snapshot_new(ctx->libusb_ctx);
+#else
+	(void)ctx;
+#endif
+
+	sr_dbg("hwdriver: Scanning %d driver(s) in %d job(s).", num_scans,
+	       g_slist_length(state->jobs));
+
+	end_time = g_get_monotonic_time() + (gint64)timeout * 1000;
+	state->pending = g_slist_length(state->jobs);
+	for (l = state->jobs; l; l = l->next) {
+		job = l->data;
+		g_atomic_int_inc(&state->refcount);
+		error = NULL;
+		thread = g_thread_try_new("sr-scan", scan_thread, job, &error);
+		if (thread) {
+			g_thread_unref(thread);
+		} else {
+			/* Fall back to scanning in this thread. */
+			g_error_free(error);
+			scan_thread(job);
+		}
+	}
+
+	devices = NULL;
+	g_mutex_lock(&state->mutex);
+	while (state->pending > 0) {
+		if (timeout <= 0)
+			g_cond_wait(&state->cond, &state->mutex);
+		else if (!g_cond_wait_until(&state->cond, &state->mutex,
+					    end_time))
+			break;
+	}
+	if (state->pending > 0)
+		sr_warn("hwdriver: %d scan job(s) still running at the "
+			"deadline.", state->pending);
+	for (l = state->jobs; l; l = l->next) {
+		job = l->data;
+		if (!job->done)
+			continue;
+		devices = g_slist_concat(devices, job->devices);
+		job->devices = NULL;
+	}
+	g_mutex_unlock(&state->mutex);
+
+#ifdef HAVE_LIBUSB_1_0
+	/* Jobs still running enumerate the bus themselves from now on. */
+	if (state->usb_snapshot)
+		sr_usb_snapshot_drop(state->usb_snapshot);
+#endif
+	scan_state_unref(state);
+
+	return devices;
+}
+
 /** @private */
 SR_PRIV void sr_hw_cleanup_all(void)
 {
 	int i;
 	struct sr_dev_driver **drivers;
 
+	if (!driver_inits)
+		return;
+
 	drivers = sr_driver_list();
 	for (i = 0; drivers[i]; i++) {
+		/* Drivers which were never used have nothing to clean up. */
+		if (!g_hash_table_lookup(driver_inits, drivers[i]))
+			continue;
 		if (drivers[i]->cleanup)
 			drivers[i]->cleanup();
+		/*
+		 * Not all drivers free their driver context on cleanup;
+		 * it is no use once the sr_context it points to is gone.
+		 */
+		g_free(drivers[i]->priv);
+		drivers[i]->priv = NULL;
 	}
+
+	g_hash_table_destroy(driver_inits);
+	driver_inits = NULL;
+}
+
+/** @private */
+SR_PRIV void sr_hw_context_set(struct sr_context *ctx)
+{
+	driver_ctx = ctx;
+}
+
+/** @private */
+SR_PRIV void sr_hw_context_unset(struct sr_context *ctx)
+{
+	if (driver_ctx == ctx)
+		driver_ctx = NULL;
 }
 
 /**
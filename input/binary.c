@@ -18,6 +18,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -29,17 +30,15 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "input/binary: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
-#define CHUNKSIZE             (512 * 1024)
 #define DEFAULT_NUM_PROBES    8
 
 struct context {
 	uint64_t samplerate;
+	uint16_t unitsize;
+	/* Start of a unit split across two pieces of streamed data. */
+	uint8_t *partial;
+	uint16_t partial_len;
 };
 
 static int format_match(const char *filename)
@@ -96,22 +95,18 @@ static int init(struct sr_input *in)
 	return SR_OK;
 }
 
-static int loadfile(struct sr_input *in, const char *filename)
+/* Send the packets the data is preceded by. */
+static void start_feed(struct sr_input *in)
 {
 	struct sr_datafeed_header header;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_meta_logic meta;
-	struct sr_datafeed_logic logic;
-	unsigned char buffer[CHUNKSIZE];
-	int fd, size, num_probes;
+	int num_probes;
 	struct context *ctx;
 
 	ctx = in->internal;
-
-	if ((fd = open(filename, O_RDONLY)) == -1)
-		return SR_ERR;
-
 	num_probes = g_slist_length(in->sdi->probes);
+	ctx->unitsize = (num_probes + 7) / 8;
 
 	/* Send header packet to the session bus. */
 	header.feed_version = 1;
@@ -126,24 +121,116 @@ static int loadfile(struct sr_input *in, const char *filename)
 	meta.samplerate = ctx->samplerate;
 	meta.num_probes = num_probes;
 	sr_session_send(in->sdi, &packet);
+}
 
-	/* Chop up the input file into chunks & send it to the session bus. */
-	packet.type = SR_DF_LOGIC;
-	packet.payload = &logic;
-	logic.unitsize = (num_probes + 7) / 8;
-	logic.data = buffer;
-	while ((size = read(fd, buffer, CHUNKSIZE)) > 0) {
-		logic.length = size;
-		sr_session_send(in->sdi, &packet);
-	}
-	close(fd);
+/* Send the end packet, and free the context. */
+static void end_feed(struct sr_input *in)
+{
+	struct sr_datafeed_packet packet;
+	struct context *ctx;
+
+	ctx = in->internal;
 
 	/* Send end packet to the session bus. */
 	packet.type = SR_DF_END;
+	packet.payload = NULL;
 	sr_session_send(in->sdi, &packet);
 
+	g_free(ctx->partial);
 	g_free(ctx);
 	in->internal = NULL;
+}
+
+static int loadfile(struct sr_input *in, const char *filename)
+{
+	int fd;
+	struct context *ctx;
+
+	ctx = in->internal;
+
+	if ((fd = open(filename, O_RDONLY)) == -1)
+		return SR_ERR;
+
+	start_feed(in);
+
+	/* Send the whole input file to the session bus. */
+	sr_input_file_send(in->sdi, fd, UINT64_MAX, ctx->unitsize);
+	close(fd);
+
+	end_feed(in);
+
+	return SR_OK;
+}
+
+static void send_logic(struct sr_input *in, const uint8_t *data,
+		       uint64_t length)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	struct context *ctx;
+
+	ctx = in->internal;
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.length = length;
+	logic.unitsize = ctx->unitsize;
+	logic.data = (void *)data;
+	logic.buffer = NULL;
+	sr_session_send(in->sdi, &packet);
+}
+
+static int stream_begin(struct sr_input *in)
+{
+	struct context *ctx;
+
+	ctx = in->internal;
+
+	start_feed(in);
+	if (!(ctx->partial = g_try_malloc(ctx->unitsize))) {
+		sr_err("Partial unit malloc failed.");
+		return SR_ERR_MALLOC;
+	}
+
+	return SR_OK;
+}
+
+static int stream_receive(struct sr_input *in, const void *buf, uint64_t len)
+{
+	const uint8_t *data;
+	uint64_t n;
+	struct context *ctx;
+
+	ctx = in->internal;
+	data = buf;
+
+	/* Complete the unit the previous piece ended in first. */
+	if (ctx->partial_len) {
+		n = MIN(len, (uint64_t)(ctx->unitsize - ctx->partial_len));
+		memcpy(ctx->partial + ctx->partial_len, data, n);
+		ctx->partial_len += n;
+		data += n;
+		len -= n;
+		if (ctx->partial_len < ctx->unitsize)
+			return SR_OK;
+		send_logic(in, ctx->partial, ctx->unitsize);
+		ctx->partial_len = 0;
+	}
+
+	/* Send the whole units in place, and keep the rest. */
+	n = len - len % ctx->unitsize;
+	if (n)
+		send_logic(in, data, n);
+	memcpy(ctx->partial, data + n, len - n);
+	ctx->partial_len = len - n;
+
+	return SR_OK;
+}
+
+static int stream_end(struct sr_input *in)
+{
+	/* An incomplete unit at the end is dropped. */
+	end_feed(in);
 
 	return SR_OK;
 }
@@ -154,4 +241,7 @@ SR_PRIV struct sr_input_format input_binary = {
 	.format_match = format_match,
 	.init = init,
 	.loadfile = loadfile,
+	.begin = stream_begin,
+	.receive = stream_receive,
+	.end = stream_end,
 };
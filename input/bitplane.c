@@ -0,0 +1,509 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reads the bit-plane files written by the "bitplane" output module (see
+ * the file layout in libsigrok-internal.h). The input module has the
+ * following options:
+ *
+ * numprobes:   Maximum number of probes to use, in the order they are
+ *              listed in the file. Only the planes of these probes are
+ *              read from the file.
+ *
+ * skip:        Number of samples to skip at the start of the capture.
+ *              The block holding the first sample to send is looked up
+ *              in the file's index, the blocks before it aren't read.
+ *
+ * Blocks in which none of the used probes has any transitions are sent
+ * as a single SR_DF_LOGIC_RLE run.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "input/bitplane: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+struct context {
+	int fd;
+	uint64_t samplerate;
+	/* Number of probes in the file, and the number of them used. */
+	unsigned int num_file_probes;
+	unsigned int num_probes;
+	uint16_t unitsize;
+	uint32_t block_samples;
+	uint64_t skip;
+	/* The file's index: first sample and file offset of each block. */
+	uint64_t *index;
+	uint64_t num_blocks;
+	uint64_t num_samples;
+	/* Block header and plane descriptors of the current block. */
+	uint8_t *desc;
+	/* Plane of the current probe, and the samples of the block. */
+	uint8_t *plane;
+	uint8_t *logic;
+};
+
+static int format_match(const char *filename)
+{
+	char magic[BITPLANE_MAGIC_LEN];
+	int fd;
+	ssize_t len;
+
+	if ((fd = open(filename, O_RDONLY)) == -1)
+		return FALSE;
+	len = read(fd, magic, BITPLANE_MAGIC_LEN);
+	close(fd);
+
+	return len == BITPLANE_MAGIC_LEN &&
+		!memcmp(magic, BITPLANE_MAGIC, BITPLANE_MAGIC_LEN);
+}
+
+static int init(struct sr_input *in)
+{
+	struct context *ctx;
+	char *param;
+
+	if (!(ctx = g_try_malloc0(sizeof(*ctx)))) {
+		sr_err("Input format context malloc failed.");
+		return SR_ERR_MALLOC;
+	}
+
+	ctx->fd = -1;
+	ctx->num_probes = SR_MAX_NUM_PROBES;
+
+	if (in->param) {
+		param = g_hash_table_lookup(in->param, "numprobes");
+		if (param) {
+			ctx->num_probes = strtoul(param, NULL, 10);
+			if (ctx->num_probes < 1) {
+				g_free(ctx);
+				return SR_ERR;
+			}
+		}
+
+		param = g_hash_table_lookup(in->param, "skip");
+		if (param)
+			ctx->skip = strtoull(param, NULL, 10);
+	}
+
+	/* Create a virtual device. Its probes are listed in the file. */
+	in->sdi = sr_dev_inst_new(0, SR_ST_ACTIVE, NULL, NULL, NULL);
+	in->internal = ctx;
+
+	return SR_OK;
+}
+
+/* Read 'len' bytes at 'offset' of the file. */
+static int read_at(struct context *ctx, uint64_t offset, void *buf,
+		   uint64_t len)
+{
+	uint8_t *p;
+	ssize_t n;
+
+	if (lseek(ctx->fd, offset, SEEK_SET) == (off_t)-1) {
+		sr_err("Failed to seek to offset %" PRIu64 ": %s.",
+		       offset, strerror(errno));
+		return SR_ERR;
+	}
+
+	for (p = buf; len; p += n, len -= n) {
+		n = read(ctx->fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0) {
+			sr_err("Failed to read %" PRIu64 " bytes at offset "
+			       "%" PRIu64 ": %s.", len, offset,
+			       n ? strerror(errno) : "end of file");
+			return SR_ERR;
+		}
+	}
+
+	return SR_OK;
+}
+
+/* Read the file header, and create the probes listed in it. */
+static int read_header(struct sr_input *in)
+{
+	struct context *ctx;
+	struct sr_probe *probe;
+	uint8_t hdr[BITPLANE_HEADER_SIZE];
+	char *names, *name, *end;
+	uint32_t names_size;
+	unsigned int i;
+	int ret;
+
+	ctx = in->internal;
+
+	if ((ret = read_at(ctx, 0, hdr, sizeof(hdr))) != SR_OK)
+		return ret;
+
+	if (memcmp(hdr, BITPLANE_MAGIC, BITPLANE_MAGIC_LEN)) {
+		sr_err("Not a bit-plane file.");
+		return SR_ERR;
+	}
+	if (RL32(hdr + 8) != BITPLANE_VERSION) {
+		sr_err("Unsupported file version %u.", RL32(hdr + 8));
+		return SR_ERR;
+	}
+
+	ctx->num_file_probes = RL32(hdr + 12);
+	ctx->samplerate = RL64(hdr + 16);
+	ctx->block_samples = RL32(hdr + 24);
+	names_size = RL32(hdr + 28);
+	if (ctx->num_file_probes < 1 ||
+	    ctx->num_file_probes > SR_MAX_NUM_PROBES ||
+	    ctx->block_samples < 1 ||
+	    names_size > ctx->num_file_probes * (SR_MAX_PROBENAME_LEN + 1)) {
+		sr_err("Invalid file header.");
+		return SR_ERR;
+	}
+	ctx->num_probes = MIN(ctx->num_probes, ctx->num_file_probes);
+	ctx->unitsize = (ctx->num_probes + 7) / 8;
+
+	if (!(names = g_try_malloc(names_size + 1))) {
+		sr_err("Probe names malloc failed.");
+		return SR_ERR_MALLOC;
+	}
+	if ((ret = read_at(ctx, BITPLANE_HEADER_SIZE, names,
+			names_size)) != SR_OK) {
+		g_free(names);
+		return ret;
+	}
+	names[names_size] = '\0';
+
+	name = names;
+	end = names + names_size;
+	for (i = 0; i < ctx->num_probes; i++) {
+		if (name >= end) {
+			sr_err("Probe names missing from the file header.");
+			g_free(names);
+			return SR_ERR;
+		}
+		if (!(probe = sr_probe_new(i, SR_PROBE_LOGIC, TRUE, name))) {
+			g_free(names);
+			return SR_ERR;
+		}
+		in->sdi->probes = g_slist_append(in->sdi->probes, probe);
+		name += strlen(name) + 1;
+	}
+	g_free(names);
+
+	return SR_OK;
+}
+
+/* Read the trailer at the end of the file, and the index it points to. */
+static int read_index(struct context *ctx)
+{
+	struct stat st;
+	uint8_t trailer[BITPLANE_TRAILER_SIZE], *index;
+	uint64_t index_offset, size, i;
+	int ret;
+
+	if (fstat(ctx->fd, &st) == -1 ||
+	    (uint64_t)st.st_size < BITPLANE_HEADER_SIZE + BITPLANE_MAGIC_LEN +
+				   BITPLANE_TRAILER_SIZE) {
+		sr_err("File too short.");
+		return SR_ERR;
+	}
+
+	if ((ret = read_at(ctx, st.st_size - BITPLANE_TRAILER_SIZE,
+			trailer, sizeof(trailer))) != SR_OK)
+		return ret;
+	if (memcmp(trailer + 24, BITPLANE_MAGIC, BITPLANE_MAGIC_LEN)) {
+		sr_err("File has no index, is it truncated?");
+		return SR_ERR;
+	}
+
+	ctx->num_blocks = RL64(trailer);
+	ctx->num_samples = RL64(trailer + 8);
+	index_offset = RL64(trailer + 16);
+	size = BITPLANE_MAGIC_LEN +
+		ctx->num_blocks * BITPLANE_INDEX_ENTRY_SIZE;
+	if (index_offset > (uint64_t)st.st_size ||
+	    ctx->num_blocks > (uint64_t)st.st_size / 16 ||
+	    index_offset + size + BITPLANE_TRAILER_SIZE !=
+	    (uint64_t)st.st_size) {
+		sr_err("Invalid file trailer.");
+		return SR_ERR;
+	}
+
+	if (!(index = g_try_malloc(size))) {
+		sr_err("Index malloc failed.");
+		return SR_ERR_MALLOC;
+	}
+	if (!(ctx->index = g_try_malloc(ctx->num_blocks * 2 *
+			sizeof(uint64_t) + 1))) {
+		sr_err("Index malloc failed.");
+		g_free(index);
+		return SR_ERR_MALLOC;
+	}
+	if ((ret = read_at(ctx, index_offset, index, size)) != SR_OK) {
+		g_free(index);
+		return ret;
+	}
+	if (memcmp(index, BITPLANE_INDEX_MAGIC, BITPLANE_MAGIC_LEN)) {
+		sr_err("Invalid file index.");
+		g_free(index);
+		return SR_ERR;
+	}
+	for (i = 0; i < ctx->num_blocks; i++) {
+		ctx->index[2 * i] = RL64(index + BITPLANE_MAGIC_LEN +
+				i * BITPLANE_INDEX_ENTRY_SIZE);
+		ctx->index[2 * i + 1] = RL64(index + BITPLANE_MAGIC_LEN +
+				i * BITPLANE_INDEX_ENTRY_SIZE + 8);
+	}
+	g_free(index);
+
+	return SR_OK;
+}
+
+/* Find the block holding sample 'sample', by binary search of the index. */
+static uint64_t block_find(const struct context *ctx, uint64_t sample)
+{
+	uint64_t lo, hi, mid;
+
+	/* The last block starting at or before 'sample'. */
+	lo = 0;
+	hi = ctx->num_blocks;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (ctx->index[2 * mid] <= sample)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Send the packets the data is preceded by. */
+static void start_feed(struct sr_input *in)
+{
+	struct sr_datafeed_header header;
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_meta_logic meta;
+	struct context *ctx;
+
+	ctx = in->internal;
+
+	/* Send header packet to the session bus. */
+	header.feed_version = 1;
+	gettimeofday(&header.starttime, NULL);
+	packet.type = SR_DF_HEADER;
+	packet.payload = &header;
+	sr_session_send(in->sdi, &packet);
+
+	/* Send metadata about the SR_DF_LOGIC packets to come. */
+	packet.type = SR_DF_META_LOGIC;
+	packet.payload = &meta;
+	meta.samplerate = ctx->samplerate;
+	meta.num_probes = ctx->num_probes;
+	sr_session_send(in->sdi, &packet);
+}
+
+/* Send the end packet. */
+static void end_feed(struct sr_input *in)
+{
+	struct sr_datafeed_packet packet;
+
+	packet.type = SR_DF_END;
+	packet.payload = NULL;
+	sr_session_send(in->sdi, &packet);
+}
+
+/* Send the samples of a block, starting at sample 'start' of it. */
+static int block_send(struct sr_input *in, uint64_t block, uint64_t start)
+{
+	struct context *ctx;
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	struct sr_datafeed_logic_rle rle;
+	struct sr_logic_run run;
+	const uint8_t *desc;
+	uint8_t *unit;
+	uint64_t offset, n, words, w, x, s, plane_offset;
+	unsigned int p, byte, mask;
+	gboolean constant;
+	int ret;
+
+	ctx = in->internal;
+	offset = ctx->index[2 * block + 1];
+
+	if ((ret = read_at(ctx, offset, ctx->desc, BITPLANE_BLOCK_HEADER_SIZE +
+			ctx->num_file_probes * BITPLANE_PLANE_SIZE)) != SR_OK)
+		return ret;
+	n = RL32(ctx->desc + 8);
+	if (RL64(ctx->desc) != ctx->index[2 * block] ||
+	    n > ctx->block_samples) {
+		sr_err("Invalid header of block %" PRIu64 ".", block);
+		return SR_ERR;
+	}
+	if (start >= n)
+		return SR_OK;
+	words = (n + 63) / 64;
+
+	constant = TRUE;
+	for (p = 0; p < ctx->num_probes; p++) {
+		desc = ctx->desc + BITPLANE_BLOCK_HEADER_SIZE +
+			p * BITPLANE_PLANE_SIZE;
+		if (RL32(desc))
+			constant = FALSE;
+	}
+
+	if (constant) {
+		/* An idle block takes a single run. */
+		run.value = 0;
+		run.length = n - start;
+		for (p = 0; p < ctx->num_probes; p++) {
+			desc = ctx->desc + BITPLANE_BLOCK_HEADER_SIZE +
+				p * BITPLANE_PLANE_SIZE;
+			if (desc[4])
+				run.value |= (uint64_t)1 << p;
+		}
+		packet.type = SR_DF_LOGIC_RLE;
+		packet.payload = &rle;
+		rle.num_runs = 1;
+		rle.unitsize = ctx->unitsize;
+		rle.runs = &run;
+		rle.buffer = NULL;
+		sr_session_send(in->sdi, &packet);
+		return SR_OK;
+	}
+
+	/* Turn the planes of the used probes back into samples. */
+	memset(ctx->logic, 0, n * ctx->unitsize);
+	for (p = 0; p < ctx->num_probes; p++) {
+		desc = ctx->desc + BITPLANE_BLOCK_HEADER_SIZE +
+			p * BITPLANE_PLANE_SIZE;
+		byte = p / 8;
+		mask = 1 << (p % 8);
+		plane_offset = RL64(desc + 8);
+		if (!plane_offset) {
+			if (!desc[4])
+				continue;
+			for (unit = ctx->logic + byte, s = 0; s < n;
+			     s++, unit += ctx->unitsize)
+				*unit |= mask;
+			continue;
+		}
+		if ((ret = read_at(ctx, offset + plane_offset, ctx->plane,
+				words * 8)) != SR_OK)
+			return ret;
+		for (w = 0; w < words; w++) {
+			for (x = RL64(ctx->plane + w * 8); x; x &= x - 1) {
+				s = w * 64 + __builtin_ctzll(x);
+				if (s < n)
+					ctx->logic[s * ctx->unitsize + byte] |=
+						mask;
+			}
+		}
+	}
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.length = (n - start) * ctx->unitsize;
+	logic.unitsize = ctx->unitsize;
+	logic.data = ctx->logic + start * ctx->unitsize;
+	logic.buffer = NULL;
+	sr_session_send(in->sdi, &packet);
+
+	return SR_OK;
+}
+
+static void context_free(struct sr_input *in)
+{
+	struct context *ctx;
+
+	ctx = in->internal;
+	if (ctx->fd != -1)
+		close(ctx->fd);
+	g_free(ctx->index);
+	g_free(ctx->desc);
+	g_free(ctx->plane);
+	g_free(ctx->logic);
+	g_free(ctx);
+	in->internal = NULL;
+}
+
+static int loadfile(struct sr_input *in, const char *filename)
+{
+	struct context *ctx;
+	uint64_t block, start;
+	int ret;
+
+	ctx = in->internal;
+
+	if ((ctx->fd = open(filename, O_RDONLY)) == -1) {
+		sr_err("Failed to open %s: %s.", filename, strerror(errno));
+		context_free(in);
+		return SR_ERR;
+	}
+
+	if ((ret = read_header(in)) != SR_OK ||
+	    (ret = read_index(ctx)) != SR_OK) {
+		context_free(in);
+		return ret;
+	}
+
+	ctx->desc = g_try_malloc(BITPLANE_BLOCK_HEADER_SIZE +
+			ctx->num_file_probes * BITPLANE_PLANE_SIZE);
+	ctx->plane = g_try_malloc((ctx->block_samples + 63) / 64 * 8);
+	ctx->logic = g_try_malloc((uint64_t)ctx->block_samples *
+			ctx->unitsize);
+	if (!ctx->desc || !ctx->plane || !ctx->logic) {
+		sr_err("Block buffer malloc failed.");
+		context_free(in);
+		return SR_ERR_MALLOC;
+	}
+
+	start_feed(in);
+
+	ret = SR_OK;
+	if (ctx->num_blocks && ctx->skip < ctx->num_samples) {
+		block = block_find(ctx, ctx->skip);
+		start = ctx->skip - MIN(ctx->skip, ctx->index[2 * block]);
+		for (; block < ctx->num_blocks && ret == SR_OK; block++) {
+			ret = block_send(in, block, start);
+			start = 0;
+		}
+	}
+
+	end_feed(in);
+	context_free(in);
+
+	return ret;
+}
+
+SR_PRIV struct sr_input_format input_bitplane = {
+	.id = "bitplane",
+	.description = "Indexed per-probe bit-planes",
+	.format_match = format_match,
+	.init = init,
+	.loadfile = loadfile,
+};
@@ -28,11 +28,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "input/chronovu-la8: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 #define NUM_PACKETS		2048
 #define PACKET_SIZE		4096
@@ -140,9 +135,8 @@ static int loadfile(struct sr_input *in, const char *filename)
 	struct sr_datafeed_header header;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_meta_logic meta;
-	struct sr_datafeed_logic logic;
-	uint8_t buf[PACKET_SIZE], divcount;
-	int i, fd, size, num_probes;
+	uint8_t divcount;
+	int fd, num_probes;
 	uint64_t samplerate;
 
 	/* TODO: Use glib functions! GIOChannel, g_fopen, etc. */
@@ -183,18 +177,10 @@ static int loadfile(struct sr_input *in, const char *filename)
 
 	/* Send data packets to the session bus. */
 	sr_dbg("%s: sending SR_DF_LOGIC data packets", __func__);
-	packet.type = SR_DF_LOGIC;
-	packet.payload = &logic;
-	logic.unitsize = (num_probes + 7) / 8;
-	logic.data = buf;
-
-	/* Send 8MB of total data to the session bus in small chunks. */
-	for (i = 0; i < NUM_PACKETS; i++) {
-		/* TODO: Handle errors, handle incomplete reads. */
-		size = read(fd, buf, PACKET_SIZE);
-		logic.length = size;
-		sr_session_send(in->sdi, &packet);
-	}
+
+	/* Send the 8MB of sample data, without the trailing bytes. */
+	sr_input_file_send(in->sdi, fd, NUM_PACKETS * PACKET_SIZE,
+			   (num_probes + 7) / 8);
 	close(fd); /* FIXME */
 
 	/* Send end packet to the session bus. */
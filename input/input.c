@@ -17,8 +17,27 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <glib.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "input: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
 
 /**
  * @file
@@ -31,6 +50,17 @@
  *
  * Input file/data format handling.
  *
+ * An input format either loads a whole file at once (loadfile()), or,
+ * if it supports streaming, is fed its data piece by piece from any
+ * source: see sr_input_begin(), sr_input_receive() and sr_input_end().
+ * sr_input_source_add() does the feeding from a file descriptor, such as
+ * a pipe or socket, as part of the session's main loop.
+ *
+ * Streaming inputs compressed with gzip or Zstandard are decompressed on
+ * the fly for formats which ask for it (a set 'decompress' field), if
+ * libsigrok was built with zlib or libzstd respectively; the format only
+ * ever sees the decompressed data.
+ *
  * @{
  */
 
@@ -38,11 +68,49 @@
 extern SR_PRIV struct sr_input_format input_chronovu_la8;
 extern SR_PRIV struct sr_input_format input_binary;
 extern SR_PRIV struct sr_input_format input_vcd;
+extern SR_PRIV struct sr_input_format input_bitplane;
+
+/* Size of the logic packets sent from a mapped file. */
+#define INPUT_PACKET_SIZE (4 * 1024 * 1024)
+/* Size of the read buffer, for files which can't be mapped. */
+#define INPUT_READ_SIZE (512 * 1024)
+/* Size of the buffer decompressed data is passed to the format in. */
+#define INPUT_CODEC_BUF_SIZE (256 * 1024)
+/* Most input zlib takes in one go (its lengths are unsigned ints). */
+#define INPUT_ZLIB_IN_MAX (1024 * 1024 * 1024)
+/* Length of the longest magic number, see sr_input_compression(). */
+#define INPUT_MAGIC_LEN 4
 /* @endcond */
 
+/* Decompression of a streaming input, see sr_input_receive(). */
+struct input_codec {
+	/* SR_COMPRESS_*, or 0 until enough data arrived to tell. */
+	int method;
+	uint8_t magic[INPUT_MAGIC_LEN];
+	size_t magic_len;
+#ifdef HAVE_ZLIB
+	z_stream zs;
+#endif
+#ifdef HAVE_LIBZSTD
+	ZSTD_DStream *zd;
+#endif
+	uint8_t *out;
+	/* The compressed stream ended where the data did. */
+	gboolean done;
+	/* Decompression failed, the rest of the data is ignored. */
+	gboolean failed;
+};
+
+/* An input fed from a file descriptor, see sr_input_source_add(). */
+struct input_source {
+	struct sr_input *in;
+	uint8_t buf[INPUT_READ_SIZE];
+};
+
 static struct sr_input_format *input_module_list[] = {
 	&input_vcd,
 	&input_chronovu_la8,
+	&input_bitplane,
 	/* This one has to be last, because it will take any input. */
 	&input_binary,
 	NULL,
@@ -53,4 +121,579 @@ SR_API struct sr_input_format **sr_input_list(void)
 	return input_module_list;
 }
 
+/**
+ * Tell whether data starts with the magic number of a compressed stream.
+ *
+ * @param buf The start of the data. Must not be NULL.
+ * @param len The length of 'buf' in bytes.
+ *
+ * @return SR_COMPRESS_GZIP or SR_COMPRESS_ZSTD, or 0 if the data isn't
+ *         compressed (or too short to tell).
+ *
+ * @private
+ */
+SR_PRIV int sr_input_compression(const uint8_t *buf, size_t len)
+{
+	static const uint8_t gzip_magic[] = { 0x1f, 0x8b };
+	static const uint8_t zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+	if (len >= sizeof(gzip_magic) &&
+	    !memcmp(buf, gzip_magic, sizeof(gzip_magic)))
+		return SR_COMPRESS_GZIP;
+	if (len >= sizeof(zstd_magic) &&
+	    !memcmp(buf, zstd_magic, sizeof(zstd_magic)))
+		return SR_COMPRESS_ZSTD;
+
+	return 0;
+}
+
+static void codec_free(struct input_codec *c)
+{
+	if (!c)
+		return;
+
+#ifdef HAVE_ZLIB
+	if (c->method == SR_COMPRESS_GZIP)
+		inflateEnd(&c->zs);
+#endif
+#ifdef HAVE_LIBZSTD
+	if (c->method == SR_COMPRESS_ZSTD)
+		ZSTD_freeDStream(c->zd);
+#endif
+	g_free(c->out);
+	g_free(c);
+}
+
+/* Set up decompression once the magic number told the method. */
+static int codec_start(struct input_codec *c, int method)
+{
+	switch (method) {
+#ifdef HAVE_ZLIB
+	case SR_COMPRESS_GZIP:
+		/* A window of up to 2^15 bytes, plus 16 for a gzip wrapper. */
+		if (inflateInit2(&c->zs, 15 + 16) != Z_OK) {
+			sr_err("%s: inflateInit2 failed", __func__);
+			return SR_ERR;
+		}
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case SR_COMPRESS_ZSTD:
+		if (!(c->zd = ZSTD_createDStream())) {
+			sr_err("%s: ZSTD_createDStream failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		break;
+#endif
+	default:
+		sr_err("The input is %s compressed, which libsigrok was "
+		       "built without support for.",
+		       method == SR_COMPRESS_GZIP ? "gzip" : "Zstandard");
+		return SR_ERR;
+	}
+	c->method = method;
+
+	if (!(c->out = g_try_malloc(INPUT_CODEC_BUF_SIZE))) {
+		sr_err("%s: buffer malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	return SR_OK;
+}
+
+#ifdef HAVE_ZLIB
+static int gzip_receive(struct sr_input *in, const uint8_t *buf, uint64_t len)
+{
+	struct input_codec *c;
+	z_stream *zs;
+	uInt n;
+	int zret, ret;
+
+	c = in->codec;
+	zs = &c->zs;
+	while (len > 0) {
+		n = MIN(len, INPUT_ZLIB_IN_MAX);
+		zs->next_in = (Bytef *)buf;
+		zs->avail_in = n;
+		buf += n;
+		len -= n;
+		do {
+			zs->next_out = c->out;
+			zs->avail_out = INPUT_CODEC_BUF_SIZE;
+			zret = inflate(zs, Z_NO_FLUSH);
+			if (zret != Z_OK && zret != Z_STREAM_END &&
+			    zret != Z_BUF_ERROR) {
+				sr_err("Failed to decompress the input: %s.",
+				       zs->msg ? zs->msg : "invalid data");
+				return SR_ERR;
+			}
+			if (zs->avail_out < INPUT_CODEC_BUF_SIZE &&
+			    (ret = in->format->receive(in, c->out,
+				    INPUT_CODEC_BUF_SIZE - zs->avail_out))
+			    != SR_OK)
+				return ret;
+			c->done = zret == Z_STREAM_END;
+			/* Another gzip member may follow this one. */
+			if (c->done && zs->avail_in > 0)
+				inflateReset(zs);
+		} while (zs->avail_in > 0 || zs->avail_out == 0);
+	}
+
+	return SR_OK;
+}
+#endif
+
+#ifdef HAVE_LIBZSTD
+static int zstd_receive(struct sr_input *in, const uint8_t *buf, uint64_t len)
+{
+	struct input_codec *c;
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	size_t zret;
+	int ret;
+
+	c = in->codec;
+	zin.src = buf;
+	zin.size = len;
+	zin.pos = 0;
+	do {
+		zout.dst = c->out;
+		zout.size = INPUT_CODEC_BUF_SIZE;
+		zout.pos = 0;
+		zret = ZSTD_decompressStream(c->zd, &zout, &zin);
+		if (ZSTD_isError(zret)) {
+			sr_err("Failed to decompress the input: %s.",
+			       ZSTD_getErrorName(zret));
+			return SR_ERR;
+		}
+		if (zout.pos > 0 &&
+		    (ret = in->format->receive(in, c->out, zout.pos)) != SR_OK)
+			return ret;
+		/* A frame ended, and further ones are decoded just as well. */
+		c->done = zret == 0;
+	} while (zin.pos < zin.size || zout.pos == zout.size);
+
+	return SR_OK;
+}
+#endif
+
+/* Pass compressed data to the format, decompressed. */
+static int codec_receive(struct sr_input *in, const uint8_t *buf,
+			 uint64_t len)
+{
+	struct input_codec *c;
+
+	c = in->codec;
+	switch (c->method) {
+#ifdef HAVE_ZLIB
+	case SR_COMPRESS_GZIP:
+		return gzip_receive(in, buf, len);
+#endif
+#ifdef HAVE_LIBZSTD
+	case SR_COMPRESS_ZSTD:
+		return zstd_receive(in, buf, len);
+#endif
+	default:
+		return SR_ERR_BUG;
+	}
+}
+
+/*
+ * The start of the data tells whether it is compressed. Until enough of
+ * it arrived, it is kept in the codec. Returns how much of 'buf' went
+ * into the magic number.
+ */
+static size_t codec_sniff(struct sr_input *in, const uint8_t *buf,
+			  uint64_t len, int *ret)
+{
+	struct input_codec *c;
+	size_t n;
+	int method;
+
+	c = in->codec;
+	n = MIN(len, INPUT_MAGIC_LEN - c->magic_len);
+	memcpy(c->magic + c->magic_len, buf, n);
+	c->magic_len += n;
+	*ret = SR_OK;
+	if (c->magic_len < INPUT_MAGIC_LEN)
+		return n;
+
+	if (!(method = sr_input_compression(c->magic, c->magic_len))) {
+		/* Plain data, which goes to the format as it is from now on. */
+		in->codec = NULL;
+		*ret = in->format->receive(in, c->magic, c->magic_len);
+		codec_free(c);
+		return n;
+	}
+
+	if ((*ret = codec_start(c, method)) == SR_OK)
+		*ret = codec_receive(in, c->magic, c->magic_len);
+
+	return n;
+}
+
+/**
+ * Start feeding data to an input format which supports streaming.
+ *
+ * The input must have been set up with the format's init() function. All
+ * data is then passed in with sr_input_receive(), in pieces of any size,
+ * and sr_input_end() finishes the input.
+ *
+ * @param in The input. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments or if the
+ *         format doesn't support streaming, or another negative error
+ *         code from the format.
+ */
+SR_API int sr_input_begin(struct sr_input *in)
+{
+	int ret;
+
+	if (!in || !in->format) {
+		sr_err("%s: in or its format was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!in->format->begin || !in->format->receive || !in->format->end) {
+		sr_err("%s: input format '%s' doesn't support streaming",
+		       __func__, in->format->id);
+		return SR_ERR_ARG;
+	}
+
+	/* Without a codec, the data goes to the format as it is. */
+	in->codec = NULL;
+	if (in->format->decompress &&
+	    !(in->codec = g_try_malloc0(sizeof(struct input_codec)))) {
+		sr_err("%s: codec malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	if ((ret = in->format->begin(in)) != SR_OK && in->codec) {
+		codec_free(in->codec);
+		in->codec = NULL;
+	}
+
+	return ret;
+}
+
+/**
+ * Feed the next piece of data to a streaming input.
+ *
+ * Right away, the format parses as much of the data as it can and sends
+ * packets for it to the session bus. Anything left over (e.g. a sample
+ * split across two pieces) is kept until more data arrives. The data
+ * itself may be reused as soon as this returns.
+ *
+ * If the format asks for it, and the data starts with the magic number of
+ * a gzip or Zstandard stream, it is decompressed before the format parses
+ * it.
+ *
+ * @param in The input, as passed to sr_input_begin(). Must not be NULL.
+ * @param buf The data. Must not be NULL.
+ * @param len The length of the data in bytes.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or another
+ *         negative error code if the data couldn't be parsed. In that case
+ *         sr_input_end() still has to be called.
+ */
+SR_API int sr_input_receive(struct sr_input *in, const void *buf,
+		uint64_t len)
+{
+	struct input_codec *c;
+	size_t n;
+	int ret;
+
+	if (!in || !in->format || !in->format->receive || !buf) {
+		sr_err("%s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(c = in->codec))
+		return in->format->receive(in, buf, len);
+
+	if (c->failed)
+		return SR_ERR;
+
+	ret = SR_OK;
+	if (!c->method) {
+		n = codec_sniff(in, buf, len, &ret);
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+		if (!in->codec)
+			return ret == SR_OK ? in->format->receive(in, buf, len)
+					    : ret;
+	}
+	if (ret == SR_OK && len > 0)
+		ret = codec_receive(in, buf, len);
+	if (ret != SR_OK)
+		c->failed = TRUE;
+
+	return ret;
+}
+
+/**
+ * Finish a streaming input.
+ *
+ * Any data left over is parsed as the end of the input, the SR_DF_END
+ * packet is sent (if a header was sent), and the input's private state is
+ * freed.
+ *
+ * @param in The input, as passed to sr_input_begin(). Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or another
+ *         negative error code if the input was incomplete or invalid.
+ */
+SR_API int sr_input_end(struct sr_input *in)
+{
+	struct input_codec *c;
+	int ret, end_ret;
+
+	if (!in || !in->format || !in->format->end) {
+		sr_err("%s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	ret = SR_OK;
+	if ((c = in->codec)) {
+		if (c->failed) {
+			ret = SR_ERR;
+		} else if (!c->method && c->magic_len > 0) {
+			/* Too short to be compressed. */
+			ret = in->format->receive(in, c->magic, c->magic_len);
+		} else if (c->method && !c->done) {
+			sr_err("The compressed input was truncated.");
+			ret = SR_ERR;
+		}
+		codec_free(c);
+		in->codec = NULL;
+	}
+
+	end_ret = in->format->end(in);
+
+	return ret != SR_OK ? ret : end_ret;
+}
+
+static int input_source_receive(int fd, int revents, void *cb_data)
+{
+	struct input_source *src;
+	ssize_t len;
+
+	(void)revents;
+
+	src = cb_data;
+
+	len = read(fd, src->buf, sizeof(src->buf));
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return TRUE;
+
+	if (len > 0 && sr_input_receive(src->in, src->buf, len) == SR_OK)
+		return TRUE;
+
+	/* End of the data, or an error; either way the input is done. */
+	if (len < 0)
+		sr_err("Failed to read input: %s.", strerror(errno));
+	sr_input_end(src->in);
+	g_free(src);
+
+	return FALSE;
+}
+
+/**
+ * Feed a streaming input from a file descriptor in the session's main loop.
+ *
+ * This calls sr_input_begin(), then adds a source to the current session
+ * which passes all data read from 'fd' to sr_input_receive(), as it
+ * arrives. This way, e.g. the output of a decompressor or a network
+ * socket can be parsed while it is produced. At the end of the data, or
+ * upon an error, sr_input_end() is called and the source is removed, so
+ * sr_session_run() returns once all sources are done. The descriptor
+ * isn't closed.
+ *
+ * @param in The input, set up with its format's init(). Must not be NULL.
+ * @param fd The file descriptor to read from.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments or if the
+ *         format doesn't support streaming, SR_ERR_MALLOC upon memory
+ *         allocation errors, or another negative error code.
+ */
+SR_API int sr_input_source_add(struct sr_input *in, int fd)
+{
+	struct input_source *src;
+	int ret;
+
+	if (fd < 0) {
+		sr_err("%s: invalid fd", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(src = g_try_malloc(sizeof(struct input_source)))) {
+		sr_err("%s: input source malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	src->in = in;
+
+	if ((ret = sr_input_begin(in)) != SR_OK) {
+		g_free(src);
+		return ret;
+	}
+
+	if ((ret = sr_session_source_add(fd, G_IO_IN, 0, input_source_receive,
+					 src)) != SR_OK) {
+		sr_input_end(in);
+		g_free(src);
+		return ret;
+	}
+
+	return SR_OK;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+static void mapping_free(void *data, void *cb_data)
+{
+	munmap(data, GPOINTER_TO_SIZE(cb_data));
+}
+
+/*
+ * Send the file's data straight from a mapping of it. Returns SR_ERR if
+ * the file can't be mapped, before anything was sent.
+ */
+static int file_send_mapped(const struct sr_dev_inst *sdi, int fd,
+			    uint64_t length, uint16_t unitsize)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	struct sr_buffer *buf;
+	uint8_t *data;
+	uint64_t offset, packet_size;
+
+	if (length > SIZE_MAX)
+		return SR_ERR;
+
+	data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return SR_ERR;
+#ifdef MADV_SEQUENTIAL
+	madvise(data, length, MADV_SEQUENTIAL);
+#endif
+
+	/* The mapping goes away once no packet references it any more. */
+	buf = sr_buffer_new_full(data, length, mapping_free,
+				 GSIZE_TO_POINTER(length));
+	if (!buf) {
+		munmap(data, length);
+		return SR_ERR_MALLOC;
+	}
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.unitsize = unitsize;
+	logic.buffer = buf;
+	packet_size = MAX(INPUT_PACKET_SIZE / unitsize, 1) * unitsize;
+	for (offset = 0; offset + unitsize <= length; offset += logic.length) {
+		logic.data = data + offset;
+		logic.length = MIN(packet_size, length - offset);
+		logic.length -= logic.length % unitsize;
+		sr_session_send(sdi, &packet);
+	}
+
+	sr_buffer_release(buf);
+
+	return SR_OK;
+}
+#endif
+
+/* Send the file's data through a read buffer. */
+static int file_send_read(const struct sr_dev_inst *sdi, int fd,
+			  uint64_t length, uint16_t unitsize)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	uint8_t *buf;
+	uint64_t size, fill, done;
+	ssize_t ret;
+
+	size = MAX(INPUT_READ_SIZE / unitsize, 1) * unitsize;
+	if (!(buf = g_try_malloc(size))) {
+		sr_err("%s: buffer malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.unitsize = unitsize;
+	logic.data = buf;
+	logic.buffer = NULL;
+	fill = done = 0;
+	while (done < length) {
+		ret = read(fd, buf + fill, MIN(size - fill, length - done));
+		if (ret <= 0)
+			break;
+		fill += ret;
+		done += ret;
+		/* Only whole units go out, the rest waits for the next read. */
+		logic.length = fill - fill % unitsize;
+		if (logic.length == 0)
+			continue;
+		sr_session_send(sdi, &packet);
+		fill -= logic.length;
+		memmove(buf, buf + logic.length, fill);
+	}
+
+	g_free(buf);
+
+	return SR_OK;
+}
+
+/**
+ * Send the samples in a raw logic data file to the session bus.
+ *
+ * The data from the start of the file, up to 'length' bytes of it, is
+ * sent as SR_DF_LOGIC packets; an incomplete unit at the end is dropped.
+ *
+ * If possible, the file is mapped into memory, and the packets point
+ * right into the mapping through a reference-counted buffer. The page
+ * cache then feeds the consumers directly, and they can keep the data
+ * without copying it (see sr_buffer_acquire()). Otherwise, the file is
+ * read in pieces.
+ *
+ * @param sdi The device instance to send the packets for.
+ * @param fd The file, open for reading and positioned at its start.
+ * @param length Maximum number of bytes to send, or UINT64_MAX to send
+ *               the whole file.
+ * @param unitsize Size of a sample in bytes. Must be > 0.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or
+ *         SR_ERR_MALLOC upon memory allocation errors.
+ *
+ * @private
+ */
+SR_PRIV int sr_input_file_send(const struct sr_dev_inst *sdi, int fd,
+			       uint64_t length, uint16_t unitsize)
+{
+	struct stat st;
+	int ret;
+
+	if (unitsize == 0) {
+		sr_err("%s: unitsize was 0", __func__);
+		return SR_ERR_ARG;
+	}
+
+	/* Regular files are mapped, up to their end. */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		length = MIN(length, (uint64_t)st.st_size);
+		if (length < unitsize)
+			return SR_OK;
+#ifdef HAVE_SYS_MMAN_H
+		ret = file_send_mapped(sdi, fd, length, unitsize);
+		if (ret != SR_ERR)
+			return ret;
+		sr_dbg("Can't map the file, reading it instead.");
+#endif
+	}
+
+	ret = file_send_read(sdi, fd, length, unitsize);
+
+	return ret;
+}
+
 /** @} */
@@ -41,6 +41,14 @@
  *              This can speed up analyzing of long captures.
  *              Default 0 = don't compress.
  *
+ * threads:     Number of threads parsing large files. The body of
+ *              the file is split into ranges at timestamps, which
+ *              are parsed in parallel.
+ *              Default: the number of online CPUs.
+ *
+ * Files compressed with gzip or Zstandard (.vcd.gz, .vcd.zst) are
+ * decompressed while they are parsed.
+ *
  * Based on Verilog standard IEEE Std 1364-2001 Version C
  *
  * Supported features:
@@ -61,102 +69,282 @@
 #include <glib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "input/vcd: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 #define DEFAULT_NUM_PROBES 8
 
-/* Read until specific type of character occurs in file.
- * Skip input if dest is NULL.
- * Modes:
- * 'W' read until whitespace
- * 'N' read until non-whitespace, and ungetc() the character
- * '$' read until $end
+/* Size of the read buffer; no token may be longer than this. */
+#define READ_BUFSIZE (1024 * 1024)
+
+/* Size of the ranges the body is split into for parallel parsing. */
+#define RANGE_SIZE (4 * 1024 * 1024)
+
+/* Maximum number of runs sent in one SR_DF_LOGIC_RLE packet. */
+#define MAX_RUNS 4096
+
+/* Buffered reader handing out whitespace-delimited tokens in place.
+ * It either reads from a file, or is fed data with reader_feed().
+ */
+struct reader
+{
+	FILE *file;
+	/* 'size' bytes, plus one for terminating the last token. */
+	char *buf;
+	size_t size;
+	size_t len;
+	size_t pos;
+	gboolean eof;
+	/* File offset of buf[0]. */
+	uint64_t offset;
+	/* No tokens starting at or after this file offset are returned. */
+	uint64_t limit;
+	/* Where parsing resumes if the fed data ran out (see reader_mark()). */
+	uint64_t mark;
+	/* Set when the fed data ran out, until more is fed. */
+	gboolean starved;
+};
+
+/* Start reading at the file's current position, or from the data fed
+ * if 'file' is NULL.
  */
-static gboolean read_until(FILE *file, GString *dest, char mode)
+static gboolean reader_init(struct reader *r, FILE *file, uint64_t limit)
 {
-	char prev[4] = "";
-	long startpos = ftell(file);
-	for(;;)
+	r->file = file;
+	r->size = READ_BUFSIZE;
+	r->len = r->pos = 0;
+	r->eof = FALSE;
+	r->offset = file ? ftello(file) : 0;
+	r->limit = limit;
+	r->mark = r->offset;
+	r->starved = FALSE;
+	if (!(r->buf = g_try_malloc(r->size + 1)))
 	{
-		int c = fgetc(file);
+		sr_err("Read buffer malloc failed.");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void reader_free(struct reader *r)
+{
+	g_free(r->buf);
+	r->buf = NULL;
+}
+
+/* Drop the data before 'keep' from the buffer. */
+static void reader_compact(struct reader *r, size_t keep)
+{
+	memmove(r->buf, r->buf + keep, r->len - keep);
+	r->offset += keep;
+	r->len -= keep;
+	r->pos -= keep;
+}
+
+/* Move the unparsed data to the front of the buffer and read more.
+ * Fed data is kept from the mark on, and there is no more of it.
+ */
+static gboolean reader_fill(struct reader *r)
+{
+	size_t n;
+
+	if (!r->file)
+	{
+		reader_compact(r, r->mark - r->offset);
+		r->starved = !r->eof;
+		return FALSE;
+	}
 
-		if (c == EOF)
+	reader_compact(r, r->pos);
+
+	n = fread(r->buf + r->len, 1, r->size - r->len, r->file);
+	r->len += n;
+	if (n == 0)
+		r->eof = TRUE;
+
+	return n > 0;
+}
+
+/* Append data to the buffer of a reader without a file. */
+static gboolean reader_feed(struct reader *r, const void *data, size_t len)
+{
+	char *buf;
+	size_t size;
+
+	reader_compact(r, r->mark - r->offset);
+
+	if (r->len + len > r->size)
+	{
+		size = MAX(r->size * 2, r->len + len);
+		if (!(buf = g_try_realloc(r->buf, size + 1)))
 		{
-			if (mode == '$')
-				sr_err("Unexpected EOF, read started at %ld.", startpos);
+			sr_err("Read buffer realloc failed.");
 			return FALSE;
 		}
-		
-		if (mode == 'W' && g_ascii_isspace(c))
-			return TRUE;
-		
-		if (mode == 'N' && !g_ascii_isspace(c))
-		{
-			ungetc(c, file);
-			return TRUE;
-		}
-		
-		if (mode == '$')
+		r->buf = buf;
+		r->size = size;
+	}
+
+	memcpy(r->buf + r->len, data, len);
+	r->len += len;
+	r->starved = FALSE;
+
+	return TRUE;
+}
+
+/* Mark the start of a unit which has to be parsed as a whole: if the fed
+ * data runs out in its middle, parsing starts over from the mark once
+ * more data arrives.
+ */
+static void reader_mark(struct reader *r)
+{
+	r->mark = r->offset + r->pos;
+}
+
+static void reader_rewind(struct reader *r)
+{
+	r->pos = r->mark - r->offset;
+}
+
+/* Whether the character separates tokens. Tokens handed out are
+ * terminated in place, so a NUL separates them when parsing starts over.
+ */
+static gboolean is_space(char c)
+{
+	return g_ascii_isspace(c) || c == '\0';
+}
+
+/* Get the next whitespace-delimited token, NUL-terminated.
+ * The token stays valid until the next call.
+ */
+static gboolean next_token(struct reader *r, char **token, size_t *len)
+{
+	uint64_t offset;
+	size_t start, end;
+	gboolean filled;
+
+	/* Skip any white-space */
+	for (;;)
+	{
+		while (r->pos < r->len && is_space(r->buf[r->pos]))
+			r->pos++;
+		if (r->pos < r->len)
+			break;
+		if (!reader_fill(r))
+			return FALSE;
+	}
+
+	if (r->offset + r->pos >= r->limit)
+		return FALSE;
+
+	start = r->pos;
+	end = start;
+	for (;;)
+	{
+		while (end < r->len && !is_space(r->buf[end]))
+			end++;
+		if (end < r->len || r->eof)
+			break;
+
+		/* The token continues past the buffer, read in the rest. */
+		if (r->file && start == 0 && r->len == r->size)
 		{
-			prev[0] = prev[1]; prev[1] = prev[2]; prev[2] = prev[3]; prev[3] = c;
-			if (prev[0] == '$' && prev[1] == 'e' && prev[2] == 'n' && prev[3] == 'd')
-			{
-				if (dest != NULL)
-					g_string_truncate(dest, dest->len - 3);
-					
-				return TRUE;
-			}
+			sr_err("Token longer than %d bytes.", READ_BUFSIZE);
+			return FALSE;
 		}
+		r->pos = start;
+		offset = r->offset;
+		filled = reader_fill(r);
+		start -= r->offset - offset;
+		end -= r->offset - offset;
+		if (!filled && !r->eof)
+			return FALSE;
+	}
+
+	/* Terminate the token in place, over the white-space after it. */
+	r->buf[end] = '\0';
+	r->pos = MIN(end + 1, r->len);
+	*token = r->buf + start;
+	*len = end - start;
 
-		if (dest != NULL)
-			g_string_append_c(dest, c);
+	return TRUE;
+}
+
+/* Whether the token is (or ends in) the $end keyword. */
+static gboolean is_end(const char *token, size_t len)
+{
+	return len >= 4 && !memcmp(token + len - 4, "$end", 4);
+}
+
+/* Skip tokens until $end. */
+static gboolean skip_section(struct reader *r)
+{
+	char *token;
+	size_t len;
+
+	while (next_token(r, &token, &len))
+	{
+		if (is_end(token, len))
+			return TRUE;
 	}
+
+	/* Running into a range's limit isn't an error. */
+	if (r->limit == UINT64_MAX)
+		sr_err("Unexpected EOF while looking for $end.");
+
+	return FALSE;
 }
 
 /* Reads a single VCD section from input file and parses it to structure.
  * e.g. $timescale 1ps $end  => "timescale" "1ps"
  */
-static gboolean parse_section(FILE *file, gchar **name, gchar **contents)
+static gboolean parse_section(struct reader *r, gchar **name,
+			      gchar **contents)
 {
-	gboolean status;
-	GString *sname, *scontents;
-	
-	/* Skip any initial white-space */
-	if (!read_until(file, NULL, 'N')) return FALSE;
-	
+	GString *scontents;
+	char *token;
+	size_t len;
+
 	/* Section tag should start with $. */
-	if (fgetc(file) != '$')
+	if (!next_token(r, &token, &len))
+		return FALSE;
+	if (token[0] != '$')
 	{
 		sr_err("Expected $ at beginning of section.");
 		return FALSE;
 	}
-	
-	/* Read the section tag */	
-	sname = g_string_sized_new(32);
-	status = read_until(file, sname, 'W');
-	
-	/* Skip whitespace before content */
-	status = status && read_until(file, NULL, 'N');
-	
-	/* Read the content */
+	*name = g_strndup(token + 1, len - 1);
+
+	/* Read the content, up to $end */
 	scontents = g_string_sized_new(128);
-	status = status && read_until(file, scontents, '$');
-	g_strchomp(scontents->str);
+	while (next_token(r, &token, &len))
+	{
+		if (is_end(token, len))
+		{
+			g_string_append_len(scontents, token, len - 4);
+			g_strchomp(scontents->str);
+			*contents = g_string_free(scontents, FALSE);
+			return TRUE;
+		}
+		g_string_append_len(scontents, token, len);
+		g_string_append_c(scontents, ' ');
+	}
 
-	/* Release strings if status is FALSE, return them if status is TRUE */	
-	*name = g_string_free(sname, !status);
-	*contents = g_string_free(scontents, !status);
-	return status;
+	if (!r->starved)
+		sr_err("Unexpected EOF in section '%s'.", *name);
+	g_free(*name);
+	*name = NULL;
+	g_string_free(scontents, TRUE);
+
+	return FALSE;
 }
 
 struct probe
@@ -174,6 +362,25 @@ struct context
 	unsigned compress;
 	int64_t skip;
 	struct probe probes[SR_MAX_NUM_PROBES];
+	/* Probe number + 1 of each single character identifier, or 0. */
+	int single_ids[128];
+	/* Probe number + 1 of each longer identifier. */
+	GHashTable *ids;
+	int threads;
+	/* Parser state carried from one timestamp to the next. */
+	uint64_t prev_timestamp;
+	uint64_t prev_values;
+	/* Inside a section other than $dump*, skipped until $end. */
+	gboolean in_section;
+	/* Reader for the data fed through receive(). */
+	struct reader stream;
+	/* Whether the header has been parsed and sent on. */
+	gboolean started;
+	gboolean failed;
+	/* Runs not sent yet, in samples of 'unitsize' bytes. */
+	struct sr_logic_run *runs;
+	uint64_t num_runs;
+	uint16_t unitsize;
 };
 
 static void release_context(struct context *ctx)
@@ -184,7 +391,11 @@ static void release_context(struct context *ctx)
 		g_free(ctx->probes[i].name); ctx->probes[i].name = NULL;
 		g_free(ctx->probes[i].identifier); ctx->probes[i].identifier = NULL;
 	}
-	
+
+	if (ctx->ids)
+		g_hash_table_destroy(ctx->ids);
+	g_free(ctx->runs);
+	reader_free(&ctx->stream);
 	g_free(ctx);
 }
 
@@ -206,16 +417,48 @@ static void remove_empty_parts(gchar **parts)
 	*dest = NULL;
 }
 
+/* Find the probe with the given identifier, or -1 if there is none. */
+static int find_probe(const struct context *ctx, const char *identifier)
+{
+	unsigned char c = identifier[0];
+
+	if (c < ARRAY_SIZE(ctx->single_ids) && identifier[1] == '\0')
+		return ctx->single_ids[c] - 1;
+
+	return GPOINTER_TO_INT(g_hash_table_lookup(ctx->ids, identifier)) - 1;
+}
+
+/* Make the probe findable by its identifier. If several probes share
+ * an identifier, the first one wins.
+ */
+static void add_probe_id(struct context *ctx, int probe, const char *identifier)
+{
+	unsigned char c = identifier[0];
+
+	if (find_probe(ctx, identifier) >= 0)
+		return;
+
+	if (c < ARRAY_SIZE(ctx->single_ids) && identifier[1] == '\0')
+		ctx->single_ids[c] = probe + 1;
+	else
+		g_hash_table_insert(ctx->ids, g_strdup(identifier),
+				    GINT_TO_POINTER(probe + 1));
+}
+
 /* Parse VCD header to get values for context structure.
  * The context structure should be zeroed before calling this.
  */
-static gboolean parse_header(FILE *file, struct context *ctx)
+static gboolean parse_header(struct reader *r, struct context *ctx)
 {
 	gchar *name = NULL, *contents = NULL;
 	gboolean status = FALSE;
 
-	while (parse_section(file, &name, &contents))
+	for (;;)
 	{
+		reader_mark(r);
+		if (!parse_section(r, &name, &contents))
+			break;
+
 		sr_dbg("Section '%s', contents '%s'.", name, contents);
 	
 		if (g_strcmp0(name, "enddefinitions") == 0)
@@ -272,6 +515,7 @@ static gboolean parse_header(FILE *file, struct context *ctx)
 				sr_info("Probe %d is '%s' identified by '%s'.", ctx->probecount, parts[3], parts[2]);
 				ctx->probes[ctx->probecount].identifier = g_strdup(parts[2]);
 				ctx->probes[ctx->probecount].name = g_strdup(parts[3]);
+				add_probe_id(ctx, ctx->probecount, parts[2]);
 				ctx->probecount++;
 			}
 			
@@ -284,28 +528,61 @@ static gboolean parse_header(FILE *file, struct context *ctx)
 	
 	g_free(name);
 	g_free(contents);
+
+	/* The section is parsed again once more data arrived */
+	if (r->starved)
+		reader_rewind(r);
 	
 	return status;
 }
 
+/* The compression of a file (see sr_input_compression()), which is rewound. */
+static int file_compression(FILE *file)
+{
+	uint8_t magic[4];
+	size_t n;
+
+	n = fread(magic, 1, sizeof(magic), file);
+	rewind(file);
+
+	return sr_input_compression(magic, n);
+}
+
 static int format_match(const char *filename)
 {
 	FILE *file;
+	struct reader r;
 	gchar *name = NULL, *contents = NULL;
 	gboolean status;
 	
-	file = fopen(filename, "r");
+	file = fopen(filename, "rb");
 	if (file == NULL)
 		return FALSE;
 
+	/* Compressed files are only told apart by their names. */
+	if (file_compression(file))
+	{
+		fclose(file);
+		return g_str_has_suffix(filename, ".vcd.gz") ||
+		       g_str_has_suffix(filename, ".vcd.zst");
+	}
+
+	if (!reader_init(&r, file, UINT64_MAX))
+	{
+		fclose(file);
+		return FALSE;
+	}
+
 	/* If we can parse the first section correctly,
 	 * then it is assumed to be a VCD file.
 	 */
-	status = parse_section(file, &name, &contents);
-	status = status && (*name != '\0');
-	
-	g_free(name);
-	g_free(contents);
+	if ((status = parse_section(&r, &name, &contents)))
+	{
+		status = (*name != '\0');
+		g_free(name);
+		g_free(contents);
+	}
+	reader_free(&r);
 	fclose(file);
 	
 	return status;
@@ -325,9 +602,15 @@ static int init(struct sr_input *in)
 	}
 
 	num_probes = DEFAULT_NUM_PROBES;
+	ctx->ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 	ctx->samplerate = 0;
 	ctx->downsample = 1;
 	ctx->skip = -1;
+#ifdef _SC_NPROCESSORS_ONLN
+	ctx->threads = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+#else
+	ctx->threads = 1;
+#endif
 
 	if (in->param) {
 		param = g_hash_table_lookup(in->param, "numprobes");
@@ -358,6 +641,11 @@ static int init(struct sr_input *in)
 		if (param) {
 			ctx->skip = strtoul(param, NULL, 10) / ctx->downsample;
 		}
+		
+		param = g_hash_table_lookup(in->param, "threads");
+		if (param) {
+			ctx->threads = MAX(strtol(param, NULL, 10), 1);
+		}
 	}
 	
 	/* Maximum number of probes to parse from the VCD */
@@ -382,183 +670,444 @@ static int init(struct sr_input *in)
 	return SR_OK;
 }
 
-#define CHUNKSIZE 1024
-
-/* Send N samples of the given value. */
-static void send_samples(const struct sr_dev_inst *sdi, uint64_t sample, uint64_t count)
+/* Send the pending runs as one packet. */
+static void send_runs(const struct sr_dev_inst *sdi, struct context *ctx)
 {
 	struct sr_datafeed_packet packet;
-	struct sr_datafeed_logic logic;
-	uint64_t buffer[CHUNKSIZE];
-	uint64_t i;
-	unsigned chunksize = CHUNKSIZE;
-		
-	if (count < chunksize)
-		chunksize = count;
+	struct sr_datafeed_logic_rle rle;
+
+	if (ctx->num_runs == 0)
+		return;
+
+	packet.type = SR_DF_LOGIC_RLE;
+	packet.payload = &rle;
+	rle.num_runs = ctx->num_runs;
+	rle.unitsize = ctx->unitsize;
+	rle.runs = ctx->runs;
+	rle.buffer = NULL;
+	sr_session_send(sdi, &packet);
 
-	for (i = 0; i < chunksize; i++)
+	ctx->num_runs = 0;
+}
+
+/* Add N samples of the given value, as a run if it differs from the last one. */
+static void send_samples(const struct sr_dev_inst *sdi, struct context *ctx, uint64_t sample, uint64_t count)
+{
+	if (count == 0)
+		return;
+
+	if (ctx->num_runs && ctx->runs[ctx->num_runs - 1].value == sample)
 	{
-		buffer[i] = sample;
+		ctx->runs[ctx->num_runs - 1].length += count;
+		return;
 	}
+
+	if (ctx->num_runs == MAX_RUNS)
+		send_runs(sdi, ctx);
+
+	ctx->runs[ctx->num_runs].value = sample;
+	ctx->runs[ctx->num_runs].length = count;
+	ctx->num_runs++;
+}
+
+/* Handle a new timestamp: generate the samples since the previous one. */
+static void new_timestamp(const struct sr_dev_inst *sdi, struct context *ctx, uint64_t timestamp)
+{
+	if (ctx->downsample > 1)
+		timestamp /= ctx->downsample;
 	
-	packet.type = SR_DF_LOGIC;
-	packet.payload = &logic;	
-	logic.unitsize = sizeof(uint64_t);
-	logic.data = buffer;
-	
-	while (count)
+	/* Skip < 0 => skip until first timestamp.
+	 * Skip = 0 => don't skip
+	 * Skip > 0 => skip until timestamp >= skip.
+	 */
+	if (ctx->skip < 0)
+	{
+		ctx->skip = timestamp;
+		ctx->prev_timestamp = timestamp;
+	}
+	else if (ctx->skip > 0 && timestamp < (uint64_t)ctx->skip)
 	{
-		if (count < chunksize)
-			chunksize = count;
+		ctx->prev_timestamp = ctx->skip;
+	}
+	else if (timestamp == ctx->prev_timestamp)
+	{
+		/* Ignore repeated timestamps (e.g. sigrok outputs these) */
+	}
+	else
+	{
+		if (ctx->compress != 0 && timestamp - ctx->prev_timestamp > ctx->compress)
+		{
+			/* Compress long idle periods */
+			ctx->prev_timestamp = timestamp - ctx->compress;
+		}
 	
-		logic.length = sizeof(uint64_t) * chunksize;
+		sr_spew("New timestamp: %" PRIu64, timestamp);
 	
-		sr_session_send(sdi, &packet);
-		count -= chunksize;
+		/* Generate samples from prev_timestamp up to timestamp - 1. */
+		send_samples(sdi, ctx, ctx->prev_values, timestamp - ctx->prev_timestamp);
+		ctx->prev_timestamp = timestamp;
 	}
 }
 
-/* Parse the data section of VCD */
-static void parse_contents(FILE *file, const struct sr_dev_inst *sdi, struct context *ctx)
+/* Whether the token is one of the $dump* keywords (or $end), whose
+ * contents are parsed as normal.
+ */
+static gboolean is_dump_keyword(const char *token)
+{
+	return !strcmp(token, "$dumpvars") ||
+	       !strcmp(token, "$dumpon") ||
+	       !strcmp(token, "$dumpoff") ||
+	       !strcmp(token, "$end");
+}
+
+/* Parse a 1-bit value change, which may be split into two tokens.
+ * Returns the probe number, or -1 if the identifier is unknown.
+ */
+static int value_change(struct reader *r, const struct context *ctx, char *token, int *bit)
 {
-	GString *token = g_string_sized_new(32);
+	size_t len;
+	int i;
+
+	*bit = (token[0] == '1');
+
+	token++;
+	if (*token == '\0')
+	{
+		/* There was a space between value and identifier.
+		 * Read in the rest.
+		 */
+		if (!next_token(r, &token, &len))
+			return -1;
+	}
 	
-	uint64_t prev_timestamp = 0;
-	uint64_t prev_values = 0;
+	if ((i = find_probe(ctx, token)) < 0)
+		sr_spew("Did not find probe for identifier '%s'.", token);
+
+	return i;
+}
+
+/* Parse the data section of VCD, from the reader's position to its end. */
+static void parse_contents(struct reader *r, const struct sr_dev_inst *sdi, struct context *ctx)
+{
+	char *token;
+	size_t len;
+	int i, bit;
 	
 	/* Read one space-delimited token at a time. */
-	while (read_until(file, NULL, 'N') && read_until(file, token, 'W'))
+	for (;;)
 	{
-		if (token->str[0] == '#' && g_ascii_isdigit(token->str[1]))
+		reader_mark(r);
+		if (!next_token(r, &token, &len))
+			break;
+
+		if (ctx->in_section)
+		{
+			/* Skip until $end */
+			if (is_end(token, len))
+				ctx->in_section = FALSE;
+		}
+		else if (token[0] == '#' && g_ascii_isdigit(token[1]))
 		{
 			/* Numeric value beginning with # is a new timestamp value */
-			uint64_t timestamp;
-			timestamp = strtoull(token->str + 1, NULL, 10);
-			
-			if (ctx->downsample > 1)
-				timestamp /= ctx->downsample;
-			
-			/* Skip < 0 => skip until first timestamp.
-			 * Skip = 0 => don't skip
-			 * Skip > 0 => skip until timestamp >= skip.
-			 */
-			if (ctx->skip < 0)
+			new_timestamp(sdi, ctx, strtoull(token + 1, NULL, 10));
+		}
+		else if (token[0] == '$' && len > 1)
+		{
+			/* This is probably a $dumpvars, $comment or similar.
+			 * $dump* contain useful data, but other tags will be skipped until $end. */
+			if (!is_dump_keyword(token))
+				ctx->in_section = TRUE;
+		}
+		else if (strchr("bBrR", token[0]) != NULL)
+		{
+			/* A vector value. Skip it and also the following identifier. */
+			next_token(r, &token, &len);
+		}
+		else if (strchr("01xXzZ", token[0]) != NULL)
+		{
+			/* A new 1-bit sample value */
+			if ((i = value_change(r, ctx, token, &bit)) >= 0)
 			{
-				ctx->skip = timestamp;
-				prev_timestamp = timestamp;
+				sr_spew("Probe %d new value %d.", i, bit);
+
+				if (bit)
+					ctx->prev_values |= (UINT64_C(1) << i);
+				else
+					ctx->prev_values &= ~(UINT64_C(1) << i);
 			}
-			else if (ctx->skip > 0 && timestamp < (uint64_t)ctx->skip)
+		}
+		else
+		{
+			sr_warn("Skipping unknown token '%s'.", token);
+		}
+
+		if (r->starved)
+			break;
+	}
+
+	/* A value change cut short is parsed again once more data arrived */
+	if (r->starved)
+		reader_rewind(r);
+}
+
+/* The value changes following a timestamp, up to the next one. */
+struct change
+{
+	uint64_t timestamp;
+	uint64_t set;
+	uint64_t clear;
+};
+
+/* A range of the body, parsed on its own thread. */
+struct range
+{
+	const char *filename;
+	const struct context *ctx;
+	uint64_t start;
+	uint64_t end;
+	/* Changes before the first timestamp of the range. */
+	struct change lead;
+	GArray *changes;
+	/* Set if the range couldn't be parsed on its own. */
+	gboolean failed;
+	GThread *thread;
+};
+
+/* Record a value change in the current change entry. */
+static void range_change(struct change *c, int probe, int bit)
+{
+	if (bit)
+	{
+		c->set |= UINT64_C(1) << probe;
+		c->clear &= ~(UINT64_C(1) << probe);
+	}
+	else
+	{
+		c->clear |= UINT64_C(1) << probe;
+		c->set &= ~(UINT64_C(1) << probe);
+	}
+}
+
+/* Parse a range into a list of changes. The probe state at the start
+ * of the range isn't known here, so only the bits which change are
+ * recorded; they are applied in order when merging.
+ *
+ * A range always starts at a timestamp, which could also occur in the
+ * middle of a $comment or similar. Anything which looks like it (an
+ * unknown token, or a section running past the end of the range) fails
+ * the range, and it is parsed sequentially instead.
+ */
+static gpointer parse_range(gpointer data)
+{
+	struct range *range = data;
+	struct reader r;
+	struct change c, *cur;
+	FILE *file;
+	char *token;
+	size_t len;
+	int i, bit, in_dump;
+
+	range->failed = TRUE;
+	if (!(file = fopen(range->filename, "rb")))
+		return NULL;
+	if (fseeko(file, range->start, SEEK_SET) || !reader_init(&r, file, range->end))
+	{
+		fclose(file);
+		return NULL;
+	}
+
+	cur = &range->lead;
+	in_dump = FALSE;
+	while (next_token(&r, &token, &len))
+	{
+		if (token[0] == '#' && g_ascii_isdigit(token[1]))
+		{
+			c.timestamp = strtoull(token + 1, NULL, 10);
+			c.set = c.clear = 0;
+			g_array_append_val(range->changes, c);
+			cur = &g_array_index(range->changes, struct change,
+					     range->changes->len - 1);
+		}
+		else if (token[0] == '$' && len > 1)
+		{
+			if (!strcmp(token, "$end"))
 			{
-				prev_timestamp = ctx->skip;
+				/* Only from a $dump* section in this range */
+				if (!in_dump)
+					goto out;
+				in_dump = FALSE;
 			}
-			else if (timestamp == prev_timestamp)
+			else if (is_dump_keyword(token))
 			{
-				/* Ignore repeated timestamps (e.g. sigrok outputs these) */
+				in_dump = TRUE;
 			}
 			else
 			{
-				if (ctx->compress != 0 && timestamp - prev_timestamp > ctx->compress)
-				{
-					/* Compress long idle periods */
-					prev_timestamp = timestamp - ctx->compress;
-				}
-			
-				sr_dbg("New timestamp: %" PRIu64, timestamp);
-			
-				/* Generate samples from prev_timestamp up to timestamp - 1. */
-				send_samples(sdi, prev_values, timestamp - prev_timestamp);
-				prev_timestamp = timestamp;
+				/* The limit stops this at the end of the range */
+				if (!skip_section(&r))
+					goto out;
 			}
 		}
-		else if (token->str[0] == '$' && token->len > 1)
+		else if (strchr("bBrR", token[0]) != NULL)
 		{
-			/* This is probably a $dumpvars, $comment or similar.
-			 * $dump* contain useful data, but other tags will be skipped until $end. */
-			if (g_strcmp0(token->str, "$dumpvars") == 0 ||
-			    g_strcmp0(token->str, "$dumpon") == 0 ||
-			    g_strcmp0(token->str, "$dumpoff") == 0 ||
-			    g_strcmp0(token->str, "$end") == 0)
-			{
-				/* Ignore, parse contents as normally. */
-			}
-			else
-			{
-				/* Skip until $end */
-				read_until(file, NULL, '$');
-			}
+			next_token(&r, &token, &len);
 		}
-		else if (strchr("bBrR", token->str[0]) != NULL)
+		else if (strchr("01xXzZ", token[0]) != NULL)
 		{
-			/* A vector value. Skip it and also the following identifier. */
-			read_until(file, NULL, 'N');
-			read_until(file, NULL, 'W');
+			if ((i = value_change(&r, range->ctx, token, &bit)) >= 0)
+				range_change(cur, i, bit);
 		}
-		else if (strchr("01xXzZ", token->str[0]) != NULL)
+		else
 		{
-			/* A new 1-bit sample value */
-			int i, bit;
-			bit = (token->str[0] == '1');
-		
-			g_string_erase(token, 0, 1);
-			if (token->len == 0)
-			{
-				/* There was a space between value and identifier.
-				 * Read in the rest.
-				 */
-				read_until(file, NULL, 'N');
-				read_until(file, token, 'W');
-			}
-			
-			for (i = 0; i < ctx->probecount; i++)
+			goto out;
+		}
+	}
+
+	/* A $dump* section left open means the range ends inside it */
+	if (!in_dump)
+		range->failed = FALSE;
+
+out:
+	reader_free(&r);
+	fclose(file);
+
+	return NULL;
+}
+
+/* Find the first timestamp at or after 'pos', or return 'end'. */
+static uint64_t find_timestamp(FILE *file, uint64_t pos, uint64_t end)
+{
+	char buf[4096];
+	size_t n, i;
+
+	if (fseeko(file, pos, SEEK_SET))
+		return end;
+
+	/* Look for white-space followed by '#' and a digit. */
+	while (pos < end && (n = fread(buf, 1, sizeof(buf), file)) > 2)
+	{
+		for (i = 0; i + 2 < n; i++)
+		{
+			if (g_ascii_isspace(buf[i]) && buf[i + 1] == '#' &&
+			    g_ascii_isdigit(buf[i + 2]))
+				return MIN(pos + i + 1, end);
+		}
+		/* Rescan the last two bytes with the next block. */
+		pos += n - 2;
+		if (fseeko(file, pos, SEEK_SET))
+			break;
+	}
+
+	return end;
+}
+
+/* Parse the data section of VCD from 'start' to 'end', a batch of
+ * ranges at a time on ctx->threads threads. Returns the offset of the
+ * first range which failed, or 'end' if all went fine.
+ */
+static uint64_t parse_parallel(FILE *file, const char *filename,
+			       const struct sr_dev_inst *sdi, struct context *ctx,
+			       uint64_t start, uint64_t end)
+{
+	struct range *ranges;
+	struct change *c;
+	uint64_t pos;
+	GError *error;
+	int i, j, n;
+	guint k;
+
+	if (!(ranges = g_try_malloc0(sizeof(struct range) * ctx->threads)))
+	{
+		sr_err("Ranges malloc failed.");
+		return start;
+	}
+
+	pos = start;
+	while (pos < end)
+	{
+		/* Split the next batch at timestamps */
+		for (n = 0; n < ctx->threads && pos < end; n++)
+		{
+			ranges[n].filename = filename;
+			ranges[n].ctx = ctx;
+			ranges[n].start = pos;
+			ranges[n].end = find_timestamp(file,
+					MIN(pos + RANGE_SIZE, end), end);
+			ranges[n].changes = g_array_new(FALSE, FALSE,
+							sizeof(struct change));
+			pos = ranges[n].end;
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			error = NULL;
+			ranges[i].thread = g_thread_try_new("vcd-parse",
+					parse_range, &ranges[i], &error);
+			if (!ranges[i].thread)
 			{
-				if (g_strcmp0(token->str, ctx->probes[i].identifier) == 0)
-				{
-					sr_dbg("Probe %d new value %d.", i, bit);
-				
-					/* Found our probe */
-					if (bit)
-						prev_values |= (1 << i);
-					else
-						prev_values &= ~(1 << i);
-					
-					break;
-				}
+				g_error_free(error);
+				parse_range(&ranges[i]);
 			}
-			
-			if (i == ctx->probecount)
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			if (ranges[i].thread)
+				g_thread_join(ranges[i].thread);
+		}
+
+		/* Merge the ranges in order, up to the first failed one */
+		for (i = 0; i < n && !ranges[i].failed; i++)
+		{
+			ctx->prev_values &= ~ranges[i].lead.clear;
+			ctx->prev_values |= ranges[i].lead.set;
+			for (k = 0; k < ranges[i].changes->len; k++)
 			{
-				sr_dbg("Did not find probe for identifier '%s'.", token->str);
+				c = &g_array_index(ranges[i].changes,
+						   struct change, k);
+				new_timestamp(sdi, ctx, c->timestamp);
+				ctx->prev_values &= ~c->clear;
+				ctx->prev_values |= c->set;
 			}
 		}
-		else
+		if (i < n)
 		{
-			sr_warn("Skipping unknown token '%s'.", token->str);
+			sr_dbg("Range at %" PRIu64 " can't be parsed on its "
+			       "own, parsing sequentially.", ranges[i].start);
+			pos = ranges[i].start;
 		}
-		
-		g_string_truncate(token, 0);
+
+		for (j = 0; j < n; j++)
+		{
+			g_array_free(ranges[j].changes, TRUE);
+			memset(&ranges[j], 0, sizeof(struct range));
+		}
+
+		if (i < n)
+			break;
 	}
-	
-	g_string_free(token, TRUE);
+
+	g_free(ranges);
+
+	return pos;
 }
 
-static int loadfile(struct sr_input *in, const char *filename)
+/* Once the header is parsed, send the packets the data is preceded by. */
+static int start_feed(struct sr_input *in)
 {
 	struct sr_datafeed_header header;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_meta_logic meta;
-	FILE *file;
 	struct context *ctx;
 
 	ctx = in->internal;
 
-	if ((file = fopen(filename, "r")) == NULL)
-		return SR_ERR;
-
-	if (!parse_header(file, ctx))
+	/* Samples need no more bytes than the probes take up. */
+	ctx->unitsize = MAX((ctx->probecount + 7) / 8, 1);
+	if (!(ctx->runs = g_try_malloc(sizeof(struct sr_logic_run) * MAX_RUNS)))
 	{
-		sr_err("VCD parsing failed");
-		fclose(file);
-		return SR_ERR;
+		sr_err("Runs malloc failed.");
+		return SR_ERR_MALLOC;
 	}
 
 	/* Send header packet to the session bus. */
@@ -568,20 +1117,131 @@ static int loadfile(struct sr_input *in, const char *filename)
 	packet.payload = &header;
 	sr_session_send(in->sdi, &packet);
 
-	/* Send metadata about the SR_DF_LOGIC packets to come. */
+	/* Send metadata about the SR_DF_LOGIC_RLE packets to come. */
 	packet.type = SR_DF_META_LOGIC;
 	packet.payload = &meta;
 	meta.samplerate = ctx->samplerate / ctx->downsample;
 	meta.num_probes = ctx->probecount;
 	sr_session_send(in->sdi, &packet);
 
-	/* Parse the contents of the VCD file */
-	parse_contents(file, in->sdi, ctx);
+	return SR_OK;
+}
+
+/* Send the remaining samples, and the end packet. */
+static void end_feed(struct sr_input *in)
+{
+	struct sr_datafeed_packet packet;
+
+	send_runs(in->sdi, in->internal);
 	
 	/* Send end packet to the session bus. */
 	packet.type = SR_DF_END;
+	packet.payload = NULL;
 	sr_session_send(in->sdi, &packet);
+}
 
+/* Decompress a file through the streaming interface, while it is parsed. */
+static int load_compressed(struct sr_input *in, FILE *file)
+{
+	char *buf;
+	size_t n;
+	int ret;
+
+	if (!(buf = g_try_malloc(READ_BUFSIZE)))
+	{
+		release_context(in->internal);
+		in->internal = NULL;
+		return SR_ERR_MALLOC;
+	}
+
+	if ((ret = sr_input_begin(in)) != SR_OK)
+	{
+		g_free(buf);
+		release_context(in->internal);
+		in->internal = NULL;
+		return ret;
+	}
+
+	while ((n = fread(buf, 1, READ_BUFSIZE, file)) > 0)
+		if ((ret = sr_input_receive(in, buf, n)) != SR_OK)
+			break;
+	if (ferror(file))
+	{
+		sr_err("Failed to read the VCD file.");
+		ret = SR_ERR;
+	}
+
+	/* This releases the context, even after errors. */
+	if (sr_input_end(in) != SR_OK && ret == SR_OK)
+		ret = SR_ERR;
+	g_free(buf);
+
+	return ret;
+}
+
+static int loadfile(struct sr_input *in, const char *filename)
+{
+	FILE *file;
+	struct reader r;
+	struct context *ctx;
+	struct stat st;
+	uint64_t start, pos;
+	int ret;
+
+	ctx = in->internal;
+
+	if ((file = fopen(filename, "rb")) == NULL)
+		return SR_ERR;
+
+	if (file_compression(file))
+	{
+		ret = load_compressed(in, file);
+		fclose(file);
+		return ret;
+	}
+
+	if (!reader_init(&r, file, UINT64_MAX))
+	{
+		fclose(file);
+		return SR_ERR_MALLOC;
+	}
+
+	if (!parse_header(&r, ctx))
+	{
+		sr_err("VCD parsing failed");
+		reader_free(&r);
+		fclose(file);
+		return SR_ERR;
+	}
+
+	if (start_feed(in) != SR_OK)
+	{
+		reader_free(&r);
+		fclose(file);
+		return SR_ERR_MALLOC;
+	}
+
+	/* Parse the contents of the VCD file, large ones in parallel. */
+	start = r.offset + r.pos;
+	if (ctx->threads > 1 && fstat(fileno(file), &st) == 0 &&
+	    (uint64_t)st.st_size >= start + 2 * RANGE_SIZE)
+	{
+		pos = parse_parallel(file, filename, in->sdi, ctx, start,
+				     st.st_size);
+		/* Carry on sequentially from where that stopped. */
+		reader_free(&r);
+		if (fseeko(file, pos, SEEK_SET) || !reader_init(&r, file, UINT64_MAX))
+		{
+			fclose(file);
+			release_context(ctx);
+			in->internal = NULL;
+			return SR_ERR;
+		}
+	}
+	parse_contents(&r, in->sdi, ctx);
+	end_feed(in);
+
+	reader_free(&r);
 	fclose(file);
 	release_context(ctx);
 	in->internal = NULL;
@@ -589,10 +1249,100 @@ static int loadfile(struct sr_input *in, const char *filename)
 	return SR_OK;
 }
 
+static int stream_begin(struct sr_input *in)
+{
+	struct context *ctx;
+
+	ctx = in->internal;
+
+	if (!reader_init(&ctx->stream, NULL, UINT64_MAX))
+		return SR_ERR_MALLOC;
+
+	return SR_OK;
+}
+
+/* Parse as much of the data fed so far as possible. */
+static int parse_stream(struct sr_input *in)
+{
+	struct context *ctx;
+
+	ctx = in->internal;
+
+	if (!ctx->started)
+	{
+		if (!parse_header(&ctx->stream, ctx))
+		{
+			if (ctx->stream.starved)
+				return SR_OK;
+			sr_err("VCD parsing failed");
+			return SR_ERR;
+		}
+		if (start_feed(in) != SR_OK)
+			return SR_ERR_MALLOC;
+		ctx->started = TRUE;
+	}
+
+	parse_contents(&ctx->stream, in->sdi, ctx);
+
+	return SR_OK;
+}
+
+static int stream_receive(struct sr_input *in, const void *buf, uint64_t len)
+{
+	struct context *ctx;
+
+	ctx = in->internal;
+
+	if (ctx->failed)
+		return SR_ERR;
+
+	if (!reader_feed(&ctx->stream, buf, len))
+	{
+		ctx->failed = TRUE;
+		return SR_ERR_MALLOC;
+	}
+
+	if (parse_stream(in) != SR_OK)
+	{
+		ctx->failed = TRUE;
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+static int stream_end(struct sr_input *in)
+{
+	struct context *ctx;
+	int ret;
+
+	ctx = in->internal;
+
+	/* Whatever is left is parsed as the end of the file. */
+	ret = SR_ERR;
+	if (!ctx->failed)
+	{
+		ctx->stream.eof = TRUE;
+		ctx->stream.starved = FALSE;
+		ret = parse_stream(in);
+	}
+	if (ctx->started)
+		end_feed(in);
+
+	release_context(ctx);
+	in->internal = NULL;
+
+	return ret;
+}
+
 SR_PRIV struct sr_input_format input_vcd = {
 	.id = "vcd",
 	.description = "Value Change Dump",
 	.format_match = format_match,
 	.init = init,
 	.loadfile = loadfile,
+	.begin = stream_begin,
+	.receive = stream_receive,
+	.end = stream_end,
+	.decompress = TRUE,
 };
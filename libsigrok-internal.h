@@ -21,6 +21,7 @@
 #define LIBSIGROK_SIGROK_INTERNAL_H
 
 #include <stdarg.h>
+#include <string.h>
 #include <glib.h>
 #include "config.h" /* Needed for HAVE_LIBUSB_1_0 and others. */
 #ifdef HAVE_LIBUSB_1_0
@@ -43,6 +44,64 @@
 #define ARRAY_AND_SIZE(a) (a), ARRAY_SIZE(a)
 #endif
 
+/**
+ * Read a 16 bits little endian unsigned integer out of memory.
+ * @param x a pointer to the input memory
+ * @return the corresponding unsigned integer
+ */
+#define RL16(x) (((uint16_t)((const uint8_t *)(x))[1] << 8) | \
+		 ((uint16_t)((const uint8_t *)(x))[0]))
+
+/**
+ * Read a 32 bits little endian unsigned integer out of memory.
+ * @param x a pointer to the input memory
+ * @return the corresponding unsigned integer
+ */
+#define RL32(x) (((uint32_t)((const uint8_t *)(x))[3] << 24) | \
+		 ((uint32_t)((const uint8_t *)(x))[2] << 16) | \
+		 ((uint32_t)((const uint8_t *)(x))[1] <<  8) | \
+		 ((uint32_t)((const uint8_t *)(x))[0]))
+
+/**
+ * Read a 64 bits little endian unsigned integer out of memory.
+ * @param x a pointer to the input memory
+ * @return the corresponding unsigned integer
+ */
+#define RL64(x) (((uint64_t)RL32((const uint8_t *)(x) + 4) << 32) | \
+		 (uint64_t)RL32(x))
+
+/**
+ * Write a 16 bits unsigned integer to memory, in little endian order.
+ * @param p a pointer to the output memory
+ * @param x the input unsigned integer
+ */
+#define WL16(p, x) do { \
+	((uint8_t *)(p))[0] = (uint8_t)(x); \
+	((uint8_t *)(p))[1] = (uint8_t)((x) >> 8); \
+} while (0)
+
+/**
+ * Write a 32 bits unsigned integer to memory, in little endian order.
+ * @param p a pointer to the output memory
+ * @param x the input unsigned integer
+ */
+#define WL32(p, x) do { \
+	((uint8_t *)(p))[0] = (uint8_t)(x); \
+	((uint8_t *)(p))[1] = (uint8_t)((x) >> 8); \
+	((uint8_t *)(p))[2] = (uint8_t)((x) >> 16); \
+	((uint8_t *)(p))[3] = (uint8_t)((x) >> 24); \
+} while (0)
+
+/**
+ * Write a 64 bits unsigned integer to memory, in little endian order.
+ * @param p a pointer to the output memory
+ * @param x the input unsigned integer
+ */
+#define WL64(p, x) do { \
+	WL32(p, (uint64_t)(x)); \
+	WL32((uint8_t *)(p) + 4, (uint64_t)(x) >> 32); \
+} while (0)
+
 /* Versions < 2.30.0 of glib don't have g_match_info_unref(). */
 #if !GLIB_CHECK_VERSION(2,30,0)
 #define g_match_info_unref g_match_info_free
@@ -51,10 +110,69 @@
 /* Size of a datastore chunk in units */
 #define DATASTORE_CHUNKSIZE (512 * 1024)
 
+/* Size of a capture file chunk written by a session writer in units */
+#define SESSION_FILE_CHUNKSIZE (4 * 1024 * 1024)
+
+/* log2 of the number of units covered by a level 0 summary entry */
+#define DATASTORE_SUMMARY_BASE 6
+
+/* Maximum number of summary pyramid levels */
+#define DATASTORE_SUMMARY_LEVELS 40
+
+/*
+ * Bit-plane capture files, as written by output/bitplane.c and read by
+ * input/bitplane.c. All integers are little endian.
+ *
+ * The file header (BITPLANE_HEADER_SIZE bytes) is followed by the probe
+ * names, each NUL-terminated:
+ *   0  magic, BITPLANE_MAGIC
+ *   8  u32 format version, BITPLANE_VERSION
+ *  12  u32 number of probes
+ *  16  u64 samplerate in Hz, or 0 if unknown
+ *  24  u32 number of samples per block
+ *  28  u32 size of the probe names in bytes
+ *
+ * Then come the blocks, all but the last one holding exactly that many
+ * samples. Each starts with a block header (BITPLANE_BLOCK_HEADER_SIZE
+ * bytes):
+ *   0  u64 number of the block's first sample
+ *   8  u32 number of samples in the block
+ *  12  u32 reserved, 0
+ * followed by a descriptor per probe (BITPLANE_PLANE_SIZE bytes):
+ *   0  u32 number of transitions of the probe within the block
+ *   4  u8  value of the block's first sample
+ *   5  u8  value of the block's last sample
+ *   6  u16 reserved, 0
+ *   8  u64 offset of the probe's plane from the start of the block, or 0
+ *          if the probe has no transitions and its plane is left out
+ * and then the planes which aren't left out. The value of a probe for
+ * sample n of the block is bit n % 64 of u64 word n / 64 of its plane.
+ *
+ * After the last block comes the index: BITPLANE_INDEX_MAGIC, then per
+ * block its first sample number and its file offset, both u64. The file
+ * ends with a trailer (BITPLANE_TRAILER_SIZE bytes):
+ *   0  u64 number of blocks
+ *   8  u64 number of samples
+ *  16  u64 file offset of the index
+ *  24  magic, BITPLANE_MAGIC
+ */
+#define BITPLANE_MAGIC              "SRBITPLN"
+#define BITPLANE_INDEX_MAGIC        "SRBPINDX"
+#define BITPLANE_MAGIC_LEN          8
+#define BITPLANE_VERSION            1
+#define BITPLANE_BLOCK_SAMPLES      65536
+#define BITPLANE_HEADER_SIZE        32
+#define BITPLANE_BLOCK_HEADER_SIZE  16
+#define BITPLANE_PLANE_SIZE         16
+#define BITPLANE_INDEX_ENTRY_SIZE   16
+#define BITPLANE_TRAILER_SIZE       32
+
 struct sr_context {
 #ifdef HAVE_LIBUSB_1_0
 	libusb_context *libusb_ctx;
 #endif
+	/* Set while hotplug events are enabled, see hotplug.c. */
+	struct sr_hotplug *hotplug;
 };
 
 #ifdef HAVE_LIBUSB_1_0
@@ -63,15 +181,24 @@ struct sr_usb_dev_inst {
 	uint8_t address;
 	struct libusb_device_handle *devhdl;
 };
+
+/* See sr_usb_snapshot_new(). */
+struct sr_usb_snapshot;
 #endif
 
 #define SERIAL_PARITY_NONE 0
 #define SERIAL_PARITY_EVEN 1
 #define SERIAL_PARITY_ODD  2
+/* Size of a serial port's read-ahead buffer (see serial_fill()). */
+#define SERIAL_RBUF_SIZE 1024
 struct sr_serial_dev_inst {
 	char *port;
 	char *serialcomm;
 	int fd;
+	/* Bytes already read from the port but not yet returned. */
+	uint8_t rbuf[SERIAL_RBUF_SIZE];
+	size_t rbuf_start;
+	size_t rbuf_len;
 };
 
 /* Private driver context. */
@@ -80,14 +207,58 @@ struct drv_context {
 	GSList *instances;
 };
 
+/*
+ * Static tracepoints (USDT probes of the provider "libsigrok") for perf
+ * and bpftrace, see --enable-tracepoints. Without it they are compiled
+ * out; with it, each is a nop until something attaches to it, plus what
+ * it takes to have its arguments at hand, so keep those cheap.
+ *
+ *  session_send_entry(sdi, type)       sr_session_send() was called
+ *  session_send_return(type, ret)      ... and is done with the packet
+ *  poll_sleep(timeout)                 the session poll loop waits (ms)
+ *  poll_wakeup()                       ... and returned from waiting
+ *  datastore_put_entry(ds, length)     sr_datastore_put() was called
+ *  datastore_put_return(ret)           ... and is done
+ *  output_data_entry(o, length)        an output module's data() is called
+ *  output_data_return(ret)             ... and returned
+ *  fx2lafw_transfer(status, length)    fx2lafw: a USB transfer completed
+ *  hantek_dso_transfer(status, length) hantek-dso: a USB transfer completed
+ */
+#ifdef HAVE_TRACEPOINTS
+#include <sys/sdt.h>
+#define SR_TRACE(name) DTRACE_PROBE(libsigrok, name)
+#define SR_TRACE1(name, a) DTRACE_PROBE1(libsigrok, name, a)
+#define SR_TRACE2(name, a, b) DTRACE_PROBE2(libsigrok, name, a, b)
+#else
+#define SR_TRACE(name) do { } while (0)
+#define SR_TRACE1(name, a) do { } while (0)
+#define SR_TRACE2(name, a, b) do { } while (0)
+#endif
+
 /*--- log.c -----------------------------------------------------------------*/
 
+/* Messages above this level are compiled out, see --disable-debug-log. */
+#ifndef SR_LOG_MAX_LEVEL
+#define SR_LOG_MAX_LEVEL SR_LOG_SPEW
+#endif
+
+extern SR_PRIV int sr_loglevel;
+
 SR_PRIV int sr_log(int loglevel, const char *format, ...);
-SR_PRIV int sr_spew(const char *format, ...);
-SR_PRIV int sr_dbg(const char *format, ...);
-SR_PRIV int sr_info(const char *format, ...);
-SR_PRIV int sr_warn(const char *format, ...);
-SR_PRIV int sr_err(const char *format, ...);
+
+/*
+ * The loglevel is checked before the arguments are evaluated, so a message
+ * which isn't shown costs a compare. Files which prefix their messages
+ * redefine sr_log(), which these go through.
+ */
+#define SR_LOG(l, s, args...) \
+	((l) <= SR_LOG_MAX_LEVEL && (l) <= sr_loglevel ? \
+	 (void)sr_log(l, s, ## args) : (void)0)
+#define sr_spew(s, args...) SR_LOG(SR_LOG_SPEW, s, ## args)
+#define sr_dbg(s, args...) SR_LOG(SR_LOG_DBG, s, ## args)
+#define sr_info(s, args...) SR_LOG(SR_LOG_INFO, s, ## args)
+#define sr_warn(s, args...) SR_LOG(SR_LOG_WARN, s, ## args)
+#define sr_err(s, args...) SR_LOG(SR_LOG_ERR, s, ## args)
 
 /*--- device.c --------------------------------------------------------------*/
 
@@ -99,6 +270,11 @@ SR_PRIV struct sr_dev_inst *sr_dev_inst_new(int index, int status,
 		const char *vendor, const char *model, const char *version);
 SR_PRIV void sr_dev_inst_free(struct sr_dev_inst *sdi);
 
+/* Health and throughput counters */
+SR_PRIV void sr_dev_stats_start(struct sr_dev_stats *stats);
+SR_PRIV void sr_dev_stats_data(struct sr_dev_stats *stats, uint64_t bytes,
+		uint64_t samples, uint64_t latency);
+
 #ifdef HAVE_LIBUSB_1_0
 /* USB-specific instances */
 SR_PRIV struct sr_usb_dev_inst *sr_usb_dev_inst_new(uint8_t bus,
@@ -115,14 +291,152 @@ SR_PRIV void sr_serial_dev_inst_free(struct sr_serial_dev_inst *serial);
 /*--- hwdriver.c ------------------------------------------------------------*/
 
 SR_PRIV void sr_hw_cleanup_all(void);
+SR_PRIV void sr_hw_context_set(struct sr_context *ctx);
+SR_PRIV void sr_hw_context_unset(struct sr_context *ctx);
 SR_PRIV int sr_source_remove(int fd);
 SR_PRIV int sr_source_add(int fd, int events, int timeout,
 			  sr_receive_data_callback_t cb, void *cb_data);
 
+/*--- hotplug.c -------------------------------------------------------------*/
+
+SR_PRIV void sr_hotplug_post(struct sr_context *ctx, int event,
+		struct sr_dev_inst *sdi);
+
+/*--- datastore.c -----------------------------------------------------------*/
+
+SR_PRIV const uint8_t *sr_datastore_chunk_data(struct sr_datastore *ds,
+		uint64_t chunk);
+
+/*--- datastore_analog.c ----------------------------------------------------*/
+
+SR_PRIV uint64_t sr_analog_datastore_chunk_samples(
+		const struct sr_analog_datastore *ads, uint64_t chunk);
+SR_PRIV void sr_analog_datastore_chunk_write(
+		const struct sr_analog_datastore *ads, uint64_t chunk,
+		uint8_t *out);
+SR_PRIV int sr_analog_datastore_chunk_read(struct sr_analog_datastore *ads,
+		const uint8_t *in, uint64_t num_samples);
+SR_PRIV int sr_analog_datastore_frame_add(struct sr_analog_datastore *ads,
+		uint64_t first_sample, uint64_t num_samples);
+
 /*--- session.c -------------------------------------------------------------*/
 
 SR_PRIV int sr_session_send(const struct sr_dev_inst *sdi,
 			    struct sr_datafeed_packet *packet);
+SR_PRIV gboolean sr_session_congested(const struct sr_dev_inst *sdi);
+SR_PRIV struct sr_datafeed_packet *sr_packet_copy(
+		const struct sr_datafeed_packet *packet);
+SR_PRIV void sr_packet_free(struct sr_datafeed_packet *packet);
+
+/*--- session_file.c --------------------------------------------------------*/
+
+struct zip;
+
+/* A capture file chunk, as listed in the capture file's index. */
+struct sr_session_chunk {
+	char name[32];
+	uint64_t first_unit;
+	uint64_t num_units;
+	/* XXH64 of the chunk's entry, if 'hashed' is set. */
+	uint64_t hash;
+	gboolean hashed;
+};
+
+SR_PRIV int sr_session_file_chunks_load(struct zip *archive,
+		const char *capturefile, struct sr_session_chunk **chunks,
+		unsigned int *num_chunks);
+SR_PRIV int sr_session_file_chunks_probe(struct zip *archive,
+		const char *capturefile, int unitsize, int unitbits,
+		struct sr_session_chunk **chunks, unsigned int *num_chunks);
+SR_PRIV int sr_session_file_analog_load(struct zip *archive,
+		const char *analogfile, struct sr_analog_datastore **ads);
+SR_PRIV struct zip *sr_session_file_archive(const char *filename);
+SR_PRIV void sr_session_file_close(void);
+SR_PRIV int sr_session_file_save_parts(const char *filename,
+		const struct sr_dev_inst *sdi, int unitsize, char **parts,
+		unsigned int num_parts, uint64_t part_units, uint64_t num_units);
+
+/*--- trigger.c -------------------------------------------------------------*/
+
+SR_PRIV int sr_trigger_send(struct sr_trigger *trigger,
+		const struct sr_dev_inst *sdi, const uint8_t *data,
+		uint64_t length, uint16_t unitsize);
+SR_PRIV int sr_trigger_flush(struct sr_trigger *trigger,
+		const struct sr_dev_inst *sdi);
+
+/*--- input/input.c ---------------------------------------------------------*/
+
+SR_PRIV int sr_input_compression(const uint8_t *buf, size_t len);
+SR_PRIV int sr_input_file_send(const struct sr_dev_inst *sdi, int fd,
+			       uint64_t length, uint16_t unitsize);
+
+/*--- output/output.c -------------------------------------------------------*/
+
+SR_PRIV int sr_output_format_dec(char *buf, uint64_t value);
+SR_PRIV int sr_output_format_hex(char *buf, uint64_t value, int width);
+
+/*
+ * Load a logic sample of 'unitsize' bytes, least significant byte first.
+ * Output modules instantiate their sample loops once per unit size (see
+ * SR_OUTPUT_KERNELS()); with a constant 'unitsize' this is a single load.
+ */
+static inline uint64_t sr_output_sample_get(const uint8_t *p,
+					    unsigned int unitsize)
+{
+	uint16_t u16;
+	uint32_t u32;
+	uint64_t u64;
+	unsigned int b;
+
+	switch (unitsize) {
+	case 1:
+		return p[0];
+	case 2:
+		memcpy(&u16, p, 2);
+		return GUINT16_FROM_LE(u16);
+	case 4:
+		memcpy(&u32, p, 4);
+		return GUINT32_FROM_LE(u32);
+	case 8:
+		memcpy(&u64, p, 8);
+		return GUINT64_FROM_LE(u64);
+	default:
+		u64 = 0;
+		for (b = 0; b < unitsize && b < 8; b++)
+			u64 |= (uint64_t)p[b] << (8 * b);
+		return u64;
+	}
+}
+
+/*
+ * Instantiate 'kernel', a function declared SR_OUTPUT_KERNEL returning
+ * 'type' (not void) and taking the unit size as its last argument, as
+ * kernel_1, kernel_2, kernel_4, kernel_8 and (for all other unit sizes)
+ * kernel_any. These take the parameters 'params', the first of which
+ * must be the module's context 'ctx', and pass them on as the remaining
+ * arguments. kernel_get() returns the one for a unit size, so that a
+ * module can pick it in its init().
+ */
+#define SR_OUTPUT_KERNEL static inline __attribute__((always_inline))
+#define SR_OUTPUT_KERNELS(kernel, type, params, ...)			\
+static type kernel##_1 params { return kernel(__VA_ARGS__, 1); }	\
+static type kernel##_2 params { return kernel(__VA_ARGS__, 2); }	\
+static type kernel##_4 params { return kernel(__VA_ARGS__, 4); }	\
+static type kernel##_8 params { return kernel(__VA_ARGS__, 8); }	\
+static type kernel##_any params						\
+{									\
+	return kernel(__VA_ARGS__, ctx->unitsize);			\
+}									\
+static type (*kernel##_get(unsigned int unitsize)) params		\
+{									\
+	switch (unitsize) {						\
+	case 1: return kernel##_1;					\
+	case 2: return kernel##_2;					\
+	case 4: return kernel##_4;					\
+	case 8: return kernel##_8;					\
+	default: return kernel##_any;					\
+	}								\
+}
 
 /*--- hardware/common/serial.c ----------------------------------------------*/
 
@@ -151,6 +465,11 @@ SR_PRIV int serial_stream_detect(struct sr_serial_dev_inst *serial,
 				 uint8_t *buf, size_t *buflen,
 				 size_t packet_size, packet_valid_t is_valid,
 				 uint64_t timeout_ms, int baudrate);
+SR_PRIV int serial_fill(struct sr_serial_dev_inst *serial);
+SR_PRIV const uint8_t *serial_get_packet(struct sr_serial_dev_inst *serial,
+		size_t packet_size, packet_valid_t is_valid);
+SR_PRIV char *serial_get_line(struct sr_serial_dev_inst *serial, char delim,
+		int *len);
 
 /*--- hardware/common/ezusb.c -----------------------------------------------*/
 
@@ -160,6 +479,7 @@ SR_PRIV int ezusb_install_firmware(libusb_device_handle *hdl,
 				   const char *filename);
 SR_PRIV int ezusb_upload_firmware(libusb_device *dev, int configuration,
 				  const char *filename);
+SR_PRIV void ezusb_firmware_cache_clear(void);
 #endif
 
 /*--- hardware/common/usb.c -------------------------------------------------*/
@@ -167,10 +487,24 @@ SR_PRIV int ezusb_upload_firmware(libusb_device *dev, int configuration,
 #ifdef HAVE_LIBUSB_1_0
 SR_PRIV GSList *sr_usb_find(libusb_context *usb_ctx, const char *conn);
 SR_PRIV int sr_usb_open(libusb_context *usb_ctx, struct sr_usb_dev_inst *usb);
+SR_PRIV struct sr_usb_snapshot *sr_usb_snapshot_new(libusb_context *usb_ctx);
+SR_PRIV void sr_usb_snapshot_drop(struct sr_usb_snapshot *snap);
+SR_PRIV void sr_usb_snapshot_free(struct sr_usb_snapshot *snap);
+SR_PRIV void sr_usb_snapshot_use(struct sr_usb_snapshot *snap);
+SR_PRIV ssize_t sr_usb_get_device_list(libusb_context *usb_ctx,
+		libusb_device ***list);
+SR_PRIV int sr_usb_get_device_descriptor(libusb_device *dev,
+		struct libusb_device_descriptor *des);
+SR_PRIV uint8_t *sr_usb_buf_alloc(struct sr_usb_dev_inst *usb, size_t size);
+SR_PRIV void sr_usb_buf_free(uint8_t *buf, size_t size);
 #endif
 
 /*--- hardware/common/dmm/fs9922.c ------------------------------------------*/
 
+#define FS9922_PACKET_SIZE 14
+
+SR_PRIV gboolean sr_fs9922_is_packet_start(uint8_t b);
+SR_PRIV gboolean sr_fs9922_packet_valid(const uint8_t *buf);
 SR_PRIV int sr_dmm_parse_fs9922(const uint8_t *buf, float *floatval,
 				struct sr_datafeed_analog *analog);
 
@@ -214,4 +548,29 @@ SR_PRIV gboolean sr_rs9lcd_packet_valid(const uint8_t *buf);
 SR_PRIV int sr_rs9lcd_parse(const uint8_t *buf, float *floatval,
 			    struct sr_datafeed_analog *analog, void *info);
 
+/*--- hardware/common/dmm/batch.c -------------------------------------------*/
+
+/* A DMM chipset's packet format, for the batch helpers below. */
+struct sr_dmm_chip {
+	const char *name;
+	size_t packet_size;
+	/* Cheap check of a packet's first byte, NULL if there's none. */
+	gboolean (*is_packet_start)(uint8_t b);
+	gboolean (*packet_valid)(const uint8_t *buf);
+	int (*packet_parse)(const uint8_t *buf, float *floatval,
+			    struct sr_datafeed_analog *analog, void *info);
+};
+
+SR_PRIV extern const struct sr_dmm_chip sr_dmm_chip_fs9721;
+SR_PRIV extern const struct sr_dmm_chip sr_dmm_chip_fs9922;
+SR_PRIV extern const struct sr_dmm_chip sr_dmm_chip_metex14;
+SR_PRIV extern const struct sr_dmm_chip sr_dmm_chip_rs9lcd;
+
+SR_PRIV size_t sr_dmm_find_packets(const struct sr_dmm_chip *chip,
+		const uint8_t *buf, size_t len, size_t *offsets,
+		size_t max_packets, size_t *used);
+SR_PRIV size_t sr_dmm_parse_packets(const struct sr_dmm_chip *chip,
+		const uint8_t *buf, const size_t *offsets, size_t num_packets,
+		float *values, int *mqs, int *units, uint64_t *mqflags);
+
 #endif
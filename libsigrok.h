@@ -155,6 +155,10 @@ enum {
 	SR_DF_META_ANALOG,
 	SR_DF_FRAME_BEGIN,
 	SR_DF_FRAME_END,
+	SR_DF_OVERRUN,
+	SR_DF_LOGIC_RLE,
+	SR_DF_SYNC,
+	SR_DF_ANALOG_RAW,
 };
 
 /** Values for sr_datafeed_analog.mq. */
@@ -176,6 +180,8 @@ enum {
 	/** Logarithmic representation of sound pressure relative to a
 	 * reference value. */
 	SR_MQ_SOUND_PRESSURE_LEVEL,
+	/** Relative humidity, usually in %. */
+	SR_MQ_RELATIVE_HUMIDITY,
 };
 
 /** Values for sr_datafeed_analog.unit. */
@@ -268,15 +274,118 @@ struct sr_datafeed_header {
 	struct timeval starttime;
 };
 
+/**
+ * Payload of SR_DF_OVERRUN: samples were lost, e.g. because the host
+ * didn't keep up with the device. The samples before and after the gap
+ * are sent as usual.
+ */
+struct sr_datafeed_overrun {
+	/** Number of samples the driver had received before the gap. */
+	uint64_t offset;
+	/** Number of samples lost, or 0 if unknown. */
+	uint64_t num_samples;
+};
+
+/**
+ * Payload of SR_DF_TRIGGER, filled in by the session when the driver
+ * sends the packet without one.
+ */
+struct sr_datafeed_trigger {
+	/** Index of the first logic sample after the trigger. */
+	uint64_t offset;
+	/** Host reception time, as in struct sr_datafeed_logic. */
+	int64_t timestamp;
+};
+
 struct sr_datafeed_meta_logic {
 	int num_probes;
 	uint64_t samplerate;
 };
 
+/**
+ * Where a device's samples sit on the session's timeline. With
+ * synchronized starts (see sr_session_sync_set()), the session sends one
+ * of these for each device once all of them have been started.
+ */
+struct sr_datafeed_sync {
+	/**
+	 * Number of sample periods (at 'samplerate') by which this device
+	 * started after the first device in the session.
+	 */
+	uint64_t offset;
+	/** The device's samplerate, or 0 if unknown (and 'offset' is 0). */
+	uint64_t samplerate;
+};
+
+typedef void (*sr_buffer_free_callback_t)(void *data, void *cb_data);
+
+/**
+ * Reference-counted data buffer, see sr_buffer_new().
+ *
+ * Only 'data' and 'size' may be accessed directly.
+ */
+struct sr_buffer {
+	/** The buffer's data. */
+	void *data;
+	/** Size of the data in bytes. */
+	uint64_t size;
+	volatile gint refcount;
+	sr_buffer_free_callback_t free_cb;
+	void *cb_data;
+};
+
 struct sr_datafeed_logic {
 	uint64_t length;
 	uint16_t unitsize;
 	void *data;
+	/**
+	 * Buffer holding 'data' if it is reference counted, or NULL if
+	 * 'data' is only valid while the packet is being delivered.
+	 */
+	struct sr_buffer *buffer;
+	/**
+	 * Index of the first sample in this packet, counting all logic
+	 * samples of the device since SR_DF_HEADER, including those lost
+	 * in an SR_DF_OVERRUN. Set by the session.
+	 */
+	uint64_t offset;
+	/**
+	 * Host time (from g_get_monotonic_time(), in us) at which the
+	 * session received the packet from the driver. Set by the session.
+	 */
+	int64_t timestamp;
+};
+
+/** One run of run-length encoded logic data. */
+struct sr_logic_run {
+	/**
+	 * The sample value, with probe n in bit n. Only the lowest
+	 * 'unitsize' bytes of it are used.
+	 */
+	uint64_t value;
+	/** Number of consecutive samples with this value. */
+	uint64_t length;
+};
+
+/**
+ * Payload of SR_DF_LOGIC_RLE: logic samples as a list of runs. This
+ * stands for the same samples as an SR_DF_LOGIC packet with each run's
+ * value repeated 'length' times, see sr_logic_rle_expand().
+ */
+struct sr_datafeed_logic_rle {
+	uint64_t num_runs;
+	/** Unitsize of the samples the runs expand to. */
+	uint16_t unitsize;
+	struct sr_logic_run *runs;
+	/**
+	 * Buffer holding 'runs' if it is reference counted, or NULL if
+	 * 'runs' is only valid while the packet is being delivered.
+	 */
+	struct sr_buffer *buffer;
+	/** Index of the first sample, as in struct sr_datafeed_logic. */
+	uint64_t offset;
+	/** Host reception time, as in struct sr_datafeed_logic. */
+	int64_t timestamp;
 };
 
 struct sr_datafeed_meta_analog {
@@ -293,6 +402,67 @@ struct sr_datafeed_analog {
 	uint64_t mqflags;
 	/** The analog value. */
 	float *data;
+	/**
+	 * Buffer holding 'data' if it is reference counted, or NULL if
+	 * 'data' is only valid while the packet is being delivered.
+	 */
+	struct sr_buffer *buffer;
+};
+
+/** How the codes of one probe of an SR_DF_ANALOG_RAW packet map to values. */
+struct sr_analog_scale {
+	/** Value of one code step, in the packet's unit. */
+	float scale;
+	/** Value of code 0, in the packet's unit. */
+	float offset;
+};
+
+/**
+ * Payload of SR_DF_ANALOG_RAW: analog samples as the device's integer
+ * codes. This stands for the same samples as an SR_DF_ANALOG packet with
+ * each code converted by its probe's scale and offset, see
+ * sr_analog_raw_to_float().
+ */
+struct sr_datafeed_analog_raw {
+	int num_samples;
+	/** Number of probes; 'data' holds one code per probe and sample. */
+	int num_probes;
+	/** Measured quantity (voltage, current, temperature, and so on). */
+	int mq;
+	/** Unit in which the MQ is measured. */
+	int unit;
+	/** Bitmap with extra information about the MQ. */
+	uint64_t mqflags;
+	/** Size of one code in bytes (1, 2 or 4), in host byte order. */
+	uint8_t sample_size;
+	/** Whether the codes are two's complement signed integers. */
+	gboolean is_signed;
+	/**
+	 * One scale per probe. Only valid while the packet is being
+	 * delivered; queued copies of the packet have their own.
+	 */
+	struct sr_analog_scale *scales;
+	/** The codes, interleaved by probe. */
+	void *data;
+	/**
+	 * Buffer holding 'data' if it is reference counted, or NULL if
+	 * 'data' is only valid while the packet is being delivered.
+	 */
+	struct sr_buffer *buffer;
+};
+
+/** Statistics of a datafeed callback, see sr_session_stats_get(). */
+struct sr_datafeed_stats {
+	/** Number of packets delivered to the callback. */
+	uint64_t calls;
+	/** Number of sample bytes (logic or analog) delivered. */
+	uint64_t bytes;
+	/** Median time (in us) the callback took. */
+	uint64_t latency_p50;
+	/** 99th percentile of the time (in us) the callback took. */
+	uint64_t latency_p99;
+	/** Longest time (in us) the callback took. */
+	uint64_t latency_max;
 };
 
 struct sr_input {
@@ -300,6 +470,8 @@ struct sr_input {
 	GHashTable *param;
 	struct sr_dev_inst *sdi;
 	void *internal;
+	/* Decompression of a streaming input (see sr_input_begin()). */
+	void *codec;
 };
 
 struct sr_input_format {
@@ -308,6 +480,74 @@ struct sr_input_format {
 	int (*format_match) (const char *filename);
 	int (*init) (struct sr_input *in);
 	int (*loadfile) (struct sr_input *in, const char *filename);
+	/*
+	 * Streaming interface, as an alternative to loadfile() (optional,
+	 * see sr_input_begin()): begin() is called once, then receive()
+	 * for each piece of data as it arrives, and end() at the end of
+	 * the data. end() frees what init() allocated.
+	 */
+	int (*begin) (struct sr_input *in);
+	int (*receive) (struct sr_input *in, const void *buf, uint64_t len);
+	int (*end) (struct sr_input *in);
+	/*
+	 * Whether streamed data which turns out to be compressed is
+	 * decompressed for the format. Binary formats leave this unset,
+	 * as their data may well start with a gzip or zstd magic number.
+	 */
+	gboolean decompress;
+};
+
+/** Output sink types, see sr_output_sink_buffer_new() and friends. */
+enum {
+	/** Output is collected in a growable buffer, reused across packets. */
+	SR_OUTPUT_SINK_BUFFER = 10000,
+	/** Output is written to a file descriptor as it is produced. */
+	SR_OUTPUT_SINK_FD,
+	/** Output is collected as a list of pieces of memory. */
+	SR_OUTPUT_SINK_IOVEC,
+	/** Output is compressed, and written to another sink. */
+	SR_OUTPUT_SINK_COMPRESS,
+};
+
+/** Compression methods, see sr_output_sink_compress_new(). */
+enum {
+	/** gzip (RFC 1952), needs zlib. */
+	SR_COMPRESS_GZIP = 10000,
+	/** Zstandard, needs libzstd. */
+	SR_COMPRESS_ZSTD,
+};
+
+/** One piece of output, see sr_output_sink_writev(). */
+struct sr_output_iov {
+	const void *data;
+	uint64_t length;
+};
+
+/**
+ * Destination of the output of an output module, see
+ * sr_output_sink_buffer_new(). Fields are private.
+ */
+struct sr_output_sink {
+	int type;
+	/** SR_OUTPUT_SINK_FD: the file descriptor written to. */
+	int fd;
+	/** Output written by the module itself (sr_output_sink_reserve()). */
+	uint8_t *buf;
+	uint64_t buf_len;
+	uint64_t buf_size;
+	/**
+	 * SR_OUTPUT_SINK_IOVEC: the pieces of output, in order. Pieces
+	 * with 'data' NULL are the next 'length' bytes of 'buf'.
+	 */
+	struct sr_output_iov *pieces;
+	int num_pieces;
+	int pieces_size;
+	/** SR_OUTPUT_SINK_IOVEC: 'pieces' resolved for the caller. */
+	struct sr_output_iov *iov;
+	/** SR_OUTPUT_SINK_COMPRESS: the sink the compressed output goes to. */
+	struct sr_output_sink *next;
+	/** SR_OUTPUT_SINK_COMPRESS: the compressor's state. */
+	void *codec;
 };
 
 struct sr_output {
@@ -330,13 +570,538 @@ struct sr_output_format {
 	GString *(*recv) (struct sr_output *o, const struct sr_dev_inst *sdi,
 			struct sr_datafeed_packet *packet);
 	int (*cleanup) (struct sr_output *o);
+	/*
+	 * Sink interface, as an alternative to data() and event() (optional,
+	 * see sr_output_data()): the output is written to 'sink' instead of
+	 * being returned in a newly allocated buffer.
+	 */
+	int (*data_sink) (struct sr_output *o, const uint8_t *data_in,
+			  uint64_t length_in, struct sr_output_sink *sink);
+	int (*event_sink) (struct sr_output *o, int event_type,
+			   struct sr_output_sink *sink);
+	/*
+	 * Sink interface for modules taking whole packets, as an
+	 * alternative to recv() (optional, see sr_output_recv()). It
+	 * doesn't change the module's state, so that the output runner
+	 * can encode several packets at once on different threads.
+	 */
+	int (*recv_sink) (struct sr_output *o,
+			  const struct sr_datafeed_packet *packet,
+			  struct sr_output_sink *sink);
+	/*
+	 * Encoding of independent pieces of a packet (optional, see
+	 * sr_output_runner_new()): like data_sink(), but it doesn't change
+	 * the module's state, so that it can run for several pieces at once
+	 * on different threads. It is only called after a first packet has
+	 * gone through data() or data_sink().
+	 */
+	int (*data_chunk) (struct sr_output *o, const uint8_t *data_in,
+			   uint64_t length_in, struct sr_output_sink *sink);
+	/*
+	 * Run-length encoded logic data (optional, see sr_output_data_rle()).
+	 * Modules without it get the runs expanded and passed to data().
+	 */
+	int (*data_rle) (struct sr_output *o,
+			 const struct sr_datafeed_logic_rle *rle,
+			 struct sr_output_sink *sink);
+};
+
+/** A transform in a session's chain, see sr_session_transform_add(). */
+struct sr_transform {
+	struct sr_transform_format *format;
+	/** The device whose packets are transformed, or NULL for all. */
+	const struct sr_dev_inst *sdi;
+	GHashTable *param;
+	void *internal;
+};
+
+struct sr_transform_format {
+	char *id;
+	char *description;
+	int (*init) (struct sr_transform *t);
+	/*
+	 * Called for each packet. The packet and its payload may be changed
+	 * in place, and passed on by setting *packet_out to it; setting
+	 * *packet_out to another packet passes that on instead, and NULL
+	 * drops it. More packets can be sent on with sr_transform_send().
+	 * The samples a payload points to may be read-only (e.g. a mapped
+	 * input file), so changed samples go into a buffer of the transform.
+	 */
+	int (*receive) (struct sr_transform *t, const struct sr_dev_inst *sdi,
+			struct sr_datafeed_packet *packet_in,
+			struct sr_datafeed_packet **packet_out);
+	int (*cleanup) (struct sr_transform *t);
+};
+
+struct sr_output_job;
+
+/** Threaded output encoder, see sr_output_runner_new(). Fields are private. */
+struct sr_output_runner {
+	struct sr_output *output;
+	/** Where the output goes, in packet order. */
+	struct sr_output_sink *sink;
+	GThread **threads;
+	int num_threads;
+	GMutex mutex;
+	/** Signalled when jobs were added, finished or written out. */
+	GCond cond;
+	/** Jobs not yet written out, oldest first. */
+	struct sr_output_job *jobs_head;
+	struct sr_output_job *jobs_tail;
+	/** Bytes of packet data held by the jobs. */
+	uint64_t queued;
+	/** Whether a worker is writing out finished jobs. */
+	gboolean writing;
+	/** Whether a logic packet has been queued already. */
+	gboolean data_seen;
+	gboolean quit;
+	/** The first error that occurred, or SR_OK. */
+	int ret;
 };
 
 struct sr_datastore {
 	/** Size in bytes of the number of units stored in this datastore. */
 	int ds_unitsize;
-	unsigned int num_units; /* TODO: uint64_t */
-	GSList *chunklist;
+	/**
+	 * Number of bits (1, 2 or 4) each unit is packed into in the chunks,
+	 * or 0 if units are stored as they are. See
+	 * sr_datastore_unitbits_set().
+	 */
+	int ds_unitbits;
+	uint64_t num_units;
+	/**
+	 * Array of chunks, each DATASTORE_CHUNKSIZE units in size. Unit n
+	 * lives in chunk n / DATASTORE_CHUNKSIZE.
+	 */
+	void **chunks;
+	/** Number of chunks in use. */
+	uint64_t num_chunks;
+	/** Number of entries allocated in 'chunks'. */
+	uint64_t chunks_size;
+	/** Number of units stored in the last chunk. */
+	uint64_t last_fill;
+	/**
+	 * Backing file of a memory-mapped datastore, or NULL if the chunks
+	 * live on the heap. The chunks are stored back-to-back in this file.
+	 */
+	char *filename;
+	/** File descriptor of the backing file, or -1. */
+	int fd;
+	/** Mapping of the last chunk (memory-mapped datastores only). */
+	void *tail_map;
+	/** Mapping of chunk 'read_chunk', or NULL. */
+	void *read_map;
+	/** Index of the chunk mapped at 'read_map'. */
+	uint64_t read_chunk;
+	/** TRUE if full chunks are compressed. */
+	gboolean compress;
+	/**
+	 * Compressed size in bytes of each chunk, or 0 if the chunk is
+	 * stored uncompressed. NULL unless 'compress' is set.
+	 */
+	uint64_t *packed_sizes;
+	/** Scratch buffer holding chunk 'unpacked_chunk' decompressed. */
+	void *unpacked;
+	/** Index of the chunk decompressed into 'unpacked'. */
+	uint64_t unpacked_chunk;
+	/**
+	 * Scratch buffer holding chunk 'expanded_chunk' of a packed
+	 * datastore, one byte per unit.
+	 */
+	uint8_t *expanded;
+	/** Index of the chunk expanded into 'expanded'. */
+	uint64_t expanded_chunk;
+	/** Number of units expanded into 'expanded'. */
+	uint64_t expanded_units;
+	/** TRUE if a summary pyramid is maintained. */
+	gboolean summarize;
+	/**
+	 * Summary pyramid levels, or NULL. Each entry of level k covers
+	 * 2^(DATASTORE_SUMMARY_BASE + k) units.
+	 */
+	struct sr_datastore_level *levels;
+	/** Number of levels holding at least one entry. */
+	int num_levels;
+	/** Summary entry being accumulated, plus the last unit seen. */
+	uint8_t *summary_acc;
+	/** Number of units accumulated into 'summary_acc'. */
+	uint64_t summary_fill;
+	/** TRUE if an edge index is maintained. */
+	gboolean index_edges;
+	/** Edge index records, one per chunk, or NULL. */
+	struct sr_datastore_edges *edges;
+	/** Number of records in use in 'edges'. */
+	uint64_t num_edge_chunks;
+	/** Number of records allocated in 'edges'. */
+	uint64_t edges_size;
+	/** The last unit indexed. */
+	uint8_t *edges_last;
+	/**
+	 * Memory reserved for the first 'reserved_chunks' chunks, back to
+	 * back, or NULL. See sr_datastore_reserve().
+	 */
+	uint8_t *reserved;
+	/** Number of chunks 'reserved' has room for. */
+	uint64_t reserved_chunks;
+};
+
+/** Edge index of one datastore chunk, see sr_datastore_edges_set(). */
+struct sr_datastore_edges {
+	/** Number of transitions of each probe in this chunk. */
+	uint32_t *counts;
+	/**
+	 * Sorted offsets (in units, within the chunk) of each probe's
+	 * transitions. NULL for probes with more than DATASTORE_EDGES_MAX
+	 * transitions in this chunk.
+	 */
+	uint32_t **offsets;
+	/** Number of entries allocated in each of 'offsets'. */
+	uint32_t *sizes;
+	/** The unit before the first unit of this chunk. */
+	uint8_t *prev;
+};
+
+/** Maximum number of stages of a software trigger. */
+#define SR_TRIGGER_MAX_STAGES 16
+
+/** Keep all samples before the trigger, see sr_trigger_new(). */
+#define SR_TRIGGER_PRETRIGGER_ALL UINT64_MAX
+
+/**
+ * A software trigger, compiled from the probe triggers of a device (see
+ * sr_trigger_new()).
+ *
+ * Stage n has to match the n-th of consecutive samples. A sample matches
+ * a stage if its probes in 'mask' have the levels in 'value', and its
+ * probes in 'edge' changed since the sample before it.
+ */
+struct sr_trigger {
+	int num_stages;
+	uint64_t mask[SR_TRIGGER_MAX_STAGES];
+	uint64_t value[SR_TRIGGER_MAX_STAGES];
+	uint64_t edge[SR_TRIGGER_MAX_STAGES];
+	/** Samples before the trigger which sr_trigger_send() keeps. */
+	uint64_t pretrigger_samples;
+
+	/** Bit n is set while stages 0 to n match the last samples. */
+	unsigned int state;
+	/** The last n - 1 samples, for matches spanning several buffers. */
+	uint64_t history[SR_TRIGGER_MAX_STAGES];
+	/** The last sample, if 'have_prev' is set. */
+	uint64_t prev;
+	gboolean have_prev;
+	/** Number of samples looked at so far. */
+	uint64_t samplecount;
+	gboolean fired;
+	/** Index of the sample which matched the first stage, once fired. */
+	uint64_t trigger_pos;
+	/** The samples which matched the stages, once fired. */
+	uint8_t match[SR_TRIGGER_MAX_STAGES * 8];
+
+	/* Pre-trigger ring of sr_trigger_send(), in samples. */
+	uint8_t *ring;
+	uint16_t unitsize;
+	uint64_t ring_size;
+	uint64_t ring_start;
+	uint64_t ring_fill;
+};
+
+/** How a decimator reduces each window of samples, see sr_decimator_new(). */
+enum {
+	/** Keep the first sample of each window. */
+	SR_DECIMATE_SAMPLE = 10000,
+	/** OR all samples: a probe is high if it was high at all. */
+	SR_DECIMATE_OR,
+	/** AND all samples: a probe is low if it was low at all. */
+	SR_DECIMATE_AND,
+	/** Keep the last sample, but toggle probes which glitched. */
+	SR_DECIMATE_TRANSITION,
+};
+
+/**
+ * Streaming decimator of logic samples (see sr_decimator_new()), turning
+ * every 'factor' samples into one.
+ */
+struct sr_decimator {
+	uint64_t factor;
+	int mode;
+	uint16_t unitsize;
+	/** Number of samples in the current window so far. */
+	uint64_t fill;
+	/** The current window so far, combined according to 'mode'. */
+	uint64_t acc;
+	/** The first and the last sample of the current window so far. */
+	uint64_t first;
+	uint64_t last;
+	/** The last sample put out, if 'have_prev' is set. */
+	uint64_t prev;
+	gboolean have_prev;
+	/** Number of samples put out so far. */
+	uint64_t samples_out;
+};
+
+/** Running counters of one probe, see struct sr_logic_stats. */
+struct sr_logic_stats_probe {
+	/** Level of the probe in the last sample. */
+	gboolean level;
+	/** Index of the sample where the probe last changed, if it did. */
+	uint64_t last_edge;
+	gboolean have_edge;
+	/** Samples the probe was high in, up to 'last_edge'. */
+	uint64_t high_samples;
+	uint64_t rising_edges;
+	uint64_t falling_edges;
+	/** Indices of the first and the last rising edge. */
+	uint64_t first_rising;
+	uint64_t last_rising;
+	/** Shortest and longest complete high and low pulses, or 0. */
+	uint64_t min_high;
+	uint64_t max_high;
+	uint64_t min_low;
+	uint64_t max_low;
+};
+
+/**
+ * Incremental per-probe statistics of a logic stream (see
+ * sr_logic_stats_new()), for up to 64 probes.
+ */
+struct sr_logic_stats {
+	uint16_t unitsize;
+	/** Samplerate of the stream, used for frequency estimates, or 0. */
+	uint64_t samplerate;
+	/** Number of samples seen so far. */
+	uint64_t num_samples;
+	/** The last sample seen, if num_samples > 0. */
+	uint64_t prev;
+	struct sr_logic_stats_probe probes[64];
+};
+
+/** Statistics of one probe, see sr_logic_stats_get(). */
+struct sr_probe_stats {
+	/** Number of samples seen. */
+	uint64_t num_samples;
+	/** Number of those in which the probe was high. */
+	uint64_t high_samples;
+	uint64_t rising_edges;
+	uint64_t falling_edges;
+	/**
+	 * Shortest and longest high and low pulses, in samples. Only
+	 * pulses between two edges count; 0 if there were none.
+	 */
+	uint64_t min_high;
+	uint64_t max_high;
+	uint64_t min_low;
+	uint64_t max_low;
+	/** Fraction of the samples in which the probe was high (0 to 1). */
+	double duty_cycle;
+	/**
+	 * Frequency estimated from the rising edges, in Hz. 0 if there
+	 * were fewer than two, or the samplerate is unknown.
+	 */
+	double frequency;
+};
+
+/**
+ * One level of a datastore's summary pyramid.
+ *
+ * Each entry is 3 * ds_unitsize bytes: the OR of all units it covers
+ * ("any high"), the OR of all inverted units ("any low"), and the OR of
+ * each unit XORed with the one before it ("has edge"). Bit n of each
+ * field thus describes probe n + 1.
+ */
+struct sr_datastore_level {
+	uint8_t *entries;
+	/** Number of entries in use. */
+	uint64_t num_entries;
+	/** Number of entries allocated. */
+	uint64_t size;
+};
+
+/** Result of a datastore summary query, see sr_datastore_summary_get(). */
+struct sr_datastore_summary {
+	/** Number of units covered by each entry. */
+	uint64_t units_per_entry;
+	/** Index of the first unit covered by the first entry. */
+	uint64_t first_unit;
+	/** Number of entries returned. */
+	uint64_t num_entries;
+	/** The entries, in the format of struct sr_datastore_level. */
+	const uint8_t *entries;
+};
+
+/** Sample formats of an analog datastore, see sr_analog_datastore_new(). */
+enum {
+	/** 32-bit floats, the values as in SR_DF_ANALOG packets. */
+	SR_ANALOG_FLOAT = 10000,
+	/** 16-bit signed codes, with a scale and offset per probe. */
+	SR_ANALOG_INT16,
+};
+
+/** A frame of an analog datastore, from SR_DF_FRAME_BEGIN to _END. */
+struct sr_analog_frame {
+	/** Index of the frame's first sample. */
+	uint64_t first_sample;
+	/** Number of samples in the frame. */
+	uint64_t num_samples;
+};
+
+/**
+ * A datastore for analog samples, see sr_analog_datastore_new().
+ *
+ * Each probe's samples are stored in a column of their own, in chunks of
+ * DATASTORE_CHUNKSIZE samples: sample n of probe p is sample
+ * n % DATASTORE_CHUNKSIZE of chunks[(n / DATASTORE_CHUNKSIZE) *
+ * num_probes + p].
+ */
+struct sr_analog_datastore {
+	int num_probes;
+	/** SR_ANALOG_FLOAT or SR_ANALOG_INT16. */
+	int format;
+	/** Size of a stored sample in bytes. */
+	int sample_size;
+	/** Measured quantity, unit and flags, from the first samples. */
+	int mq;
+	int unit;
+	uint64_t mqflags;
+	gboolean have_mq;
+	/**
+	 * Scale and offset of each probe's codes (SR_ANALOG_INT16 only),
+	 * or NULL until they're known.
+	 */
+	struct sr_analog_scale *scales;
+	/** Number of samples stored, per probe. */
+	uint64_t num_samples;
+	/** The probes' columns, num_probes per chunk. */
+	void **chunks;
+	/** Number of chunks in use, per probe. */
+	uint64_t num_chunks;
+	/** Number of entries allocated in 'chunks', per probe. */
+	uint64_t chunks_size;
+	/** The frames, in order. */
+	struct sr_analog_frame *frames;
+	/** Number of frames, including one which hasn't ended yet. */
+	uint64_t num_frames;
+	/** Number of entries allocated in 'frames'. */
+	uint64_t frames_size;
+	/** TRUE between SR_DF_FRAME_BEGIN and SR_DF_FRAME_END. */
+	gboolean in_frame;
+	/** TRUE if a summary pyramid is maintained. */
+	gboolean summarize;
+	/**
+	 * Summary pyramid levels, DATASTORE_SUMMARY_LEVELS per probe, or
+	 * NULL. Each entry is the minimum and the maximum (two floats) of
+	 * the 2^(DATASTORE_SUMMARY_BASE + k) samples it covers.
+	 */
+	struct sr_datastore_level *levels;
+	/** Number of levels holding at least one entry. */
+	int num_levels;
+	/** Entry being accumulated for each probe, plus scratch space. */
+	float *summary_acc;
+	/** Number of samples accumulated into 'summary_acc'. */
+	uint64_t summary_fill;
+	/** Packets converted to floats before they're stored. */
+	float *convert;
+	/** Number of floats allocated in 'convert'. */
+	uint64_t convert_size;
+};
+
+/** Result of an analog summary query, see sr_analog_datastore_summary_get(). */
+struct sr_analog_datastore_summary {
+	/** Number of samples covered by each entry. */
+	uint64_t samples_per_entry;
+	/** Index of the first sample covered by the first entry. */
+	uint64_t first_sample;
+	/** Number of entries returned. */
+	uint64_t num_entries;
+	/** The minimum and maximum of each entry, one after the other. */
+	const float *entries;
+};
+
+/** Compression of capture data in session files. */
+enum {
+	/** No compression. */
+	SR_COMPRESSION_STORE = 10000,
+	/** Deflate, readable by every libzip. */
+	SR_COMPRESSION_DEFLATE,
+	/** Zstandard, needs libzip with zstd support. */
+	SR_COMPRESSION_ZSTD,
+};
+
+/** Incremental session file writer, see sr_session_writer_new(). */
+struct sr_session_writer {
+	/** The session file being written. */
+	char *filename;
+	int unitsize;
+	/** Data not yet written to a part file. */
+	uint8_t *buf;
+	/** Size of 'buf' in bytes, i.e. of one chunk. */
+	uint64_t buf_size;
+	/** Number of bytes used in 'buf'. */
+	uint64_t fill;
+	/** Number of chunks written so far. */
+	unsigned int num_chunks;
+	/** The chunks written so far, as they will be listed in the index. */
+	struct sr_session_chunk *chunks;
+	/** Index + 1 of the first chunk with each hash. */
+	GHashTable *hashes;
+	/** Number of units written so far. */
+	uint64_t num_units;
+	/** Compression of the capture file chunks (SR_COMPRESSION_*). */
+	int codec;
+	int level;
+};
+
+/** Stream-to-disk recorder, see sr_recorder_new(). Fields are private. */
+struct sr_recorder {
+	/** The session file written when the recorder is closed. */
+	char *filename;
+	const struct sr_dev_inst *sdi;
+	int unitsize;
+	uint64_t samplerate;
+	/** Ring limits: keep only this much of the data, 0 for no limit. */
+	uint64_t max_bytes;
+	uint64_t max_msec;
+	/** Whether parts are written with O_DIRECT. */
+	gboolean direct;
+
+	/** The two buffers: one being filled, one being written out. */
+	uint8_t *bufs[2];
+	uint64_t buf_size;
+	int active;
+	uint64_t fill;
+
+	GThread *thread;
+	GMutex mutex;
+	/** Signalled when a buffer was handed over or written out. */
+	GCond cond;
+	/** The buffer to be written out, or -1. */
+	int pending;
+	uint64_t pending_len;
+	gboolean quit;
+	/** The first error that occurred, or SR_OK. */
+	int ret;
+
+	/* Used by the writer thread only, until it has quit. */
+	int fd;
+	/** Bytes written to the part being written. */
+	uint64_t part_fill;
+	/** The parts kept on disk are first_part up to next_part - 1. */
+	unsigned int first_part;
+	unsigned int next_part;
+	/** Units written to parts so far, including dropped ones. */
+	uint64_t num_units;
+	/** Units dropped with parts removed by the ring limits. */
+	uint64_t dropped_units;
+};
+
+/** Iterator over a range of units in a datastore. */
+struct sr_datastore_iter {
+	/** The datastore being read. */
+	struct sr_datastore *ds;
+	/** Index of the next unit to hand out. */
+	uint64_t unit;
+	/** Index of the unit after the last one in the range. */
+	uint64_t end;
 };
 
 /*
@@ -480,8 +1245,10 @@ enum {
 	/** The device supports specifying a capturefile to inject. */
 	SR_HWCAP_CAPTUREFILE,
 
-	/* TODO: Better description. */
-	/** The device supports specifying the capturefile unit size. */
+	/**
+	 * The device supports specifying the unit size (in bytes) of the
+	 * capturefile, or of the samples it generates.
+	 */
 	SR_HWCAP_CAPTURE_UNITSIZE,
 
 	/* TODO: Better description. */
@@ -514,6 +1281,60 @@ enum {
 	 * samples continuously, until explicitly stopped by a certain command.
 	 */
 	SR_HWCAP_CONTINUOUS,
+
+	/*--- Added later, at the end so no value above changes -------------*/
+
+	/**
+	 * The device supports setting the playback speed of a capture (or
+	 * the speed at which it generates samples), as a multiple of its
+	 * samplerate (1 is real time). 0 plays back as fast as possible.
+	 */
+	SR_HWCAP_PLAYBACK_SPEED,
+
+	/** The device supports setting the size of the packets it sends. */
+	SR_HWCAP_PLAYBACK_CHUNKSIZE,
+
+	/**
+	 * The device can service its USB transfers on a dedicated thread,
+	 * which hands the data over to the session.
+	 */
+	SR_HWCAP_USB_EVENT_THREAD,
+
+	/**
+	 * The device can start downloading its sample memory while the
+	 * capture is still running.
+	 */
+	SR_HWCAP_LIVE_DOWNLOAD,
+
+	/** The device supports setting the number of analog probes. */
+	SR_HWCAP_NUM_ANALOG_PROBES,
+
+	/** Pattern generator mode of the analog probes. */
+	SR_HWCAP_ANALOG_PATTERN_MODE,
+
+	/**
+	 * The device supports specifying the number of bits (1, 2 or 4)
+	 * each unit of a packed capturefile takes up, see sr_logic_pack().
+	 */
+	SR_HWCAP_CAPTURE_UNITBITS,
+
+	/**
+	 * The device supports specifying an analog capture file to inject,
+	 * as written by sr_session_save_analog().
+	 */
+	SR_HWCAP_ANALOGFILE,
+
+	/**
+	 * The device's serial communication parameters can be changed, in
+	 * the same form as SR_HWOPT_SERIALCOMM (e.g. "921600/8n1").
+	 */
+	SR_HWCAP_SERIALCOMM,
+
+	/**
+	 * The oscilloscope can stream its samples continuously at slow
+	 * timebases (roll mode), instead of capturing them in frames.
+	 */
+	SR_HWCAP_ROLL_MODE,
 };
 
 struct sr_hwcap_option {
@@ -557,6 +1378,17 @@ enum {
 	SR_ST_STOPPING,
 };
 
+/** Hotplug events, see sr_hotplug_enable(). */
+enum {
+	/** A device instance was added to its driver's device list. */
+	SR_HOTPLUG_ARRIVED = 10000,
+	/** A device instance is about to be removed and freed. */
+	SR_HOTPLUG_LEFT,
+};
+
+typedef void (*sr_hotplug_callback_t)(int event, struct sr_dev_inst *sdi,
+		void *cb_data);
+
 /*
  * TODO: This sucks, you just kinda have to "know" the returned type.
  * TODO: Need a DI to return the number of trigger stages supported.
@@ -592,6 +1424,12 @@ enum {
 	SR_DI_VDIVS,
 	/** Coupling options. */
 	SR_DI_COUPLING,
+	/** USB transfer statistics (struct sr_transfer_stats). */
+	SR_DI_TRANSFER_STATS,
+	/** Supported patterns of the analog probes (pattern generator mode). */
+	SR_DI_ANALOG_PATTERNS,
+	/** Health and throughput counters (struct sr_dev_stats). */
+	SR_DI_DEV_STATS,
 };
 
 /*
@@ -606,6 +1444,72 @@ struct sr_samplerates {
 	const uint64_t *list;
 };
 
+/*
+ * Statistics of the USB transfers of a device's current (or last)
+ * acquisition. The driver sizes its transfer queue from the observed
+ * latencies; these show where it ended up.
+ */
+struct sr_transfer_stats {
+	/** Size of each transfer buffer, in bytes. */
+	uint64_t transfer_size;
+	/** Number of transfers in flight. */
+	uint64_t transfers;
+	/** Number of spare buffers held by the USB event thread. */
+	uint64_t spare_buffers;
+	/** Number of transfers which completed with data. */
+	uint64_t completed;
+	/** Number of transfers which failed or came back empty. */
+	uint64_t failed;
+	/** Number of bytes received. */
+	uint64_t bytes;
+	/** Longest time (in us) completed data waited to be handled. */
+	uint64_t latency_max;
+};
+
+/*
+ * Health and throughput counters of a device's current (or last)
+ * acquisition, kept by its driver. Read them with sr_dev_stats_get(),
+ * which also fills in the rates and the average latency.
+ */
+struct sr_dev_stats {
+	/** Monotonic time (in us) at which the acquisition started. */
+	int64_t start_time;
+	/** Monotonic time (in us) at which data last came in. */
+	int64_t last_time;
+	/** Number of bytes received. */
+	uint64_t bytes;
+	/** Number of samples received. */
+	uint64_t samples;
+	/** Number of transfers which completed with data. */
+	uint64_t transfers_completed;
+	/** Number of transfers which failed or came back empty. */
+	uint64_t transfers_failed;
+	/** Number of transfers which were submitted again after completing. */
+	uint64_t transfers_resubmitted;
+	/** Time (in us) the last completed data waited to be handled. */
+	uint64_t latency_last;
+	/** Longest time (in us) completed data waited to be handled. */
+	uint64_t latency_max;
+	/** Sum of all those waits (in us). */
+	uint64_t latency_total;
+	/** Bytes of received data waiting in the driver's buffers. */
+	uint64_t buffer_used;
+	/** Most bytes that ever waited in the driver's buffers at once. */
+	uint64_t buffer_max;
+	/** Total size of the driver's buffers, in bytes. */
+	uint64_t buffer_size;
+	/* The current rate window, which rolls over about every second. */
+	int64_t window_start;
+	uint64_t window_bytes;
+	uint64_t window_samples;
+	/** Bytes per second received over the last window. */
+	double bytes_per_sec;
+	/** Samples per second received over the last window. */
+	double samples_per_sec;
+	/** Average time (in us) completed data waited to be handled. */
+	uint64_t latency_avg;
+};
+
 struct sr_dev_driver {
 	/* Driver-specific */
 	char *name;
@@ -628,16 +1532,46 @@ struct sr_dev_driver {
 			void *cb_data);
 	int (*dev_acquisition_stop) (struct sr_dev_inst *sdi,
 			void *cb_data);
+	/*
+	 * Optional: dev_acquisition_start() split in two, for synchronized
+	 * starts. arm does everything up to the point where sampling
+	 * begins, release then begins it as quickly as possible.
+	 */
+	int (*dev_acquisition_arm) (const struct sr_dev_inst *sdi,
+			void *cb_data);
+	int (*dev_acquisition_release) (const struct sr_dev_inst *sdi);
+	/*
+	 * Optional: hotplug support (see sr_hotplug_enable()). usb_arrived
+	 * is told about a USB device which was just plugged in, and adds an
+	 * instance for it if it's one of the driver's. usb_left is told
+	 * about one which went away, and removes its instance. Both report
+	 * what they did with sr_hotplug_post().
+	 */
+	void (*usb_arrived) (uint16_t vid, uint16_t pid, uint8_t bus,
+			uint8_t address);
+	void (*usb_left) (uint8_t bus, uint8_t address);
 
 	/* Dynamic */
 	void *priv;
 };
 
+/** One driver for sr_scan_all() to scan, and what to scan it with. */
+struct sr_scan {
+	struct sr_dev_driver *driver;
+	/** List of struct sr_hwopt options, as for sr_driver_scan(). */
+	GSList *options;
+};
+
 struct sr_session {
 	/** List of struct sr_dev pointers. */
 	GSList *devs;
 	/** List of sr_receive_data_callback_t items. */
 	GSList *datafeed_callbacks;
+	/* Statistics for each datafeed callback, in the same order. */
+	GSList *datafeed_stats;
+	/* Number of datafeed callbacks which run on their own thread. */
+	unsigned int num_async;
+	gboolean stats_enabled;
 	GTimeVal starttime;
 
 	unsigned int num_sources;
@@ -650,7 +1584,106 @@ struct sr_session {
 	 */
 	struct source *sources;
 	GPollFD *pollfds;
-	int source_timeout;
+	/* Number of entries allocated in "sources", "pollfds" and "timers". */
+	unsigned int sources_size;
+	/*
+	 * Min-heap of the indices of all sources with a timeout, ordered by
+	 * the time their timeout expires.
+	 */
+	unsigned int *timers;
+	unsigned int num_timers;
+	/*
+	 * The epoll/kqueue descriptor all sources are registered with, or
+	 * -1 if g_poll() is used.
+	 */
+	int backend_fd;
+	/* TRUE while the poll loop is calling source callbacks. */
+	gboolean dispatching;
+	/* Sources removed while dispatching, not yet dropped from the arrays. */
+	unsigned int num_removed;
+	/* Index of the source whose callback is running, or -1. */
+	int current_source;
+	/* Index at which the next round over idle sources continues. */
+	unsigned int idle_next;
+
+	/*
+	 * Threaded mode (see sr_session_threaded_set()): the sources are
+	 * serviced on a separate acquisition thread, which hands packets
+	 * to the thread running sr_session_run() through one lock-free
+	 * ring per device.
+	 */
+	gboolean threaded;
+	/** List of struct packet_ring pointers, one per device. */
+	GSList *rings;
+	GThread *acquisition_thread;
+	volatile gint acquisition_running;
+	volatile gint stop_requested;
+	volatile gint consumer_waiting;
+	volatile gint producer_waiting;
+	/* Serializes datafeed callbacks invoked from different threads. */
+	GMutex dispatch_mutex;
+	/* Only used to sleep on an empty (or full) ring. */
+	GMutex ring_mutex;
+	GCond ring_cond;
+
+	/*
+	 * Logic packet coalescing (see sr_session_coalesce_set()). A size
+	 * of 0 disables it.
+	 */
+	uint64_t coalesce_size;
+	int coalesce_latency;
+	/** List of struct coalescer pointers, one per sending device. */
+	GSList *coalescers;
+	/** List of struct feed_position pointers, one per sending device. */
+	GSList *positions;
+
+	/* Probe filtering (see sr_session_probe_filter_set()). */
+	gboolean probe_filter;
+	/** List of struct probe_filter pointers, one per device. */
+	GSList *probe_filters;
+	/*
+	 * Decimation of logic packets (see sr_session_decimate_set()). A
+	 * factor of 0 or 1 disables it.
+	 */
+	uint64_t decimate_factor;
+	int decimate_mode;
+	/** List of struct session_decimator pointers, one per device. */
+	GSList *decimators;
+	/* Per-probe statistics (see sr_session_probe_stats_set()). */
+	gboolean probe_stats;
+	/** List of struct session_probe_stats pointers, one per device. */
+	GSList *probe_stats_devs;
+	/** List of struct sr_transform pointers, in chain order. */
+	GSList *transforms;
+
+	/* Whether sr_session_start() arms all devices, then releases them. */
+	gboolean sync_start;
+	/* Merging of two logic streams (see sr_session_merge_set()). */
+	struct session_merge *merge;
+
+	/* Whether datafeed callbacks take SR_DF_LOGIC_RLE packets as is. */
+	gboolean rle_native;
+	/** Expanded SR_DF_LOGIC_RLE data, reused once nobody holds it. */
+	struct sr_buffer *rle_buf;
+	/* Whether datafeed callbacks take SR_DF_ANALOG_RAW packets as is. */
+	gboolean analog_raw_native;
+	/** Converted SR_DF_ANALOG_RAW data, reused once nobody holds it. */
+	struct sr_buffer *analog_buf;
+
+	/*
+	 * The session file loaded by sr_session_load(), kept open for the
+	 * acquisition, and its background indexing (see
+	 * sr_session_load_lazy()).
+	 */
+	struct zip *archive;
+	char *archive_name;
+	GThread *index_thread;
+	/** List of struct session_index pointers, one per device. */
+	GSList *indexes;
+	GMutex index_mutex;
+	volatile gint index_abort;
+	/** The session driver's device instances playing back the file. */
+	GSList *file_devs;
 };
 
 #include "proto.h"
@@ -37,8 +37,11 @@
  * @{
  */
 
-/* Currently selected libsigrok loglevel. Default: SR_LOG_WARN. */
-static int sr_loglevel = SR_LOG_WARN; /* Show errors+warnings per default. */
+/*
+ * Currently selected libsigrok loglevel. Default: SR_LOG_WARN.
+ * Not static, the sr_spew() etc. macros check it before calling sr_log().
+ */
+SR_PRIV int sr_loglevel = SR_LOG_WARN; /* Show errors+warnings per default. */
 
 /* Function prototype. */
 static int sr_logv(void *cb_data, int loglevel, const char *format,
@@ -60,6 +63,35 @@ static void *sr_log_callback_data = NULL;
 /** @endcond */
 static char sr_log_domain[LOGDOMAIN_MAXLEN + 1] = LOGDOMAIN_DEFAULT;
 
+/*
+ * With asynchronous logging, messages are formatted into a ring and only
+ * passed to the log callback by sr_log_async_flush(). Any thread can add
+ * messages without taking a lock; a full ring drops them. This is a
+ * bounded queue as described by Dmitry Vyukov: each slot's sequence
+ * number tells whether it is free for the message numbered 'head', or
+ * holds the one numbered 'tail'.
+ */
+/** @cond PRIVATE */
+#define LOG_RING_SLOTS 256
+#define LOG_RING_MSGLEN 256
+/** @endcond */
+
+struct log_slot {
+	volatile gint seq;
+	int loglevel;
+	char msg[LOG_RING_MSGLEN];
+};
+
+static struct {
+	volatile gint enabled;
+	volatile gint head;
+	volatile gint dropped;
+	/* Only the flushing thread touches 'tail'. */
+	GMutex flush_mutex;
+	gint tail;
+	struct log_slot slots[LOG_RING_SLOTS];
+} log_ring;
+
 /**
  * Set the libsigrok loglevel.
  *
@@ -143,6 +175,9 @@ SR_API char *sr_log_logdomain_get(void)
 /**
  * Set the libsigrok log callback to the specified function.
  *
+ * The callback only gets the messages of the current loglevel or lower,
+ * see sr_log_loglevel_set().
+ *
  * @param cb Function pointer to the log callback function to use.
  *           Must not be NULL.
  * @param cb_data Pointer to private data to be passed on. This can be used by
@@ -206,8 +241,8 @@ static int sr_logv(void *cb_data, int loglevel, const char *format, va_list args
 	return ret;
 }
 
-/** @private */
-SR_PRIV int sr_log(int loglevel, const char *format, ...)
+/* Pass a message to the log callback, with a format of its own. */
+static int log_deliver(int loglevel, const char *format, ...)
 {
 	int ret;
 	va_list args;
@@ -219,66 +254,138 @@ SR_PRIV int sr_log(int loglevel, const char *format, ...)
 	return ret;
 }
 
-/** @private */
-SR_PRIV int sr_spew(const char *format, ...)
+/* Queue a message in the ring. Returns FALSE if it is full. */
+static gboolean log_ring_push(int loglevel, const char *format, va_list args)
 {
-	int ret;
-	va_list args;
+	struct log_slot *slot;
+	gint pos, seq;
+
+	pos = g_atomic_int_get(&log_ring.head);
+	for (;;) {
+		slot = &log_ring.slots[(guint)pos % LOG_RING_SLOTS];
+		seq = g_atomic_int_get(&slot->seq);
+		if (seq == pos) {
+			/* Free for this message; claim it. */
+			if (g_atomic_int_compare_and_exchange(&log_ring.head,
+							      pos, pos + 1))
+				break;
+		} else if ((gint)((guint)seq - (guint)pos) < 0) {
+			/* Still holds the message of the previous round. */
+			return FALSE;
+		}
+		pos = g_atomic_int_get(&log_ring.head);
+	}
 
-	va_start(args, format);
-	ret = sr_log_callback(sr_log_callback_data, SR_LOG_SPEW, format, args);
-	va_end(args);
+	slot->loglevel = loglevel;
+	vsnprintf(slot->msg, LOG_RING_MSGLEN, format, args);
+	/* Hand the slot to the flushing thread. */
+	g_atomic_int_set(&slot->seq, pos + 1);
 
-	return ret;
+	return TRUE;
 }
 
-/** @private */
-SR_PRIV int sr_dbg(const char *format, ...)
+/**
+ * Enable or disable asynchronous logging.
+ *
+ * Normally, the log callback is called from whichever thread logs a
+ * message, which may be an acquisition thread. With asynchronous logging
+ * the message is only queued there, and the callback is called from
+ * sr_log_async_flush(), which the frontend calls e.g. from its main loop.
+ * Queueing a message never blocks. Messages which don't fit the queue
+ * (256 messages of up to 255 characters) are dropped and counted.
+ *
+ * Disabling asynchronous logging flushes the messages still queued.
+ *
+ * @param async TRUE to queue messages, FALSE to pass them on directly.
+ *
+ * @return SR_OK upon success.
+ */
+SR_API int sr_log_async_set(gboolean async)
 {
-	int ret;
-	va_list args;
-
-	va_start(args, format);
-	ret = sr_log_callback(sr_log_callback_data, SR_LOG_DBG, format, args);
-	va_end(args);
+	int i;
+
+	if (async && !g_atomic_int_get(&log_ring.enabled)) {
+		g_mutex_lock(&log_ring.flush_mutex);
+		/* Slot i is free for message i. */
+		for (i = 0; i < LOG_RING_SLOTS; i++)
+			g_atomic_int_set(&log_ring.slots[i].seq, i);
+		g_atomic_int_set(&log_ring.head, 0);
+		g_atomic_int_set(&log_ring.dropped, 0);
+		log_ring.tail = 0;
+		g_mutex_unlock(&log_ring.flush_mutex);
+		g_atomic_int_set(&log_ring.enabled, 1);
+	} else if (!async && g_atomic_int_get(&log_ring.enabled)) {
+		g_atomic_int_set(&log_ring.enabled, 0);
+		sr_log_async_flush();
+	}
 
-	return ret;
+	return SR_OK;
 }
 
-/** @private */
-SR_PRIV int sr_info(const char *format, ...)
+/**
+ * Pass the queued log messages to the log callback.
+ *
+ * Only needed with asynchronous logging, see sr_log_async_set(). The
+ * callback is called from the calling thread.
+ *
+ * @return The number of messages passed on.
+ */
+SR_API int sr_log_async_flush(void)
 {
-	int ret;
-	va_list args;
+	struct log_slot *slot;
+	gint dropped;
+	int n;
+
+	g_mutex_lock(&log_ring.flush_mutex);
+
+	n = 0;
+	for (;;) {
+		slot = &log_ring.slots[(guint)log_ring.tail % LOG_RING_SLOTS];
+		if (g_atomic_int_get(&slot->seq) != log_ring.tail + 1)
+			break;
+		log_deliver(slot->loglevel, "%s", slot->msg);
+		/* Free the slot for the message one round later. */
+		g_atomic_int_set(&slot->seq, log_ring.tail + LOG_RING_SLOTS);
+		log_ring.tail++;
+		n++;
+	}
 
-	va_start(args, format);
-	ret = sr_log_callback(sr_log_callback_data, SR_LOG_INFO, format, args);
-	va_end(args);
+	do {
+		dropped = g_atomic_int_get(&log_ring.dropped);
+	} while (!g_atomic_int_compare_and_exchange(&log_ring.dropped,
+						    dropped, 0));
 
-	return ret;
-}
+	g_mutex_unlock(&log_ring.flush_mutex);
 
-/** @private */
-SR_PRIV int sr_warn(const char *format, ...)
-{
-	int ret;
-	va_list args;
+	if (dropped > 0)
+		log_deliver(SR_LOG_WARN, "%d log message(s) dropped, the "
+			    "log queue was full.", dropped);
 
-	va_start(args, format);
-	ret = sr_log_callback(sr_log_callback_data, SR_LOG_WARN, format, args);
-	va_end(args);
-
-	return ret;
+	return n;
 }
 
-/** @private */
-SR_PRIV int sr_err(const char *format, ...)
+/**
+ * Log a message.
+ *
+ * Call sr_spew(), sr_dbg(), sr_info(), sr_warn() or sr_err() instead,
+ * which only get here if the message's loglevel is enabled.
+ *
+ * @private
+ */
+SR_PRIV int sr_log(int loglevel, const char *format, ...)
 {
 	int ret;
 	va_list args;
 
 	va_start(args, format);
-	ret = sr_log_callback(sr_log_callback_data, SR_LOG_ERR, format, args);
+	if (g_atomic_int_get(&log_ring.enabled)) {
+		if (!log_ring_push(loglevel, format, args))
+			g_atomic_int_inc(&log_ring.dropped);
+		ret = 0;
+	} else {
+		ret = sr_log_callback(sr_log_callback_data, loglevel, format,
+				      args);
+	}
 	va_end(args);
 
 	return ret;
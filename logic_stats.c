@@ -0,0 +1,373 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "logic-stats: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/**
+ * @file
+ *
+ * Incremental per-probe statistics of logic samples.
+ */
+
+/**
+ * @defgroup grp_logic_stats Logic statistics
+ *
+ * Incremental per-probe statistics of logic samples.
+ *
+ * A struct sr_logic_stats counts, for each probe, its rising and falling
+ * edges, the samples it was high in, and the shortest and longest high
+ * and low pulses, as samples are fed to it. sr_logic_stats_get() turns
+ * the counters into a probe's duty cycle and estimated frequency at any
+ * time, so a frontend never has to rescan a capture for them.
+ *
+ * With unit sizes of 1, 2, 4 and 8 bytes, the samples are XORed with
+ * their predecessors eight bytes at a time; only the edges this turns up
+ * are looked at one by one, so quiet probes cost next to nothing.
+ *
+ * The session can keep statistics of every device's logic samples, see
+ * sr_session_probe_stats_set().
+ *
+ * @{
+ */
+
+/* Sample 'i' of a buffer, with probe n in bit n. */
+static inline uint64_t sample_get(const uint8_t *buf, uint16_t unitsize,
+				  uint64_t i)
+{
+	const uint8_t *p;
+	uint64_t sample;
+	int b;
+
+	p = buf + i * unitsize;
+	if (unitsize == 1)
+		return p[0];
+
+	sample = 0;
+	for (b = 0; b < unitsize; b++)
+		sample |= (uint64_t)p[b] << (8 * b);
+
+	return sample;
+}
+
+/* Probe 'p' changed to 'level' at sample 'pos'. */
+static void edge(struct sr_logic_stats *s, unsigned int p, uint64_t pos,
+		 gboolean level)
+{
+	struct sr_logic_stats_probe *ps;
+	uint64_t width;
+
+	ps = &s->probes[p];
+	width = pos - ps->last_edge;
+	if (level) {
+		/* A low pulse ended. */
+		if (ps->have_edge) {
+			if (!ps->min_low || width < ps->min_low)
+				ps->min_low = width;
+			ps->max_low = MAX(ps->max_low, width);
+		}
+		if (!ps->rising_edges)
+			ps->first_rising = pos;
+		ps->last_rising = pos;
+		ps->rising_edges++;
+	} else {
+		/* A high pulse ended. */
+		ps->high_samples += width;
+		if (ps->have_edge) {
+			if (!ps->min_high || width < ps->min_high)
+				ps->min_high = width;
+			ps->max_high = MAX(ps->max_high, width);
+		}
+		ps->falling_edges++;
+	}
+	ps->last_edge = pos;
+	ps->have_edge = TRUE;
+	ps->level = level;
+}
+
+/*
+ * Record the edges in 'x', the XOR of 'cur' and its predecessor, of a
+ * sample or a word of samples starting at sample 'pos'. Bit b of 'x' is
+ * probe b % bits of the (b / bits)-th sample.
+ */
+static inline void edges_record(struct sr_logic_stats *s, uint64_t x,
+				uint64_t cur, unsigned int bits, uint64_t pos)
+{
+	unsigned int b;
+
+	while (x) {
+		b = __builtin_ctzll(x);
+		x &= x - 1;
+		edge(s, b % bits, pos + b / bits, (cur >> b) & 1);
+	}
+}
+
+/* Take the first sample of the stream as the probes' initial levels. */
+static void first_sample(struct sr_logic_stats *s, uint64_t sample)
+{
+	unsigned int p;
+
+	for (p = 0; p < 8U * s->unitsize; p++)
+		s->probes[p].level = (sample >> p) & 1;
+	s->prev = sample;
+}
+
+/**
+ * Create an empty set of logic statistics.
+ *
+ * @param stats Where to store the new statistics. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors.
+ */
+SR_API int sr_logic_stats_new(struct sr_logic_stats **stats)
+{
+	if (!stats) {
+		sr_err("%s: stats was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(*stats = g_try_malloc0(sizeof(struct sr_logic_stats)))) {
+		sr_err("%s: stats malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Destroy a set of logic statistics.
+ *
+ * @param stats The statistics. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_logic_stats_destroy(struct sr_logic_stats *stats)
+{
+	if (!stats)
+		return SR_ERR_ARG;
+
+	g_free(stats);
+
+	return SR_OK;
+}
+
+/**
+ * Reset a set of logic statistics for a new stream.
+ *
+ * @param stats The statistics. Must not be NULL.
+ * @param samplerate The samplerate of the new stream, or 0 if unknown.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_logic_stats_reset(struct sr_logic_stats *stats,
+		uint64_t samplerate)
+{
+	if (!stats)
+		return SR_ERR_ARG;
+
+	memset(stats, 0, sizeof(struct sr_logic_stats));
+	stats->samplerate = samplerate;
+
+	return SR_OK;
+}
+
+/**
+ * Add logic samples to a set of statistics.
+ *
+ * The samples continue those of the last call. If the unit size differs
+ * from that of the last call, the statistics are reset first (keeping the
+ * samplerate).
+ *
+ * @param stats The statistics. Must not be NULL.
+ * @param data The samples. Must not be NULL.
+ * @param length The length of 'data', in bytes.
+ * @param unitsize The size of a sample, in bytes (1 to 8).
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_logic_stats_feed(struct sr_logic_stats *stats,
+		const uint8_t *data, uint64_t length, uint16_t unitsize)
+{
+	struct sr_logic_stats *s;
+	uint64_t i, n, w, x, cur, prev;
+	unsigned int bits, per_word;
+
+	if (!stats || !data) {
+		sr_err("%s: arguments may not be NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (unitsize == 0 || unitsize > 8) {
+		sr_err("%s: invalid unit size %d", __func__, unitsize);
+		return SR_ERR_ARG;
+	}
+
+	s = stats;
+	if (s->unitsize != unitsize)
+		sr_logic_stats_reset(s, s->samplerate);
+	s->unitsize = unitsize;
+
+	n = length / unitsize;
+	if (n == 0)
+		return SR_OK;
+	if (s->num_samples == 0)
+		first_sample(s, sample_get(data, unitsize, 0));
+
+	bits = 8 * unitsize;
+	i = 0;
+	prev = s->prev;
+	if (8 % unitsize == 0) {
+		/*
+		 * Eight bytes at a time: XOR each word with itself shifted
+		 * up by one sample, the last sample before it shifted in.
+		 */
+		per_word = 8 / unitsize;
+		for (; i + per_word <= n; i += per_word) {
+			memcpy(&w, data + i * unitsize, 8);
+			w = GUINT64_FROM_LE(w);
+			x = bits == 64 ? w ^ prev : w ^ ((w << bits) | prev);
+			if (x)
+				edges_record(s, x, w, bits,
+					     s->num_samples + i);
+			prev = bits == 64 ? w : w >> (64 - bits);
+		}
+	}
+
+	for (; i < n; i++) {
+		cur = sample_get(data, unitsize, i);
+		if ((x = cur ^ prev))
+			edges_record(s, x, cur, bits, s->num_samples + i);
+		prev = cur;
+	}
+	s->prev = prev;
+	s->num_samples += n;
+
+	return SR_OK;
+}
+
+/**
+ * Add run-length encoded logic samples to a set of statistics.
+ *
+ * This works like sr_logic_stats_feed(), but only looks at the runs'
+ * boundaries.
+ *
+ * @param stats The statistics. Must not be NULL.
+ * @param rle The runs. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_logic_stats_feed_rle(struct sr_logic_stats *stats,
+		const struct sr_datafeed_logic_rle *rle)
+{
+	struct sr_logic_stats *s;
+	uint64_t i, x, mask;
+
+	if (!stats || !rle) {
+		sr_err("%s: arguments may not be NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (rle->unitsize == 0 || rle->unitsize > 8) {
+		sr_err("%s: invalid unit size %d", __func__, rle->unitsize);
+		return SR_ERR_ARG;
+	}
+
+	s = stats;
+	if (s->unitsize != rle->unitsize)
+		sr_logic_stats_reset(s, s->samplerate);
+	s->unitsize = rle->unitsize;
+
+	mask = rle->unitsize == 8 ? UINT64_MAX
+		: (UINT64_C(1) << (8 * rle->unitsize)) - 1;
+	for (i = 0; i < rle->num_runs; i++) {
+		if (rle->runs[i].length == 0)
+			continue;
+		if (s->num_samples == 0)
+			first_sample(s, rle->runs[i].value & mask);
+		if ((x = (rle->runs[i].value & mask) ^ s->prev))
+			edges_record(s, x, rle->runs[i].value, 64,
+				     s->num_samples);
+		s->prev = rle->runs[i].value & mask;
+		s->num_samples += rle->runs[i].length;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Get the statistics of one probe.
+ *
+ * This can be called at any time; the samples of the current, unfinished
+ * pulse count towards the duty cycle, but not towards the pulse widths.
+ *
+ * @param stats The statistics. Must not be NULL.
+ * @param probe The index of the probe, i.e. its bit in the samples
+ *              (0 to 8 * unitsize - 1).
+ * @param probe_stats Pointer to a struct which will be filled in. Must
+ *                    not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_logic_stats_get(const struct sr_logic_stats *stats, int probe,
+		struct sr_probe_stats *probe_stats)
+{
+	const struct sr_logic_stats_probe *ps;
+	uint64_t span;
+
+	if (!stats || !probe_stats) {
+		sr_err("%s: arguments may not be NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (probe < 0 || probe >= 64 ||
+	    (stats->unitsize && probe >= 8 * stats->unitsize)) {
+		sr_err("%s: invalid probe %d", __func__, probe);
+		return SR_ERR_ARG;
+	}
+
+	ps = &stats->probes[probe];
+	memset(probe_stats, 0, sizeof(struct sr_probe_stats));
+	probe_stats->num_samples = stats->num_samples;
+	probe_stats->high_samples = ps->high_samples;
+	if (stats->num_samples && ps->level)
+		probe_stats->high_samples += stats->num_samples - ps->last_edge;
+	probe_stats->rising_edges = ps->rising_edges;
+	probe_stats->falling_edges = ps->falling_edges;
+	probe_stats->min_high = ps->min_high;
+	probe_stats->max_high = ps->max_high;
+	probe_stats->min_low = ps->min_low;
+	probe_stats->max_low = ps->max_low;
+	if (stats->num_samples)
+		probe_stats->duty_cycle = (double)probe_stats->high_samples /
+					  stats->num_samples;
+	span = ps->last_rising - ps->first_rising;
+	if (ps->rising_edges >= 2 && stats->samplerate && span)
+		probe_stats->frequency = (double)(ps->rising_edges - 1) *
+					 stats->samplerate / span;
+
+	return SR_OK;
+}
+
+/** @} */
@@ -27,23 +27,54 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "output/analog: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
+
+/*
+ * The output is text by default, a line per probe and sample. The
+ * parameter selects a binary format instead, with the values of all
+ * probes for a sample after each other, in little endian order:
+ *
+ * float32:      The values as 32-bit floats.
+ *
+ * int16[:lsb]:  The values as signed 16-bit integers, in steps of 'lsb'
+ *               (default 0.001, i.e. millivolts for voltages), clipped
+ *               to the int16 range.
+ */
+
+enum {
+	MODE_TEXT,
+	MODE_FLOAT32,
+	MODE_INT16,
+};
+
+/* Longest number: 39 digits of FLT_MAX, '.', 6 decimals and a sign. */
+#define MAX_NUMBER_LEN 48
+
+/* Longest unit, including an SI prefix and all flags. */
+#define MAX_SUFFIX_LEN 32
 
 struct context {
 	int num_enabled_probes;
 	GPtrArray *probelist;
+	/* Length of the longest probe name. */
+	size_t max_namelen;
+	int mode;
+	double lsb;
 	GString *out;
 };
 
+/* An SI prefix, and how values are scaled for it. */
+struct si_prefix {
+	const char *prefix;
+	double mul;
+	double div;
+};
+
 static int init(struct sr_output *o)
 {
 	struct context *ctx;
 	struct sr_probe *probe;
 	GSList *l;
+	char *end;
 
 	sr_spew("Initializing output module.");
 
@@ -63,135 +94,331 @@ static int init(struct sr_output *o)
 		if (!probe || !probe->enabled)
 			continue;
 		g_ptr_array_add(ctx->probelist, probe->name);
+		ctx->max_namelen = MAX(ctx->max_namelen, strlen(probe->name));
 		ctx->num_enabled_probes++;
 	}
 
+	ctx->mode = MODE_TEXT;
+	ctx->lsb = 0.001;
+	if (o->param && !strcmp(o->param, "float32")) {
+		ctx->mode = MODE_FLOAT32;
+	} else if (o->param && !strncmp(o->param, "int16", 5)) {
+		ctx->mode = MODE_INT16;
+		if (o->param[5] == ':') {
+			ctx->lsb = strtod(o->param + 6, &end);
+			if (*end || !(ctx->lsb > 0)) {
+				sr_err("Invalid int16 step: %s.", o->param + 6);
+				ctx->lsb = 0.001;
+			}
+		}
+	} else if (o->param && o->param[0]) {
+		sr_err("Unknown parameter: %s.", o->param);
+	}
+
 	ctx->out = g_string_sized_new(512);
 
 	return SR_OK;
 }
 
-static void si_printf(float value, GString *out, char *unitstr)
+/* Set an SI prefix, by which values are multiplied or divided. */
+static void si_prefix_set(struct si_prefix *si, const char *prefix,
+			  double mul, double div)
 {
-	float v;
+	si->prefix = prefix;
+	si->mul = mul;
+	si->div = div;
+}
 
-	if (signbit(value))
-		v = -(value);
-	else
-		v = value;
-
-	if (v < 1e-12 || v > 1e+12)
-		g_string_append_printf(out, "%f %s", value, unitstr);
-	else if (v > 1e+9)
-		g_string_append_printf(out, "%f G%s", value / 1e+9, unitstr);
-	else if (v > 1e+6)
-		g_string_append_printf(out, "%f M%s", value / 1e+6, unitstr);
-	else if (v > 1e+3)
-		g_string_append_printf(out, "%f k%s", value / 1e+3, unitstr);
-	else if (v < 1e-9)
-		g_string_append_printf(out, "%f n%s", value * 1e+9, unitstr);
-	else if (v < 1e-6)
-		g_string_append_printf(out, "%f u%s", value * 1e+6, unitstr);
-	else if (v < 1e-3)
-		g_string_append_printf(out, "%f m%s", value * 1e+3, unitstr);
+/*
+ * Pick the SI prefix for a packet, from the largest of its values. All
+ * values of the packet are printed with it, as on a meter's display.
+ */
+static void si_prefix_pick(const float *data, uint64_t num_values,
+			   struct si_prefix *si)
+{
+	uint64_t i;
+	float v, max;
+
+	max = 0;
+	for (i = 0; i < num_values; i++) {
+		v = fabsf(data[i]);
+		if (v > max)
+			max = v;
+	}
+
+	if (max < 1e-12 || max > 1e+12 || isnan(max))
+		si_prefix_set(si, "", 1, 1);
+	else if (max > 1e+9)
+		si_prefix_set(si, "G", 1, 1e+9);
+	else if (max > 1e+6)
+		si_prefix_set(si, "M", 1, 1e+6);
+	else if (max > 1e+3)
+		si_prefix_set(si, "k", 1, 1e+3);
+	else if (max < 1e-9)
+		si_prefix_set(si, "n", 1e+9, 1);
+	else if (max < 1e-6)
+		si_prefix_set(si, "u", 1e+6, 1);
+	else if (max < 1e-3)
+		si_prefix_set(si, "m", 1e+3, 1);
 	else
-		g_string_append_printf(out, "%f %s", value, unitstr);
+		si_prefix_set(si, "", 1, 1);
+}
 
+/* Write 'value' as with printf("%f"), returning the number of characters. */
+static int format_float(char *buf, double value)
+{
+	uint64_t r, ip, fp;
+	double x, t, rem;
+	int len, i;
+
+	x = fabs(value);
+	if (!(x < 1e+12))
+		/* Too large for the fast path, or not a number. */
+		return snprintf(buf, MAX_NUMBER_LEN, "%f", value);
+
+	/*
+	 * Round to 6 decimals as printf() does, i.e. based on the exact
+	 * value of x * 1e6. Its distance from floor(x * 1e6) is what
+	 * fma() returns, rounded only once. Should that look like a tie,
+	 * leave it to printf().
+	 */
+	t = floor(x * 1e+6);
+	rem = fma(x, 1e+6, -t);
+	if (rem < 0) {
+		t -= 1;
+		rem += 1;
+	} else if (rem >= 1) {
+		t += 1;
+		rem -= 1;
+	}
+	if (rem == 0.5)
+		return snprintf(buf, MAX_NUMBER_LEN, "%f", value);
+	r = (uint64_t)t + (rem > 0.5);
+	ip = r / 1000000;
+	fp = r % 1000000;
+
+	len = 0;
+	if (signbit(value))
+		buf[len++] = '-';
+	len += sr_output_format_dec(buf + len, ip);
+	buf[len++] = '.';
+	for (i = 5; i >= 0; i--, fp /= 10)
+		buf[len + i] = '0' + fp % 10;
+
+	return len + 6;
 }
 
-static void fancyprint(int unit, int mqflags, float value, GString *out)
+/*
+ * Write what follows the number on each line: the prefixed unit and the
+ * flags, and a newline. Returns the number of characters.
+ */
+static int format_suffix(char *buf, int unit, uint64_t mqflags,
+			 const char *prefix)
 {
+	const char *unitstr, *timew, *func;
+	int len;
+
+	timew = func = "";
 	switch (unit) {
-		case SR_UNIT_VOLT:
-			si_printf(value, out, "V");
-			break;
-		case SR_UNIT_AMPERE:
-			si_printf(value, out, "A");
-			break;
-		case SR_UNIT_OHM:
-			si_printf(value, out, "");
-			g_string_append_unichar(out, 0x2126);
-			break;
-		case SR_UNIT_FARAD:
-			si_printf(value, out, "F");
-			break;
-		case SR_UNIT_KELVIN:
-			si_printf(value, out, "K");
-			break;
-		case SR_UNIT_CELSIUS:
-			si_printf(value, out, "");
-			g_string_append_unichar(out, 0x00b0);
-			g_string_append_c(out, 'C');
-			break;
-		case SR_UNIT_FAHRENHEIT:
-			si_printf(value, out, "");
-			g_string_append_unichar(out, 0x00b0);
-			g_string_append_c(out, 'F');
-			break;
-		case SR_UNIT_HERTZ:
-			si_printf(value, out, "Hz");
-			break;
-		case SR_UNIT_PERCENTAGE:
-			g_string_append_printf(out, "%f%%", value);
-			break;
-		case SR_UNIT_BOOLEAN:
-			if (value > 0)
-				g_string_append_printf(out, "TRUE");
-			else
-				g_string_append_printf(out, "FALSE");
-			break;
-		case SR_UNIT_SECOND:
-			si_printf(value, out, "s");
-			break;
-		case SR_UNIT_SIEMENS:
-			si_printf(value, out, "S");
-			break;
-		case SR_UNIT_DECIBEL_MW:
-			si_printf(value, out, "dBu");
-			break;
-		case SR_UNIT_DECIBEL_VOLT:
-			si_printf(value, out, "dBV");
-			break;
-		case SR_UNIT_DECIBEL_SPL:
-			if (mqflags & SR_MQFLAG_SPL_FREQ_WEIGHT_A)
-				si_printf(value, out, "dB(A)");
-			else if (mqflags & SR_MQFLAG_SPL_FREQ_WEIGHT_C)
-				si_printf(value, out, "dB(C)");
-			else if (mqflags & SR_MQFLAG_SPL_FREQ_WEIGHT_Z)
-				si_printf(value, out, "dB(Z)");
-			else
-				/* No frequency weighting, or non-standard "flat" */
-				si_printf(value, out, "dB(SPL)");
-			if (mqflags & SR_MQFLAG_SPL_TIME_WEIGHT_S)
-				g_string_append(out, " S");
-			else if (mqflags & SR_MQFLAG_SPL_TIME_WEIGHT_F)
-				g_string_append(out, " F");
-			if (mqflags & SR_MQFLAG_SPL_LAT)
-				g_string_append(out, " LAT");
-			else if (mqflags & SR_MQFLAG_SPL_PCT_OVER_ALARM)
-				/* Not a standard function for SLMs, so this is
-				 * a made-up notation. */
-				g_string_append(out, " %oA");
-			break;
-		default:
-			si_printf(value, out, "");
+	case SR_UNIT_VOLT:
+		unitstr = "V";
+		break;
+	case SR_UNIT_AMPERE:
+		unitstr = "A";
+		break;
+	case SR_UNIT_OHM:
+		unitstr = "\xe2\x84\xa6";
+		break;
+	case SR_UNIT_FARAD:
+		unitstr = "F";
+		break;
+	case SR_UNIT_KELVIN:
+		unitstr = "K";
+		break;
+	case SR_UNIT_CELSIUS:
+		unitstr = "\xc2\xb0" "C";
+		break;
+	case SR_UNIT_FAHRENHEIT:
+		unitstr = "\xc2\xb0" "F";
+		break;
+	case SR_UNIT_HERTZ:
+		unitstr = "Hz";
+		break;
+	case SR_UNIT_SECOND:
+		unitstr = "s";
+		break;
+	case SR_UNIT_SIEMENS:
+		unitstr = "S";
+		break;
+	case SR_UNIT_DECIBEL_MW:
+		unitstr = "dBu";
+		break;
+	case SR_UNIT_DECIBEL_VOLT:
+		unitstr = "dBV";
+		break;
+	case SR_UNIT_DECIBEL_SPL:
+		if (mqflags & SR_MQFLAG_SPL_FREQ_WEIGHT_A)
+			unitstr = "dB(A)";
+		else if (mqflags & SR_MQFLAG_SPL_FREQ_WEIGHT_C)
+			unitstr = "dB(C)";
+		else if (mqflags & SR_MQFLAG_SPL_FREQ_WEIGHT_Z)
+			unitstr = "dB(Z)";
+		else
+			/* No frequency weighting, or non-standard "flat" */
+			unitstr = "dB(SPL)";
+		if (mqflags & SR_MQFLAG_SPL_TIME_WEIGHT_S)
+			timew = " S";
+		else if (mqflags & SR_MQFLAG_SPL_TIME_WEIGHT_F)
+			timew = " F";
+		if (mqflags & SR_MQFLAG_SPL_LAT)
+			func = " LAT";
+		else if (mqflags & SR_MQFLAG_SPL_PCT_OVER_ALARM)
+			/* Not a standard function for SLMs, so this is
+			 * a made-up notation. */
+			func = " %oA";
+		break;
+	default:
+		unitstr = "";
+		break;
 	}
-	if ((mqflags & (SR_MQFLAG_AC | SR_MQFLAG_DC)) == (SR_MQFLAG_AC | SR_MQFLAG_DC))
-		g_string_append_printf(out, " AC+DC");
+
+	if (unit == SR_UNIT_PERCENTAGE)
+		len = snprintf(buf, MAX_SUFFIX_LEN, "%%");
+	else if (unit == SR_UNIT_BOOLEAN)
+		len = 0;
+	else
+		len = snprintf(buf, MAX_SUFFIX_LEN, " %s%s%s%s",
+			       prefix, unitstr, timew, func);
+
+	if ((mqflags & (SR_MQFLAG_AC | SR_MQFLAG_DC)) ==
+	    (SR_MQFLAG_AC | SR_MQFLAG_DC))
+		len += snprintf(buf + len, MAX_SUFFIX_LEN - len, " AC+DC");
 	else if (mqflags & SR_MQFLAG_AC)
-		g_string_append_printf(out, " AC");
+		len += snprintf(buf + len, MAX_SUFFIX_LEN - len, " AC");
 	else if (mqflags & SR_MQFLAG_DC)
-		g_string_append_printf(out, " DC");
-	g_string_append_c(out, '\n');
+		len += snprintf(buf + len, MAX_SUFFIX_LEN - len, " DC");
+	buf[len++] = '\n';
+
+	return len;
+}
+
+/* Number of values in an analog packet: one per probe for each sample. */
+static uint64_t num_values(const struct context *ctx,
+			   const struct sr_datafeed_analog *analog)
+{
+	if (analog->num_samples <= 0)
+		return 0;
+
+	return (uint64_t)analog->num_samples * ctx->num_enabled_probes;
+}
+
+/* Largest possible size of the output for a packet. */
+static uint64_t outsize(const struct context *ctx,
+			const struct sr_datafeed_packet *packet)
+{
+	uint64_t n;
+
+	if (packet->type == SR_DF_FRAME_BEGIN ||
+	    packet->type == SR_DF_FRAME_END)
+		return ctx->mode == MODE_TEXT ? strlen("FRAME-BEGIN\n") : 0;
+	if (packet->type != SR_DF_ANALOG)
+		return 0;
+
+	n = num_values(ctx, packet->payload);
+	if (ctx->mode == MODE_FLOAT32)
+		return n * 4;
+	if (ctx->mode == MODE_INT16)
+		return n * 2;
+
+	return n * (ctx->max_namelen + 2 + MAX_NUMBER_LEN + MAX_SUFFIX_LEN);
+}
+
+/* Write the output for a packet to 'outbuf'. */
+static uint64_t encode(const struct context *ctx,
+		       const struct sr_datafeed_packet *packet,
+		       uint8_t *outbuf)
+{
+	const struct sr_datafeed_analog *analog;
+	const char *name;
+	struct si_prefix si;
+	char suffix[MAX_SUFFIX_LEN + 1];
+	uint8_t *out;
+	uint64_t n, i;
+	uint32_t bits;
+	double v;
+	int suffix_len, j;
+	size_t len;
+
+	if (ctx->mode == MODE_TEXT && packet->type == SR_DF_FRAME_BEGIN) {
+		memcpy(outbuf, "FRAME-BEGIN\n", 12);
+		return 12;
+	}
+	if (ctx->mode == MODE_TEXT && packet->type == SR_DF_FRAME_END) {
+		memcpy(outbuf, "FRAME-END\n", 10);
+		return 10;
+	}
+	if (packet->type != SR_DF_ANALOG)
+		return 0;
+
+	analog = packet->payload;
+	n = num_values(ctx, analog);
+	out = outbuf;
+
+	if (ctx->mode == MODE_FLOAT32) {
+		for (i = 0; i < n; i++, out += 4) {
+			memcpy(&bits, &analog->data[i], 4);
+			WL32(out, bits);
+		}
+		return out - outbuf;
+	}
+
+	if (ctx->mode == MODE_INT16) {
+		for (i = 0; i < n; i++, out += 2) {
+			v = rint(analog->data[i] / ctx->lsb);
+			v = isnan(v) ? 0 : MAX(MIN(v, INT16_MAX), INT16_MIN);
+			WL16(out, (uint16_t)(int16_t)v);
+		}
+		return out - outbuf;
+	}
+
+	/* The prefix and the rest of the line are the same for all. */
+	if (analog->unit == SR_UNIT_PERCENTAGE ||
+	    analog->unit == SR_UNIT_BOOLEAN)
+		si_prefix_set(&si, "", 1, 1);
+	else
+		si_prefix_pick(analog->data, n, &si);
+	suffix_len = format_suffix(suffix, analog->unit, analog->mqflags,
+				   si.prefix);
+
+	for (i = 0; i < n; i++) {
+		j = i % ctx->num_enabled_probes;
+		name = g_ptr_array_index(ctx->probelist, j);
+		len = strlen(name);
+		memcpy(out, name, len);
+		out += len;
+		*out++ = ':';
+		*out++ = ' ';
+		if (analog->unit == SR_UNIT_BOOLEAN) {
+			name = analog->data[i] > 0 ? "TRUE" : "FALSE";
+			len = strlen(name);
+			memcpy(out, name, len);
+			out += len;
+		} else {
+			v = (double)analog->data[i] * si.mul / si.div;
+			out += format_float((char *)out, v);
+		}
+		memcpy(out, suffix, suffix_len);
+		out += suffix_len;
+	}
+
+	return out - outbuf;
 }
 
 static GString *receive(struct sr_output *o, const struct sr_dev_inst *sdi,
 		struct sr_datafeed_packet *packet)
 {
-	struct sr_datafeed_analog *analog;
 	struct context *ctx;
-	float *fdata;
-	int i, j;
+	uint64_t len;
 
 	(void)sdi;
 
@@ -199,33 +426,32 @@ static GString *receive(struct sr_output *o, const struct sr_dev_inst *sdi,
 		return NULL;
 	ctx = o->internal;
 
-	g_string_set_size(ctx->out, 0);
-	switch (packet->type) {
-	case SR_DF_HEADER:
-		break;
-	case SR_DF_FRAME_BEGIN:
-		g_string_append_printf(ctx->out, "FRAME-BEGIN\n");
-		break;
-	case SR_DF_FRAME_END:
-		g_string_append_printf(ctx->out, "FRAME-END\n");
-		break;
-	case SR_DF_ANALOG:
-		analog = packet->payload;
-		fdata = (float *)analog->data;
-		for (i = 0; i < analog->num_samples; i++) {
-			for (j = 0; j < ctx->num_enabled_probes; j++) {
-				g_string_append_printf(ctx->out, "%s: ",
-						(char *)g_ptr_array_index(ctx->probelist, j));
-				fancyprint(analog->unit, analog->mqflags,
-						fdata[i + j], ctx->out);
-			}
-		}
-		break;
-	}
+	g_string_set_size(ctx->out, outsize(ctx, packet));
+	len = encode(ctx, packet, (uint8_t *)ctx->out->str);
+	g_string_set_size(ctx->out, len);
 
 	return ctx->out;
 }
 
+static int receive_sink(struct sr_output *o,
+			const struct sr_datafeed_packet *packet,
+			struct sr_output_sink *sink)
+{
+	struct context *ctx;
+	uint8_t *outbuf;
+	uint64_t size;
+
+	if (!o || !(ctx = o->internal))
+		return SR_ERR_ARG;
+
+	if (!(size = outsize(ctx, packet)))
+		return SR_OK;
+	if (!(outbuf = sr_output_sink_reserve(sink, size)))
+		return SR_ERR_MALLOC;
+
+	return sr_output_sink_commit(sink, encode(ctx, packet, outbuf));
+}
+
 static int cleanup(struct sr_output *o)
 {
 	struct context *ctx;
@@ -248,5 +474,6 @@ SR_PRIV struct sr_output_format output_analog = {
 	.df_type = SR_DF_ANALOG,
 	.init = init,
 	.recv = receive,
-	.cleanup = cleanup
+	.cleanup = cleanup,
+	.recv_sink = receive_sink,
 };
@@ -27,11 +27,9 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "output/binary: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
+
+/* Size of the pieces SR_DF_LOGIC_RLE packets are expanded in. */
+#define RLE_CHUNK_SIZE (64 * 1024)
 
 static int data(struct sr_output *o, const uint8_t *data_in,
 		uint64_t length_in, uint8_t **data_out, uint64_t *length_out)
@@ -55,7 +53,7 @@ static int data(struct sr_output *o, const uint8_t *data_in,
 		return SR_ERR_ARG;
 	}
 
-	if (!(outbuf = g_try_malloc0(length_in))) {
+	if (!(outbuf = g_try_malloc(length_in))) {
 		sr_err("%s: outbuf malloc failed", __func__);
 		return SR_ERR_MALLOC;
 	}
@@ -67,6 +65,50 @@ static int data(struct sr_output *o, const uint8_t *data_in,
 	return SR_OK;
 }
 
+/* The output is the data itself, hand the sink a reference to it. */
+static int data_sink(struct sr_output *o, const uint8_t *data_in,
+		     uint64_t length_in, struct sr_output_sink *sink)
+{
+	struct sr_output_iov iov;
+
+	(void)o;
+
+	if (!data_in) {
+		sr_err("%s: data_in was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	iov.data = data_in;
+	iov.length = length_in;
+
+	return sr_output_sink_writev(sink, &iov, 1);
+}
+
+/* Expand the runs straight into the sink, there's nothing else to do. */
+static int data_rle(struct sr_output *o,
+		    const struct sr_datafeed_logic_rle *rle,
+		    struct sr_output_sink *sink)
+{
+	uint64_t run, offset, length;
+	uint8_t *out;
+	int ret;
+
+	(void)o;
+
+	run = offset = 0;
+	do {
+		if (!(out = sr_output_sink_reserve(sink, RLE_CHUNK_SIZE)))
+			return SR_ERR_MALLOC;
+		if ((ret = sr_logic_rle_expand(rle, &run, &offset, out,
+				RLE_CHUNK_SIZE, &length)) != SR_OK)
+			return ret;
+		if ((ret = sr_output_sink_commit(sink, length)) != SR_OK)
+			return ret;
+	} while (length > 0);
+
+	return SR_OK;
+}
+
 SR_PRIV struct sr_output_format output_binary = {
 	.id = "binary",
 	.description = "Raw binary",
@@ -74,4 +116,6 @@ SR_PRIV struct sr_output_format output_binary = {
 	.init = NULL,
 	.data = data,
 	.event = NULL,
+	.data_sink = data_sink,
+	.data_rle = data_rle,
 };
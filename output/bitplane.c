@@ -0,0 +1,529 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "output/bitplane: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/*
+ * Samples are stored per probe rather than per sample: each block holds
+ * a plane of bits for every probe (see the file layout in
+ * libsigrok-internal.h). Planes without any transitions are left out, so
+ * idle probes cost a block descriptor only, and a reader interested in a
+ * single probe only needs to read that probe's planes.
+ */
+
+/* Number of u64 words in the plane of a full block. */
+#define PLANE_WORDS (BITPLANE_BLOCK_SAMPLES / 64)
+
+struct context {
+	unsigned int num_enabled_probes;
+	unsigned int unitsize;
+	char *probelist[SR_MAX_NUM_PROBES + 1];
+	uint64_t samplerate;
+	gboolean header_done;
+	/* Planes of the block being filled, PLANE_WORDS words per probe. */
+	uint64_t *planes;
+	/* Number of samples in the block being filled. */
+	uint64_t fill;
+	/* Number of samples in the blocks written so far. */
+	uint64_t num_samples;
+	/* Number of bytes of output so far. */
+	uint64_t offset;
+	/* First sample and file offset of every block written so far. */
+	uint64_t *index;
+	uint64_t num_blocks;
+	uint64_t index_size;
+};
+
+static int init(struct sr_output *o)
+{
+	struct context *ctx;
+	struct sr_probe *probe;
+	GSList *l;
+	uint64_t *samplerate;
+
+	if (!o) {
+		sr_err("%s: o was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!o->sdi) {
+		sr_err("%s: o->sdi was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(ctx = g_try_malloc0(sizeof(struct context)))) {
+		sr_err("%s: ctx malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	o->internal = ctx;
+
+	/* Get the number of probes, their names, and the unitsize. */
+	for (l = o->sdi->probes; l; l = l->next) {
+		probe = l->data;
+		/* Analog probes aren't bits of the logic units. */
+		if (probe->type != SR_PROBE_LOGIC || !probe->enabled)
+			continue;
+		ctx->probelist[ctx->num_enabled_probes++] = probe->name;
+	}
+	ctx->probelist[ctx->num_enabled_probes] = 0;
+	ctx->unitsize = (ctx->num_enabled_probes + 7) / 8;
+
+	if (o->sdi->driver && sr_dev_has_hwcap(o->sdi, SR_HWCAP_SAMPLERATE)) {
+		o->sdi->driver->info_get(SR_DI_CUR_SAMPLERATE,
+				(const void **)&samplerate, o->sdi);
+		ctx->samplerate = *samplerate;
+	} else
+		ctx->samplerate = 0;
+
+	if (!(ctx->planes = g_try_malloc0(ctx->num_enabled_probes *
+			PLANE_WORDS * sizeof(uint64_t) + 1))) {
+		sr_err("%s: planes malloc failed", __func__);
+		g_free(ctx);
+		o->internal = NULL;
+		return SR_ERR_MALLOC;
+	}
+
+	return SR_OK;
+}
+
+/* Size of the file header, including the probe names. */
+static uint64_t header_size(const struct context *ctx)
+{
+	uint64_t size;
+	unsigned int i;
+
+	size = BITPLANE_HEADER_SIZE;
+	for (i = 0; i < ctx->num_enabled_probes; i++)
+		size += strlen(ctx->probelist[i]) + 1;
+
+	return size;
+}
+
+/* Largest possible size of a block: one with all planes stored. */
+static uint64_t block_size_max(const struct context *ctx)
+{
+	return BITPLANE_BLOCK_HEADER_SIZE + ctx->num_enabled_probes *
+		(BITPLANE_PLANE_SIZE + PLANE_WORDS * sizeof(uint64_t));
+}
+
+/* Make room in the index for 'count' more blocks. */
+static int index_grow(struct context *ctx, uint64_t count)
+{
+	uint64_t *index, size;
+
+	if (ctx->num_blocks + count <= ctx->index_size)
+		return SR_OK;
+
+	size = MAX(ctx->index_size * 2, ctx->num_blocks + count);
+	size = MAX(size, 64);
+	index = g_try_realloc(ctx->index, size * 2 * sizeof(uint64_t));
+	if (!index) {
+		sr_err("%s: index malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	ctx->index = index;
+	ctx->index_size = size;
+
+	return SR_OK;
+}
+
+static uint64_t write_header(struct context *ctx, uint8_t *outbuf)
+{
+	uint8_t *out;
+	size_t len;
+	unsigned int i;
+
+	memcpy(outbuf, BITPLANE_MAGIC, BITPLANE_MAGIC_LEN);
+	WL32(outbuf + 8, BITPLANE_VERSION);
+	WL32(outbuf + 12, ctx->num_enabled_probes);
+	WL64(outbuf + 16, ctx->samplerate);
+	WL32(outbuf + 24, BITPLANE_BLOCK_SAMPLES);
+	WL32(outbuf + 28, header_size(ctx) - BITPLANE_HEADER_SIZE);
+
+	out = outbuf + BITPLANE_HEADER_SIZE;
+	for (i = 0; i < ctx->num_enabled_probes; i++) {
+		len = strlen(ctx->probelist[i]) + 1;
+		memcpy(out, ctx->probelist[i], len);
+		out += len;
+	}
+	ctx->header_done = TRUE;
+	ctx->offset += out - outbuf;
+
+	return out - outbuf;
+}
+
+/* Number of value changes within the first 'n' samples of a plane. */
+static uint32_t plane_transitions(const uint64_t *plane, uint64_t n)
+{
+	uint64_t w, x, diff, prev;
+	uint32_t transitions;
+
+	transitions = 0;
+	prev = plane[0] & 1;
+	for (w = 0; w * 64 < n; w++) {
+		x = plane[w];
+		/* Bit i is set if sample i differs from sample i - 1. */
+		diff = x ^ ((x << 1) | prev);
+		if (n - w * 64 < 64)
+			diff &= ((uint64_t)1 << (n - w * 64)) - 1;
+		transitions += __builtin_popcountll(diff);
+		prev = x >> 63;
+	}
+
+	return transitions;
+}
+
+/* Write out the block being filled and start a new one. */
+static uint64_t write_block(struct context *ctx, uint8_t *outbuf)
+{
+	const uint64_t *plane;
+	uint8_t *desc;
+	uint64_t n, words, w, pos;
+	uint32_t transitions;
+	unsigned int p;
+
+	n = ctx->fill;
+	words = (n + 63) / 64;
+
+	WL64(outbuf, ctx->num_samples);
+	WL32(outbuf + 8, n);
+	WL32(outbuf + 12, 0);
+
+	desc = outbuf + BITPLANE_BLOCK_HEADER_SIZE;
+	pos = BITPLANE_BLOCK_HEADER_SIZE +
+		ctx->num_enabled_probes * BITPLANE_PLANE_SIZE;
+	for (p = 0; p < ctx->num_enabled_probes; p++) {
+		plane = ctx->planes + p * PLANE_WORDS;
+		transitions = plane_transitions(plane, n);
+		WL32(desc, transitions);
+		desc[4] = plane[0] & 1;
+		desc[5] = (plane[(n - 1) / 64] >> ((n - 1) % 64)) & 1;
+		desc[6] = desc[7] = 0;
+		if (transitions) {
+			WL64(desc + 8, pos);
+			for (w = 0; w < words; w++, pos += 8)
+				WL64(outbuf + pos, plane[w]);
+		} else {
+			WL64(desc + 8, 0);
+		}
+		desc += BITPLANE_PLANE_SIZE;
+		memset(ctx->planes + p * PLANE_WORDS, 0,
+		       words * sizeof(uint64_t));
+	}
+
+	/* Room for this was made by index_grow(). */
+	ctx->index[2 * ctx->num_blocks] = ctx->num_samples;
+	ctx->index[2 * ctx->num_blocks + 1] = ctx->offset;
+	ctx->num_blocks++;
+
+	ctx->num_samples += n;
+	ctx->offset += pos;
+	ctx->fill = 0;
+
+	return pos;
+}
+
+/* Largest possible size of the output for 'num_samples' samples. */
+static uint64_t outsize(const struct context *ctx, uint64_t num_samples)
+{
+	uint64_t size;
+
+	size = (ctx->fill + num_samples) / BITPLANE_BLOCK_SAMPLES *
+		block_size_max(ctx);
+	if (!ctx->header_done)
+		size += header_size(ctx);
+
+	return size;
+}
+
+/* Write the output for 'num_samples' samples to 'outbuf'. */
+static uint64_t encode(struct context *ctx, const uint8_t *data_in,
+		       uint64_t num_samples, uint8_t *outbuf)
+{
+	const uint8_t *unit;
+	uint8_t *out;
+	uint64_t i, bit, *planes;
+	unsigned int b, p, v;
+
+	out = outbuf;
+	if (!ctx->header_done)
+		out += write_header(ctx, out);
+
+	for (i = 0; i < num_samples; i++) {
+		unit = data_in + i * ctx->unitsize;
+		planes = ctx->planes + ctx->fill / 64;
+		bit = (uint64_t)1 << (ctx->fill % 64);
+		/* Only the probes which are high need touching. */
+		for (b = 0; b < ctx->unitsize; b++) {
+			for (v = unit[b]; v; v &= v - 1) {
+				p = 8 * b + __builtin_ctz(v);
+				if (p < ctx->num_enabled_probes)
+					planes[p * PLANE_WORDS] |= bit;
+			}
+		}
+		if (++ctx->fill == BITPLANE_BLOCK_SAMPLES)
+			out += write_block(ctx, out);
+	}
+
+	return out - outbuf;
+}
+
+/* Largest possible size of the end of the file, see finish(). */
+static uint64_t finish_size(const struct context *ctx)
+{
+	uint64_t size;
+
+	size = outsize(ctx, 0) + BITPLANE_MAGIC_LEN + BITPLANE_TRAILER_SIZE;
+	if (ctx->fill)
+		size += block_size_max(ctx);
+
+	return size + (ctx->num_blocks + 1) * BITPLANE_INDEX_ENTRY_SIZE;
+}
+
+/* Write the last, partial block, the index and the trailer. */
+static uint64_t finish(struct context *ctx, uint8_t *outbuf)
+{
+	uint8_t *out;
+	uint64_t index_offset, i;
+
+	out = outbuf;
+	if (!ctx->header_done)
+		out += write_header(ctx, out);
+	if (ctx->fill)
+		out += write_block(ctx, out);
+
+	index_offset = ctx->offset;
+	memcpy(out, BITPLANE_INDEX_MAGIC, BITPLANE_MAGIC_LEN);
+	out += BITPLANE_MAGIC_LEN;
+	for (i = 0; i < ctx->num_blocks; i++) {
+		WL64(out, ctx->index[2 * i]);
+		WL64(out + 8, ctx->index[2 * i + 1]);
+		out += BITPLANE_INDEX_ENTRY_SIZE;
+	}
+
+	WL64(out, ctx->num_blocks);
+	WL64(out + 8, ctx->num_samples);
+	WL64(out + 16, index_offset);
+	memcpy(out + 24, BITPLANE_MAGIC, BITPLANE_MAGIC_LEN);
+	out += BITPLANE_TRAILER_SIZE;
+
+	ctx->offset += out - outbuf;
+
+	return out - outbuf;
+}
+
+static void context_free(struct sr_output *o)
+{
+	struct context *ctx;
+
+	ctx = o->internal;
+	g_free(ctx->planes);
+	g_free(ctx->index);
+	g_free(ctx);
+	o->internal = NULL;
+}
+
+static int data(struct sr_output *o, const uint8_t *data_in,
+		uint64_t length_in, uint8_t **data_out, uint64_t *length_out)
+{
+	struct context *ctx;
+	uint8_t *outbuf;
+	uint64_t num_samples;
+	int ret;
+
+	if (!o) {
+		sr_err("%s: o was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(ctx = o->internal)) {
+		sr_err("%s: o->internal was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!data_in) {
+		sr_err("%s: data_in was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	num_samples = ctx->unitsize ? length_in / ctx->unitsize : 0;
+	if ((ret = index_grow(ctx, (ctx->fill + num_samples) /
+			BITPLANE_BLOCK_SAMPLES)) != SR_OK)
+		return ret;
+
+	if (!(outbuf = g_try_malloc(outsize(ctx, num_samples) + 1))) {
+		sr_err("%s: outbuf malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	*length_out = encode(ctx, data_in, num_samples, outbuf);
+	*data_out = outbuf;
+
+	return SR_OK;
+}
+
+static int data_sink(struct sr_output *o, const uint8_t *data_in,
+		     uint64_t length_in, struct sr_output_sink *sink)
+{
+	struct context *ctx;
+	uint8_t *outbuf;
+	uint64_t num_samples;
+	int ret;
+
+	if (!o) {
+		sr_err("%s: o was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(ctx = o->internal)) {
+		sr_err("%s: o->internal was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!data_in) {
+		sr_err("%s: data_in was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	num_samples = ctx->unitsize ? length_in / ctx->unitsize : 0;
+	if ((ret = index_grow(ctx, (ctx->fill + num_samples) /
+			BITPLANE_BLOCK_SAMPLES)) != SR_OK)
+		return ret;
+
+	if (!(outbuf = sr_output_sink_reserve(sink,
+			outsize(ctx, num_samples))))
+		return SR_ERR_MALLOC;
+
+	return sr_output_sink_commit(sink,
+			encode(ctx, data_in, num_samples, outbuf));
+}
+
+static int event(struct sr_output *o, int event_type, uint8_t **data_out,
+		 uint64_t *length_out)
+{
+	struct context *ctx;
+	uint8_t *outbuf;
+	int ret;
+
+	if (!o) {
+		sr_err("%s: o was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(ctx = o->internal)) {
+		sr_err("%s: o->internal was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!data_out) {
+		sr_err("%s: data_out was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	*data_out = NULL;
+	*length_out = 0;
+
+	switch (event_type) {
+	case SR_DF_TRIGGER:
+		/* Not recorded in the file. */
+		break;
+	case SR_DF_END:
+		if ((ret = index_grow(ctx, 1)) != SR_OK) {
+			context_free(o);
+			return ret;
+		}
+		if (!(outbuf = g_try_malloc(finish_size(ctx)))) {
+			sr_err("%s: outbuf malloc failed", __func__);
+			context_free(o);
+			return SR_ERR_MALLOC;
+		}
+		*length_out = finish(ctx, outbuf);
+		*data_out = outbuf;
+		context_free(o);
+		break;
+	default:
+		sr_err("%s: unsupported event type: %d", __func__, event_type);
+		break;
+	}
+
+	return SR_OK;
+}
+
+static int event_sink(struct sr_output *o, int event_type,
+		      struct sr_output_sink *sink)
+{
+	struct context *ctx;
+	uint8_t *outbuf;
+	int ret;
+
+	if (!o) {
+		sr_err("%s: o was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(ctx = o->internal)) {
+		sr_err("%s: o->internal was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	switch (event_type) {
+	case SR_DF_TRIGGER:
+		/* Not recorded in the file. */
+		ret = SR_OK;
+		break;
+	case SR_DF_END:
+		if ((ret = index_grow(ctx, 1)) != SR_OK) {
+			context_free(o);
+			break;
+		}
+		if (!(outbuf = sr_output_sink_reserve(sink,
+				finish_size(ctx)))) {
+			context_free(o);
+			ret = SR_ERR_MALLOC;
+			break;
+		}
+		ret = sr_output_sink_commit(sink, finish(ctx, outbuf));
+		context_free(o);
+		break;
+	default:
+		sr_err("%s: unsupported event type: %d", __func__, event_type);
+		ret = SR_OK;
+		break;
+	}
+
+	return ret;
+}
+
+SR_PRIV struct sr_output_format output_bitplane = {
+	.id = "bitplane",
+	.description = "Indexed per-probe bit-planes",
+	.df_type = SR_DF_LOGIC,
+	.init = init,
+	.data = data,
+	.event = event,
+	.data_sink = data_sink,
+	.event_sink = event_sink,
+};
@@ -27,11 +27,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "output/chronovu-la8: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 struct context {
 	unsigned int num_enabled_probes;
@@ -121,7 +116,8 @@ static int init(struct sr_output *o)
 	/* Get the probe names and the unitsize. */
 	for (l = o->sdi->probes; l; l = l->next) {
 		probe = l->data;
-		if (!probe->enabled)
+		/* Analog probes aren't bits of the logic units. */
+		if (probe->type != SR_PROBE_LOGIC || !probe->enabled)
 			continue;
 		ctx->probelist[ctx->num_enabled_probes++] = probe->name;
 	}
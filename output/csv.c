@@ -28,11 +28,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "output/csv: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 struct context {
 	unsigned int num_enabled_probes;
@@ -41,6 +36,11 @@ struct context {
 	uint64_t samplerate;
 	GString *header;
 	char separator;
+	/* Per byte of samples: its 8 probes as "b7,b6,...,b0,", MSB first. */
+	char lut[256][16];
+	/* format_lines() for this unit size. */
+	uint64_t (*format_lines)(struct context *ctx, const uint8_t *data_in,
+				 uint64_t num_samples, uint8_t *out);
 };
 
 /*
@@ -55,6 +55,42 @@ struct context {
  *  - Trigger support.
  */
 
+/* Write a line for each sample. Returns the length written. */
+SR_OUTPUT_KERNEL uint64_t format_lines(struct context *ctx,
+		const uint8_t *data_in, uint64_t num_samples, uint8_t *out,
+		unsigned int unitsize)
+{
+	const uint8_t *unit;
+	uint8_t *start;
+	uint64_t i;
+	unsigned int top;
+	int b;
+
+	start = out;
+
+	/* Number of probes in the most significant, maybe partial, byte. */
+	top = ctx->num_enabled_probes - 8 * (unitsize - 1);
+
+	for (i = 0; i < num_samples; i++) {
+		unit = data_in + i * unitsize;
+		/* Probes are printed from the highest one down to probe 0. */
+		b = unitsize - 1;
+		memcpy(out, ctx->lut[unit[b]] + 2 * (8 - top), 2 * top);
+		out += 2 * top;
+		while (--b >= 0) {
+			memcpy(out, ctx->lut[unit[b]], 16);
+			out += 16;
+		}
+		*out++ = '\n';
+	}
+
+	return out - start;
+}
+
+SR_OUTPUT_KERNELS(format_lines, uint64_t, (struct context *ctx,
+		const uint8_t *data_in, uint64_t num_samples, uint8_t *out),
+		ctx, data_in, num_samples, out)
+
 static int init(struct sr_output *o)
 {
 	struct context *ctx;
@@ -63,7 +99,7 @@ static int init(struct sr_output *o)
 	int num_probes;
 	uint64_t *samplerate;
 	time_t t;
-	unsigned int i;
+	unsigned int i, j;
 
 	if (!o) {
 		sr_err("%s: o was NULL", __func__);
@@ -88,16 +124,20 @@ static int init(struct sr_output *o)
 	o->internal = ctx;
 
 	/* Get the number of probes, their names, and the unitsize. */
+	num_probes = 0;
 	for (l = o->sdi->probes; l; l = l->next) {
 		probe = l->data;
+		/* Analog probes aren't bits of the logic units. */
+		if (probe->type != SR_PROBE_LOGIC)
+			continue;
+		num_probes++;
 		if (!probe->enabled)
 			continue;
 		ctx->probelist[ctx->num_enabled_probes++] = probe->name;
 	}
 	ctx->probelist[ctx->num_enabled_probes] = 0;
 	ctx->unitsize = (ctx->num_enabled_probes + 7) / 8;
-
-	num_probes = g_slist_length(o->sdi->probes);
+	ctx->format_lines = format_lines_get(ctx->unitsize);
 
 	if (sr_dev_has_hwcap(o->sdi, SR_HWCAP_SAMPLERATE)) {
 		o->sdi->driver->info_get(SR_DI_CUR_SAMPLERATE,
@@ -107,6 +147,13 @@ static int init(struct sr_output *o)
 		ctx->samplerate = 0;
 
 	ctx->separator = ',';
+	for (i = 0; i < 256; i++) {
+		for (j = 0; j < 8; j++) {
+			ctx->lut[i][2 * j] = (i & (0x80 >> j)) ? '1' : '0';
+			ctx->lut[i][2 * j + 1] = ctx->separator;
+		}
+	}
+
 	ctx->header = g_string_sized_new(512);
 
 	t = time(NULL);
@@ -159,6 +206,8 @@ static int event(struct sr_output *o, int event_type, uint8_t **data_out,
 		/* TODO */
 		*data_out = NULL;
 		*length_out = 0;
+		if (ctx->header)
+			g_string_free(ctx->header, TRUE);
 		g_free(o->internal);
 		o->internal = NULL;
 		break;
@@ -172,13 +221,45 @@ static int event(struct sr_output *o, int event_type, uint8_t **data_out,
 	return SR_OK;
 }
 
+/* Size of the output for 'num_samples' samples, including the header. */
+static uint64_t outsize(const struct context *ctx, uint64_t num_samples)
+{
+	uint64_t size;
+
+	/* A digit and a separator per probe, and a newline. */
+	size = num_samples * (2 * ctx->num_enabled_probes + 1);
+	if (ctx->header)
+		size += ctx->header->len;
+
+	return size;
+}
+
+/* Write the output for 'num_samples' samples to 'outbuf'. */
+static uint64_t encode(struct context *ctx, const uint8_t *data_in,
+		       uint64_t num_samples, uint8_t *outbuf)
+{
+	uint8_t *out;
+
+	out = outbuf;
+	if (ctx->header) {
+		/* First data packet. */
+		memcpy(out, ctx->header->str, ctx->header->len);
+		out += ctx->header->len;
+		g_string_free(ctx->header, TRUE);
+		ctx->header = NULL;
+	}
+
+	out += ctx->format_lines(ctx, data_in, num_samples, out);
+
+	return out - outbuf;
+}
+
 static int data(struct sr_output *o, const uint8_t *data_in,
 		uint64_t length_in, uint8_t **data_out, uint64_t *length_out)
 {
 	struct context *ctx;
-	GString *outstr;
-	uint64_t sample, i;
-	int j;
+	uint8_t *outbuf;
+	uint64_t num_samples;
 
 	if (!o) {
 		sr_err("%s: o was NULL", __func__);
@@ -195,29 +276,48 @@ static int data(struct sr_output *o, const uint8_t *data_in,
 		return SR_ERR_ARG;
 	}
 
-	if (ctx->header) {
-		/* First data packet. */
-		outstr = ctx->header;
-		ctx->header = NULL;
-	} else {
-		outstr = g_string_sized_new(512);
+	num_samples = ctx->unitsize ? length_in / ctx->unitsize : 0;
+	if (!(outbuf = g_try_malloc(outsize(ctx, num_samples) + 1))) {
+		sr_err("%s: outbuf malloc failed", __func__);
+		return SR_ERR_MALLOC;
 	}
 
-	for (i = 0; i <= length_in - ctx->unitsize; i += ctx->unitsize) {
-		memcpy(&sample, data_in + i, ctx->unitsize);
-		for (j = ctx->num_enabled_probes - 1; j >= 0; j--) {
-			g_string_append_printf(outstr, "%d%c",
-				(int)((sample & (1 << j)) >> j),
-				ctx->separator);
-		}
-		g_string_append_printf(outstr, "\n");
+	*length_out = encode(ctx, data_in, num_samples, outbuf);
+	outbuf[*length_out] = '\0';
+	*data_out = outbuf;
+
+	return SR_OK;
+}
+
+static int data_sink(struct sr_output *o, const uint8_t *data_in,
+		     uint64_t length_in, struct sr_output_sink *sink)
+{
+	struct context *ctx;
+	uint8_t *outbuf;
+	uint64_t num_samples;
+
+	if (!o) {
+		sr_err("%s: o was NULL", __func__);
+		return SR_ERR_ARG;
 	}
 
-	*data_out = (uint8_t *)outstr->str;
-	*length_out = outstr->len;
-	g_string_free(outstr, FALSE);
+	if (!(ctx = o->internal)) {
+		sr_err("%s: o->internal was NULL", __func__);
+		return SR_ERR_ARG;
+	}
 
-	return SR_OK;
+	if (!data_in) {
+		sr_err("%s: data_in was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	num_samples = ctx->unitsize ? length_in / ctx->unitsize : 0;
+	if (!(outbuf = sr_output_sink_reserve(sink,
+			outsize(ctx, num_samples))))
+		return SR_ERR_MALLOC;
+
+	return sr_output_sink_commit(sink,
+			encode(ctx, data_in, num_samples, outbuf));
 }
 
 SR_PRIV struct sr_output_format output_csv = {
@@ -227,4 +327,7 @@ SR_PRIV struct sr_output_format output_csv = {
 	.init = init,
 	.data = data,
 	.event = event,
+	.data_sink = data_sink,
+	/* Once the header is out, rows only depend on their own sample. */
+	.data_chunk = data_sink,
 };
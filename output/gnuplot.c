@@ -28,17 +28,19 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "output/gnuplot: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 struct context {
 	unsigned int num_enabled_probes;
 	unsigned int unitsize;
 	char *probelist[SR_MAX_NUM_PROBES + 1];
 	char *header;
+	uint64_t samplecount;
+	uint64_t old_sample;
+	/* Per byte of samples: its 8 probes as "b0 b1 ... b7 ", LSB first. */
+	char lut[256][16];
+	/* format_lines() for this unit size. */
+	uint64_t (*format_lines)(struct context *ctx, const uint8_t *data_in,
+				 uint64_t num_samples, char *out);
 };
 
 #define MAX_HEADER_LEN \
@@ -58,12 +60,66 @@ static const char *gnuplot_header = "\
 static const char *gnuplot_header_comment = "\
 # Comment: Acquisition with %d/%d probes at %s\n";
 
+/*
+ * Write a line for each sample which differs from the previous one, and
+ * for the packet's last sample. Returns the length written.
+ */
+SR_OUTPUT_KERNEL uint64_t format_lines(struct context *ctx,
+		const uint8_t *data_in, uint64_t num_samples, char *out,
+		unsigned int unitsize)
+{
+	const uint8_t *unit;
+	uint64_t sample, i;
+	unsigned int b, top;
+	char *start;
+
+	start = out;
+
+	/* Number of probes in the most significant, maybe partial, byte. */
+	top = ctx->num_enabled_probes - 8 * (unitsize - 1);
+
+	for (i = 0; i < num_samples; i++, ctx->samplecount++) {
+		unit = data_in + i * unitsize;
+		sample = sr_output_sample_get(unit, unitsize);
+
+		/*
+		 * Don't output the same samples multiple times. However, make
+		 * sure to output at least the first and last sample.
+		 */
+		if (ctx->samplecount != 0 && sample == ctx->old_sample) {
+			if (i != num_samples - 1)
+				continue;
+		}
+		ctx->old_sample = sample;
+
+		/* The first column is a counter (needed for gnuplot). */
+		out += sr_output_format_dec(out, ctx->samplecount);
+		*out++ = '\t';
+
+		/* The next columns are the values of all channels. */
+		for (b = 0; b < unitsize - 1; b++) {
+			memcpy(out, ctx->lut[unit[b]], 16);
+			out += 16;
+		}
+		memcpy(out, ctx->lut[unit[b]], 2 * top);
+		out += 2 * top;
+
+		*out++ = '\n';
+	}
+
+	return out - start;
+}
+
+SR_OUTPUT_KERNELS(format_lines, uint64_t, (struct context *ctx,
+		const uint8_t *data_in, uint64_t num_samples, char *out),
+		ctx, data_in, num_samples, out)
+
 static int init(struct sr_output *o)
 {
 	struct context *ctx;
 	struct sr_probe *probe;
 	GSList *l;
-	uint64_t *samplerate;
+	uint64_t *samplerate, tmp;
 	unsigned int i;
 	int b, num_probes;
 	char *c, *frequency_s;
@@ -98,16 +154,28 @@ static int init(struct sr_output *o)
 
 	o->internal = ctx;
 	ctx->num_enabled_probes = 0;
+	num_probes = 0;
 	for (l = o->sdi->probes; l; l = l->next) {
 		probe = l->data; /* TODO: Error checks. */
+		/* Analog probes aren't bits of the logic units. */
+		if (probe->type != SR_PROBE_LOGIC)
+			continue;
+		num_probes++;
 		if (!probe->enabled)
 			continue;
 		ctx->probelist[ctx->num_enabled_probes++] = probe->name;
 	}
 	ctx->probelist[ctx->num_enabled_probes] = 0;
 	ctx->unitsize = (ctx->num_enabled_probes + 7) / 8;
+	ctx->format_lines = format_lines_get(ctx->unitsize);
+
+	for (i = 0; i < 256; i++) {
+		for (b = 0; b < 8; b++) {
+			ctx->lut[i][2 * b] = '0' + ((i >> b) & 1);
+			ctx->lut[i][2 * b + 1] = ' ';
+		}
+	}
 
-	num_probes = g_slist_length(o->sdi->probes);
 	comment[0] = '\0';
 	if (sr_dev_has_hwcap(o->sdi, SR_HWCAP_SAMPLERATE)) {
 		o->sdi->driver->info_get(SR_DI_CUR_SAMPLERATE,
@@ -121,6 +189,9 @@ static int init(struct sr_output *o)
 		snprintf(comment, 127, gnuplot_header_comment,
 			ctx->num_enabled_probes, num_probes, frequency_s);
 		g_free(frequency_s);
+	} else {
+		tmp = 0;
+		samplerate = &tmp;
 	}
 
 	/* Columns / channels */
@@ -156,6 +227,8 @@ static int init(struct sr_output *o)
 static int event(struct sr_output *o, int event_type, uint8_t **data_out,
 		 uint64_t *length_out)
 {
+	struct context *ctx;
+
 	if (!o) {
 		sr_err("%s: o was NULL", __func__);
 		return SR_ERR_ARG;
@@ -176,6 +249,8 @@ static int event(struct sr_output *o, int event_type, uint8_t **data_out,
 		/* TODO: Can a trigger mark be in a gnuplot data file? */
 		break;
 	case SR_DF_END:
+		if ((ctx = o->internal))
+			g_free(ctx->header);
 		g_free(o->internal);
 		o->internal = NULL;
 		break;
@@ -194,10 +269,9 @@ static int data(struct sr_output *o, const uint8_t *data_in,
 		uint64_t length_in, uint8_t **data_out, uint64_t *length_out)
 {
 	struct context *ctx;
-	unsigned int max_linelen, outsize, p, curbit, i;
-	uint64_t sample;
-	static uint64_t samplecount = 0, old_sample = 0;
-	uint8_t *outbuf, *c;
+	uint64_t max_linelen, outsize, num_samples;
+	size_t len;
+	char *outbuf, *out;
 
 	if (!o) {
 		sr_err("%s: o was NULL", __func__);
@@ -225,55 +299,34 @@ static int data(struct sr_output *o, const uint8_t *data_in,
 	}
 
 	ctx = o->internal;
-	max_linelen = 16 + ctx->num_enabled_probes * 2;
-	outsize = length_in / ctx->unitsize * max_linelen;
+	num_samples = ctx->unitsize ? length_in / ctx->unitsize : 0;
+
+	/* A 20 digit counter, a tab, a digit and a space per probe, newline. */
+	max_linelen = 22 + ctx->num_enabled_probes * 2;
+	outsize = num_samples * max_linelen;
 	if (ctx->header)
 		outsize += strlen(ctx->header);
 
-	if (!(outbuf = g_try_malloc0(outsize))) {
+	if (!(outbuf = g_try_malloc(outsize + 1))) {
 		sr_err("%s: outbuf malloc failed", __func__);
 		return SR_ERR_MALLOC;
 	}
 
-	outbuf[0] = '\0';
+	out = outbuf;
 	if (ctx->header) {
 		/* The header is still here, this must be the first packet. */
-		strncpy((char *)outbuf, ctx->header, outsize);
+		len = strlen(ctx->header);
+		memcpy(out, ctx->header, len);
+		out += len;
 		g_free(ctx->header);
 		ctx->header = NULL;
 	}
 
-	for (i = 0; i <= length_in - ctx->unitsize; i += ctx->unitsize) {
-
-		memcpy(&sample, data_in + i, ctx->unitsize);
-
-		/*
-		 * Don't output the same samples multiple times. However, make
-		 * sure to output at least the first and last sample.
-		 */
-		if (samplecount++ != 0 && sample == old_sample) {
-			if (i != (length_in - ctx->unitsize))
-				continue;
-		}
-		old_sample = sample;
-
-		/* The first column is a counter (needed for gnuplot). */
-		c = outbuf + strlen((const char *)outbuf);
-		sprintf((char *)c, "%" PRIu64 "\t", samplecount++);
-
-		/* The next columns are the values of all channels. */
-		for (p = 0; p < ctx->num_enabled_probes; p++) {
-			curbit = (sample & ((uint64_t) (1 << p))) >> p;
-			c = outbuf + strlen((const char *)outbuf);
-			sprintf((char *)c, "%d ", curbit);
-		}
-
-		c = outbuf + strlen((const char *)outbuf);
-		sprintf((char *)c, "\n");
-	}
+	out += ctx->format_lines(ctx, data_in, num_samples, out);
+	*out = '\0';
 
-	*data_out = outbuf;
-	*length_out = strlen((const char *)outbuf);
+	*data_out = (uint8_t *)outbuf;
+	*length_out = out - outbuf;
 
 	return SR_OK;
 }
@@ -34,18 +34,67 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "output/ols: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
+
+/* Longest line: 8 hex digits, '@', a 20 digit sample number, newline. */
+#define MAX_LINE_LEN 30
+
+/* Number of runs of an SR_DF_LOGIC_RLE packet encoded at a time. */
+#define RLE_BATCH 1024
 
 struct context {
 	GString *header;
 	uint64_t num_samples;
 	unsigned int unitsize;
+	/* The last sample, and whether a line was written for it. */
+	uint64_t prev_sample;
+	gboolean prev_written;
+	/* format_lines() for this unit size. */
+	uint64_t (*format_lines)(struct context *ctx, const uint8_t *data_in,
+				 uint64_t num_samples, char *out);
 };
 
+/* Write the line for sample 'samplenum', which has value 'sample'. */
+static int format_line(char *buf, uint64_t sample, uint64_t samplenum)
+{
+	int len;
+
+	len = sr_output_format_hex(buf, (uint32_t)sample, 8);
+	buf[len++] = '@';
+	len += sr_output_format_dec(buf + len, samplenum);
+	buf[len++] = '\n';
+
+	return len;
+}
+
+/*
+ * Compressed: a line for each sample which differs from the previous one.
+ * Returns the length written.
+ */
+SR_OUTPUT_KERNEL uint64_t format_lines(struct context *ctx,
+		const uint8_t *data_in, uint64_t num_samples, char *out,
+		unsigned int unitsize)
+{
+	uint64_t sample, i;
+	char *start;
+
+	start = out;
+	for (i = 0; i < num_samples; i++, ctx->num_samples++) {
+		sample = sr_output_sample_get(data_in + i * unitsize, unitsize);
+		ctx->prev_written = !ctx->num_samples ||
+				    sample != ctx->prev_sample;
+		if (!ctx->prev_written)
+			continue;
+		ctx->prev_sample = sample;
+		out += format_line(out, sample, ctx->num_samples);
+	}
+
+	return out - start;
+}
+
+SR_OUTPUT_KERNELS(format_lines, uint64_t, (struct context *ctx,
+		const uint8_t *data_in, uint64_t num_samples, char *out),
+		ctx, data_in, num_samples, out)
+
 static int init(struct sr_output *o)
 {
 	struct context *ctx;
@@ -54,7 +103,7 @@ static int init(struct sr_output *o)
 	uint64_t *samplerate, tmp;
 	int num_enabled_probes;
 
-	if (!(ctx = g_try_malloc(sizeof(struct context)))) {
+	if (!(ctx = g_try_malloc0(sizeof(struct context)))) {
 		sr_err("%s: ctx malloc failed", __func__);
 		return SR_ERR_MALLOC;
 	}
@@ -64,10 +113,12 @@ static int init(struct sr_output *o)
 	num_enabled_probes = 0;
 	for (l = o->sdi->probes; l; l = l->next) {
 		probe = l->data;
-		if (probe->enabled)
+		/* Analog probes aren't bits of the logic units. */
+		if (probe->type == SR_PROBE_LOGIC && probe->enabled)
 			num_enabled_probes++;
 	}
 	ctx->unitsize = (num_enabled_probes + 7) / 8;
+	ctx->format_lines = format_lines_get(ctx->unitsize);
 
 	if (o->sdi->driver && sr_dev_has_hwcap(o->sdi, SR_HWCAP_SAMPLERATE))
 		o->sdi->driver->info_get(SR_DI_CUR_SAMPLERATE,
@@ -91,46 +142,129 @@ static int event(struct sr_output *o, int event_type, uint8_t **data_out,
 		 uint64_t *length_out)
 {
 	struct context *ctx;
+	uint8_t *outbuf;
 
 	ctx = o->internal;
 
+	*data_out = NULL;
+	*length_out = 0;
+
 	if (ctx && event_type == SR_DF_END) {
-		g_string_free(ctx->header, TRUE);
+		/*
+		 * The last sample needs a line even if it didn't change, or
+		 * the capture would appear to be shorter than it was.
+		 */
+		if (ctx->num_samples && !ctx->prev_written) {
+			if (!(outbuf = g_try_malloc(MAX_LINE_LEN + 1))) {
+				sr_err("%s: outbuf malloc failed", __func__);
+				return SR_ERR_MALLOC;
+			}
+			*length_out = format_line((char *)outbuf,
+					ctx->prev_sample, ctx->num_samples - 1);
+			outbuf[*length_out] = '\0';
+			*data_out = outbuf;
+		}
+		if (ctx->header)
+			g_string_free(ctx->header, TRUE);
 		g_free(o->internal);
 		o->internal = NULL;
 	}
 
-	*data_out = NULL;
-	*length_out = 0;
-
 	return SR_OK;
 }
 
 static int data(struct sr_output *o, const uint8_t *data_in,
 		uint64_t length_in, uint8_t **data_out, uint64_t *length_out)
 {
-	GString *out;
 	struct context *ctx;
-	uint64_t sample;
-	unsigned int i;
+	uint8_t *outbuf;
+	char *out;
+	uint64_t num_samples, size;
+
+	ctx = o->internal;
+	num_samples = ctx->unitsize ? length_in / ctx->unitsize : 0;
+
+	size = num_samples * MAX_LINE_LEN;
+	if (ctx->header)
+		size += ctx->header->len;
+	if (!(outbuf = g_try_malloc(size + 1))) {
+		sr_err("%s: outbuf malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	out = (char *)outbuf;
+	if (ctx->header) {
+		/* first data packet */
+		memcpy(out, ctx->header->str, ctx->header->len);
+		out += ctx->header->len;
+		g_string_free(ctx->header, TRUE);
+		ctx->header = NULL;
+	}
+
+	out += ctx->format_lines(ctx, data_in, num_samples, out);
+	*out = '\0';
+
+	*data_out = outbuf;
+	*length_out = out - (char *)outbuf;
+
+	return SR_OK;
+}
+
+/* Like data(), but one line per run at most: only its first sample. */
+static int data_rle(struct sr_output *o,
+		    const struct sr_datafeed_logic_rle *rle,
+		    struct sr_output_sink *sink)
+{
+	struct context *ctx;
+	const struct sr_logic_run *run;
+	uint64_t i, j, n, sample, mask;
+	uint8_t *out;
+	int len, ret;
 
 	ctx = o->internal;
+
 	if (ctx->header) {
 		/* first data packet */
-		out = ctx->header;
+		ret = sr_output_sink_write(sink, ctx->header->str,
+					   ctx->header->len);
+		g_string_free(ctx->header, TRUE);
 		ctx->header = NULL;
-	} else
-		out = g_string_sized_new(512);
-
-	for (i = 0; i <= length_in - ctx->unitsize; i += ctx->unitsize) {
-		sample = 0;
-		memcpy(&sample, data_in + i, ctx->unitsize);
-		g_string_append_printf(out, "%08x@%"PRIu64"\n",
-				(uint32_t) sample, ctx->num_samples++);
+		if (ret != SR_OK)
+			return ret;
+	}
+
+	if (ctx->unitsize == 0)
+		return SR_OK;
+
+	mask = ~UINT64_C(0);
+	if (MIN(ctx->unitsize, rle->unitsize) < 8)
+		mask = (UINT64_C(1) << (8 * MIN(ctx->unitsize,
+						rle->unitsize))) - 1;
+
+	for (i = 0; i < rle->num_runs; i += n) {
+		n = MIN(rle->num_runs - i, RLE_BATCH);
+		if (!(out = sr_output_sink_reserve(sink, n * MAX_LINE_LEN)))
+			return SR_ERR_MALLOC;
+		len = 0;
+		for (j = i; j < i + n; j++) {
+			run = &rle->runs[j];
+			if (run->length == 0)
+				continue;
+			sample = run->value & mask;
+			if (!ctx->num_samples || sample != ctx->prev_sample) {
+				ctx->prev_sample = sample;
+				len += format_line((char *)out + len, sample,
+						   ctx->num_samples);
+				/* Only the run's first sample has a line. */
+				ctx->prev_written = run->length == 1;
+			} else {
+				ctx->prev_written = FALSE;
+			}
+			ctx->num_samples += run->length;
+		}
+		if ((ret = sr_output_sink_commit(sink, len)) != SR_OK)
+			return ret;
 	}
-	*data_out = (uint8_t *)out->str;
-	*length_out = out->len;
-	g_string_free(out, FALSE);
 
 	return SR_OK;
 }
@@ -142,4 +276,5 @@ SR_PRIV struct sr_output_format output_ols = {
 	.init = init,
 	.data = data,
 	.event = event,
+	.data_rle = data_rle,
 };
@@ -17,9 +17,14 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <glib.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "output: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
 /**
  * @file
  *
@@ -45,9 +50,15 @@ extern SR_PRIV struct sr_output_format output_gnuplot;
 extern SR_PRIV struct sr_output_format output_chronovu_la8;
 extern SR_PRIV struct sr_output_format output_csv;
 extern SR_PRIV struct sr_output_format output_analog;
+extern SR_PRIV struct sr_output_format output_bitplane;
 /* extern SR_PRIV struct sr_output_format output_analog_gnuplot; */
 /* @endcond */
 
+/** @cond PRIVATE */
+/* Size of the pieces RLE packets are expanded in for data(). */
+#define RLE_CHUNK_SIZE (256 * 1024)
+/** @endcond */
+
 static struct sr_output_format *output_module_list[] = {
 	&output_text_bits,
 	&output_text_hex,
@@ -59,6 +70,7 @@ static struct sr_output_format *output_module_list[] = {
 	&output_chronovu_la8,
 	&output_csv,
 	&output_analog,
+	&output_bitplane,
 	/* &output_analog_gnuplot, */
 	NULL,
 };
@@ -68,4 +80,260 @@ SR_API struct sr_output_format **sr_output_list(void)
 	return output_module_list;
 }
 
+/**
+ * Run a packet's data through an output module, writing the output to a
+ * sink.
+ *
+ * Modules with a data_sink() callback write to the sink directly. For all
+ * others, the output returned by their data() callback is written to it.
+ *
+ * @param o The output instance. Must not be NULL.
+ * @param data_in The packet's data.
+ * @param length_in The size of the packet's data in bytes.
+ * @param sink The sink. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or the
+ *         module's or sink's error code.
+ */
+SR_API int sr_output_data(struct sr_output *o, const uint8_t *data_in,
+		uint64_t length_in, struct sr_output_sink *sink)
+{
+	uint8_t *data_out;
+	uint64_t length_out;
+	int ret;
+
+	if (!o || !o->format || !sink) {
+		sr_err("%s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (o->format->data_sink) {
+		SR_TRACE2(output_data_entry, o, length_in);
+		ret = o->format->data_sink(o, data_in, length_in, sink);
+		SR_TRACE1(output_data_return, ret);
+		return ret;
+	}
+
+	if (!o->format->data) {
+		sr_err("%s: output format has no data callback", __func__);
+		return SR_ERR_ARG;
+	}
+
+	data_out = NULL;
+	length_out = 0;
+	SR_TRACE2(output_data_entry, o, length_in);
+	ret = o->format->data(o, data_in, length_in, &data_out, &length_out);
+	SR_TRACE1(output_data_return, ret);
+	if (ret == SR_OK && data_out)
+		ret = sr_output_sink_write(sink, data_out, length_out);
+	g_free(data_out);
+
+	return ret;
+}
+
+/**
+ * Run a run-length encoded logic packet through an output module, writing
+ * the output to a sink.
+ *
+ * Modules with a data_rle() callback take the runs as they are. For all
+ * others, the runs are expanded piece by piece and passed to
+ * sr_output_data(). The expanded samples only live until the next piece,
+ * so the module's output can't refer to them: it goes through a buffer
+ * sink and is copied.
+ *
+ * @param o The output instance. Must not be NULL.
+ * @param rle The packet's payload. Must not be NULL.
+ * @param sink The sink. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or the module's or
+ *         sink's error code.
+ */
+SR_API int sr_output_data_rle(struct sr_output *o,
+		const struct sr_datafeed_logic_rle *rle,
+		struct sr_output_sink *sink)
+{
+	struct sr_output_sink *piece;
+	const uint8_t *data;
+	uint64_t run, offset, length;
+	uint8_t *buf;
+	int ret;
+
+	if (!o || !o->format || !rle || !sink) {
+		sr_err("%s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (o->format->data_rle)
+		return o->format->data_rle(o, rle, sink);
+
+	if (!(buf = g_try_malloc(RLE_CHUNK_SIZE))) {
+		sr_err("%s: buf malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	if (!(piece = sr_output_sink_buffer_new())) {
+		g_free(buf);
+		return SR_ERR_MALLOC;
+	}
+
+	run = offset = 0;
+	while ((ret = sr_logic_rle_expand(rle, &run, &offset, buf,
+			RLE_CHUNK_SIZE, &length)) == SR_OK && length > 0) {
+		sr_output_sink_reset(piece);
+		if ((ret = sr_output_data(o, buf, length, piece)) != SR_OK)
+			break;
+		sr_output_sink_data_get(piece, &data, &length);
+		if ((ret = sr_output_sink_write(sink, data, length)) != SR_OK)
+			break;
+	}
+	sr_output_sink_destroy(piece);
+	g_free(buf);
+
+	return ret;
+}
+
+/**
+ * Pass an event to an output module, writing its output to a sink.
+ *
+ * Modules with an event_sink() callback write to the sink directly. For
+ * all others, the output returned by their event() callback is written
+ * to it. Modules without either callback ignore events.
+ *
+ * @param o The output instance. Must not be NULL.
+ * @param event_type The event, i.e. the packet type (SR_DF_TRIGGER,
+ *                   SR_DF_END, ...).
+ * @param sink The sink. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or the
+ *         module's or sink's error code.
+ */
+SR_API int sr_output_event(struct sr_output *o, int event_type,
+		struct sr_output_sink *sink)
+{
+	uint8_t *data_out;
+	uint64_t length_out;
+	int ret;
+
+	if (!o || !o->format || !sink) {
+		sr_err("%s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (o->format->event_sink)
+		return o->format->event_sink(o, event_type, sink);
+
+	if (!o->format->event)
+		return SR_OK;
+
+	data_out = NULL;
+	length_out = 0;
+	ret = o->format->event(o, event_type, &data_out, &length_out);
+	if (ret == SR_OK && data_out)
+		ret = sr_output_sink_write(sink, data_out, length_out);
+	g_free(data_out);
+
+	return ret;
+}
+
+/**
+ * Pass a whole packet to an output module, writing its output to a sink.
+ *
+ * This is for modules which take all packets rather than logic data only,
+ * i.e. those with a recv() or recv_sink() callback. Modules with a
+ * recv_sink() callback write to the sink directly. For the others, the
+ * output returned by recv() is written to it; that string belongs to the
+ * module.
+ *
+ * @param o The output instance. Must not be NULL.
+ * @param packet The packet. Must not be NULL.
+ * @param sink The sink. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or the
+ *         module's or sink's error code.
+ */
+SR_API int sr_output_recv(struct sr_output *o,
+		const struct sr_datafeed_packet *packet,
+		struct sr_output_sink *sink)
+{
+	GString *out;
+
+	if (!o || !o->format || !packet || !sink) {
+		sr_err("%s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (o->format->recv_sink)
+		return o->format->recv_sink(o, packet, sink);
+
+	if (!o->format->recv) {
+		sr_err("%s: output format has no recv callback", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(out = o->format->recv(o, o->sdi,
+			(struct sr_datafeed_packet *)packet)))
+		return SR_OK;
+
+	return sr_output_sink_write(sink, out->str, out->len);
+}
+
+/**
+ * Write a number in decimal, without a terminating NUL.
+ *
+ * This is what output modules printing a number per sample use, rather
+ * than the much slower printf() family.
+ *
+ * @param buf The buffer to write to, with room for 20 characters.
+ * @param value The number.
+ *
+ * @return The number of characters written.
+ *
+ * @private
+ */
+SR_PRIV int sr_output_format_dec(char *buf, uint64_t value)
+{
+	char digits[20];
+	int n, i;
+
+	n = 0;
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	for (i = 0; i < n; i++)
+		buf[i] = digits[n - 1 - i];
+
+	return n;
+}
+
+/**
+ * Write a number in lowercase hexadecimal, without a terminating NUL.
+ *
+ * @param buf The buffer to write to, with room for 16 characters, or
+ *            'width' if that is more.
+ * @param value The number.
+ * @param width The minimum number of digits. The number is padded with
+ *              leading zeroes to this width, as with printf("%0*x").
+ *
+ * @return The number of characters written.
+ *
+ * @private
+ */
+SR_PRIV int sr_output_format_hex(char *buf, uint64_t value, int width)
+{
+	static const char hex[] = "0123456789abcdef";
+	int n, i;
+
+	for (n = 1; n < 16 && value >> (4 * n); n++)
+		;
+	n = MAX(n, width);
+
+	for (i = n - 1; i >= 0; i--, value >>= 4)
+		buf[i] = hex[value & 0xf];
+
+	return n;
+}
+
 /** @} */
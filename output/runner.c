@@ -0,0 +1,529 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "output/runner: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/**
+ * @file
+ *
+ * Running output modules on worker threads.
+ */
+
+/**
+ * @defgroup grp_output_runner Output runners
+ *
+ * Running output modules on worker threads.
+ *
+ * Output modules normally run in the datafeed callback, i.e. on the thread
+ * which also services the device. A slow encoder then holds up the
+ * acquisition. An output runner instead queues the packets it is given
+ * (without copying sample data which lives in a reference-counted buffer)
+ * and encodes them on a pool of worker threads. The output is written to a
+ * sink (see grp_output_sink) in packet order.
+ *
+ * Most modules keep state from one packet to the next, so their packets
+ * are encoded one at a time, in order. That still moves the encoding off
+ * the acquisition thread, and overlaps it with writing out the output.
+ * Modules with a data_chunk() callback produce output for every sample on
+ * its own; their packets are cut into pieces which are encoded on all
+ * worker threads at once. Likewise, the packets of modules with a
+ * recv_sink() callback are encoded on all worker threads at once.
+ *
+ * Several runners can work on the same capture, e.g. to export it in more
+ * than one format at the same time.
+ *
+ * @{
+ */
+
+/** @cond PRIVATE */
+/* Size of the pieces a packet is cut into for data_chunk(), in bytes. */
+#define RUNNER_CHUNK_SIZE (256 * 1024)
+
+/* Packet data queued before sr_output_runner_send() blocks, in bytes. */
+#define RUNNER_QUEUE_MAX (64 * 1024 * 1024)
+/** @endcond */
+
+enum {
+	JOB_DATA,
+	JOB_CHUNK,
+	JOB_RLE,
+	JOB_EVENT,
+	JOB_RECV,
+	JOB_PACKET,
+};
+
+enum {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+};
+
+/* A queued packet, shared by all jobs encoding a piece of it. */
+struct runner_packet {
+	volatile gint refcount;
+	struct sr_datafeed_packet *packet;
+};
+
+struct sr_output_job {
+	struct sr_output_job *next;
+	int type;
+	int state;
+	/* The queued packet, or NULL for events. */
+	struct runner_packet *packet;
+	/* The (piece of the) packet's logic data to encode. */
+	const uint8_t *data;
+	uint64_t length;
+	int event_type;
+	/* Bytes of packet data accounted to this job. */
+	uint64_t size;
+	struct sr_output_sink *out;
+};
+
+static void runner_packet_unref(struct runner_packet *rp)
+{
+	if (!g_atomic_int_dec_and_test(&rp->refcount))
+		return;
+
+	sr_packet_free(rp->packet);
+	g_free(rp);
+}
+
+static void job_free(struct sr_output_job *job)
+{
+	if (job->packet)
+		runner_packet_unref(job->packet);
+	sr_output_sink_destroy(job->out);
+	g_free(job);
+}
+
+static struct sr_output_job *job_new(int type, struct runner_packet *rp)
+{
+	struct sr_output_job *job;
+
+	if (!(job = g_try_malloc0(sizeof(struct sr_output_job)))) {
+		sr_err("%s: job malloc failed", __func__);
+		return NULL;
+	}
+
+	if (!(job->out = sr_output_sink_iovec_new())) {
+		g_free(job);
+		return NULL;
+	}
+
+	job->type = type;
+	job->state = JOB_QUEUED;
+	if ((job->packet = rp))
+		g_atomic_int_inc(&rp->refcount);
+
+	return job;
+}
+
+/* Whether a job can run alongside other jobs, see job_next(). */
+static gboolean job_stateless(const struct sr_output_job *job)
+{
+	return job->type == JOB_CHUNK || job->type == JOB_PACKET;
+}
+
+/*
+ * Get the next job which can be started, or NULL. Jobs of stateful
+ * modules wait for all earlier jobs to finish. The jobs of data_chunk()
+ * pieces and of recv_sink() packets only wait for earlier stateful jobs.
+ */
+static struct sr_output_job *job_next(struct sr_output_runner *runner)
+{
+	struct sr_output_job *job;
+	gboolean unfinished;
+
+	unfinished = FALSE;
+	for (job = runner->jobs_head; job; job = job->next) {
+		if (job->state == JOB_QUEUED) {
+			if (!job_stateless(job) && unfinished)
+				return NULL;
+			return job;
+		}
+		if (job->state == JOB_RUNNING) {
+			if (!job_stateless(job))
+				return NULL;
+			unfinished = TRUE;
+		}
+	}
+
+	return NULL;
+}
+
+static int job_run(struct sr_output_runner *runner, struct sr_output_job *job)
+{
+	struct sr_output *o;
+
+	o = runner->output;
+	switch (job->type) {
+	case JOB_CHUNK:
+		return o->format->data_chunk(o, job->data, job->length,
+					     job->out);
+	case JOB_DATA:
+		return sr_output_data(o, job->data, job->length, job->out);
+	case JOB_RLE:
+		return sr_output_data_rle(o, job->packet->packet->payload,
+					  job->out);
+	case JOB_RECV:
+	case JOB_PACKET:
+		return sr_output_recv(o, job->packet->packet, job->out);
+	default:
+		return sr_output_event(o, job->event_type, job->out);
+	}
+}
+
+/*
+ * Write out the output of the finished jobs at the head of the queue, in
+ * order, and drop them. Called with the mutex held. The mutex is released
+ * while writing, but only one thread writes at a time.
+ */
+static void jobs_write(struct sr_output_runner *runner)
+{
+	struct sr_output_job *job;
+	const struct sr_output_iov *iov;
+	gboolean failed;
+	int iovcnt, ret;
+
+	while (!runner->writing && (job = runner->jobs_head)
+			&& job->state == JOB_DONE) {
+		runner->writing = TRUE;
+		failed = runner->ret != SR_OK;
+		g_mutex_unlock(&runner->mutex);
+
+		/* Nothing more is written once something has failed. */
+		ret = SR_OK;
+		if (!failed && (ret = sr_output_sink_iovec_get(job->out,
+				&iov, &iovcnt)) == SR_OK)
+			ret = sr_output_sink_writev(runner->sink, iov, iovcnt);
+
+		g_mutex_lock(&runner->mutex);
+		if (ret != SR_OK && runner->ret == SR_OK)
+			runner->ret = ret;
+		if (!(runner->jobs_head = job->next))
+			runner->jobs_tail = NULL;
+		runner->queued -= job->size;
+		runner->writing = FALSE;
+		job_free(job);
+	}
+}
+
+static gpointer runner_thread(gpointer data)
+{
+	struct sr_output_runner *runner;
+	struct sr_output_job *job;
+	int ret;
+
+	runner = data;
+	g_mutex_lock(&runner->mutex);
+	while (TRUE) {
+		while (!runner->quit && !(job = job_next(runner)))
+			g_cond_wait(&runner->cond, &runner->mutex);
+		if (runner->quit)
+			break;
+
+		job->state = JOB_RUNNING;
+		g_mutex_unlock(&runner->mutex);
+		ret = job_run(runner, job);
+		g_mutex_lock(&runner->mutex);
+
+		job->state = JOB_DONE;
+		if (ret != SR_OK && runner->ret == SR_OK) {
+			sr_err("%s: encoding failed: %d", __func__, ret);
+			runner->ret = ret;
+		}
+		jobs_write(runner);
+		g_cond_broadcast(&runner->cond);
+	}
+	g_mutex_unlock(&runner->mutex);
+
+	return NULL;
+}
+
+/**
+ * Create a new output runner.
+ *
+ * @param o The output instance, initialized by its module's init(). Must
+ *          not be NULL. The runner calls its module from the worker
+ *          threads only, so it must not be used directly until the runner
+ *          is destroyed.
+ * @param sink The sink to write the output to. Must not be NULL. It is
+ *             written from the worker threads.
+ * @param num_threads The number of worker threads, or 0 for one per CPU.
+ *
+ * @return A pointer to the new runner, or NULL upon errors.
+ */
+SR_API struct sr_output_runner *sr_output_runner_new(struct sr_output *o,
+		struct sr_output_sink *sink, int num_threads)
+{
+	struct sr_output_runner *runner;
+	int i;
+
+	if (!o || !o->format || !sink) {
+		sr_err("%s: invalid arguments", __func__);
+		return NULL;
+	}
+
+	if (num_threads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		num_threads = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+#else
+		num_threads = 1;
+#endif
+	}
+
+	if (!(runner = g_try_malloc0(sizeof(struct sr_output_runner)))) {
+		sr_err("%s: runner malloc failed", __func__);
+		return NULL;
+	}
+
+	if (!(runner->threads = g_try_malloc0(sizeof(GThread *)
+			* num_threads))) {
+		sr_err("%s: threads malloc failed", __func__);
+		g_free(runner);
+		return NULL;
+	}
+
+	runner->output = o;
+	runner->sink = sink;
+	runner->ret = SR_OK;
+	g_mutex_init(&runner->mutex);
+	g_cond_init(&runner->cond);
+
+	for (i = 0; i < num_threads; i++) {
+		if (!(runner->threads[i] = g_thread_try_new("sr-output",
+				runner_thread, runner, NULL))) {
+			sr_err("%s: failed to start worker thread", __func__);
+			sr_output_runner_destroy(runner);
+			return NULL;
+		}
+		runner->num_threads++;
+	}
+
+	return runner;
+}
+
+/* Queue a job, with the mutex held. */
+static void job_queue(struct sr_output_runner *runner,
+		      struct sr_output_job *job)
+{
+	if (runner->jobs_tail)
+		runner->jobs_tail->next = job;
+	else
+		runner->jobs_head = job;
+	runner->jobs_tail = job;
+	runner->queued += job->size;
+}
+
+/* Queue the jobs for a logic packet, with the mutex held. */
+static int logic_queue(struct sr_output_runner *runner,
+		       struct runner_packet *rp)
+{
+	const struct sr_datafeed_logic *logic;
+	struct sr_output_job *job;
+	uint64_t offset, piece;
+	gboolean chunks;
+
+	logic = rp->packet->payload;
+	chunks = runner->output->format->data_chunk && runner->data_seen
+			&& logic->unitsize > 0;
+	if (logic->length > 0)
+		runner->data_seen = TRUE;
+
+	/* The first packet, or a stateful module: a single job. */
+	piece = logic->length;
+	if (chunks)
+		piece = MAX(RUNNER_CHUNK_SIZE / logic->unitsize, 1)
+				* logic->unitsize;
+
+	for (offset = 0; offset < logic->length; offset += piece) {
+		if (!(job = job_new(chunks ? JOB_CHUNK : JOB_DATA, rp)))
+			return SR_ERR_MALLOC;
+		job->data = (const uint8_t *)logic->data + offset;
+		job->length = MIN(piece, logic->length - offset);
+		job->size = job->length;
+		job_queue(runner, job);
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Queue a datafeed packet for encoding.
+ *
+ * This is meant to be called from a datafeed callback. Logic and
+ * run-length encoded logic data, triggers and the end of the datafeed are
+ * passed to the module; modules with a recv() or recv_sink() callback get
+ * all packets.
+ *
+ * If a lot of packet data is queued already, this blocks until the workers
+ * have caught up.
+ *
+ * @param runner The runner. Must not be NULL.
+ * @param packet The packet. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or the error code
+ *         of an earlier failure to encode or write output.
+ */
+SR_API int sr_output_runner_send(struct sr_output_runner *runner,
+		const struct sr_datafeed_packet *packet)
+{
+	struct sr_output_format *format;
+	struct runner_packet *rp;
+	struct sr_output_job *job;
+	int type, ret;
+
+	if (!runner || !packet) {
+		sr_err("%s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	format = runner->output->format;
+	if (format->recv_sink)
+		type = JOB_PACKET;
+	else if (format->recv)
+		type = JOB_RECV;
+	else if (packet->type == SR_DF_LOGIC)
+		type = JOB_DATA;
+	else if (packet->type == SR_DF_LOGIC_RLE)
+		type = JOB_RLE;
+	else if (packet->type == SR_DF_TRIGGER || packet->type == SR_DF_END)
+		type = JOB_EVENT;
+	else
+		return SR_OK;
+
+	rp = NULL;
+	if (type != JOB_EVENT) {
+		if (!(rp = g_try_malloc(sizeof(struct runner_packet)))) {
+			sr_err("%s: packet malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		if (!(rp->packet = sr_packet_copy(packet))) {
+			g_free(rp);
+			return SR_ERR_MALLOC;
+		}
+		/* The reference held here, dropped once all jobs are queued. */
+		rp->refcount = 1;
+	}
+
+	g_mutex_lock(&runner->mutex);
+	while (runner->ret == SR_OK && runner->jobs_head
+			&& runner->queued >= RUNNER_QUEUE_MAX)
+		g_cond_wait(&runner->cond, &runner->mutex);
+
+	if ((ret = runner->ret) != SR_OK) {
+		/* Nothing more is written anyway. */
+	} else if (type == JOB_DATA) {
+		ret = logic_queue(runner, rp);
+	} else if (!(job = job_new(type, rp))) {
+		ret = SR_ERR_MALLOC;
+	} else {
+		job->event_type = packet->type;
+		if (type == JOB_RLE)
+			job->size = ((const struct sr_datafeed_logic_rle *)
+				packet->payload)->num_runs
+				* sizeof(struct sr_logic_run);
+		else if (packet->type == SR_DF_ANALOG)
+			job->size = ((const struct sr_datafeed_analog *)
+				packet->payload)->num_samples * sizeof(float);
+		job_queue(runner, job);
+	}
+	g_cond_broadcast(&runner->cond);
+	g_mutex_unlock(&runner->mutex);
+
+	if (rp)
+		runner_packet_unref(rp);
+
+	return ret;
+}
+
+/**
+ * Wait until all queued packets have been encoded and written out.
+ *
+ * @param runner The runner. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or the
+ *         error code of the first failure to encode or write output.
+ */
+SR_API int sr_output_runner_wait(struct sr_output_runner *runner)
+{
+	int ret;
+
+	if (!runner) {
+		sr_err("%s: runner was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	g_mutex_lock(&runner->mutex);
+	while (runner->jobs_head)
+		g_cond_wait(&runner->cond, &runner->mutex);
+	ret = runner->ret;
+	g_mutex_unlock(&runner->mutex);
+
+	return ret;
+}
+
+/**
+ * Destroy an output runner.
+ *
+ * Packets which have not been encoded yet are dropped; call
+ * sr_output_runner_wait() first to have them written out. The output
+ * instance and the sink are not freed.
+ *
+ * @param runner The runner. Can be NULL, in which case nothing happens.
+ *
+ * @return SR_OK upon success.
+ */
+SR_API int sr_output_runner_destroy(struct sr_output_runner *runner)
+{
+	struct sr_output_job *job;
+	int i;
+
+	if (!runner)
+		return SR_OK;
+
+	g_mutex_lock(&runner->mutex);
+	runner->quit = TRUE;
+	g_cond_broadcast(&runner->cond);
+	g_mutex_unlock(&runner->mutex);
+
+	for (i = 0; i < runner->num_threads; i++)
+		g_thread_join(runner->threads[i]);
+
+	while ((job = runner->jobs_head)) {
+		runner->jobs_head = job->next;
+		job_free(job);
+	}
+
+	g_cond_clear(&runner->cond);
+	g_mutex_clear(&runner->mutex);
+	g_free(runner->threads);
+	g_free(runner);
+
+	return SR_OK;
+}
+
+/** @} */
@@ -0,0 +1,842 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "output/sink: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/**
+ * @file
+ *
+ * Destinations for the output of output modules.
+ */
+
+/**
+ * @defgroup grp_output_sink Output sinks
+ *
+ * Destinations for the output of output modules.
+ *
+ * The data() and event() callbacks of an output module return their
+ * output in a newly allocated buffer, which the caller writes out and
+ * frees again: one allocation and one copy of the output per packet.
+ *
+ * With sr_output_data() and sr_output_event(), the output goes to a sink
+ * instead. Modules with sink support write their output into it directly,
+ * or hand it pieces of the packet data (without copying them) where the
+ * output is the data itself. The output of other modules is written to
+ * the sink once they have returned it.
+ *
+ * There are three kinds of sinks:
+ * - A buffer sink collects the output in a growable buffer, which is
+ *   reused across packets (see sr_output_sink_reset()).
+ * - A file descriptor sink writes the output to a file descriptor as it is
+ *   produced, with writev() where possible.
+ * - An iovec sink collects the output as a list of pieces of memory, for
+ *   the caller to write out or send with a single call. Pieces may point
+ *   into the packet data, so the list is only valid until the packet has
+ *   been delivered.
+ * - A compressing sink compresses the output on the fly (gzip or
+ *   Zstandard), and writes the result to another sink, e.g. one for a
+ *   file. sr_output_sink_finish() ends the compressed stream.
+ *
+ * @{
+ */
+
+/** @cond PRIVATE */
+/* Initial size of a sink's buffer. */
+#define SINK_BUF_MIN 4096
+
+/* Number of pieces passed to one writev() call. */
+#define SINK_IOV_BATCH 64
+
+/* Size of the buffer collecting compressed output for the next sink. */
+#define SINK_CODEC_BUF_SIZE (256 * 1024)
+
+/* Most input zlib takes in one go (its lengths are unsigned ints). */
+#define SINK_ZLIB_IN_MAX (1024 * 1024 * 1024)
+
+/* State of a compressing sink. */
+struct sink_codec {
+	int method;
+#ifdef HAVE_ZLIB
+	z_stream zs;
+#endif
+#ifdef HAVE_LIBZSTD
+	ZSTD_CCtx *zc;
+#endif
+	/* Compressed output not yet written to the next sink. */
+	uint8_t *out;
+	uint64_t out_len;
+	/* Set by sr_output_sink_finish(). */
+	gboolean finished;
+};
+/** @endcond */
+
+static struct sr_output_sink *sink_new(int type, int fd)
+{
+	struct sr_output_sink *sink;
+
+	if (!(sink = g_try_malloc0(sizeof(struct sr_output_sink)))) {
+		sr_err("%s: sink malloc failed", __func__);
+		return NULL;
+	}
+
+	sink->type = type;
+	sink->fd = fd;
+
+	return sink;
+}
+
+/**
+ * Create a new sink which collects the output in a buffer.
+ *
+ * Get the output with sr_output_sink_data_get(), and empty the buffer for
+ * the next packet with sr_output_sink_reset().
+ *
+ * @return A pointer to the new sink, or NULL upon errors.
+ */
+SR_API struct sr_output_sink *sr_output_sink_buffer_new(void)
+{
+	return sink_new(SR_OUTPUT_SINK_BUFFER, -1);
+}
+
+/**
+ * Create a new sink which writes the output to a file descriptor.
+ *
+ * @param fd The file descriptor. It must be in blocking mode, and is not
+ *           closed by sr_output_sink_destroy().
+ *
+ * @return A pointer to the new sink, or NULL upon errors.
+ */
+SR_API struct sr_output_sink *sr_output_sink_fd_new(int fd)
+{
+	if (fd < 0) {
+		sr_err("%s: invalid file descriptor %d", __func__, fd);
+		return NULL;
+	}
+
+	return sink_new(SR_OUTPUT_SINK_FD, fd);
+}
+
+/**
+ * Create a new sink which collects the output as a list of pieces.
+ *
+ * Get the list with sr_output_sink_iovec_get(), and empty it for the next
+ * packet with sr_output_sink_reset().
+ *
+ * @return A pointer to the new sink, or NULL upon errors.
+ */
+SR_API struct sr_output_sink *sr_output_sink_iovec_new(void)
+{
+	return sink_new(SR_OUTPUT_SINK_IOVEC, -1);
+}
+
+static void codec_free(struct sink_codec *c)
+{
+	if (!c)
+		return;
+
+#ifdef HAVE_ZLIB
+	if (c->method == SR_COMPRESS_GZIP)
+		deflateEnd(&c->zs);
+#endif
+#ifdef HAVE_LIBZSTD
+	if (c->method == SR_COMPRESS_ZSTD)
+		ZSTD_freeCCtx(c->zc);
+#endif
+	g_free(c->out);
+	g_free(c);
+}
+
+static int codec_init(struct sink_codec *c, int level, int num_threads)
+{
+	(void)level;
+	(void)num_threads;
+
+	switch (c->method) {
+#ifdef HAVE_ZLIB
+	case SR_COMPRESS_GZIP:
+		if (level < 0 || level > 9) {
+			sr_err("%s: invalid gzip level %d", __func__, level);
+			return SR_ERR_ARG;
+		}
+		/* A window of 2^15 bytes, plus 16 for a gzip wrapper. */
+		if (deflateInit2(&c->zs, level ? level : Z_DEFAULT_COMPRESSION,
+				 Z_DEFLATED, 15 + 16, 8,
+				 Z_DEFAULT_STRATEGY) != Z_OK) {
+			sr_err("%s: deflateInit2 failed", __func__);
+			return SR_ERR;
+		}
+		return SR_OK;
+#endif
+#ifdef HAVE_LIBZSTD
+	case SR_COMPRESS_ZSTD:
+		if (!(c->zc = ZSTD_createCCtx())) {
+			sr_err("%s: ZSTD_createCCtx failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		if (ZSTD_isError(ZSTD_CCtx_setParameter(c->zc,
+				ZSTD_c_compressionLevel,
+				level ? level : ZSTD_CLEVEL_DEFAULT))) {
+			sr_err("%s: invalid zstd level %d", __func__, level);
+			ZSTD_freeCCtx(c->zc);
+			return SR_ERR_ARG;
+		}
+		if (num_threads > 1 && ZSTD_isError(ZSTD_CCtx_setParameter(
+				c->zc, ZSTD_c_nbWorkers, num_threads)))
+			sr_warn("%s: libzstd has no thread support, "
+				"compressing on one thread", __func__);
+		return SR_OK;
+#endif
+	default:
+		sr_err("%s: compression method %d is not supported",
+		       __func__, c->method);
+		return SR_ERR_ARG;
+	}
+}
+
+/**
+ * Create a new sink which compresses the output.
+ *
+ * The compressed output is written to 'next' as it is produced, e.g. to a
+ * file descriptor sink for a .vcd.gz file. Once the last output has been
+ * written, sr_output_sink_finish() must be called to end the compressed
+ * stream. Any output module can be written through such a sink.
+ *
+ * @param next The sink the compressed output is written to. Must not be
+ *             NULL. It is not destroyed by sr_output_sink_destroy().
+ * @param method The compression method, SR_COMPRESS_GZIP or
+ *               SR_COMPRESS_ZSTD. Each needs libsigrok to be built with
+ *               the respective library.
+ * @param level The compression level (1-9 for gzip, 1-22 for Zstandard),
+ *              or 0 for the method's default.
+ * @param num_threads The number of threads Zstandard compresses on, if
+ *                    libzstd supports it. 0 or 1 means the calling thread
+ *                    only. Ignored for gzip.
+ *
+ * @return A pointer to the new sink, or NULL upon errors (e.g. if the
+ *         method isn't supported).
+ */
+SR_API struct sr_output_sink *sr_output_sink_compress_new(
+		struct sr_output_sink *next, int method, int level,
+		int num_threads)
+{
+	struct sr_output_sink *sink;
+	struct sink_codec *c;
+
+	if (!next) {
+		sr_err("%s: next was NULL", __func__);
+		return NULL;
+	}
+
+	if (!(c = g_try_malloc0(sizeof(struct sink_codec)))) {
+		sr_err("%s: codec malloc failed", __func__);
+		return NULL;
+	}
+
+	c->method = method;
+	if (codec_init(c, level, num_threads) != SR_OK) {
+		g_free(c);
+		return NULL;
+	}
+
+	if (!(c->out = g_try_malloc(SINK_CODEC_BUF_SIZE))
+	    || !(sink = sink_new(SR_OUTPUT_SINK_COMPRESS, -1))) {
+		codec_free(c);
+		return NULL;
+	}
+	sink->next = next;
+	sink->codec = c;
+
+	return sink;
+}
+
+/**
+ * Destroy a sink.
+ *
+ * @param sink The sink. Can be NULL, in which case nothing happens.
+ *
+ * @return SR_OK upon success.
+ */
+SR_API int sr_output_sink_destroy(struct sr_output_sink *sink)
+{
+	if (!sink)
+		return SR_OK;
+
+	codec_free(sink->codec);
+	g_free(sink->buf);
+	g_free(sink->pieces);
+	g_free(sink->iov);
+	g_free(sink);
+
+	return SR_OK;
+}
+
+/**
+ * Drop the output collected in a buffer or iovec sink.
+ *
+ * The sink keeps its memory, so that it can be reused for the next packet
+ * without new allocations.
+ *
+ * @param sink The sink. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_output_sink_reset(struct sr_output_sink *sink)
+{
+	if (!sink) {
+		sr_err("%s: sink was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	sink->buf_len = 0;
+	sink->num_pieces = 0;
+
+	return SR_OK;
+}
+
+static int fd_write(int fd, const uint8_t *data, uint64_t length)
+{
+	ssize_t ret;
+
+	while (length > 0) {
+		if ((ret = write(fd, data, length)) < 0) {
+			if (errno == EINTR)
+				continue;
+			sr_err("%s: write failed: %s", __func__,
+			       strerror(errno));
+			return SR_ERR;
+		}
+		data += ret;
+		length -= ret;
+	}
+
+	return SR_OK;
+}
+
+static int fd_writev(int fd, const struct sr_output_iov *iov, int iovcnt)
+{
+#ifdef HAVE_SYS_UIO_H
+	struct iovec vec[SINK_IOV_BATCH];
+	ssize_t ret;
+	uint64_t done;
+	int i, n;
+
+	while (iovcnt > 0) {
+		n = MIN(iovcnt, SINK_IOV_BATCH);
+		for (i = 0; i < n; i++) {
+			vec[i].iov_base = (void *)iov[i].data;
+			vec[i].iov_len = iov[i].length;
+		}
+		if ((ret = writev(fd, vec, n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			sr_err("%s: writev failed: %s", __func__,
+			       strerror(errno));
+			return SR_ERR;
+		}
+
+		/* Skip the pieces written in full, finish a partial one. */
+		done = ret;
+		for (i = 0; i < n && done >= iov[i].length; i++)
+			done -= iov[i].length;
+		if (i < n) {
+			if (fd_write(fd, (const uint8_t *)iov[i].data + done,
+				     iov[i].length - done) != SR_OK)
+				return SR_ERR;
+			i++;
+		}
+		iov += i;
+		iovcnt -= i;
+	}
+#else
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (fd_write(fd, iov[i].data, iov[i].length) != SR_OK)
+			return SR_ERR;
+	}
+#endif
+
+	return SR_OK;
+}
+
+/* Pass the compressed output collected so far on to the next sink. */
+static int codec_flush(struct sr_output_sink *sink)
+{
+	struct sink_codec *c;
+	int ret;
+
+	c = sink->codec;
+	ret = sr_output_sink_write(sink->next, c->out, c->out_len);
+	c->out_len = 0;
+
+	return ret;
+}
+
+#ifdef HAVE_ZLIB
+static int gzip_feed(struct sr_output_sink *sink, const uint8_t *data,
+		     uint64_t length, gboolean finish)
+{
+	struct sink_codec *c;
+	z_stream *zs;
+	uInt n;
+	int flush, ret;
+
+	c = sink->codec;
+	zs = &c->zs;
+	do {
+		n = MIN(length, SINK_ZLIB_IN_MAX);
+		zs->next_in = (Bytef *)data;
+		zs->avail_in = n;
+		data += n;
+		length -= n;
+		flush = finish && length == 0 ? Z_FINISH : Z_NO_FLUSH;
+		do {
+			zs->next_out = c->out + c->out_len;
+			zs->avail_out = SINK_CODEC_BUF_SIZE - c->out_len;
+			if (deflate(zs, flush) == Z_STREAM_ERROR) {
+				sr_err("%s: deflate failed", __func__);
+				return SR_ERR;
+			}
+			c->out_len = SINK_CODEC_BUF_SIZE - zs->avail_out;
+			if (zs->avail_out == 0 &&
+			    (ret = codec_flush(sink)) != SR_OK)
+				return ret;
+		} while (zs->avail_out == 0);
+	} while (length > 0);
+
+	return SR_OK;
+}
+#endif
+
+#ifdef HAVE_LIBZSTD
+static int zstd_feed(struct sr_output_sink *sink, const uint8_t *data,
+		     uint64_t length, gboolean finish)
+{
+	struct sink_codec *c;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t left;
+	int ret;
+
+	c = sink->codec;
+	in.src = data;
+	in.size = length;
+	in.pos = 0;
+	do {
+		out.dst = c->out;
+		out.size = SINK_CODEC_BUF_SIZE;
+		out.pos = c->out_len;
+		left = ZSTD_compressStream2(c->zc, &out, &in,
+				finish ? ZSTD_e_end : ZSTD_e_continue);
+		if (ZSTD_isError(left)) {
+			sr_err("%s: compression failed: %s", __func__,
+			       ZSTD_getErrorName(left));
+			return SR_ERR;
+		}
+		c->out_len = out.pos;
+		if (out.pos == out.size && (ret = codec_flush(sink)) != SR_OK)
+			return ret;
+	} while (in.pos < in.size || (finish && left > 0));
+
+	return SR_OK;
+}
+#endif
+
+/*
+ * Compress output for the next sink. With 'finish', whatever the
+ * compressor still holds is written out, and the stream is ended.
+ */
+static int codec_feed(struct sr_output_sink *sink, const void *data,
+		      uint64_t length, gboolean finish)
+{
+	struct sink_codec *c;
+	int ret;
+
+	c = sink->codec;
+	if (c->finished) {
+		sr_err("%s: the compressed stream was already finished",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	(void)data;
+	(void)length;
+
+	switch (c->method) {
+#ifdef HAVE_ZLIB
+	case SR_COMPRESS_GZIP:
+		ret = gzip_feed(sink, data, length, finish);
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case SR_COMPRESS_ZSTD:
+		ret = zstd_feed(sink, data, length, finish);
+		break;
+#endif
+	default:
+		ret = SR_ERR_BUG;
+		break;
+	}
+
+	if (ret == SR_OK && finish) {
+		c->finished = TRUE;
+		ret = codec_flush(sink);
+	}
+
+	return ret;
+}
+
+/* Append a piece to an iovec sink, merging it with the last if possible. */
+static int pieces_append(struct sr_output_sink *sink, const void *data,
+			 uint64_t length)
+{
+	struct sr_output_iov *last, *pieces;
+	int size;
+
+	if (length == 0)
+		return SR_OK;
+
+	if (sink->num_pieces > 0) {
+		last = &sink->pieces[sink->num_pieces - 1];
+		if (!last->data && !data) {
+			last->length += length;
+			return SR_OK;
+		}
+		if (last->data && (const uint8_t *)last->data + last->length
+				== data) {
+			last->length += length;
+			return SR_OK;
+		}
+	}
+
+	if (sink->num_pieces == sink->pieces_size) {
+		size = MAX(2 * sink->pieces_size, SINK_IOV_BATCH);
+		if (!(pieces = g_try_realloc(sink->pieces,
+				size * sizeof(struct sr_output_iov)))) {
+			sr_err("%s: pieces malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		sink->pieces = pieces;
+		sink->pieces_size = size;
+	}
+
+	sink->pieces[sink->num_pieces].data = data;
+	sink->pieces[sink->num_pieces].length = length;
+	sink->num_pieces++;
+
+	return SR_OK;
+}
+
+/**
+ * Get space in a sink to write output into.
+ *
+ * This lets a module encode its output in place instead of in a buffer of
+ * its own. Once it has written the output, it calls
+ * sr_output_sink_commit() with the number of bytes written. The space is
+ * only valid until then.
+ *
+ * @param sink The sink. Must not be NULL.
+ * @param length The number of bytes needed.
+ *
+ * @return A pointer to at least 'length' bytes of space, or NULL upon
+ *         errors.
+ */
+SR_API uint8_t *sr_output_sink_reserve(struct sr_output_sink *sink,
+		uint64_t length)
+{
+	uint64_t size;
+	uint8_t *buf;
+
+	if (!sink) {
+		sr_err("%s: sink was NULL", __func__);
+		return NULL;
+	}
+
+	if (sink->buf && sink->buf_size - sink->buf_len >= length)
+		return sink->buf + sink->buf_len;
+
+	size = MAX(2 * sink->buf_size, sink->buf_len + length);
+	size = MAX(size, SINK_BUF_MIN);
+	if (!(buf = g_try_realloc(sink->buf, size))) {
+		sr_err("%s: buffer malloc failed", __func__);
+		return NULL;
+	}
+	sink->buf = buf;
+	sink->buf_size = size;
+
+	return sink->buf + sink->buf_len;
+}
+
+/**
+ * Add output written into space from sr_output_sink_reserve() to a sink.
+ *
+ * @param sink The sink. Must not be NULL.
+ * @param length The number of bytes written, at most as many as were
+ *               reserved.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, SR_ERR
+ *         upon write errors, SR_ERR_MALLOC upon memory allocation errors.
+ */
+SR_API int sr_output_sink_commit(struct sr_output_sink *sink,
+		uint64_t length)
+{
+	int ret;
+
+	if (!sink) {
+		sr_err("%s: sink was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (length > sink->buf_size - sink->buf_len) {
+		sr_err("%s: more data than was reserved", __func__);
+		return SR_ERR_ARG;
+	}
+
+	switch (sink->type) {
+	case SR_OUTPUT_SINK_FD:
+		ret = fd_write(sink->fd, sink->buf + sink->buf_len, length);
+		break;
+	case SR_OUTPUT_SINK_IOVEC:
+		if ((ret = pieces_append(sink, NULL, length)) == SR_OK)
+			sink->buf_len += length;
+		break;
+	case SR_OUTPUT_SINK_COMPRESS:
+		ret = codec_feed(sink, sink->buf + sink->buf_len, length, FALSE);
+		break;
+	default:
+		sink->buf_len += length;
+		ret = SR_OK;
+		break;
+	}
+
+	return ret;
+}
+
+/**
+ * Write a copy of some output to a sink.
+ *
+ * @param sink The sink. Must not be NULL.
+ * @param data The output. Can be NULL if 'length' is 0.
+ * @param length The size of the output in bytes.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, SR_ERR
+ *         upon write errors, SR_ERR_MALLOC upon memory allocation errors.
+ */
+SR_API int sr_output_sink_write(struct sr_output_sink *sink,
+		const void *data, uint64_t length)
+{
+	uint8_t *buf;
+
+	if (!sink || (!data && length > 0)) {
+		sr_err("%s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (length == 0)
+		return SR_OK;
+
+	if (sink->type == SR_OUTPUT_SINK_FD)
+		return fd_write(sink->fd, data, length);
+
+	if (sink->type == SR_OUTPUT_SINK_COMPRESS)
+		return codec_feed(sink, data, length, FALSE);
+
+	if (!(buf = sr_output_sink_reserve(sink, length)))
+		return SR_ERR_MALLOC;
+	memcpy(buf, data, length);
+
+	return sr_output_sink_commit(sink, length);
+}
+
+/**
+ * Write pieces of memory to a sink, in order.
+ *
+ * File descriptor sinks write them with writev(), and iovec sinks keep
+ * pointers to them rather than copies. The pieces must therefore remain
+ * valid for as long as the iovec sink's list is used, e.g. by pointing
+ * into the packet currently being delivered. Buffer sinks copy them, and
+ * compressing sinks compress them one after the other.
+ *
+ * @param sink The sink. Must not be NULL.
+ * @param iov Array of pieces. Can be NULL if 'iovcnt' is 0.
+ * @param iovcnt The number of pieces in 'iov'.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, SR_ERR
+ *         upon write errors, SR_ERR_MALLOC upon memory allocation errors.
+ */
+SR_API int sr_output_sink_writev(struct sr_output_sink *sink,
+		const struct sr_output_iov *iov, int iovcnt)
+{
+	int ret, i;
+
+	if (!sink || (!iov && iovcnt > 0)) {
+		sr_err("%s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (sink->type == SR_OUTPUT_SINK_FD)
+		return fd_writev(sink->fd, iov, iovcnt);
+
+	for (i = 0; i < iovcnt; i++) {
+		if (!iov[i].data && iov[i].length > 0) {
+			sr_err("%s: piece %d has no data", __func__, i);
+			return SR_ERR_ARG;
+		}
+		if (sink->type == SR_OUTPUT_SINK_IOVEC)
+			ret = pieces_append(sink, iov[i].data, iov[i].length);
+		else
+			ret = sr_output_sink_write(sink, iov[i].data,
+						   iov[i].length);
+		if (ret != SR_OK)
+			return ret;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Finish the output written to a sink.
+ *
+ * A compressing sink writes out what the compressor still holds, and ends
+ * the compressed stream; nothing can be written to it afterwards. This
+ * does nothing for other sinks.
+ *
+ * @param sink The sink. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments (or if
+ *         the sink was already finished), SR_ERR upon compression or write
+ *         errors, SR_ERR_MALLOC upon memory allocation errors.
+ */
+SR_API int sr_output_sink_finish(struct sr_output_sink *sink)
+{
+	if (!sink) {
+		sr_err("%s: sink was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (sink->type != SR_OUTPUT_SINK_COMPRESS)
+		return SR_OK;
+
+	return codec_feed(sink, NULL, 0, TRUE);
+}
+
+/**
+ * Get the output collected in a buffer sink.
+ *
+ * @param sink The sink. Must not be NULL.
+ * @param data Pointer to where a pointer to the output will be stored. It
+ *             is valid until the next write to, or reset of, the sink.
+ *             Must not be NULL.
+ * @param length Pointer to where the size of the output in bytes will be
+ *               stored. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_output_sink_data_get(struct sr_output_sink *sink,
+		const uint8_t **data, uint64_t *length)
+{
+	if (!sink || !data || !length) {
+		sr_err("%s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (sink->type != SR_OUTPUT_SINK_BUFFER) {
+		sr_err("%s: not a buffer sink", __func__);
+		return SR_ERR_ARG;
+	}
+
+	*data = sink->buf;
+	*length = sink->buf_len;
+
+	return SR_OK;
+}
+
+/**
+ * Get the output collected in an iovec sink.
+ *
+ * @param sink The sink. Must not be NULL.
+ * @param iov Pointer to where a pointer to the array of pieces will be
+ *            stored. It is valid until the next write to, or reset of, the
+ *            sink. Must not be NULL.
+ * @param iovcnt Pointer to where the number of pieces will be stored. Must
+ *               not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors.
+ */
+SR_API int sr_output_sink_iovec_get(struct sr_output_sink *sink,
+		const struct sr_output_iov **iov, int *iovcnt)
+{
+	struct sr_output_iov *piece, *out;
+	uint64_t offset;
+	int i;
+
+	if (!sink || !iov || !iovcnt) {
+		sr_err("%s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (sink->type != SR_OUTPUT_SINK_IOVEC) {
+		sr_err("%s: not an iovec sink", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(out = g_try_realloc(sink->iov, MAX(sink->pieces_size, 1)
+			* sizeof(struct sr_output_iov)))) {
+		sr_err("%s: iov malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	sink->iov = out;
+
+	/* The buffer may have moved since the pieces were added. */
+	offset = 0;
+	for (i = 0; i < sink->num_pieces; i++) {
+		piece = &sink->pieces[i];
+		out[i].length = piece->length;
+		if (piece->data) {
+			out[i].data = piece->data;
+		} else {
+			out[i].data = sink->buf + offset;
+			offset += piece->length;
+		}
+	}
+
+	*iov = out;
+	*iovcnt = sink->num_pieces;
+
+	return SR_OK;
+}
+
+/** @} */
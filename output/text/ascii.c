@@ -28,15 +28,78 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "output/ascii: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
+
+/*
+ * Add a column to the line buffers for each sample, flushing them to
+ * 'outbuf' at the end of each line. Returns the length written.
+ */
+SR_OUTPUT_KERNEL uint64_t columns(struct context *ctx,
+		const uint8_t *data_in, uint64_t num_samples, uint8_t *outbuf,
+		unsigned int unitsize)
+{
+	uint64_t sample, edges, len, i;
+	unsigned int p;
+	uint8_t *col;
+
+	len = 0;
+	for (i = 0; i < num_samples; i++) {
+		sample = sr_output_sample_get(data_in + i * unitsize, unitsize)
+			& ctx->mask;
+
+		/* A falling edge ends the previous column's high level. */
+		if (ctx->line_offset > 0) {
+			col = ctx->linebuf + ctx->line_offset - 1;
+			edges = ctx->prevsample & ~sample;
+			while (edges) {
+				p = __builtin_ctzll(edges);
+				edges &= edges - 1;
+				col[p * ctx->linebuf_len] = '\\';
+			}
+		}
+
+		/* End of line. */
+		if (ctx->spl_cnt >= ctx->samples_per_line) {
+			len += flush_linebufs(ctx, outbuf + len);
+			ctx->line_offset = ctx->spl_cnt = 0;
+			ctx->mark_trigger = -1;
+		}
+
+		col = ctx->linebuf + ctx->line_offset;
+		for (p = 0; p < ctx->num_enabled_probes; p++)
+			col[p * ctx->linebuf_len] = ((sample >> p) & 1)
+						    ? '"' : '.';
+		edges = sample & ~ctx->prevsample;
+		while (edges) {
+			p = __builtin_ctzll(edges);
+			edges &= edges - 1;
+			col[p * ctx->linebuf_len] = '/';
+		}
+
+		ctx->line_offset++;
+		ctx->spl_cnt++;
+
+		ctx->prevsample = sample;
+	}
+
+	return len;
+}
+
+SR_OUTPUT_KERNELS(columns, uint64_t, (struct context *ctx,
+		const uint8_t *data_in, uint64_t num_samples, uint8_t *outbuf),
+		ctx, data_in, num_samples, outbuf)
 
 SR_PRIV int init_ascii(struct sr_output *o)
 {
-	return init(o, DEFAULT_BPL_ASCII, MODE_ASCII);
+	struct context *ctx;
+	int ret;
+
+	if ((ret = init(o, DEFAULT_BPL_ASCII, MODE_ASCII)) != SR_OK)
+		return ret;
+
+	ctx = o->internal;
+	ctx->columns = columns_get(ctx->unitsize);
+
+	return SR_OK;
 }
 
 SR_PRIV int data_ascii(struct sr_output *o, const uint8_t *data_in,
@@ -44,84 +107,35 @@ SR_PRIV int data_ascii(struct sr_output *o, const uint8_t *data_in,
 		       uint64_t *length_out)
 {
 	struct context *ctx;
-	unsigned int outsize, offset, p;
-	int max_linelen;
-	uint64_t sample;
+	uint64_t outsize, num_samples, len;
 	uint8_t *outbuf;
 
 	ctx = o->internal;
-	max_linelen = SR_MAX_PROBENAME_LEN + 3 + ctx->samples_per_line
-			+ ctx->samples_per_line / 8;
-        /*
-         * Calculate space needed for probes. Set aside 512 bytes for
-         * extra output, e.g. trigger.
-         */
-	outsize = 512 + (1 + (length_in / ctx->unitsize) / ctx->samples_per_line)
-            * (ctx->num_enabled_probes * max_linelen);
-
-	if (!(outbuf = g_try_malloc0(outsize + 1))) {
+	num_samples = length_in / ctx->unitsize;
+	outsize = text_outsize(ctx, num_samples);
+
+	if (!(outbuf = g_try_malloc(outsize + 1))) {
 		sr_err("%s: outbuf malloc failed", __func__);
 		return SR_ERR_MALLOC;
 	}
 
-	outbuf[0] = '\0';
+	len = 0;
 	if (ctx->header) {
 		/* The header is still here, this must be the first packet. */
-		strncpy((char *)outbuf, ctx->header, outsize);
+		len = strlen(ctx->header);
+		memcpy(outbuf, ctx->header, len);
 		g_free(ctx->header);
 		ctx->header = NULL;
 	}
 
-	if (length_in >= ctx->unitsize) {
-		for (offset = 0; offset <= length_in - ctx->unitsize;
-		     offset += ctx->unitsize) {
-			memcpy(&sample, data_in + offset, ctx->unitsize);
-
-			char tmpval[ctx->num_enabled_probes];
-
-			for (p = 0; p < ctx->num_enabled_probes; p++) {
-				uint64_t curbit = (sample & ((uint64_t) 1 << p));
-				uint64_t prevbit = (ctx->prevsample &
-						((uint64_t) 1 << p));
-
-				if (curbit < prevbit && ctx->line_offset > 0) {
-					ctx->linebuf[p * ctx->linebuf_len +
-						ctx->line_offset-1] = '\\';
-				}
-
-				if (curbit > prevbit) {
-					tmpval[p] = '/';
-				} else {
-					if (curbit)
-						tmpval[p] = '"';
-					else
-						tmpval[p] = '.';
-				}
-			}
-
-			/* End of line. */
-			if (ctx->spl_cnt >= ctx->samples_per_line) {
-				flush_linebufs(ctx, outbuf);
-				ctx->line_offset = ctx->spl_cnt = 0;
-				ctx->mark_trigger = -1;
-			}
-
-			for (p = 0; p < ctx->num_enabled_probes; p++) {
-				ctx->linebuf[p * ctx->linebuf_len +
-					     ctx->line_offset] = tmpval[p];
-			}
-
-			ctx->line_offset++;
-			ctx->spl_cnt++;
-
-			ctx->prevsample = sample;
-		}
-	} else {
+	if (num_samples == 0)
 		sr_info("Short buffer (length_in=%" PRIu64 ").", length_in);
-	}
+
+	len += ctx->columns(ctx, data_in, num_samples, outbuf + len);
+	outbuf[len] = '\0';
 
 	*data_out = outbuf;
-	*length_out = strlen((const char *)outbuf);
+	*length_out = len;
 
 	return SR_OK;
 }
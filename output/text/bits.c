@@ -28,11 +28,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "output/bits: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 SR_PRIV int init_bits(struct sr_output *o)
 {
@@ -44,71 +39,66 @@ SR_PRIV int data_bits(struct sr_output *o, const uint8_t *data_in,
 		      uint64_t *length_out)
 {
 	struct context *ctx;
-	unsigned int outsize, offset, p;
-	int max_linelen;
-	uint64_t sample;
-	uint8_t *outbuf, c;
+	uint64_t outsize, num_samples, len, i, n;
+	unsigned int p;
+	uint8_t *outbuf, *row;
 
 	ctx = o->internal;
-	max_linelen = SR_MAX_PROBENAME_LEN + 3 + ctx->samples_per_line
-			+ ctx->samples_per_line / 8;
-        /*
-         * Calculate space needed for probes. Set aside 512 bytes for
-         * extra output, e.g. trigger.
-         */
-	outsize = 512 + (1 + (length_in / ctx->unitsize) / ctx->samples_per_line)
-            * (ctx->num_enabled_probes * max_linelen);
+	num_samples = length_in / ctx->unitsize;
+	outsize = text_outsize(ctx, num_samples);
 
-	if (!(outbuf = g_try_malloc0(outsize + 1))) {
+	if (!(outbuf = g_try_malloc(outsize + 1))) {
 		sr_err("%s: outbuf malloc failed", __func__);
 		return SR_ERR_MALLOC;
 	}
 
-	outbuf[0] = '\0';
+	len = 0;
 	if (ctx->header) {
 		/* The header is still here, this must be the first packet. */
-		strncpy((char *)outbuf, ctx->header, outsize);
+		len = strlen(ctx->header);
+		memcpy(outbuf, ctx->header, len);
 		g_free(ctx->header);
 		ctx->header = NULL;
 
 		/* Ensure first transition. */
-		memcpy(&ctx->prevsample, data_in, ctx->unitsize);
-		ctx->prevsample = ~ctx->prevsample;
+		if (num_samples > 0)
+			ctx->prevsample = ~sr_output_sample_get(data_in,
+							ctx->unitsize);
 	}
 
-	if (length_in >= ctx->unitsize) {
-		for (offset = 0; offset <= length_in - ctx->unitsize;
-		     offset += ctx->unitsize) {
-			memcpy(&sample, data_in + offset, ctx->unitsize);
-			for (p = 0; p < ctx->num_enabled_probes; p++) {
-				c = (sample & ((uint64_t) 1 << p)) ? '1' : '0';
-				ctx->linebuf[p * ctx->linebuf_len +
-					     ctx->line_offset] = c;
-			}
-			ctx->line_offset++;
-			ctx->spl_cnt++;
+	if (num_samples == 0)
+		sr_info("Short buffer (length_in=%" PRIu64 ").", length_in);
 
-			/* Add a space every 8th bit. */
-			if ((ctx->spl_cnt & 7) == 0) {
-				for (p = 0; p < ctx->num_enabled_probes; p++)
-					ctx->linebuf[p * ctx->linebuf_len +
-						     ctx->line_offset] = ' ';
-				ctx->line_offset++;
-			}
+	for (i = 0; i < num_samples; i += n) {
+		/* Up to the end of the current byte or line. */
+		n = MIN(num_samples - i, 8 - (uint64_t)(ctx->spl_cnt & 7));
+		n = MIN(n, (uint64_t)(ctx->samples_per_line - ctx->spl_cnt));
+		ctx->collect(ctx, data_in + i * ctx->unitsize, n);
 
-			/* End of line. */
-			if (ctx->spl_cnt >= ctx->samples_per_line) {
-				flush_linebufs(ctx, outbuf);
-				ctx->line_offset = ctx->spl_cnt = 0;
-				ctx->mark_trigger = -1;
+		/* Write out every complete byte, followed by a space. */
+		if ((ctx->spl_cnt & 7) == 0) {
+			for (p = 0; p < ctx->num_enabled_probes; p++) {
+				row = ctx->linebuf + p * ctx->linebuf_len
+						+ ctx->line_offset;
+				memcpy(row, ctx->bits[ctx->linevalues[p]], 8);
+				row[8] = ' ';
 			}
+			memset(ctx->linevalues, 0, ctx->num_enabled_probes);
+			ctx->line_offset += 9;
+		}
+
+		/* End of line. */
+		if (ctx->spl_cnt >= ctx->samples_per_line) {
+			len += flush_linebufs(ctx, outbuf + len);
+			memset(ctx->linevalues, 0, ctx->num_enabled_probes);
+			ctx->line_offset = ctx->spl_cnt = 0;
+			ctx->mark_trigger = -1;
 		}
-	} else {
-		sr_info("Short buffer (length_in=%" PRIu64 ").", length_in);
 	}
+	outbuf[len] = '\0';
 
 	*data_out = outbuf;
-	*length_out = strlen((const char *)outbuf);
+	*length_out = len;
 
 	return SR_OK;
 }
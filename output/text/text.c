@@ -30,48 +30,130 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "output/text: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
-SR_PRIV void flush_linebufs(struct context *ctx, uint8_t *outbuf)
+/*
+ * Write out the samples of the line's last, incomplete byte, which the
+ * bits and hex modules only put into the line buffers once the byte is
+ * complete. Returns the number of characters written per probe.
+ */
+static int flush_partial_byte(struct context *ctx)
 {
-	static int max_probename_len = 0;
-	int len, i;
-
-	if (ctx->linebuf[0] == 0)
-		return;
-
-	if (max_probename_len == 0) {
-		/* First time through... */
-		for (i = 0; ctx->probelist[i]; i++) {
-			len = strlen(ctx->probelist[i]);
-			if (len > max_probename_len)
-				max_probename_len = len;
+	uint8_t *row, value;
+	unsigned int p;
+	int n;
+
+	if ((n = ctx->spl_cnt & 7) == 0)
+		return 0;
+
+	for (p = 0; p < ctx->num_enabled_probes; p++) {
+		row = ctx->linebuf + p * ctx->linebuf_len + ctx->line_offset;
+		value = ctx->linevalues[p];
+		switch (ctx->mode) {
+		case MODE_BITS:
+			memcpy(row, ctx->bits[value], n);
+			break;
+		case MODE_HEX:
+			memcpy(row, ctx->hex[value >> (8 - n)], 2);
+			break;
+		default:
+			return 0;
 		}
 	}
 
+	return ctx->mode == MODE_HEX ? 2 : n;
+}
+
+/*
+ * Add samples to the probes' current bytes of the line (linevalues) for
+ * the bits and hex modules, the first sample of a byte in its most
+ * significant bit; the samples must not go past the end of that byte.
+ * Returns the number of samples.
+ */
+SR_OUTPUT_KERNEL uint64_t collect(struct context *ctx,
+		const uint8_t *data_in, uint64_t num_samples,
+		unsigned int unitsize)
+{
+	uint64_t i, set;
+	unsigned int bit;
+
+	bit = 0x80 >> (ctx->spl_cnt & 7);
+	for (i = 0; i < num_samples; i++, bit >>= 1) {
+		set = sr_output_sample_get(data_in + i * unitsize, unitsize)
+			& ctx->mask;
+		while (set) {
+			ctx->linevalues[__builtin_ctzll(set)] |= bit;
+			set &= set - 1;
+		}
+	}
+	ctx->spl_cnt += num_samples;
+
+	return num_samples;
+}
+
+SR_OUTPUT_KERNELS(collect, uint64_t, (struct context *ctx,
+		const uint8_t *data_in, uint64_t num_samples),
+		ctx, data_in, num_samples)
+
+/*
+ * Write the line buffers to 'outbuf', which must have room for
+ * ctx->line_size bytes. Returns the number of bytes written.
+ */
+SR_PRIV uint64_t flush_linebufs(struct context *ctx, uint8_t *outbuf)
+{
+	uint8_t *out;
+	int len, rowlen, space_offset, i;
+
+	rowlen = ctx->line_offset + flush_partial_byte(ctx);
+	if (rowlen == 0)
+		return 0;
+
+	out = outbuf;
 	for (i = 0; ctx->probelist[i]; i++) {
-		sprintf((char *)outbuf + strlen((const char *)outbuf),
-			"%*s:%s\n", max_probename_len,
-			ctx->probelist[i], ctx->linebuf + i * ctx->linebuf_len);
+		len = strlen(ctx->probelist[i]);
+		memset(out, ' ', ctx->max_probename_len - len);
+		out += ctx->max_probename_len - len;
+		memcpy(out, ctx->probelist[i], len);
+		out += len;
+		*out++ = ':';
+		memcpy(out, ctx->linebuf + i * ctx->linebuf_len, rowlen);
+		out += rowlen;
+		*out++ = '\n';
 	}
 
 	/* Mark trigger with a ^ character. */
 	if (ctx->mark_trigger != -1)
 	{
-		int space_offset = ctx->mark_trigger / 8;
+		space_offset = ctx->mark_trigger / 8;
 
 		if (ctx->mode == MODE_ASCII)
 			space_offset = 0;
 
-		sprintf((char *)outbuf + strlen((const char *)outbuf),
-			"T:%*s^\n", ctx->mark_trigger + space_offset, "");
+		*out++ = 'T';
+		*out++ = ':';
+		memset(out, ' ', ctx->mark_trigger + space_offset);
+		out += ctx->mark_trigger + space_offset;
+		*out++ = '^';
+		*out++ = '\n';
 	}
 
-	memset(ctx->linebuf, 0, i * ctx->linebuf_len);
+	return out - outbuf;
+}
+
+/*
+ * Get the size of the output buffer needed for a packet of 'num_samples'
+ * samples: the header if it hasn't been sent yet, and every line the
+ * packet completes.
+ */
+SR_PRIV uint64_t text_outsize(struct context *ctx, uint64_t num_samples)
+{
+	uint64_t outsize;
+
+	outsize = (ctx->spl_cnt + num_samples) / ctx->samples_per_line
+			* ctx->line_size;
+	if (ctx->header)
+		outsize += strlen(ctx->header);
+
+	return outsize;
 }
 
 SR_PRIV int init(struct sr_output *o, int default_spl, enum outputmode mode)
@@ -80,7 +162,8 @@ SR_PRIV int init(struct sr_output *o, int default_spl, enum outputmode mode)
 	struct sr_probe *probe;
 	GSList *l;
 	uint64_t *samplerate;
-	int num_probes, ret;
+	int num_probes, rowlen, len, ret;
+	unsigned int i, j;
 	char *samplerate_s;
 
 	if (!(ctx = g_try_malloc0(sizeof(struct context)))) {
@@ -91,8 +174,13 @@ SR_PRIV int init(struct sr_output *o, int default_spl, enum outputmode mode)
 	o->internal = ctx;
 	ctx->num_enabled_probes = 0;
 
+	num_probes = 0;
 	for (l = o->sdi->probes; l; l = l->next) {
 		probe = l->data;
+		/* Analog probes aren't bits of the logic units. */
+		if (probe->type != SR_PROBE_LOGIC)
+			continue;
+		num_probes++;
 		if (!probe->enabled)
 			continue;
 		ctx->probelist[ctx->num_enabled_probes++] = probe->name;
@@ -100,6 +188,11 @@ SR_PRIV int init(struct sr_output *o, int default_spl, enum outputmode mode)
 
 	ctx->probelist[ctx->num_enabled_probes] = 0;
 	ctx->unitsize = (ctx->num_enabled_probes + 7) / 8;
+	if (ctx->num_enabled_probes < 64)
+		ctx->mask = (UINT64_C(1) << ctx->num_enabled_probes) - 1;
+	else
+		ctx->mask = ~UINT64_C(0);
+	ctx->collect = collect_get(ctx->unitsize);
 	ctx->line_offset = 0;
 	ctx->spl_cnt = 0;
 	ctx->mark_trigger = -1;
@@ -122,7 +215,6 @@ SR_PRIV int init(struct sr_output *o, int default_spl, enum outputmode mode)
 	}
 
 	snprintf(ctx->header, 511, "%s\n", PACKAGE_STRING);
-	num_probes = g_slist_length(o->sdi->probes);
 	if (o->sdi->driver || sr_dev_has_hwcap(o->sdi, SR_HWCAP_SAMPLERATE)) {
 		ret = o->sdi->driver->info_get(SR_DI_CUR_SAMPLERATE,
 				(const void **)&samplerate, o->sdi);
@@ -139,6 +231,37 @@ SR_PRIV int init(struct sr_output *o, int default_spl, enum outputmode mode)
 		g_free(samplerate_s);
 	}
 
+	/* Longest line buffer row, without the probe name. */
+	switch (mode) {
+	case MODE_BITS:
+		rowlen = ctx->samples_per_line + ctx->samples_per_line / 8;
+		break;
+	case MODE_HEX:
+		rowlen = ctx->samples_per_line / 8 * 3 + 2;
+		break;
+	default:
+		rowlen = ctx->samples_per_line;
+		break;
+	}
+
+	for (i = 0; ctx->probelist[i]; i++) {
+		len = strlen(ctx->probelist[i]);
+		if (len > ctx->max_probename_len)
+			ctx->max_probename_len = len;
+	}
+
+	/* A "name:row\n" line per probe, and the trigger marker line. */
+	ctx->line_size = ctx->num_enabled_probes
+			* (ctx->max_probename_len + rowlen + 2)
+			+ ctx->samples_per_line + ctx->samples_per_line / 8 + 4;
+
+	for (i = 0; i < 256; i++) {
+		for (j = 0; j < 8; j++)
+			ctx->bits[i][j] = (i & (0x80 >> j)) ? '1' : '0';
+		ctx->hex[i][0] = "0123456789abcdef"[i >> 4];
+		ctx->hex[i][1] = "0123456789abcdef"[i & 0xf];
+	}
+
 	ctx->linebuf_len = ctx->samples_per_line * 2 + 4;
 	if (!(ctx->linebuf = g_try_malloc0(num_probes * ctx->linebuf_len))) {
 		sr_err("%s: ctx->linebuf malloc failed", __func__);
@@ -164,7 +287,6 @@ SR_PRIV int event(struct sr_output *o, int event_type, uint8_t **data_out,
 		  uint64_t *length_out)
 {
 	struct context *ctx;
-	int outsize;
 	uint8_t *outbuf;
 
 	ctx = o->internal;
@@ -175,15 +297,16 @@ SR_PRIV int event(struct sr_output *o, int event_type, uint8_t **data_out,
 		*length_out = 0;
 		break;
 	case SR_DF_END:
-		outsize = ctx->num_enabled_probes
-				* (ctx->samples_per_line + 20) + 512;
-		if (!(outbuf = g_try_malloc0(outsize))) {
+		if (!(outbuf = g_try_malloc(ctx->line_size + 1))) {
 			sr_err("%s: outbuf malloc failed", __func__);
 			return SR_ERR_MALLOC;
 		}
-		flush_linebufs(ctx, outbuf);
+		*length_out = flush_linebufs(ctx, outbuf);
+		outbuf[*length_out] = '\0';
 		*data_out = outbuf;
-		*length_out = strlen((const char *)outbuf);
+		g_free(ctx->header);
+		g_free(ctx->linebuf);
+		g_free(ctx->linevalues);
 		g_free(o->internal);
 		o->internal = NULL;
 		break;
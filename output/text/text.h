@@ -44,9 +44,24 @@ struct context {
 	int mark_trigger;
 	uint64_t prevsample;
 	enum outputmode mode;
+	int max_probename_len;
+	/* Upper bound of the output of one flush_linebufs() call. */
+	uint64_t line_size;
+	/* Per byte of samples: its 8 bits as '0'/'1', MSB first. */
+	char bits[256][8];
+	/* Per byte of samples: its value as two hex digits. */
+	char hex[256][2];
+	/* Bits of the enabled probes in a sample. */
+	uint64_t mask;
+	/* collect() (bits, hex) and columns() (ascii) for this unit size. */
+	uint64_t (*collect)(struct context *ctx, const uint8_t *data_in,
+			    uint64_t num_samples);
+	uint64_t (*columns)(struct context *ctx, const uint8_t *data_in,
+			    uint64_t num_samples, uint8_t *outbuf);
 };
 
-SR_PRIV void flush_linebufs(struct context *ctx, uint8_t *outbuf);
+SR_PRIV uint64_t flush_linebufs(struct context *ctx, uint8_t *outbuf);
+SR_PRIV uint64_t text_outsize(struct context *ctx, uint64_t num_samples);
 SR_PRIV int init(struct sr_output *o, int default_spl, enum outputmode mode);
 SR_PRIV int event(struct sr_output *o, int event_type, uint8_t **data_out,
 		  uint64_t *length_out);
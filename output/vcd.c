@@ -29,26 +29,97 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "output/vcd: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
+
+/* Longest output for one sample: its timestamp, and all probes. */
+#define MAX_SAMPLE_LEN (1 + 20 + 1 + 3 * SR_MAX_NUM_PROBES)
+
+/* Number of runs of an SR_DF_LOGIC_RLE packet encoded at a time. */
+#define RLE_BATCH 1024
 
 struct context {
 	int num_enabled_probes;
 	int unitsize;
 	char *probelist[SR_MAX_NUM_PROBES + 1];
-	int *prevbits;
 	GString *header;
 	uint64_t prevsample;
+	/* Bits of the enabled probes in a sample. */
+	uint64_t mask;
+	/* Number of samples before the current packet. */
+	uint64_t samplecount;
 	int period;
 	uint64_t samplerate;
+	/* changes() for this unit size. */
+	uint64_t (*changes)(struct context *ctx, const uint8_t *data_in,
+			    uint64_t num_samples, GString *out);
 };
 
 static const char *vcd_header_comment = "\
 $comment\n  Acquisition with %d/%d probes at %s\n$end\n";
 
+/* The VCD timestamp of a sample, in units of the timescale. */
+static uint64_t timestamp(const struct context *ctx, uint64_t samplenum)
+{
+	/* Without a samplerate, the timestamps just count samples. */
+	if (ctx->samplerate == 0)
+		return samplenum;
+
+	/* Split up, so that this doesn't overflow for long captures. */
+	return (samplenum / ctx->samplerate) * ctx->period
+		+ (samplenum % ctx->samplerate) * ctx->period / ctx->samplerate;
+}
+
+/*
+ * Write a timestamp, then which of the probes in 'diff' changed to which
+ * value. Returns the length written, at most MAX_SAMPLE_LEN.
+ */
+static int format_change(const struct context *ctx, char *buf,
+			 uint64_t sample, uint64_t diff, uint64_t samplenum)
+{
+	int p, len;
+
+	buf[0] = '#';
+	len = 1 + sr_output_format_dec(buf + 1, timestamp(ctx, samplenum));
+	buf[len++] = '\n';
+	while (diff) {
+		p = __builtin_ctzll(diff);
+		diff &= diff - 1;
+		buf[len++] = (sample >> p) & 1 ? '1' : '0';
+		buf[len++] = '!' + p;
+		buf[len++] = '\n';
+	}
+
+	return len;
+}
+
+/* Append the changes in the samples to 'out', return the sample count. */
+SR_OUTPUT_KERNEL uint64_t changes(struct context *ctx,
+		const uint8_t *data_in, uint64_t num_samples, GString *out,
+		unsigned int unitsize)
+{
+	char buf[MAX_SAMPLE_LEN];
+	uint64_t i, sample, diff;
+	int len;
+
+	for (i = 0; i < num_samples; i++) {
+		sample = sr_output_sample_get(data_in + i * unitsize, unitsize);
+
+		/* VCD only contains deltas/changes of signals. */
+		if (!(diff = (sample ^ ctx->prevsample) & ctx->mask))
+			continue;
+		ctx->prevsample = sample;
+
+		len = format_change(ctx, buf, sample, diff,
+				    ctx->samplecount + i);
+		g_string_append_len(out, buf, len);
+	}
+
+	return num_samples;
+}
+
+SR_OUTPUT_KERNELS(changes, uint64_t, (struct context *ctx,
+		const uint8_t *data_in, uint64_t num_samples, GString *out),
+		ctx, data_in, num_samples, out)
+
 static int init(struct sr_output *o)
 {
 	struct context *ctx;
@@ -67,8 +138,13 @@ static int init(struct sr_output *o)
 	o->internal = ctx;
 	ctx->num_enabled_probes = 0;
 
+	num_probes = 0;
 	for (l = o->sdi->probes; l; l = l->next) {
 		probe = l->data;
+		/* Analog probes aren't bits of the logic units. */
+		if (probe->type != SR_PROBE_LOGIC)
+			continue;
+		num_probes++;
 		if (!probe->enabled)
 			continue;
 		ctx->probelist[ctx->num_enabled_probes++] = probe->name;
@@ -80,8 +156,12 @@ static int init(struct sr_output *o)
 
 	ctx->probelist[ctx->num_enabled_probes] = 0;
 	ctx->unitsize = (ctx->num_enabled_probes + 7) / 8;
+	ctx->changes = changes_get(ctx->unitsize);
+	if (ctx->num_enabled_probes < 64)
+		ctx->mask = (UINT64_C(1) << ctx->num_enabled_probes) - 1;
+	else
+		ctx->mask = ~UINT64_C(0);
 	ctx->header = g_string_sized_new(512);
-	num_probes = g_slist_length(o->sdi->probes);
 
 	/* timestamp */
 	t = time(NULL);
@@ -136,27 +216,25 @@ static int init(struct sr_output *o)
 	g_string_append(ctx->header, "$upscope $end\n"
 			"$enddefinitions $end\n$dumpvars\n");
 
-	if (!(ctx->prevbits = g_try_malloc0(sizeof(int) * num_probes))) {
-		g_string_free(ctx->header, TRUE);
-		g_free(ctx);
-		sr_err("%s: ctx->prevbits malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
-
 	return SR_OK;
 }
 
 static int event(struct sr_output *o, int event_type, uint8_t **data_out,
 		 uint64_t *length_out)
 {
+	struct context *ctx;
 	uint8_t *outbuf;
 
+	ctx = o->internal;
+
 	switch (event_type) {
 	case SR_DF_END:
 		outbuf = (uint8_t *)g_strdup("$dumpoff\n$end\n");
 		*data_out = outbuf;
 		*length_out = strlen((const char *)outbuf);
-		g_free(o->internal);
+		if (ctx->header)
+			g_string_free(ctx->header, TRUE);
+		g_free(ctx);
 		o->internal = NULL;
 		break;
 	default:
@@ -172,14 +250,11 @@ static int data(struct sr_output *o, const uint8_t *data_in,
 		uint64_t length_in, uint8_t **data_out, uint64_t *length_out)
 {
 	struct context *ctx;
-	unsigned int i;
-	int p, curbit, prevbit;
-	uint64_t sample;
-	static uint64_t samplecount = 0;
+	uint64_t num_samples;
 	GString *out;
-	int first_sample = 0;
 
 	ctx = o->internal;
+	num_samples = length_in / ctx->unitsize;
 	out = g_string_sized_new(512);
 
 	if (ctx->header) {
@@ -187,40 +262,71 @@ static int data(struct sr_output *o, const uint8_t *data_in,
 		g_string_append(out, ctx->header->str);
 		g_string_free(ctx->header, TRUE);
 		ctx->header = NULL;
-		first_sample = 1;
+		/* Make sure all values are stored with the first sample. */
+		if (num_samples > 0)
+			ctx->prevsample = ~sr_output_sample_get(data_in,
+							ctx->unitsize);
 	}
 
-	for (i = 0; i <= length_in - ctx->unitsize; i += ctx->unitsize) {
-		samplecount++;
+	ctx->samplecount += ctx->changes(ctx, data_in, num_samples, out);
 
-		memcpy(&sample, data_in + i, ctx->unitsize);
-
-		if (first_sample) {
-			/* First packet. We neg to make sure sample is stored. */
-			ctx->prevsample = ~sample;
-			first_sample = 0;
-		}
+	*data_out = (uint8_t *)out->str;
+	*length_out = out->len;
+	g_string_free(out, FALSE);
 
-		for (p = 0; p < ctx->num_enabled_probes; p++) {
-			curbit = (sample & ((uint64_t) (1 << p))) >> p;
-			prevbit = (ctx->prevsample & ((uint64_t) (1 << p))) >> p;
+	return SR_OK;
+}
 
-			/* VCD only contains deltas/changes of signals. */
-			if (prevbit == curbit)
-				continue;
+/* Runs are exactly what VCD wants: a change at the start of each one. */
+static int data_rle(struct sr_output *o,
+		    const struct sr_datafeed_logic_rle *rle,
+		    struct sr_output_sink *sink)
+{
+	struct context *ctx;
+	const struct sr_logic_run *run;
+	uint64_t i, j, n, diff, mask;
+	uint8_t *out;
+	int len, ret;
 
-			/* Output which signal changed to which value. */
-			g_string_append_printf(out, "#%" PRIu64 "\n%i%c\n",
-					(uint64_t)(((float)samplecount / ctx->samplerate)
-					* ctx->period), curbit, (char)('!' + p));
-		}
+	ctx = o->internal;
 
-		ctx->prevsample = sample;
+	if (ctx->header) {
+		/* The header is still here, this must be the first packet. */
+		ret = sr_output_sink_write(sink, ctx->header->str,
+					   ctx->header->len);
+		g_string_free(ctx->header, TRUE);
+		ctx->header = NULL;
+		if (ret != SR_OK)
+			return ret;
+		/* Make sure all values are stored with the first sample. */
+		if (rle->num_runs > 0)
+			ctx->prevsample = ~rle->runs[0].value;
 	}
 
-	*data_out = (uint8_t *)out->str;
-	*length_out = out->len;
-	g_string_free(out, FALSE);
+	mask = ctx->mask;
+	if (rle->unitsize < 8)
+		mask &= (UINT64_C(1) << (8 * rle->unitsize)) - 1;
+
+	for (i = 0; i < rle->num_runs; i += n) {
+		/* Room for a batch of runs, each of which may be a change. */
+		n = MIN(rle->num_runs - i, RLE_BATCH);
+		if (!(out = sr_output_sink_reserve(sink, n * MAX_SAMPLE_LEN)))
+			return SR_ERR_MALLOC;
+		len = 0;
+		for (j = i; j < i + n; j++) {
+			run = &rle->runs[j];
+			diff = (run->value ^ ctx->prevsample) & mask;
+			if (run->length > 0 && diff) {
+				ctx->prevsample = run->value;
+				len += format_change(ctx, (char *)out + len,
+						     run->value, diff,
+						     ctx->samplecount);
+			}
+			ctx->samplecount += run->length;
+		}
+		if ((ret = sr_output_sink_commit(sink, len)) != SR_OK)
+			return ret;
+	}
 
 	return SR_OK;
 }
@@ -232,4 +338,5 @@ struct sr_output_format output_vcd = {
 	.init = init,
 	.data = data,
 	.event = event,
+	.data_rle = data_rle,
 };
@@ -0,0 +1,375 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "pool: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/**
+ * @file
+ *
+ * A pool of large memory blocks, reused across acquisitions.
+ */
+
+/**
+ * @defgroup grp_pool Buffer pool
+ *
+ * A pool of large memory blocks, reused across acquisitions.
+ *
+ * Datastore chunks and USB transfer buffers are large, and are allocated
+ * and freed again on every acquisition. For workloads with many short
+ * captures in a row, that churns a lot of memory through malloc and
+ * fragments the heap.
+ *
+ * Blocks allocated with sr_pool_alloc() are instead rounded up to a power
+ * of two (the block's size class) and, when handed back with
+ * sr_pool_free(), kept on a free list for that size class. The next
+ * allocation of the same class takes the block from there. The pool only
+ * retains up to a limit (see sr_pool_limit_set()) of free memory; blocks
+ * beyond that are given back to the system right away.
+ *
+ * Blocks of POOL_MAP_MIN bytes or more are mapped directly from the
+ * system, optionally backed by huge pages (see sr_pool_hugepages_set()).
+ * sr_pool_reserve() allocates such a block for a bounded capture up
+ * front, with all of its pages already faulted in.
+ *
+ * All functions are safe to call from any thread.
+ *
+ * @{
+ */
+
+/** @cond PRIVATE */
+/* log2 of the smallest size class. */
+#define POOL_CLASS_MIN 12
+
+/* Number of size classes; larger blocks bypass the pool. */
+#define POOL_NUM_CLASSES 24
+
+/* Default limit of free memory retained by the pool, in bytes. */
+#define POOL_LIMIT_DEFAULT (256 * 1024 * 1024)
+
+/* Blocks at least this large are mapped directly from the system. */
+#define POOL_MAP_MIN (2 * 1024 * 1024)
+
+/* Stride at which sr_pool_reserve() faults pages in. */
+#define POOL_PAGE_SIZE 4096
+
+#if defined(HAVE_SYS_MMAN_H) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+/** @endcond */
+
+/* A free block; the link lives in the block's own (unused) memory. */
+struct pool_block {
+	struct pool_block *next;
+};
+
+static struct {
+	GMutex mutex;
+	struct pool_block *free[POOL_NUM_CLASSES];
+	uint64_t retained;
+	uint64_t limit;
+	gboolean hugepages;
+} pool = {
+	.limit = POOL_LIMIT_DEFAULT,
+};
+
+/* Size class of a 'size' byte block, or -1 if it's too large for one. */
+static int size_class(uint64_t size)
+{
+	int cls;
+
+	for (cls = 0; cls < POOL_NUM_CLASSES; cls++) {
+		if (size <= UINT64_C(1) << (POOL_CLASS_MIN + cls))
+			return cls;
+	}
+
+	return -1;
+}
+
+static uint64_t class_size(int cls)
+{
+	return UINT64_C(1) << (POOL_CLASS_MIN + cls);
+}
+
+/* Get a new block of 'size' bytes from the system. */
+static void *block_new(uint64_t size)
+{
+#ifdef HAVE_SYS_MMAN_H
+	void *mem;
+
+	if (size < POOL_MAP_MIN)
+		return g_try_malloc(size);
+
+	mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (pool.hugepages)
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (mem == MAP_FAILED) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		/* No reserved huge pages, try transparent ones. */
+		if (pool.hugepages)
+			madvise(mem, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	return mem;
+#else
+	return g_try_malloc(size);
+#endif
+}
+
+/* Give a block obtained from block_new() back to the system. */
+static void block_free(void *mem, uint64_t size)
+{
+#ifdef HAVE_SYS_MMAN_H
+	if (size >= POOL_MAP_MIN) {
+		munmap(mem, size);
+		return;
+	}
+#else
+	(void)size;
+#endif
+	g_free(mem);
+}
+
+/**
+ * Allocate a block of memory from the pool.
+ *
+ * The memory is not initialized. It must be freed with sr_pool_free(),
+ * passing the same size.
+ *
+ * @param size The size of the block in bytes. Must be > 0.
+ *
+ * @return A pointer to the block, or NULL upon errors.
+ */
+SR_API void *sr_pool_alloc(uint64_t size)
+{
+	struct pool_block *block;
+	void *mem;
+	int cls;
+
+	if (size == 0) {
+		sr_err("%s: size was 0", __func__);
+		return NULL;
+	}
+
+	/* Too large to be worth keeping around. */
+	if ((cls = size_class(size)) < 0) {
+		if (!(mem = block_new(size)))
+			sr_err("%s: block malloc failed", __func__);
+		return mem;
+	}
+
+	g_mutex_lock(&pool.mutex);
+	if ((block = pool.free[cls])) {
+		pool.free[cls] = block->next;
+		pool.retained -= class_size(cls);
+	}
+	g_mutex_unlock(&pool.mutex);
+
+	if (block)
+		return block;
+
+	if (!(mem = block_new(class_size(cls))))
+		sr_err("%s: block malloc failed", __func__);
+
+	return mem;
+}
+
+/**
+ * Return a block of memory to the pool.
+ *
+ * @param mem The block, as returned by sr_pool_alloc(). Can be NULL, in
+ *            which case nothing happens.
+ * @param size The size the block was allocated with.
+ */
+SR_API void sr_pool_free(void *mem, uint64_t size)
+{
+	struct pool_block *block;
+	int cls;
+
+	if (!mem)
+		return;
+
+	if ((cls = size_class(size)) < 0) {
+		block_free(mem, size);
+		return;
+	}
+
+	g_mutex_lock(&pool.mutex);
+	if (pool.retained + class_size(cls) <= pool.limit) {
+		block = mem;
+		block->next = pool.free[cls];
+		pool.free[cls] = block;
+		pool.retained += class_size(cls);
+		mem = NULL;
+	}
+	g_mutex_unlock(&pool.mutex);
+
+	if (mem)
+		block_free(mem, class_size(cls));
+}
+
+/**
+ * Allocate a large block of memory, and fault all of its pages in.
+ *
+ * Unlike sr_pool_alloc(), the block bypasses the free lists: it's meant
+ * for a buffer sized to a whole bounded capture, set up before the
+ * acquisition starts, so that filling it doesn't stall on page faults.
+ * Like other large blocks, it's backed by huge pages if those are
+ * enabled (see sr_pool_hugepages_set()).
+ *
+ * The memory is zeroed. It must be freed with sr_pool_release(), passing
+ * the same size.
+ *
+ * @param size The size of the block in bytes. Must be > 0.
+ *
+ * @return A pointer to the block, or NULL upon errors.
+ */
+SR_API void *sr_pool_reserve(uint64_t size)
+{
+	uint8_t *mem;
+	uint64_t i;
+
+	if (size == 0) {
+		sr_err("%s: size was 0", __func__);
+		return NULL;
+	}
+
+	if (!(mem = block_new(size))) {
+		sr_err("%s: block malloc failed", __func__);
+		return NULL;
+	}
+
+#ifdef HAVE_SYS_MMAN_H
+	/* Fresh mappings read as zero; writing a byte per page faults it in. */
+	if (size >= POOL_MAP_MIN) {
+		for (i = 0; i < size; i += POOL_PAGE_SIZE)
+			mem[i] = 0;
+		return mem;
+	}
+#endif
+	memset(mem, 0, size);
+
+	return mem;
+}
+
+/**
+ * Free a block of memory allocated with sr_pool_reserve().
+ *
+ * @param mem The block. Can be NULL, in which case nothing happens.
+ * @param size The size the block was allocated with.
+ */
+SR_API void sr_pool_release(void *mem, uint64_t size)
+{
+	if (mem)
+		block_free(mem, size);
+}
+
+/**
+ * Set the maximum amount of free memory the pool retains.
+ *
+ * If more than that is retained already, the excess is given back to the
+ * system.
+ *
+ * @param limit The limit in bytes. 0 disables pooling altogether.
+ *
+ * @return SR_OK upon success.
+ */
+SR_API int sr_pool_limit_set(uint64_t limit)
+{
+	struct pool_block *block;
+	int cls;
+
+	g_mutex_lock(&pool.mutex);
+	pool.limit = limit;
+	/* Drop the largest blocks first, they're the cheapest to refetch. */
+	for (cls = POOL_NUM_CLASSES - 1; cls >= 0; cls--) {
+		while (pool.retained > pool.limit && (block = pool.free[cls])) {
+			pool.free[cls] = block->next;
+			pool.retained -= class_size(cls);
+			block_free(block, class_size(cls));
+		}
+	}
+	g_mutex_unlock(&pool.mutex);
+
+	return SR_OK;
+}
+
+/**
+ * Enable or disable huge page backing of large pool blocks.
+ *
+ * This only affects blocks of POOL_MAP_MIN bytes or more which are newly
+ * allocated from the system. Reserved huge pages (MAP_HUGETLB) are tried
+ * first, then transparent huge pages. If neither is available, the blocks
+ * are backed by normal pages.
+ *
+ * @param enabled TRUE to back large blocks by huge pages, FALSE otherwise.
+ *
+ * @return SR_OK upon success.
+ */
+SR_API int sr_pool_hugepages_set(gboolean enabled)
+{
+	g_mutex_lock(&pool.mutex);
+	pool.hugepages = enabled;
+	g_mutex_unlock(&pool.mutex);
+
+	return SR_OK;
+}
+
+/**
+ * Give all free memory retained by the pool back to the system.
+ *
+ * This is called by sr_exit().
+ *
+ * @return SR_OK upon success.
+ */
+SR_API int sr_pool_flush(void)
+{
+	struct pool_block *block;
+	int cls;
+
+	g_mutex_lock(&pool.mutex);
+	for (cls = 0; cls < POOL_NUM_CLASSES; cls++) {
+		while ((block = pool.free[cls])) {
+			pool.free[cls] = block->next;
+			block_free(block, class_size(cls));
+		}
+	}
+	pool.retained = 0;
+	g_mutex_unlock(&pool.mutex);
+
+	return SR_OK;
+}
+
+/** @} */
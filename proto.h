@@ -42,14 +42,123 @@ SR_API int sr_log_callback_set(sr_log_callback_t cb, void *cb_data);
 SR_API int sr_log_callback_set_default(void);
 SR_API int sr_log_logdomain_set(const char *logdomain);
 SR_API char *sr_log_logdomain_get(void);
+SR_API int sr_log_async_set(gboolean async);
+SR_API int sr_log_async_flush(void);
+
+/*--- buffer.c --------------------------------------------------------------*/
+
+SR_API struct sr_buffer *sr_buffer_new(uint64_t size);
+SR_API struct sr_buffer *sr_buffer_new_full(void *data, uint64_t size,
+		sr_buffer_free_callback_t free_cb, void *cb_data);
+SR_API struct sr_buffer *sr_buffer_acquire(struct sr_buffer *buf);
+SR_API int sr_buffer_release(struct sr_buffer *buf);
 
 /*--- datastore.c -----------------------------------------------------------*/
 
 SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds);
+SR_API int sr_datastore_new_mapped(int unitsize, struct sr_datastore **ds);
+SR_API int sr_datastore_compression_set(struct sr_datastore *ds,
+		gboolean enabled);
+SR_API int sr_datastore_unitbits_set(struct sr_datastore *ds, int unitbits);
+SR_API int sr_datastore_summary_set(struct sr_datastore *ds, gboolean enabled);
+SR_API int sr_datastore_edges_set(struct sr_datastore *ds, gboolean enabled);
+SR_API int sr_datastore_reserve(struct sr_datastore *ds, uint64_t num_units);
 SR_API int sr_datastore_destroy(struct sr_datastore *ds);
 SR_API int sr_datastore_put(struct sr_datastore *ds, void *data,
-			    unsigned int length, int in_unitsize,
+			    uint64_t length, int in_unitsize,
 			    const int *probelist);
+SR_API int sr_datastore_put_rle(struct sr_datastore *ds,
+		const struct sr_datafeed_logic_rle *rle);
+SR_API int sr_datastore_get_range(struct sr_datastore *ds,
+		uint64_t start_unit, uint64_t count, void *buf);
+SR_API int sr_datastore_iter_init(struct sr_datastore *ds,
+		struct sr_datastore_iter *iter, uint64_t start_unit,
+		uint64_t count);
+SR_API gboolean sr_datastore_iter_next(struct sr_datastore_iter *iter,
+		const void **data, uint64_t *length);
+SR_API int sr_datastore_summary_get(struct sr_datastore *ds,
+		uint64_t start_unit, uint64_t count, uint64_t width,
+		struct sr_datastore_summary *summary);
+SR_API gboolean sr_datastore_edge_next(struct sr_datastore *ds, int probe,
+		uint64_t from, uint64_t *unit);
+SR_API gboolean sr_datastore_edge_prev(struct sr_datastore *ds, int probe,
+		uint64_t from, uint64_t *unit);
+SR_API int sr_datastore_edge_count(struct sr_datastore *ds, int probe,
+		uint64_t start_unit, uint64_t count, uint64_t *num);
+
+/*--- datastore_analog.c ----------------------------------------------------*/
+
+SR_API int sr_analog_datastore_new(int num_probes, int format,
+		struct sr_analog_datastore **ads);
+SR_API int sr_analog_datastore_scales_set(struct sr_analog_datastore *ads,
+		const struct sr_analog_scale *scales);
+SR_API int sr_analog_datastore_summary_set(struct sr_analog_datastore *ads,
+		gboolean enabled);
+SR_API int sr_analog_datastore_destroy(struct sr_analog_datastore *ads);
+SR_API int sr_analog_datastore_put(struct sr_analog_datastore *ads,
+		const struct sr_datafeed_packet *packet);
+SR_API int sr_analog_datastore_get_range(struct sr_analog_datastore *ads,
+		int probe, uint64_t start_sample, uint64_t count, float *buf);
+SR_API int sr_analog_datastore_summary_get(struct sr_analog_datastore *ads,
+		int probe, uint64_t start_sample, uint64_t count,
+		uint64_t width, struct sr_analog_datastore_summary *summary);
+
+/*--- logic_stats.c ---------------------------------------------------------*/
+
+SR_API int sr_logic_stats_new(struct sr_logic_stats **stats);
+SR_API int sr_logic_stats_destroy(struct sr_logic_stats *stats);
+SR_API int sr_logic_stats_reset(struct sr_logic_stats *stats,
+		uint64_t samplerate);
+SR_API int sr_logic_stats_feed(struct sr_logic_stats *stats,
+		const uint8_t *data, uint64_t length, uint16_t unitsize);
+SR_API int sr_logic_stats_feed_rle(struct sr_logic_stats *stats,
+		const struct sr_datafeed_logic_rle *rle);
+SR_API int sr_logic_stats_get(const struct sr_logic_stats *stats, int probe,
+		struct sr_probe_stats *probe_stats);
+
+/*--- pool.c ----------------------------------------------------------------*/
+
+SR_API void *sr_pool_alloc(uint64_t size);
+SR_API void sr_pool_free(void *mem, uint64_t size);
+SR_API void *sr_pool_reserve(uint64_t size);
+SR_API void sr_pool_release(void *mem, uint64_t size);
+SR_API int sr_pool_limit_set(uint64_t limit);
+SR_API int sr_pool_hugepages_set(gboolean enabled);
+SR_API int sr_pool_flush(void);
+
+/*--- rle.c -----------------------------------------------------------------*/
+
+SR_API uint64_t sr_logic_rle_num_samples(
+		const struct sr_datafeed_logic_rle *rle);
+SR_API int sr_logic_rle_expand(const struct sr_datafeed_logic_rle *rle,
+		uint64_t *run, uint64_t *offset, void *buf, uint64_t size,
+		uint64_t *length);
+
+/*--- trigger.c -------------------------------------------------------------*/
+
+SR_API int sr_trigger_new(const struct sr_dev_inst *sdi,
+		uint64_t pretrigger_samples, struct sr_trigger **trigger);
+SR_API int sr_trigger_destroy(struct sr_trigger *trigger);
+SR_API int sr_trigger_reset(struct sr_trigger *trigger);
+SR_API gboolean sr_trigger_find(struct sr_trigger *trigger,
+		const uint8_t *data, uint64_t length, uint16_t unitsize,
+		uint64_t *used);
+
+/*--- decimate.c ------------------------------------------------------------*/
+
+SR_API int sr_decimator_new(uint64_t factor, int mode,
+		struct sr_decimator **decimator);
+SR_API int sr_decimator_destroy(struct sr_decimator *decimator);
+SR_API int sr_decimator_reset(struct sr_decimator *decimator);
+SR_API int sr_decimate_logic(struct sr_decimator *decimator,
+		const uint8_t *data, uint64_t length, uint16_t unitsize,
+		uint8_t *out, uint64_t *length_out);
+
+/*--- analog.c --------------------------------------------------------------*/
+
+SR_API uint64_t sr_analog_raw_size(const struct sr_datafeed_analog_raw *raw);
+SR_API int sr_analog_raw_to_float(const struct sr_datafeed_analog_raw *raw,
+		float *out);
 
 /*--- device.c --------------------------------------------------------------*/
 
@@ -62,6 +171,8 @@ SR_API int sr_dev_trigger_set(const struct sr_dev_inst *sdi, int probenum,
 SR_API gboolean sr_dev_has_hwcap(const struct sr_dev_inst *sdi, int hwcap);
 SR_API int sr_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 		const void *value);
+SR_API int sr_dev_stats_get(const struct sr_dev_inst *sdi,
+		struct sr_dev_stats *stats);
 SR_API GSList *sr_dev_inst_list(const struct sr_dev_driver *driver);
 SR_API int sr_dev_inst_clear(const struct sr_dev_driver *driver);
 
@@ -71,13 +182,30 @@ SR_API int sr_filter_probes(int in_unitsize, int out_unitsize,
 			    const int *probelist, const uint8_t *data_in,
 			    uint64_t length_in, uint8_t **data_out,
 			    uint64_t *length_out);
+SR_API int sr_filter_probes_buf(int in_unitsize, int out_unitsize,
+				const int *probelist, const uint8_t *data_in,
+				uint64_t length_in, uint8_t *data_out,
+				uint64_t *length_out);
+SR_API gboolean sr_filter_probes_identity(int in_unitsize, int out_unitsize,
+					  const int *probelist);
+SR_API int sr_logic_pack(const uint8_t *in, uint64_t num_samples,
+			 int unitbits, uint8_t *out, uint64_t offset);
+SR_API int sr_logic_unpack(const uint8_t *in, uint64_t offset,
+			   uint64_t num_samples, int unitbits, uint8_t *out);
+SR_API int sr_filter_probes_packed(int in_unitsize, int out_unitbits,
+				   const int *probelist, const uint8_t *data_in,
+				   uint64_t length_in, uint8_t *data_out,
+				   uint64_t *length_out);
 
 /*--- hwdriver.c ------------------------------------------------------------*/
 
 SR_API struct sr_dev_driver **sr_driver_list(void);
+SR_API struct sr_dev_driver *sr_driver_find(const char *name);
 SR_API int sr_driver_init(struct sr_context *ctx,
 		struct sr_dev_driver *driver);
 SR_API GSList *sr_driver_scan(struct sr_dev_driver *driver, GSList *options);
+SR_API GSList *sr_scan_all(struct sr_context *ctx, const struct sr_scan *scans,
+		int num_scans, int timeout);
 SR_API int sr_info_get(struct sr_dev_driver *driver, int id,
 		const void **data, const struct sr_dev_inst *sdi);
 SR_API gboolean sr_driver_hwcap_exists(struct sr_dev_driver *driver, int hwcap);
@@ -86,6 +214,13 @@ SR_API const struct sr_hwcap_option *sr_drvopt_name_get(const char *optname);
 SR_API const struct sr_hwcap_option *sr_devopt_get(int opt);
 SR_API const struct sr_hwcap_option *sr_devopt_name_get(const char *optname);
 
+/*--- hotplug.c -------------------------------------------------------------*/
+
+SR_API int sr_hotplug_enable(struct sr_context *ctx, sr_hotplug_callback_t cb,
+		void *cb_data);
+SR_API int sr_hotplug_disable(struct sr_context *ctx);
+SR_API int sr_hotplug_handle_events(struct sr_context *ctx, int timeout);
+
 /*--- session.c -------------------------------------------------------------*/
 
 typedef void (*sr_datafeed_callback_t)(const struct sr_dev_inst *sdi,
@@ -93,14 +228,45 @@ typedef void (*sr_datafeed_callback_t)(const struct sr_dev_inst *sdi,
 
 /* Session setup */
 SR_API int sr_session_load(const char *filename);
+SR_API int sr_session_load_lazy(const char *filename);
+SR_API int sr_session_index_get(const struct sr_dev_inst *sdi,
+		uint64_t *num_units, struct sr_datastore **ds);
+SR_API int sr_session_index_wait(void);
 SR_API struct sr_session *sr_session_new(void);
+SR_API struct sr_session *sr_session_current(void);
+SR_API int sr_session_current_set(struct sr_session *s);
 SR_API int sr_session_destroy(void);
 SR_API int sr_session_dev_remove_all(void);
 SR_API int sr_session_dev_add(const struct sr_dev_inst *sdi);
+SR_API int sr_session_threaded_set(gboolean threaded);
+SR_API gboolean sr_session_threaded_get(void);
+SR_API int sr_session_coalesce_set(uint64_t size, int latency);
+SR_API int sr_session_probe_filter_set(gboolean enabled);
+SR_API int sr_session_rle_set(gboolean enabled);
+SR_API int sr_session_analog_raw_set(gboolean enabled);
+SR_API int sr_session_decimate_set(uint64_t factor, int mode);
+SR_API int sr_session_probe_stats_set(gboolean enabled);
+SR_API int sr_session_probe_stats_get(const struct sr_dev_inst *sdi,
+		int probe, struct sr_probe_stats *stats);
+SR_API int sr_session_sync_set(gboolean enabled);
+SR_API int sr_session_merge_set(const struct sr_dev_inst *sdi_a,
+		const struct sr_dev_inst *sdi_b);
 
 /* Datafeed setup */
 SR_API int sr_session_datafeed_callback_remove_all(void);
 SR_API int sr_session_datafeed_callback_add(sr_datafeed_callback_t cb);
+SR_API int sr_session_datafeed_callback_add_async(sr_datafeed_callback_t cb,
+		unsigned int queue_size);
+SR_API int sr_session_stats_set(gboolean enabled);
+SR_API int sr_session_stats_get(unsigned int index,
+		struct sr_datafeed_stats *stats);
+
+/* Transforms */
+SR_API int sr_session_transform_add(struct sr_transform *t);
+SR_API int sr_session_transform_remove_all(void);
+SR_API int sr_transform_send(struct sr_transform *t,
+		const struct sr_dev_inst *sdi,
+		struct sr_datafeed_packet *packet);
 
 /* Session control */
 SR_API int sr_session_start(void);
@@ -109,23 +275,105 @@ SR_API int sr_session_halt(void);
 SR_API int sr_session_stop(void);
 SR_API int sr_session_save(const char *filename,
 		const struct sr_dev_inst *sdi, struct sr_datastore *ds);
+SR_API int sr_session_save_analog(const char *filename,
+		const struct sr_dev_inst *sdi, struct sr_datastore *ds,
+		const struct sr_analog_datastore *ads);
+SR_API int sr_session_compression_set(int codec, int level);
+SR_API int sr_session_writer_new(const char *filename,
+		const struct sr_dev_inst *sdi, int unitsize,
+		struct sr_session_writer **writer);
+SR_API int sr_session_writer_append(struct sr_session_writer *writer,
+		const struct sr_datafeed_packet *packet);
+SR_API int sr_session_writer_close(struct sr_session_writer *writer);
+SR_API int sr_session_file_compare(const char *filename1,
+		const char *filename2, gboolean *equal, uint64_t *first_diff);
 SR_API int sr_session_source_add(int fd, int events, int timeout,
 		sr_receive_data_callback_t cb, void *cb_data);
 SR_API int sr_session_source_add_pollfd(GPollFD *pollfd, int timeout,
 		sr_receive_data_callback_t cb, void *cb_data);
 SR_API int sr_session_source_add_channel(GIOChannel *channel, int events,
 		int timeout, sr_receive_data_callback_t cb, void *cb_data);
+SR_API int sr_session_source_timeout_set(int fd, int timeout);
+SR_API int sr_session_source_timeout_set_pollfd(GPollFD *pollfd, int timeout);
+SR_API int sr_session_source_timeout_set_channel(GIOChannel *channel,
+		int timeout);
+SR_API int sr_session_source_idle_wait(uint64_t wait_us);
 SR_API int sr_session_source_remove(int fd);
 SR_API int sr_session_source_remove_pollfd(GPollFD *pollfd);
 SR_API int sr_session_source_remove_channel(GIOChannel *channel);
 
+/*--- recorder.c ------------------------------------------------------------*/
+
+SR_API int sr_recorder_new(const char *filename,
+		const struct sr_dev_inst *sdi, int unitsize,
+		struct sr_recorder **recorder);
+SR_API int sr_recorder_ring_set(struct sr_recorder *recorder,
+		uint64_t max_bytes, uint64_t max_msec);
+SR_API int sr_recorder_direct_set(struct sr_recorder *recorder,
+		gboolean enabled);
+SR_API int sr_recorder_append(struct sr_recorder *recorder,
+		const struct sr_datafeed_packet *packet);
+SR_API int sr_recorder_close(struct sr_recorder *recorder);
+
 /*--- input/input.c ---------------------------------------------------------*/
 
 SR_API struct sr_input_format **sr_input_list(void);
+SR_API int sr_input_begin(struct sr_input *in);
+SR_API int sr_input_receive(struct sr_input *in, const void *buf,
+		uint64_t len);
+SR_API int sr_input_end(struct sr_input *in);
+SR_API int sr_input_source_add(struct sr_input *in, int fd);
+
+/*--- transform/transform.c -------------------------------------------------*/
+
+SR_API struct sr_transform_format **sr_transform_list(void);
 
 /*--- output/output.c -------------------------------------------------------*/
 
 SR_API struct sr_output_format **sr_output_list(void);
+SR_API int sr_output_data(struct sr_output *o, const uint8_t *data_in,
+		uint64_t length_in, struct sr_output_sink *sink);
+SR_API int sr_output_data_rle(struct sr_output *o,
+		const struct sr_datafeed_logic_rle *rle,
+		struct sr_output_sink *sink);
+SR_API int sr_output_event(struct sr_output *o, int event_type,
+		struct sr_output_sink *sink);
+SR_API int sr_output_recv(struct sr_output *o,
+		const struct sr_datafeed_packet *packet,
+		struct sr_output_sink *sink);
+
+/*--- output/runner.c -------------------------------------------------------*/
+
+SR_API struct sr_output_runner *sr_output_runner_new(struct sr_output *o,
+		struct sr_output_sink *sink, int num_threads);
+SR_API int sr_output_runner_send(struct sr_output_runner *runner,
+		const struct sr_datafeed_packet *packet);
+SR_API int sr_output_runner_wait(struct sr_output_runner *runner);
+SR_API int sr_output_runner_destroy(struct sr_output_runner *runner);
+
+/*--- output/sink.c ---------------------------------------------------------*/
+
+SR_API struct sr_output_sink *sr_output_sink_buffer_new(void);
+SR_API struct sr_output_sink *sr_output_sink_fd_new(int fd);
+SR_API struct sr_output_sink *sr_output_sink_iovec_new(void);
+SR_API struct sr_output_sink *sr_output_sink_compress_new(
+		struct sr_output_sink *next, int method, int level,
+		int num_threads);
+SR_API int sr_output_sink_destroy(struct sr_output_sink *sink);
+SR_API int sr_output_sink_reset(struct sr_output_sink *sink);
+SR_API int sr_output_sink_finish(struct sr_output_sink *sink);
+SR_API uint8_t *sr_output_sink_reserve(struct sr_output_sink *sink,
+		uint64_t length);
+SR_API int sr_output_sink_commit(struct sr_output_sink *sink,
+		uint64_t length);
+SR_API int sr_output_sink_write(struct sr_output_sink *sink,
+		const void *data, uint64_t length);
+SR_API int sr_output_sink_writev(struct sr_output_sink *sink,
+		const struct sr_output_iov *iov, int iovcnt);
+SR_API int sr_output_sink_data_get(struct sr_output_sink *sink,
+		const uint8_t **data, uint64_t *length);
+SR_API int sr_output_sink_iovec_get(struct sr_output_sink *sink,
+		const struct sr_output_iov **iov, int *iovcnt);
 
 /*--- strutil.c -------------------------------------------------------------*/
 
@@ -0,0 +1,537 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE /* For O_DIRECT. */
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "recorder: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/**
+ * @file
+ *
+ * Recording logic data to disk as it is captured.
+ */
+
+/**
+ * @addtogroup grp_session
+ *
+ * @{
+ */
+
+/** @cond PRIVATE */
+/* Size of each of the two buffers, in units. */
+#define RECORDER_BUF_UNITS (2 * 1024 * 1024)
+/* Size of a part file, in buffers. */
+#define RECORDER_PART_BUFS 8
+/* Writes which aren't a multiple of this can't use O_DIRECT. */
+#define RECORDER_ALIGN 4096
+/* Only Windows tells text from binary files, and needs to be told. */
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+/** @endcond */
+
+static uint64_t part_units(void)
+{
+	return (uint64_t)RECORDER_BUF_UNITS * RECORDER_PART_BUFS;
+}
+
+static char *part_name(const struct sr_recorder *rec, unsigned int n)
+{
+	return g_strdup_printf("%s.part%u", rec->filename, n);
+}
+
+static int part_open(struct sr_recorder *rec)
+{
+	char *name;
+	int flags;
+
+	if (!(name = part_name(rec, rec->next_part)))
+		return SR_ERR_MALLOC;
+
+	flags = O_WRONLY | O_CREAT | O_TRUNC | O_BINARY;
+#ifdef O_DIRECT
+	if (rec->direct) {
+		rec->fd = g_open(name, flags | O_DIRECT, 0644);
+		if (rec->fd == -1 && errno == EINVAL) {
+			sr_warn("No O_DIRECT on '%s', writing it buffered.",
+				name);
+			rec->direct = FALSE;
+		}
+	}
+	if (!rec->direct)
+#endif
+		rec->fd = g_open(name, flags, 0644);
+
+	if (rec->fd == -1) {
+		sr_err("Failed to create '%s': %s.", name, g_strerror(errno));
+		g_free(name);
+		return SR_ERR;
+	}
+	g_free(name);
+	rec->next_part++;
+
+	return SR_OK;
+}
+
+/* Remove the oldest parts beyond the ring limits. */
+static void ring_trim(struct sr_recorder *rec)
+{
+	uint64_t samplerate, max_parts, n;
+	char *name;
+
+	g_mutex_lock(&rec->mutex);
+	samplerate = rec->samplerate;
+	g_mutex_unlock(&rec->mutex);
+
+	max_parts = 0;
+	if (rec->max_bytes)
+		max_parts = MAX(rec->max_bytes /
+				(rec->buf_size * RECORDER_PART_BUFS), 1);
+	if (rec->max_msec && samplerate) {
+		n = (samplerate * rec->max_msec / 1000
+		     + part_units() - 1) / part_units();
+		n = MAX(n, 1);
+		max_parts = max_parts ? MIN(max_parts, n) : n;
+	}
+
+	while (max_parts && rec->next_part - rec->first_part > max_parts) {
+		if ((name = part_name(rec, rec->first_part))) {
+			g_unlink(name);
+			g_free(name);
+		}
+		rec->first_part++;
+		rec->dropped_units += part_units();
+	}
+}
+
+/* Write a buffer to the end of the current part. */
+static int buf_write(struct sr_recorder *rec, const uint8_t *buf,
+		     uint64_t len)
+{
+	uint64_t done;
+	ssize_t ret;
+	int err;
+
+	if (rec->fd == -1 && (err = part_open(rec)) != SR_OK)
+		return err;
+
+#ifdef O_DIRECT
+	/* Only the last write can be short; do it the normal way. */
+	if (rec->direct && len % RECORDER_ALIGN)
+		fcntl(rec->fd, F_SETFL, fcntl(rec->fd, F_GETFL) & ~O_DIRECT);
+#endif
+
+	for (done = 0; done < len; done += ret) {
+		if ((ret = write(rec->fd, buf + done, len - done)) == -1) {
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			sr_err("Failed to write part %u: %s.",
+			       rec->next_part - 1, g_strerror(errno));
+			return SR_ERR;
+		}
+	}
+	rec->part_fill += len;
+	rec->num_units += len / rec->unitsize;
+
+	if (rec->part_fill == rec->buf_size * RECORDER_PART_BUFS) {
+		close(rec->fd);
+		rec->fd = -1;
+		rec->part_fill = 0;
+		ring_trim(rec);
+	}
+
+	return SR_OK;
+}
+
+static gpointer writer_thread(gpointer data)
+{
+	struct sr_recorder *rec;
+	const uint8_t *buf;
+	uint64_t len;
+	int ret;
+
+	rec = data;
+
+	g_mutex_lock(&rec->mutex);
+	while (TRUE) {
+		while (rec->pending == -1 && !rec->quit)
+			g_cond_wait(&rec->cond, &rec->mutex);
+		if (rec->pending == -1)
+			break;
+		buf = rec->bufs[rec->pending];
+		len = rec->pending_len;
+		g_mutex_unlock(&rec->mutex);
+
+		ret = buf_write(rec, buf, len);
+
+		g_mutex_lock(&rec->mutex);
+		if (ret != SR_OK && rec->ret == SR_OK)
+			rec->ret = ret;
+		rec->pending = -1;
+		g_cond_broadcast(&rec->cond);
+	}
+	g_mutex_unlock(&rec->mutex);
+
+	return NULL;
+}
+
+/* Hand the active buffer to the writer thread, and switch to the other. */
+static int buf_submit(struct sr_recorder *rec)
+{
+	int ret;
+
+	g_mutex_lock(&rec->mutex);
+	while (rec->pending != -1)
+		g_cond_wait(&rec->cond, &rec->mutex);
+	if ((ret = rec->ret) == SR_OK) {
+		rec->pending = rec->active;
+		rec->pending_len = rec->fill;
+		g_cond_broadcast(&rec->cond);
+	}
+	g_mutex_unlock(&rec->mutex);
+
+	if (ret != SR_OK)
+		return ret;
+
+	rec->active ^= 1;
+	rec->fill = 0;
+
+	return SR_OK;
+}
+
+static void rec_free(struct sr_recorder *rec)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (rec->bufs[i])
+			sr_pool_free(rec->bufs[i], rec->buf_size);
+	}
+	g_mutex_clear(&rec->mutex);
+	g_cond_clear(&rec->cond);
+	g_free(rec->filename);
+	g_free(rec);
+}
+
+/**
+ * Start recording logic data to disk.
+ *
+ * A recorder takes a device's logic packets off the session bus (see
+ * sr_recorder_append()) and writes them to disk as they come in, for
+ * captures which are too long to keep in memory. It collects the data
+ * in one of two large buffers while a thread of its own writes the other
+ * one out, to raw part files next to 'filename' ('filename'.part1, .part2,
+ * ...). Memory use is fixed at the two buffers, no matter how long the
+ * capture runs. When the recorder is closed, the parts are turned into a
+ * session file, and removed.
+ *
+ * With ring limits (see sr_recorder_ring_set()), old parts are removed
+ * as new ones are written, so only the end of the capture is kept.
+ *
+ * @param filename The name of the session file to write. Must not be NULL.
+ *                 An existing file of that name is replaced.
+ * @param sdi The device instance from which the data is captured. Must not
+ *            be NULL.
+ * @param unitsize The unit size (>= 1) of the logic data to be written.
+ * @param recorder Pointer to a variable which will hold the newly created
+ *                 recorder. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR upon
+ *         other errors.
+ */
+SR_API int sr_recorder_new(const char *filename,
+		const struct sr_dev_inst *sdi, int unitsize,
+		struct sr_recorder **recorder)
+{
+	struct sr_recorder *rec;
+
+	if (!filename || !sdi || !recorder) {
+		sr_err("%s: filename, sdi or recorder was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (unitsize < 1) {
+		sr_err("%s: unitsize was %d, but it must be >= 1", __func__,
+		       unitsize);
+		return SR_ERR_ARG;
+	}
+
+	if (!(rec = g_try_malloc0(sizeof(struct sr_recorder)))) {
+		sr_err("%s: recorder malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	g_mutex_init(&rec->mutex);
+	g_cond_init(&rec->cond);
+	rec->sdi = sdi;
+	rec->unitsize = unitsize;
+	rec->pending = -1;
+	rec->fd = -1;
+	rec->ret = SR_OK;
+	rec->first_part = rec->next_part = 1;
+
+	/* Large blocks come from the pool page aligned, as O_DIRECT needs. */
+	rec->buf_size = (uint64_t)RECORDER_BUF_UNITS * unitsize;
+	rec->filename = g_strdup(filename);
+	rec->bufs[0] = sr_pool_alloc(rec->buf_size);
+	rec->bufs[1] = sr_pool_alloc(rec->buf_size);
+	if (!rec->filename || !rec->bufs[0] || !rec->bufs[1]) {
+		sr_err("%s: recorder buffer malloc failed", __func__);
+		rec_free(rec);
+		return SR_ERR_MALLOC;
+	}
+
+	if (!(rec->thread = g_thread_try_new("sr-recorder", writer_thread,
+					     rec, NULL))) {
+		sr_err("%s: failed to start writer thread", __func__);
+		rec_free(rec);
+		return SR_ERR;
+	}
+	*recorder = rec;
+
+	return SR_OK;
+}
+
+/**
+ * Keep only the end of a recording.
+ *
+ * Once the parts on disk exceed 'max_bytes', or cover more than
+ * 'max_msec' at the samplerate from SR_DF_META_LOGIC, the oldest ones
+ * are removed. Parts are removed as a whole, so somewhat more than the
+ * limit is kept. Must be called before the first sr_recorder_append().
+ *
+ * @param recorder The recorder. Must not be NULL.
+ * @param max_bytes The amount of data to keep, or 0 for no limit.
+ * @param max_msec The time span of data to keep (in ms), or 0 for no
+ *                 limit.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_recorder_ring_set(struct sr_recorder *recorder,
+		uint64_t max_bytes, uint64_t max_msec)
+{
+	if (!recorder) {
+		sr_err("%s: recorder was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	recorder->max_bytes = max_bytes;
+	recorder->max_msec = max_msec;
+
+	return SR_OK;
+}
+
+/**
+ * Write a recording's parts with O_DIRECT, bypassing the page cache.
+ *
+ * This keeps a long recording from pushing everything else out of the
+ * page cache. Where O_DIRECT isn't supported, the data is written the
+ * normal way. Must be called before the first sr_recorder_append().
+ *
+ * @param recorder The recorder. Must not be NULL.
+ * @param enabled TRUE to use O_DIRECT, FALSE not to (the default).
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_recorder_direct_set(struct sr_recorder *recorder,
+		gboolean enabled)
+{
+	if (!recorder) {
+		sr_err("%s: recorder was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+#ifndef O_DIRECT
+	if (enabled)
+		sr_warn("No O_DIRECT on this system, writing buffered.");
+	enabled = FALSE;
+#endif
+	recorder->direct = enabled;
+
+	return SR_OK;
+}
+
+/**
+ * Append a datafeed packet to a recording.
+ *
+ * SR_DF_LOGIC and SR_DF_LOGIC_RLE packets are recorded (the latter are
+ * expanded), and SR_DF_META_LOGIC packets set the samplerate; all other
+ * packet types are ignored. This can be called directly from a datafeed
+ * callback. It only waits for the disk if the buffer written last isn't
+ * done by the time the other one is full.
+ *
+ * @param recorder The recorder. Must not be NULL.
+ * @param packet The packet. Must not be NULL. Logic packets must have the
+ *               unit size the recorder was created with.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if data couldn't be written to disk.
+ */
+SR_API int sr_recorder_append(struct sr_recorder *recorder,
+		const struct sr_datafeed_packet *packet)
+{
+	const struct sr_datafeed_logic *logic;
+	const struct sr_datafeed_logic_rle *rle;
+	const struct sr_datafeed_meta_logic *meta;
+	struct sr_recorder *rec;
+	uint64_t done, size, run, offset;
+	int ret;
+
+	if (!recorder || !packet) {
+		sr_err("%s: recorder or packet was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+	rec = recorder;
+
+	switch (packet->type) {
+	case SR_DF_META_LOGIC:
+		meta = packet->payload;
+		g_mutex_lock(&rec->mutex);
+		rec->samplerate = meta->samplerate;
+		g_mutex_unlock(&rec->mutex);
+		return SR_OK;
+	case SR_DF_LOGIC:
+		logic = packet->payload;
+		if (logic->unitsize != rec->unitsize)
+			break;
+		for (done = 0; done < logic->length; done += size) {
+			size = MIN(logic->length - done,
+				   rec->buf_size - rec->fill);
+			memcpy(rec->bufs[rec->active] + rec->fill,
+			       (const uint8_t *)logic->data + done, size);
+			rec->fill += size;
+			if (rec->fill == rec->buf_size &&
+			    (ret = buf_submit(rec)) != SR_OK)
+				return ret;
+		}
+		return SR_OK;
+	case SR_DF_LOGIC_RLE:
+		rle = packet->payload;
+		if (rle->unitsize != rec->unitsize)
+			break;
+		run = offset = 0;
+		while (run < rle->num_runs) {
+			if ((ret = sr_logic_rle_expand(rle, &run, &offset,
+					rec->bufs[rec->active] + rec->fill,
+					rec->buf_size - rec->fill,
+					&size)) != SR_OK)
+				return ret;
+			rec->fill += size;
+			if (rec->fill == rec->buf_size &&
+			    (ret = buf_submit(rec)) != SR_OK)
+				return ret;
+		}
+		return SR_OK;
+	default:
+		return SR_OK;
+	}
+
+	sr_err("%s: unitsize doesn't match the recorder's (%d)", __func__,
+	       rec->unitsize);
+
+	return SR_ERR_ARG;
+}
+
+/**
+ * Finish a recording.
+ *
+ * The remaining data is written out, and the parts kept on disk are
+ * turned into the session file and removed. If that fails, they are left
+ * in place. The recorder is freed either way.
+ *
+ * @param recorder The recorder. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR if
+ *         data couldn't be written to disk.
+ */
+SR_API int sr_recorder_close(struct sr_recorder *recorder)
+{
+	struct sr_recorder *rec;
+	char **parts;
+	unsigned int i, num_parts;
+	int ret;
+
+	if (!recorder) {
+		sr_err("%s: recorder was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+	rec = recorder;
+
+	ret = SR_OK;
+	if (rec->fill)
+		ret = buf_submit(rec);
+
+	g_mutex_lock(&rec->mutex);
+	rec->quit = TRUE;
+	g_cond_broadcast(&rec->cond);
+	g_mutex_unlock(&rec->mutex);
+	g_thread_join(rec->thread);
+
+	if (rec->fd != -1)
+		close(rec->fd);
+	if (ret == SR_OK)
+		ret = rec->ret;
+
+	num_parts = rec->next_part - rec->first_part;
+	if (!(parts = g_try_malloc0(sizeof(char *) * (num_parts + 1)))) {
+		sr_err("%s: parts malloc failed", __func__);
+		rec_free(rec);
+		return SR_ERR_MALLOC;
+	}
+	for (i = 0; i < num_parts; i++) {
+		if (!(parts[i] = part_name(rec, rec->first_part + i)))
+			ret = SR_ERR_MALLOC;
+	}
+
+	if (ret == SR_OK)
+		ret = sr_session_file_save_parts(rec->filename, rec->sdi,
+				rec->unitsize, parts, num_parts, part_units(),
+				rec->num_units - rec->dropped_units);
+
+	if (ret == SR_OK) {
+		if (rec->dropped_units)
+			sr_info("Kept the last %" PRIu64 " samples, dropped "
+				"%" PRIu64 ".",
+				rec->num_units - rec->dropped_units,
+				rec->dropped_units);
+		for (i = 0; i < num_parts; i++)
+			g_unlink(parts[i]);
+	} else if (num_parts) {
+		sr_err("Failed to write '%s', the raw data is left in "
+		       "'%s.part*'.", rec->filename, rec->filename);
+	}
+
+	g_strfreev(parts);
+	rec_free(rec);
+
+	return ret;
+}
+
+/** @} */
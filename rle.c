@@ -0,0 +1,156 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "rle: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/**
+ * @file
+ *
+ * Helpers for run-length encoded logic data.
+ */
+
+/**
+ * @defgroup grp_rle Run-length logic data
+ *
+ * Helpers for run-length encoded logic data.
+ *
+ * Devices and input formats which already have their samples as a list
+ * of value changes can send them as SR_DF_LOGIC_RLE packets, where each
+ * run is a sample value along with the number of samples it is held for.
+ * A long idle stretch then takes 16 bytes on the datafeed bus, whatever
+ * the samplerate.
+ *
+ * Consumers which need every sample expand the runs with
+ * sr_logic_rle_expand(). Unless the frontend declares that all of its
+ * datafeed callbacks handle SR_DF_LOGIC_RLE (see sr_session_rle_set()),
+ * the session does that for them and delivers SR_DF_LOGIC packets only.
+ *
+ * @{
+ */
+
+/**
+ * Get the number of samples in a run-length encoded logic packet.
+ *
+ * @param rle The packet's payload. Must not be NULL.
+ *
+ * @return The sum of all run lengths.
+ */
+SR_API uint64_t sr_logic_rle_num_samples(
+		const struct sr_datafeed_logic_rle *rle)
+{
+	uint64_t i, num_samples;
+
+	num_samples = 0;
+	for (i = 0; i < rle->num_runs; i++)
+		num_samples += rle->runs[i].length;
+
+	return num_samples;
+}
+
+/* Fill 'count' units of 'unitsize' bytes with the given sample value. */
+static void fill_units(uint8_t *out, uint64_t value, uint16_t unitsize,
+		       uint64_t count)
+{
+	uint64_t done, n;
+	uint16_t b;
+
+	if (unitsize == 1) {
+		memset(out, value & 0xff, count);
+		return;
+	}
+
+	/* Little-endian, as in SR_DF_LOGIC data. */
+	for (b = 0; b < unitsize; b++)
+		out[b] = b < 8 ? (value >> (8 * b)) & 0xff : 0;
+
+	/* Double the filled part until it covers all units. */
+	for (done = 1; done < count; done += n) {
+		n = MIN(done, count - done);
+		memcpy(out + done * unitsize, out, n * unitsize);
+	}
+}
+
+/**
+ * Expand run-length encoded logic data into plain samples.
+ *
+ * Expansion starts at sample '*offset' of run '*run' in the packet, and
+ * stops when 'buf' is full or all runs have been expanded. Both '*run' and
+ * '*offset' are then advanced past the samples written, so that calling
+ * this again continues where it left off. This way packets of any size
+ * can be expanded in pieces of a fixed size. Start with both set to 0.
+ *
+ * The samples written to 'buf' have the packet's unitsize; they are laid
+ * out as in an SR_DF_LOGIC packet.
+ *
+ * @param rle The packet's payload. Must not be NULL.
+ * @param run Pointer to the index of the run to start at. Must not be NULL.
+ * @param offset Pointer to the number of samples of that run which have
+ *               been expanded already. Must not be NULL.
+ * @param buf The buffer to write the samples to. Must not be NULL.
+ * @param size The size of 'buf' in bytes. Must be at least the unitsize.
+ * @param length Pointer to where the number of bytes written to 'buf'
+ *               will be stored. This is 0 once all runs have been
+ *               expanded. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_logic_rle_expand(const struct sr_datafeed_logic_rle *rle,
+		uint64_t *run, uint64_t *offset, void *buf, uint64_t size,
+		uint64_t *length)
+{
+	const struct sr_logic_run *r;
+	uint8_t *out;
+	uint64_t avail, count;
+
+	if (!rle || !run || !offset || !buf || !length) {
+		sr_err("%s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (rle->unitsize == 0 || size < rle->unitsize) {
+		sr_err("%s: buffer smaller than one unit", __func__);
+		return SR_ERR_ARG;
+	}
+
+	out = buf;
+	avail = size / rle->unitsize;
+	while (avail && *run < rle->num_runs) {
+		r = &rle->runs[*run];
+		count = MIN(r->length - MIN(*offset, r->length), avail);
+		fill_units(out, r->value, rle->unitsize, count);
+		out += count * rle->unitsize;
+		avail -= count;
+		*offset += count;
+		if (*offset >= r->length) {
+			(*run)++;
+			*offset = 0;
+		}
+	}
+	*length = out - (uint8_t *)buf;
+
+	return SR_OK;
+}
+
+/** @} */
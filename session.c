@@ -21,10 +21,23 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <glib.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
+#if defined(HAVE_SYS_EPOLL_H)
+#define SESSION_USE_EPOLL
+#include <fcntl.h>
+#include <sys/epoll.h>
+#elif defined(HAVE_SYS_EVENT_H)
+#define SESSION_USE_KQUEUE
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
 /**
  * @file
  *
@@ -48,41 +61,523 @@ struct source {
 	 * being polled and will be used to match the source when removing it again.
 	 */
 	gintptr poll_object;
+
+	/* Whether the source is registered with the event backend. */
+	gboolean registered;
+
+	/* Monotonic time (in us) at which the timeout expires. */
+	gint64 deadline;
+	/* Position in the timer heap, or -1 if the source has no timeout. */
+	int timer_pos;
+
+	/*
+	 * Monotonic time (in us) before which an idle source doesn't want
+	 * to be called, see sr_session_source_idle_wait().
+	 */
+	gint64 idle_until;
+};
+
+/** @cond PRIVATE */
+/* Number of packets each device's ring can hold in threaded mode. */
+#define SESSION_RING_SIZE 1024
+/* Fill level at which a device's ring counts as congested. */
+#define SESSION_RING_HIGH_WATER (SESSION_RING_SIZE * 3 / 4)
+/* Upper bound for a single sleep on an empty or full ring (in us). */
+#define SESSION_RING_WAIT_US 10000
+/* Initial number of entries in the sources and pollfds arrays. */
+#define SESSION_SOURCES_MIN 8
+/* Maximum number of events fetched by one epoll/kqueue wait. */
+#define SESSION_MAX_EVENTS 64
+/*
+ * Latency histogram buckets: 8 buckets per power of two (in us), which
+ * covers up to 2^41 us with an error of at most 12.5%.
+ */
+#define SESSION_STATS_SUB_BUCKETS 8
+#define SESSION_STATS_BUCKETS (SESSION_STATS_SUB_BUCKETS * 40)
+/* Size of the SR_DF_LOGIC packets SR_DF_LOGIC_RLE data is expanded into. */
+#define SESSION_RLE_EXPAND_SIZE (256 * 1024)
+/* Default number of packets an asynchronous datafeed callback can queue. */
+#define SESSION_ASYNC_QUEUE_SIZE 64
+/*
+ * Time (in us) the idle sources get to run, round-robin, before the
+ * descriptors and timers are checked again.
+ */
+#define SESSION_IDLE_QUANTUM_US 2000
+/** @endcond */
+
+/* Operations for backend_ctl(). */
+enum {
+	BACKEND_ADD,
+	BACKEND_MOD,
+	BACKEND_DEL,
+};
+
+/*
+ * Bounded single-producer/single-consumer queue of packets. The producer
+ * is the acquisition thread, the consumer is the thread which called
+ * sr_session_run(). Each index is only ever written by one side.
+ */
+struct packet_ring {
+	const struct sr_dev_inst *sdi;
+	struct sr_datafeed_packet *slots[SESSION_RING_SIZE];
+	/* Next slot to write, only modified by the producer. */
+	volatile gint head;
+	/* Next slot to read, only modified by the consumer. */
+	volatile gint tail;
+};
+
+/*
+ * Logic data of one device which has been sent, but not dispatched yet
+ * (see sr_session_coalesce_set()). Only used by the thread which calls
+ * sr_session_send(), i.e. the acquisition thread in threaded mode.
+ */
+struct coalescer {
+	const struct sr_dev_inst *sdi;
+	/* Collects the pending data, NULL while nothing is pending. */
+	struct sr_buffer *buf;
+	uint64_t length;
+	uint16_t unitsize;
+	/* Stamps of the first packet in the pending data. */
+	uint64_t offset;
+	gint64 timestamp;
+	/* Monotonic time (in us) by which the pending data must go out. */
+	gint64 deadline;
+};
+
+/*
+ * Number of logic samples a device has sent since its SR_DF_HEADER, for
+ * stamping its packets (see sr_session_send()). Only used by the thread
+ * which calls sr_session_send().
+ */
+struct feed_position {
+	const struct sr_dev_inst *sdi;
+	uint64_t samples;
+};
+
+/*
+ * Probe filter of one device (see sr_session_probe_filter_set()). Only
+ * used by the thread which runs the datafeed callbacks.
+ */
+struct probe_filter {
+	const struct sr_dev_inst *sdi;
+	/* The probe configuration the probe list was built for. */
+	uint64_t enabled_mask;
+	uint16_t in_unitsize;
+	/* Enabled probe indices, terminated with -1. */
+	int probelist[SR_MAX_NUM_PROBES + 1];
+	uint16_t out_unitsize;
+	gboolean identity;
+	/* Output of the last filter pass, reused once nobody holds it. */
+	struct sr_buffer *buf;
+};
+
+/*
+ * Decimator of one device (see sr_session_decimate_set()). Only used by
+ * the thread which runs the datafeed callbacks.
+ */
+struct session_decimator {
+	const struct sr_dev_inst *sdi;
+	struct sr_decimator *decimator;
+	/* Output of the last pass, reused once nobody holds it. */
+	struct sr_buffer *buf;
+};
+
+/*
+ * Statistics of one device's probes (see sr_session_probe_stats_set()).
+ * Only used by the thread which runs the datafeed callbacks, or with the
+ * dispatch mutex held.
+ */
+struct session_probe_stats {
+	const struct sr_dev_inst *sdi;
+	struct sr_logic_stats *stats;
+};
+
+/*
+ * One of the two logic streams being merged (see sr_session_merge_set()),
+ * holding its samples which have no partner from the other one yet.
+ */
+struct merge_stream {
+	const struct sr_dev_inst *sdi;
+	uint8_t *data;
+	uint64_t len;
+	uint64_t size;
+	uint16_t unitsize;
+	/* Samples still to be dropped, to line up with the other stream. */
+	uint64_t skip;
+	/* Number of samples taken in so far. */
+	uint64_t received;
+	/* Reception time of the last samples taken in. */
+	gint64 timestamp;
+	gboolean have_header;
+	gboolean have_meta;
+	gboolean have_sync;
+	gboolean ended;
+	struct sr_datafeed_header header;
+	struct sr_datafeed_meta_logic meta;
+	struct sr_datafeed_sync sync;
+};
+
+struct session_merge {
+	struct merge_stream streams[2];
+	/* Output of the last merge, reused once nobody holds it. */
+	struct sr_buffer *buf;
+	/* Number of merged samples delivered so far. */
+	uint64_t emitted;
+	/* An SR_DF_TRIGGER is due before merged sample 'trigger_pos'. */
+	gboolean trigger_pending;
+	gboolean triggered;
+	uint64_t trigger_pos;
+	gint64 trigger_timestamp;
+	gboolean meta_sent;
+	/* Set if the streams can't be merged; they are passed on as is. */
+	gboolean passthrough;
+};
+
+/*
+ * Statistics of one datafeed callback (see sr_session_stats_set()). The
+ * session keeps one of these for each entry in datafeed_callbacks, in the
+ * same order.
+ */
+struct datafeed_stats {
+	uint64_t calls;
+	uint64_t bytes;
+	uint64_t latency_max;
+	uint64_t histogram[SESSION_STATS_BUCKETS];
+	/* Set if the callback runs on its own thread. */
+	struct async_consumer *async;
+};
+
+/*
+ * A packet queued for the asynchronous datafeed callbacks. All of them
+ * share one copy, the last one to be done with it frees it.
+ */
+struct async_packet {
+	const struct sr_dev_inst *sdi;
+	struct sr_datafeed_packet *packet;
+	gint refcount;
+	/* Whether statistics were enabled when the packet was sent. */
+	gboolean stats;
+};
+
+/*
+ * A datafeed callback which runs on a worker thread of its own (see
+ * sr_session_datafeed_callback_add_async()), fed through a bounded
+ * queue. The mutex protects everything below it, and the statistics.
+ */
+struct async_consumer {
+	struct sr_session *owner;
+	sr_datafeed_callback_t cb;
+	struct datafeed_stats *stats;
+	GThread *thread;
+	GMutex mutex;
+	/* Signalled whenever anything below changes. */
+	GCond cond;
+	struct async_packet **queue;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+	/* Set while the callback is running. */
+	gboolean busy;
+	gboolean stop;
 };
 
-/* There can only be one session at a time. */
-/* 'session' is not static, it's used elsewhere (via 'extern'). */
-struct sr_session *session;
+/* Set (non-NULL) on the acquisition thread of a threaded session. */
+static GPrivate acquisition_thread_key = G_PRIVATE_INIT(NULL);
+
+static void coalescer_remove(struct coalescer *c);
+static void coalescers_flush_expired(void);
+static void coalescers_flush_all(void);
+static int coalescers_timeout(void);
+static void source_dispatch(unsigned int i, int revents);
+static void probe_filters_free(void);
+static void decimators_free(void);
+static void probe_stats_free(void);
+static void merge_free(void);
+static void merge_reset(struct session_merge *m);
+
+/*
+ * Each thread works on its current session, see sr_session_current().
+ * Threads which didn't pick one use the most recently created session.
+ */
+static GPrivate current_session_key = G_PRIVATE_INIT(NULL);
+static struct sr_session *default_session = NULL;
+
+static inline struct sr_session *current_session(void)
+{
+	struct sr_session *s;
+
+	if ((s = g_private_get(&current_session_key)))
+		return s;
+
+	return g_atomic_pointer_get(&default_session);
+}
+
+/* The session functions below all work on the current session. */
+#define session (current_session())
+
+/*
+ * Event loop backends. With epoll (Linux) or kqueue (BSD, Mac OS X) the
+ * sources are registered once when they are added, and a wait only
+ * returns the sources which are actually ready. Otherwise, or if the
+ * backend fails, g_poll() is used on the "pollfds" array, which is kept
+ * up to date in either case.
+ */
+
+static int backend_open(void)
+{
+	int fd;
+
+#if defined(SESSION_USE_EPOLL)
+	fd = epoll_create(SESSION_MAX_EVENTS);
+#elif defined(SESSION_USE_KQUEUE)
+	fd = kqueue();
+#else
+	fd = -1;
+#endif
+
+#if defined(SESSION_USE_EPOLL) || defined(SESSION_USE_KQUEUE)
+	if (fd < 0)
+		sr_warn("session: %s: using g_poll(), failed to create event "
+			"backend: %s", __func__, g_strerror(errno));
+	else
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+	return fd;
+}
+
+static void backend_close(void)
+{
+	if (session->backend_fd < 0)
+		return;
+
+	close(session->backend_fd);
+	session->backend_fd = -1;
+}
+
+/* Registering a source failed, continue with g_poll() from now on. */
+static void backend_fallback(unsigned int i)
+{
+	sr_warn("session: %s: can't register fd %d (%s), using g_poll()",
+		__func__, session->pollfds[i].fd, g_strerror(errno));
+	backend_close();
+}
+
+#if defined(SESSION_USE_EPOLL)
+
+/*
+ * Add, update or remove the registration of source 'i'. The registration
+ * carries the source's index, which is why a source which moves to a
+ * different index has to be updated.
+ */
+static int backend_ctl(unsigned int i, int op)
+{
+	struct epoll_event ev;
+	int events;
+
+	events = session->pollfds[i].events;
+	ev.events = 0;
+	if (events & G_IO_IN)
+		ev.events |= EPOLLIN;
+	if (events & G_IO_PRI)
+		ev.events |= EPOLLPRI;
+	if (events & G_IO_OUT)
+		ev.events |= EPOLLOUT;
+	ev.data.u64 = i;
+
+	if (op == BACKEND_ADD)
+		op = EPOLL_CTL_ADD;
+	else if (op == BACKEND_MOD)
+		op = EPOLL_CTL_MOD;
+	else
+		op = EPOLL_CTL_DEL;
+
+	return epoll_ctl(session->backend_fd, op, session->pollfds[i].fd, &ev);
+}
+
+/*
+ * Wait for events and run the callbacks of all ready sources. Returns the
+ * number of ready sources, 0 on timeout, or -1 upon errors.
+ */
+static int backend_dispatch(int timeout)
+{
+	struct epoll_event events[SESSION_MAX_EVENTS];
+	unsigned int i;
+	int ret, n, revents;
+
+	ret = epoll_wait(session->backend_fd, events, SESSION_MAX_EVENTS,
+			 timeout);
+	for (n = 0; n < ret; n++) {
+		i = events[n].data.u64;
+		revents = 0;
+		if (events[n].events & EPOLLIN)
+			revents |= G_IO_IN;
+		if (events[n].events & EPOLLPRI)
+			revents |= G_IO_PRI;
+		if (events[n].events & EPOLLOUT)
+			revents |= G_IO_OUT;
+		if (events[n].events & EPOLLERR)
+			revents |= G_IO_ERR;
+		if (events[n].events & EPOLLHUP)
+			revents |= G_IO_HUP;
+		source_dispatch(i, revents);
+	}
+
+	return ret;
+}
+
+#elif defined(SESSION_USE_KQUEUE)
+
+static int backend_ctl(unsigned int i, int op)
+{
+	struct kevent changes[2];
+	int n, fd, events, flags;
+
+	fd = session->pollfds[i].fd;
+	events = session->pollfds[i].events;
+	/* EV_ADD on an existing registration just updates it. */
+	flags = (op == BACKEND_DEL) ? EV_DELETE : EV_ADD;
+
+	n = 0;
+	if (events & (G_IO_IN | G_IO_PRI))
+		EV_SET(&changes[n++], fd, EVFILT_READ, flags, 0, 0,
+		       (void *)(uintptr_t)i);
+	if (events & G_IO_OUT)
+		EV_SET(&changes[n++], fd, EVFILT_WRITE, flags, 0, 0,
+		       (void *)(uintptr_t)i);
+
+	return kevent(session->backend_fd, changes, n, NULL, 0, NULL);
+}
+
+static int backend_dispatch(int timeout)
+{
+	struct kevent events[SESSION_MAX_EVENTS];
+	struct timespec ts, *tsp;
+	unsigned int i;
+	int ret, n, revents;
+
+	tsp = NULL;
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		tsp = &ts;
+	}
+
+	ret = kevent(session->backend_fd, NULL, 0, events, SESSION_MAX_EVENTS,
+		     tsp);
+	for (n = 0; n < ret; n++) {
+		i = (uintptr_t)events[n].udata;
+		revents = (events[n].filter == EVFILT_WRITE) ? G_IO_OUT : G_IO_IN;
+		if (events[n].flags & EV_EOF)
+			revents |= G_IO_HUP;
+		if (events[n].flags & EV_ERROR)
+			revents = G_IO_ERR;
+		source_dispatch(i, revents);
+	}
+
+	return ret;
+}
+
+#else
+
+static int backend_ctl(unsigned int i, int op)
+{
+	(void)i;
+	(void)op;
+
+	return -1;
+}
+
+static int backend_dispatch(int timeout)
+{
+	(void)timeout;
+
+	return -1;
+}
+
+#endif
+
+/* Only sources which poll a real descriptor go through the backend. */
+static gboolean backend_wants(unsigned int i)
+{
+	return session->pollfds[i].fd >= 0 && session->pollfds[i].events;
+}
+
+/**
+ * Return the calling thread's current session.
+ *
+ * All session functions work on this session. It is the one the thread
+ * selected with sr_session_current_set(), or else the one it created
+ * last. Threads which did neither get the most recently created session.
+ *
+ * @return The current session, or NULL if there is none.
+ */
+SR_API struct sr_session *sr_session_current(void)
+{
+	return current_session();
+}
+
+/**
+ * Select the calling thread's current session.
+ *
+ * A process can run several independent sessions, e.g. one per thread.
+ * A session must not be used by two threads at the same time, except
+ * for sr_session_stop().
+ *
+ * @param s The session, as returned by sr_session_new(). NULL selects
+ *          the most recently created session again.
+ *
+ * @return SR_OK.
+ */
+SR_API int sr_session_current_set(struct sr_session *s)
+{
+	g_private_set(&current_session_key, s);
+
+	return SR_OK;
+}
 
 /**
  * Create a new session.
  *
- * @todo Should it use the file-global "session" variable or take an argument?
- *       The same question applies to all the other session functions.
+ * The new session becomes the calling thread's current session, and the
+ * one used by threads which didn't select one.
  *
  * @return A pointer to the newly allocated session, or NULL upon errors.
  */
 SR_API struct sr_session *sr_session_new(void)
 {
-	if (!(session = g_try_malloc0(sizeof(struct sr_session)))) {
+	struct sr_session *s;
+
+	if (!(s = g_try_malloc0(sizeof(struct sr_session)))) {
 		sr_err("session: %s: session malloc failed", __func__);
 		return NULL; /* TODO: SR_ERR_MALLOC? */
 	}
 
-	session->source_timeout = -1;
+	s->backend_fd = backend_open();
+	s->current_source = -1;
+	g_mutex_init(&s->dispatch_mutex);
+	g_mutex_init(&s->ring_mutex);
+	g_cond_init(&s->ring_cond);
+	g_mutex_init(&s->index_mutex);
 
-	return session;
+	g_private_set(&current_session_key, s);
+	g_atomic_pointer_set(&default_session, s);
+
+	return s;
 }
 
 /**
  * Destroy the current session.
  *
- * This frees up all memory used by the session.
+ * This frees up all memory used by the session. Other threads which
+ * selected it must not use it anymore.
  *
  * @return SR_OK upon success, SR_ERR_BUG if no session exists.
  */
 SR_API int sr_session_destroy(void)
 {
+	struct sr_session *s;
+
 	if (!session) {
 		sr_err("session: %s: session was NULL", __func__);
 		return SR_ERR_BUG;
@@ -92,8 +587,40 @@ SR_API int sr_session_destroy(void)
 
 	/* TODO: Error checks needed? */
 
-	g_free(session);
-	session = NULL;
+	sr_session_datafeed_callback_remove_all();
+	sr_session_transform_remove_all();
+
+	/* Data which is still pending at this point is dropped. */
+	while (session->coalescers)
+		coalescer_remove(session->coalescers->data);
+	g_slist_free_full(session->positions, g_free);
+	session->positions = NULL;
+
+	probe_filters_free();
+	decimators_free();
+	probe_stats_free();
+	merge_free();
+	if (session->rle_buf)
+		sr_buffer_release(session->rle_buf);
+	if (session->analog_buf)
+		sr_buffer_release(session->analog_buf);
+
+	sr_session_file_close();
+
+	backend_close();
+	g_free(session->sources);
+	g_free(session->pollfds);
+	g_free(session->timers);
+
+	g_mutex_clear(&session->dispatch_mutex);
+	g_mutex_clear(&session->ring_mutex);
+	g_cond_clear(&session->ring_cond);
+	g_mutex_clear(&session->index_mutex);
+
+	s = session;
+	g_private_set(&current_session_key, NULL);
+	g_atomic_pointer_compare_and_exchange(&default_session, s, NULL);
+	g_free(s);
 
 	return SR_OK;
 }
@@ -121,6 +648,10 @@ SR_API int sr_session_dev_remove_all(void)
 
 	g_slist_free_full(session->devs, (GDestroyNotify)sr_dev_close);
 	session->devs = NULL;
+	probe_filters_free();
+	decimators_free();
+	probe_stats_free();
+	merge_free();
 
 	return SR_OK;
 }
@@ -174,243 +705,3389 @@ SR_API int sr_session_dev_add(const struct sr_dev_inst *sdi)
 }
 
 /**
- * Remove all datafeed callbacks in the current session.
+ * Enable or disable the threaded mode of the current session.
  *
- * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ * In threaded mode, sr_session_run() services all event sources (and
+ * thus the hardware drivers) on a separate acquisition thread. Packets
+ * sent by the drivers are queued in a bounded lock-free ring per device
+ * and the datafeed callbacks are invoked on the thread which called
+ * sr_session_run(). A slow datafeed callback then no longer delays the
+ * handling of USB transfers and other driver events.
+ *
+ * This can only be changed while no acquisition is running.
+ *
+ * @param threaded TRUE to enable threaded mode, FALSE to disable it.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists or an
+ *         acquisition is currently running.
  */
-SR_API int sr_session_datafeed_callback_remove_all(void)
+SR_API int sr_session_threaded_set(gboolean threaded)
 {
 	if (!session) {
 		sr_err("session: %s: session was NULL", __func__);
 		return SR_ERR_BUG;
 	}
 
-	g_slist_free(session->datafeed_callbacks);
-	session->datafeed_callbacks = NULL;
+	if (g_atomic_int_get(&session->acquisition_running)) {
+		sr_err("session: %s: can't change mode while running",
+		       __func__);
+		return SR_ERR_BUG;
+	}
+
+	session->threaded = threaded;
 
 	return SR_OK;
 }
 
 /**
- * Add a datafeed callback to the current session.
+ * Query whether the current session runs in threaded mode.
  *
- * @param cb Function to call when a chunk of data is received.
- *           Must not be NULL.
+ * @return TRUE if a session exists and runs in threaded mode, FALSE
+ *         otherwise.
+ */
+SR_API gboolean sr_session_threaded_get(void)
+{
+	return session ? session->threaded : FALSE;
+}
+
+/**
+ * Set up coalescing of logic packets in the current session.
+ *
+ * Some drivers send their samples in many small SR_DF_LOGIC packets, and
+ * each of them has to go through all datafeed callbacks. With coalescing
+ * enabled, consecutive logic packets of a device with the same unitsize
+ * are collected until 'size' bytes are pending or the oldest of them is
+ * 'latency' milliseconds old. They are then delivered to the datafeed
+ * callbacks as a single packet. Any other packet from the same device
+ * flushes the pending data first, so the order of packets is kept.
+ *
+ * Packets of 'size' bytes or more are never held back.
+ *
+ * This can only be changed while no data is pending, i.e. not during an
+ * acquisition.
+ *
+ * @param size Maximum number of bytes to collect, or 0 to disable
+ *             coalescing (the default).
+ * @param latency Maximum time (in ms) to hold back data, or 0 for no
+ *                time limit. Must not be negative.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or
+ *         SR_ERR_BUG if no session exists or data is pending.
+ */
+SR_API int sr_session_coalesce_set(uint64_t size, int latency)
+{
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (latency < 0) {
+		sr_err("session: %s: latency was negative", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (session->coalescers) {
+		sr_err("session: %s: can't change coalescing while data is "
+		       "pending", __func__);
+		return SR_ERR_BUG;
+	}
+
+	session->coalesce_size = size;
+	session->coalesce_latency = latency;
+
+	return SR_OK;
+}
+
+/**
+ * Enable or disable probe filtering in the current session.
+ *
+ * Output modules expect logic samples which only contain the enabled
+ * probes, packed into as few bytes as possible. Rather than having every
+ * consumer call sr_filter_probes() on every packet, the session can do it
+ * once: with filtering enabled, each SR_DF_LOGIC packet is reduced to the
+ * device's enabled probes (in the order of sdi->probes) before it is
+ * handed to the datafeed callbacks, with its unitsize adjusted to match.
+ *
+ * The probe list is cached per device and only rebuilt when the set of
+ * enabled probes changes. If all probes are enabled, packets are passed
+ * on untouched.
+ *
+ * @param enabled TRUE to filter logic packets, FALSE to pass them on as
+ *                sent by the driver (the default).
  *
  * @return SR_OK upon success, SR_ERR_BUG if no session exists.
  */
-SR_API int sr_session_datafeed_callback_add(sr_datafeed_callback_t cb)
+SR_API int sr_session_probe_filter_set(gboolean enabled)
 {
 	if (!session) {
 		sr_err("session: %s: session was NULL", __func__);
 		return SR_ERR_BUG;
 	}
 
-	if (!cb) {
-		sr_err("session: %s: cb was NULL", __func__);
+	if (session->threaded)
+		g_mutex_lock(&session->dispatch_mutex);
+	session->probe_filter = enabled;
+	if (!enabled)
+		probe_filters_free();
+	if (session->threaded)
+		g_mutex_unlock(&session->dispatch_mutex);
+
+	return SR_OK;
+}
+
+/**
+ * Decimate logic data in the current session.
+ *
+ * To record or display a long acquisition at a lower samplerate than it
+ * was captured at, the session can decimate each device's logic samples
+ * before they reach the datafeed callbacks: every 'factor' samples are
+ * turned into one according to 'mode' (see sr_decimator_new()). The
+ * samplerate in SR_DF_META_LOGIC and SR_DF_SYNC, and the sample offsets
+ * in SR_DF_TRIGGER and SR_DF_OVERRUN, are divided by 'factor' to match.
+ *
+ * Decimation happens after probe filtering (see
+ * sr_session_probe_filter_set()), and before merging (see
+ * sr_session_merge_set()). SR_DF_LOGIC_RLE packets are expanded for it,
+ * even if the datafeed callbacks handle them (see sr_session_rle_set()).
+ * A window which isn't complete when the acquisition ends is dropped.
+ *
+ * @param factor The number of samples to turn into one, or 0 or 1 to
+ *               pass them on as sent by the driver (the default).
+ * @param mode How to turn them into one (SR_DECIMATE_*).
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_decimate_set(uint64_t factor, int mode)
+{
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (mode != SR_DECIMATE_SAMPLE && mode != SR_DECIMATE_OR
+	    && mode != SR_DECIMATE_AND && mode != SR_DECIMATE_TRANSITION) {
+		sr_err("session: %s: invalid mode %d", __func__, mode);
 		return SR_ERR_ARG;
 	}
 
-	session->datafeed_callbacks =
-	    g_slist_append(session->datafeed_callbacks, cb);
+	if (session->threaded)
+		g_mutex_lock(&session->dispatch_mutex);
+	decimators_free();
+	session->decimate_factor = factor;
+	session->decimate_mode = mode;
+	if (session->threaded)
+		g_mutex_unlock(&session->dispatch_mutex);
+
+	return SR_OK;
+}
+
+/**
+ * Enable or disable per-probe statistics in the current session.
+ *
+ * While enabled, the session keeps counters of each device's logic
+ * samples on their way to the datafeed callbacks: the edges, duty cycle,
+ * pulse widths and frequency of every probe (see grp_logic_stats). They
+ * are reset by each SR_DF_HEADER, and can be read with
+ * sr_session_probe_stats_get() at any time, also after the acquisition.
+ *
+ * The statistics describe the samples as delivered, i.e. after probe
+ * filtering and decimation (see sr_session_probe_filter_set() and
+ * sr_session_decimate_set()). Disabling them drops the counters.
+ *
+ * @param enabled TRUE to keep statistics, FALSE not to (the default).
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_probe_stats_set(gboolean enabled)
+{
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (session->threaded)
+		g_mutex_lock(&session->dispatch_mutex);
+	if (!enabled)
+		probe_stats_free();
+	session->probe_stats = enabled;
+	if (session->threaded)
+		g_mutex_unlock(&session->dispatch_mutex);
 
 	return SR_OK;
 }
 
-static int sr_session_run_poll(void)
+/**
+ * Get the statistics of a probe of a device in the current session.
+ *
+ * In threaded mode this must not be called from a datafeed callback.
+ *
+ * @param sdi The device. Must not be NULL.
+ * @param probe The index of the probe, i.e. its bit in the samples as
+ *              delivered.
+ * @param stats Pointer to a struct which will be filled in. Must not be
+ *              NULL. If the device hasn't sent any samples yet, it is
+ *              zeroed.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments (or if
+ *         the statistics aren't enabled), SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_probe_stats_get(const struct sr_dev_inst *sdi,
+		int probe, struct sr_probe_stats *stats)
+{
+	struct session_probe_stats *ps;
+	GSList *l;
+	int ret;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!sdi || !stats) {
+		sr_err("session: %s: sdi and stats may not be NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!session->probe_stats) {
+		sr_err("session: %s: probe statistics are not enabled",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	g_mutex_lock(&session->dispatch_mutex);
+	ps = NULL;
+	for (l = session->probe_stats_devs; l && !ps; l = l->next) {
+		if (((struct session_probe_stats *)l->data)->sdi == sdi)
+			ps = l->data;
+	}
+	if (ps) {
+		ret = sr_logic_stats_get(ps->stats, probe, stats);
+	} else if (probe < 0 || probe >= 64) {
+		sr_err("session: %s: invalid probe %d", __func__, probe);
+		ret = SR_ERR_ARG;
+	} else {
+		memset(stats, 0, sizeof(struct sr_probe_stats));
+		ret = SR_OK;
+	}
+	g_mutex_unlock(&session->dispatch_mutex);
+
+	return ret;
+}
+
+/**
+ * Declare whether the datafeed callbacks handle run-length encoded data.
+ *
+ * Some drivers and input formats send logic samples as SR_DF_LOGIC_RLE
+ * packets (see sr_logic_rle_expand()). By default, the session expands
+ * these into SR_DF_LOGIC packets before handing them to the datafeed
+ * callbacks, so that callbacks which don't know about SR_DF_LOGIC_RLE
+ * still get all samples. A frontend whose callbacks all handle it can
+ * skip that, and get the runs as they were sent.
+ *
+ * Probe filtering (see sr_session_probe_filter_set()) applies to either.
+ *
+ * @param enabled TRUE to deliver SR_DF_LOGIC_RLE packets as they are,
+ *                FALSE to expand them (the default).
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_rle_set(gboolean enabled)
+{
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (session->threaded)
+		g_mutex_lock(&session->dispatch_mutex);
+	session->rle_native = enabled;
+	if (session->threaded)
+		g_mutex_unlock(&session->dispatch_mutex);
+
+	return SR_OK;
+}
+
+/**
+ * Declare whether the datafeed callbacks handle raw analog data.
+ *
+ * Some drivers send analog samples as SR_DF_ANALOG_RAW packets, holding
+ * the device's integer codes (see sr_analog_raw_to_float()). By default,
+ * the session converts these into SR_DF_ANALOG packets before handing
+ * them to the datafeed callbacks, so that callbacks which don't know
+ * about SR_DF_ANALOG_RAW still get the values. A frontend whose callbacks
+ * all handle it can skip that, and get the codes as they were sent.
+ *
+ * @param enabled TRUE to deliver SR_DF_ANALOG_RAW packets as they are,
+ *                FALSE to convert them (the default).
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_analog_raw_set(gboolean enabled)
+{
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (session->threaded)
+		g_mutex_lock(&session->dispatch_mutex);
+	session->analog_raw_native = enabled;
+	if (session->threaded)
+		g_mutex_unlock(&session->dispatch_mutex);
+
+	return SR_OK;
+}
+
+/**
+ * Add a transform to the end of the current session's transform chain.
+ *
+ * Transforms see each packet after the session's own processing (probe
+ * filtering, decimation and merging), and before the datafeed callbacks.
+ * They can change packets in place, drop them, or send new ones; see
+ * struct sr_transform_format. A transform whose 'sdi' is set only sees
+ * the packets of that device.
+ *
+ * The transform's init() callback is called here. The struct sr_transform
+ * itself remains the caller's, and must stay valid until it is removed
+ * with sr_session_transform_remove_all().
+ *
+ * @param t The transform, with its format, device and parameters set.
+ *          Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_BUG if no session exists, or the error code of the
+ *         transform's init() callback.
+ */
+SR_API int sr_session_transform_add(struct sr_transform *t)
+{
+	int ret;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!t || !t->format) {
+		sr_err("session: %s: t and its format may not be NULL",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (t->format->init && (ret = t->format->init(t)) != SR_OK) {
+		sr_err("session: %s: transform '%s' init failed", __func__,
+		       t->format->id);
+		return ret;
+	}
+
+	if (session->threaded)
+		g_mutex_lock(&session->dispatch_mutex);
+	session->transforms = g_slist_append(session->transforms, t);
+	if (session->threaded)
+		g_mutex_unlock(&session->dispatch_mutex);
+
+	return SR_OK;
+}
+
+/**
+ * Remove all transforms from the current session.
+ *
+ * Each transform's cleanup() callback is called.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_transform_remove_all(void)
+{
+	struct sr_transform *t;
+	GSList *l;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (session->threaded)
+		g_mutex_lock(&session->dispatch_mutex);
+	for (l = session->transforms; l; l = l->next) {
+		t = l->data;
+		if (t->format->cleanup)
+			t->format->cleanup(t);
+	}
+	g_slist_free(session->transforms);
+	session->transforms = NULL;
+	if (session->threaded)
+		g_mutex_unlock(&session->dispatch_mutex);
+
+	return SR_OK;
+}
+
+static uint64_t packet_bytes(const struct sr_datafeed_packet *packet);
+static void stats_record(struct datafeed_stats *stats, uint64_t bytes,
+			 uint64_t latency);
+
+/* Clear a callback's statistics. */
+static void stats_reset(struct datafeed_stats *stats)
+{
+	if (stats->async)
+		g_mutex_lock(&stats->async->mutex);
+	stats->calls = 0;
+	stats->bytes = 0;
+	stats->latency_max = 0;
+	memset(stats->histogram, 0, sizeof(stats->histogram));
+	if (stats->async)
+		g_mutex_unlock(&stats->async->mutex);
+}
+
+static void async_packet_unref(struct async_packet *p)
+{
+	if (!g_atomic_int_dec_and_test(&p->refcount))
+		return;
+
+	sr_packet_free(p->packet);
+	g_free(p);
+}
+
+static gpointer async_consumer_run(gpointer data)
+{
+	struct async_consumer *c;
+	struct async_packet *p;
+	uint64_t bytes, latency;
+	gint64 start;
+
+	c = data;
+	g_private_set(&current_session_key, c->owner);
+
+	g_mutex_lock(&c->mutex);
+	for (;;) {
+		while (!c->count && !c->stop)
+			g_cond_wait(&c->cond, &c->mutex);
+		/* Whatever is still queued is handled before stopping. */
+		if (!c->count)
+			break;
+		p = c->queue[c->head];
+		c->head = (c->head + 1) % c->size;
+		c->count--;
+		c->busy = TRUE;
+		g_cond_broadcast(&c->cond);
+		g_mutex_unlock(&c->mutex);
+
+		start = p->stats ? g_get_monotonic_time() : 0;
+		c->cb(p->sdi, p->packet);
+		latency = p->stats ? g_get_monotonic_time() - start : 0;
+		bytes = p->stats ? packet_bytes(p->packet) : 0;
+
+		g_mutex_lock(&c->mutex);
+		if (p->stats)
+			stats_record(c->stats, bytes, latency);
+		async_packet_unref(p);
+		c->busy = FALSE;
+		g_cond_broadcast(&c->cond);
+	}
+	g_mutex_unlock(&c->mutex);
+
+	return NULL;
+}
+
+/* Queue a packet for a consumer, waiting for room if its queue is full. */
+static void async_consumer_push(struct async_consumer *c,
+				struct async_packet *p)
+{
+	g_mutex_lock(&c->mutex);
+	while (c->count == c->size)
+		g_cond_wait(&c->cond, &c->mutex);
+	c->queue[(c->head + c->count) % c->size] = p;
+	c->count++;
+	g_cond_broadcast(&c->cond);
+	g_mutex_unlock(&c->mutex);
+}
+
+/* Wait until a consumer has handled all packets queued for it. */
+static void async_consumer_drain(struct async_consumer *c)
+{
+	g_mutex_lock(&c->mutex);
+	while (c->count || c->busy)
+		g_cond_wait(&c->cond, &c->mutex);
+	g_mutex_unlock(&c->mutex);
+}
+
+/* Stop a consumer's worker thread once its queue is empty, and free it. */
+static void async_consumer_free(struct async_consumer *c)
+{
+	g_mutex_lock(&c->mutex);
+	c->stop = TRUE;
+	g_cond_broadcast(&c->cond);
+	g_mutex_unlock(&c->mutex);
+	g_thread_join(c->thread);
+
+	g_mutex_clear(&c->mutex);
+	g_cond_clear(&c->cond);
+	g_free(c->queue);
+	g_free(c);
+}
+
+static void async_consumers_drain(void)
+{
+	struct datafeed_stats *stats;
+	GSList *l;
+
+	for (l = session->datafeed_stats; l; l = l->next) {
+		stats = l->data;
+		if (stats->async)
+			async_consumer_drain(stats->async);
+	}
+}
+
+/**
+ * Remove all datafeed callbacks in the current session.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_datafeed_callback_remove_all(void)
+{
+	struct datafeed_stats *stats;
+	GSList *l;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	for (l = session->datafeed_stats; l; l = l->next) {
+		stats = l->data;
+		if (stats->async)
+			async_consumer_free(stats->async);
+	}
+	session->num_async = 0;
+
+	g_slist_free(session->datafeed_callbacks);
+	session->datafeed_callbacks = NULL;
+	g_slist_free_full(session->datafeed_stats, g_free);
+	session->datafeed_stats = NULL;
+
+	return SR_OK;
+}
+
+/**
+ * Add a datafeed callback to the current session.
+ *
+ * @param cb Function to call when a chunk of data is received.
+ *           Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_datafeed_callback_add(sr_datafeed_callback_t cb)
+{
+	struct datafeed_stats *stats;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!cb) {
+		sr_err("session: %s: cb was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(stats = g_try_malloc0(sizeof(struct datafeed_stats)))) {
+		sr_err("session: %s: stats malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	session->datafeed_callbacks =
+	    g_slist_append(session->datafeed_callbacks, cb);
+	session->datafeed_stats =
+	    g_slist_append(session->datafeed_stats, stats);
+
+	return SR_OK;
+}
+
+/**
+ * Add an asynchronous datafeed callback to the current session.
+ *
+ * The callback runs on a worker thread of its own, so that a slow
+ * consumer (e.g. one writing to disk) doesn't hold up the acquisition or
+ * the other callbacks, and several of them can work in parallel. Each
+ * packet is copied once for all asynchronous callbacks; sample data in
+ * reference-counted buffers is shared rather than copied. A callback gets
+ * the packets in the order they were sent, but unlike the other callbacks
+ * it may still be working on one while the next is sent.
+ *
+ * Each callback has a queue of 'queue_size' packets. If it falls that far
+ * behind, sending a packet blocks until it caught up, which in turn slows
+ * down the acquisition. sr_session_run() returns only after all queued
+ * packets were handled.
+ *
+ * The callback must not call into the session, except for
+ * sr_session_stop() in threaded mode (see sr_session_threaded_set()).
+ * Asynchronous callbacks count towards the callback indices of
+ * sr_session_stats_get(); their latency is the time the callback took.
+ *
+ * @param cb Function to call when a chunk of data is received.
+ *           Must not be NULL.
+ * @param queue_size The number of packets which can be queued for the
+ *                   callback, or 0 for the default (64).
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, SR_ERR if the
+ *         worker thread can't be created, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_datafeed_callback_add_async(sr_datafeed_callback_t cb,
+		unsigned int queue_size)
+{
+	struct datafeed_stats *stats;
+	struct async_consumer *c;
+	GError *error;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!cb) {
+		sr_err("session: %s: cb was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(stats = g_try_malloc0(sizeof(struct datafeed_stats)))) {
+		sr_err("session: %s: stats malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	if (!(c = g_try_malloc0(sizeof(struct async_consumer)))) {
+		sr_err("session: %s: consumer malloc failed", __func__);
+		g_free(stats);
+		return SR_ERR_MALLOC;
+	}
+
+	c->size = queue_size ? queue_size : SESSION_ASYNC_QUEUE_SIZE;
+	if (!(c->queue = g_try_malloc0(c->size * sizeof(*c->queue)))) {
+		sr_err("session: %s: queue malloc failed", __func__);
+		g_free(c);
+		g_free(stats);
+		return SR_ERR_MALLOC;
+	}
+
+	c->owner = session;
+	c->cb = cb;
+	c->stats = stats;
+	g_mutex_init(&c->mutex);
+	g_cond_init(&c->cond);
+
+	error = NULL;
+	c->thread = g_thread_try_new("sr-datafeed", async_consumer_run, c,
+				     &error);
+	if (!c->thread) {
+		sr_err("session: %s: failed to create worker thread: %s",
+		       __func__, error->message);
+		g_error_free(error);
+		g_mutex_clear(&c->mutex);
+		g_cond_clear(&c->cond);
+		g_free(c->queue);
+		g_free(c);
+		g_free(stats);
+		return SR_ERR;
+	}
+
+	stats->async = c;
+	session->datafeed_callbacks =
+	    g_slist_append(session->datafeed_callbacks, cb);
+	session->datafeed_stats =
+	    g_slist_append(session->datafeed_stats, stats);
+	session->num_async++;
+
+	return SR_OK;
+}
+
+/**
+ * Enable or disable datafeed callback statistics in the current session.
+ *
+ * While enabled, the session records the number of calls, the number of
+ * bytes delivered and a latency histogram for each datafeed callback.
+ * Use sr_session_stats_get() to read them. Enabling the statistics
+ * resets them.
+ *
+ * In threaded mode this must not be called from a datafeed callback.
+ *
+ * @param enabled TRUE to enable the statistics, FALSE to disable them.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_stats_set(gboolean enabled)
+{
+	GSList *l;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	g_mutex_lock(&session->dispatch_mutex);
+	if (enabled && !session->stats_enabled) {
+		for (l = session->datafeed_stats; l; l = l->next)
+			stats_reset(l->data);
+	}
+	session->stats_enabled = enabled;
+	g_mutex_unlock(&session->dispatch_mutex);
+
+	return SR_OK;
+}
+
+static unsigned int stats_bucket(uint64_t latency)
+{
+	unsigned int bits, idx;
+
+	if (latency < SESSION_STATS_SUB_BUCKETS)
+		return latency;
+
+	/* Position of the highest set bit, at least 3. */
+	for (bits = 0; latency >> (bits + 1); bits++)
+		;
+	idx = SESSION_STATS_SUB_BUCKETS * (bits - 2)
+		+ ((latency >> (bits - 3)) & (SESSION_STATS_SUB_BUCKETS - 1));
+
+	return MIN(idx, SESSION_STATS_BUCKETS - 1);
+}
+
+/* The highest latency (in us) which falls into the bucket. */
+static uint64_t stats_bucket_max(unsigned int idx)
+{
+	unsigned int bits, sub;
+
+	if (idx < SESSION_STATS_SUB_BUCKETS)
+		return idx;
+
+	bits = idx / SESSION_STATS_SUB_BUCKETS + 2;
+	sub = idx % SESSION_STATS_SUB_BUCKETS;
+
+	return ((uint64_t)(SESSION_STATS_SUB_BUCKETS + sub + 1) << (bits - 3)) - 1;
+}
+
+/* Return the latency (in us) which 'percent' % of all calls stayed under. */
+static uint64_t stats_percentile(const struct datafeed_stats *stats,
+				 unsigned int percent)
+{
+	uint64_t target, count;
+	unsigned int i;
+
+	if (!stats->calls)
+		return 0;
+
+	/* Round up, so that e.g. p99 of 10 calls is the slowest one. */
+	target = (stats->calls * percent + 99) / 100;
+	count = 0;
+	for (i = 0; i < SESSION_STATS_BUCKETS; i++) {
+		count += stats->histogram[i];
+		if (count >= target)
+			break;
+	}
+
+	return MIN(stats_bucket_max(i), stats->latency_max);
+}
+
+/**
+ * Get the statistics of a datafeed callback in the current session.
+ *
+ * The statistics are only recorded while enabled, see
+ * sr_session_stats_set(). Latencies are measured with microsecond
+ * resolution, the percentiles are accurate to within 12.5%.
+ *
+ * In threaded mode this must not be called from a datafeed callback.
+ *
+ * @param index The index of the datafeed callback, in the order the
+ *              callbacks were added (starting at 0).
+ * @param stats Pointer to a struct which will be filled in. Must not be
+ *              NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments (or if
+ *         there is no callback with that index), SR_ERR_BUG if no session
+ *         exists.
+ */
+SR_API int sr_session_stats_get(unsigned int index,
+		struct sr_datafeed_stats *stats)
+{
+	struct datafeed_stats *s;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!stats) {
+		sr_err("session: %s: stats was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(s = g_slist_nth_data(session->datafeed_stats, index))) {
+		sr_err("session: %s: no datafeed callback %u", __func__,
+		       index);
+		return SR_ERR_ARG;
+	}
+
+	g_mutex_lock(&session->dispatch_mutex);
+	if (s->async)
+		g_mutex_lock(&s->async->mutex);
+	stats->calls = s->calls;
+	stats->bytes = s->bytes;
+	stats->latency_p50 = stats_percentile(s, 50);
+	stats->latency_p99 = stats_percentile(s, 99);
+	stats->latency_max = s->latency_max;
+	if (s->async)
+		g_mutex_unlock(&s->async->mutex);
+	g_mutex_unlock(&session->dispatch_mutex);
+
+	return SR_OK;
+}
+
+/*
+ * In threaded mode, a stop requested from outside the acquisition thread
+ * is carried out by the acquisition thread itself, since it owns the
+ * sources the drivers will remove.
+ */
+static gboolean session_stop_pending(void)
+{
+	if (!session->threaded || !g_atomic_int_get(&session->stop_requested))
+		return FALSE;
+
+	g_atomic_int_set(&session->stop_requested, 0);
+	sr_session_stop();
+
+	return TRUE;
+}
+
+/*
+ * Source timeouts are kept in a binary min-heap of source indices, ordered
+ * by deadline. Each source with a timeout knows its position in the heap,
+ * so its deadline can be changed (or the source removed) in O(log n).
+ */
+
+static gboolean timer_before(unsigned int a, unsigned int b)
+{
+	return session->sources[session->timers[a]].deadline
+		< session->sources[session->timers[b]].deadline;
+}
+
+static void timer_swap(unsigned int a, unsigned int b)
+{
+	unsigned int tmp;
+
+	tmp = session->timers[a];
+	session->timers[a] = session->timers[b];
+	session->timers[b] = tmp;
+	session->sources[session->timers[a]].timer_pos = a;
+	session->sources[session->timers[b]].timer_pos = b;
+}
+
+/* Restore the heap order after the deadline at 'pos' has changed. */
+static void timer_fix(unsigned int pos)
+{
+	unsigned int child;
+
+	while (pos > 0 && timer_before(pos, (pos - 1) / 2)) {
+		timer_swap(pos, (pos - 1) / 2);
+		pos = (pos - 1) / 2;
+	}
+
+	while ((child = 2 * pos + 1) < session->num_timers) {
+		if (child + 1 < session->num_timers
+		    && timer_before(child + 1, child))
+			child++;
+		if (!timer_before(child, pos))
+			break;
+		timer_swap(pos, child);
+		pos = child;
+	}
+}
+
+static void timer_remove(unsigned int i)
+{
+	unsigned int pos, last;
+
+	if (session->sources[i].timer_pos < 0)
+		return;
+
+	pos = session->sources[i].timer_pos;
+	session->sources[i].timer_pos = -1;
+	last = --session->num_timers;
+	if (pos != last) {
+		session->timers[pos] = session->timers[last];
+		session->sources[session->timers[pos]].timer_pos = pos;
+		timer_fix(pos);
+	}
+}
+
+/* (Re)start the timeout of source 'i', counting from 'now'. */
+static void timer_arm(unsigned int i, gint64 now)
+{
+	struct source *s;
+
+	s = &session->sources[i];
+	if (s->timeout <= 0) {
+		timer_remove(i);
+		return;
+	}
+
+	s->deadline = now + (gint64)s->timeout * 1000;
+	if (s->timer_pos < 0) {
+		/* The timers array is as big as the sources array. */
+		s->timer_pos = session->num_timers++;
+		session->timers[s->timer_pos] = i;
+	}
+	timer_fix(s->timer_pos);
+}
+
+/*
+ * Return the time (in ms) until the earliest source deadline, or -1 if
+ * no source has a timeout.
+ */
+static int timers_timeout(gint64 now)
+{
+	gint64 deadline;
+
+	if (!session->num_timers)
+		return -1;
+
+	deadline = session->sources[session->timers[0]].deadline;
+	if (deadline <= now)
+		return 0;
+
+	/* Round up, so that the deadline has passed after the timeout. */
+	return (deadline - now + 999) / 1000;
+}
+
+/* Source 'i' now lives at a different index, tell the heap and backend. */
+static void source_moved(unsigned int i)
+{
+	if (session->sources[i].timer_pos >= 0)
+		session->timers[session->sources[i].timer_pos] = i;
+
+	if (session->backend_fd >= 0 && session->sources[i].registered
+	    && backend_ctl(i, BACKEND_MOD) < 0)
+		backend_fallback(i);
+}
+
+static void source_remove(unsigned int i)
+{
+	unsigned int last;
+
+	if (session->backend_fd >= 0 && session->sources[i].registered)
+		backend_ctl(i, BACKEND_DEL);
+	session->sources[i].registered = FALSE;
+	timer_remove(i);
+
+	if (session->dispatching) {
+		/*
+		 * The indices of the other sources must stay valid until
+		 * the poll loop is done with them, so only mark it as
+		 * removed for now.
+		 */
+		session->sources[i].cb = NULL;
+		session->num_removed++;
+		return;
+	}
+
+	/* Move the last source into the gap. */
+	last = --session->num_sources;
+	if (i != last) {
+		session->sources[i] = session->sources[last];
+		session->pollfds[i] = session->pollfds[last];
+		source_moved(i);
+	}
+}
+
+/* Drop the sources which were removed while dispatching. */
+static void sources_compact(void)
+{
+	unsigned int i, j;
+
+	if (!session->num_removed)
+		return;
+
+	for (i = j = 0; i < session->num_sources; i++) {
+		if (!session->sources[i].cb)
+			continue;
+		if (i != j) {
+			session->sources[j] = session->sources[i];
+			session->pollfds[j] = session->pollfds[i];
+			source_moved(j);
+		}
+		j++;
+	}
+	session->num_sources = j;
+	session->num_removed = 0;
+}
+
+/*
+ * Run the callback of source 'i', and remove the source if it asks so.
+ * Since the callback is being called, its timeout starts over.
+ */
+static void source_dispatch(unsigned int i, int revents)
+{
+	struct source *s;
+
+	if (i >= session->num_sources)
+		return;
+
+	s = &session->sources[i];
+	/* Already removed during this pass. */
+	if (!s->cb)
+		return;
+
+	if (s->timer_pos >= 0)
+		timer_arm(i, g_get_monotonic_time());
+
+	session->current_source = i;
+	if (!s->cb(session->pollfds[i].fd, revents, s->cb_data))
+		source_remove(i);
+	session->current_source = -1;
+}
+
+/*
+ * Idle sources have neither a descriptor nor a timeout: session file
+ * playback, or drivers which compute their samples. They are called
+ * whenever the loop has nothing else to do.
+ */
+static gboolean source_idle(unsigned int i)
+{
+	return session->sources[i].cb && session->pollfds[i].fd < 0
+	       && session->sources[i].timeout <= 0;
+}
+
+/*
+ * Return the time (in ms) until the first idle source wants to be called
+ * again, 0 if one wants to be called right away, or -1 if there are no
+ * idle sources.
+ */
+static int idle_timeout(gint64 now)
+{
+	gint64 until;
+	unsigned int i;
+
+	until = G_MAXINT64;
+	for (i = 0; i < session->num_sources; i++) {
+		if (source_idle(i))
+			until = MIN(until, session->sources[i].idle_until);
+	}
+
+	if (until == G_MAXINT64)
+		return -1;
+	if (until <= now)
+		return 0;
+
+	return (until - now + 999) / 1000;
+}
+
+/*
+ * Call the idle sources which don't wait, one after the other, for up to
+ * SESSION_IDLE_QUANTUM_US. The next call carries on where this one left
+ * off, so each of them gets its turn no matter how long the others take.
+ */
+static void idle_dispatch(void)
+{
+	unsigned int i, num_sources, skipped;
+	gint64 now, end;
+
+	/* Sources added by the callbacks are not part of this pass. */
+	num_sources = session->num_sources;
+	if (!num_sources)
+		return;
+
+	now = g_get_monotonic_time();
+	end = now + SESSION_IDLE_QUANTUM_US;
+	i = session->idle_next % num_sources;
+	for (skipped = 0; skipped < num_sources && now < end;
+	     i = (i + 1) % num_sources) {
+		if (!source_idle(i) || session->sources[i].idle_until > now) {
+			skipped++;
+			continue;
+		}
+		skipped = 0;
+		source_dispatch(i, 0);
+		if (session->threaded
+		    && g_atomic_int_get(&session->stop_requested))
+			break;
+		now = g_get_monotonic_time();
+	}
+	session->idle_next = i;
+}
+
+static int gpoll_dispatch(int timeout)
+{
+	unsigned int i, num_sources;
+	int ret;
+
+	/* Sources added by the callbacks are not part of this pass. */
+	num_sources = session->num_sources;
+	ret = g_poll(session->pollfds, num_sources, timeout);
+	for (i = 0; ret > 0 && i < num_sources; i++) {
+		if (session->pollfds[i].revents > 0)
+			source_dispatch(i, session->pollfds[i].revents);
+	}
+
+	return ret;
+}
+
+static int sr_session_run_poll(void)
+{
+	int timeout, coalesce_timeout, idle;
+	gint64 now;
+
+	while (session->num_sources > 0) {
+		if (session_stop_pending())
+			continue;
+		now = g_get_monotonic_time();
+		timeout = timers_timeout(now);
+		/* Don't sleep while idle sources have work to do. */
+		idle = idle_timeout(now);
+		if (idle >= 0 && (timeout < 0 || idle < timeout))
+			timeout = idle;
+		/*
+		 * Wake up regularly in threaded mode, so that stop requests
+		 * are noticed even if no source asked for a timeout.
+		 */
+		if (session->threaded && (timeout < 0
+				|| timeout > SESSION_RING_WAIT_US / 1000))
+			timeout = SESSION_RING_WAIT_US / 1000;
+		/* Don't sleep past the deadline of pending logic data. */
+		coalesce_timeout = coalescers_timeout();
+		if (coalesce_timeout >= 0
+		    && (timeout < 0 || coalesce_timeout < timeout))
+			timeout = coalesce_timeout;
+
+		session->dispatching = TRUE;
+		SR_TRACE1(poll_sleep, timeout);
+		if (session->backend_fd >= 0)
+			backend_dispatch(timeout);
+		else
+			gpoll_dispatch(timeout);
+		SR_TRACE(poll_wakeup);
+		/*
+		 * Call the sources whose timeout has expired. Each of them
+		 * is re-armed before its callback runs, so this terminates.
+		 */
+		now = g_get_monotonic_time();
+		while (session->num_timers && session->sources[
+		       session->timers[0]].deadline <= now)
+			source_dispatch(session->timers[0], 0);
+		idle_dispatch();
+		session->dispatching = FALSE;
+		sources_compact();
+
+		coalescers_flush_expired();
+	}
+
+	return SR_OK;
+}
+
+static int session_run_sources(void)
+{
+	sr_session_run_poll();
+
+	/* Deliver whatever the drivers left pending. */
+	coalescers_flush_all();
+
+	return SR_OK;
+}
+
+/**
+ * Enable or disable synchronized starts in the current session.
+ *
+ * Normally sr_session_start() starts one device after the other, each of
+ * them taking as long as it takes to set up. With synchronized starts,
+ * all devices whose driver can split its start into arming and releasing
+ * are armed first, then released back to back, and the remaining devices
+ * are started after that.
+ *
+ * The session then sends an SR_DF_SYNC packet for each device, after its
+ * SR_DF_META_LOGIC, telling how many sample periods it started later than
+ * the first device. That's as accurate as the host's clock and the time a
+ * release takes, which is good enough to line up streams to within a few
+ * samples at typical logic analyzer rates; see sr_session_merge_set().
+ *
+ * @param enabled TRUE to start devices synchronized, FALSE to start them
+ *                one after the other (the default).
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_sync_set(gboolean enabled)
+{
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	session->sync_start = enabled;
+
+	return SR_OK;
+}
+
+/**
+ * Merge the logic streams of two devices in the current session.
+ *
+ * Sample n of the merged stream holds the bytes of sample n of 'sdi_a',
+ * followed by those of sample n of 'sdi_b', so the probes of 'sdi_b' are
+ * numbered on from the next byte boundary after those of 'sdi_a'. The
+ * merged stream is delivered to the datafeed callbacks as coming from
+ * 'sdi_a'; the header, metadata, sync, trigger, logic and end packets of
+ * 'sdi_b' are taken into it. Other packets are passed on as they are.
+ *
+ * Both devices must run at the same samplerate, otherwise their streams
+ * are passed on separately. With synchronized starts (see
+ * sr_session_sync_set()), the leading samples of the device which started
+ * first are dropped, so that the streams line up. Samples of one stream
+ * which have no partner when the other one ends are dropped.
+ *
+ * Merging happens after probe filtering (see sr_session_probe_filter_set()).
+ *
+ * @param sdi_a The device whose samples go first. NULL disables merging.
+ * @param sdi_b The device whose samples go second. Must be a different
+ *              device than 'sdi_a'.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, SR_ERR_BUG if no
+ *         session exists.
+ */
+SR_API int sr_session_merge_set(const struct sr_dev_inst *sdi_a,
+		const struct sr_dev_inst *sdi_b)
+{
+	struct session_merge *m;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (sdi_a && (!sdi_b || sdi_a == sdi_b)) {
+		sr_err("session: %s: need two different devices", __func__);
+		return SR_ERR_ARG;
+	}
+
+	m = NULL;
+	if (sdi_a && !(m = g_try_malloc0(sizeof(struct session_merge)))) {
+		sr_err("session: %s: merge malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	if (session->threaded)
+		g_mutex_lock(&session->dispatch_mutex);
+	merge_free();
+	if (m) {
+		m->streams[0].sdi = sdi_a;
+		m->streams[1].sdi = sdi_b;
+		session->merge = m;
+	}
+	if (session->threaded)
+		g_mutex_unlock(&session->dispatch_mutex);
+
+	return SR_OK;
+}
+
+/*
+ * Start (or release) one device, and note the time (in us) at which it
+ * started sampling: somewhere during the call, so take the middle.
+ */
+static int session_dev_start(struct sr_dev_inst *sdi, gboolean armed,
+			     gint64 *when)
+{
+	gint64 before;
+	int ret;
+
+	before = g_get_monotonic_time();
+	if (armed)
+		ret = sdi->driver->dev_acquisition_release(sdi);
+	else
+		ret = sdi->driver->dev_acquisition_start(sdi, sdi);
+	*when = before + (g_get_monotonic_time() - before) / 2;
+
+	return ret;
+}
+
+static gboolean session_dev_can_arm(const struct sr_dev_inst *sdi)
+{
+	return sdi->driver->dev_acquisition_arm
+	    && sdi->driver->dev_acquisition_release;
+}
+
+/* See sr_session_sync_set(). */
+static int session_start_synced(void)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_sync sync;
+	struct sr_dev_inst *sdi;
+	const void *data;
+	gint64 *when, first;
+	GSList *l, *m;
+	gboolean before;
+	int i, pass, ret;
+
+	if (!(when = g_try_malloc(sizeof(gint64)
+				  * g_slist_length(session->devs)))) {
+		sr_err("session: %s: malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	for (l = session->devs; l; l = l->next) {
+		sdi = l->data;
+		if (!session_dev_can_arm(sdi))
+			continue;
+		if ((ret = sdi->driver->dev_acquisition_arm(sdi, sdi))
+		    != SR_OK) {
+			sr_err("session: %s: could not arm an acquisition "
+			       "(%d)", __func__, ret);
+			/* Stand down the ones which were armed already. */
+			for (m = session->devs; m != l; m = m->next) {
+				sdi = m->data;
+				if (session_dev_can_arm(sdi))
+					sdi->driver->dev_acquisition_stop(sdi,
+									  sdi);
+			}
+			g_free(when);
+			return ret;
+		}
+	}
+
+	/* Release the armed devices back to back, then start the others. */
+	ret = SR_OK;
+	for (pass = 0; pass < 2; pass++) {
+		for (l = session->devs, i = 0; l; l = l->next, i++) {
+			sdi = l->data;
+			if (session_dev_can_arm(sdi) != (pass == 0))
+				continue;
+			if ((ret = session_dev_start(sdi, pass == 0,
+						     &when[i])) != SR_OK) {
+				sr_err("session: %s: could not start an "
+				       "acquisition (%d)", __func__, ret);
+				break;
+			}
+		}
+		if (ret != SR_OK)
+			break;
+	}
+	if (ret != SR_OK) {
+		/*
+		 * Stop all armed devices, released or not, and the others
+		 * which were started before the one that failed.
+		 */
+		for (m = session->devs, before = TRUE; m; m = m->next) {
+			sdi = m->data;
+			if (m == l)
+				before = FALSE;
+			if (session_dev_can_arm(sdi)
+			    || (pass == 1 && before))
+				sdi->driver->dev_acquisition_stop(sdi, sdi);
+		}
+		g_free(when);
+		return ret;
+	}
+
+	first = when[0];
+	for (i = 1, l = session->devs->next; l; l = l->next, i++)
+		first = MIN(first, when[i]);
+
+	packet.type = SR_DF_SYNC;
+	packet.payload = &sync;
+	for (l = session->devs, i = 0; l; l = l->next, i++) {
+		sdi = l->data;
+		sync.samplerate = 0;
+		if (sdi->driver->info_get(SR_DI_CUR_SAMPLERATE, &data, sdi)
+		    == SR_OK && data)
+			sync.samplerate = *(const uint64_t *)data;
+		sync.offset = (uint64_t)(when[i] - first) * sync.samplerate
+			      / 1000000;
+		sr_dbg("session: %s: device %d started %" PRIu64 " samples "
+		       "in", __func__, sdi->index, sync.offset);
+		sr_session_send(sdi, &packet);
+	}
+
+	g_free(when);
+
+	return SR_OK;
+}
+
+/**
+ * Start a session.
+ *
+ * There can only be one session at a time.
+ *
+ * @return SR_OK upon success, SR_ERR upon errors.
+ */
+SR_API int sr_session_start(void)
+{
+	struct sr_dev_inst *sdi;
+	GSList *l;
+	int ret;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL; a session must be "
+		       "created before starting it.", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!session->devs) {
+		sr_err("session: %s: session->devs was NULL; a session "
+		       "cannot be started without devices.", __func__);
+		return SR_ERR_BUG;
+	}
+
+	sr_info("session: starting");
+
+	if (session->merge)
+		merge_reset(session->merge);
+
+	if (session->sync_start)
+		return session_start_synced();
+
+	for (l = session->devs; l; l = l->next) {
+		sdi = l->data;
+		if ((ret = sdi->driver->dev_acquisition_start(sdi, sdi)) != SR_OK) {
+			sr_err("session: %s: could not start an acquisition "
+			       "(%d)", __func__, ret);
+			break;
+		}
+	}
+
+	/* TODO: What if there are multiple devices? Which return code? */
+
+	return ret;
+}
+
+/*
+ * Sleep until ready() returns TRUE, but for SESSION_RING_WAIT_US at most.
+ * The 'waiting' flag tells the other side that it has to wake us up.
+ */
+static void session_wait(volatile gint *waiting,
+		gboolean (*ready)(struct packet_ring *ring),
+		struct packet_ring *ring)
+{
+	gint64 end_time;
+
+	g_mutex_lock(&session->ring_mutex);
+	g_atomic_int_set(waiting, 1);
+	if (!ready(ring)) {
+		end_time = g_get_monotonic_time() + SESSION_RING_WAIT_US;
+		g_cond_wait_until(&session->ring_cond, &session->ring_mutex,
+				  end_time);
+	}
+	g_atomic_int_set(waiting, 0);
+	g_mutex_unlock(&session->ring_mutex);
+}
+
+static void session_wake(volatile gint *waiting)
+{
+	if (!g_atomic_int_get(waiting))
+		return;
+
+	g_mutex_lock(&session->ring_mutex);
+	g_cond_broadcast(&session->ring_cond);
+	g_mutex_unlock(&session->ring_mutex);
+}
+
+static gboolean ring_has_space(struct packet_ring *ring)
+{
+	return (g_atomic_int_get(&ring->head) + 1) % SESSION_RING_SIZE
+		!= g_atomic_int_get(&ring->tail);
+}
+
+static gboolean rings_have_data(struct packet_ring *unused)
+{
+	struct packet_ring *ring;
+	GSList *l;
+
+	(void)unused;
+
+	if (!g_atomic_int_get(&session->acquisition_running))
+		return TRUE;
+
+	for (l = session->rings; l; l = l->next) {
+		ring = l->data;
+		if (g_atomic_int_get(&ring->head) != g_atomic_int_get(&ring->tail))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Producer side, only ever called on the acquisition thread. */
+static void ring_push(struct packet_ring *ring,
+		      struct sr_datafeed_packet *packet)
+{
+	gint head;
+
+	while (!ring_has_space(ring))
+		session_wait(&session->producer_waiting, ring_has_space, ring);
+
+	head = g_atomic_int_get(&ring->head);
+	ring->slots[head] = packet;
+	g_atomic_int_set(&ring->head, (head + 1) % SESSION_RING_SIZE);
+
+	session_wake(&session->consumer_waiting);
+}
+
+/* Consumer side, only ever called on the thread in sr_session_run(). */
+static struct sr_datafeed_packet *ring_pop(struct packet_ring *ring)
+{
+	struct sr_datafeed_packet *packet;
+	gint tail;
+
+	tail = g_atomic_int_get(&ring->tail);
+	if (tail == g_atomic_int_get(&ring->head))
+		return NULL;
+
+	packet = ring->slots[tail];
+	g_atomic_int_set(&ring->tail, (tail + 1) % SESSION_RING_SIZE);
+
+	session_wake(&session->producer_waiting);
+
+	return packet;
+}
+
+static struct packet_ring *ring_find(const struct sr_dev_inst *sdi)
+{
+	struct packet_ring *ring;
+	GSList *l;
+
+	for (l = session->rings; l; l = l->next) {
+		ring = l->data;
+		if (ring->sdi == sdi)
+			return ring;
+	}
+
+	return NULL;
+}
+
+/**
+ * Free a packet made by sr_packet_copy().
+ *
+ * @param packet The packet. Must not be NULL.
+ *
+ * @private
+ */
+SR_PRIV void sr_packet_free(struct sr_datafeed_packet *packet)
+{
+	const struct sr_datafeed_logic *logic;
+	const struct sr_datafeed_logic_rle *rle;
+	const struct sr_datafeed_analog *analog;
+	const struct sr_datafeed_analog_raw *raw;
+
+	if (packet->type == SR_DF_LOGIC) {
+		logic = packet->payload;
+		if (logic->buffer)
+			sr_buffer_release(logic->buffer);
+	} else if (packet->type == SR_DF_LOGIC_RLE) {
+		rle = packet->payload;
+		if (rle->buffer)
+			sr_buffer_release(rle->buffer);
+	} else if (packet->type == SR_DF_ANALOG) {
+		analog = packet->payload;
+		if (analog->buffer)
+			sr_buffer_release(analog->buffer);
+	} else if (packet->type == SR_DF_ANALOG_RAW) {
+		raw = packet->payload;
+		if (raw->buffer)
+			sr_buffer_release(raw->buffer);
+	}
+
+	g_free(packet);
+}
+
+static void rings_free(void)
+{
+	struct packet_ring *ring;
+	struct sr_datafeed_packet *packet;
+	GSList *l;
+
+	for (l = session->rings; l; l = l->next) {
+		ring = l->data;
+		while ((packet = ring_pop(ring)))
+			sr_packet_free(packet);
+		g_free(ring);
+	}
+	g_slist_free(session->rings);
+	session->rings = NULL;
+}
+
+static int rings_new(void)
+{
+	struct packet_ring *ring;
+	GSList *l;
+
+	for (l = session->devs; l; l = l->next) {
+		if (!(ring = g_try_malloc0(sizeof(struct packet_ring)))) {
+			sr_err("session: %s: ring malloc failed", __func__);
+			rings_free();
+			return SR_ERR_MALLOC;
+		}
+		ring->sdi = l->data;
+		session->rings = g_slist_append(session->rings, ring);
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Copy a packet including its payload into a single allocation.
+ *
+ * This way the packet can be queued while the driver reuses its own
+ * buffers. Sample data which lives in a reference-counted buffer is not
+ * copied, the copy just holds another reference to it.
+ *
+ * @param packet The packet. Must not be NULL.
+ *
+ * @return The copy, to be freed with sr_packet_free(), or NULL upon
+ *         errors.
+ *
+ * @private
+ */
+SR_PRIV struct sr_datafeed_packet *sr_packet_copy(
+		const struct sr_datafeed_packet *packet)
+{
+	struct sr_datafeed_packet *copy;
+	const struct sr_datafeed_logic *logic;
+	const struct sr_datafeed_logic_rle *rle;
+	const struct sr_datafeed_analog *analog;
+	const struct sr_datafeed_analog_raw *raw;
+	struct sr_datafeed_logic *logic_copy;
+	struct sr_datafeed_logic_rle *rle_copy;
+	struct sr_datafeed_analog *analog_copy;
+	struct sr_datafeed_analog_raw *raw_copy;
+	size_t payload_size, scales_size, data_size;
+
+	logic = NULL;
+	rle = NULL;
+	analog = NULL;
+	raw = NULL;
+	payload_size = scales_size = data_size = 0;
+
+	switch (packet->type) {
+	case SR_DF_HEADER:
+		payload_size = sizeof(struct sr_datafeed_header);
+		break;
+	case SR_DF_META_LOGIC:
+		payload_size = sizeof(struct sr_datafeed_meta_logic);
+		break;
+	case SR_DF_META_ANALOG:
+		payload_size = sizeof(struct sr_datafeed_meta_analog);
+		break;
+	case SR_DF_OVERRUN:
+		payload_size = sizeof(struct sr_datafeed_overrun);
+		break;
+	case SR_DF_SYNC:
+		payload_size = sizeof(struct sr_datafeed_sync);
+		break;
+	case SR_DF_TRIGGER:
+		if (packet->payload)
+			payload_size = sizeof(struct sr_datafeed_trigger);
+		break;
+	case SR_DF_LOGIC:
+		logic = packet->payload;
+		payload_size = sizeof(struct sr_datafeed_logic);
+		if (!logic->buffer)
+			data_size = logic->length;
+		break;
+	case SR_DF_LOGIC_RLE:
+		rle = packet->payload;
+		payload_size = sizeof(struct sr_datafeed_logic_rle);
+		if (!rle->buffer)
+			data_size = rle->num_runs * sizeof(struct sr_logic_run);
+		break;
+	case SR_DF_ANALOG:
+		analog = packet->payload;
+		payload_size = sizeof(struct sr_datafeed_analog);
+		if (!analog->buffer)
+			data_size = analog->num_samples * sizeof(float);
+		break;
+	case SR_DF_ANALOG_RAW:
+		raw = packet->payload;
+		payload_size = sizeof(struct sr_datafeed_analog_raw);
+		/* The scales always go with the copy, they're small. */
+		if (raw->num_probes > 0)
+			scales_size = raw->num_probes
+					* sizeof(struct sr_analog_scale);
+		if (!raw->buffer)
+			data_size = sr_analog_raw_size(raw);
+		break;
+	default:
+		/* SR_DF_END and SR_DF_FRAME_* have no payload. */
+		break;
+	}
+
+	if (!(copy = g_try_malloc(sizeof(struct sr_datafeed_packet)
+			+ payload_size + scales_size + data_size))) {
+		sr_err("session: %s: packet malloc failed", __func__);
+		return NULL;
+	}
+
+	copy->type = packet->type;
+	copy->payload = NULL;
+	if (payload_size) {
+		copy->payload = copy + 1;
+		memcpy(copy->payload, packet->payload, payload_size);
+	}
+
+	if (logic && logic->buffer) {
+		sr_buffer_acquire(logic->buffer);
+	} else if (logic) {
+		logic_copy = copy->payload;
+		logic_copy->data = (uint8_t *)copy->payload + payload_size;
+		memcpy(logic_copy->data, logic->data, data_size);
+	} else if (rle && rle->buffer) {
+		sr_buffer_acquire(rle->buffer);
+	} else if (rle) {
+		rle_copy = copy->payload;
+		rle_copy->runs = (struct sr_logic_run *)
+				((uint8_t *)copy->payload + payload_size);
+		memcpy(rle_copy->runs, rle->runs, data_size);
+	} else if (analog && analog->buffer) {
+		sr_buffer_acquire(analog->buffer);
+	} else if (analog) {
+		analog_copy = copy->payload;
+		analog_copy->data = (float *)((uint8_t *)copy->payload
+				+ payload_size);
+		memcpy(analog_copy->data, analog->data, data_size);
+	} else if (raw) {
+		raw_copy = copy->payload;
+		raw_copy->scales = (struct sr_analog_scale *)
+				((uint8_t *)copy->payload + payload_size);
+		memcpy(raw_copy->scales, raw->scales, scales_size);
+		if (raw->buffer) {
+			sr_buffer_acquire(raw->buffer);
+		} else {
+			raw_copy->data = (uint8_t *)raw_copy->scales
+					+ scales_size;
+			memcpy(raw_copy->data, raw->data, data_size);
+		}
+	}
+
+	return copy;
+}
+
+static gpointer session_acquisition_thread(gpointer data)
+{
+	/* The thread works on the session which started it. */
+	g_private_set(&current_session_key, data);
+	g_private_set(&acquisition_thread_key, GINT_TO_POINTER(1));
+
+	session_run_sources();
+
+	g_atomic_int_set(&session->acquisition_running, 0);
+	session_wake(&session->consumer_waiting);
+
+	return NULL;
+}
+
+static void datafeed_dispatch(const struct sr_dev_inst *sdi,
+			      struct sr_datafeed_packet *packet);
+
+static void session_consume_rings(void)
+{
+	struct packet_ring *ring;
+	struct sr_datafeed_packet *packet;
+	GSList *l;
+	gboolean idle, done;
+
+	done = FALSE;
+	while (!done) {
+		/* Once the producer is gone, one more pass drains the rings. */
+		done = !g_atomic_int_get(&session->acquisition_running);
+		idle = TRUE;
+		for (l = session->rings; l; l = l->next) {
+			ring = l->data;
+			while ((packet = ring_pop(ring))) {
+				idle = FALSE;
+				g_mutex_lock(&session->dispatch_mutex);
+				datafeed_dispatch(ring->sdi, packet);
+				g_mutex_unlock(&session->dispatch_mutex);
+				sr_packet_free(packet);
+			}
+		}
+		if (idle && !done)
+			session_wait(&session->consumer_waiting,
+				     rings_have_data, NULL);
+	}
+}
+
+static int session_run_threaded(void)
+{
+	GError *error;
+	int ret;
+
+	if ((ret = rings_new()) != SR_OK)
+		return ret;
+
+	error = NULL;
+	g_atomic_int_set(&session->stop_requested, 0);
+	g_atomic_int_set(&session->acquisition_running, 1);
+	session->acquisition_thread = g_thread_try_new("sr-acquisition",
+			session_acquisition_thread, session, &error);
+	if (!session->acquisition_thread) {
+		sr_err("session: %s: failed to create acquisition thread: %s",
+		       __func__, error->message);
+		g_error_free(error);
+		g_atomic_int_set(&session->acquisition_running, 0);
+		rings_free();
+		return SR_ERR;
+	}
+
+	session_consume_rings();
+
+	g_thread_join(session->acquisition_thread);
+	session->acquisition_thread = NULL;
+	rings_free();
+
+	return SR_OK;
+}
+
+/**
+ * Run the session.
+ *
+ * In threaded mode (see sr_session_threaded_set()) the datafeed callbacks
+ * are invoked on the calling thread, while the event sources are serviced
+ * on a separate acquisition thread.
+ *
+ * Asynchronous datafeed callbacks (see
+ * sr_session_datafeed_callback_add_async()) run on their own threads;
+ * this returns once they have handled all packets.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG upon errors.
+ */
+SR_API int sr_session_run(void)
+{
+	int ret;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL; a session must be "
+		       "created first, before running it.", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!session->devs) {
+		/* TODO: Actually the case? */
+		sr_err("session: %s: session->devs was NULL; a session "
+		       "cannot be run without devices.", __func__);
+		return SR_ERR_BUG;
+	}
+
+	sr_info("session: running");
+
+	if (session->threaded)
+		ret = session_run_threaded();
+	else
+		ret = session_run_sources();
+
+	async_consumers_drain();
+
+	return ret;
+}
+
+/**
+ * Halt the current session.
+ *
+ * This function is deprecated and should not be used in new code, use
+ * sr_session_stop() instead. The behaviour of this function is identical to
+ * sr_session_stop().
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_halt(void)
+{
+	return sr_session_stop();
+}
+
+/**
+ * Stop the current session.
+ *
+ * The current session is stopped immediately, with all acquisition sessions
+ * being stopped and hardware drivers cleaned up.
+ *
+ * In threaded mode, if this is called while the session is running, the
+ * devices are stopped asynchronously by the acquisition thread.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_stop(void)
+{
+	struct sr_dev_inst *sdi;
+	GSList *l;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (session->threaded && g_atomic_int_get(&session->acquisition_running)
+	    && !g_private_get(&acquisition_thread_key)) {
+		sr_info("session: requesting stop");
+		g_atomic_int_set(&session->stop_requested, 1);
+		return SR_OK;
+	}
+
+	sr_info("session: stopping");
+
+	for (l = session->devs; l; l = l->next) {
+		sdi = l->data;
+		if (sdi->driver) {
+			if (sdi->driver->dev_acquisition_stop)
+				sdi->driver->dev_acquisition_stop(sdi, sdi);
+		}
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Debug helper.
+ *
+ * @param packet The packet to show debugging information for.
+ */
+static void datafeed_dump(struct sr_datafeed_packet *packet)
+{
+	struct sr_datafeed_logic *logic;
+	struct sr_datafeed_logic_rle *rle;
+	struct sr_datafeed_analog *analog;
+	struct sr_datafeed_analog_raw *raw;
+	struct sr_datafeed_overrun *overrun;
+	struct sr_datafeed_sync *sync;
+	struct sr_datafeed_trigger *trigger;
+
+	switch (packet->type) {
+	case SR_DF_HEADER:
+		sr_dbg("bus: received SR_DF_HEADER");
+		break;
+	case SR_DF_TRIGGER:
+		if ((trigger = packet->payload))
+			sr_dbg("bus: received SR_DF_TRIGGER at sample %" PRIu64,
+			       trigger->offset);
+		else
+			sr_dbg("bus: received SR_DF_TRIGGER");
+		break;
+	case SR_DF_META_LOGIC:
+		sr_dbg("bus: received SR_DF_META_LOGIC");
+		break;
+	case SR_DF_LOGIC:
+		logic = packet->payload;
+		/* TODO: Check for logic != NULL. */
+		sr_dbg("bus: received SR_DF_LOGIC %" PRIu64 " bytes at sample "
+		       "%" PRIu64, logic->length, logic->offset);
+		break;
+	case SR_DF_LOGIC_RLE:
+		rle = packet->payload;
+		sr_dbg("bus: received SR_DF_LOGIC_RLE %" PRIu64 " runs at "
+		       "sample %" PRIu64, rle->num_runs, rle->offset);
+		break;
+	case SR_DF_META_ANALOG:
+		sr_dbg("bus: received SR_DF_META_ANALOG");
+		break;
+	case SR_DF_ANALOG:
+		analog = packet->payload;
+		/* TODO: Check for analog != NULL. */
+		sr_dbg("bus: received SR_DF_ANALOG %d samples", analog->num_samples);
+		break;
+	case SR_DF_ANALOG_RAW:
+		raw = packet->payload;
+		sr_dbg("bus: received SR_DF_ANALOG_RAW %d samples of %d "
+		       "probes", raw->num_samples, raw->num_probes);
+		break;
+	case SR_DF_END:
+		sr_dbg("bus: received SR_DF_END");
+		break;
+	case SR_DF_FRAME_BEGIN:
+		sr_dbg("bus: received SR_DF_FRAME_BEGIN");
+		break;
+	case SR_DF_FRAME_END:
+		sr_dbg("bus: received SR_DF_FRAME_END");
+		break;
+	case SR_DF_OVERRUN:
+		overrun = packet->payload;
+		sr_dbg("bus: received SR_DF_OVERRUN %" PRIu64 " samples lost "
+		       "after sample %" PRIu64, overrun->num_samples,
+		       overrun->offset);
+		break;
+	case SR_DF_SYNC:
+		sync = packet->payload;
+		sr_dbg("bus: received SR_DF_SYNC at offset %" PRIu64,
+		       sync->offset);
+		break;
+	default:
+		sr_dbg("bus: received unknown packet type %d", packet->type);
+		break;
+	}
+}
+
+/* Number of sample bytes in a packet, for the statistics. */
+static uint64_t packet_bytes(const struct sr_datafeed_packet *packet)
+{
+	const struct sr_datafeed_logic *logic;
+	const struct sr_datafeed_logic_rle *rle;
+	const struct sr_datafeed_analog *analog;
+
+	if (packet->type == SR_DF_LOGIC) {
+		logic = packet->payload;
+		return logic->length;
+	} else if (packet->type == SR_DF_LOGIC_RLE) {
+		rle = packet->payload;
+		return rle->num_runs * sizeof(struct sr_logic_run);
+	} else if (packet->type == SR_DF_ANALOG) {
+		analog = packet->payload;
+		return analog->num_samples * sizeof(float);
+	} else if (packet->type == SR_DF_ANALOG_RAW) {
+		return sr_analog_raw_size(packet->payload);
+	}
+
+	return 0;
+}
+
+static void probe_filters_free(void)
+{
+	struct probe_filter *f;
+	GSList *l;
+
+	for (l = session->probe_filters; l; l = l->next) {
+		f = l->data;
+		if (f->buf)
+			sr_buffer_release(f->buf);
+		g_free(f);
+	}
+	g_slist_free(session->probe_filters);
+	session->probe_filters = NULL;
+}
+
+/* Find (or create) the probe filter of a device, and bring it up to date. */
+static struct probe_filter *probe_filter_get(const struct sr_dev_inst *sdi,
+					     uint16_t in_unitsize)
+{
+	struct probe_filter *f;
+	struct sr_probe *probe;
+	uint64_t mask;
+	GSList *l;
+	int n;
+
+	mask = 0;
+	for (l = sdi->probes; l; l = l->next) {
+		probe = l->data;
+		if (probe->type == SR_PROBE_LOGIC && probe->enabled &&
+		    probe->index < 64)
+			mask |= UINT64_C(1) << probe->index;
+	}
+
+	f = NULL;
+	for (l = session->probe_filters; l; l = l->next) {
+		if (((struct probe_filter *)l->data)->sdi == sdi) {
+			f = l->data;
+			break;
+		}
+	}
+
+	if (!f) {
+		if (!(f = g_try_malloc0(sizeof(struct probe_filter)))) {
+			sr_err("session: %s: filter malloc failed", __func__);
+			return NULL;
+		}
+		f->sdi = sdi;
+		session->probe_filters =
+		    g_slist_append(session->probe_filters, f);
+	}
+
+	/* A new filter has no unit size yet, so this always builds it. */
+	if (f->enabled_mask == mask && f->in_unitsize == in_unitsize)
+		return f;
+
+	n = 0;
+	for (l = sdi->probes; l && n < SR_MAX_NUM_PROBES; l = l->next) {
+		probe = l->data;
+		/* Analog probes aren't bits of the logic units. */
+		if (probe->type == SR_PROBE_LOGIC && probe->enabled)
+			f->probelist[n++] = probe->index;
+	}
+	f->probelist[n] = -1;
+	f->enabled_mask = mask;
+	f->in_unitsize = in_unitsize;
+	f->out_unitsize = MAX((n + 7) / 8, 1);
+	f->identity = sr_filter_probes_identity(in_unitsize, f->out_unitsize,
+						f->probelist);
+
+	return f;
+}
+
+/* Reuse the last output buffer, unless it's too small or still held. */
+static gboolean probe_filter_buf_get(struct probe_filter *f, uint64_t size)
+{
+	if (f->buf && (f->buf->size < size ||
+		       g_atomic_int_get(&f->buf->refcount) > 1)) {
+		sr_buffer_release(f->buf);
+		f->buf = NULL;
+	}
+	if (!f->buf && !(f->buf = sr_buffer_new(MAX(size, 1))))
+		return FALSE;
+
+	return TRUE;
+}
+
+/*
+ * Filter a logic packet down to its device's enabled probes. Returns
+ * FALSE if the packet should be delivered as is.
+ */
+static gboolean probe_filter_apply(const struct sr_dev_inst *sdi,
+				   const struct sr_datafeed_logic *logic,
+				   struct sr_datafeed_logic *filtered)
+{
+	struct probe_filter *f;
+	uint64_t size;
+
+	if (!(f = probe_filter_get(sdi, logic->unitsize)) || f->identity)
+		return FALSE;
+
+	size = (logic->length / logic->unitsize) * f->out_unitsize;
+	if (!probe_filter_buf_get(f, size))
+		return FALSE;
+
+	if (sr_filter_probes_buf(logic->unitsize, f->out_unitsize,
+				 f->probelist, logic->data, logic->length,
+				 f->buf->data, &filtered->length) != SR_OK) {
+		sr_err("session: %s: probe filter failed, passing the "
+		       "packet on unfiltered", __func__);
+		return FALSE;
+	}
+	filtered->unitsize = f->out_unitsize;
+	filtered->data = f->buf->data;
+	filtered->buffer = f->buf;
+	filtered->offset = logic->offset;
+	filtered->timestamp = logic->timestamp;
+
+	return TRUE;
+}
+
+/*
+ * Filter the runs of an SR_DF_LOGIC_RLE packet down to its device's
+ * enabled probes, merging runs which end up with the same value. Returns
+ * FALSE if the packet should be delivered as is.
+ */
+static gboolean probe_filter_apply_rle(const struct sr_dev_inst *sdi,
+				       const struct sr_datafeed_logic_rle *rle,
+				       struct sr_datafeed_logic_rle *filtered)
+{
+	struct probe_filter *f;
+	struct sr_logic_run *runs;
+	uint64_t i, n, value;
+	int p;
+
+	if (!(f = probe_filter_get(sdi, rle->unitsize)) || f->identity)
+		return FALSE;
+
+	if (!probe_filter_buf_get(f, rle->num_runs * sizeof(*runs)))
+		return FALSE;
+
+	runs = f->buf->data;
+	n = 0;
+	for (i = 0; i < rle->num_runs; i++) {
+		value = 0;
+		for (p = 0; f->probelist[p] != -1; p++) {
+			if (f->probelist[p] < 64 &&
+			    (rle->runs[i].value >> f->probelist[p]) & 1)
+				value |= UINT64_C(1) << p;
+		}
+		if (n && runs[n - 1].value == value) {
+			runs[n - 1].length += rle->runs[i].length;
+		} else {
+			runs[n].value = value;
+			runs[n].length = rle->runs[i].length;
+			n++;
+		}
+	}
+	filtered->num_runs = n;
+	filtered->unitsize = f->out_unitsize;
+	filtered->runs = runs;
+	filtered->buffer = f->buf;
+	filtered->offset = rle->offset;
+	filtered->timestamp = rle->timestamp;
+
+	return TRUE;
+}
+
+static void decimators_free(void)
+{
+	struct session_decimator *sd;
+	GSList *l;
+
+	for (l = session->decimators; l; l = l->next) {
+		sd = l->data;
+		sr_decimator_destroy(sd->decimator);
+		if (sd->buf)
+			sr_buffer_release(sd->buf);
+		g_free(sd);
+	}
+	g_slist_free(session->decimators);
+	session->decimators = NULL;
+}
+
+/* Find (or create) the decimator of a device. */
+static struct session_decimator *decimator_get(const struct sr_dev_inst *sdi)
+{
+	struct session_decimator *sd;
+	GSList *l;
+
+	for (l = session->decimators; l; l = l->next) {
+		if (((struct session_decimator *)l->data)->sdi == sdi)
+			return l->data;
+	}
+
+	if (!(sd = g_try_malloc0(sizeof(struct session_decimator)))) {
+		sr_err("session: %s: decimator malloc failed", __func__);
+		return NULL;
+	}
+	if (sr_decimator_new(session->decimate_factor, session->decimate_mode,
+			     &sd->decimator) != SR_OK) {
+		g_free(sd);
+		return NULL;
+	}
+	sd->sdi = sdi;
+	session->decimators = g_slist_append(session->decimators, sd);
+
+	return sd;
+}
+
+static void probe_stats_free(void)
+{
+	struct session_probe_stats *ps;
+	GSList *l;
+
+	for (l = session->probe_stats_devs; l; l = l->next) {
+		ps = l->data;
+		sr_logic_stats_destroy(ps->stats);
+		g_free(ps);
+	}
+	g_slist_free(session->probe_stats_devs);
+	session->probe_stats_devs = NULL;
+}
+
+/* Update the statistics of a device's probes with a packet. */
+static void probe_stats_apply(const struct sr_dev_inst *sdi,
+			      const struct sr_datafeed_packet *packet)
+{
+	struct session_probe_stats *ps;
+	const struct sr_datafeed_meta_logic *meta;
+	const struct sr_datafeed_logic *logic;
+	GSList *l;
+
+	if (packet->type != SR_DF_HEADER && packet->type != SR_DF_META_LOGIC
+	    && packet->type != SR_DF_LOGIC && packet->type != SR_DF_LOGIC_RLE)
+		return;
+
+	ps = NULL;
+	for (l = session->probe_stats_devs; l && !ps; l = l->next) {
+		if (((struct session_probe_stats *)l->data)->sdi == sdi)
+			ps = l->data;
+	}
+	if (!ps) {
+		if (!(ps = g_try_malloc0(sizeof(struct session_probe_stats)))) {
+			sr_err("session: %s: stats malloc failed", __func__);
+			return;
+		}
+		if (sr_logic_stats_new(&ps->stats) != SR_OK) {
+			g_free(ps);
+			return;
+		}
+		ps->sdi = sdi;
+		session->probe_stats_devs =
+			g_slist_append(session->probe_stats_devs, ps);
+	}
+
+	switch (packet->type) {
+	case SR_DF_HEADER:
+		sr_logic_stats_reset(ps->stats, 0);
+		break;
+	case SR_DF_META_LOGIC:
+		meta = packet->payload;
+		ps->stats->samplerate = meta->samplerate;
+		break;
+	case SR_DF_LOGIC:
+		logic = packet->payload;
+		if (logic->unitsize > 0 && logic->unitsize <= 8)
+			sr_logic_stats_feed(ps->stats, logic->data,
+					    logic->length, logic->unitsize);
+		break;
+	default:
+		sr_logic_stats_feed_rle(ps->stats, packet->payload);
+		break;
+	}
+}
+
+/* Payloads of the packets decimate_apply() hands out instead. */
+struct decimated {
+	struct sr_datafeed_packet packet;
+	union {
+		struct sr_datafeed_logic logic;
+		struct sr_datafeed_meta_logic meta;
+		struct sr_datafeed_sync sync;
+		struct sr_datafeed_trigger trigger;
+		struct sr_datafeed_overrun overrun;
+	} payload;
+};
+
+/*
+ * Samples were lost: drop the window started before the gap, which
+ * would otherwise be completed with samples from after it, and skip the
+ * decimated samples the gap (and that window) took up. 'overrun' is
+ * turned into the decimated one.
+ */
+static void decimate_gap(struct sr_decimator *d,
+			 struct sr_datafeed_overrun *overrun)
+{
+	uint64_t samples_out, lost;
+	uint16_t unitsize;
+
+	lost = d->fill + overrun->num_samples;
+	lost = (lost + d->factor - 1) / d->factor;
+	samples_out = d->samples_out;
+	unitsize = d->unitsize;
+	sr_decimator_reset(d);
+	d->unitsize = unitsize;
+	d->samples_out = samples_out + lost;
+
+	overrun->offset = samples_out;
+	overrun->num_samples = lost;
+}
+
+/*
+ * Decimate a packet of a device. Returns the packet to deliver instead,
+ * which may be 'packet' itself, or NULL if there is nothing to deliver.
+ */
+static struct sr_datafeed_packet *decimate_apply(
+		const struct sr_dev_inst *sdi,
+		struct sr_datafeed_packet *packet, struct decimated *out)
+{
+	struct session_decimator *sd;
+	const struct sr_datafeed_logic *logic;
+	struct sr_datafeed_logic *dlogic;
+	struct sr_buffer *buf;
+	const uint64_t factor = session->decimate_factor;
+	uint64_t size;
+
+	if (!(sd = decimator_get(sdi)))
+		return packet;
+
+	out->packet.type = packet->type;
+	out->packet.payload = &out->payload;
+
+	switch (packet->type) {
+	case SR_DF_HEADER:
+		sr_decimator_reset(sd->decimator);
+		return packet;
+	case SR_DF_META_LOGIC:
+		out->payload.meta = *(struct sr_datafeed_meta_logic *)
+					packet->payload;
+		out->payload.meta.samplerate /= factor;
+		return &out->packet;
+	case SR_DF_SYNC:
+		out->payload.sync = *(struct sr_datafeed_sync *)
+					packet->payload;
+		out->payload.sync.offset /= factor;
+		out->payload.sync.samplerate /= factor;
+		return &out->packet;
+	/*
+	 * Offsets count the decimated samples put out so far, as the
+	 * logic packets' offsets do, so gaps can't throw them apart.
+	 */
+	case SR_DF_TRIGGER:
+		if (!packet->payload)
+			return packet;
+		out->payload.trigger = *(struct sr_datafeed_trigger *)
+					packet->payload;
+		out->payload.trigger.offset = sd->decimator->samples_out;
+		return &out->packet;
+	case SR_DF_OVERRUN:
+		out->payload.overrun = *(struct sr_datafeed_overrun *)
+					packet->payload;
+		decimate_gap(sd->decimator, &out->payload.overrun);
+		return &out->packet;
+	case SR_DF_LOGIC:
+		break;
+	default:
+		return packet;
+	}
+
+	logic = packet->payload;
+	if (logic->unitsize == 0 || logic->unitsize > 8)
+		return packet;
+
+	/* Reuse the last output buffer, unless it's too small or held. */
+	size = (logic->length / logic->unitsize / factor + 1)
+		* logic->unitsize;
+	buf = sd->buf;
+	if (buf && (buf->size < size ||
+		    g_atomic_int_get(&buf->refcount) > 1)) {
+		sr_buffer_release(buf);
+		buf = sd->buf = NULL;
+	}
+	if (!buf && !(buf = sd->buf = sr_buffer_new(size)))
+		return packet;
+
+	dlogic = &out->payload.logic;
+	dlogic->offset = sd->decimator->samples_out;
+	if (sr_decimate_logic(sd->decimator, logic->data, logic->length,
+			      logic->unitsize, buf->data,
+			      &dlogic->length) != SR_OK)
+		return packet;
+	if (dlogic->length == 0)
+		return NULL;
+	dlogic->unitsize = logic->unitsize;
+	dlogic->data = buf->data;
+	dlogic->buffer = buf;
+	dlogic->timestamp = logic->timestamp;
+
+	return &out->packet;
+}
+
+/*
+ * Deliver an SR_DF_LOGIC_RLE packet as a series of SR_DF_LOGIC packets,
+ * for datafeed callbacks which don't handle the runs themselves.
+ */
+static void rle_dispatch_expanded(const struct sr_dev_inst *sdi,
+				  const struct sr_datafeed_logic_rle *rle)
+{
+	struct sr_datafeed_packet logic_packet;
+	struct sr_datafeed_logic logic;
+	struct sr_buffer *buf;
+	uint64_t run, offset;
+
+	logic_packet.type = SR_DF_LOGIC;
+	logic_packet.payload = &logic;
+	logic.unitsize = rle->unitsize;
+	logic.offset = rle->offset;
+	logic.timestamp = rle->timestamp;
+
+	run = offset = 0;
+	while (run < rle->num_runs) {
+		/* Reuse the last buffer, unless a consumer still holds it. */
+		buf = session->rle_buf;
+		if (buf && g_atomic_int_get(&buf->refcount) > 1) {
+			sr_buffer_release(buf);
+			buf = session->rle_buf = NULL;
+		}
+		if (!buf && !(buf = session->rle_buf =
+			      sr_buffer_new(SESSION_RLE_EXPAND_SIZE)))
+			return;
+
+		if (sr_logic_rle_expand(rle, &run, &offset, buf->data,
+					buf->size, &logic.length) != SR_OK)
+			return;
+		if (logic.length == 0)
+			break;
+		logic.data = buf->data;
+		logic.buffer = buf;
+		datafeed_dispatch(sdi, &logic_packet);
+		logic.offset += logic.length / logic.unitsize;
+	}
+}
+
+static void stats_record(struct datafeed_stats *stats, uint64_t bytes,
+			 uint64_t latency)
+{
+	stats->calls++;
+	stats->bytes += bytes;
+	stats->histogram[stats_bucket(latency)]++;
+	if (latency > stats->latency_max)
+		stats->latency_max = latency;
+}
+
+/* Queue a packet for all asynchronous datafeed callbacks. */
+static void async_consumers_send(const struct sr_dev_inst *sdi,
+				 struct sr_datafeed_packet *packet)
+{
+	struct async_packet *p;
+	struct datafeed_stats *stats;
+	GSList *l;
+
+	if (!(p = g_try_malloc(sizeof(struct async_packet)))
+	    || !(p->packet = sr_packet_copy(packet))) {
+		sr_err("session: %s: packet copy failed, dropping it for "
+		       "the asynchronous callbacks", __func__);
+		g_free(p);
+		return;
+	}
+	p->sdi = sdi;
+	p->refcount = session->num_async;
+	p->stats = session->stats_enabled;
+
+	for (l = session->datafeed_stats; l; l = l->next) {
+		stats = l->data;
+		if (stats->async)
+			async_consumer_push(stats->async, p);
+	}
+}
+
+/* Hand a packet to the datafeed callbacks, keeping their statistics. */
+static void callbacks_deliver(const struct sr_dev_inst *sdi,
+			      struct sr_datafeed_packet *packet)
+{
+	GSList *l, *s;
+	sr_datafeed_callback_t cb;
+	struct datafeed_stats *stats;
+	uint64_t bytes, latency;
+	gint64 start;
+
+	if (sr_log_loglevel_get() >= SR_LOG_DBG)
+		datafeed_dump(packet);
+
+	/* Get the workers going first, they run alongside the others. */
+	if (session->num_async)
+		async_consumers_send(sdi, packet);
+
+	if (!session->stats_enabled) {
+		for (l = session->datafeed_callbacks,
+		     s = session->datafeed_stats; l && s;
+		     l = l->next, s = s->next) {
+			stats = s->data;
+			if (stats->async)
+				continue;
+			cb = l->data;
+			cb(sdi, packet);
+		}
+		return;
+	}
+
+	bytes = packet_bytes(packet);
+	for (l = session->datafeed_callbacks, s = session->datafeed_stats;
+	     l && s; l = l->next, s = s->next) {
+		cb = l->data;
+		stats = s->data;
+		if (stats->async)
+			continue;
+		start = g_get_monotonic_time();
+		cb(sdi, packet);
+		latency = g_get_monotonic_time() - start;
+		stats_record(stats, bytes, latency);
+	}
+}
+
+/*
+ * Run a packet through the transforms from 'l' on, and hand what comes
+ * out of them to the datafeed callbacks.
+ */
+static void transforms_run(GSList *l, const struct sr_dev_inst *sdi,
+			   struct sr_datafeed_packet *packet)
+{
+	struct sr_transform *t;
+	struct sr_datafeed_packet *out;
+
+	for (; l; l = l->next) {
+		t = l->data;
+		if ((t->sdi && t->sdi != sdi) || !t->format->receive)
+			continue;
+		out = packet;
+		if (t->format->receive(t, sdi, packet, &out) != SR_OK) {
+			sr_err("session: transform '%s' failed, passing the "
+			       "packet on", t->format->id);
+			out = packet;
+		}
+		if (!out)
+			return;
+		packet = out;
+	}
+
+	callbacks_deliver(sdi, packet);
+}
+
+/* Hand a packet to the transforms, then the datafeed callbacks. */
+static void datafeed_deliver(const struct sr_dev_inst *sdi,
+			     struct sr_datafeed_packet *packet)
+{
+	transforms_run(session->transforms, sdi, packet);
+}
+
+/**
+ * Send a packet on from a transform.
+ *
+ * Only to be called from the transform's receive() callback: the packet
+ * goes through the transforms after 't' in the chain, and then to the
+ * datafeed callbacks, before this returns.
+ *
+ * @param t The transform sending the packet. Must not be NULL.
+ * @param sdi The device instance the packet is from.
+ * @param packet The packet. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_transform_send(struct sr_transform *t,
+		const struct sr_dev_inst *sdi,
+		struct sr_datafeed_packet *packet)
+{
+	GSList *l;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!t || !packet || !(l = g_slist_find(session->transforms, t))) {
+		sr_err("session: %s: invalid transform or packet", __func__);
+		return SR_ERR_ARG;
+	}
+
+	transforms_run(l->next, sdi, packet);
+
+	return SR_OK;
+}
+
+static void merge_free(void)
+{
+	struct session_merge *m;
+	int i;
+
+	if (!(m = session->merge))
+		return;
+
+	for (i = 0; i < 2; i++)
+		g_free(m->streams[i].data);
+	if (m->buf)
+		sr_buffer_release(m->buf);
+	g_free(m);
+	session->merge = NULL;
+}
+
+/* Forget about the last acquisition, but keep the buffers. */
+static void merge_reset(struct session_merge *m)
+{
+	struct merge_stream *s;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		s = &m->streams[i];
+		s->len = 0;
+		s->unitsize = 0;
+		s->skip = 0;
+		s->received = 0;
+		s->have_header = s->have_meta = s->have_sync = FALSE;
+		s->ended = FALSE;
+	}
+	m->emitted = 0;
+	m->trigger_pending = m->triggered = FALSE;
+	m->meta_sent = FALSE;
+	m->passthrough = FALSE;
+}
+
+static void merge_send(const struct sr_dev_inst *sdi, int type,
+		       void *payload)
+{
+	struct sr_datafeed_packet packet;
+
+	packet.type = type;
+	packet.payload = payload;
+	datafeed_deliver(sdi, &packet);
+}
+
+/*
+ * Give up on merging, and pass the streams on separately from now on.
+ * Whatever of them was held back for the merged stream goes out first.
+ */
+static void merge_passthrough(struct session_merge *m, const char *why)
+{
+	struct merge_stream *a, *b;
+
+	sr_err("session: can't merge logic streams: %s; passing them on "
+	       "separately", why);
+	m->passthrough = TRUE;
+	if (m->meta_sent)
+		return;
+
+	a = &m->streams[0];
+	b = &m->streams[1];
+	if (a->have_meta)
+		merge_send(a->sdi, SR_DF_META_LOGIC, &a->meta);
+	if (b->have_header)
+		merge_send(b->sdi, SR_DF_HEADER, &b->header);
+	if (b->have_meta)
+		merge_send(b->sdi, SR_DF_META_LOGIC, &b->meta);
+}
+
+static gboolean merge_reserve(struct merge_stream *s, uint64_t bytes)
+{
+	uint64_t size;
+	uint8_t *data;
+
+	if (s->len + bytes <= s->size)
+		return TRUE;
+
+	size = MAX(s->size * 2, s->len + bytes);
+	if (!(data = g_try_realloc(s->data, size))) {
+		sr_err("session: %s: merge buffer malloc failed", __func__);
+		return FALSE;
+	}
+	s->data = data;
+	s->size = size;
+
+	return TRUE;
+}
+
+/* Drop 'n' samples from the front of a stream's buffer. */
+static void merge_consume(struct merge_stream *s, uint64_t n)
+{
+	uint64_t bytes;
+
+	bytes = MIN(n * s->unitsize, s->len);
+	memmove(s->data, s->data + bytes, s->len - bytes);
+	s->len -= bytes;
+}
+
+/*
+ * Take in 'length' bytes of samples which have just been placed at the
+ * end of the stream's buffer, dropping those which are still to be
+ * skipped.
+ */
+static void merge_commit(struct merge_stream *s, uint64_t length)
+{
+	uint8_t *p;
+	uint64_t n, d;
+
+	n = length / s->unitsize;
+	d = MIN(s->skip, n);
+	if (d) {
+		p = s->data + s->len;
+		memmove(p, p + d * s->unitsize, (n - d) * s->unitsize);
+		s->skip -= d;
+	}
+	s->len += (n - d) * s->unitsize;
+	s->received += n - d;
+}
+
+static gboolean merge_unitsize(struct merge_stream *s, uint16_t unitsize)
+{
+	if (!s->unitsize)
+		s->unitsize = unitsize;
+
+	return unitsize && s->unitsize == unitsize;
+}
+
+static gboolean merge_append(struct merge_stream *s,
+			     const struct sr_datafeed_logic *logic)
+{
+	if (!merge_unitsize(s, logic->unitsize)
+	    || !merge_reserve(s, logic->length))
+		return FALSE;
+
+	memcpy(s->data + s->len, logic->data, logic->length);
+	merge_commit(s, logic->length);
+	s->timestamp = logic->timestamp;
+
+	return TRUE;
+}
+
+static gboolean merge_append_rle(struct merge_stream *s,
+				 const struct sr_datafeed_logic_rle *rle)
+{
+	uint64_t run, offset, length;
+
+	if (!merge_unitsize(s, rle->unitsize))
+		return FALSE;
+
+	run = offset = 0;
+	while (run < rle->num_runs) {
+		if (!merge_reserve(s, SESSION_RLE_EXPAND_SIZE)
+		    || sr_logic_rle_expand(rle, &run, &offset, s->data + s->len,
+					   SESSION_RLE_EXPAND_SIZE,
+					   &length) != SR_OK)
+			return FALSE;
+		if (length == 0)
+			break;
+		merge_commit(s, length);
+	}
+	s->timestamp = rle->timestamp;
+
+	return TRUE;
+}
+
+/* Deliver the first 'n' samples both streams have. */
+static void merge_deliver(struct session_merge *m, uint64_t n)
+{
+	struct sr_datafeed_logic logic;
+	struct merge_stream *a, *b;
+	const uint8_t *pa, *pb;
+	uint8_t *out;
+	uint64_t i, size;
+
+	a = &m->streams[0];
+	b = &m->streams[1];
+	logic.unitsize = a->unitsize + b->unitsize;
+	size = n * logic.unitsize;
+
+	/* Reuse the last buffer, unless it's too small or still held. */
+	if (m->buf && (m->buf->size < size ||
+		       g_atomic_int_get(&m->buf->refcount) > 1)) {
+		sr_buffer_release(m->buf);
+		m->buf = NULL;
+	}
+	if (!m->buf && !(m->buf = sr_buffer_new(MAX(size, 1))))
+		return;
+
+	out = m->buf->data;
+	pa = a->data;
+	pb = b->data;
+	for (i = 0; i < n; i++) {
+		memcpy(out, pa, a->unitsize);
+		out += a->unitsize;
+		pa += a->unitsize;
+		memcpy(out, pb, b->unitsize);
+		out += b->unitsize;
+		pb += b->unitsize;
+	}
+
+	logic.length = size;
+	logic.data = m->buf->data;
+	logic.buffer = m->buf;
+	/* The merged samples are complete once the later one arrived. */
+	logic.offset = m->emitted;
+	logic.timestamp = MAX(a->timestamp, b->timestamp);
+	merge_send(a->sdi, SR_DF_LOGIC, &logic);
+
+	merge_consume(a, n);
+	merge_consume(b, n);
+	m->emitted += n;
+}
+
+static void merge_send_trigger(struct session_merge *m)
+{
+	struct sr_datafeed_trigger trigger;
+
+	trigger.offset = m->trigger_pos;
+	trigger.timestamp = m->trigger_timestamp;
+	merge_send(m->streams[0].sdi, SR_DF_TRIGGER, &trigger);
+}
+
+/* Deliver all samples which have a partner, and a pending trigger. */
+static void merge_flush(struct session_merge *m)
+{
+	struct merge_stream *a, *b;
+	uint64_t n;
+
+	a = &m->streams[0];
+	b = &m->streams[1];
+	for (;;) {
+		n = 0;
+		if (a->unitsize && b->unitsize)
+			n = MIN(a->len / a->unitsize, b->len / b->unitsize);
+		if (m->trigger_pending && m->trigger_pos <= m->emitted) {
+			merge_send_trigger(m);
+			m->trigger_pending = FALSE;
+			m->triggered = TRUE;
+			continue;
+		}
+		if (m->trigger_pending)
+			n = MIN(n, m->trigger_pos - m->emitted);
+		if (!n)
+			break;
+		merge_deliver(m, n);
+	}
+
+	/*
+	 * Once a stream ended, what the other one has beyond it never gets
+	 * a partner: drop it rather than hold it until that one ends too.
+	 */
+	if (a->ended)
+		b->len = 0;
+	if (b->ended)
+		a->len = 0;
+}
+
+/* Once both streams are synced, line them up. */
+static void merge_sync(struct session_merge *m)
+{
+	struct sr_datafeed_sync sync;
+	struct merge_stream *s;
+	uint64_t d;
+	int i;
+
+	sync.offset = MAX(m->streams[0].sync.offset,
+			  m->streams[1].sync.offset);
+	sync.samplerate = m->streams[0].sync.samplerate;
+	for (i = 0; i < 2; i++) {
+		s = &m->streams[i];
+		s->skip = sync.offset - s->sync.offset;
+		/* Samples may have come in before the sync. */
+		if (s->unitsize) {
+			d = MIN(s->skip, s->len / s->unitsize);
+			merge_consume(s, d);
+			s->skip -= d;
+			s->received -= d;
+		}
+	}
+	merge_send(m->streams[0].sdi, SR_DF_SYNC, &sync);
+}
+
+/*
+ * Take a packet of one of the merged devices into the merged stream.
+ * Returns FALSE if the packet should be delivered as is.
+ */
+static gboolean merge_apply(const struct sr_dev_inst *sdi,
+			    struct sr_datafeed_packet *packet)
+{
+	struct sr_datafeed_meta_logic meta;
+	struct session_merge *m;
+	struct merge_stream *s, *a, *b;
+	gboolean ok;
+
+	m = session->merge;
+	if (m->passthrough)
+		return FALSE;
+
+	a = &m->streams[0];
+	b = &m->streams[1];
+	if (sdi == a->sdi)
+		s = a;
+	else if (sdi == b->sdi)
+		s = b;
+	else
+		return FALSE;
+
+	switch (packet->type) {
+	case SR_DF_HEADER:
+		s->header = *(const struct sr_datafeed_header *)packet->payload;
+		s->have_header = TRUE;
+		if (s == a)
+			datafeed_deliver(sdi, packet);
+		break;
+	case SR_DF_META_LOGIC:
+		s->meta = *(const struct sr_datafeed_meta_logic *)
+			  packet->payload;
+		s->have_meta = TRUE;
+		if (!a->have_meta || !b->have_meta)
+			break;
+		if (a->meta.samplerate != b->meta.samplerate) {
+			merge_passthrough(m, "samplerates differ");
+			break;
+		}
+		meta.samplerate = a->meta.samplerate;
+		meta.num_probes = (a->meta.num_probes + 7) / 8 * 8
+				  + b->meta.num_probes;
+		merge_send(a->sdi, SR_DF_META_LOGIC, &meta);
+		m->meta_sent = TRUE;
+		break;
+	case SR_DF_SYNC:
+		s->sync = *(const struct sr_datafeed_sync *)packet->payload;
+		s->have_sync = TRUE;
+		if (a->have_sync && b->have_sync)
+			merge_sync(m);
+		break;
+	case SR_DF_LOGIC:
+	case SR_DF_LOGIC_RLE:
+		if (packet->type == SR_DF_LOGIC)
+			ok = merge_append(s, packet->payload);
+		else
+			ok = merge_append_rle(s, packet->payload);
+		if (!ok) {
+			merge_passthrough(m, "unit size changed or out of "
+					  "memory");
+			return FALSE;
+		}
+		merge_flush(m);
+		break;
+	case SR_DF_TRIGGER:
+		/* The first trigger of either device counts. */
+		if (!m->trigger_pending && !m->triggered) {
+			m->trigger_pending = TRUE;
+			m->trigger_pos = s->received;
+			m->trigger_timestamp = packet->payload ?
+				((const struct sr_datafeed_trigger *)
+				 packet->payload)->timestamp : 0;
+		}
+		merge_flush(m);
+		break;
+	case SR_DF_END:
+		s->ended = TRUE;
+		merge_flush(m);
+		if (a->ended && b->ended) {
+			/* Its samples never came; don't lose the trigger. */
+			if (m->trigger_pending)
+				merge_send_trigger(m);
+			merge_send(a->sdi, SR_DF_END, NULL);
+			merge_reset(m);
+		}
+		break;
+	default:
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Deliver an SR_DF_ANALOG_RAW packet as an SR_DF_ANALOG packet, for
+ * datafeed callbacks which don't handle the codes themselves.
+ */
+static void analog_raw_dispatch_converted(const struct sr_dev_inst *sdi,
+		const struct sr_datafeed_analog_raw *raw)
+{
+	struct sr_datafeed_packet analog_packet;
+	struct sr_datafeed_analog analog;
+	struct sr_buffer *buf;
+	uint64_t size;
+
+	if (raw->num_samples <= 0 || raw->num_probes <= 0)
+		return;
+	size = (uint64_t)raw->num_samples * raw->num_probes * sizeof(float);
+
+	/* Reuse the last buffer, unless it's too small or still held. */
+	buf = session->analog_buf;
+	if (buf && (buf->size < size ||
+		    g_atomic_int_get(&buf->refcount) > 1)) {
+		sr_buffer_release(buf);
+		buf = session->analog_buf = NULL;
+	}
+	if (!buf && !(buf = session->analog_buf = sr_buffer_new(size)))
+		return;
+
+	if (sr_analog_raw_to_float(raw, buf->data) != SR_OK)
+		return;
+
+	analog_packet.type = SR_DF_ANALOG;
+	analog_packet.payload = &analog;
+	analog.num_samples = raw->num_samples;
+	analog.mq = raw->mq;
+	analog.unit = raw->unit;
+	analog.mqflags = raw->mqflags;
+	analog.data = buf->data;
+	analog.buffer = buf;
+	datafeed_deliver(sdi, &analog_packet);
+}
+
+static void datafeed_dispatch(const struct sr_dev_inst *sdi,
+			      struct sr_datafeed_packet *packet)
+{
+	struct sr_datafeed_packet filtered_packet;
+	struct sr_datafeed_logic filtered_logic;
+	struct sr_datafeed_logic_rle filtered_rle;
+	struct decimated decimated;
+
+	/* Decimation works on the expanded samples. */
+	if (packet->type == SR_DF_LOGIC_RLE &&
+	    (!session->rle_native || session->decimate_factor > 1)) {
+		rle_dispatch_expanded(sdi, packet->payload);
+		return;
+	}
+
+	if (packet->type == SR_DF_ANALOG_RAW && !session->analog_raw_native) {
+		analog_raw_dispatch_converted(sdi, packet->payload);
+		return;
+	}
+
+	if (session->probe_filter && packet->type == SR_DF_LOGIC &&
+	    probe_filter_apply(sdi, packet->payload, &filtered_logic)) {
+		filtered_packet.type = SR_DF_LOGIC;
+		filtered_packet.payload = &filtered_logic;
+		packet = &filtered_packet;
+	} else if (session->probe_filter && packet->type == SR_DF_LOGIC_RLE
+		   && probe_filter_apply_rle(sdi, packet->payload,
+					     &filtered_rle)) {
+		filtered_packet.type = SR_DF_LOGIC_RLE;
+		filtered_packet.payload = &filtered_rle;
+		packet = &filtered_packet;
+	}
+
+	if (session->decimate_factor > 1 &&
+	    !(packet = decimate_apply(sdi, packet, &decimated)))
+		return;
+
+	if (session->probe_stats)
+		probe_stats_apply(sdi, packet);
+
+	if (session->merge && merge_apply(sdi, packet))
+		return;
+
+	datafeed_deliver(sdi, packet);
+}
+
+/*
+ * Deliver a packet to the datafeed callbacks, or queue it for the thread
+ * running them.
+ */
+static int session_send_packet(const struct sr_dev_inst *sdi,
+			       struct sr_datafeed_packet *packet)
+{
+	struct packet_ring *ring;
+	struct sr_datafeed_packet *copy;
+
+	if (session->threaded && g_private_get(&acquisition_thread_key)
+	    && (ring = ring_find(sdi))) {
+		/* Hand the packet over to the thread running the callbacks. */
+		if (!(copy = sr_packet_copy(packet)))
+			return SR_ERR_MALLOC;
+		ring_push(ring, copy);
+		return SR_OK;
+	}
+
+	if (session->threaded) {
+		g_mutex_lock(&session->dispatch_mutex);
+		datafeed_dispatch(sdi, packet);
+		g_mutex_unlock(&session->dispatch_mutex);
+	} else {
+		datafeed_dispatch(sdi, packet);
+	}
+
+	return SR_OK;
+}
+
+static struct coalescer *coalescer_find(const struct sr_dev_inst *sdi)
+{
+	struct coalescer *c;
+	GSList *l;
+
+	for (l = session->coalescers; l; l = l->next) {
+		c = l->data;
+		if (c->sdi == sdi)
+			return c;
+	}
+
+	return NULL;
+}
+
+static struct coalescer *coalescer_new(const struct sr_dev_inst *sdi)
+{
+	struct coalescer *c;
+
+	if (!(c = g_try_malloc0(sizeof(struct coalescer)))) {
+		sr_err("session: %s: coalescer malloc failed", __func__);
+		return NULL;
+	}
+	c->sdi = sdi;
+	session->coalescers = g_slist_append(session->coalescers, c);
+
+	return c;
+}
+
+/* Drop the coalescer, along with any data still pending in it. */
+static void coalescer_remove(struct coalescer *c)
+{
+	if (c->buf)
+		sr_buffer_release(c->buf);
+	session->coalescers = g_slist_remove(session->coalescers, c);
+	g_free(c);
+}
+
+static int coalescer_flush(struct coalescer *c)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	int ret;
+
+	if (!c->buf)
+		return SR_OK;
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.length = c->length;
+	logic.unitsize = c->unitsize;
+	logic.data = c->buf->data;
+	logic.buffer = c->buf;
+	logic.offset = c->offset;
+	logic.timestamp = c->timestamp;
+	ret = session_send_packet(c->sdi, &packet);
+
+	sr_buffer_release(c->buf);
+	c->buf = NULL;
+	c->length = 0;
+
+	return ret;
+}
+
+/* Flush all pending data whose deadline has passed. */
+static void coalescers_flush_expired(void)
+{
+	struct coalescer *c;
+	GSList *l;
+	gint64 now;
+
+	if (!session->coalescers || !session->coalesce_latency)
+		return;
+
+	now = g_get_monotonic_time();
+	for (l = session->coalescers; l; l = l->next) {
+		c = l->data;
+		if (c->buf && now >= c->deadline)
+			coalescer_flush(c);
+	}
+}
+
+/* Flush all pending data and drop the coalescers. */
+static void coalescers_flush_all(void)
 {
-	unsigned int i;
-	int ret;
+	struct coalescer *c;
 
-	while (session->num_sources > 0) {
-		ret = g_poll(session->pollfds, session->num_sources,
-				session->source_timeout);
-		for (i = 0; i < session->num_sources; i++) {
-			if (session->pollfds[i].revents > 0 || (ret == 0
-				&& session->source_timeout == session->sources[i].timeout)) {
-				/*
-				 * Invoke the source's callback on an event,
-				 * or if the poll timed out and this source
-				 * asked for that timeout.
-				 */
-				if (!session->sources[i].cb(session->pollfds[i].fd,
-						session->pollfds[i].revents,
-						session->sources[i].cb_data))
-					sr_session_source_remove(session->sources[i].poll_object);
-			}
-		}
+	while (session->coalescers) {
+		c = session->coalescers->data;
+		coalescer_flush(c);
+		coalescer_remove(c);
 	}
-
-	return SR_OK;
 }
 
-/**
- * Start a session.
- *
- * There can only be one session at a time.
- *
- * @return SR_OK upon success, SR_ERR upon errors.
+/*
+ * Return the time (in ms) until the earliest deadline of any pending
+ * data, or -1 if there is no such deadline.
  */
-SR_API int sr_session_start(void)
+static int coalescers_timeout(void)
 {
-	struct sr_dev_inst *sdi;
+	struct coalescer *c;
 	GSList *l;
-	int ret;
+	gint64 now, earliest;
 
-	if (!session) {
-		sr_err("session: %s: session was NULL; a session must be "
-		       "created before starting it.", __func__);
-		return SR_ERR_BUG;
-	}
+	if (!session->coalescers || !session->coalesce_latency)
+		return -1;
 
-	if (!session->devs) {
-		sr_err("session: %s: session->devs was NULL; a session "
-		       "cannot be started without devices.", __func__);
-		return SR_ERR_BUG;
+	earliest = -1;
+	for (l = session->coalescers; l; l = l->next) {
+		c = l->data;
+		if (c->buf && (earliest < 0 || c->deadline < earliest))
+			earliest = c->deadline;
 	}
 
-	sr_info("session: starting");
-
-	for (l = session->devs; l; l = l->next) {
-		sdi = l->data;
-		if ((ret = sdi->driver->dev_acquisition_start(sdi, sdi)) != SR_OK) {
-			sr_err("session: %s: could not start an acquisition "
-			       "(%d)", __func__, ret);
-			break;
-		}
-	}
+	if (earliest < 0)
+		return -1;
 
-	/* TODO: What if there are multiple devices? Which return code? */
+	now = g_get_monotonic_time();
+	if (earliest <= now)
+		return 0;
 
-	return ret;
+	/* Round up, so that the deadline has passed after the timeout. */
+	return (earliest - now + 999) / 1000;
 }
 
-/**
- * Run the session.
- *
- * @return SR_OK upon success, SR_ERR_BUG upon errors.
- */
-SR_API int sr_session_run(void)
+static int coalesce_send(const struct sr_dev_inst *sdi,
+			 struct sr_datafeed_packet *packet)
 {
-	if (!session) {
-		sr_err("session: %s: session was NULL; a session must be "
-		       "created first, before running it.", __func__);
-		return SR_ERR_BUG;
+	struct coalescer *c;
+	const struct sr_datafeed_logic *logic;
+	int ret;
+
+	c = coalescer_find(sdi);
+
+	if (packet->type != SR_DF_LOGIC) {
+		if (!c)
+			return session_send_packet(sdi, packet);
+		/* Pending data goes out first, to keep the packet order. */
+		ret = coalescer_flush(c);
+		if (packet->type == SR_DF_END)
+			coalescer_remove(c);
+		if (ret != SR_OK)
+			return ret;
+		return session_send_packet(sdi, packet);
 	}
 
-	if (!session->devs) {
-		/* TODO: Actually the case? */
-		sr_err("session: %s: session->devs was NULL; a session "
-		       "cannot be run without devices.", __func__);
-		return SR_ERR_BUG;
+	logic = packet->payload;
+
+	if (c && c->buf && (logic->unitsize != c->unitsize
+	    || c->length + logic->length > session->coalesce_size)) {
+		if ((ret = coalescer_flush(c)) != SR_OK)
+			return ret;
 	}
 
-	sr_info("session: running");
+	/* Big enough on its own. */
+	if (logic->length >= session->coalesce_size)
+		return session_send_packet(sdi, packet);
 
-	/* Do we have real sources? */
-	if (session->num_sources == 1 && session->pollfds[0].fd == -1) {
-		/* Dummy source, freewheel over it. */
-		while (session->num_sources)
-			session->sources[0].cb(-1, 0, session->sources[0].cb_data);
-	} else {
-		/* Real sources, use g_poll() main loop. */
-		sr_session_run_poll();
+	if (!c && !(c = coalescer_new(sdi)))
+		return SR_ERR_MALLOC;
+
+	if (!c->buf) {
+		if (!(c->buf = sr_buffer_new(session->coalesce_size)))
+			return SR_ERR_MALLOC;
+		c->unitsize = logic->unitsize;
+		c->offset = logic->offset;
+		c->timestamp = logic->timestamp;
+		c->deadline = g_get_monotonic_time()
+				+ (gint64)session->coalesce_latency * 1000;
 	}
 
-	return SR_OK;
-}
+	memcpy((uint8_t *)c->buf->data + c->length, logic->data,
+	       logic->length);
+	c->length += logic->length;
 
-/**
- * Halt the current session.
- *
- * This function is deprecated and should not be used in new code, use
- * sr_session_stop() instead. The behaviour of this function is identical to
- * sr_session_stop().
- *
- * @return SR_OK upon success, SR_ERR_BUG if no session exists.
- */
-SR_API int sr_session_halt(void)
-{
-	return sr_session_stop();
+	if (c->length == session->coalesce_size || (session->coalesce_latency
+	    && g_get_monotonic_time() >= c->deadline))
+		return coalescer_flush(c);
+
+	return SR_OK;
 }
 
-/**
- * Stop the current session.
- *
- * The current session is stopped immediately, with all acquisition sessions
- * being stopped and hardware drivers cleaned up.
- *
- * @return SR_OK upon success, SR_ERR_BUG if no session exists.
- */
-SR_API int sr_session_stop(void)
+static struct feed_position *position_get(const struct sr_dev_inst *sdi)
 {
-	struct sr_dev_inst *sdi;
+	struct feed_position *pos;
 	GSList *l;
 
-	if (!session) {
-		sr_err("session: %s: session was NULL", __func__);
-		return SR_ERR_BUG;
+	for (l = session->positions; l; l = l->next) {
+		pos = l->data;
+		if (pos->sdi == sdi)
+			return pos;
 	}
 
-	sr_info("session: stopping");
-
-	for (l = session->devs; l; l = l->next) {
-		sdi = l->data;
-		if (sdi->driver) {
-			if (sdi->driver->dev_acquisition_stop)
-				sdi->driver->dev_acquisition_stop(sdi, sdi);
-		}
+	if (!(pos = g_try_malloc0(sizeof(struct feed_position)))) {
+		sr_err("session: %s: position malloc failed", __func__);
+		return NULL;
 	}
+	pos->sdi = sdi;
+	session->positions = g_slist_prepend(session->positions, pos);
 
-	return SR_OK;
+	return pos;
 }
 
-/**
- * Debug helper.
- *
- * @param packet The packet to show debugging information for.
+/*
+ * Stamp a packet from a driver with its position in the device's sample
+ * stream and the time it came in. An SR_DF_TRIGGER without a payload
+ * gets 'trigger' as its payload.
  */
-static void datafeed_dump(struct sr_datafeed_packet *packet)
+static int packet_stamp(const struct sr_dev_inst *sdi,
+			struct sr_datafeed_packet *packet,
+			struct sr_datafeed_trigger *trigger)
 {
+	struct feed_position *pos;
 	struct sr_datafeed_logic *logic;
-	struct sr_datafeed_analog *analog;
+	struct sr_datafeed_logic_rle *rle;
+	const struct sr_datafeed_overrun *overrun;
+	uint64_t i;
 
 	switch (packet->type) {
 	case SR_DF_HEADER:
-		sr_dbg("bus: received SR_DF_HEADER");
-		break;
+	case SR_DF_LOGIC:
+	case SR_DF_LOGIC_RLE:
+	case SR_DF_OVERRUN:
 	case SR_DF_TRIGGER:
-		sr_dbg("bus: received SR_DF_TRIGGER");
+		if (!(pos = position_get(sdi)))
+			return SR_ERR_MALLOC;
 		break;
-	case SR_DF_META_LOGIC:
-		sr_dbg("bus: received SR_DF_META_LOGIC");
+	default:
+		return SR_OK;
+	}
+
+	switch (packet->type) {
+	case SR_DF_HEADER:
+		pos->samples = 0;
 		break;
 	case SR_DF_LOGIC:
 		logic = packet->payload;
-		/* TODO: Check for logic != NULL. */
-		sr_dbg("bus: received SR_DF_LOGIC %" PRIu64 " bytes", logic->length);
-		break;
-	case SR_DF_META_ANALOG:
-		sr_dbg("bus: received SR_DF_META_ANALOG");
-		break;
-	case SR_DF_ANALOG:
-		analog = packet->payload;
-		/* TODO: Check for analog != NULL. */
-		sr_dbg("bus: received SR_DF_ANALOG %d samples", analog->num_samples);
-		break;
-	case SR_DF_END:
-		sr_dbg("bus: received SR_DF_END");
+		logic->offset = pos->samples;
+		logic->timestamp = g_get_monotonic_time();
+		if (logic->unitsize)
+			pos->samples += logic->length / logic->unitsize;
 		break;
-	case SR_DF_FRAME_BEGIN:
-		sr_dbg("bus: received SR_DF_FRAME_BEGIN");
+	case SR_DF_LOGIC_RLE:
+		rle = packet->payload;
+		rle->offset = pos->samples;
+		rle->timestamp = g_get_monotonic_time();
+		for (i = 0; i < rle->num_runs; i++)
+			pos->samples += rle->runs[i].length;
 		break;
-	case SR_DF_FRAME_END:
-		sr_dbg("bus: received SR_DF_FRAME_END");
+	case SR_DF_OVERRUN:
+		/* The lost samples leave a gap in the offsets. */
+		overrun = packet->payload;
+		pos->samples += overrun->num_samples;
 		break;
-	default:
-		sr_dbg("bus: received unknown packet type %d", packet->type);
+	case SR_DF_TRIGGER:
+		if (packet->payload)
+			break;
+		trigger->offset = pos->samples;
+		trigger->timestamp = g_get_monotonic_time();
+		packet->payload = trigger;
 		break;
 	}
+
+	return SR_OK;
 }
 
 /**
@@ -418,6 +4095,19 @@ static void datafeed_dump(struct sr_datafeed_packet *packet)
  *
  * Hardware drivers use this to send a data packet to the frontend.
  *
+ * In threaded mode, packets sent from the acquisition thread are copied
+ * into the device's ring and delivered to the datafeed callbacks from the
+ * thread running sr_session_run(). If the ring is full, this blocks until
+ * the consumer has caught up.
+ *
+ * If coalescing is enabled (see sr_session_coalesce_set()), small logic
+ * packets may be held back and delivered later as part of a bigger one.
+ *
+ * Logic packets get their 'offset' and 'timestamp' set here, so drivers
+ * need not fill them in. So does an SR_DF_TRIGGER sent without payload;
+ * a driver which knows the exact trigger position can send a struct
+ * sr_datafeed_trigger itself.
+ *
  * @param sdi TODO.
  * @param packet The datafeed packet to send to the session bus.
  *
@@ -428,8 +4118,8 @@ static void datafeed_dump(struct sr_datafeed_packet *packet)
 SR_PRIV int sr_session_send(const struct sr_dev_inst *sdi,
 			    struct sr_datafeed_packet *packet)
 {
-	GSList *l;
-	sr_datafeed_callback_t cb;
+	struct sr_datafeed_trigger trigger;
+	int ret;
 
 	if (!sdi) {
 		sr_err("session: %s: sdi was NULL", __func__);
@@ -441,14 +4131,57 @@ SR_PRIV int sr_session_send(const struct sr_dev_inst *sdi,
 		return SR_ERR_ARG;
 	}
 
-	for (l = session->datafeed_callbacks; l; l = l->next) {
-		if (sr_log_loglevel_get() >= SR_LOG_DBG)
-			datafeed_dump(packet);
-		cb = l->data;
-		cb(sdi, packet);
+	SR_TRACE2(session_send_entry, sdi, packet->type);
+
+	if ((ret = packet_stamp(sdi, packet, &trigger)) == SR_OK) {
+		if (session->coalesce_size)
+			ret = coalesce_send(sdi, packet);
+		else
+			ret = session_send_packet(sdi, packet);
 	}
 
-	return SR_OK;
+	/* The packet is the driver's, don't leave it pointing in here. */
+	if (packet->payload == &trigger)
+		packet->payload = NULL;
+
+	SR_TRACE2(session_send_return, packet->type, ret);
+
+	return ret;
+}
+
+/**
+ * Check whether the datafeed callbacks are falling behind a device.
+ *
+ * In threaded mode, this returns TRUE while the device's queue of packets
+ * is filled beyond its high-watermark. A driver which can pace itself
+ * (e.g. file playback) should hold off sending more data until this
+ * returns FALSE again. Otherwise sr_session_send() may block once the
+ * queue is full, which also holds up all other devices in the session.
+ *
+ * Without threaded mode, packets are delivered synchronously by
+ * sr_session_send(), so this always returns FALSE.
+ *
+ * @param sdi The device instance. Must not be NULL.
+ *
+ * @return TRUE if the device should slow down, FALSE otherwise.
+ *
+ * @private
+ */
+SR_PRIV gboolean sr_session_congested(const struct sr_dev_inst *sdi)
+{
+	struct packet_ring *ring;
+	gint fill;
+
+	if (!session || !session->threaded
+	    || !g_atomic_int_get(&session->acquisition_running)
+	    || !(ring = ring_find(sdi)))
+		return FALSE;
+
+	fill = g_atomic_int_get(&ring->head) - g_atomic_int_get(&ring->tail);
+	if (fill < 0)
+		fill += SESSION_RING_SIZE;
+
+	return fill >= SESSION_RING_HIGH_WATER;
 }
 
 /**
@@ -468,6 +4201,8 @@ static int _sr_session_source_add(GPollFD *pollfd, int timeout,
 {
 	struct source *new_sources, *s;
 	GPollFD *new_pollfds;
+	unsigned int *new_timers;
+	unsigned int i, new_size;
 
 	if (!cb) {
 		sr_err("session: %s: cb was NULL", __func__);
@@ -476,32 +4211,60 @@ static int _sr_session_source_add(GPollFD *pollfd, int timeout,
 
 	/* Note: cb_data can be NULL, that's not a bug. */
 
-	new_pollfds = g_try_realloc(session->pollfds,
-			sizeof(GPollFD) * (session->num_sources + 1));
-	if (!new_pollfds) {
-		sr_err("session: %s: new_pollfds malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
+	/* Grow the arrays geometrically, so adding a source is cheap. */
+	if (session->num_sources == session->sources_size) {
+		new_size = session->sources_size ?
+			   session->sources_size * 2 : SESSION_SOURCES_MIN;
 
-	new_sources = g_try_realloc(session->sources, sizeof(struct source) *
-			(session->num_sources + 1));
-	if (!new_sources) {
-		sr_err("session: %s: new_sources malloc failed", __func__);
-		return SR_ERR_MALLOC;
+		new_pollfds = g_try_realloc(session->pollfds,
+					    sizeof(GPollFD) * new_size);
+		if (!new_pollfds) {
+			sr_err("session: %s: new_pollfds malloc failed",
+			       __func__);
+			return SR_ERR_MALLOC;
+		}
+		session->pollfds = new_pollfds;
+
+		new_sources = g_try_realloc(session->sources,
+					    sizeof(struct source) * new_size);
+		if (!new_sources) {
+			sr_err("session: %s: new_sources malloc failed",
+			       __func__);
+			return SR_ERR_MALLOC;
+		}
+		session->sources = new_sources;
+
+		new_timers = g_try_realloc(session->timers,
+					   sizeof(unsigned int) * new_size);
+		if (!new_timers) {
+			sr_err("session: %s: new_timers malloc failed",
+			       __func__);
+			return SR_ERR_MALLOC;
+		}
+		session->timers = new_timers;
+		session->sources_size = new_size;
 	}
 
-	new_pollfds[session->num_sources] = *pollfd;
-	s = &new_sources[session->num_sources++];
+	i = session->num_sources++;
+	session->pollfds[i] = *pollfd;
+	session->pollfds[i].revents = 0;
+	s = &session->sources[i];
 	s->timeout = timeout;
 	s->cb = cb;
 	s->cb_data = cb_data;
 	s->poll_object = poll_object;
-	session->pollfds = new_pollfds;
-	session->sources = new_sources;
+	s->registered = FALSE;
+	s->timer_pos = -1;
+	s->idle_until = 0;
+
+	if (session->backend_fd >= 0 && backend_wants(i)) {
+		if (backend_ctl(i, BACKEND_ADD) < 0)
+			backend_fallback(i);
+		else
+			s->registered = TRUE;
+	}
 
-	if (timeout != session->source_timeout && timeout > 0
-	    && (session->source_timeout == -1 || timeout < session->source_timeout))
-		session->source_timeout = timeout;
+	timer_arm(i, g_get_monotonic_time());
 
 	return SR_OK;
 }
@@ -574,60 +4337,144 @@ SR_API int sr_session_source_add_channel(GIOChannel *channel, int events,
 	return _sr_session_source_add(&p, timeout, cb, cb_data, (gintptr)channel);
 }
 
+/* Find the (not yet removed) source belonging to the poll object. */
+static int source_find(gintptr poll_object)
+{
+	unsigned int i;
+
+	for (i = 0; i < session->num_sources; i++) {
+		if (session->sources[i].cb
+		    && session->sources[i].poll_object == poll_object)
+			return i;
+	}
+
+	return -1;
+}
+
 /**
- * Remove the source belonging to the specified channel.
- *
- * @todo Add more error checks and logging.
+ * Change the timeout of the source belonging to the specified poll object.
  *
- * @param channel The channel for which the source should be removed.
+ * @param poll_object The fd, pollfd or channel of the source.
+ * @param timeout Max time to wait before the callback is called, ignored if 0.
  *
- * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or
- *         SR_ERR_MALLOC upon memory allocation errors, SR_ERR_BUG upon
- *         internal errors.
+ * @return SR_OK upon success, SR_ERR_ARG if there is no such source.
  */
-static int _sr_session_source_remove(gintptr poll_object)
+static int _sr_session_source_timeout_set(gintptr poll_object, int timeout)
 {
-	struct source *new_sources;
-	GPollFD *new_pollfds;
-	unsigned int old;
+	int i;
 
-	if (!session->sources || !session->num_sources) {
-		sr_err("session: %s: sources was NULL", __func__);
-		return SR_ERR_BUG;
+	if ((i = source_find(poll_object)) < 0) {
+		sr_err("session: %s: source not found", __func__);
+		return SR_ERR_ARG;
 	}
 
-	for (old = 0; old < session->num_sources; old++) {
-		if (session->sources[old].poll_object == poll_object)
-			break;
-	}
+	session->sources[i].timeout = timeout;
+	timer_arm(i, g_get_monotonic_time());
 
-	/* fd not found, nothing to do */
-	if (old == session->num_sources)
-		return SR_OK;
+	return SR_OK;
+}
 
-	session->num_sources -= 1;
+/**
+ * Change the timeout of the source belonging to the specified file
+ * descriptor.
+ *
+ * Unlike removing the source and adding it again, this keeps the source's
+ * registration with the event loop.
+ *
+ * @param fd The file descriptor of the source.
+ * @param timeout Max time to wait before the callback is called, ignored if 0.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG if there is no such source.
+ */
+SR_API int sr_session_source_timeout_set(int fd, int timeout)
+{
+	return _sr_session_source_timeout_set((gintptr)fd, timeout);
+}
 
-	if (old != session->num_sources) {
-		memmove(&session->pollfds[old], &session->pollfds[old+1],
-			(session->num_sources - old) * sizeof(GPollFD));
-		memmove(&session->sources[old], &session->sources[old+1],
-			(session->num_sources - old) * sizeof(struct source));
-	}
+/**
+ * Change the timeout of the source belonging to the specified poll
+ * descriptor.
+ *
+ * @param pollfd The poll descriptor of the source.
+ * @param timeout Max time to wait before the callback is called, ignored if 0.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG if there is no such source.
+ */
+SR_API int sr_session_source_timeout_set_pollfd(GPollFD *pollfd, int timeout)
+{
+	return _sr_session_source_timeout_set((gintptr)pollfd, timeout);
+}
 
-	new_pollfds = g_try_realloc(session->pollfds, sizeof(GPollFD) * session->num_sources);
-	if (!new_pollfds && session->num_sources > 0) {
-		sr_err("session: %s: new_pollfds malloc failed", __func__);
-		return SR_ERR_MALLOC;
+/**
+ * Change the timeout of the source belonging to the specified channel.
+ *
+ * @param channel The channel of the source.
+ * @param timeout Max time to wait before the callback is called, ignored if 0.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG if there is no such source.
+ */
+SR_API int sr_session_source_timeout_set_channel(GIOChannel *channel,
+		int timeout)
+{
+	return _sr_session_source_timeout_set((gintptr)channel, timeout);
+}
+
+/**
+ * Tell the session that the calling idle source has nothing to do for a
+ * while.
+ *
+ * Idle sources are those without a file descriptor nor a timeout, such
+ * as session file playback. The session calls them round-robin whenever
+ * it isn't busy with other sources, and only sleeps when every one of
+ * them waits. Rather than sleeping in its callback, which would hold up
+ * all other sources, an idle source which is e.g. ahead of its schedule
+ * should call this and return.
+ *
+ * This must be called from the source's callback.
+ *
+ * @param wait_us The time (in us) before which the source doesn't need
+ *                to be called again. It may be called later than that,
+ *                but not earlier.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG if not called from the callback
+ *         of an idle source.
+ */
+SR_API int sr_session_source_idle_wait(uint64_t wait_us)
+{
+	int i;
+
+	if (!session || (i = session->current_source) < 0 || !source_idle(i)) {
+		sr_err("session: %s: not called by an idle source", __func__);
+		return SR_ERR_ARG;
 	}
 
-	new_sources = g_try_realloc(session->sources, sizeof(struct source) * session->num_sources);
-	if (!new_sources && session->num_sources > 0) {
-		sr_err("session: %s: new_sources malloc failed", __func__);
-		return SR_ERR_MALLOC;
+	session->sources[i].idle_until = g_get_monotonic_time()
+					 + MIN(wait_us, G_MAXINT);
+
+	return SR_OK;
+}
+
+/**
+ * Remove the source belonging to the specified poll object.
+ *
+ * @param poll_object The fd, pollfd or channel of the source.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG upon internal errors.
+ */
+static int _sr_session_source_remove(gintptr poll_object)
+{
+	int i;
+
+	if (!session->sources || !session->num_sources) {
+		sr_err("session: %s: sources was NULL", __func__);
+		return SR_ERR_BUG;
 	}
 
-	session->pollfds = new_pollfds;
-	session->sources = new_sources;
+	/* fd not found, nothing to do */
+	if ((i = source_find(poll_object)) < 0)
+		return SR_OK;
+
+	source_remove(i);
 
 	return SR_OK;
 }
@@ -637,9 +4484,7 @@ static int _sr_session_source_remove(gintptr poll_object)
  *
  * @param fd The file descriptor for which the source should be removed.
  *
- * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or
- *         SR_ERR_MALLOC upon memory allocation errors, SR_ERR_BUG upon
- *         internal errors.
+ * @return SR_OK upon success, SR_ERR_BUG upon internal errors.
  */
 SR_API int sr_session_source_remove(int fd)
 {
@@ -651,9 +4496,7 @@ SR_API int sr_session_source_remove(int fd)
  *
  * @param pollfd The poll descriptor for which the source should be removed.
  *
- * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or
- *         SR_ERR_MALLOC upon memory allocation errors, SR_ERR_BUG upon
- *         internal errors.
+ * @return SR_OK upon success, SR_ERR_BUG upon internal errors.
  */
 SR_API int sr_session_source_remove_pollfd(GPollFD *pollfd)
 {
@@ -665,9 +4508,7 @@ SR_API int sr_session_source_remove_pollfd(GPollFD *pollfd)
  *
  * @param channel The channel for which the source should be removed.
  *
- * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or
- *         SR_ERR_MALLOC upon memory allocation errors, SR_ERR_BUG upon
- *         internal errors.
+ * @return SR_OK upon success, SR_ERR_BUG upon internal errors.
  */
 SR_API int sr_session_source_remove_channel(GIOChannel *channel)
 {
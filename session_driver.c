@@ -29,87 +29,631 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "virtual-session: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
-/* size of payloads sent across the session bus */
+/* default size of payloads sent across the session bus */
 /** @cond PRIVATE */
 #define CHUNKSIZE (512 * 1024)
+/* Longest wait while playback is ahead of schedule (in us). */
+#define PACING_WAIT_MAX_US 10000
+/* Triggers which can be found in a recording, see sr_trigger_new(). */
+#define TRIGGER_TYPES "01rfc"
+/* How long to back off while the frontend is behind (in us). */
+#define CONGESTION_WAIT_US 1000
+/* Number of worker threads inflating indexed chunks ahead of playback. */
+#define PREFETCH_THREADS 4
+/* Number of inflated chunks which may be waiting for the session thread. */
+#define PREFETCH_DEPTH 8
 /** @endcond */
 
+enum {
+	SLOT_EMPTY,
+	SLOT_READY,
+	SLOT_FAILED,
+};
+
+/* An inflated chunk waiting for the session thread. */
+struct prefetch_slot {
+	int state;
+	struct sr_buffer *buf;
+	uint64_t length;
+};
+
+/*
+ * Indexed chunks are read and inflated by a small pool of worker threads,
+ * each with its own archive handle (libzip handles can't be shared between
+ * threads). Chunk n goes to slot n % PREFETCH_DEPTH; the slots form a
+ * bounded queue, so the workers never get more than PREFETCH_DEPTH chunks
+ * ahead of the session thread, which takes the chunks in order.
+ */
+struct session_prefetch {
+	struct session_vdev *vdev;
+	GThread *threads[PREFETCH_THREADS];
+	unsigned int num_threads;
+	GMutex mutex;
+	GCond cond;
+	struct prefetch_slot slots[PREFETCH_DEPTH];
+	/* Next chunk to be taken by a worker. */
+	unsigned int next_fetch;
+	/* Next chunk to be taken by the session thread. */
+	unsigned int next_deliver;
+	/* Size of the largest chunk, in bytes. */
+	uint64_t buf_size;
+	gboolean abort;
+};
+
 struct session_vdev {
 	char *sessionfile;
 	char *capturefile;
 	struct zip *archive;
+	/* TRUE if 'archive' is the session's, and not ours to close. */
+	gboolean archive_shared;
 	struct zip_file *capfile;
-	int bytes_read;
+	/*
+	 * Number of the capture file chunk being read ("logic-1-N", as
+	 * written by a session writer), or 0 for a single capture file.
+	 */
+	unsigned int chunk;
+	/* The capture file's index, if it has one (version 2 files). */
+	struct sr_session_chunk *chunks;
+	unsigned int num_chunks;
+	/* Workers inflating indexed chunks, and the chunk being sent. */
+	struct session_prefetch *prefetch;
+	struct sr_buffer *cur_buf;
+	uint64_t cur_length;
+	uint64_t cur_offset;
+	uint64_t bytes_read;
 	uint64_t samplerate;
+	/* Playback speed as a multiple of samplerate, 0 for unlimited. */
+	uint64_t speed;
+	/* Size of the logic packets sent, in bytes. */
+	uint64_t chunksize;
+	/* When the acquisition started (monotonic time, in us). */
+	gint64 start_time;
+	/* Finds the probes' trigger in the recording, if they have one. */
+	struct sr_trigger *trigger;
 	int unitsize;
+	/* Bits per unit of a packed capture file, or 0. */
+	int unitbits;
 	int num_probes;
+	/* TRUE once the logic capture file (if there is one) has been sent. */
+	gboolean logic_done;
+	/* The analog capture file, and its samples once loaded. */
+	char *analogfile;
+	struct sr_analog_datastore *ads;
+	/* Next analog sample to send, and the frame it's in or before. */
+	uint64_t analog_pos;
+	uint64_t frame;
+	gboolean in_frame;
+	/* Number of samples per analog packet. */
+	uint64_t analog_chunk;
+	/* One probe's samples, before they're interleaved into a packet. */
+	float *column;
+	/* Set by hw_dev_acquisition_stop() to skip the remaining samples. */
+	gint analog_abort;
 };
 
-static GSList *dev_insts = NULL;
 static const int hwcaps[] = {
 	SR_HWCAP_CAPTUREFILE,
 	SR_HWCAP_CAPTURE_UNITSIZE,
+	SR_HWCAP_CAPTURE_UNITBITS,
+	SR_HWCAP_ANALOGFILE,
+	SR_HWCAP_PLAYBACK_SPEED,
+	SR_HWCAP_PLAYBACK_CHUNKSIZE,
 	0,
 };
 
+/* Open the next chunk of a chunked capture file, if there is one. */
+static gboolean next_chunk(struct session_vdev *vdev)
+{
+	char *name;
+
+	if (vdev->chunk == 0)
+		return FALSE;
+
+	name = g_strdup_printf("%s-%u", vdev->capturefile, vdev->chunk + 1);
+	if (!name)
+		return FALSE;
+	zip_fclose(vdev->capfile);
+	vdev->capfile = zip_fopen(vdev->archive, name, 0);
+	g_free(name);
+	if (!vdev->capfile)
+		return FALSE;
+	vdev->chunk++;
+
+	return TRUE;
+}
+
+/* Hand a chunk buffer back to the pool once its last user is done. */
+static void prefetch_buf_free(void *data, void *cb_data)
+{
+	sr_pool_free(data, GPOINTER_TO_SIZE(cb_data));
+}
+
+/*
+ * Read and inflate chunk 'n' into a new buffer. Packed chunks are unpacked
+ * to one byte per unit.
+ */
+static struct sr_buffer *prefetch_read(struct session_prefetch *pf,
+		struct zip *archive, unsigned int n, uint64_t *length)
+{
+	struct sr_session_chunk *chunk;
+	struct zip_file *zf;
+	struct sr_buffer *buf;
+	uint64_t done, size;
+	uint8_t *packed;
+	void *mem;
+	int ret;
+
+	chunk = &pf->vdev->chunks[n];
+	*length = chunk->num_units * pf->vdev->unitsize;
+	size = *length;
+	if (pf->vdev->unitbits)
+		size = (chunk->num_units * pf->vdev->unitbits + 7) / 8;
+
+	if (!(zf = zip_fopen(archive, chunk->name, 0))) {
+		sr_err("Failed to open chunk '%s' of capture file '%s'.",
+		       chunk->name, pf->vdev->capturefile);
+		return NULL;
+	}
+
+	mem = sr_pool_alloc(pf->buf_size);
+	packed = pf->vdev->unitbits ? g_try_malloc(MAX(size, 1)) : mem;
+	if (!mem || !packed) {
+		if (packed != mem)
+			g_free(packed);
+		sr_pool_free(mem, pf->buf_size);
+		zip_fclose(zf);
+		return NULL;
+	}
+
+	for (done = 0; done < size; done += ret) {
+		ret = zip_fread(zf, packed + done, size - done);
+		if (ret <= 0)
+			break;
+	}
+	zip_fclose(zf);
+	if (done != size) {
+		sr_err("Chunk '%s' of capture file '%s' is truncated.",
+		       chunk->name, pf->vdev->capturefile);
+		if (packed != mem)
+			g_free(packed);
+		sr_pool_free(mem, pf->buf_size);
+		return NULL;
+	}
+
+	if (packed != mem) {
+		sr_logic_unpack(packed, 0, chunk->num_units,
+				pf->vdev->unitbits, mem);
+		g_free(packed);
+	}
+
+	if (!(buf = sr_buffer_new_full(mem, *length, prefetch_buf_free,
+				       GSIZE_TO_POINTER(pf->buf_size))))
+		sr_pool_free(mem, pf->buf_size);
+
+	return buf;
+}
+
+static gpointer prefetch_thread(gpointer data)
+{
+	struct session_prefetch *pf;
+	struct prefetch_slot *slot;
+	struct sr_buffer *buf;
+	struct zip *archive;
+	uint64_t length;
+	unsigned int n;
+	int ret;
+
+	pf = data;
+
+	if (!(archive = zip_open(pf->vdev->sessionfile, 0, &ret)))
+		sr_err("Failed to open session file '%s': zip error %d",
+		       pf->vdev->sessionfile, ret);
+
+	g_mutex_lock(&pf->mutex);
+	while (!pf->abort && pf->next_fetch < pf->vdev->num_chunks) {
+		if (pf->next_fetch >= pf->next_deliver + PREFETCH_DEPTH) {
+			/* The queue is full. */
+			g_cond_wait(&pf->cond, &pf->mutex);
+			continue;
+		}
+		n = pf->next_fetch++;
+		g_mutex_unlock(&pf->mutex);
+
+		length = 0;
+		buf = archive ? prefetch_read(pf, archive, n, &length) : NULL;
+
+		g_mutex_lock(&pf->mutex);
+		slot = &pf->slots[n % PREFETCH_DEPTH];
+		slot->state = buf ? SLOT_READY : SLOT_FAILED;
+		slot->buf = buf;
+		slot->length = length;
+		g_cond_broadcast(&pf->cond);
+	}
+	g_mutex_unlock(&pf->mutex);
+
+	if (archive)
+		zip_close(archive);
+
+	return NULL;
+}
+
+/* Stop the prefetch workers and free everything they inflated. */
+static void prefetch_free(struct session_prefetch *pf)
+{
+	unsigned int i;
+
+	g_mutex_lock(&pf->mutex);
+	pf->abort = TRUE;
+	g_cond_broadcast(&pf->cond);
+	g_mutex_unlock(&pf->mutex);
+
+	for (i = 0; i < pf->num_threads; i++)
+		g_thread_join(pf->threads[i]);
+
+	for (i = 0; i < PREFETCH_DEPTH; i++) {
+		if (pf->slots[i].buf)
+			sr_buffer_release(pf->slots[i].buf);
+	}
+
+	g_mutex_clear(&pf->mutex);
+	g_cond_clear(&pf->cond);
+	g_free(pf);
+}
+
+/* Start inflating the chunks listed in the capture file's index. */
+static int prefetch_start(struct session_vdev *vdev)
+{
+	struct session_prefetch *pf;
+	GError *error;
+	unsigned int i;
+
+	if (!(pf = g_try_malloc0(sizeof(struct session_prefetch)))) {
+		sr_err("%s: pf malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	pf->vdev = vdev;
+	for (i = 0; i < vdev->num_chunks; i++)
+		pf->buf_size = MAX(pf->buf_size,
+				   vdev->chunks[i].num_units * vdev->unitsize);
+	/* sr_pool_alloc() doesn't do empty blocks. */
+	pf->buf_size = MAX(pf->buf_size, 1);
+	g_mutex_init(&pf->mutex);
+	g_cond_init(&pf->cond);
+	vdev->prefetch = pf;
+
+	for (i = 0; i < MIN(PREFETCH_THREADS, vdev->num_chunks); i++) {
+		error = NULL;
+		pf->threads[i] = g_thread_try_new("sr-session-prefetch",
+				prefetch_thread, pf, &error);
+		if (!pf->threads[i]) {
+			sr_err("Failed to create prefetch thread: %s",
+			       error->message);
+			g_error_free(error);
+			break;
+		}
+		pf->num_threads++;
+	}
+
+	if (vdev->num_chunks && !pf->num_threads) {
+		prefetch_free(pf);
+		vdev->prefetch = NULL;
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * Get the next slice of at most 'chunksize' bytes of the prefetched chunks,
+ * waiting for the workers if necessary. Returns the number of bytes, 0 at
+ * the end of the capture file, or -1 upon errors or if the acquisition was
+ * stopped. The slice is at
+ * 'vdev->cur_buf->data + vdev->cur_offset'.
+ */
+static int prefetch_next(struct session_vdev *vdev)
+{
+	struct session_prefetch *pf;
+	struct prefetch_slot *slot;
+	int state;
+
+	pf = vdev->prefetch;
+
+	if (vdev->cur_buf &&
+	    vdev->cur_offset + vdev->chunksize < vdev->cur_length) {
+		vdev->cur_offset += vdev->chunksize;
+		return MIN(vdev->chunksize,
+			   vdev->cur_length - vdev->cur_offset);
+	}
+
+	if (vdev->cur_buf) {
+		sr_buffer_release(vdev->cur_buf);
+		vdev->cur_buf = NULL;
+	}
+
+	if (pf->next_deliver >= vdev->num_chunks)
+		return 0;
+
+	g_mutex_lock(&pf->mutex);
+	slot = &pf->slots[pf->next_deliver % PREFETCH_DEPTH];
+	while (slot->state == SLOT_EMPTY && !pf->abort)
+		g_cond_wait(&pf->cond, &pf->mutex);
+	state = pf->abort ? SLOT_FAILED : slot->state;
+	vdev->cur_buf = slot->buf;
+	vdev->cur_length = slot->length;
+	vdev->cur_offset = 0;
+	slot->state = SLOT_EMPTY;
+	slot->buf = NULL;
+	pf->next_deliver++;
+	/* A slot is free again. */
+	g_cond_broadcast(&pf->cond);
+	g_mutex_unlock(&pf->mutex);
+
+	if (state == SLOT_FAILED)
+		return -1;
+
+	return MIN(vdev->chunksize, vdev->cur_length);
+}
+
+/* Done with a capture file, free its state. */
+static void vdev_free(struct session_vdev *vdev)
+{
+	if (vdev->prefetch)
+		prefetch_free(vdev->prefetch);
+	if (vdev->cur_buf)
+		sr_buffer_release(vdev->cur_buf);
+	if (vdev->capfile)
+		zip_fclose(vdev->capfile);
+	if (vdev->archive && !vdev->archive_shared)
+		zip_close(vdev->archive);
+	if (vdev->trigger)
+		sr_trigger_destroy(vdev->trigger);
+	if (vdev->ads)
+		sr_analog_datastore_destroy(vdev->ads);
+	g_free(vdev->capturefile);
+	g_free(vdev->analogfile);
+	g_free(vdev->chunks);
+	g_free(vdev->column);
+	g_free(vdev);
+}
+
+/*
+ * Send a logic packet, through the trigger if there is one: everything
+ * is still sent, with SR_DF_TRIGGER marking the first match.
+ */
+static int vdev_send(const struct session_vdev *vdev, void *cb_data,
+		     struct sr_datafeed_packet *packet)
+{
+	const struct sr_datafeed_logic *logic;
+
+	if (!vdev->trigger)
+		return sr_session_send(cb_data, packet);
+
+	logic = packet->payload;
+
+	return sr_trigger_send(vdev->trigger, cb_data, logic->data,
+			       logic->length, logic->unitsize);
+}
+
+/* Done with a capture file, send what the trigger holds back. */
+static void vdev_done(struct sr_dev_inst *sdi, void *cb_data)
+{
+	struct session_vdev *vdev;
+
+	vdev = sdi->priv;
+	if (vdev->trigger)
+		sr_trigger_flush(vdev->trigger, cb_data);
+	vdev_free(vdev);
+	sdi->priv = NULL;
+}
+
+/*
+ * Done with the logic capture file. Returns TRUE if the analog capture
+ * file is still to be sent.
+ */
+static gboolean logic_end(struct sr_dev_inst *sdi, void *cb_data)
+{
+	struct session_vdev *vdev;
+
+	vdev = sdi->priv;
+	if (!vdev->ads) {
+		vdev_done(sdi, cb_data);
+		return FALSE;
+	}
+
+	if (vdev->trigger) {
+		sr_trigger_flush(vdev->trigger, cb_data);
+		sr_trigger_destroy(vdev->trigger);
+		vdev->trigger = NULL;
+	}
+	vdev->logic_done = TRUE;
+
+	return TRUE;
+}
+
+/*
+ * Send the next packet of the analog capture file: the samples up to the
+ * next frame boundary (at most analog_chunk of them), or the boundary's
+ * SR_DF_FRAME_BEGIN or SR_DF_FRAME_END. Returns FALSE once everything has
+ * been sent.
+ */
+static gboolean analog_send(struct session_vdev *vdev, void *cb_data)
+{
+	struct sr_analog_datastore *ads;
+	const struct sr_analog_frame *f;
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_analog analog;
+	struct sr_buffer *buf;
+	uint64_t n, end, i;
+	float *data;
+	int p;
+
+	if (g_atomic_int_get(&vdev->analog_abort))
+		return FALSE;
+
+	ads = vdev->ads;
+	f = vdev->frame < ads->num_frames ? &ads->frames[vdev->frame] : NULL;
+	end = f ? MIN(f->first_sample + f->num_samples, ads->num_samples) : 0;
+	if (f && !vdev->in_frame && vdev->analog_pos >= f->first_sample) {
+		packet.type = SR_DF_FRAME_BEGIN;
+		packet.payload = NULL;
+		sr_session_send(cb_data, &packet);
+		vdev->in_frame = TRUE;
+		return TRUE;
+	}
+	if (f && vdev->in_frame && vdev->analog_pos >= end) {
+		packet.type = SR_DF_FRAME_END;
+		packet.payload = NULL;
+		sr_session_send(cb_data, &packet);
+		vdev->in_frame = FALSE;
+		vdev->frame++;
+		return TRUE;
+	}
+
+	if (vdev->analog_pos >= ads->num_samples)
+		return FALSE;
+
+	n = MIN(vdev->analog_chunk, ads->num_samples - vdev->analog_pos);
+	if (f && !vdev->in_frame)
+		end = f->first_sample;
+	if (f)
+		n = MIN(n, end - vdev->analog_pos);
+
+	if (!(buf = sr_buffer_new(n * ads->num_probes * sizeof(float))))
+		return FALSE;
+	data = buf->data;
+	for (p = 0; p < ads->num_probes; p++) {
+		if (sr_analog_datastore_get_range(ads, p, vdev->analog_pos, n,
+						  vdev->column) != SR_OK) {
+			sr_buffer_release(buf);
+			return FALSE;
+		}
+		for (i = 0; i < n; i++)
+			data[i * ads->num_probes + p] = vdev->column[i];
+	}
+
+	packet.type = SR_DF_ANALOG;
+	packet.payload = &analog;
+	analog.num_samples = n;
+	analog.mq = ads->mq;
+	analog.unit = ads->unit;
+	analog.mqflags = ads->mqflags;
+	analog.data = data;
+	analog.buffer = buf;
+	sr_session_send(cb_data, &packet);
+	sr_buffer_release(buf);
+	vdev->analog_pos += n;
+
+	return TRUE;
+}
+
+/*
+ * How long (in us) until the next packet of a paced playback is due, or
+ * 0 if it is due now.
+ */
+static gint64 pacing_wait(const struct session_vdev *vdev)
+{
+	uint64_t samples, rate;
+	gint64 due;
+
+	if (vdev->speed == 0 || vdev->samplerate == 0 || vdev->unitsize == 0)
+		return 0;
+
+	samples = vdev->bytes_read / vdev->unitsize;
+	rate = vdev->samplerate * vdev->speed;
+	due = vdev->start_time + (samples / rate) * G_USEC_PER_SEC
+		+ (samples % rate) * G_USEC_PER_SEC / rate;
+
+	return MAX(due - g_get_monotonic_time(), 0);
+}
+
+/*
+ * Each device plays back from a source of its own, without a descriptor.
+ * The session calls such sources round-robin, so several recordings play
+ * back side by side.
+ */
 static int receive_data(int fd, int revents, void *cb_data)
 {
 	struct sr_dev_inst *sdi;
 	struct session_vdev *vdev;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_logic logic;
-	GSList *l;
-	void *buf;
-	int ret, got_data;
+	struct sr_buffer *buf;
+	gint64 wait;
+	int ret;
 
 	(void)fd;
 	(void)revents;
 
+	sdi = cb_data;
+	if (!(vdev = sdi->priv)) {
+		/* Done with this instance. */
+		packet.type = SR_DF_END;
+		sr_session_send(cb_data, &packet);
+		return FALSE;
+	}
+
+	/*
+	 * Let the frontend catch up, rather than blocking in
+	 * sr_session_send() with a full queue.
+	 */
+	if (sr_session_congested(cb_data)) {
+		sr_session_source_idle_wait(CONGESTION_WAIT_US);
+		return TRUE;
+	}
+
 	sr_dbg("Feed chunk.");
 
-	got_data = FALSE;
-	for (l = dev_insts; l; l = l->next) {
-		sdi = l->data;
-		vdev = sdi->priv;
-		if (!vdev)
-			/* already done with this instance */
-			continue;
+	if (vdev->logic_done) {
+		/* The analog samples come last, and aren't paced. */
+		if (!analog_send(vdev, cb_data))
+			vdev_done(sdi, cb_data);
+		return TRUE;
+	}
 
-		if (!(buf = g_try_malloc(CHUNKSIZE))) {
-			sr_err("%s: buf malloc failed", __func__);
-			return FALSE;
-		}
+	if ((wait = pacing_wait(vdev)) > 0) {
+		/* Ahead of the capture's samplerate, don't spin. */
+		sr_session_source_idle_wait(MIN(wait, PACING_WAIT_MAX_US));
+		return TRUE;
+	}
 
-		ret = zip_fread(vdev->capfile, buf, CHUNKSIZE);
-		if (ret > 0) {
-			got_data = TRUE;
+	if (vdev->prefetch) {
+		/* Indexed chunks, inflated by the prefetch workers. */
+		if ((ret = prefetch_next(vdev)) > 0) {
 			packet.type = SR_DF_LOGIC;
 			packet.payload = &logic;
 			logic.length = ret;
 			logic.unitsize = vdev->unitsize;
-			logic.data = buf;
+			logic.data = (uint8_t *)vdev->cur_buf->data
+					+ vdev->cur_offset;
+			logic.buffer = vdev->cur_buf;
 			vdev->bytes_read += ret;
-			sr_session_send(cb_data, &packet);
+			vdev_send(vdev, cb_data, &packet);
 		} else {
-			/* done with this capture file */
-			zip_fclose(vdev->capfile);
-			g_free(vdev->capturefile);
-			g_free(vdev);
-			sdi->priv = NULL;
+			logic_end(sdi, cb_data);
 		}
+		return TRUE;
 	}
 
-	if (!got_data) {
-		packet.type = SR_DF_END;
-		sr_session_send(cb_data, &packet);
-		sr_session_source_remove(-1);
+	if (!(buf = sr_buffer_new(vdev->chunksize)))
+		return FALSE;
+
+	ret = zip_fread(vdev->capfile, buf->data, vdev->chunksize);
+	if (ret > 0) {
+		packet.type = SR_DF_LOGIC;
+		packet.payload = &logic;
+		logic.length = ret;
+		logic.unitsize = vdev->unitsize;
+		logic.data = buf->data;
+		logic.buffer = buf;
+		vdev->bytes_read += ret;
+		vdev_send(vdev, cb_data, &packet);
+	} else if (!next_chunk(vdev)) {
+		/* done with this capture file */
+		logic_end(sdi, cb_data);
 	}
+	sr_buffer_release(buf);
 
 	return TRUE;
 }
@@ -126,24 +670,33 @@ static int hw_init(struct sr_context *sr_ctx)
 
 static int hw_cleanup(void)
 {
-	GSList *l;
-
-	for (l = dev_insts; l; l = l->next)
-		sr_dev_inst_free(l->data);
-	g_slist_free(dev_insts);
-	dev_insts = NULL;
-
+	/* The device instances are the session's, see hw_dev_open(). */
 	return SR_OK;
 }
 
 static int hw_dev_open(struct sr_dev_inst *sdi)
 {
-	if (!(sdi->priv = g_try_malloc0(sizeof(struct session_vdev)))) {
+	struct sr_session *session;
+	struct session_vdev *vdev;
+
+	if (!(session = sr_session_current())) {
+		sr_err("%s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!(vdev = g_try_malloc0(sizeof(struct session_vdev)))) {
 		sr_err("%s: sdi->priv malloc failed", __func__);
 		return SR_ERR_MALLOC;
 	}
+	vdev->chunksize = CHUNKSIZE;
+	sdi->priv = vdev;
 
-	dev_insts = g_slist_append(dev_insts, sdi);
+	/*
+	 * Kept with the session rather than the driver, so sessions loaded
+	 * by different threads don't share the list; freed along with the
+	 * session file by sr_session_destroy().
+	 */
+	session->file_devs = g_slist_append(session->file_devs, sdi);
 
 	return SR_OK;
 }
@@ -164,6 +717,9 @@ static int hw_info_get(int info_id, const void **data,
 		} else
 			return SR_ERR;
 		break;
+	case SR_DI_TRIGGER_TYPES:
+		*data = (char *)TRIGGER_TYPES;
+		break;
 	default:
 		return SR_ERR_ARG;
 	}
@@ -197,10 +753,45 @@ static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 		tmp_u64 = value;
 		vdev->unitsize = *tmp_u64;
 		break;
+	case SR_HWCAP_ANALOGFILE:
+		vdev->analogfile = g_strdup(value);
+		sr_info("Setting analogfile to '%s'.", vdev->analogfile);
+		break;
+	case SR_HWCAP_CAPTURE_UNITBITS:
+		tmp_u64 = value;
+		if (*tmp_u64 != 0 && *tmp_u64 != 1 && *tmp_u64 != 2 &&
+		    *tmp_u64 != 4) {
+			sr_err("Invalid number of bits per unit: %" PRIu64 ".",
+			       *tmp_u64);
+			return SR_ERR_ARG;
+		}
+		vdev->unitbits = *tmp_u64;
+		break;
 	case SR_HWCAP_CAPTURE_NUM_PROBES:
 		tmp_u64 = value;
 		vdev->num_probes = *tmp_u64;
 		break;
+	case SR_HWCAP_PLAYBACK_SPEED:
+		tmp_u64 = value;
+		vdev->speed = *tmp_u64;
+		sr_info("Setting playback speed to %" PRIu64 "x.", vdev->speed);
+		break;
+	case SR_HWCAP_PLAYBACK_CHUNKSIZE:
+		tmp_u64 = value;
+		if (*tmp_u64 == 0) {
+			sr_err("Playback chunk size can't be 0.");
+			return SR_ERR_ARG;
+		}
+		/* Slices are read and passed on with int lengths. */
+		if (*tmp_u64 > G_MAXINT) {
+			sr_err("Playback chunk size can't exceed %d.",
+			       G_MAXINT);
+			return SR_ERR_ARG;
+		}
+		vdev->chunksize = *tmp_u64;
+		sr_info("Setting playback chunk size to %" PRIu64 ".",
+			vdev->chunksize);
+		break;
 	default:
 		sr_err("Unknown capability: %d.", hwcap);
 		return SR_ERR;
@@ -209,38 +800,155 @@ static int hw_dev_config_set(const struct sr_dev_inst *sdi, int hwcap,
 	return SR_OK;
 }
 
+/* Open a capture file which has no index, as a whole or chunk by chunk. */
+static int capfile_open(struct session_vdev *vdev)
+{
+	struct zip_stat zs;
+	char *name;
+
+	/* Session writers store the capture file in numbered chunks. */
+	vdev->chunk = 0;
+	name = g_strdup(vdev->capturefile);
+	if (zip_stat(vdev->archive, name, 0, &zs) == -1) {
+		g_free(name);
+		name = g_strdup_printf("%s-1", vdev->capturefile);
+		vdev->chunk = 1;
+	}
+
+	if (zip_stat(vdev->archive, name, 0, &zs) == -1) {
+		sr_err("Failed to check capture file '%s' in "
+		       "session file '%s'.", vdev->capturefile, vdev->sessionfile);
+		g_free(name);
+		return SR_ERR;
+	}
+
+	if (!(vdev->capfile = zip_fopen(vdev->archive, name, 0))) {
+		sr_err("Failed to open capture file '%s' in "
+		       "session file '%s'.", name, vdev->sessionfile);
+		g_free(name);
+		return SR_ERR;
+	}
+	g_free(name);
+
+	return SR_OK;
+}
+
+/* Open the logic capture file, through its index if it has one. */
+static int logic_open(struct session_vdev *vdev)
+{
+	int ret;
+
+	if ((ret = sr_session_file_chunks_load(vdev->archive,
+			vdev->capturefile, &vdev->chunks,
+			&vdev->num_chunks)) != SR_OK)
+		return ret;
+
+	/* Version 2 files list their chunks in an index. */
+	if (vdev->chunks)
+		return prefetch_start(vdev);
+
+	if (vdev->unitbits) {
+		sr_err("Packed capture file '%s' has no index.",
+		       vdev->capturefile);
+		return SR_ERR;
+	}
+
+	return capfile_open(vdev);
+}
+
+/* Load the analog capture file, if there is one, and rewind it. */
+static int analog_load(struct session_vdev *vdev)
+{
+	int ret;
+
+	if (!vdev->analogfile)
+		return SR_OK;
+
+	if (vdev->ads) {
+		sr_analog_datastore_destroy(vdev->ads);
+		vdev->ads = NULL;
+	}
+	if ((ret = sr_session_file_analog_load(vdev->archive,
+			vdev->analogfile, &vdev->ads)) != SR_OK)
+		return ret;
+
+	vdev->analog_pos = 0;
+	vdev->frame = 0;
+	vdev->in_frame = FALSE;
+	g_atomic_int_set(&vdev->analog_abort, 0);
+	vdev->analog_chunk = MAX(vdev->chunksize /
+			(vdev->ads->num_probes * sizeof(float)), 1);
+	g_free(vdev->column);
+	if (!(vdev->column = g_try_malloc(vdev->analog_chunk *
+					  sizeof(float)))) {
+		sr_err("%s: column malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	return SR_OK;
+}
+
 static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 		void *cb_data)
 {
-	struct zip_stat zs;
 	struct session_vdev *vdev;
 	struct sr_datafeed_header *header;
 	struct sr_datafeed_packet *packet;
 	struct sr_datafeed_meta_logic meta;
+	struct sr_datafeed_meta_analog meta_analog;
 	int ret;
 
 	vdev = sdi->priv;
 
+	if (!vdev->capturefile && !vdev->analogfile) {
+		sr_err("No capture file in session file '%s'.",
+		       vdev->sessionfile);
+		return SR_ERR;
+	}
+
 	sr_info("Opening archive %s file %s", vdev->sessionfile,
-		vdev->capturefile);
+		vdev->capturefile ? vdev->capturefile : vdev->analogfile);
 
-	if (!(vdev->archive = zip_open(vdev->sessionfile, 0, &ret))) {
+	/* The archive may still be open from sr_session_load(). */
+	if ((vdev->archive = sr_session_file_archive(vdev->sessionfile))) {
+		vdev->archive_shared = TRUE;
+	} else if (!(vdev->archive = zip_open(vdev->sessionfile, 0, &ret))) {
 		sr_err("Failed to open session file '%s': "
 		       "zip error %d\n", vdev->sessionfile, ret);
 		return SR_ERR;
 	}
 
-	if (zip_stat(vdev->archive, vdev->capturefile, 0, &zs) == -1) {
-		sr_err("Failed to check capture file '%s' in "
-		       "session file '%s'.", vdev->capturefile, vdev->sessionfile);
-		return SR_ERR;
+	if ((ret = analog_load(vdev)) != SR_OK)
+		return ret;
+
+	/* Analog-only files have no logic capture file. */
+	vdev->logic_done = !vdev->capturefile;
+	if (vdev->capturefile && (ret = logic_open(vdev)) != SR_OK)
+		return ret;
+
+	/* Whole units only. */
+	if (vdev->unitsize > 0) {
+		vdev->chunksize -= vdev->chunksize % vdev->unitsize;
+		vdev->chunksize = MAX(vdev->chunksize,
+				      (uint64_t)vdev->unitsize);
 	}
+	if (vdev->speed && !vdev->samplerate)
+		sr_warn("No samplerate, playing back at full speed.");
 
-	if (!(vdev->capfile = zip_fopen(vdev->archive, vdev->capturefile, 0))) {
-		sr_err("Failed to open capture file '%s' in "
-		       "session file '%s'.", vdev->capturefile, vdev->sessionfile);
-		return SR_ERR;
+	/* Mark where the probes' trigger first matches the recording. */
+	if (vdev->trigger) {
+		sr_trigger_destroy(vdev->trigger);
+		vdev->trigger = NULL;
 	}
+	if ((ret = sr_trigger_new(sdi, SR_TRIGGER_PRETRIGGER_ALL,
+				  &vdev->trigger)) != SR_OK)
+		return ret;
+	if (vdev->trigger->num_stages == 0) {
+		sr_trigger_destroy(vdev->trigger);
+		vdev->trigger = NULL;
+	}
+	vdev->bytes_read = 0;
+	vdev->start_time = g_get_monotonic_time();
 
 	/* freewheeling source */
 	sr_session_source_add(-1, 0, 0, receive_data, cb_data);
@@ -263,11 +971,21 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	sr_session_send(cb_data, packet);
 
 	/* Send metadata about the SR_DF_LOGIC packets to come. */
-	packet->type = SR_DF_META_LOGIC;
-	packet->payload = &meta;
-	meta.samplerate = vdev->samplerate;
-	meta.num_probes = vdev->num_probes;
-	sr_session_send(cb_data, packet);
+	if (vdev->capturefile) {
+		packet->type = SR_DF_META_LOGIC;
+		packet->payload = &meta;
+		meta.samplerate = vdev->samplerate;
+		meta.num_probes = vdev->num_probes;
+		sr_session_send(cb_data, packet);
+	}
+
+	/* And about the SR_DF_ANALOG packets after them. */
+	if (vdev->ads) {
+		packet->type = SR_DF_META_ANALOG;
+		packet->payload = &meta_analog;
+		meta_analog.num_probes = vdev->ads->num_probes;
+		sr_session_send(cb_data, packet);
+	}
 
 	g_free(header);
 	g_free(packet);
@@ -275,6 +993,29 @@ static int hw_dev_acquisition_start(const struct sr_dev_inst *sdi,
 	return SR_OK;
 }
 
+static int hw_dev_acquisition_stop(struct sr_dev_inst *sdi,
+		void *cb_data)
+{
+	struct session_vdev *vdev;
+
+	(void)cb_data;
+
+	/*
+	 * Only tell the prefetch workers (and the analog playback) to quit;
+	 * receive_data() notices and frees the capture file's state.
+	 */
+	if ((vdev = sdi->priv))
+		g_atomic_int_set(&vdev->analog_abort, 1);
+	if (vdev && vdev->prefetch) {
+		g_mutex_lock(&vdev->prefetch->mutex);
+		vdev->prefetch->abort = TRUE;
+		g_cond_broadcast(&vdev->prefetch->cond);
+		g_mutex_unlock(&vdev->prefetch->mutex);
+	}
+
+	return SR_OK;
+}
+
 /** @private */
 SR_PRIV struct sr_dev_driver session_driver = {
 	.name = "virtual-session",
@@ -287,5 +1028,5 @@ SR_PRIV struct sr_dev_driver session_driver = {
 	.info_get = hw_info_get,
 	.dev_config_set = hw_dev_config_set,
 	.dev_acquisition_start = hw_dev_acquisition_start,
-	.dev_acquisition_stop = NULL,
+	.dev_acquisition_stop = hw_dev_acquisition_stop,
 };
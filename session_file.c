@@ -17,6 +17,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -30,11 +32,6 @@
 /* Message logging helpers with driver-specific prefix string. */
 #define DRIVER_LOG_DOMAIN "session-file: "
 #define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
-#define sr_spew(s, args...) sr_spew(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_dbg(s, args...) sr_dbg(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_info(s, args...) sr_info(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_warn(s, args...) sr_warn(DRIVER_LOG_DOMAIN s, ## args)
-#define sr_err(s, args...) sr_err(DRIVER_LOG_DOMAIN s, ## args)
 
 /**
  * @file
@@ -48,12 +45,286 @@
  * @{
  */
 
-extern struct sr_session *session;
+/* Like in session.c, work on the current session. */
+#define session (sr_session_current())
 extern SR_PRIV struct sr_dev_driver session_driver;
 
+/** @cond PRIVATE */
+/* Size of the reads done while building a summary datastore, in units. */
+#define SESSION_INDEX_READSIZE (512 * 1024)
+/** @endcond */
+
+/* Compression of the capture file entries written from now on. */
+static struct {
+	int codec;
+	int level;
+} compression = {
+	.codec = SR_COMPRESSION_DEFLATE,
+	.level = 0,
+};
+
+static const struct {
+	int codec;
+	const char *name;
+} codecs[] = {
+	{SR_COMPRESSION_STORE, "store"},
+	{SR_COMPRESSION_DEFLATE, "deflate"},
+	{SR_COMPRESSION_ZSTD, "zstd"},
+};
+
+/* A device of a session file, indexed in the background. */
+struct session_index {
+	const struct sr_dev_inst *sdi;
+	char *capturefile;
+	int unitsize;
+	/* Bits per unit of a packed capture file, or 0. */
+	int unitbits;
+	/* The capture file's chunks; only used by the indexing thread. */
+	struct sr_session_chunk *chunks;
+	unsigned int num_chunks;
+	/* The fields below are protected by session->index_mutex. */
+	gboolean ranges_done;
+	uint64_t num_units;
+	struct sr_datastore *ds;
+};
+
+static int session_load(const char *filename, gboolean lazy);
+
+/* The codec named 'name', or -1 if there's no such codec. */
+static int codec_get(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(codecs); i++) {
+		if (!strcmp(codecs[i].name, name))
+			return codecs[i].codec;
+	}
+
+	return -1;
+}
+
+static const char *codec_name(int codec)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(codecs); i++) {
+		if (codecs[i].codec == codec)
+			return codecs[i].name;
+	}
+
+	return NULL;
+}
+
+/*
+ * Whether this libzip can write (if 'encode' is TRUE) or read entries
+ * compressed with 'codec'.
+ */
+static gboolean codec_supported(int codec, gboolean encode)
+{
+	switch (codec) {
+	case SR_COMPRESSION_STORE:
+	case SR_COMPRESSION_DEFLATE:
+		/* Older libzip can only write its default, deflate. */
+#ifndef HAVE_ZIP_SET_FILE_COMPRESSION
+		if (encode && codec != SR_COMPRESSION_DEFLATE)
+			return FALSE;
+#endif
+		return TRUE;
+	case SR_COMPRESSION_ZSTD:
+#ifdef ZIP_CM_ZSTD
+		return zip_compression_method_supported(ZIP_CM_ZSTD, encode);
+#else
+		return FALSE;
+#endif
+	default:
+		return FALSE;
+	}
+}
+
+/** @cond PRIVATE */
+#define XXH_PRIME64_1 UINT64_C(0x9E3779B185EBCA87)
+#define XXH_PRIME64_2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define XXH_PRIME64_3 UINT64_C(0x165667B19E3779F9)
+#define XXH_PRIME64_4 UINT64_C(0x85EBCA77C2B2AE63)
+#define XXH_PRIME64_5 UINT64_C(0x27D4EB2F165667C5)
+/** @endcond */
+
+static inline uint64_t xxh_rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, 8);
+
+	return GUINT64_FROM_LE(v);
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t lane)
+{
+	acc += lane * XXH_PRIME64_2;
+
+	return xxh_rotl(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge(uint64_t h, uint64_t v)
+{
+	h ^= xxh_round(0, v);
+
+	return h * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/*
+ * Hash of a capture file chunk, as listed in the index: XXH64 with seed 0,
+ * so the hashes can be checked with the xxHash tools.
+ */
+static uint64_t chunk_hash(const uint8_t *p, uint64_t len)
+{
+	const uint8_t *end;
+	uint32_t v32;
+	uint64_t h, v1, v2, v3, v4;
+
+	end = p + len;
+	if (len >= 32) {
+		v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+		v2 = XXH_PRIME64_2;
+		v3 = 0;
+		v4 = -XXH_PRIME64_1;
+		for (; p + 32 <= end; p += 32) {
+			v1 = xxh_round(v1, xxh_read64(p));
+			v2 = xxh_round(v2, xxh_read64(p + 8));
+			v3 = xxh_round(v3, xxh_read64(p + 16));
+			v4 = xxh_round(v4, xxh_read64(p + 24));
+		}
+		h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12)
+		    + xxh_rotl(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	} else {
+		h = XXH_PRIME64_5;
+	}
+	h += len;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= xxh_round(0, xxh_read64(p));
+		h = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		memcpy(&v32, p, 4);
+		h ^= (uint64_t)GUINT32_FROM_LE(v32) * XXH_PRIME64_1;
+		h = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH_PRIME64_5;
+		h = xxh_rotl(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+/* Set the compression of archive entry 'idx'. */
+static int entry_compression_set(struct zip *zipfile, int64_t idx,
+				 int codec, int level)
+{
+#ifdef HAVE_ZIP_SET_FILE_COMPRESSION
+	zip_int32_t method;
+
+	switch (codec) {
+	case SR_COMPRESSION_STORE:
+		method = ZIP_CM_STORE;
+		break;
+#ifdef ZIP_CM_ZSTD
+	case SR_COMPRESSION_ZSTD:
+		method = ZIP_CM_ZSTD;
+		break;
+#endif
+	default:
+		method = ZIP_CM_DEFLATE;
+		break;
+	}
+
+	if (zip_set_file_compression(zipfile, idx, method, level) == -1) {
+		sr_err("%s: failed to set compression: %s", __func__,
+		       zip_strerror(zipfile));
+		return SR_ERR;
+	}
+#else
+	(void)zipfile;
+	(void)idx;
+	(void)codec;
+	(void)level;
+#endif
+
+	return SR_OK;
+}
+
+/**
+ * Set the compression of the capture data in session files.
+ *
+ * This applies to the capture file entries of session files written by
+ * sr_session_save() and session writers created with
+ * sr_session_writer_new() from then on; the metadata and index entries
+ * are small and always deflated. The codec is recorded in the metadata,
+ * so sr_session_load() can tell whether it is able to decode the file.
+ *
+ * SR_COMPRESSION_STORE writes the data uncompressed, which is the fastest
+ * option by far. SR_COMPRESSION_DEFLATE (the default) can be decoded by
+ * every libzip. SR_COMPRESSION_ZSTD usually compresses better than
+ * deflate, several times faster, but needs a libzip built with zstd
+ * support for both writing and reading. Whatever the codec, the files
+ * are written in session file format version 2, which older libsigrok
+ * releases, only reading version 1, refuse to load.
+ *
+ * @param codec The codec, one of SR_COMPRESSION_*.
+ * @param level The compression level, from 1 (fastest) to a codec specific
+ *              maximum (9 for deflate, 19 for zstd). 0 uses the codec's
+ *              default level. Ignored for SR_COMPRESSION_STORE.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments or if this
+ *         libzip can't write the codec.
+ */
+SR_API int sr_session_compression_set(int codec, int level)
+{
+	if (!codec_name(codec)) {
+		sr_err("%s: unknown codec %d", __func__, codec);
+		return SR_ERR_ARG;
+	}
+
+	if (!codec_supported(codec, TRUE)) {
+		sr_err("%s: libzip can't write '%s' entries", __func__,
+		       codec_name(codec));
+		return SR_ERR_ARG;
+	}
+
+	if (level < 0) {
+		sr_err("%s: level was %d", __func__, level);
+		return SR_ERR_ARG;
+	}
+
+	compression.codec = codec;
+	compression.level = level;
+
+	return SR_OK;
+}
+
 /**
  * Load the session from the specified filename.
  *
+ * The session file stays open until the session is destroyed, so that
+ * the acquisition doesn't have to open it again.
+ *
  * @param filename The name of the session file to load. Must not be NULL.
  *
  * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
@@ -61,6 +332,361 @@ extern SR_PRIV struct sr_dev_driver session_driver;
  *         other errors.
  */
 SR_API int sr_session_load(const char *filename)
+{
+	return session_load(filename, FALSE);
+}
+
+/**
+ * Load the session from the specified filename, and index it in the
+ * background.
+ *
+ * This is like sr_session_load(), and returns as soon as the metadata is
+ * parsed and the session's devices exist. A background thread then works
+ * out the number of samples of each device, from the capture file's chunk
+ * index (or the archive's directory, for files without one), and reads the
+ * samples into a datastore with a summary pyramid (see
+ * sr_datastore_summary_set()). A frontend can show the metadata right
+ * away, the capture's length shortly after, and an overview from the
+ * summary once it's done, all without starting an acquisition. Use
+ * sr_session_index_get() to check on the progress.
+ *
+ * @param filename The name of the session file to load. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR upon
+ *         other errors.
+ */
+SR_API int sr_session_load_lazy(const char *filename)
+{
+	return session_load(filename, TRUE);
+}
+
+/* Add a device to be indexed in the background. */
+static struct session_index *index_add(const struct sr_dev_inst *sdi,
+				       const char *capturefile)
+{
+	struct session_index *idx;
+
+	if (!(idx = g_try_malloc0(sizeof(struct session_index)))) {
+		sr_err("%s: idx malloc failed", __func__);
+		return NULL;
+	}
+
+	idx->sdi = sdi;
+	idx->capturefile = g_strdup(capturefile);
+	session->indexes = g_slist_append(session->indexes, idx);
+
+	return idx;
+}
+
+/* Find the number of units and the chunks of each device's capture file. */
+static void index_ranges(struct zip *archive)
+{
+	struct session_index *idx;
+	GSList *l;
+	uint64_t num_units;
+	unsigned int i;
+
+	for (l = session->indexes; l; l = l->next) {
+		if (g_atomic_int_get(&session->index_abort))
+			return;
+		idx = l->data;
+		if (sr_session_file_chunks_probe(archive, idx->capturefile,
+				idx->unitsize, idx->unitbits, &idx->chunks,
+				&idx->num_chunks) != SR_OK)
+			continue;
+
+		num_units = 0;
+		for (i = 0; i < idx->num_chunks; i++)
+			num_units += idx->chunks[i].num_units;
+		sr_dbg("Capture file '%s' has %" PRIu64 " samples.",
+		       idx->capturefile, num_units);
+
+		g_mutex_lock(&session->index_mutex);
+		idx->num_units = num_units;
+		idx->ranges_done = TRUE;
+		g_mutex_unlock(&session->index_mutex);
+	}
+}
+
+/* Read a device's capture file into a new datastore with a summary. */
+static int index_summary(struct zip *archive, struct session_index *idx,
+			 struct sr_datastore **ds)
+{
+	/* sr_datastore_put() requires a probe list but doesn't use it. */
+	static const int probelist[] = { 1, 0 };
+	struct zip_file *zf;
+	uint64_t size, fill, left, units;
+	int64_t got;
+	unsigned int i;
+	uint8_t *buf, *unpacked;
+	int ret;
+
+	/* Captures may be larger than memory. */
+	if ((ret = sr_datastore_new_mapped(idx->unitsize, ds)) != SR_OK &&
+	    (ret = sr_datastore_new(idx->unitsize, ds)) != SR_OK)
+		return ret;
+	if ((ret = sr_datastore_unitbits_set(*ds, idx->unitbits)) != SR_OK ||
+	    (ret = sr_datastore_summary_set(*ds, TRUE)) != SR_OK) {
+		sr_datastore_destroy(*ds);
+		return ret;
+	}
+
+	size = (uint64_t)SESSION_INDEX_READSIZE * idx->unitsize;
+	buf = g_try_malloc(size);
+	/* Packed units go to the datastore one byte each. */
+	unpacked = idx->unitbits ? g_try_malloc(size * 8 / idx->unitbits)
+				 : NULL;
+	if (!buf || (idx->unitbits && !unpacked)) {
+		sr_err("%s: buf malloc failed", __func__);
+		g_free(buf);
+		g_free(unpacked);
+		sr_datastore_destroy(*ds);
+		return SR_ERR_MALLOC;
+	}
+
+	ret = SR_OK;
+	for (i = 0; i < idx->num_chunks && ret == SR_OK; i++) {
+		if (!(zf = zip_fopen(archive, idx->chunks[i].name, 0))) {
+			ret = SR_ERR;
+			break;
+		}
+		left = idx->chunks[i].num_units;
+		do {
+			/* Only hand whole units to the datastore. */
+			fill = 0;
+			while (fill < size && (got = zip_fread(zf, buf + fill,
+						size - fill)) > 0)
+				fill += got;
+			if (got < 0) {
+				ret = SR_ERR;
+			} else if (fill > 0 && idx->unitbits) {
+				/* The last byte may be padding. */
+				units = MIN(fill * 8 / idx->unitbits, left);
+				sr_logic_unpack(buf, 0, units, idx->unitbits,
+						unpacked);
+				left -= units;
+				ret = sr_datastore_put(*ds, unpacked, units, 1,
+						       probelist);
+			} else if (fill > 0) {
+				ret = sr_datastore_put(*ds, buf,
+						fill - fill % idx->unitsize,
+						idx->unitsize, probelist);
+			}
+			if (g_atomic_int_get(&session->index_abort))
+				ret = SR_ERR;
+		} while (fill == size && ret == SR_OK);
+		zip_fclose(zf);
+	}
+	g_free(buf);
+	g_free(unpacked);
+
+	if (ret != SR_OK) {
+		sr_datastore_destroy(*ds);
+		*ds = NULL;
+	}
+
+	return ret;
+}
+
+static gpointer index_thread(gpointer data)
+{
+	struct session_index *idx;
+	struct sr_datastore *ds;
+	struct zip *archive;
+	GSList *l;
+	int ret;
+
+	sr_session_current_set(data);
+
+	/* libzip handles can't be shared between threads, use our own. */
+	if (!(archive = zip_open(session->archive_name, 0, &ret))) {
+		sr_err("Failed to open session file '%s': zip error %d",
+		       session->archive_name, ret);
+		return NULL;
+	}
+
+	/* All the ranges first, they're cheap. */
+	index_ranges(archive);
+
+	for (l = session->indexes; l; l = l->next) {
+		idx = l->data;
+		if (g_atomic_int_get(&session->index_abort))
+			break;
+		if (!idx->chunks || index_summary(archive, idx, &ds) != SR_OK)
+			continue;
+		sr_dbg("Capture file '%s' is indexed.", idx->capturefile);
+		g_mutex_lock(&session->index_mutex);
+		idx->ds = ds;
+		g_mutex_unlock(&session->index_mutex);
+	}
+
+	zip_close(archive);
+
+	return NULL;
+}
+
+/* Start indexing the session's devices in the background. */
+static int index_start(void)
+{
+	GError *error;
+
+	error = NULL;
+	session->index_thread = g_thread_try_new("sr-session-index",
+			index_thread, session, &error);
+	if (!session->index_thread) {
+		sr_err("Failed to create index thread: %s", error->message);
+		g_error_free(error);
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Get the progress of the background indexing of a device.
+ *
+ * See sr_session_load_lazy().
+ *
+ * @param sdi The device. Must be one of the session's devices.
+ * @param num_units Will be set to the number of samples the device's
+ *                  capture file holds. Must not be NULL.
+ * @param ds Will be set to a datastore holding the capture, with a summary
+ *           pyramid, or NULL if it is still being built. The datastore is
+ *           owned by the session and must not be modified. Must not be
+ *           NULL.
+ *
+ * @return SR_OK if (at least) the number of samples is known, SR_ERR_ARG
+ *         upon invalid arguments or if the session wasn't loaded with
+ *         sr_session_load_lazy(), or SR_ERR if the number of samples
+ *         isn't known yet, or couldn't be determined.
+ */
+SR_API int sr_session_index_get(const struct sr_dev_inst *sdi,
+		uint64_t *num_units, struct sr_datastore **ds)
+{
+	struct session_index *idx;
+	GSList *l;
+	int ret;
+
+	if (!session || !sdi || !num_units || !ds) {
+		sr_err("%s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	for (l = session->indexes; l; l = l->next) {
+		idx = l->data;
+		if (idx->sdi != sdi)
+			continue;
+		g_mutex_lock(&session->index_mutex);
+		ret = idx->ranges_done ? SR_OK : SR_ERR;
+		*num_units = idx->num_units;
+		*ds = idx->ds;
+		g_mutex_unlock(&session->index_mutex);
+		return ret;
+	}
+
+	sr_err("%s: device isn't indexed", __func__);
+
+	return SR_ERR_ARG;
+}
+
+/**
+ * Wait until the background indexing of the session is done.
+ *
+ * See sr_session_load_lazy().
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_index_wait(void)
+{
+	if (!session) {
+		sr_err("%s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (session->index_thread) {
+		g_thread_join(session->index_thread);
+		session->index_thread = NULL;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Get the session's open session file, if it is 'filename'.
+ *
+ * @param filename The name of the session file.
+ *
+ * @return The archive, or NULL if the session doesn't have 'filename'
+ *         open. The archive remains owned by the session.
+ *
+ * @private
+ */
+SR_PRIV struct zip *sr_session_file_archive(const char *filename)
+{
+	if (!session || !session->archive || !filename ||
+	    strcmp(session->archive_name, filename))
+		return NULL;
+
+	return session->archive;
+}
+
+/**
+ * Close the session's session file, drop its indexes and free the
+ * session driver's device instances playing it back.
+ *
+ * This is called by sr_session_destroy().
+ *
+ * @private
+ */
+SR_PRIV void sr_session_file_close(void)
+{
+	struct session_index *idx;
+	GSList *l;
+
+	g_atomic_int_set(&session->index_abort, 1);
+	sr_session_index_wait();
+
+	for (l = session->indexes; l; l = l->next) {
+		idx = l->data;
+		if (idx->ds)
+			sr_datastore_destroy(idx->ds);
+		g_free(idx->chunks);
+		g_free(idx->capturefile);
+		g_free(idx);
+	}
+	g_slist_free(session->indexes);
+	session->indexes = NULL;
+
+	g_slist_free_full(session->file_devs,
+			  (GDestroyNotify)sr_dev_inst_free);
+	session->file_devs = NULL;
+
+	if (session->archive)
+		zip_close(session->archive);
+	session->archive = NULL;
+	g_free(session->archive_name);
+	session->archive_name = NULL;
+}
+
+/* Add a device of the session file, played back by the session driver. */
+static struct sr_dev_inst *dev_new(int devcnt, const char *filename)
+{
+	struct sr_dev_inst *sdi;
+
+	if (!(sdi = sr_dev_inst_new(devcnt, SR_ST_ACTIVE, NULL, NULL, NULL)))
+		return NULL;
+	sdi->driver = &session_driver;
+	if (devcnt == 0)
+		/* first device, init the driver */
+		sdi->driver->init(NULL);
+	sr_session_dev_add(sdi);
+	sdi->driver->dev_config_set(sdi, SR_HWCAP_SESSIONFILE, filename);
+
+	return sdi;
+}
+
+static int session_load(const char *filename, gboolean lazy)
 {
 	GKeyFile *kf;
 	GPtrArray *capturefiles;
@@ -69,6 +695,7 @@ SR_API int sr_session_load(const char *filename)
 	struct zip_stat zs;
 	struct sr_dev_inst *sdi;
 	struct sr_probe *probe;
+	struct session_index *idx;
 	int ret, probenum, devcnt, version, i, j;
 	uint64_t tmp_u64, total_probes, enabled_probes, p;
 	char **sections, **keys, *metafile, *val, s[11];
@@ -88,28 +715,34 @@ SR_API int sr_session_load(const char *filename)
 	version = 0;
 	if (!(zf = zip_fopen(archive, "version", 0))) {
 		sr_dbg("Not a sigrok session file.");
+		zip_close(archive);
 		return SR_ERR;
 	}
 	if ((ret = zip_fread(zf, s, 10)) == -1) {
 		sr_dbg("Not a valid sigrok session file.");
+		zip_fclose(zf);
+		zip_close(archive);
 		return SR_ERR;
 	}
 	zip_fclose(zf);
 	s[ret] = 0;
 	version = strtoull(s, NULL, 10);
-	if (version != 1) {
+	if (version != 1 && version != 2) {
 		sr_dbg("Not a valid sigrok session file version.");
+		zip_close(archive);
 		return SR_ERR;
 	}
 
 	/* read "metadata" */
 	if (zip_stat(archive, "metadata", 0, &zs) == -1) {
 		sr_dbg("Not a valid sigrok session file.");
+		zip_close(archive);
 		return SR_ERR;
 	}
 
 	if (!(metafile = g_try_malloc(zs.size))) {
 		sr_err("%s: metafile malloc failed", __func__);
+		zip_close(archive);
 		return SR_ERR_MALLOC;
 	}
 
@@ -118,51 +751,82 @@ SR_API int sr_session_load(const char *filename)
 	zip_fclose(zf);
 
 	kf = g_key_file_new();
-	if (!g_key_file_load_from_data(kf, metafile, zs.size, 0, NULL)) {
+	ret = g_key_file_load_from_data(kf, metafile, zs.size, 0, NULL);
+	g_free(metafile);
+	if (!ret) {
 		sr_dbg("Failed to parse metadata.");
+		g_key_file_free(kf);
+		zip_close(archive);
 		return SR_ERR;
 	}
 
+	/* Don't leave an earlier session file's archive and indexes behind. */
+	if (session && session->archive)
+		sr_session_destroy();
 	sr_session_new();
 
+	ret = SR_OK;
+
 	devcnt = 0;
 	capturefiles = g_ptr_array_new_with_free_func(g_free);
 	sections = g_key_file_get_groups(kf, NULL);
-	for (i = 0; sections[i]; i++) {
+	for (i = 0; sections[i] && ret == SR_OK; i++) {
 		if (!strcmp(sections[i], "global"))
 			/* nothing really interesting in here yet */
 			continue;
 		if (!strncmp(sections[i], "device ", 7)) {
 			/* device section */
 			sdi = NULL;
+			idx = NULL;
 			enabled_probes = 0;
+			total_probes = 0;
 			keys = g_key_file_get_keys(kf, sections[i], NULL, NULL);
-			for (j = 0; keys[j]; j++) {
+			for (j = 0; keys[j] && ret == SR_OK; j++) {
 				val = g_key_file_get_string(kf, sections[i], keys[j], NULL);
 				if (!strcmp(keys[j], "capturefile")) {
-					sdi = sr_dev_inst_new(devcnt, SR_ST_ACTIVE, NULL, NULL, NULL);
-					sdi->driver = &session_driver;
-					if (devcnt == 0)
-						/* first device, init the driver */
-						sdi->driver->init(NULL);
-					sr_session_dev_add(sdi);
-					sdi->driver->dev_config_set(sdi, SR_HWCAP_SESSIONFILE, filename);
+					if (!sdi &&
+					    !(sdi = dev_new(devcnt, filename))) {
+						g_free(val);
+						ret = SR_ERR_MALLOC;
+						break;
+					}
 					sdi->driver->dev_config_set(sdi, SR_HWCAP_CAPTUREFILE, val);
 					g_ptr_array_add(capturefiles, val);
+					if (lazy &&
+					    !(idx = index_add(sdi, val)))
+						ret = SR_ERR_MALLOC;
+				} else if (!strcmp(keys[j], "analogfile")) {
+					if (!sdi &&
+					    !(sdi = dev_new(devcnt, filename))) {
+						g_free(val);
+						ret = SR_ERR_MALLOC;
+						break;
+					}
+					sdi->driver->dev_config_set(sdi, SR_HWCAP_ANALOGFILE, val);
+					g_ptr_array_add(capturefiles, val);
 				} else if (!strcmp(keys[j], "samplerate")) {
 					sr_parse_sizestring(val, &tmp_u64);
 					sdi->driver->dev_config_set(sdi, SR_HWCAP_SAMPLERATE, &tmp_u64);
 				} else if (!strcmp(keys[j], "unitsize")) {
 					tmp_u64 = strtoull(val, NULL, 10);
 					sdi->driver->dev_config_set(sdi, SR_HWCAP_CAPTURE_UNITSIZE, &tmp_u64);
+					if (idx)
+						idx->unitsize = tmp_u64;
+				} else if (!strcmp(keys[j], "unitbits")) {
+					tmp_u64 = strtoull(val, NULL, 10);
+					sdi->driver->dev_config_set(sdi, SR_HWCAP_CAPTURE_UNITBITS, &tmp_u64);
+					if (idx)
+						idx->unitbits = tmp_u64;
 				} else if (!strcmp(keys[j], "total probes")) {
 					total_probes = strtoull(val, NULL, 10);
 					sdi->driver->dev_config_set(sdi, SR_HWCAP_CAPTURE_NUM_PROBES, &total_probes);
 					for (p = 0; p < total_probes; p++) {
 						snprintf(probename, SR_MAX_PROBENAME_LEN, "%" PRIu64, p);
 						if (!(probe = sr_probe_new(p, SR_PROBE_LOGIC, TRUE,
-								probename)))
-							return SR_ERR;
+								probename))) {
+							ret = SR_ERR;
+							break;
+						}
 						sdi->probes = g_slist_append(sdi->probes, probe);
 					}
 				} else if (!strncmp(keys[j], "probe", 5)) {
@@ -172,6 +836,14 @@ SR_API int sr_session_load(const char *filename)
 					tmp_u64 = strtoul(keys[j]+5, NULL, 10);
 					/* sr_session_save() */
 					sr_dev_probe_name_set(sdi, tmp_u64 - 1, val);
+				} else if (!strcmp(keys[j], "compression")) {
+					if (!codec_supported(codec_get(val),
+							     FALSE)) {
+						sr_err("Can't decode capture "
+						       "files compressed with "
+						       "'%s'.", val);
+						ret = SR_ERR;
+					}
 				} else if (!strncmp(keys[j], "trigger", 7)) {
 					probenum = strtoul(keys[j]+7, NULL, 10);
 					sr_dev_trigger_set(sdi, probenum, val);
@@ -186,50 +858,612 @@ SR_API int sr_session_load(const char *filename)
 	}
 	g_strfreev(sections);
 	g_key_file_free(kf);
+	g_ptr_array_free(capturefiles, TRUE);
+
+	if (ret != SR_OK) {
+		zip_close(archive);
+		return ret;
+	}
+
+	/* Keep the archive around for the acquisition. */
+	session->archive = archive;
+	session->archive_name = g_strdup(filename);
+
+	if (lazy)
+		return index_start();
 
 	return SR_OK;
 }
 
+/*
+ * Session file format
+ *
+ * A session file is a zip archive. Its "version" entry holds the format
+ * version as a decimal number, and its "metadata" entry describes the
+ * devices in key file format. Version 1 stores the samples of a device in
+ * a single entry, named by the device's "capturefile" key (e.g. "logic-1").
+ *
+ * Version 2 splits the samples into chunk entries "<capturefile>-1",
+ * "<capturefile>-2", ..., which all hold the same number of units except
+ * for the last one. The "<capturefile>-index" entry maps units to chunks:
+ * for each chunk, in order, it holds a line
+ *
+ *     <entry name> <index of first unit> <number of units> [<hash>]
+ *
+ * so a reader can find the chunk holding any unit without reading the
+ * chunks before it. The optional hash is the XXH64 (seed 0) of the
+ * entry's data, as 16 hex digits; sr_session_file_compare() only inflates
+ * chunks whose hashes differ. Logic chunks identical to an earlier one
+ * aren't stored again: their line names the earlier chunk's entry.
+ *
+ * Capture files of up to four probes may be packed: with a "unitbits"
+ * key of 1, 2 or 4 (and a "unitsize" of 1), every byte holds 8, 4 or 2
+ * units, the first one in its least significant bits (see
+ * sr_logic_pack()). Only the last byte of each chunk can be partly
+ * used. Packed capture files always have an index.
+ *
+ * Analog samples (see sr_session_save_analog()) are stored the same way,
+ * in chunk entries of the device's "analogfile" (e.g. "analog-1"), listed
+ * in "<analogfile>-index" with samples as units. A chunk holds the samples
+ * of each probe in a column of its own, the columns back to back, as
+ * little endian 32-bit floats or 16-bit signed codes. "<analogfile>-info"
+ * is a key file with the number of probes, the sample format ("float" or
+ * "int16"), the measured quantity, unit and flags, and for int16 codes
+ * each probe's "scale<n> = <scale> <offset>". "<analogfile>-frames", if
+ * present, holds a line "<first sample> <number of samples>" per frame.
+ */
+
+/* Name of the n-th (1-based) chunk entry of capture file 'capturefile'. */
+static void chunk_name(char *buf, size_t size, const char *capturefile,
+		       uint64_t n)
+{
+	snprintf(buf, size, "%s-%" PRIu64, capturefile, n);
+}
+
 /**
- * Save the current session to the specified file.
+ * Load the index of a capture file ("<capturefile>-index"), if there is one.
  *
- * @param filename The name of the file where to save the current session.
- *                 Must not be NULL.
- * @param sdi The device instance from which the data was captured.
- * @param ds The datastore where the session's captured data was stored.
+ * @param archive The session file.
+ * @param capturefile The name of the capture file.
+ * @param chunks Will be set to a newly allocated array of the chunks listed
+ *               in the index, or NULL if the capture file has no index.
+ * @param num_chunks Will be set to the number of chunks.
  *
- * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
- *         upon other errors.
+ * @return SR_OK upon success (including when there's no index),
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR if the
+ *         index is invalid.
+ *
+ * @private
  */
-SR_API int sr_session_save(const char *filename,
-		const struct sr_dev_inst *sdi, struct sr_datastore *ds)
+SR_PRIV int sr_session_file_chunks_load(struct zip *archive,
+		const char *capturefile, struct sr_session_chunk **chunks,
+		unsigned int *num_chunks)
 {
-	GSList *l, *d;
-	FILE *meta;
-	struct sr_probe *probe;
-	struct zip *zipfile;
-	struct zip_source *versrc, *metasrc, *logicsrc;
-	int bufcnt, tmpfile, ret, probecnt;
-	uint64_t *samplerate;
-	char version[1], rawname[16], metafile[32], *buf, *s;
+	struct zip_stat zs;
+	struct zip_file *zf;
+	struct sr_session_chunk *chunk;
+	char *name, *buf, **lines;
+	unsigned int i, n;
+	int ret;
 
-	if (!filename) {
-		sr_err("%s: filename was NULL", __func__);
-		return SR_ERR_ARG;
+	*chunks = NULL;
+	*num_chunks = 0;
+
+	if (!(name = g_strdup_printf("%s-index", capturefile)))
+		return SR_ERR_MALLOC;
+	ret = zip_stat(archive, name, 0, &zs);
+	if (ret == -1 || !(zf = zip_fopen(archive, name, 0))) {
+		g_free(name);
+		return SR_OK;
 	}
+	g_free(name);
 
-	/* Quietly delete it first, libzip wants replace ops otherwise. */
-	unlink(filename);
-	if (!(zipfile = zip_open(filename, ZIP_CREATE, &ret)))
+	if (!(buf = g_try_malloc(zs.size + 1))) {
+		sr_err("%s: index malloc failed", __func__);
+		zip_fclose(zf);
+		return SR_ERR_MALLOC;
+	}
+	ret = zip_fread(zf, buf, zs.size);
+	zip_fclose(zf);
+	if (ret < 0 || (uint64_t)ret != zs.size) {
+		sr_err("Failed to read the index of capture file '%s'.",
+		       capturefile);
+		g_free(buf);
+		return SR_ERR;
+	}
+	buf[zs.size] = '\0';
+
+	lines = g_strsplit(buf, "\n", 0);
+	g_free(buf);
+	n = g_strv_length(lines);
+	if (n && !(*chunks = g_try_malloc(sizeof(*chunk) * n))) {
+		sr_err("%s: chunks malloc failed", __func__);
+		g_strfreev(lines);
+		return SR_ERR_MALLOC;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!lines[i][0])
+			continue;
+		chunk = &(*chunks)[*num_chunks];
+		/* Older files have no hashes. */
+		ret = sscanf(lines[i], "%31s %" SCNu64 " %" SCNu64 " %" SCNx64,
+			     chunk->name, &chunk->first_unit,
+			     &chunk->num_units, &chunk->hash);
+		chunk->hashed = ret == 4;
+		if (ret < 3) {
+			sr_err("Invalid index line '%s' in capture file '%s'.",
+			       lines[i], capturefile);
+			g_strfreev(lines);
+			g_free(*chunks);
+			*chunks = NULL;
+			*num_chunks = 0;
+			return SR_ERR;
+		}
+		(*num_chunks)++;
+	}
+	g_strfreev(lines);
+
+	sr_dbg("Capture file '%s' has %u indexed chunks.", capturefile,
+	       *num_chunks);
+
+	return SR_OK;
+}
+
+/**
+ * Find the chunks of a capture file, with or without an index.
+ *
+ * Without an index (version 1 files and older session writer output), the
+ * chunks are found by their names, and their sizes are taken from the
+ * archive's directory. No data is read either way.
+ *
+ * @param archive The session file.
+ * @param capturefile The name of the capture file.
+ * @param unitsize The capture file's unit size.
+ * @param unitbits The number of bits per unit of a packed capture file,
+ *                 or 0.
+ * @param chunks Will be set to a newly allocated array of the chunks.
+ * @param num_chunks Will be set to the number of chunks.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR if the
+ *         capture file doesn't exist or its index is invalid.
+ *
+ * @private
+ */
+SR_PRIV int sr_session_file_chunks_probe(struct zip *archive,
+		const char *capturefile, int unitsize, int unitbits,
+		struct sr_session_chunk **chunks, unsigned int *num_chunks)
+{
+	struct zip_stat zs;
+	struct sr_session_chunk chunk, *new_chunks;
+	GArray *found;
+	uint64_t n;
+	int ret;
+
+	if (unitsize < 1) {
+		sr_err("%s: unitsize was %d", __func__, unitsize);
+		return SR_ERR_ARG;
+	}
+
+	if ((ret = sr_session_file_chunks_load(archive, capturefile, chunks,
+					       num_chunks)) != SR_OK)
+		return ret;
+	if (*chunks)
+		return SR_OK;
+
+	found = g_array_new(FALSE, FALSE, sizeof(chunk));
+	chunk.first_unit = 0;
+	chunk.hash = 0;
+	chunk.hashed = FALSE;
+	snprintf(chunk.name, sizeof(chunk.name), "%s", capturefile);
+	if (zip_stat(archive, chunk.name, 0, &zs) == 0) {
+		/* A single capture file entry. */
+		chunk.num_units = unitbits ? zs.size * 8 / unitbits
+					   : zs.size / unitsize;
+		g_array_append_val(found, chunk);
+	} else {
+		for (n = 1; ; n++) {
+			chunk_name(chunk.name, sizeof(chunk.name), capturefile,
+				   n);
+			if (zip_stat(archive, chunk.name, 0, &zs) == -1)
+				break;
+			chunk.num_units = unitbits ? zs.size * 8 / unitbits
+						   : zs.size / unitsize;
+			g_array_append_val(found, chunk);
+			chunk.first_unit += chunk.num_units;
+		}
+	}
+
+	if (found->len == 0) {
+		sr_err("Capture file '%s' not found.", capturefile);
+		g_array_free(found, TRUE);
+		return SR_ERR;
+	}
+
+	if (!(new_chunks = g_try_malloc(sizeof(chunk) * found->len))) {
+		sr_err("%s: chunks malloc failed", __func__);
+		g_array_free(found, TRUE);
+		return SR_ERR_MALLOC;
+	}
+	memcpy(new_chunks, found->data, sizeof(chunk) * found->len);
+	*chunks = new_chunks;
+	*num_chunks = found->len;
+	g_array_free(found, TRUE);
+
+	return SR_OK;
+}
+
+/*
+ * Read entry 'name' of the archive into a newly allocated, NUL-terminated
+ * buffer. Returns SR_ERR_ARG if there is no such entry.
+ */
+static int entry_read(struct zip *archive, const char *name, char **buf,
+		      uint64_t *size)
+{
+	struct zip_stat zs;
+	struct zip_file *zf;
+	int64_t ret;
+
+	if (zip_stat(archive, name, 0, &zs) == -1 ||
+	    !(zf = zip_fopen(archive, name, 0)))
+		return SR_ERR_ARG;
+
+	if (!(*buf = g_try_malloc(zs.size + 1))) {
+		sr_err("%s: buf malloc failed", __func__);
+		zip_fclose(zf);
+		return SR_ERR_MALLOC;
+	}
+	ret = zip_fread(zf, *buf, zs.size);
+	zip_fclose(zf);
+	if (ret < 0 || (uint64_t)ret != zs.size) {
+		sr_err("Failed to read '%s'.", name);
+		g_free(*buf);
+		return SR_ERR;
+	}
+	(*buf)[zs.size] = '\0';
+	*size = zs.size;
+
+	return SR_OK;
+}
+
+/* Create the datastore described by the "-info" entry of 'analogfile'. */
+static int analog_info_load(struct zip *archive, const char *analogfile,
+			    struct sr_analog_datastore **ads)
+{
+	GKeyFile *kf;
+	struct sr_analog_scale *scales;
+	uint64_t size;
+	int num_probes, format, p, ret;
+	char *name, *buf, *val, *end, key[16];
+
+	if (!(name = g_strdup_printf("%s-info", analogfile)))
+		return SR_ERR_MALLOC;
+	ret = entry_read(archive, name, &buf, &size);
+	g_free(name);
+	if (ret == SR_ERR_ARG)
+		sr_err("Analog capture file '%s' has no info.", analogfile);
+	if (ret != SR_OK)
+		return ret == SR_ERR_ARG ? SR_ERR : ret;
+
+	kf = g_key_file_new();
+	if (!g_key_file_load_from_data(kf, buf, size, 0, NULL)) {
+		sr_err("Invalid info in analog capture file '%s'.",
+		       analogfile);
+		g_key_file_free(kf);
+		g_free(buf);
+		return SR_ERR;
+	}
+	g_free(buf);
+
+	num_probes = g_key_file_get_integer(kf, "analog", "probes", NULL);
+	val = g_key_file_get_string(kf, "analog", "format", NULL);
+	format = val && !strcmp(val, "int16") ? SR_ANALOG_INT16
+					      : SR_ANALOG_FLOAT;
+	g_free(val);
+	if ((ret = sr_analog_datastore_new(num_probes, format, ads)) != SR_OK) {
+		g_key_file_free(kf);
+		return ret;
+	}
+	(*ads)->mq = g_key_file_get_integer(kf, "analog", "mq", NULL);
+	(*ads)->unit = g_key_file_get_integer(kf, "analog", "unit", NULL);
+	(*ads)->mqflags = g_key_file_get_uint64(kf, "analog", "mqflags", NULL);
+	(*ads)->have_mq = TRUE;
+
+	if (format != SR_ANALOG_INT16) {
+		g_key_file_free(kf);
+		return SR_OK;
+	}
+
+	if (!(scales = g_try_malloc(sizeof(*scales) * num_probes))) {
+		sr_err("%s: scales malloc failed", __func__);
+		g_key_file_free(kf);
+		return SR_ERR_MALLOC;
+	}
+	for (p = 0; p < num_probes; p++) {
+		snprintf(key, sizeof(key), "scale%d", p + 1);
+		if (!(val = g_key_file_get_string(kf, "analog", key, NULL)))
+			break;
+		scales[p].scale = g_ascii_strtod(val, &end);
+		scales[p].offset = g_ascii_strtod(end, NULL);
+		g_free(val);
+	}
+	g_key_file_free(kf);
+	if (p < num_probes) {
+		sr_err("Analog capture file '%s' has no scale for probe %d.",
+		       analogfile, p + 1);
+		g_free(scales);
+		return SR_ERR;
+	}
+	ret = sr_analog_datastore_scales_set(*ads, scales);
+	g_free(scales);
+
+	return ret;
+}
+
+/* Add the frames listed in the "-frames" entry of 'analogfile', if any. */
+static int analog_frames_load(struct zip *archive, const char *analogfile,
+			      struct sr_analog_datastore *ads)
+{
+	uint64_t size, first, num;
+	char *name, *buf, **lines;
+	unsigned int i;
+	int ret;
+
+	if (!(name = g_strdup_printf("%s-frames", analogfile)))
+		return SR_ERR_MALLOC;
+	ret = entry_read(archive, name, &buf, &size);
+	g_free(name);
+	if (ret == SR_ERR_ARG)
+		return SR_OK;
+	if (ret != SR_OK)
+		return ret;
+
+	lines = g_strsplit(buf, "\n", 0);
+	g_free(buf);
+	for (i = 0; lines[i] && ret == SR_OK; i++) {
+		if (!lines[i][0])
+			continue;
+		if (sscanf(lines[i], "%" SCNu64 " %" SCNu64, &first,
+			   &num) != 2) {
+			sr_err("Invalid frame '%s' in analog capture file "
+			       "'%s'.", lines[i], analogfile);
+			ret = SR_ERR;
+			break;
+		}
+		ret = sr_analog_datastore_frame_add(ads, first, num);
+	}
+	g_strfreev(lines);
+
+	return ret;
+}
+
+/**
+ * Load an analog capture file, as written by sr_session_save_analog().
+ *
+ * @param archive The session file.
+ * @param analogfile The name of the analog capture file.
+ * @param ads Will be set to a newly created analog datastore holding the
+ *            capture file's samples and frames.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR if the capture file is missing or invalid.
+ *
+ * @private
+ */
+SR_PRIV int sr_session_file_analog_load(struct zip *archive,
+		const char *analogfile, struct sr_analog_datastore **ads)
+{
+	struct sr_session_chunk *chunks;
+	unsigned int num_chunks, n;
+	uint64_t size;
+	char *buf;
+	int ret;
+
+	if ((ret = analog_info_load(archive, analogfile, ads)) != SR_OK)
+		return ret;
+
+	if ((ret = sr_session_file_chunks_load(archive, analogfile, &chunks,
+					       &num_chunks)) != SR_OK)
+		goto err;
+	if (!chunks) {
+		sr_err("Analog capture file '%s' has no index.", analogfile);
+		ret = SR_ERR;
+		goto err;
+	}
+
+	for (n = 0; n < num_chunks; n++) {
+		if ((ret = entry_read(archive, chunks[n].name, &buf,
+				      &size)) != SR_OK)
+			break;
+		if (size != chunks[n].num_units * (*ads)->num_probes *
+			    (*ads)->sample_size) {
+			sr_err("Chunk '%s' doesn't hold %" PRIu64 " samples.",
+			       chunks[n].name, chunks[n].num_units);
+			ret = SR_ERR;
+		} else {
+			ret = sr_analog_datastore_chunk_read(*ads,
+					(uint8_t *)buf, chunks[n].num_units);
+		}
+		g_free(buf);
+		if (ret != SR_OK)
+			break;
+	}
+	g_free(chunks);
+	if (ret == SR_ERR_ARG) {
+		sr_err("Analog capture file '%s' is incomplete.", analogfile);
+		ret = SR_ERR;
+	}
+	if (ret == SR_OK)
+		ret = analog_frames_load(archive, analogfile, *ads);
+	if (ret == SR_OK) {
+		sr_dbg("Loaded %" PRIu64 " samples of %d analog probes, in "
+		       "%" PRIu64 " frames.", (*ads)->num_samples,
+		       (*ads)->num_probes, (*ads)->num_frames);
+		return SR_OK;
+	}
+
+err:
+	sr_analog_datastore_destroy(*ads);
+	*ads = NULL;
+
+	return ret;
+}
+
+/*
+ * Add (or replace) entry 'name', taking over 'buf' (of 'size' bytes); libzip
+ * frees it once the archive is closed.
+ */
+static int buffer_add(struct zip *zipfile, const char *name, char *buf,
+		      size_t size, gboolean compress)
+{
+	struct zip_source *src;
+	int64_t idx;
+
+	if (!(src = zip_source_buffer(zipfile, buf, size, 1))) {
+		g_free(buf);
+		return SR_ERR;
+	}
+
+	if ((idx = zip_name_locate(zipfile, name, 0)) >= 0)
+		idx = zip_replace(zipfile, idx, src);
+	else
+		idx = zip_add(zipfile, name, src);
+	if (idx == -1) {
+		sr_err("%s: failed to write '%s': %s", __func__, name,
+		       zip_strerror(zipfile));
+		zip_source_free(src);
+		return SR_ERR;
+	}
+
+	if (!compress)
+		return SR_OK;
+
+	return entry_compression_set(zipfile, idx, compression.codec,
+				     compression.level);
+}
+
+/* Add (or replace) the index entry of 'capturefile', listing 'chunks'. */
+static int index_write_chunks(struct zip *zipfile, const char *capturefile,
+			      const struct sr_session_chunk *chunks,
+			      uint64_t num_chunks)
+{
+	uint64_t n;
+	char name[32], *buf;
+	size_t size, len;
+
+	size = num_chunks * 96 + 1;
+	if (!(buf = g_try_malloc(size))) {
+		sr_err("%s: index malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	len = 0;
+	buf[0] = '\0';
+	for (n = 0; n < num_chunks; n++) {
+		len += snprintf(buf + len, size - len,
+				"%s %" PRIu64 " %" PRIu64, chunks[n].name,
+				chunks[n].first_unit, chunks[n].num_units);
+		if (chunks[n].hashed)
+			len += snprintf(buf + len, size - len, " %016" PRIx64,
+					chunks[n].hash);
+		len += snprintf(buf + len, size - len, "\n");
+	}
+
+	snprintf(name, sizeof(name), "%s-index", capturefile);
+
+	return buffer_add(zipfile, name, buf, len, FALSE);
+}
+
+/*
+ * Add (or replace) the index entry of 'capturefile', for 'num_units' units
+ * stored in chunks of 'chunk_units' units each, without hashes.
+ */
+static int index_write(struct zip *zipfile, const char *capturefile,
+		       uint64_t num_units, uint64_t chunk_units)
+{
+	struct sr_session_chunk *chunks;
+	uint64_t n, num_chunks;
+	int ret;
+
+	num_chunks = (num_units + chunk_units - 1) / chunk_units;
+	if (!(chunks = g_try_malloc0(sizeof(*chunks) * MAX(num_chunks, 1)))) {
+		sr_err("%s: chunks malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	for (n = 0; n < num_chunks; n++) {
+		chunk_name(chunks[n].name, sizeof(chunks[n].name),
+			   capturefile, n + 1);
+		chunks[n].first_unit = n * chunk_units;
+		chunks[n].num_units = MIN(chunk_units,
+					  num_units - n * chunk_units);
+	}
+
+	ret = index_write_chunks(zipfile, capturefile, chunks, num_chunks);
+	g_free(chunks);
+
+	return ret;
+}
+
+/*
+ * Look up an earlier chunk with the same hash and size as chunk 'n' in
+ * 'hashes' (which maps hashes to chunk indices + 1), and add chunk 'n' if
+ * there is none. Returns the index of the earlier chunk, or -1.
+ */
+static int64_t chunk_twin(GHashTable *hashes,
+			  const struct sr_session_chunk *chunks, uint64_t n)
+{
+	gpointer key;
+	uint64_t twin;
+
+	key = GSIZE_TO_POINTER((gsize)chunks[n].hash);
+	twin = GPOINTER_TO_SIZE(g_hash_table_lookup(hashes, key));
+	if (!twin) {
+		g_hash_table_insert(hashes, key, GSIZE_TO_POINTER(n + 1));
+		return -1;
+	}
+
+	if (chunks[twin - 1].hash != chunks[n].hash ||
+	    chunks[twin - 1].num_units != chunks[n].num_units)
+		return -1;
+
+	return twin - 1;
+}
+
+/*
+ * Create a new session file containing the "version" and "metadata" entries
+ * for data of the given device and unit size ('unitbits' is the number of
+ * bits per unit of packed data, or 0). A unit size of 0 leaves out the
+ * logic capture file, and 'analogfile' names the analog capture file, if
+ * there is one. The metadata is written to the temporary file 'metafile'
+ * (at least 32 bytes), which the caller must unlink once the archive is
+ * closed.
+ */
+static int archive_new(const char *filename, const struct sr_dev_inst *sdi,
+		       int unitsize, int unitbits, const char *analogfile,
+		       int codec, struct zip **zipfile, char *metafile)
+{
+	static const char version[] = "2";
+	GSList *l;
+	FILE *meta;
+	struct sr_probe *probe;
+	struct zip_source *versrc, *metasrc;
+	int tmpfile, ret, probecnt;
+	uint64_t *samplerate;
+	char *s;
+
+	/* Quietly delete it first, libzip wants replace ops otherwise. */
+	unlink(filename);
+	if (!(*zipfile = zip_open(filename, ZIP_CREATE, &ret)))
 		return SR_ERR;
 
 	/* "version" */
-	version[0] = '1';
-	if (!(versrc = zip_source_buffer(zipfile, version, 1, 0)))
+	if (!(versrc = zip_source_buffer(*zipfile, version, 1, 0)))
 		return SR_ERR;
-	if (zip_add(zipfile, "version", versrc) == -1) {
+	if (zip_add(*zipfile, "version", versrc) == -1) {
 		sr_info("error saving version into zipfile: %s",
-			zip_strerror(zipfile));
+			zip_strerror(*zipfile));
 		return SR_ERR;
 	}
 
@@ -248,9 +1482,18 @@ SR_API int sr_session_save(const char *filename,
 		fprintf(meta, "driver = %s\n", sdi->driver->name);
 
 	/* metadata */
-	fprintf(meta, "capturefile = logic-1\n");
-	fprintf(meta, "unitsize = %d\n", ds->ds_unitsize);
-	fprintf(meta, "total probes = %d\n", g_slist_length(sdi->probes));
+	if (analogfile)
+		fprintf(meta, "analogfile = %s\n", analogfile);
+	if (unitsize) {
+		fprintf(meta, "capturefile = logic-1\n");
+		fprintf(meta, "unitsize = %d\n", unitsize);
+	}
+	if (unitbits)
+		fprintf(meta, "unitbits = %d\n", unitbits);
+	fprintf(meta, "compression = %s\n", codec_name(codec));
+	if (unitsize)
+		fprintf(meta, "total probes = %d\n",
+			g_slist_length(sdi->probes));
 	if (sr_dev_has_hwcap(sdi, SR_HWCAP_SAMPLERATE)) {
 		if (sr_info_get(sdi->driver, SR_DI_CUR_SAMPLERATE,
 				(const void **)&samplerate, sdi) == SR_OK) {
@@ -260,7 +1503,7 @@ SR_API int sr_session_save(const char *filename,
 		}
 	}
 	probecnt = 1;
-	for (l = sdi->probes; l; l = l->next) {
+	for (l = unitsize ? sdi->probes : NULL; l; l = l->next) {
 		probe = l->data;
 		if (probe->enabled) {
 			if (probe->name)
@@ -270,34 +1513,193 @@ SR_API int sr_session_save(const char *filename,
 			probecnt++;
 		}
 	}
+	fclose(meta);
 
-	/* dump datastore into logic-n */
-	buf = g_try_malloc(ds->num_units * ds->ds_unitsize +
-		   DATASTORE_CHUNKSIZE);
-	if (!buf) {
-		sr_err("%s: buf malloc failed", __func__);
+	if (!(metasrc = zip_source_file(*zipfile, metafile, 0, -1)))
+		return SR_ERR;
+	if (zip_add(*zipfile, "metadata", metasrc) == -1)
+		return SR_ERR;
+
+	return SR_OK;
+}
+
+/* Close an archive without writing any changes. */
+static void archive_discard(struct zip *zipfile)
+{
+	zip_unchange_all(zipfile);
+	zip_close(zipfile);
+}
+
+/*
+ * Compare chunk 'n' of a datastore against chunk 'twin'. Only one chunk's
+ * data is valid at a time (see sr_datastore_chunk_data()), so the twin
+ * is copied first.
+ */
+static int chunk_same(struct sr_datastore *ds, uint64_t twin, uint64_t n,
+		      uint64_t size)
+{
+	const uint8_t *data;
+	uint8_t *copy;
+	int ret;
+
+	if (!(data = sr_datastore_chunk_data(ds, twin)))
+		return SR_ERR;
+	if (!(copy = g_try_malloc(MAX(size, 1)))) {
+		sr_err("%s: copy malloc failed", __func__);
 		return SR_ERR_MALLOC;
 	}
+	memcpy(copy, data, size);
 
-	bufcnt = 0;
-	for (d = ds->chunklist; d; d = d->next) {
-		memcpy(buf + bufcnt, d->data,
-			   DATASTORE_CHUNKSIZE);
-		bufcnt += DATASTORE_CHUNKSIZE;
-	}
-	if (!(logicsrc = zip_source_buffer(zipfile, buf,
-			   ds->num_units * ds->ds_unitsize, TRUE)))
+	if (!(data = sr_datastore_chunk_data(ds, n))) {
+		g_free(copy);
 		return SR_ERR;
-	snprintf(rawname, 15, "logic-1");
-	if (zip_add(zipfile, rawname, logicsrc) == -1)
-		return SR_ERR;
-	fclose(meta);
+	}
+	ret = memcmp(copy, data, size) ? FALSE : TRUE;
+	g_free(copy);
+
+	return ret;
+}
+
+/* Add one chunk of a datastore as entry 'name'. */
+static int logic_chunk_add(struct zip *zipfile, struct sr_datastore *ds,
+			   uint64_t n, uint64_t size, const char *name)
+{
+	struct zip_source *logicsrc;
+	uint64_t chunk_bytes;
+	const uint8_t *data;
+	int64_t idx;
+	char *buf;
 
-	if (!(metasrc = zip_source_file(zipfile, metafile, 0, -1)))
+	chunk_bytes = ds->ds_unitbits ?
+		(uint64_t)DATASTORE_CHUNKSIZE * ds->ds_unitbits / 8 :
+		(uint64_t)DATASTORE_CHUNKSIZE * ds->ds_unitsize;
+	if (ds->filename) {
+		/* The chunks are stored back-to-back in the file. */
+		logicsrc = zip_source_file(zipfile, ds->filename,
+				n * chunk_bytes, size);
+	} else if (!ds->packed_sizes || !ds->packed_sizes[n]) {
+		logicsrc = zip_source_buffer(zipfile, ds->chunks[n], size, 0);
+	} else {
+		/* Compressed chunks need to be decompressed first. */
+		if (!(data = sr_datastore_chunk_data(ds, n)))
+			return SR_ERR;
+		if (!(buf = g_try_malloc(size))) {
+			sr_err("%s: buf malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		memcpy(buf, data, size);
+		if (!(logicsrc = zip_source_buffer(zipfile, buf, size, 1)))
+			g_free(buf);
+	}
+	if (!logicsrc)
 		return SR_ERR;
-	if (zip_add(zipfile, "metadata", metasrc) == -1)
+	if ((idx = zip_add(zipfile, name, logicsrc)) == -1)
 		return SR_ERR;
 
+	return entry_compression_set(zipfile, idx, compression.codec,
+				     compression.level);
+}
+
+/*
+ * Add the chunks and the index of a datastore as capture file "logic-1".
+ * Each chunk's hash goes into the index, and chunks identical to an
+ * earlier one are only listed there.
+ */
+static int logic_write(struct zip *zipfile, struct sr_datastore *ds)
+{
+	struct sr_session_chunk *chunks;
+	GHashTable *hashes;
+	uint64_t n, num_chunks, size;
+	const uint8_t *data;
+	int64_t twin;
+	int ret;
+
+	num_chunks = (ds->num_units + DATASTORE_CHUNKSIZE - 1)
+		     / DATASTORE_CHUNKSIZE;
+	if (!(chunks = g_try_malloc0(sizeof(*chunks) * MAX(num_chunks, 1)))) {
+		sr_err("%s: chunks malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	hashes = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	/* dump datastore into logic-1-n */
+	ret = SR_OK;
+	for (n = 0; n < num_chunks && ret == SR_OK; n++) {
+		chunks[n].first_unit = n * DATASTORE_CHUNKSIZE;
+		chunks[n].num_units = MIN((uint64_t)DATASTORE_CHUNKSIZE,
+					  ds->num_units - chunks[n].first_unit);
+		size = ds->ds_unitbits ?
+		       (chunks[n].num_units * ds->ds_unitbits + 7) / 8 :
+		       chunks[n].num_units * ds->ds_unitsize;
+		if (!(data = sr_datastore_chunk_data(ds, n))) {
+			ret = SR_ERR;
+			break;
+		}
+		chunks[n].hash = chunk_hash(data, size);
+		chunks[n].hashed = TRUE;
+
+		twin = chunk_twin(hashes, chunks, n);
+		if (twin >= 0 && (ret = chunk_same(ds, twin, n, size)) > 0) {
+			/* Stored once already. */
+			strcpy(chunks[n].name, chunks[twin].name);
+			ret = SR_OK;
+			continue;
+		}
+		if (ret < 0)
+			break;
+
+		chunk_name(chunks[n].name, sizeof(chunks[n].name), "logic-1",
+			   n + 1);
+		ret = logic_chunk_add(zipfile, ds, n, size, chunks[n].name);
+	}
+
+	if (ret == SR_OK)
+		ret = index_write_chunks(zipfile, "logic-1", chunks,
+					 num_chunks);
+	g_hash_table_destroy(hashes);
+	g_free(chunks);
+
+	return ret;
+}
+
+/**
+ * Save the current session to the specified file.
+ *
+ * The datastore's chunks are written as the session file's capture file
+ * chunks, one entry each. Chunks which are stored uncompressed (in memory
+ * or in a memory-mapped datastore's file) are handed to libzip as they are,
+ * so no copy of the whole capture is made. The chunks of packed datastores
+ * (see sr_datastore_unitbits_set()) are written packed.
+ *
+ * @param filename The name of the file where to save the current session.
+ *                 Must not be NULL.
+ * @param sdi The device instance from which the data was captured.
+ * @param ds The datastore where the session's captured data was stored.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR upon
+ *         other errors.
+ */
+SR_API int sr_session_save(const char *filename,
+		const struct sr_dev_inst *sdi, struct sr_datastore *ds)
+{
+	struct zip *zipfile;
+	int ret;
+	char metafile[32];
+
+	if (!filename) {
+		sr_err("%s: filename was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if ((ret = archive_new(filename, sdi, ds->ds_unitsize, ds->ds_unitbits,
+			       NULL, compression.codec, &zipfile,
+			       metafile)) != SR_OK)
+		return ret;
+
+	if ((ret = logic_write(zipfile, ds)) != SR_OK)
+		return ret;
+
 	if ((ret = zip_close(zipfile)) == -1) {
 		sr_info("error saving zipfile: %s", zip_strerror(zipfile));
 		return SR_ERR;
@@ -308,4 +1710,907 @@ SR_API int sr_session_save(const char *filename,
 	return SR_OK;
 }
 
+/* Add the "-info" entry of analog capture file 'analogfile'. */
+static int analog_info_write(struct zip *zipfile, const char *analogfile,
+			     const struct sr_analog_datastore *ads)
+{
+	GKeyFile *kf;
+	char name[32], key[16], scale[G_ASCII_DTOSTR_BUF_SIZE];
+	char offset[G_ASCII_DTOSTR_BUF_SIZE], *val, *buf;
+	gsize size;
+	int p;
+
+	kf = g_key_file_new();
+	g_key_file_set_integer(kf, "analog", "probes", ads->num_probes);
+	g_key_file_set_string(kf, "analog", "format",
+			ads->format == SR_ANALOG_INT16 ? "int16" : "float");
+	g_key_file_set_integer(kf, "analog", "mq", ads->mq);
+	g_key_file_set_integer(kf, "analog", "unit", ads->unit);
+	g_key_file_set_uint64(kf, "analog", "mqflags", ads->mqflags);
+	for (p = 0; ads->scales && p < ads->num_probes; p++) {
+		g_ascii_formatd(scale, sizeof(scale), "%.9g",
+				ads->scales[p].scale);
+		g_ascii_formatd(offset, sizeof(offset), "%.9g",
+				ads->scales[p].offset);
+		val = g_strdup_printf("%s %s", scale, offset);
+		snprintf(key, sizeof(key), "scale%d", p + 1);
+		g_key_file_set_string(kf, "analog", key, val);
+		g_free(val);
+	}
+	buf = g_key_file_to_data(kf, &size, NULL);
+	g_key_file_free(kf);
+	if (!buf)
+		return SR_ERR_MALLOC;
+
+	snprintf(name, sizeof(name), "%s-info", analogfile);
+
+	return buffer_add(zipfile, name, buf, size, FALSE);
+}
+
+/* Add the "-frames" entry of analog capture file 'analogfile'. */
+static int analog_frames_write(struct zip *zipfile, const char *analogfile,
+			       const struct sr_analog_datastore *ads)
+{
+	char name[32], *buf;
+	size_t size, len;
+	uint64_t n;
+
+	size = ads->num_frames * 48 + 1;
+	if (!(buf = g_try_malloc(size))) {
+		sr_err("%s: frames malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	len = 0;
+	buf[0] = '\0';
+	for (n = 0; n < ads->num_frames; n++)
+		len += snprintf(buf + len, size - len,
+				"%" PRIu64 " %" PRIu64 "\n",
+				ads->frames[n].first_sample,
+				ads->frames[n].num_samples);
+
+	snprintf(name, sizeof(name), "%s-frames", analogfile);
+
+	return buffer_add(zipfile, name, buf, len, FALSE);
+}
+
+/* Add the chunks, index, info and frames of analog capture file "analog-1". */
+static int analog_write(struct zip *zipfile,
+			const struct sr_analog_datastore *ads)
+{
+	uint64_t n, size;
+	char name[32], *buf;
+	int ret;
+
+	for (n = 0; n < ads->num_chunks; n++) {
+		size = sr_analog_datastore_chunk_samples(ads, n) *
+		       ads->num_probes * ads->sample_size;
+		if (!(buf = g_try_malloc(MAX(size, 1)))) {
+			sr_err("%s: chunk malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		sr_analog_datastore_chunk_write(ads, n, (uint8_t *)buf);
+		chunk_name(name, sizeof(name), "analog-1", n + 1);
+		if ((ret = buffer_add(zipfile, name, buf, size,
+				      TRUE)) != SR_OK)
+			return ret;
+	}
+
+	if ((ret = index_write(zipfile, "analog-1", ads->num_samples,
+			       DATASTORE_CHUNKSIZE)) != SR_OK)
+		return ret;
+
+	if ((ret = analog_info_write(zipfile, "analog-1", ads)) != SR_OK)
+		return ret;
+
+	return analog_frames_write(zipfile, "analog-1", ads);
+}
+
+/**
+ * Save an analog capture, and optionally the logic capture taken along
+ * with it, to the specified file.
+ *
+ * The analog samples are written in chunks of DATASTORE_CHUNKSIZE samples,
+ * in the datastore's format, along with the datastore's frames. Loading
+ * the file with sr_session_load() plays both captures back.
+ *
+ * @param filename The name of the file where to save the session.
+ *                 Must not be NULL.
+ * @param sdi The device instance from which the data was captured.
+ * @param ds The datastore with the logic samples, or NULL.
+ * @param ads The datastore with the analog samples. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR upon
+ *         other errors.
+ */
+SR_API int sr_session_save_analog(const char *filename,
+		const struct sr_dev_inst *sdi, struct sr_datastore *ds,
+		const struct sr_analog_datastore *ads)
+{
+	struct zip *zipfile;
+	int ret;
+	char metafile[32];
+
+	if (!filename || !sdi || !ads) {
+		sr_err("%s: filename, sdi and ads may not be NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if ((ret = archive_new(filename, sdi, ds ? ds->ds_unitsize : 0,
+			       ds ? ds->ds_unitbits : 0, "analog-1",
+			       compression.codec, &zipfile,
+			       metafile)) != SR_OK)
+		return ret;
+
+	if (ds && (ret = logic_write(zipfile, ds)) != SR_OK)
+		goto err;
+
+	if ((ret = analog_write(zipfile, ads)) != SR_OK)
+		goto err;
+
+	if (zip_close(zipfile) == -1) {
+		sr_err("%s: failed to write '%s': %s", __func__, filename,
+		       zip_strerror(zipfile));
+		ret = SR_ERR;
+		goto err;
+	}
+	unlink(metafile);
+
+	return SR_OK;
+
+err:
+	archive_discard(zipfile);
+	unlink(metafile);
+
+	return ret;
+}
+
+/**
+ * Save raw logic data from files as a session file.
+ *
+ * Each of the files becomes one capture file chunk. All but the last one
+ * must hold 'part_units' units; the data is read (and compressed) only
+ * when the session file is written out.
+ *
+ * @param filename The name of the file to write. Must not be NULL.
+ * @param sdi The device instance from which the data was captured.
+ * @param unitsize The unit size of the data.
+ * @param parts The names of the files holding the data, in order.
+ * @param num_parts The number of files.
+ * @param part_units The number of units in each file but the last.
+ * @param num_units The number of units in all files.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation
+ *         errors, or SR_ERR upon other errors.
+ *
+ * @private
+ */
+SR_PRIV int sr_session_file_save_parts(const char *filename,
+		const struct sr_dev_inst *sdi, int unitsize, char **parts,
+		unsigned int num_parts, uint64_t part_units, uint64_t num_units)
+{
+	struct zip *zipfile;
+	struct zip_source *logicsrc;
+	uint64_t units;
+	unsigned int n;
+	int64_t idx;
+	int ret;
+	char rawname[32], metafile[32];
+
+	if ((ret = archive_new(filename, sdi, unitsize, 0, NULL,
+			       compression.codec, &zipfile, metafile)) != SR_OK)
+		return ret;
+
+	for (n = 0; n < num_parts; n++) {
+		units = MIN(part_units, num_units - n * part_units);
+		if (!(logicsrc = zip_source_file(zipfile, parts[n], 0,
+						 units * unitsize))) {
+			ret = SR_ERR;
+			goto err;
+		}
+		chunk_name(rawname, sizeof(rawname), "logic-1", n + 1);
+		if ((idx = zip_add(zipfile, rawname, logicsrc)) == -1) {
+			sr_err("%s: failed to add '%s': %s", __func__,
+			       rawname, zip_strerror(zipfile));
+			zip_source_free(logicsrc);
+			ret = SR_ERR;
+			goto err;
+		}
+		if ((ret = entry_compression_set(zipfile, idx,
+				compression.codec, compression.level)) != SR_OK)
+			goto err;
+	}
+
+	if ((ret = index_write(zipfile, "logic-1", num_units,
+			       part_units)) != SR_OK)
+		goto err;
+
+	if (zip_close(zipfile) == -1) {
+		sr_err("%s: failed to write '%s': %s", __func__, filename,
+		       zip_strerror(zipfile));
+		ret = SR_ERR;
+		goto err;
+	}
+	unlink(metafile);
+
+	return SR_OK;
+
+err:
+	archive_discard(zipfile);
+	unlink(metafile);
+
+	return ret;
+}
+
+/* Name of the part file holding the n-th (1-based) chunk of a writer. */
+static char *writer_part_name(const struct sr_session_writer *writer,
+			      uint64_t n)
+{
+	return g_strdup_printf("%s.part%" PRIu64, writer->filename, n);
+}
+
+/*
+ * Whether the pending data of a session writer repeats an earlier chunk
+ * of its file. Returns that chunk's index, or -1.
+ */
+static int64_t writer_twin(struct sr_session_writer *writer, uint64_t hash)
+{
+	uint64_t twin;
+	gsize size;
+	gchar *buf;
+	char *part;
+	int same;
+
+	twin = GPOINTER_TO_SIZE(g_hash_table_lookup(writer->hashes,
+					GSIZE_TO_POINTER((gsize)hash)));
+	if (!twin)
+		return -1;
+	twin--;
+	if (writer->chunks[twin].hash != hash ||
+	    writer->chunks[twin].num_units != writer->fill / writer->unitsize)
+		return -1;
+
+	/* Hashes can collide, so check the stored chunk itself. */
+	if (!(part = writer_part_name(writer, twin + 1)))
+		return -1;
+	same = g_file_get_contents(part, &buf, &size, NULL);
+	g_free(part);
+	if (!same)
+		return -1;
+	same = size == writer->fill && !memcmp(buf, writer->buf, size);
+	g_free(buf);
+
+	return same ? (int64_t)twin : -1;
+}
+
+/* Write the pending data of a session writer to the part file 'part'. */
+static int writer_part_write(struct sr_session_writer *writer,
+			     const char *part)
+{
+	FILE *f;
+	int ret;
+
+	if (!(f = g_fopen(part, "wb"))) {
+		sr_err("%s: failed to create '%s': %s", __func__, part,
+		       g_strerror(errno));
+		return SR_ERR;
+	}
+
+	ret = SR_OK;
+	if (fwrite(writer->buf, 1, writer->fill, f) != writer->fill) {
+		sr_err("%s: failed to write '%s': %s", __func__, part,
+		       g_strerror(errno));
+		ret = SR_ERR;
+	}
+	if (fclose(f) != 0 && ret == SR_OK) {
+		sr_err("%s: failed to write '%s': %s", __func__, part,
+		       g_strerror(errno));
+		ret = SR_ERR;
+	}
+	if (ret != SR_OK)
+		g_unlink(part);
+
+	return ret;
+}
+
+/*
+ * Write the pending data of a session writer to a part file as the next
+ * chunk, or only list it if an earlier chunk holds the same data. The
+ * parts go into the archive in one go when the writer is closed.
+ */
+static int writer_flush(struct sr_session_writer *writer)
+{
+	struct sr_session_chunk *chunks, *chunk;
+	uint64_t hash;
+	int64_t twin;
+	char *part;
+	int ret;
+
+	if (writer->fill == 0)
+		return SR_OK;
+
+	if (!(chunks = g_try_realloc(writer->chunks,
+			sizeof(*chunks) * (writer->num_chunks + 1)))) {
+		sr_err("%s: chunks malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	writer->chunks = chunks;
+	hash = chunk_hash(writer->buf, writer->fill);
+	chunk = &chunks[writer->num_chunks];
+	chunk->first_unit = writer->num_units;
+	chunk->num_units = writer->fill / writer->unitsize;
+	chunk->hash = hash;
+	chunk->hashed = TRUE;
+
+	if ((twin = writer_twin(writer, hash)) >= 0) {
+		/* Stored once already. */
+		strcpy(chunk->name, chunks[twin].name);
+	} else {
+		chunk_name(chunk->name, sizeof(chunk->name), "logic-1",
+			   writer->num_chunks + 1);
+		if (!(part = writer_part_name(writer, writer->num_chunks + 1)))
+			return SR_ERR_MALLOC;
+		ret = writer_part_write(writer, part);
+		g_free(part);
+		if (ret != SR_OK)
+			return ret;
+	}
+
+	if (twin < 0 && !g_hash_table_lookup(writer->hashes,
+					GSIZE_TO_POINTER((gsize)hash)))
+		g_hash_table_insert(writer->hashes,
+				    GSIZE_TO_POINTER((gsize)hash),
+				    GSIZE_TO_POINTER(writer->num_chunks + 1));
+	writer->num_chunks++;
+	writer->num_units += chunk->num_units;
+	writer->fill = 0;
+
+	return SR_OK;
+}
+
+/* Whether chunk n (0-based) of a session writer has a part file. */
+static gboolean writer_chunk_stored(const struct sr_session_writer *writer,
+				    uint64_t n)
+{
+	char name[32];
+
+	chunk_name(name, sizeof(name), "logic-1", n + 1);
+
+	return !strcmp(writer->chunks[n].name, name);
+}
+
+/*
+ * Add the part files of a session writer to its archive, along with the
+ * index, with a single rewrite of the archive.
+ */
+static int writer_merge(struct sr_session_writer *writer)
+{
+	struct zip *zipfile;
+	struct zip_source *logicsrc;
+	uint64_t n;
+	int64_t idx;
+	char *part;
+	int ret;
+
+	if (!(zipfile = zip_open(writer->filename, 0, &ret))) {
+		sr_err("%s: failed to open '%s': zip error %d", __func__,
+		       writer->filename, ret);
+		return SR_ERR;
+	}
+
+	for (n = 0; n < writer->num_chunks; n++) {
+		if (!writer_chunk_stored(writer, n))
+			continue;
+		if (!(part = writer_part_name(writer, n + 1))) {
+			ret = SR_ERR_MALLOC;
+			goto err;
+		}
+		logicsrc = zip_source_file(zipfile, part, 0, -1);
+		g_free(part);
+		if (!logicsrc) {
+			ret = SR_ERR;
+			goto err;
+		}
+		if ((idx = zip_add(zipfile, writer->chunks[n].name,
+				   logicsrc)) == -1) {
+			sr_err("%s: failed to add '%s': %s", __func__,
+			       writer->chunks[n].name, zip_strerror(zipfile));
+			zip_source_free(logicsrc);
+			ret = SR_ERR;
+			goto err;
+		}
+		if ((ret = entry_compression_set(zipfile, idx, writer->codec,
+						 writer->level)) != SR_OK)
+			goto err;
+	}
+
+	if ((ret = index_write_chunks(zipfile, "logic-1", writer->chunks,
+				      writer->num_chunks)) != SR_OK)
+		goto err;
+
+	if (zip_close(zipfile) == -1) {
+		sr_err("%s: failed to write '%s': %s", __func__,
+		       writer->filename, zip_strerror(zipfile));
+		ret = SR_ERR;
+		goto err;
+	}
+
+	return SR_OK;
+
+err:
+	archive_discard(zipfile);
+
+	return ret;
+}
+
+/* Delete the part files of a session writer. */
+static void writer_parts_remove(const struct sr_session_writer *writer)
+{
+	uint64_t n;
+	char *part;
+
+	for (n = 0; n < writer->num_chunks; n++) {
+		if (!writer_chunk_stored(writer, n))
+			continue;
+		if ((part = writer_part_name(writer, n + 1))) {
+			g_unlink(part);
+			g_free(part);
+		}
+	}
+}
+
+/**
+ * Start writing a session file incrementally.
+ *
+ * Unlike sr_session_save(), which writes a whole datastore at once, a
+ * session writer takes the logic data packet by packet, as it arrives
+ * (see sr_session_writer_append()). Whenever SESSION_FILE_CHUNKSIZE
+ * units are pending, they are written to a part file next to the session
+ * file ("<filename>.part1", "<filename>.part2", ...) as the next capture
+ * file chunk. Memory usage is bounded by one chunk, and if the program dies
+ * mid-capture, the part files hold everything up to the last complete chunk.
+ * A chunk that repeats an earlier one (e.g. of an idle bus) is only added
+ * to the index.
+ *
+ * sr_session_writer_close() adds the parts to the archive as "logic-1-1",
+ * "logic-1-2", ... and deletes them, so libzip writes the archive only once.
+ *
+ * @param filename The name of the file to write. Must not be NULL. An
+ *                 existing file of that name is replaced.
+ * @param sdi The device instance from which the data is captured. Must not
+ *            be NULL.
+ * @param unitsize The unit size (>= 1) of the logic data to be written.
+ * @param writer Pointer to a variable which will hold the newly created
+ *               writer. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR upon
+ *         other errors.
+ */
+SR_API int sr_session_writer_new(const char *filename,
+		const struct sr_dev_inst *sdi, int unitsize,
+		struct sr_session_writer **writer)
+{
+	struct zip *zipfile;
+	char metafile[32];
+	int ret;
+
+	if (!filename || !sdi || !writer) {
+		sr_err("%s: filename, sdi or writer was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (unitsize < 1) {
+		sr_err("%s: unitsize was %d, but it must be >= 1", __func__,
+		       unitsize);
+		return SR_ERR_ARG;
+	}
+
+	if (!(*writer = g_try_malloc0(sizeof(struct sr_session_writer)))) {
+		sr_err("%s: writer malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	(*writer)->unitsize = unitsize;
+	(*writer)->codec = compression.codec;
+	(*writer)->level = compression.level;
+	(*writer)->buf_size = (uint64_t)SESSION_FILE_CHUNKSIZE * unitsize;
+	(*writer)->filename = g_strdup(filename);
+	(*writer)->buf = g_try_malloc((*writer)->buf_size);
+	(*writer)->hashes = g_hash_table_new(g_direct_hash, g_direct_equal);
+	if (!(*writer)->filename || !(*writer)->buf) {
+		sr_err("%s: writer buffer malloc failed", __func__);
+		ret = SR_ERR_MALLOC;
+		goto err;
+	}
+
+	if ((ret = archive_new(filename, sdi, unitsize, 0, NULL,
+			       (*writer)->codec, &zipfile, metafile)) != SR_OK)
+		goto err;
+	if (zip_close(zipfile) == -1) {
+		sr_err("%s: failed to write '%s': %s", __func__, filename,
+		       zip_strerror(zipfile));
+		archive_discard(zipfile);
+		unlink(metafile);
+		ret = SR_ERR;
+		goto err;
+	}
+	unlink(metafile);
+
+	return SR_OK;
+
+err:
+	g_hash_table_destroy((*writer)->hashes);
+	g_free((*writer)->buf);
+	g_free((*writer)->filename);
+	g_free(*writer);
+
+	return ret;
+}
+
+/* Expand the runs of an SR_DF_LOGIC_RLE packet right into the chunk. */
+static int writer_append_rle(struct sr_session_writer *writer,
+			     const struct sr_datafeed_logic_rle *rle)
+{
+	uint64_t run, offset, length;
+	int ret;
+
+	if (rle->unitsize != writer->unitsize) {
+		sr_err("%s: unitsize %d doesn't match the writer's (%d)",
+		       __func__, rle->unitsize, writer->unitsize);
+		return SR_ERR_ARG;
+	}
+
+	run = offset = 0;
+	while (run < rle->num_runs) {
+		if ((ret = sr_logic_rle_expand(rle, &run, &offset,
+				writer->buf + writer->fill,
+				writer->buf_size - writer->fill,
+				&length)) != SR_OK)
+			return ret;
+		writer->fill += length;
+		if (writer->fill == writer->buf_size &&
+		    (ret = writer_flush(writer)) != SR_OK)
+			return ret;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Append a datafeed packet to a session file being written.
+ *
+ * Only SR_DF_LOGIC and SR_DF_LOGIC_RLE packets carry data to be written
+ * (the latter are expanded), all other packet types are ignored. This can
+ * be called directly from a datafeed callback.
+ *
+ * @param writer The session writer. Must not be NULL.
+ * @param packet The packet. Must not be NULL. Logic packets must have the
+ *               unit size the writer was created with.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if a chunk couldn't be written to the file.
+ */
+SR_API int sr_session_writer_append(struct sr_session_writer *writer,
+		const struct sr_datafeed_packet *packet)
+{
+	const struct sr_datafeed_logic *logic;
+	uint64_t done, size;
+	int ret;
+
+	if (!writer || !packet) {
+		sr_err("%s: writer or packet was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (packet->type == SR_DF_LOGIC_RLE)
+		return writer_append_rle(writer, packet->payload);
+
+	if (packet->type != SR_DF_LOGIC)
+		return SR_OK;
+
+	logic = packet->payload;
+	if (logic->unitsize != writer->unitsize) {
+		sr_err("%s: unitsize %d doesn't match the writer's (%d)",
+		       __func__, logic->unitsize, writer->unitsize);
+		return SR_ERR_ARG;
+	}
+
+	for (done = 0; done < logic->length; done += size) {
+		size = MIN(logic->length - done,
+			   writer->buf_size - writer->fill);
+		memcpy(writer->buf + writer->fill,
+		       (const uint8_t *)logic->data + done, size);
+		writer->fill += size;
+		if (writer->fill == writer->buf_size &&
+		    (ret = writer_flush(writer)) != SR_OK)
+			return ret;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Finish writing a session file.
+ *
+ * Any pending data is written as the last chunk, all chunks are added to
+ * the archive, and the writer is freed (even if that fails). The part files
+ * are deleted once they're in the archive, and kept if that fails.
+ *
+ * @param writer The session writer. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if the last chunk couldn't be written to the file.
+ */
+SR_API int sr_session_writer_close(struct sr_session_writer *writer)
+{
+	int ret;
+
+	if (!writer) {
+		sr_err("%s: writer was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if ((ret = writer_flush(writer)) == SR_OK &&
+	    (ret = writer_merge(writer)) == SR_OK)
+		writer_parts_remove(writer);
+	else if (writer->num_chunks > 0)
+		sr_err("Failed to write '%s', the raw data is left in "
+		       "'%s.part*'.", writer->filename, writer->filename);
+
+	g_hash_table_destroy(writer->hashes);
+	g_free(writer->chunks);
+	g_free(writer->buf);
+	g_free(writer->filename);
+	g_free(writer);
+
+	return ret;
+}
+
+/* One of the session files being compared. */
+struct compare_file {
+	struct zip *archive;
+	struct sr_session_chunk *chunks;
+	unsigned int num_chunks;
+	int unitsize;
+	int unitbits;
+	uint64_t num_units;
+	/* The units of chunk 'cur', one byte each if packed, or NULL. */
+	uint8_t *units;
+	unsigned int cur;
+};
+
+/* Open a session file and find the chunks of its first capture file. */
+static int compare_open(const char *filename, struct compare_file *cf)
+{
+	GKeyFile *kf;
+	uint64_t size;
+	unsigned int i;
+	int ret;
+	char **sections, *metafile, *capturefile;
+
+	if (!(cf->archive = zip_open(filename, 0, &ret))) {
+		sr_err("Failed to open session file '%s': zip error %d",
+		       filename, ret);
+		return SR_ERR;
+	}
+	if ((ret = entry_read(cf->archive, "metadata", &metafile,
+			      &size)) != SR_OK) {
+		sr_err("'%s' is not a valid sigrok session file.", filename);
+		return SR_ERR;
+	}
+
+	kf = g_key_file_new();
+	capturefile = NULL;
+	if (g_key_file_load_from_data(kf, metafile, size, 0, NULL)) {
+		sections = g_key_file_get_groups(kf, NULL);
+		for (i = 0; sections[i] && !capturefile; i++) {
+			if (strncmp(sections[i], "device ", 7))
+				continue;
+			if (!(capturefile = g_key_file_get_string(kf,
+					sections[i], "capturefile", NULL)))
+				continue;
+			cf->unitsize = g_key_file_get_integer(kf, sections[i],
+					"unitsize", NULL);
+			cf->unitbits = g_key_file_get_integer(kf, sections[i],
+					"unitbits", NULL);
+		}
+		g_strfreev(sections);
+	}
+	g_key_file_free(kf);
+	g_free(metafile);
+
+	if (!capturefile) {
+		sr_err("'%s' has no logic capture file.", filename);
+		return SR_ERR;
+	}
+	ret = sr_session_file_chunks_probe(cf->archive, capturefile,
+			cf->unitsize, cf->unitbits, &cf->chunks,
+			&cf->num_chunks);
+	g_free(capturefile);
+	if (ret != SR_OK)
+		return ret;
+
+	for (i = 0; i < cf->num_chunks; i++)
+		cf->num_units = MAX(cf->num_units, cf->chunks[i].first_unit +
+				    cf->chunks[i].num_units);
+
+	return SR_OK;
+}
+
+/* Read the units of the current chunk, unpacking packed ones. */
+static int compare_units_read(struct compare_file *cf)
+{
+	const struct sr_session_chunk *chunk;
+	uint64_t size, need;
+	char *buf;
+	int ret;
+
+	chunk = &cf->chunks[cf->cur];
+	if ((ret = entry_read(cf->archive, chunk->name, &buf,
+			      &size)) != SR_OK)
+		return ret == SR_ERR_ARG ? SR_ERR : ret;
+
+	need = cf->unitbits ? (chunk->num_units * cf->unitbits + 7) / 8
+			    : chunk->num_units * cf->unitsize;
+	if (size < need) {
+		sr_err("Chunk '%s' is truncated.", chunk->name);
+		g_free(buf);
+		return SR_ERR;
+	}
+
+	if (!cf->unitbits) {
+		cf->units = (uint8_t *)buf;
+		return SR_OK;
+	}
+
+	if (!(cf->units = g_try_malloc(MAX(chunk->num_units, 1)))) {
+		sr_err("%s: units malloc failed", __func__);
+		g_free(buf);
+		return SR_ERR_MALLOC;
+	}
+	sr_logic_unpack((const uint8_t *)buf, 0, chunk->num_units,
+			cf->unitbits, cf->units);
+	g_free(buf);
+
+	return SR_OK;
+}
+
+/* Move on to the chunk holding unit 'pos', if there is one. */
+static void compare_seek(struct compare_file *cf, uint64_t pos)
+{
+	while (cf->cur < cf->num_chunks &&
+	       cf->chunks[cf->cur].first_unit +
+	       cf->chunks[cf->cur].num_units <= pos) {
+		g_free(cf->units);
+		cf->units = NULL;
+		cf->cur++;
+	}
+}
+
+static void compare_close(struct compare_file *cf)
+{
+	g_free(cf->units);
+	g_free(cf->chunks);
+	if (cf->archive)
+		zip_close(cf->archive);
+}
+
+/**
+ * Compare the logic data of two session files.
+ *
+ * The first logic capture file of each session file is compared, unit by
+ * unit. Chunks whose index entries carry a hash (see
+ * sr_session_file_chunks_load()) are compared by that hash where they line
+ * up with a chunk of the other file, and only inflated if the hashes
+ * differ. Two captures written with the same chunk size, as by
+ * sr_session_save() or a session writer, are thus compared without reading
+ * any of their common chunks.
+ *
+ * @param filename1 The name of the first session file. Must not be NULL.
+ * @param filename2 The name of the second session file. Must not be NULL.
+ * @param equal Will be set to TRUE if both files hold the same samples.
+ *              Must not be NULL.
+ * @param first_diff Will be set to the index of the first unit in which the
+ *                   files differ (or at which the shorter one ends), if
+ *                   they are not equal. Can be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR if a
+ *         file couldn't be read.
+ */
+SR_API int sr_session_file_compare(const char *filename1,
+		const char *filename2, gboolean *equal, uint64_t *first_diff)
+{
+	struct compare_file cf[2];
+	const struct sr_session_chunk *c0, *c1;
+	const uint8_t *u0, *u1;
+	uint64_t pos, end, len, width, diff;
+	unsigned int skipped, inflated, i;
+	int ret;
+
+	if (!filename1 || !filename2 || !equal) {
+		sr_err("%s: filename1, filename2 or equal was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	memset(cf, 0, sizeof(cf));
+	diff = 0;
+	if ((ret = compare_open(filename1, &cf[0])) != SR_OK ||
+	    (ret = compare_open(filename2, &cf[1])) != SR_OK)
+		goto done;
+
+	*equal = TRUE;
+	if (cf[0].unitsize != cf[1].unitsize ||
+	    cf[0].unitbits != cf[1].unitbits) {
+		sr_dbg("The capture files' unit sizes differ.");
+		*equal = FALSE;
+		goto done;
+	}
+	width = cf[0].unitbits ? 1 : cf[0].unitsize;
+
+	skipped = inflated = 0;
+	len = MIN(cf[0].num_units, cf[1].num_units);
+	for (pos = 0; pos < len && *equal; pos = end) {
+		compare_seek(&cf[0], pos);
+		compare_seek(&cf[1], pos);
+		if (cf[0].cur == cf[0].num_chunks ||
+		    cf[1].cur == cf[1].num_chunks)
+			break;
+		c0 = &cf[0].chunks[cf[0].cur];
+		c1 = &cf[1].chunks[cf[1].cur];
+		if (c0->first_unit > pos || c1->first_unit > pos) {
+			sr_err("The capture files' indexes have gaps.");
+			ret = SR_ERR;
+			break;
+		}
+		end = MIN(c0->first_unit + c0->num_units,
+			  c1->first_unit + c1->num_units);
+
+		if (c0->first_unit == c1->first_unit &&
+		    c0->num_units == c1->num_units &&
+		    c0->hashed && c1->hashed && c0->hash == c1->hash) {
+			skipped++;
+			continue;
+		}
+
+		for (i = 0; i < 2; i++) {
+			if (cf[i].units)
+				continue;
+			if ((ret = compare_units_read(&cf[i])) != SR_OK)
+				goto done;
+			inflated++;
+		}
+		u0 = cf[0].units + (pos - c0->first_unit) * width;
+		u1 = cf[1].units + (pos - c1->first_unit) * width;
+		if (!memcmp(u0, u1, (end - pos) * width))
+			continue;
+
+		/* Find the unit that differs. */
+		while (!memcmp(u0, u1, width)) {
+			u0 += width;
+			u1 += width;
+			pos++;
+		}
+		*equal = FALSE;
+		diff = pos;
+	}
+
+	if (ret == SR_OK && *equal && cf[0].num_units != cf[1].num_units) {
+		*equal = FALSE;
+		diff = len;
+	}
+	if (ret == SR_OK)
+		sr_dbg("Compared %u chunks by hash, inflated %u.", skipped,
+		       inflated);
+
+done:
+	if (ret == SR_OK && first_diff && !*equal)
+		*first_diff = diff;
+	compare_close(&cf[0]);
+	compare_close(&cf[1]);
+
+	return ret;
+}
+
 /** @} */
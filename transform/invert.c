@@ -0,0 +1,191 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "transform/invert: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/*
+ * Inverts logic probes, e.g. those of an active-low bus. The "mask"
+ * parameter selects the bits of the samples to invert (bit n is the n-th
+ * bit of a sample as delivered, i.e. after probe filtering); by default,
+ * all of them are.
+ */
+
+struct context {
+	uint64_t mask;
+	/* The inverted samples, reused once nobody holds them. */
+	struct sr_buffer *buf;
+	struct sr_datafeed_packet packet;
+	union {
+		struct sr_datafeed_logic logic;
+		struct sr_datafeed_logic_rle rle;
+	} payload;
+};
+
+static int init(struct sr_transform *t)
+{
+	struct context *ctx;
+	const char *param;
+	char *end;
+
+	if (!t) {
+		sr_err("%s: t was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(ctx = g_try_malloc0(sizeof(struct context)))) {
+		sr_err("%s: ctx malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	ctx->mask = UINT64_MAX;
+
+	if (t->param && (param = g_hash_table_lookup(t->param, "mask"))) {
+		ctx->mask = strtoull(param, &end, 0);
+		if (*param == '\0' || *end != '\0') {
+			sr_err("Invalid mask '%s'.", param);
+			g_free(ctx);
+			return SR_ERR_ARG;
+		}
+	}
+	t->internal = ctx;
+
+	return SR_OK;
+}
+
+/* Reuse the buffer, unless it's too small or still held. */
+static gboolean buf_get(struct context *ctx, uint64_t size)
+{
+	if (ctx->buf && (ctx->buf->size < size ||
+			 g_atomic_int_get(&ctx->buf->refcount) > 1)) {
+		sr_buffer_release(ctx->buf);
+		ctx->buf = NULL;
+	}
+	if (!ctx->buf && !(ctx->buf = sr_buffer_new(MAX(size, 1))))
+		return FALSE;
+
+	return TRUE;
+}
+
+/* XOR 'mask' into every sample, eight bytes at a time where possible. */
+static void invert_logic(const struct sr_datafeed_logic *logic,
+			 uint64_t mask, uint8_t *out)
+{
+	const uint8_t *data;
+	uint8_t pattern[8];
+	uint64_t i, n, w, wmask;
+
+	data = logic->data;
+	if (8 % logic->unitsize == 0) {
+		for (i = 0; i < 8; i++)
+			pattern[i] = mask >> (8 * (i % logic->unitsize));
+		memcpy(&wmask, pattern, 8);
+		n = logic->length / 8;
+		for (i = 0; i < n; i++) {
+			memcpy(&w, data + i * 8, 8);
+			w ^= wmask;
+			memcpy(out + i * 8, &w, 8);
+		}
+		for (i = n * 8; i < logic->length; i++)
+			out[i] = data[i] ^ pattern[i % 8];
+		return;
+	}
+
+	for (i = 0; i < logic->length; i++)
+		out[i] = data[i] ^ (mask >> (8 * (i % logic->unitsize)));
+}
+
+static int receive(struct sr_transform *t, const struct sr_dev_inst *sdi,
+		   struct sr_datafeed_packet *packet_in,
+		   struct sr_datafeed_packet **packet_out)
+{
+	struct context *ctx;
+	const struct sr_datafeed_logic *logic;
+	const struct sr_datafeed_logic_rle *rle;
+	struct sr_logic_run *runs;
+	uint64_t i, mask;
+
+	(void)sdi;
+
+	ctx = t->internal;
+	*packet_out = packet_in;
+
+	if (packet_in->type == SR_DF_LOGIC) {
+		logic = packet_in->payload;
+		if (logic->unitsize == 0)
+			return SR_OK;
+		if (!buf_get(ctx, logic->length))
+			return SR_ERR_MALLOC;
+		invert_logic(logic, ctx->mask, ctx->buf->data);
+		ctx->payload.logic = *logic;
+		ctx->payload.logic.data = ctx->buf->data;
+		ctx->payload.logic.buffer = ctx->buf;
+	} else if (packet_in->type == SR_DF_LOGIC_RLE) {
+		rle = packet_in->payload;
+		if (!buf_get(ctx, rle->num_runs * sizeof(struct sr_logic_run)))
+			return SR_ERR_MALLOC;
+		mask = ctx->mask;
+		if (rle->unitsize < 8)
+			mask &= (UINT64_C(1) << (8 * rle->unitsize)) - 1;
+		runs = ctx->buf->data;
+		for (i = 0; i < rle->num_runs; i++) {
+			runs[i].value = rle->runs[i].value ^ mask;
+			runs[i].length = rle->runs[i].length;
+		}
+		ctx->payload.rle = *rle;
+		ctx->payload.rle.runs = runs;
+		ctx->payload.rle.buffer = ctx->buf;
+	} else {
+		return SR_OK;
+	}
+
+	ctx->packet.type = packet_in->type;
+	ctx->packet.payload = &ctx->payload;
+	*packet_out = &ctx->packet;
+
+	return SR_OK;
+}
+
+static int cleanup(struct sr_transform *t)
+{
+	struct context *ctx;
+
+	if (!t)
+		return SR_ERR_ARG;
+
+	ctx = t->internal;
+	if (ctx && ctx->buf)
+		sr_buffer_release(ctx->buf);
+	g_free(ctx);
+	t->internal = NULL;
+
+	return SR_OK;
+}
+
+SR_PRIV struct sr_transform_format transform_invert = {
+	.id = "invert",
+	.description = "Invert logic probes",
+	.init = init,
+	.receive = receive,
+	.cleanup = cleanup,
+};
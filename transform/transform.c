@@ -0,0 +1,58 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/**
+ * @file
+ *
+ * Transform modules, processing packets on their way to the frontend.
+ */
+
+/**
+ * @defgroup grp_transform Transform modules
+ *
+ * Transform modules, processing packets on their way to the frontend.
+ *
+ * A transform sits in the session's chain between the drivers and the
+ * datafeed callbacks (see sr_session_transform_add()). For each packet,
+ * its receive() callback can change the packet in place, replace it with
+ * another one, or drop it, and it can send additional packets on with
+ * sr_transform_send(). Like outputs, a transform is a struct
+ * sr_transform instance of one of the formats in sr_transform_list(),
+ * with its parameters in 'param'.
+ *
+ * @{
+ */
+
+/** @cond PRIVATE */
+extern SR_PRIV struct sr_transform_format transform_invert;
+/* @endcond */
+
+static struct sr_transform_format *transform_module_list[] = {
+	&transform_invert,
+	NULL,
+};
+
+SR_API struct sr_transform_format **sr_transform_list(void)
+{
+	return transform_module_list;
+}
+
+/** @} */
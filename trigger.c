@@ -0,0 +1,624 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Message logging helpers with driver-specific prefix string. */
+#define DRIVER_LOG_DOMAIN "trigger: "
+#define sr_log(l, s, args...) sr_log(l, DRIVER_LOG_DOMAIN s, ## args)
+
+/**
+ * @file
+ *
+ * Software triggers on logic samples.
+ */
+
+/**
+ * @defgroup grp_trigger Software triggers
+ *
+ * Software triggers on logic samples.
+ *
+ * The probe triggers of a device (see sr_dev_trigger_set()) are compiled
+ * once into a struct sr_trigger, which holds a mask, a value and an edge
+ * mask for each trigger stage. Each character of a probe's trigger is
+ * one stage: '0' and '1' match a level, 'r' and 'f' a rising or falling
+ * edge, and 'c' any change.
+ *
+ * Drivers which stream raw samples and have no hardware trigger pass
+ * their data through sr_trigger_send(), which holds back the pre-trigger
+ * window and sends SR_DF_TRIGGER where the trigger fired. Drivers with a
+ * hardware trigger can program it from the compiled stages. Frontends
+ * can run sr_trigger_find() over recorded data, e.g. the packets from a
+ * session file, to locate the trigger in it.
+ *
+ * @{
+ */
+
+/* Sample 'i' of a buffer, with probe n in bit n. */
+static inline uint64_t sample_get(const uint8_t *buf, uint16_t unitsize,
+				  uint64_t i)
+{
+	const uint8_t *p;
+	uint64_t sample;
+	int b;
+
+	p = buf + i * unitsize;
+	switch (unitsize) {
+	case 1:
+		return p[0];
+	case 2:
+		return p[0] | (uint64_t)p[1] << 8;
+	default:
+		sample = 0;
+		for (b = 0; b < unitsize; b++)
+			sample |= (uint64_t)p[b] << (8 * b);
+		return sample;
+	}
+}
+
+static void sample_put(uint8_t *p, uint16_t unitsize, uint64_t sample)
+{
+	int b;
+
+	for (b = 0; b < unitsize; b++)
+		p[b] = sample >> (8 * b);
+}
+
+/* Bit n of the result is set if the sample matches stage n. */
+static inline unsigned int stages_match(const struct sr_trigger *trigger,
+					uint64_t sample, uint64_t prev,
+					gboolean have_prev)
+{
+	unsigned int bits;
+	int i;
+
+	bits = 0;
+	for (i = 0; i < trigger->num_stages; i++) {
+		if ((sample ^ trigger->value[i]) & trigger->mask[i])
+			continue;
+		if (trigger->edge[i] && (!have_prev ||
+		    ((sample ^ prev) & trigger->edge[i]) != trigger->edge[i]))
+			continue;
+		bits |= 1 << i;
+	}
+
+	return bits;
+}
+
+/*
+ * Find the first sample at or after 'i' which may match the first stage.
+ * Samples are tested a 64-bit word at a time, lanes of 'unitsize' bytes:
+ * for a level stage, lanes where (sample ^ value) & mask is zero are
+ * candidates; for a pure change stage, lanes which differ from the lane
+ * before. The lowest lane flagged is always a candidate, and the caller
+ * checks it in full.
+ */
+static uint64_t stage0_scan(const struct sr_trigger *trigger,
+			    const uint8_t *buf, uint16_t unitsize,
+			    uint64_t i, uint64_t count)
+{
+	const uint64_t mask = trigger->mask[0];
+	const uint64_t value = trigger->value[0];
+	const uint64_t edge = trigger->edge[0];
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+	const int bits = 8 * unitsize;
+	uint64_t ones, m, v, e, w, wp, x, t;
+	uint64_t lanes;
+
+	if (unitsize == 1 || unitsize == 2 || unitsize == 4) {
+		lanes = 8 / unitsize;
+		ones = UINT64_MAX / ((UINT64_C(1) << bits) - 1);
+		m = ones * (mask & ((UINT64_C(1) << bits) - 1));
+		v = ones * (value & ((UINT64_C(1) << bits) - 1));
+		e = ones * (edge & ((UINT64_C(1) << bits) - 1));
+
+		if (mask) {
+			while (i + lanes <= count) {
+				memcpy(&w, buf + i * unitsize, sizeof(w));
+				x = (w ^ v) & m;
+				t = (x - ones) & ~x & (ones << (bits - 1));
+				if (t)
+					return i + __builtin_ctzll(t) / bits;
+				i += lanes;
+			}
+		} else if (edge) {
+			/* Sample 0 has no earlier lane in the buffer. */
+			if (i == 0)
+				return 0;
+			while (i + lanes <= count) {
+				memcpy(&w, buf + i * unitsize, sizeof(w));
+				memcpy(&wp, buf + (i - 1) * unitsize,
+				       sizeof(wp));
+				if ((x = (w ^ wp) & e))
+					return i + __builtin_ctzll(x) / bits;
+				i += lanes;
+			}
+		}
+	}
+#endif
+
+	if (!mask && !edge)
+		return i;
+
+	for (; i < count; i++) {
+		if (mask && !((sample_get(buf, unitsize, i) ^ value) & mask))
+			break;
+		if (!mask && (i == 0 || ((sample_get(buf, unitsize, i) ^
+		    sample_get(buf, unitsize, i - 1)) & edge)))
+			break;
+	}
+
+	return i;
+}
+
+/**
+ * Compile the probe triggers of a device into a software trigger.
+ *
+ * Only enabled probes are taken into account. A device without probe
+ * triggers yields a trigger without stages, which fires on the first
+ * sample.
+ *
+ * @param sdi The device instance. Must not be NULL.
+ * @param pretrigger_samples The number of samples before the trigger
+ *        which sr_trigger_send() passes on, or SR_TRIGGER_PRETRIGGER_ALL
+ *        to pass on all of them.
+ * @param trigger Where to store the new trigger, to be freed with
+ *        sr_trigger_destroy(). Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments or
+ *         unsupported probe triggers, SR_ERR_MALLOC upon memory
+ *         allocation errors.
+ */
+SR_API int sr_trigger_new(const struct sr_dev_inst *sdi,
+		uint64_t pretrigger_samples, struct sr_trigger **trigger)
+{
+	struct sr_trigger *t;
+	const struct sr_probe *probe;
+	const GSList *l;
+	const char *tc;
+	uint64_t bit;
+	int stage;
+
+	if (!sdi || !trigger) {
+		sr_err("%s: sdi and trigger may not be NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(t = g_try_malloc0(sizeof(struct sr_trigger)))) {
+		sr_err("%s: trigger malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	t->pretrigger_samples = pretrigger_samples;
+
+	for (l = sdi->probes; l; l = l->next) {
+		probe = l->data;
+		if (!probe->enabled || !probe->trigger)
+			continue;
+
+		if (probe->index < 0 || probe->index >= SR_MAX_NUM_PROBES) {
+			sr_err("Probe %d can't be triggered on.",
+			       probe->index);
+			g_free(t);
+			return SR_ERR_ARG;
+		}
+		bit = UINT64_C(1) << probe->index;
+
+		for (tc = probe->trigger, stage = 0; *tc; tc++, stage++) {
+			if (stage == SR_TRIGGER_MAX_STAGES) {
+				sr_err("Probe %s has more than %d trigger "
+				       "stages.", probe->name,
+				       SR_TRIGGER_MAX_STAGES);
+				g_free(t);
+				return SR_ERR_ARG;
+			}
+			switch (*tc) {
+			case '1':
+				t->value[stage] |= bit;
+				/* Fall through. */
+			case '0':
+				t->mask[stage] |= bit;
+				break;
+			case 'r':
+				t->value[stage] |= bit;
+				/* Fall through. */
+			case 'f':
+				t->mask[stage] |= bit;
+				/* Fall through. */
+			case 'c':
+				t->edge[stage] |= bit;
+				break;
+			default:
+				sr_err("Unsupported trigger type '%c' on "
+				       "probe %s.", *tc, probe->name);
+				g_free(t);
+				return SR_ERR_ARG;
+			}
+		}
+		t->num_stages = MAX(t->num_stages, stage);
+	}
+
+	sr_dbg("Compiled %d trigger stages.", t->num_stages);
+	*trigger = t;
+
+	return SR_OK;
+}
+
+/**
+ * Destroy a software trigger.
+ *
+ * @param trigger The trigger. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_trigger_destroy(struct sr_trigger *trigger)
+{
+	if (!trigger) {
+		sr_err("%s: trigger was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	g_free(trigger->ring);
+	g_free(trigger);
+
+	return SR_OK;
+}
+
+/**
+ * Get a software trigger ready for another acquisition.
+ *
+ * The samples held back by sr_trigger_send() are dropped.
+ *
+ * @param trigger The trigger. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_trigger_reset(struct sr_trigger *trigger)
+{
+	if (!trigger) {
+		sr_err("%s: trigger was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	trigger->state = 0;
+	trigger->have_prev = FALSE;
+	trigger->samplecount = 0;
+	trigger->fired = FALSE;
+	trigger->trigger_pos = 0;
+	trigger->ring_start = 0;
+	trigger->ring_fill = 0;
+
+	return SR_OK;
+}
+
+/**
+ * Look for the trigger in a buffer of logic samples.
+ *
+ * The buffers of an acquisition are passed in one after the other; a
+ * match may span several of them. Once the trigger has fired, buffers
+ * are no longer looked at.
+ *
+ * @param trigger The trigger. Must not be NULL.
+ * @param data The samples. Must not be NULL.
+ * @param length The length of 'data', in bytes.
+ * @param unitsize The size of a sample, in bytes (1 to 8).
+ * @param used Where to store the number of samples of 'data' up to and
+ *        including the one completing the match, or all of them if the
+ *        trigger didn't fire. May be NULL.
+ *
+ * @return TRUE if the trigger has fired, FALSE otherwise. Upon TRUE, the
+ *         trigger's 'trigger_pos' is the index of the sample matching the
+ *         first stage, counted over all buffers passed in since
+ *         sr_trigger_new() or sr_trigger_reset(), and 'match' holds the
+ *         'num_stages' samples which matched.
+ */
+SR_API gboolean sr_trigger_find(struct sr_trigger *trigger,
+		const uint8_t *data, uint64_t length, uint16_t unitsize,
+		uint64_t *used)
+{
+	const int n = trigger->num_stages;
+	uint64_t count, i, sample, prev;
+	unsigned int state, done;
+	int64_t p;
+	int j, keep;
+
+	if (used)
+		*used = 0;
+
+	if (trigger->fired)
+		return TRUE;
+
+	if (n == 0) {
+		trigger->fired = TRUE;
+		trigger->trigger_pos = trigger->samplecount;
+		return TRUE;
+	}
+
+	if (unitsize == 0 || unitsize > 8) {
+		sr_err("%s: unsupported unitsize %d", __func__, unitsize);
+		return FALSE;
+	}
+
+	count = length / unitsize;
+	if (count == 0)
+		return FALSE;
+	done = 1 << (n - 1);
+
+	/*
+	 * Shift-and: bit k of 'state' tracks a match of stages 0 to k ending
+	 * at the current sample, so all partial matches advance at once and
+	 * each sample is looked at once. While there is no partial match,
+	 * stage0_scan() skips ahead to the next candidate.
+	 */
+	state = trigger->state;
+	for (i = 0; i < count; i++) {
+		if (!state && (i = stage0_scan(trigger, data, unitsize, i,
+					       count)) == count)
+			break;
+		sample = sample_get(data, unitsize, i);
+		prev = i ? sample_get(data, unitsize, i - 1) : trigger->prev;
+		state = ((state << 1) | 1) & stages_match(trigger, sample,
+				prev, i || trigger->have_prev);
+		if (state & done)
+			break;
+	}
+	trigger->state = state;
+
+	/*
+	 * Keep the samples the match ended with, or the last n - 1 in case
+	 * the next buffer completes one. A sample p < 0 comes from the
+	 * history at p + n - 1, which is never below j, so it hasn't been
+	 * overwritten yet.
+	 */
+	if (state & done) {
+		keep = n;
+	} else {
+		keep = n - 1;
+		i = count - 1;
+	}
+	for (j = 0; j < keep; j++) {
+		p = (int64_t)i - keep + 1 + j;
+		trigger->history[j] = p >= 0 ? sample_get(data, unitsize, p)
+			: trigger->history[p + n - 1];
+	}
+
+	trigger->prev = sample_get(data, unitsize, i);
+	trigger->have_prev = TRUE;
+	trigger->samplecount += i + 1;
+	if (used)
+		*used = i + 1;
+
+	if (!(state & done))
+		return FALSE;
+
+	trigger->fired = TRUE;
+	trigger->trigger_pos = trigger->samplecount - n;
+	for (j = 0; j < n; j++)
+		sample_put(trigger->match + j * unitsize, unitsize,
+			   trigger->history[j]);
+
+	sr_dbg("Trigger fired at sample %" PRIu64 ".", trigger->trigger_pos);
+
+	return TRUE;
+}
+
+static int send_logic(const struct sr_dev_inst *sdi, const uint8_t *data,
+		      uint64_t num_samples, uint16_t unitsize)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+
+	if (num_samples == 0)
+		return SR_OK;
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.length = num_samples * unitsize;
+	logic.unitsize = unitsize;
+	logic.data = (void *)data;
+	logic.buffer = NULL;
+
+	return sr_session_send(sdi, &packet);
+}
+
+/* Send 'num_samples' samples from the front of the ring, or drop them. */
+static int ring_take(struct sr_trigger *trigger, const struct sr_dev_inst *sdi,
+		     uint64_t num_samples, gboolean send)
+{
+	const uint16_t u = trigger->unitsize;
+	uint64_t first;
+	int ret;
+
+	if (num_samples == 0)
+		return SR_OK;
+
+	if (send) {
+		first = MIN(num_samples,
+			    trigger->ring_size - trigger->ring_start);
+		if ((ret = send_logic(sdi, trigger->ring +
+				      trigger->ring_start * u, first,
+				      u)) != SR_OK ||
+		    (ret = send_logic(sdi, trigger->ring,
+				      num_samples - first, u)) != SR_OK)
+			return ret;
+	}
+	trigger->ring_start = (trigger->ring_start + num_samples)
+			      % trigger->ring_size;
+	trigger->ring_fill -= num_samples;
+
+	return SR_OK;
+}
+
+/*
+ * Add samples to the end of the ring. What no longer fits is sent on if
+ * all pre-trigger samples are kept, and dropped otherwise.
+ */
+static int ring_put(struct sr_trigger *trigger, const struct sr_dev_inst *sdi,
+		    const uint8_t *data, uint64_t num_samples)
+{
+	const uint16_t u = trigger->unitsize;
+	const gboolean keep_all =
+		trigger->pretrigger_samples == SR_TRIGGER_PRETRIGGER_ALL;
+	uint64_t over, end, first;
+	int ret;
+
+	if (num_samples >= trigger->ring_size) {
+		if ((ret = ring_take(trigger, sdi, trigger->ring_fill,
+				     keep_all)) != SR_OK)
+			return ret;
+		over = num_samples - trigger->ring_size;
+		if (keep_all && (ret = send_logic(sdi, data, over,
+						  u)) != SR_OK)
+			return ret;
+		memcpy(trigger->ring, data + over * u, trigger->ring_size * u);
+		trigger->ring_start = 0;
+		trigger->ring_fill = trigger->ring_size;
+		return SR_OK;
+	}
+
+	if (trigger->ring_fill + num_samples > trigger->ring_size) {
+		over = trigger->ring_fill + num_samples - trigger->ring_size;
+		if ((ret = ring_take(trigger, sdi, over, keep_all)) != SR_OK)
+			return ret;
+	}
+
+	end = (trigger->ring_start + trigger->ring_fill) % trigger->ring_size;
+	first = MIN(num_samples, trigger->ring_size - end);
+	memcpy(trigger->ring + end * u, data, first * u);
+	memcpy(trigger->ring, data + first * u, (num_samples - first) * u);
+	trigger->ring_fill += num_samples;
+
+	return SR_OK;
+}
+
+/*
+ * The ring holds the pre-trigger window plus the samples matching the
+ * stages. Those are the samples a match may span which haven't been
+ * passed on yet.
+ */
+static int ring_setup(struct sr_trigger *trigger, uint16_t unitsize)
+{
+	uint64_t size;
+
+	if (trigger->ring && trigger->unitsize == unitsize)
+		return SR_OK;
+
+	/* Without stages, the trigger fires before any sample is held. */
+	size = trigger->num_stages;
+	if (size && trigger->pretrigger_samples != SR_TRIGGER_PRETRIGGER_ALL)
+		size += trigger->pretrigger_samples;
+
+	g_free(trigger->ring);
+	trigger->ring_start = trigger->ring_fill = 0;
+	trigger->unitsize = unitsize;
+	trigger->ring_size = size;
+	if (!(trigger->ring = g_try_malloc(MAX(size, 1) * unitsize))) {
+		sr_err("%s: pre-trigger ring malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Send logic samples to the session, starting at the trigger.
+ *
+ * Until the trigger fires, samples are held back. Once it fires, the
+ * last 'pretrigger_samples' of them go out, followed by SR_DF_TRIGGER
+ * and the samples from the one matching the first stage on. After that,
+ * samples are sent on as they come in.
+ *
+ * @param trigger The trigger. Must not be NULL.
+ * @param sdi The device instance the samples are from. Must not be NULL.
+ * @param data The samples. Must not be NULL.
+ * @param length The length of 'data', in bytes.
+ * @param unitsize The size of a sample, in bytes (1 to 8).
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors.
+ *
+ * @private
+ */
+SR_PRIV int sr_trigger_send(struct sr_trigger *trigger,
+		const struct sr_dev_inst *sdi, const uint8_t *data,
+		uint64_t length, uint16_t unitsize)
+{
+	struct sr_datafeed_packet packet;
+	uint64_t count, used, pre;
+	int ret;
+
+	if (unitsize == 0 || unitsize > 8) {
+		sr_err("%s: unsupported unitsize %d", __func__, unitsize);
+		return SR_ERR_ARG;
+	}
+	count = length / unitsize;
+
+	if (trigger->fired)
+		return send_logic(sdi, data, count, unitsize);
+
+	if ((ret = ring_setup(trigger, unitsize)) != SR_OK)
+		return ret;
+	if (!sr_trigger_find(trigger, data, length, unitsize, &used))
+		return ring_put(trigger, sdi, data, count);
+
+	/* The ring ends with the stages' samples now. */
+	if ((ret = ring_put(trigger, sdi, data, used)) != SR_OK)
+		return ret;
+	pre = trigger->ring_fill - MIN(trigger->ring_fill,
+				       (uint64_t)trigger->num_stages);
+	if ((ret = ring_take(trigger, sdi, pre, TRUE)) != SR_OK)
+		return ret;
+
+	packet.type = SR_DF_TRIGGER;
+	packet.payload = NULL;
+	if ((ret = sr_session_send(sdi, &packet)) != SR_OK)
+		return ret;
+
+	if ((ret = ring_take(trigger, sdi, trigger->ring_fill, TRUE)) != SR_OK)
+		return ret;
+
+	return send_logic(sdi, data + used * unitsize, count - used, unitsize);
+}
+
+/**
+ * Send the samples sr_trigger_send() still holds back.
+ *
+ * Only if all pre-trigger samples are kept (SR_TRIGGER_PRETRIGGER_ALL):
+ * up to 'num_stages' - 1 of those are held back until it's clear whether
+ * they start a match. Otherwise samples before a trigger which never
+ * fired are dropped. Drivers call this before sending SR_DF_END.
+ *
+ * @param trigger The trigger. Must not be NULL.
+ * @param sdi The device instance the samples are from. Must not be NULL.
+ *
+ * @return SR_OK upon success, or an error from sr_session_send().
+ *
+ * @private
+ */
+SR_PRIV int sr_trigger_flush(struct sr_trigger *trigger,
+		const struct sr_dev_inst *sdi)
+{
+	const gboolean keep_all =
+		trigger->pretrigger_samples == SR_TRIGGER_PRETRIGGER_ALL;
+
+	return ring_take(trigger, sdi, trigger->ring_fill, keep_all);
+}
+
+/** @} */